@@ -12,6 +12,7 @@ sinclude(m4/find_svn.m4)
 sinclude(m4/ax_python_devel.m4)
 
 AC_ARG_ENABLE([git], [AS_HELP_STRING([--disable-git], [Don't include the git backend])], [git="$enableval"], [git="auto"])
+AC_ARG_ENABLE([libgit2], [AS_HELP_STRING([--enable-libgit2], [Include the git backend using libgit2])], [libgit2="$enableval"], [libgit2="no"])
 AC_ARG_ENABLE([mercurial], [AS_HELP_STRING([--disable-mercurial], [Don't include the mercurial backend])], [mercurial="$enableval"], [mercurial="auto"])
 AC_ARG_ENABLE([svn], [AS_HELP_STRING([--disable-svn], [Don't include the subversion backend])], [subversion="$enableval"], [subversion="auto"])
 
@@ -30,6 +31,34 @@ AC_DEFUN([BACKENDS_CHECK], [
 		fi
 	fi
 
+	if test "x$libgit2" != "xno"; then
+		AC_ARG_WITH([libgit2], [AC_HELP_STRING([--with-libgit2=PATH], [prefix for libgit2 installation])], [libgit2_prefix=$withval])
+		if test "x$libgit2_prefix" != x; then
+			LIBGIT2_CPPFLAGS="-I$libgit2_prefix/include"
+			LIBGIT2_LIBS="-L$libgit2_prefix/lib"
+		fi
+		OLD_CPPFLAGS=$CPPFLAGS
+		OLD_LIBS=$LIBS
+		CPPFLAGS="$CPPFLAGS $LIBGIT2_CPPFLAGS"
+		LIBS="$LIBS $LIBGIT2_LIBS"
+		AC_CHECK_HEADER([git2.h], [header_found="yes"], [header_found="no"])
+		dnl git_error_last() has been introduced with libgit2 0.28
+		AC_CHECK_LIB([git2], [git_error_last], [lib_found="yes"], [lib_found="no"])
+		CPPFLAGS=$OLD_CPPFLAGS
+		LIBS=$OLD_LIBS
+		if test "x$header_found" != "xyes" || test "x$lib_found" != "xyes"; then
+			if test "x$libgit2" = "xyes"; then
+				AC_MSG_ERROR([libgit2 (>= 0.28) headers or libraries not found. Please use the --with-libgit2 option.])
+			fi
+			libgit2="no"
+		else
+			LIBGIT2_LIBS="$LIBGIT2_LIBS -lgit2"
+			AC_SUBST(LIBGIT2_CPPFLAGS)
+			AC_SUBST(LIBGIT2_LIBS)
+			libgit2="yes"
+		fi
+	fi
+
 	if test "x$subversion" != "xno"; then
 		APR_FIND_APR(,,[1],[1])
 		if test "$apr_found" = "no"; then
@@ -52,7 +81,7 @@ AC_DEFUN([BACKENDS_CHECK], [
 		fi
 
 		if test "x$subversion" != "xno"; then
-			FIND_SVN([1],[5])
+			FIND_SVN([1],[6])
 			if test "x$svn_found" != "xyes"; then
 				if test "x$subversion" != "xauto"; then
 					AC_MSG_ERROR([Subversion could not be located. Please use the --with-svn option.])
@@ -113,9 +142,11 @@ AC_DEFUN([BACKENDS_REPORT], [
 	echo
 	echo "    Enabled(+) / disabled(-) SCM backends:"
 	if test "x$git" = "xyes"; then echo "      + Git"; fi
+	if test "x$libgit2" = "xyes"; then echo "      + Git (libgit2)"; fi
 	if test "x$mercurial" = "xyes"; then echo "      + Mercurial"; fi
 	if test "x$subversion" = "xyes"; then echo "      + Subversion"; fi
 	if test "x$git" = "xno"; then echo "      - Git"; fi
+	if test "x$libgit2" = "xno"; then echo "      - Git (libgit2)"; fi
 	if test "x$mercurial" = "xno"; then echo "      - Mercurial"; fi
 	if test "x$subversion" = "xno"; then echo "      - Subversion"; fi
 ])
@@ -10,6 +10,9 @@ dnl
 AC_ARG_ENABLE([gnuplot], [AS_HELP_STRING([--disable-gnuplot], [Disable Gnuplot backend for graphical reports])], [gnuplot="$enableval"], [gnuplot="auto"])
 AC_ARG_ENABLE([man], [AS_HELP_STRING([--disable-man], [Don't generate the man page])], [manpage="$enableval"], [manpage="auto"])
 AC_ARG_ENABLE([leveldb], [AS_HELP_STRING([--enable-leveldb], [Use LevelDB for caching revisions])], [leveldb="$enableval"], [leveldb="no"])
+AC_ARG_ENABLE([lz4], [AS_HELP_STRING([--disable-lz4], [Disable LZ4 compression of cached revisions])], [lz4="$enableval"], [lz4="auto"])
+AC_ARG_ENABLE([zstd], [AS_HELP_STRING([--disable-zstd], [Disable Zstandard compression of cached revisions])], [zstd="$enableval"], [zstd="auto"])
+AC_ARG_ENABLE([luajit], [AS_HELP_STRING([--enable-luajit], [Run reports using LuaJIT instead of Lua 5.1])], [luajit="$enableval"], [luajit="no"])
 
 
 dnl Run checks for manpage programs
@@ -151,6 +154,52 @@ you want to use the builtin version.])
 	AC_LANG_POP([C++])
 ])
 
+dnl Run checks for LuaJIT headers and libraries, which replace the Lua ones
+AC_DEFUN([CHECK_LUAJIT], [
+	AC_ARG_WITH([luajit], [AC_HELP_STRING([--with-luajit=PATH], [prefix for LuaJIT installation])], [luajit_prefix=$withval])
+
+	if test "x$luajit_prefix" = x; then
+		luajit_prefix="/usr"
+	fi
+
+	LUAJIT_OLD_CPPFLAGS="$CPPFLAGS"
+	header_found="no"
+	for luajit_dir in luajit-2.1 luajit-2.0; do
+		CPPFLAGS="$LUAJIT_OLD_CPPFLAGS -I$luajit_prefix/include/$luajit_dir"
+		AS_UNSET(AS_TR_SH([ac_cv_header_luajit.h]))
+		AC_CHECK_HEADER([luajit.h], [header_found="yes"], [header_found="no"])
+		if test "x$header_found" = "xyes"; then
+			LUA_INCLUDE="-I$luajit_prefix/include/$luajit_dir"
+			break
+		fi
+	done
+	CPPFLAGS="$LUAJIT_OLD_CPPFLAGS"
+
+	LUAJIT_OLD_LIBS="$LIBS"
+	LIBS="$LIBS -L$luajit_prefix/lib"
+	AC_CHECK_LIB([luajit-5.1], [luaJIT_setmode], [lib_found="yes"], [lib_found="no"], [-lm -ldl])
+	LIBS="$LUAJIT_OLD_LIBS"
+	LUA_LIB="-L$luajit_prefix/lib -lluajit-5.1 -lm -ldl"
+
+	if test "x$header_found" != "xyes" || test "x$lib_found" != "xyes"; then
+		AC_MSG_ERROR([LuaJIT headers or libraries not found. Please use the --with-luajit option.])
+	fi
+	AC_DEFINE([HAVE_LUAJIT], [1], [Define if reports are run using LuaJIT])
+])
+
+dnl Run checks for a compression library: name, header, library, function
+AC_DEFUN([CHECK_CODEC], [
+	AC_CHECK_HEADER([$2], [AC_CHECK_LIB([$3], [$4], [codec_found="yes"], [codec_found="no"])], [codec_found="no"])
+	if test "x$codec_found" = "xyes"; then
+		$1="yes"
+		LIBS="$LIBS -l$3"
+	elif test "x$$1" = "xyes"; then
+		AC_MSG_ERROR([$1 headers or libraries not found.])
+	else
+		$1="no"
+	fi
+])
+
 dnl Run checks for the features
 AC_DEFUN([FEATURES_CHECK], [
 	if test "x$gnuplot" != "xno"; then
@@ -179,6 +228,20 @@ AC_DEFUN([FEATURES_CHECK], [
 			leveldb="yes"
 		fi
 	fi
+
+	if test "x$lz4" != "xno"; then
+		CHECK_CODEC([lz4], [lz4.h], [lz4], [LZ4_compress_default])
+		if test "x$lz4" = "xyes"; then
+			AC_DEFINE([HAVE_LZ4], [1], [Define if you have the LZ4 library])
+		fi
+	fi
+
+	if test "x$zstd" != "xno"; then
+		CHECK_CODEC([zstd], [zstd.h], [zstd], [ZDICT_trainFromBuffer])
+		if test "x$zstd" = "xyes"; then
+			AC_DEFINE([HAVE_ZSTD], [1], [Define if you have the Zstandard library])
+		fi
+	fi
 ])
 
 dnl Print a feature configuration report
@@ -194,4 +257,10 @@ AC_DEFUN([FEATURES_REPORT], [
 		else echo "      + LevelDB"; fi
 	fi
 	if test "x$leveldb" = "xno"; then echo "      - LevelDB"; fi
+	if test "x$lz4" = "xyes"; then echo "      + LZ4"; fi
+	if test "x$lz4" = "xno"; then echo "      - LZ4"; fi
+	if test "x$zstd" = "xyes"; then echo "      + Zstandard"; fi
+	if test "x$zstd" = "xno"; then echo "      - Zstandard"; fi
+	if test "x$luajit" = "xyes"; then echo "      + LuaJIT"; fi
+	if test "x$luajit" = "xno"; then echo "      - LuaJIT"; fi
 ])
@@ -51,9 +51,9 @@ function count(r)
 	elseif split == "directories" or split == "files" then
 		local s = r:diffstat()
 		local dir = (split == "directories")
-		for i,v in ipairs(s:files()) do
+		for v, ladd, ldel in s:each() do
 			if count_changes ~= nil then
-				n = s:lines_added(v) + s:lines_removed(v)
+				n = ladd + ldel
 			end
 			if dir then v = pepper.utils.dirname("/" .. v) end
 			if activity[v] == nil then activity[v] = {} end
@@ -29,77 +29,20 @@ function describe(self)
 	return r
 end
 
--- Revision callback function
-function callback(r)
-	if r:author() == "" then
-		return
-	end
-
-	-- Save commit and LOC count
-	local loc = r:diffstat():lines_added()
-	table.insert(commits, {r:date(), r:author(), loc})
-	if authors[r:author()] == nil then
-		authors[r:author()] = loc
-	else
-		authors[r:author()] = authors[r:author()] + loc
-	end
-end
-
 -- Main script function
 function run(self)
-	commits = {}   -- Commit list by timestamp with LOC delta
-	authors = {}   -- Total LOC by author
-
 	-- Gather data, but start at the beginning of the repository
 	-- to get a proper LOC count.
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {stop=datemax}):map(callback)
-
-	-- Determine the "busiest" authors (by LOC)
-	local authorloc = {}
-	for k,v in pairs(authors) do
-		table.insert(authorloc, {k, v})
-	end
-	table.sort(authorloc, function (a,b) return (a[2] > b[2]) end)
-	local i = 1 + tonumber(self:getopt("n", 6))
-	while i <= #authorloc do
-		authors[authorloc[i][1]] = nil
-		authorloc[i] = nil
-		i = i + 1
-	end
+	local loc = pepper.aggregator:new({key = "author", value = "lines_added"})
+	repo:iterator(branch, {stop=datemax}):aggregate(loc)
 
-	-- Sort commits by time
-	table.sort(commits, function (a,b) return (a[1] < b[1]) end)
-
-	-- Generate data arrays for the authors, skipping data points
-	-- prior to datemin.
-	local keys = {}
-	local series = {}
-	local loc = {}
-	for i,a in ipairs(authorloc) do
-		loc[a[1]] = 0
-	end
-	for t,v in ipairs(commits) do
-		if datemin < 0 or v[1] >= datemin then
-			table.insert(keys, v[1])
-			table.insert(series, {});
-		end
-		for i,a in ipairs(authorloc) do
-			if a[1] == v[2] then
-				loc[a[1]] = loc[a[1]] + v[3]
-			end
-			if datemin < 0 or v[1] >= datemin then
-				table.insert(series[#series], loc[a[1]])
-			end
-		end
-	end
-
-	local authors = {}
-	for i,a in ipairs(authorloc) do
-		table.insert(authors, a[1])
-	end
+	-- Determine the "busiest" authors (by LOC) and generate data arrays
+	-- for them, skipping data points prior to datemin.
+	local authors = loc:top(tonumber(self:getopt("n", 6)))
+	local keys, series = loc:series(authors, datemin)
 
 	local p = pepper.gnuplot:new()
 	pepper.plotutils.setup_output(p)
@@ -16,11 +16,17 @@ function describe(self)
 	local r = {}
 	r.title = "Cache check"
 	r.description = "Checks and cleans up the revision cache"
-	r.options = {{"-f,--force", "Force clearing of cache if necessary"}}
+	r.options = {
+		{"-f,--force", "Force clearing of cache if necessary"},
+		{"-c,--compact", "Remove unused data from the cache afterwards"}
+	}
 	return r
 end
 
 -- Main script function
 function run(self)
 	pepper.internal.check_cache(self:repository(), self:getopt("f,force"))
+	if self:getopt("c,compact") then
+		pepper.internal.compact_cache(self:repository())
+	end
 end
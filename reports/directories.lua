@@ -29,102 +29,20 @@ function describe(self)
 	return r
 end
 
--- Revision callback function
-function count(r)
-	local s = r:diffstat()
-
-	-- Save commit and file paths
-	table.insert(commits, {r:date(), pepper.diffstat(s)})
-
-	-- Update directory sizes
-	for i,v in ipairs(s:files()) do
-		local dir = pepper.utils.dirname("/" .. v)
-		local old = 0
-		if directories[dir] == nil then
-			directories[dir] = s:lines_added(v) - s:lines_removed(v)
-		else
-			old = directories[dir]
-			directories[dir] = directories[dir] + s:lines_added(v) - s:lines_removed(v)
-		end
-	end
-end
-
--- Compares directory sizes of a and b
-function dircmp(a, b)
-	return (a[2] > b[2])
-end
-
--- Checks whether commit a has been earlier than b
-function commitcmp(a, b)
-	return (a[1] < b[1])
-end
-
 -- Main report function
 function main(self)
-	commits = {}     -- Commit list by timestamp with diffstat
-	directories = {} -- Total LOC by directory
-
 	-- Gather data, but start at the beginning of the repository
 	-- to get a proper LOC count.
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {stop=datemax}):map(count)
+	local sizes = pepper.aggregator:new({key = "directory", value = "lines"})
+	repo:iterator(branch, {stop=datemax}):aggregate(sizes)
 
-	-- Determine the largest directories (by current LOC)
-	local dirloc = {}
-	for k,v in pairs(directories) do
-		table.insert(dirloc, {k, v})
-	end
-	table.sort(dirloc, dircmp)
-	local i = 1 + tonumber(self:getopt("n", 6))
-	while i <= #dirloc do
-		directories[dirloc[i][1]] = nil
-		dirloc[i] = nil
-		i = i + 1
-	end
-
-	-- Sort commits by time
-	table.sort(commits, commitcmp)
-
-	-- Generate data arrays for the directories, skipping data points
-	-- prior to datemin.
-	local keys = {}
-	local series = {}
-	local loc = {}
-	for i,a in ipairs(dirloc) do
-		loc[a[1]] = 0
-	end
-	for t,v in ipairs(commits) do
-		if datemin < 0 or v[1] >= datemin then
-			table.insert(keys, v[1])
-			table.insert(series, {});
-		end
-
-		-- Update directory sizes
-		local s = v[2];
-		for i,v in ipairs(s:files()) do
-			local dir = pepper.utils.dirname("/" .. v)
-			if loc[dir] ~= nil then
-				loc[dir] = loc[dir] + s:lines_added(v) - s:lines_removed(v)
-			end
-		end
-
-		if datemin < 0 or v[1] >= datemin then
-			for i,a in ipairs(dirloc) do
-				table.insert(series[#series], loc[a[1]])
-			end
-		end
-	end
-
-	local directories = {}
-	for i,a in ipairs(dirloc) do
-		if #a[1] > 1 then
-			table.insert(directories, a[1]:sub(2))
-		else
-			table.insert(directories, a[1])
-		end
-	end
+	-- Determine the largest directories (by current LOC) and generate
+	-- data arrays for them, skipping data points prior to datemin.
+	local directories = sizes:top(tonumber(self:getopt("n", 6)))
+	local keys, series = sizes:series(directories, datemin)
 
 	local p = pepper.gnuplot:new()
 	pepper.plotutils.setup_output(p)
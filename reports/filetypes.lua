@@ -21,6 +21,7 @@ function describe(self)
 	r.options = {
 		{"-rARG, --revision=ARG", "Select revision (defaults to HEAD)"},
 		{"-nARG", "Show the ARG most frequent file types"},
+		{"-l, --lines", "Count lines of code instead of files"},
 		{"-p, --pie", "Generate pie chart instead of histogram"},
 	}
 	pepper.plotutils.add_plot_options(r)
@@ -83,11 +84,20 @@ end
 -- Main report function
 function run(self)
 	local rev = self:getopt("r, revision", "")
-	local tree = self:repository():tree(rev)
+	local lines = self:getopt("l, lines")
+
+	-- Count the number of files or lines for each extension
+	local sizes = {}
+	if lines then
+		sizes = self:repository():line_counts(rev)
+	else
+		for i,v in ipairs(self:repository():tree(rev)) do
+			sizes[v] = 1
+		end
+	end
 
-	-- For now, simply count the number of files for each extension
 	local count = {}
-	for i,v in ipairs(tree) do
+	for v,size in pairs(sizes) do
 		local ext = extension(v)
 		local nam = ""
 		if ext ~= nil then
@@ -101,7 +111,7 @@ function run(self)
 		if count[nam] == nil then
 			count[nam] = 0
 		end
-		count[nam] = count[nam] + 1
+		count[nam] = count[nam] + size
 	end
 
 	-- Sort by number of files
@@ -165,8 +175,8 @@ set style fill solid border -1
 set style histogram cluster gap 1
 set xtics nomirror
 set yrange [0:]
-set ylabel "Number of files"
 ]])
+		p:cmd("set ylabel \"" .. (lines and "Lines of code" or "Number of files") .. "\"")
 		p:plot_histogram(keys, values)
 	end
 end
@@ -30,6 +30,7 @@ end
 
 -- Revision callback function
 function callback(r)
+	last = r:id()
 	if r:date() == 0 then return end
 
 	s = r:diffstat()
@@ -49,11 +50,24 @@ function run(self)
 	locdeltas = {}
 
 	-- Gather data, but start at the beginning of the repository
-	-- to get a proper LOC count.
+	-- to get a proper LOC count. If there's a checkpoint from a
+	-- previous run, only new revisions need to be processed.
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {stop=datemax}):map(callback)
+	local state
+	state, last = self:restore(branch)
+	local it = repo:iterator(branch, {stop=datemax, since=last})
+	if state ~= nil and it:resumed() then
+		locdeltas = state
+		for k,v in pairs(locdeltas) do
+			table.insert(dates, k)
+		end
+	end
+	it:map(callback)
+	if last ~= nil then
+		self:checkpoint(locdeltas, last, branch)
+	end
 
 	-- Sort loc data by date
 	table.sort(dates)
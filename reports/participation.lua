@@ -148,6 +148,7 @@ function run(self)
 	-- Gather data
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local data = {} -- {commits, changes}
+	local id = pepper.author_id(author)
 	repo:iterator(branch, {start=start}):map(
 		function (r)
 			local slot = timeslot(r:date(), resolution)
@@ -158,7 +159,7 @@ function run(self)
 				n = r:diffstat():lines_added()
 			end
 
-			if r:author() == author then
+			if r:author_id() == id then
 				data[slot][1] = data[slot][1] + n
 			else
 				data[slot][2] = data[slot][2] + n
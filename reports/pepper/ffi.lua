@@ -0,0 +1,57 @@
+--[[
+	pepper - SCM statistics report generator
+	Copyright (C) 2010-present Jonas Gehring
+
+	Released under the GNU General Public License, version 3.
+	Please see the COPYING file in the source distribution for license
+	terms and conditions, or see http://www.gnu.org/licenses/.
+
+	file pepper/ffi.lua
+	Fast access to revision data using the LuaJIT FFI
+--]]
+
+--- Fast access to revision data using the LuaJIT FFI.
+--  If pepper has been built against LuaJIT, the numeric data of revisions
+--  can be read from C structs, which avoids method calls into pepper and
+--  the creation of diffstat objects. Otherwise, equivalent tables are used.
+--  Please note that this is a Lua module. If you want to use it, add
+--  <pre>require "pepper.ffi"</pre> to your script.
+
+module("pepper.ffi", package.seeall)
+
+
+local ffilib = nil
+if jit then
+	local ok, lib = pcall(require, "ffi")
+	if ok then
+		ffilib = lib
+		ffilib.cdef(pepper.revision_view)
+	end
+end
+local viewptr = ffilib and ffilib.typeof("const pepper_revision_view *")
+
+--- Whether the LuaJIT FFI is being used.
+available = (ffilib ~= nil)
+
+--- Returns the numeric data of a revision.
+--  The result provides the fields <code>date</code>, <code>files</code>,
+--  <code>lines_added</code>, <code>bytes_added</code>, <code>lines_removed</code>
+--  and <code>bytes_removed</code>. With the FFI, the fields are read
+--  directly from the revision, so the result must not be used after the
+--  revision object has been released.
+--  @param r The revision
+function view(r)
+	if viewptr then
+		return viewptr(r:view())
+	end
+	local s = r:diffstat()
+	local ladd, cadd, ldel, cdel = s:totals()
+	return {
+		date = r:date(),
+		files = #s:files(),
+		lines_added = ladd,
+		bytes_added = cadd,
+		lines_removed = ldel,
+		bytes_removed = cdel
+	}
+end
@@ -29,39 +29,41 @@ function describe(self)
 	return r
 end
 
--- Revision callback function
-function callback(r)
-	if r:date() == 0 then
-		return
-	end
-
-	if author and r:author() ~= author then
-		return
-	end
-
-	local date = os.date("%w %H", r:date())
-	if commits[date] == nil then
-		commits[date] = 1
-	else
-		commits[date] = commits[date] + 1
-	end
-	if commits[date] > max then
-		max = commits[date]	
+-- Merges the commit counts of b into a
+function merge(a, b)
+	for k,v in pairs(b) do
+		a[k] = (a[k] or 0) + v
 	end
+	return a
 end
 
 -- Main report function
 function run(self)
-	commits = {}  -- Number of commits: (hour, wday) -> num
-	author = self:getopt("a,author")
-	max = 0
+	local author = self:getopt("a,author")
 
-	-- Gather data
+	-- Gather data, counting commits by (hour, wday) in parallel
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {start=datemin, stop=datemax}):map(callback)
+	local iterator = repo:iterator(branch, {start=datemin, stop=datemax, diffstats=false})
+	local commits = iterator:mapreduce(function (r, commits)
+		if r:date() == 0 then
+			return
+		end
+		if author and r:author() ~= author then
+			return
+		end
+
+		local date = os.date("%w %H", r:date())
+		commits[date] = (commits[date] or 0) + 1
+	end, merge)
 
+	local max = 0
+	for k,v in pairs(commits) do
+		if v > max then
+			max = v
+		end
+	end
 	max = max * 2
 
 	-- Extract data
@@ -18,7 +18,7 @@ function describe(self)
 	r.title = "Revision dump"
 	r.options = {
 		{"-bARG, --branch=ARG", "Select branch"},
-		{"-rARG, --revision=ARG", "Select revision"}
+		{"-rARG, --revision=ARG", "Select revision, or a comma-separated list of revisions"}
 	}
 	return r
 end
@@ -46,7 +46,11 @@ function run(self)
 	local repo = self:repository()
 	local rev = self:getopt("r,revision")
 	if rev ~= nil then
-		revdump(repo:revision(rev))
+		local ids = {}
+		for id in string.gmatch(rev, "[^,]+") do
+			table.insert(ids, id)
+		end
+		repo:revisions(ids, revdump)
 	else
 		local branch = self:getopt("b,branch", repo:default_branch())
 		repo:iterator(branch):map(revdump)
@@ -29,30 +29,35 @@ end
 
 -- Revision callback function
 function callback(r)
-	if r:author() ~= "" then
-		if messages[r:author()] == nil then
-			messages[r:author()] = {}
+	local id = r:author_id()
+	if id ~= 0 then
+		if messages[id] == nil then
+			messages[id] = {}
 		end
-		table.insert(messages[r:author()], r:message())
+		table.insert(messages[id], r:message())
 	end
 end
 
 -- Main report function
 function run(self)
-	-- Commit message dictionary, indexed by author
+	-- Commit message dictionary, indexed by author ID
 	messages = {}
 
 	-- Gather data
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {start=datemin, stop=datemax}):map(callback)
+	repo:iterator(branch, {start=datemin, stop=datemax, diffstats=false}):map(callback)
 
-	-- Sort commit dictionary
+	-- Sort commit dictionary by author name
 	local authors = {}
-	for author,revisions in pairs(messages) do
+	local byname = {}
+	for id,msgs in pairs(messages) do
+		local author = pepper.author_name(id)
 		table.insert(authors, author)
+		byname[author] = msgs
 	end
+	messages = byname
 	if self:getopt("n,numbered") then
 		table.sort(authors, function (a,b)
 			return #messages[a] > #messages[b]
@@ -53,7 +53,7 @@ function run(self)
 	local repo = self:repository()
 	local branch = self:getopt("b,branch", repo:default_branch())
 	local datemin, datemax = pepper.datetime.date_range(self)
-	repo:iterator(branch, {start=datemin, stop=datemax}):map(callback)
+	repo:iterator(branch, {start=datemin, stop=datemax, diffstats=false}):map(callback)
 
 	-- Generate graph
 	local p = pepper.gnuplot:new()
@@ -6,6 +6,8 @@
  *   * An optional table argument has been added to Lunar::Register()
  *   * Store instances in std::shared_ptr. This is handy for sharing object
  *     ownership between C++ and Lua.
+ *   * Lunar<T>::ptr() returns the shared_ptr of an instance on the stack.
+ *   * An optional hook is called after member functions, e.g. for profiling.
  */
 
 
@@ -20,6 +22,15 @@ extern "C" {
 #include <lualib.h>
 }
 
+// Function that is called after a member function has returned, while its
+// stack frame is still active
+typedef void (*LunarHook)(lua_State *L, const char *className, const char *method);
+
+inline LunarHook &lunarHook() {
+	static LunarHook hook = NULL;
+	return hook;
+}
+
 template <typename T> class Lunar
 {
 	typedef struct {
@@ -159,6 +170,17 @@ template <typename T> class Lunar
 		return ud->pT.get();  // pointer to T object
 	}
 
+	// get userdata from Lua stack and return the shared_ptr holding the object
+	static std::shared_ptr<T> ptr(lua_State *L, int narg) {
+		userdataType *ud =
+			static_cast<userdataType*>(luaL_checkudata(L, narg, T::className));
+		if(!ud) {
+			luaL_typerror(L, narg, T::className);
+			return std::shared_ptr<T>();
+		}
+		return ud->pT;
+	}
+
 	private:
 	Lunar();  // hide default constructor
 
@@ -178,6 +200,9 @@ template <typename T> class Lunar
 		// get member function from upvalue
 		RegType *l = static_cast<RegType*>(lua_touserdata(L, lua_upvalueindex(1)));
 		int ret = (obj->*(l->mfunc))(L);  // call member function
+		if (LunarHook hook = lunarHook()) {
+			hook(L, T::className, l->name);
+		}
 
 		// Remove temporary reference
 		lua_pushnil(L);
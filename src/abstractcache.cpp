@@ -13,42 +13,558 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <set>
+
 #include "bstream.h"
 #include "diffstat.h"
 #include "logger.h"
 #include "options.h"
 #include "revision.h"
+#include "stats.h"
 #include "strlib.h"
 #include "utils.h"
 
+#include "syslib/datetime.h"
 #include "syslib/fs.h"
 
 #include "abstractcache.h"
 
 
+#define MAX_PENDING 256
+#define BUNDLE_MAGIC "pepper-bundle"
+#define BUNDLE_VERSION (uint32_t)1
+#define BUNDLE_BATCH 256 // Revisions per cache access
+#define LOG_MAGIC "pepper-log"
+#define LOG_VERSION (uint32_t)1
+#define DATES_MAGIC "pepper-dates"
+#define DATES_VERSION (uint32_t)1
+#define LINES_MAGIC "pepper-lines"
+#define LINES_VERSION (uint32_t)1
+#define TREE_MAGIC "pepper-tree"
+#define TREE_VERSION (uint32_t)1
+#define MAX_CONTENTS (32 * 1024 * 1024) // Bytes of file contents kept in memory
+#define WARM_WINDOW 1024 // Revisions requested at once by warm()
+#define WARM_FLUSH 16384 // Revisions between flushes during warm()
+
+
+namespace
+{
+
+// Returns a file name made of the given prefix and the SHA-1 digest of
+// the key in hexadecimal notation
+std::string digestName(const std::string &prefix, const std::string &key)
+{
+	unsigned char digest[20];
+	utils::sha1(key.data(), key.length(), digest);
+	std::string name = prefix;
+	for (size_t i = 0; i < sizeof(digest); i++) {
+		name += str::printf("%02x", digest[i]);
+	}
+	return name;
+}
+
+} // anonymous namespace
+
+
+// Guards calls to the cache implementation from the report thread, or
+// from background threads if busy is false
+class AbstractCache::Locker
+{
+	public:
+		Locker(AbstractCache *cache, bool busy = true) : m_cache(cache), m_busy(busy) {
+			m_cache->m_mutex.lock();
+			if (m_busy) {
+				m_cache->m_busy = 1;
+			}
+		}
+		~Locker() {
+			if (m_busy) {
+				m_cache->m_busy = 0;
+			}
+			m_cache->m_mutex.unlock();
+		}
+
+	private:
+		AbstractCache *m_cache;
+		bool m_busy;
+};
+
+
+// Reads cached revisions ahead on the global thread pool
+class AbstractCache::Readahead : public sys::parallel::Task
+{
+	public:
+		Readahead(const std::function<void()> &func) : m_func(func) { }
+
+	protected:
+		void run() {
+			try {
+				m_func();
+			} catch (const std::exception &ex) {
+				// Revisions will be loaded again when requested
+				PDEBUG << "Cache: Readahead failed: " << ex.what() << endl;
+			}
+		}
+
+	private:
+		std::function<void()> m_func;
+};
+
+
+// Cached revisions that are loaded at once when the first of them is claimed
+class AbstractCache::Batch
+{
+	public:
+		Batch(AbstractCache *cache, bool diffstats) : m_cache(cache), m_diffstats(diffstats), m_loaded(false) { }
+		~Batch() {
+			for (size_t i = 0; i < m_revs.size(); i++) {
+				delete m_revs[i];
+			}
+		}
+
+		size_t size() const { return m_ids.size(); }
+		size_t add(const std::string &id) {
+			m_ids.push_back(id);
+			return m_ids.size() - 1;
+		}
+
+		// Returns the revision at the given index. Revisions that are no
+		// longer cached completely are fetched from the backend.
+		Revision *take(size_t index) {
+			Revision *r;
+			{
+				sys::parallel::MutexLocker locker(&m_mutex);
+				if (!m_loaded) {
+					load(false);
+				}
+				r = m_revs[index];
+				m_revs[index] = NULL;
+			}
+			if (r == NULL) {
+				return (m_diffstats ? m_cache->revision(m_ids[index]) : m_cache->metaRevision(m_ids[index]));
+			}
+			PTRACE << "Cache hit: " << r->id() << endl;
+			Stats::add(Stats::CacheHits);
+			return r;
+		}
+
+		// Loads the revisions in the background, unless take() has been
+		// called already
+		void preload() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			if (!m_loaded) {
+				load(true);
+			}
+		}
+
+	private:
+		void load(bool background) {
+			m_revs = m_cache->cachedMany(m_ids, (m_diffstats ? Revision::AllParts : Revision::MetaPart | Revision::MessagePart), background);
+			m_loaded = true;
+		}
+
+	private:
+		AbstractCache *m_cache;
+		bool m_diffstats;
+		bool m_loaded;
+		std::vector<std::string> m_ids;
+		std::vector<Revision *> m_revs;
+		sys::parallel::Mutex m_mutex;
+};
+
+
+// Background thread writing revisions to the cache
+class AbstractCache::Writer : public sys::parallel::Thread
+{
+	public:
+		Writer(AbstractCache *cache) : m_cache(cache), m_writing(0), m_end(false) { }
+
+		// Queues revisions for writing, taking ownership. Diffstats with
+		// non-empty keys will be linked to the revisions afterwards.
+		void push(const std::vector<Revision *> &revs, const std::vector<std::string> &keys) {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			for (size_t i = 0; i < revs.size(); i++) {
+				while (!m_end && m_queue.size() + m_writing >= MAX_PENDING) {
+					// Let the writer catch up with large batches
+					m_pushed.wake();
+					m_written.wait(&m_mutex);
+				}
+				m_queue.push_back(revs[i]);
+				m_keys.push_back(keys[i]);
+				m_ids.insert(revs[i]->m_id);
+			}
+			m_pushed.wake();
+		}
+
+		// Checks whether the given revision is queued or being written
+		bool pending(const std::string &id) {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			return (m_ids.find(id) != m_ids.end());
+		}
+
+		// Waits until all queued revisions have been written
+		void sync() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			while (!m_queue.empty() || m_writing > 0) {
+				m_written.wait(&m_mutex);
+			}
+			if (!m_error.empty()) {
+				std::string error = m_error;
+				m_error.clear();
+				throw PEX(str::printf("Error writing to cache: %s", error.c_str()));
+			}
+		}
+
+		// Stops the thread, dropping revisions that haven't been written yet
+		void stop() {
+			m_mutex.lock();
+			m_end = true;
+			for (size_t i = 0; i < m_queue.size(); i++) {
+				delete m_queue[i];
+			}
+			m_queue.clear();
+			m_keys.clear();
+			m_pushed.wakeAll();
+			m_written.wakeAll();
+			m_mutex.unlock();
+			wait();
+		}
+
+	protected:
+		void run() {
+			// Signals are handled by the report thread, which flushes the cache
+			sigset_t set;
+			sigemptyset(&set);
+			sigaddset(&set, SIGINT);
+			sigaddset(&set, SIGTERM);
+			pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+			m_mutex.lock();
+			while (true) {
+				while (!m_end && m_queue.empty()) {
+					m_pushed.wait(&m_mutex);
+				}
+				if (m_end) {
+					break;
+				}
+
+				std::vector<Revision *> revs(m_queue.begin(), m_queue.end());
+				std::vector<std::string> keys(m_keys.begin(), m_keys.end());
+				m_queue.clear();
+				m_keys.clear();
+				m_writing = revs.size();
+				m_mutex.unlock();
+
+				std::string error;
+				try {
+					sys::parallel::MutexLocker locker(&m_cache->m_mutex);
+					// Revisions that are cached already are part of the rollups
+					std::vector<Revision *> added = m_cache->unindexed(revs);
+					m_cache->putMany(revs);
+					m_cache->addRollups(added);
+					for (size_t i = 0; i < revs.size(); i++) {
+						if (!keys[i].empty()) {
+							m_cache->link(keys[i], revs[i]->m_id);
+						}
+					}
+				} catch (const std::exception &ex) {
+					error = ex.what();
+				}
+
+				m_mutex.lock();
+				for (size_t i = 0; i < revs.size(); i++) {
+					m_ids.erase(m_ids.find(revs[i]->m_id));
+					delete revs[i];
+				}
+				m_writing = 0;
+				if (!error.empty() && m_error.empty()) {
+					PDEBUG << "Error writing to cache: " << error << endl;
+					m_error = error;
+				}
+				m_written.wakeAll();
+			}
+			m_mutex.unlock();
+		}
+
+	private:
+		AbstractCache *m_cache;
+		sys::parallel::Mutex m_mutex;
+		sys::parallel::WaitCondition m_pushed, m_written;
+		std::deque<Revision *> m_queue;
+		std::deque<std::string> m_keys;
+		std::multiset<std::string> m_ids;
+		size_t m_writing;
+		bool m_end;
+		std::string m_error;
+};
+
+
+// Records the revision IDs returned by a log iterator of the repository
+// and stores them once the log has been read completely
+class AbstractCache::LogRecorder : public Backend::LogIterator
+{
+	public:
+		LogRecorder(LogIterator *iterator, const std::string &file, const std::string &head)
+			: LogIterator(), m_iterator(iterator), m_file(file), m_head(head) {
+			m_iterator->start();
+		}
+		~LogRecorder() {
+			m_iterator->wait();
+			delete m_iterator;
+		}
+
+		bool nextIds(std::queue<std::string> *queue) {
+			std::queue<std::string> ids;
+			if (!m_iterator->nextIds(&ids)) {
+				if (!m_file.empty()) {
+					AbstractCache::writeLog(m_file, m_head, m_ids);
+					m_file.clear();
+				}
+				return false;
+			}
+			while (!ids.empty()) {
+				m_ids.push_back(ids.front());
+				queue->push(ids.front());
+				ids.pop();
+			}
+			return true;
+		}
+
+	protected:
+		void run() {
+			m_iterator->wait();
+		}
+
+	private:
+		LogIterator *m_iterator;
+		std::string m_file, m_head;
+		std::vector<std::string> m_ids;
+};
+
+
 // Constructor
 AbstractCache::AbstractCache(Backend *backend, const Options &options)
-	: Backend(options), m_backend(backend)
+	: Backend(options), m_backend(backend), m_writer(NULL), m_lineCountsLoaded(false), m_contentSize(0), m_rollupsState(RollupsUnknown), m_memorySize(0), m_busy(0), m_linesOnly(options.linesOnly())
 {
+	m_memoryLimit = size_t(options.revisionMemory()) * 1024 * 1024;
 
+	// Misses are counted by the innermost cache only
+	AbstractCache *inner = dynamic_cast<AbstractCache *>(backend);
+	m_direct = (inner == NULL);
+
+	// Only the outermost cache keeps revisions in memory, the others would
+	// only hold duplicates
+	if (inner != NULL) {
+		inner->setMemoryLimit(0);
+	}
 }
 
 // Destructor
 AbstractCache::~AbstractCache()
 {
+	waitReadahead();
+
+	// Implementations are expected to call sync() in flush()
+	if (m_writer != NULL) {
+		m_writer->stop();
+		delete m_writer;
+	}
+	forget();
+}
+
+// Returns a log iterator. If the cache stores logs, the revision IDs of
+// an unfiltered log are recorded together with the branch head, and they
+// are replayed without asking the repository as long as the head stays
+// the same. Date-bounded logs are cut out of the complete log of the
+// branch if possible, see datedLog().
+Backend::LogIterator *AbstractCache::iterator(const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter)
+{
+	if (!storesLogs() || !filter.empty()) {
+		return m_backend->iterator(branch, start, end, filter);
+	}
+
+	std::string head = m_backend->head(branch);
+	if (head.empty()) {
+		return m_backend->iterator(branch, start, end, filter);
+	}
+
+	std::vector<std::string> ids;
+	if ((start >= 0 || end >= 0) && datedLog(branch, head, start, end, &ids)) {
+		PDEBUG << "Cache: Replaying " << ids.size() << " revisions between " << start << " and " << end << " from date index" << endl;
+		return new LogIterator(ids);
+	}
+
+	std::string file = logFile(branch, start, end);
+	if (readLog(file, head, &ids)) {
+		PDEBUG << "Cache: Replaying log of " << ids.size() << " revisions at " << head << endl;
+		return new LogIterator(ids);
+	}
+	return new LogRecorder(m_backend->iterator(branch, start, end, filter), file, head);
+}
+
+// Returns the file listing of the given revision. Listings are stored in
+// the cache directory by the key of the tree.
+std::vector<std::string> AbstractCache::tree(const std::string &id)
+{
+	std::string key = (storesLogs() ? m_backend->treeKey(id) : std::string());
+	if (key.empty()) {
+		return m_backend->tree(id);
+	}
+
+	std::string file = cacheFile(this, digestName("tree_", key));
+	std::vector<std::string> paths;
+	if (readTree(file, key, &paths)) {
+		PDEBUG << "Cache: Read listing of " << paths.size() << " files for tree " << key << endl;
+		return paths;
+	}
+	paths = m_backend->tree(id);
+	writeTree(file, key, paths);
+	return paths;
+}
+
+// Returns the file contents of the given path at the given revision
+std::string AbstractCache::cat(const std::string &path, const std::string &id)
+{
+	return catMany(std::vector<std::string>(1, path), id).front();
+}
+
+// Returns the contents of the given files at the given revision. Recently
+// read files are kept in memory by the key of the tree, up to a total of
+// MAX_CONTENTS bytes, dropping the least recently used ones first.
+std::vector<std::string> AbstractCache::catMany(const std::vector<std::string> &paths, const std::string &id)
+{
+	std::string key = (m_direct ? m_backend->treeKey(id) : std::string());
+	if (key.empty()) {
+		return m_backend->catMany(paths, id);
+	}
+
+	std::vector<std::string> contents(paths.size()), missing;
+	std::vector<size_t> indices;
+	{
+		sys::parallel::MutexLocker locker(&m_contentMutex);
+		for (size_t i = 0; i < paths.size(); i++) {
+			std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator>::iterator it = m_contentIndex.find(key + '\0' + paths[i]);
+			if (it != m_contentIndex.end()) {
+				m_contents.splice(m_contents.begin(), m_contents, it->second);
+				contents[i] = it->second->second;
+			} else {
+				missing.push_back(paths[i]);
+				indices.push_back(i);
+			}
+		}
+	}
+	PTRACE << "Cache: " << (paths.size() - missing.size()) << " of " << paths.size() << " files in memory" << endl;
+	if (missing.empty()) {
+		return contents;
+	}
+
+	std::vector<std::string> fetched = m_backend->catMany(missing, id);
+	sys::parallel::MutexLocker locker(&m_contentMutex);
+	for (size_t i = 0; i < missing.size(); i++) {
+		contents[indices[i]] = fetched[i];
+		std::string k = key + '\0' + missing[i];
+		if (fetched[i].length() > MAX_CONTENTS / 4 || m_contentIndex.find(k) != m_contentIndex.end()) {
+			continue;
+		}
+		m_contents.push_front(std::make_pair(k, fetched[i]));
+		m_contentIndex[k] = m_contents.begin();
+		m_contentSize += fetched[i].length();
+		while (m_contentSize > MAX_CONTENTS) {
+			m_contentSize -= m_contents.back().second.length();
+			m_contentIndex.erase(m_contents.back().first);
+			m_contents.pop_back();
+		}
+	}
+	return contents;
+}
+
+// Returns the line counts of the files in the tree of the given revision.
+// Counts of files with content-based keys are stored in the cache, so
+// files that didn't change since the last call are not read again.
+std::map<std::string, uint64_t> AbstractCache::lineCounts(const std::string &id)
+{
+	if (!storesLogs()) {
+		return m_backend->lineCounts(id);
+	}
+
+	std::vector<std::string> paths;
+	std::vector<std::string> keys = m_backend->treeKeys(id, &paths);
+	loadLineCounts();
+
+	std::map<std::string, uint64_t> counts;
+	std::vector<std::string> missing, missingKeys;
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (Diffstat::excluded(paths[i].c_str(), m_excludes)) {
+			continue;
+		}
+		std::map<std::string, uint64_t>::const_iterator it = (keys[i].empty() ? m_lineCounts.end() : m_lineCounts.find(keys[i]));
+		if (it != m_lineCounts.end()) {
+			counts[paths[i]] = it->second;
+		} else {
+			missing.push_back(paths[i]);
+			missingKeys.push_back(keys[i]);
+		}
+	}
+	PDEBUG << "Cache: " << counts.size() << " of " << (counts.size() + missing.size()) << " line counts cached" << endl;
+	if (missing.empty()) {
+		return counts;
+	}
+
+	std::vector<uint64_t> fetched = m_backend->countLines(missing, id);
+	std::string file = cacheFile(this, "linecounts");
+	bool exists = sys::fs::fileExists(file);
+	BOStream out(file, true);
+	if (!exists) {
+		out << std::string(LINES_MAGIC) << LINES_VERSION;
+	}
+	for (size_t i = 0; i < missing.size(); i++) {
+		counts[missing[i]] = fetched[i];
+		if (!missingKeys[i].empty()) {
+			m_lineCounts[missingKeys[i]] = fetched[i];
+			out << missingKeys[i] << fetched[i];
+		}
+	}
+	if (!out.ok()) {
+		Logger::warn() << "Warning: Unable to write line counts to " << file << endl;
+	}
+	return counts;
+}
+
+// Returns the per-day sums of the given key for all days overlapping the
+// given time range. The rollups cover all cached revisions, regardless of
+// the branches they have been retrieved for. If the cache doesn't have
+// rollups yet, they are built from the cached revisions once.
+bool AbstractCache::rollups(Rollups::Key key, int64_t start, int64_t end, std::vector<Rollups::Row> *rows)
+{
+	if (!storesLogs()) {
+		return m_backend->rollups(key, start, end, rows);
+	}
 
+	flush();
+	Rollups all;
+	if (!all.read(cacheFile(this, "rollups"))) {
+		buildRollups(&all);
+	}
+	*rows = all.rows(key, start, end);
+	return true;
 }
 
 // Returns a diffstat for the specified revision
 DiffstatPtr AbstractCache::diffstat(const std::string &id)
 {
-	if (!lookup(id)) {
+	Revision *r = cached(id, Revision::DiffstatPart);
+	if (r == NULL) {
 		PTRACE << "Cache miss: " << id << endl;
+		Stats::add(Stats::CacheMisses, m_direct);
+		Stats::Clock clock(Stats::DiffstatFetch, m_direct);
 		return m_backend->diffstat(id);
 	}
 
 	PTRACE << "Cache hit: " << id << endl;
-	Revision *r = get(id);
+	Stats::add(Stats::CacheHits);
 	DiffstatPtr stat = r->diffstat();
 	delete r;
 	return stat;
@@ -57,45 +573,1278 @@ DiffstatPtr AbstractCache::diffstat(const std::string &id)
 // Tells the wrapped backend to pre-fetch revisions that are not cached yet
 void AbstractCache::prefetch(const std::vector<std::string> &ids)
 {
+	std::vector<std::string> missing = uncached(ids);
+	PDEBUG << "Cache: " << (ids.size() - missing.size()) << " of " << ids.size() << " revisions already cached, prefetching " << missing.size() << endl;
+	request(missing, true);
+	remember(ids, Revision::AllParts);
+}
+
+// Returns the revision data for the given ID
+Revision *AbstractCache::revision(const std::string &id)
+{
+	Revision *r = cached(id, Revision::AllParts);
+	if (r == NULL) {
+		PTRACE << "Cache miss: " << id << endl;
+		std::string key;
+		r = fetchUncached(id, true, &key);
+		writeBehind(std::vector<Revision *>(1, r), std::vector<std::string>(1, key));
+		remember(r, Revision::AllParts);
+		return r;
+	}
+
+	PTRACE << "Cache hit: " << id << endl;
+	Stats::add(Stats::CacheHits);
+	return r;
+}
+
+// Returns the revision data for all given IDs
+std::vector<Revision *> AbstractCache::revisions(const std::vector<std::string> &ids)
+{
+	return fetch(ids, true);
+}
+
+// Tells the wrapped backend to pre-fetch the meta-data of revisions that
+// are not cached yet
+void AbstractCache::prefetchMeta(const std::vector<std::string> &ids)
+{
+	std::vector<std::string> missing = uncached(ids);
+	PDEBUG << "Cache: " << (ids.size() - missing.size()) << " of " << ids.size() << " revisions already cached, prefetching meta-data for " << missing.size() << endl;
+	request(missing, false);
+	remember(ids, Revision::MetaPart | Revision::MessagePart);
+}
+
+// Returns the revision meta-data for the given ID. Cached revisions are
+// returned without diffstats, which will be loaded on demand. Revisions
+// without diffstats are not written to the cache.
+Revision *AbstractCache::metaRevision(const std::string &id)
+{
+	Revision *r = cached(id, Revision::MetaPart | Revision::MessagePart);
+	if (r == NULL) {
+		PTRACE << "Cache miss: " << id << endl;
+		std::string key;
+		r = fetchUncached(id, false, &key);
+		if (r->m_diffstat) {
+			writeBehind(std::vector<Revision *>(1, r), std::vector<std::string>(1, key));
+		}
+		remember(r, (r->m_diffstat ? Revision::AllParts : Revision::MetaPart | Revision::MessagePart));
+		return r;
+	}
+
+	PTRACE << "Cache hit: " << id << endl;
+	Stats::add(Stats::CacheHits);
+	return r;
+}
+
+// Returns the revision meta-data for all given IDs
+std::vector<Revision *> AbstractCache::metaRevisions(const std::vector<std::string> &ids)
+{
+	return fetch(ids, false);
+}
+
+// Requests the given revisions and returns a future for each of them.
+// Cached revisions are loaded in batches on first access, while the others
+// are requested from the wrapped backend right away.
+std::vector<RevisionFuture> AbstractCache::revisionsAsync(const std::vector<std::string> &ids, bool diffstats)
+{
+	syncPending(ids);
+	std::vector<bool> cached;
+	{
+		Locker locker(this);
+		cached = lookupMany(ids);
+	}
+
+	std::vector<std::string> missing;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (!cached[i]) {
+			missing.push_back(ids[i]);
+		}
+	}
+	PDEBUG << "Cache: " << (ids.size() - missing.size()) << " of " << ids.size() << " requested revisions cached" << endl;
+	request(missing, diffstats);
+
+	std::vector<RevisionFuture> futures;
+	futures.reserve(ids.size());
+	std::shared_ptr<Batch> batch;
+	for (size_t i = 0; i < ids.size(); i++) {
+		std::string id = ids[i];
+		if (!cached[i]) {
+			futures.push_back(RevisionFuture(id, [this, id, diffstats]() {
+				return (diffstats ? revision(id) : metaRevision(id));
+			}));
+			continue;
+		}
+
+		if (!batch || batch->size() >= LoadBatchSize) {
+			if (batch) {
+				readahead([batch]() { batch->preload(); });
+			}
+			batch = std::make_shared<Batch>(this, diffstats);
+		}
+		size_t index = batch->add(id);
+		futures.push_back(RevisionFuture(id, [batch, index]() {
+			return batch->take(index);
+		}));
+	}
+	if (batch) {
+		readahead([batch]() { batch->preload(); });
+	}
+	return futures;
+}
+
+// Returns whether the given revision has been requested from the wrapped
+// backend, but hasn't been claimed yet
+bool AbstractCache::inFlight(const std::string &id)
+{
+	Locker locker(this);
+	return (m_inflight.find(id) != m_inflight.end());
+}
+
+// Returns the IDs of all revisions of the branch selected by the options
+std::vector<std::string> AbstractCache::history()
+{
+	std::vector<std::string> all;
+	LogIterator *it = iterator(m_opts.branch());
+	it->start();
+	std::queue<std::string> queue;
+	while (it->nextIds(&queue)) {
+		while (!queue.empty()) {
+			all.push_back(queue.front());
+			queue.pop();
+		}
+	}
+	it->wait();
+	delete it;
+	return all;
+}
+
+// Returns the IDs of all given revisions that are neither cached nor
+// pending to be written
+std::vector<std::string> AbstractCache::uncached(const std::vector<std::string> &ids)
+{
+	std::vector<bool> cached;
+	{
+		Locker locker(this);
+		cached = lookupMany(ids);
+	}
+
 	std::vector<std::string> missing;
 	for (unsigned int i = 0; i < ids.size(); i++) {
-		if (!lookup(ids[i])) {
+		if (!cached[i] && (m_writer == NULL || !m_writer->pending(ids[i]))) {
 			missing.push_back(ids[i]);
 		}
 	}
+	return missing;
+}
 
-	PDEBUG << "Cache: " << (ids.size() - missing.size()) << " of " << ids.size() << " revisions already cached, prefetching " << missing.size() << endl;
+// Returns the given revisions, loading cached ones at once. Only complete
+// revisions are written to the cache.
+std::vector<Revision *> AbstractCache::fetch(const std::vector<std::string> &ids, bool diffstats)
+{
+	std::vector<Revision *> revs = cachedMany(ids, (diffstats ? Revision::AllParts : Revision::MetaPart | Revision::MessagePart)), fetched;
+	size_t hits = ids.size() - std::count(revs.begin(), revs.end(), (Revision *)NULL);
+	PTRACE << "Cache: " << hits << " of " << ids.size() << " revisions cached" << endl;
+	Stats::add(Stats::CacheHits, hits);
+
+	std::vector<std::string> keys;
+	try {
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (revs[i] == NULL) {
+				std::string key;
+				revs[i] = fetchUncached(ids[i], diffstats, &key);
+				if (revs[i]->m_diffstat) {
+					fetched.push_back(revs[i]);
+					keys.push_back(key);
+				}
+				remember(revs[i], (revs[i]->m_diffstat ? Revision::AllParts : Revision::MetaPart | Revision::MessagePart));
+			}
+		}
+	} catch (...) {
+		// Release the cached and fetched revisions, as the caller won't
+		// receive any of them
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw;
+	}
+	if (!fetched.empty()) {
+		writeBehind(fetched, keys);
+	}
+	return revs;
+}
+
+// Requests revisions that are not cached yet from the wrapped backend,
+// skipping those that have already been requested. If the diffstat of a
+// revision is already known by its content-based key, only the meta-data
+// will be fetched.
+void AbstractCache::request(const std::vector<std::string> &ids, bool diffstats)
+{
+	std::vector<std::string> missing;
+	{
+		Locker locker(this);
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (m_inflight.find(ids[i]) == m_inflight.end()) {
+				missing.push_back(ids[i]);
+			}
+		}
+	}
+	if (missing.empty()) {
+		return;
+	}
+
+	std::vector<std::string> shared;
+	if (diffstats && sharesDiffstats()) {
+		std::vector<std::string> keys;
+		try {
+			keys = m_backend->diffstatKeys(missing);
+		} catch (const std::exception &ex) {
+			PDEBUG << "Unable to retrieve diffstat keys: " << ex.what() << endl;
+			keys.assign(missing.size(), std::string());
+		}
+
+		std::vector<std::string> unshared;
+		{
+			Locker locker(this);
+			for (size_t i = 0; i < missing.size(); i++) {
+				DiffstatPtr stat;
+				if (!keys[i].empty()) {
+					stat = getShared(keys[i]);
+				}
+				if (stat) {
+					m_shared[missing[i]] = stat;
+					shared.push_back(missing[i]);
+				} else {
+					if (!keys[i].empty()) {
+						m_keys[missing[i]] = keys[i];
+					}
+					unshared.push_back(missing[i]);
+				}
+			}
+		}
+		PDEBUG << "Cache: Found shared diffstats for " << shared.size() << " revisions" << endl;
+		missing.swap(unshared);
+	}
+
+	std::vector<RevisionFuture> futures;
+	if (!shared.empty()) {
+		futures = m_backend->revisionsAsync(shared, false);
+	}
 	if (!missing.empty()) {
-		m_backend->prefetch(missing);
+		std::vector<RevisionFuture> f = m_backend->revisionsAsync(missing, diffstats);
+		futures.insert(futures.end(), f.begin(), f.end());
+	}
+
+	Locker locker(this);
+	for (size_t i = 0; i < futures.size(); i++) {
+		m_inflight[futures[i].id()] = futures[i];
 	}
 }
 
-// Returns the revision data for the given ID
-Revision *AbstractCache::revision(const std::string &id)
+// Waits for pending writes of the given revisions
+void AbstractCache::syncPending(const std::vector<std::string> &ids)
 {
-	if (!lookup(id)) {
-		PTRACE << "Cache miss: " << id << endl;
-		Revision *r = m_backend->revision(id);
-		put(id, *r);
+	if (m_writer == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (m_writer->pending(ids[i])) {
+			m_writer->sync();
+			break;
+		}
+	}
+}
+
+// Fetches a revision from the wrapped backend, using a shared diffstat if
+// one has been found during prefetching. If the diffstat should be linked
+// to a content-based key after writing the revision, the key is returned.
+Revision *AbstractCache::fetchUncached(const std::string &id, bool diffstats, std::string *key)
+{
+	key->clear();
+	DiffstatPtr stat;
+	RevisionFuture future;
+	{
+		// Prefetching may happen in another thread
+		Locker locker(this);
+		std::map<std::string, RevisionFuture>::iterator ft = m_inflight.find(id);
+		if (ft != m_inflight.end()) {
+			future = ft->second;
+			m_inflight.erase(ft);
+		}
+		std::map<std::string, DiffstatPtr>::iterator it = m_shared.find(id);
+		if (it != m_shared.end()) {
+			stat = it->second;
+			m_shared.erase(it);
+		}
+		std::map<std::string, std::string>::iterator jt = m_keys.find(id);
+		if (jt != m_keys.end()) {
+			*key = jt->second;
+			m_keys.erase(jt);
+		}
+	}
+
+	Stats::add(Stats::CacheMisses, m_direct);
+	Stats::Clock clock((diffstats && !stat) ? Stats::DiffstatFetch : Stats::MetaFetch, m_direct);
+	if (stat) {
+		PTRACE << "Shared diffstat hit: " << id << endl;
+		Revision *r = (future.valid() ? future.get() : m_backend->metaRevision(id));
+		r->m_diffstat = stat;
 		return r;
 	}
+	if (future.valid()) {
+		Revision *r = future.get();
+		if (diffstats && !r->m_diffstat) {
+			// Only the meta-data has been requested
+			r->m_diffstat = m_backend->diffstat(id);
+		}
+		return r;
+	}
+	return (diffstats ? m_backend->revision(id) : m_backend->metaRevision(id));
+}
 
-	PTRACE << "Cache hit: " << id << endl;
-	return get(id);
+// Waits until all revisions have been written to the cache and all
+// background loads have finished
+void AbstractCache::sync()
+{
+	if (m_busy) {
+		// The report thread has been interrupted by a signal while accessing
+		// the cache, so the writer would not be able to continue
+		PDEBUG << "Cache is busy, not waiting for pending writes" << endl;
+		return;
+	}
+	waitReadahead();
+	if (m_writer != NULL) {
+		m_writer->sync();
+	}
+	appendRollups();
+}
+
+// Waits for all loads on the global thread pool
+void AbstractCache::waitReadahead()
+{
+	sys::parallel::MutexLocker locker(&m_readaheadMutex);
+	for (size_t i = 0; i < m_readahead.size(); i++) {
+		m_readahead[i]->wait();
+		delete m_readahead[i];
+	}
+	m_readahead.clear();
+}
+
+// Checks which of the given revisions are already cached
+std::vector<bool> AbstractCache::lookupMany(const std::vector<std::string> &ids)
+{
+	std::vector<bool> cached(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		cached[i] = lookup(ids[i]);
+	}
+	return cached;
+}
+
+// Adds the given revisions to the cache
+void AbstractCache::putMany(const std::vector<Revision *> &revs)
+{
+	for (size_t i = 0; i < revs.size(); i++) {
+		put(revs[i]->id(), *revs[i]);
+	}
+}
+
+// Loads the given parts of the given revisions from the cache
+std::vector<Revision *> AbstractCache::getMany(const std::vector<std::string> &ids, int parts)
+{
+	std::vector<Revision *> revs;
+	revs.reserve(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		revs.push_back(get(ids[i], parts));
+	}
+	return revs;
+}
+
+// Returns the given parts of a revision, or NULL if it's not cached. The
+// default implementation looks the revision up before loading it.
+Revision *AbstractCache::getCached(const std::string &id, int parts)
+{
+	return (lookup(id) ? get(id, parts) : NULL);
+}
+
+// Batched version of getCached()
+std::vector<Revision *> AbstractCache::getCachedMany(const std::vector<std::string> &ids, int parts)
+{
+	std::vector<bool> cached = lookupMany(ids);
+	std::vector<std::string> hits;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (cached[i]) {
+			hits.push_back(ids[i]);
+		}
+	}
+
+	std::vector<Revision *> loaded = getMany(hits, parts), revs(ids.size(), (Revision *)NULL);
+	for (size_t i = 0, j = 0; i < ids.size(); i++) {
+		if (cached[i]) {
+			revs[i] = loaded[j++];
+		}
+	}
+	return revs;
+}
+
+// Writes all cached revisions of the repository to a compressed bundle
+// file, which can be imported by any cache implementation. Returns the
+// number of exported revisions.
+size_t AbstractCache::exportBundle(const std::string &path)
+{
+	flush();
+
+	std::vector<std::string> all;
+	{
+		Locker locker(this);
+		all = ids();
+	}
+	return writeBundle(path, all, false);
+}
+
+// Writes the k-th of n ranges of consecutive revisions on the main branch
+// to a bundle, retrieving uncached revisions from the repository. This
+// distributes filling the cache of a large repository over several
+// machines, whose bundles are then imported on one of them. Returns the
+// number of exported revisions.
+size_t AbstractCache::exportShard(const std::string &path, int k, int n)
+{
+	std::vector<std::string> all = history();
+	size_t begin = all.size() * (k-1) / n, end = all.size() * k / n;
+	std::vector<std::string> shard(all.begin() + begin, all.begin() + end);
+	Logger::info() << "Shard " << k << " of " << n << " contains revisions " << (begin+1) << " to " << end << " of " << all.size() << endl;
+	prefetch(shard);
+	size_t count = writeBundle(path, shard, true);
+	flush();
+	return count;
+}
+
+// Adds all revisions of the branch that are not cached yet, without
+// running a report. Revisions are requested from the wrapped backend one
+// window ahead and written in the background, and the cache is flushed
+// regularly, so an interrupted run continues where it stopped. Returns
+// the number of added revisions.
+size_t AbstractCache::warm()
+{
+	std::vector<std::string> all = history();
+	std::vector<std::string> missing = uncached(all);
+	Logger::info() << "Cache: " << (all.size() - missing.size()) << " of " << all.size() << " revisions already cached" << endl;
+	if (missing.empty()) {
+		return 0;
+	}
+
+	sys::datetime::Watch watch, status;
+	size_t flushed = 0;
+	request(std::vector<std::string>(missing.begin(), missing.begin() + std::min(missing.size(), size_t(WARM_WINDOW))), true);
+	for (size_t i = 0; i < missing.size(); i += WARM_WINDOW) {
+		size_t end = std::min(missing.size(), i + WARM_WINDOW);
+		if (end < missing.size()) {
+			request(std::vector<std::string>(missing.begin() + end, missing.begin() + std::min(missing.size(), end + WARM_WINDOW)), true);
+		}
+
+		std::vector<Revision *> revs = fetch(std::vector<std::string>(missing.begin() + i, missing.begin() + end), true);
+		for (size_t j = 0; j < revs.size(); j++) {
+			delete revs[j];
+		}
+
+		if (end - flushed >= WARM_FLUSH) {
+			flush();
+			flushed = end;
+		}
+		if (status.elapsedMSecs() > 1000) {
+			status.start();
+			Logger::status() << "\r\033[0K";
+			Logger::status() << "Warming cache... " << end << " of " << missing.size() << " revisions (" << (100 * end / missing.size()) << "%)" << ::flush;
+		}
+	}
+	m_backend->finalize();
+	flush();
+
+	float elapsed = watch.elapsed();
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Warming cache... done" << endl;
+	Logger::info() << "Cache: Added " << missing.size() << " revisions in " << str::printf("%.1f", elapsed) << " s ("
+		<< str::printf("%.1f", elapsed > 0 ? missing.size() / elapsed : 0.0f) << " revisions/s)" << endl;
+	return missing.size();
+}
+
+// Adds all revisions from a bundle file that are not cached yet. Bundles
+// of other repositories are rejected. Returns the number of imported
+// revisions.
+size_t AbstractCache::importBundle(const std::string &path)
+{
+	if (!sys::fs::fileExists(path)) {
+		throw PEX(str::printf("No such bundle: %s", path.c_str()));
+	}
+
+	GZIStream in(path);
+	std::string magic, id;
+	uint32_t version = 0;
+	uint64_t count = 0;
+	in >> magic >> version;
+	if (!in.ok() || magic != BUNDLE_MAGIC) {
+		throw PEX(str::printf("Not a cache bundle: %s", path.c_str()));
+	}
+	if (version != BUNDLE_VERSION) {
+		throw PEX(str::printf("Unknown bundle version number %u", version));
+	}
+	in >> id >> count;
+	if (id != cacheId(this)) {
+		throw PEX(str::printf("Bundle %s has been exported for a different repository (%s)", path.c_str(), id.c_str()));
+	}
+
+	Logger::status() << "Importing " << count << " revisions from bundle " << path << "... " << ::flush;
+	size_t imported = 0;
+	for (uint64_t i = 0; i < count; i += BUNDLE_BATCH) {
+		std::vector<Revision *> revs;
+		for (uint64_t j = i; j < std::min(count, i + BUNDLE_BATCH); j++) {
+			in >> id;
+			Revision *rev = new Revision(id);
+			revs.push_back(rev);
+			if (!rev->load(in)) {
+				for (size_t k = 0; k < revs.size(); k++) {
+					delete revs[k];
+				}
+				throw PEX(str::printf("Bundle %s is corrupted", path.c_str()));
+			}
+		}
+
+		// Don't store revisions twice
+		std::vector<Revision *> missing;
+		{
+			Locker locker(this);
+			missing = unindexed(revs);
+			putMany(missing);
+			addRollups(missing);
+		}
+		imported += missing.size();
+		for (size_t j = 0; j < revs.size(); j++) {
+			delete revs[j];
+		}
+	}
+	flush();
+	Logger::status() << "done" << endl;
+	return imported;
+}
+
+// Writes the given revisions to a bundle. If fetch is true, uncached
+// revisions are retrieved from the repository and added to the cache.
+size_t AbstractCache::writeBundle(const std::string &path, const std::vector<std::string> &ids, bool fetch)
+{
+	Logger::status() << "Exporting " << ids.size() << " revisions to bundle " << path << "... " << ::flush;
+	GZOStream out(path);
+	if (!out.ok()) {
+		throw PEX(str::printf("Unable to open bundle %s for writing", path.c_str()));
+	}
+	out << std::string(BUNDLE_MAGIC) << BUNDLE_VERSION << cacheId(this) << (uint64_t)ids.size();
+	for (size_t i = 0; i < ids.size(); i += BUNDLE_BATCH) {
+		std::vector<std::string> batch(ids.begin() + i, ids.begin() + std::min(ids.size(), i + BUNDLE_BATCH));
+		std::vector<Revision *> revs;
+		if (fetch) {
+			revs = revisions(batch);
+		} else {
+			Locker locker(this);
+			revs = getMany(batch, Revision::AllParts);
+		}
+		for (size_t j = 0; j < revs.size(); j++) {
+			out << revs[j]->m_id;
+			revs[j]->write(out);
+			delete revs[j];
+		}
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write bundle %s", path.c_str()));
+		}
+	}
+	Logger::status() << "done" << endl;
+	return ids.size();
+}
+
+// Reads a recorded log. Returns false if there is none for the given head.
+bool AbstractCache::readLog(const std::string &file, const std::string &head, std::vector<std::string> *ids)
+{
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic, recorded;
+	uint32_t version = 0;
+	uint64_t count = 0;
+	in >> magic >> version >> recorded >> count;
+	if (!in.ok() || magic != LOG_MAGIC || version != LOG_VERSION || recorded != head) {
+		return false;
+	}
+	ids->clear();
+	ids->reserve(count);
+	std::string id;
+	for (uint64_t i = 0; i < count; i++) {
+		in >> id;
+		ids->push_back(id);
+	}
+	return in.ok();
+}
+
+// Reads the line counts stored in the cache directory, if not done yet.
+// Records are appended to the file, so a truncated record at the end is
+// ignored.
+void AbstractCache::loadLineCounts()
+{
+	if (m_lineCountsLoaded) {
+		return;
+	}
+	m_lineCountsLoaded = true;
+
+	std::string file = cacheFile(this, "linecounts");
+	if (!sys::fs::fileExists(file)) {
+		return;
+	}
+
+	BIStream in(file);
+	std::string magic, key;
+	uint32_t version = 0;
+	in >> magic >> version;
+	if (!in.ok() || magic != LINES_MAGIC || version != LINES_VERSION) {
+		Logger::warn() << "Warning: Ignoring invalid line counts in " << file << endl;
+		return;
+	}
+	uint64_t count;
+	while (!in.eof()) {
+		in >> key >> count;
+		if (!in.ok()) {
+			break;
+		}
+		m_lineCounts[key] = count;
+	}
+	PDEBUG << "Cache: Loaded " << m_lineCounts.size() << " line counts" << endl;
+}
+
+// Returns the given revisions that are not in the cache yet, skipping
+// repeated ones. The cache has to be locked.
+std::vector<Revision *> AbstractCache::unindexed(const std::vector<Revision *> &revs)
+{
+	std::vector<std::string> ids;
+	for (size_t i = 0; i < revs.size(); i++) {
+		ids.push_back(revs[i]->m_id);
+	}
+	std::vector<bool> cached = lookupMany(ids);
+
+	std::vector<Revision *> missing;
+	std::set<std::string> seen;
+	for (size_t i = 0; i < revs.size(); i++) {
+		if (!cached[i] && seen.insert(ids[i]).second) {
+			missing.push_back(revs[i]);
+		}
+	}
+	return missing;
+}
+
+// Adds newly cached revisions to the rollups, if they are maintained
+void AbstractCache::addRollups(const std::vector<Revision *> &revs)
+{
+	if (!storesLogs()) {
+		return;
+	}
+
+	// Another process may have built the rollups in the meantime
+	sys::parallel::MutexLocker locker(&m_rollupsMutex);
+	if (m_rollupsState != RollupsPresent) {
+		m_rollupsState = (sys::fs::fileExists(cacheFile(this, "rollups")) ? RollupsPresent : RollupsMissing);
+	}
+	if (m_rollupsState == RollupsPresent) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			m_newRollups.add(revs[i]);
+		}
+	}
+}
+
+// Appends the sums of newly cached revisions to the rollups file. Other
+// processes may append to the same file, so the rows are summed when
+// reading it.
+void AbstractCache::appendRollups()
+{
+	sys::parallel::MutexLocker locker(&m_rollupsMutex);
+	if (m_newRollups.empty()) {
+		return;
+	}
+	std::string file = cacheFile(this, "rollups");
+	if (sys::fs::fileExists(file)) {
+		if (!m_newRollups.append(file)) {
+			Logger::warn() << "Warning: Unable to write rollups to " << file << endl;
+		}
+	} else {
+		// The cache has been cleared in the meantime
+		m_rollupsState = RollupsMissing;
+	}
+	m_newRollups.clear();
+}
+
+// Builds the rollups from all cached revisions and writes them to the
+// rollups file. Revisions added while reading are recorded as usual.
+void AbstractCache::buildRollups(Rollups *rollups)
+{
+	std::vector<std::string> all;
+	{
+		Locker locker(this);
+		all = ids();
+		sys::parallel::MutexLocker rlocker(&m_rollupsMutex);
+		m_rollupsState = RollupsPresent;
+		m_newRollups.clear();
+	}
+
+	Logger::status() << "Building rollups of " << all.size() << " cached revisions... " << ::flush;
+	for (size_t i = 0; i < all.size(); i += BUNDLE_BATCH) {
+		std::vector<std::string> batch(all.begin() + i, all.begin() + std::min(all.size(), i + BUNDLE_BATCH));
+		std::vector<Revision *> revs;
+		{
+			Locker locker(this);
+			revs = getMany(batch, Revision::MetaPart | Revision::DiffstatPart);
+		}
+		for (size_t j = 0; j < revs.size(); j++) {
+			rollups->add(revs[j]);
+			delete revs[j];
+		}
+	}
+	Logger::status() << "done" << endl;
+
+	std::string file = cacheFile(this, "rollups");
+	if (!rollups->write(file)) {
+		Logger::warn() << "Warning: Unable to write rollups to " << file << endl;
+	}
+	PDEBUG << "Cache: Built " << rollups->size() << " rollups from " << all.size() << " revisions" << endl;
+}
+
+// Returns the file name of the recorded log for the given branch and range
+std::string AbstractCache::logFile(const std::string &branch, int64_t start, int64_t end)
+{
+	std::string key = branch + '\0' + str::itos(start) + '\0' + str::itos(end);
+	return cacheFile(this, digestName("log_", key));
+}
+
+// Determines the revisions of a date-bounded log locally, using an index
+// of the commit dates along the complete log of the branch. This is only
+// possible if the backend's dates are ordered along its logs. The index
+// is built once the complete log has been recorded at the current head
+// and all of its revisions are cached. Returns false if there's no index.
+bool AbstractCache::datedLog(const std::string &branch, const std::string &head, int64_t start, int64_t end, std::vector<std::string> *ids)
+{
+	if (!orderedDates()) {
+		return false;
+	}
+
+	DateIndex &index = m_dates[branch];
+	if (index.head != head && !loadDateIndex(branch, head, &index)) {
+		m_dates.erase(branch);
+		return false;
+	}
+
+	// Same bounds as the backends: start < date <= end
+	const std::vector<int64_t> &dates = index.dates;
+	std::vector<int64_t>::const_iterator first = dates.begin(), last = dates.end();
+	if (start >= 0) {
+		first = std::upper_bound(dates.begin(), dates.end(), start);
+	}
+	if (end >= 0) {
+		last = std::upper_bound(first, dates.end(), end);
+	}
+	ids->assign(index.ids.begin() + (first - dates.begin()), index.ids.begin() + (last - dates.begin()));
+	return true;
+}
+
+// Reads the date index for the given branch and head, or builds it from
+// the recorded log and the cached revisions
+bool AbstractCache::loadDateIndex(const std::string &branch, const std::string &head, DateIndex *index)
+{
+	std::string file = cacheFile(this, digestName("dates_", branch));
+	if (readDateIndex(file, head, index)) {
+		return true;
+	}
+
+	std::vector<std::string> ids;
+	if (!readLog(logFile(branch, -1, -1), head, &ids)) {
+		return false;
+	}
+
+	std::vector<Revision *> revs;
+	{
+		Locker locker(this);
+		revs = getCachedMany(ids, Revision::MetaPart);
+	}
+	std::vector<int64_t> dates;
+	dates.reserve(revs.size());
+	for (size_t i = 0; i < revs.size(); i++) {
+		if (revs[i] != NULL && (dates.empty() || revs[i]->m_date >= dates.back())) {
+			dates.push_back(revs[i]->m_date);
+		}
+		delete revs[i];
+	}
+	if (dates.size() != ids.size()) {
+		PDEBUG << "Cache: Unable to build date index for branch '" << branch << "', " << dates.size() << " of " << ids.size() << " revisions usable" << endl;
+		return false;
+	}
+
+	index->head = head;
+	index->ids.swap(ids);
+	index->dates.swap(dates);
+	writeDateIndex(file, *index);
+	return true;
+}
+
+// Reads a tree listing, checking that it has been stored for the given key
+bool AbstractCache::readTree(const std::string &file, const std::string &key, std::vector<std::string> *paths)
+{
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic, recorded;
+	uint32_t version = 0;
+	uint64_t count = 0;
+	in >> magic >> version >> recorded >> count;
+	if (!in.ok() || magic != TREE_MAGIC || version != TREE_VERSION || recorded != key) {
+		return false;
+	}
+	paths->resize(count);
+	for (uint64_t i = 0; i < count; i++) {
+		in >> (*paths)[i];
+	}
+	return in.ok();
+}
+
+// Stores a tree listing
+void AbstractCache::writeTree(const std::string &file, const std::string &key, const std::vector<std::string> &paths)
+{
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		out << std::string(TREE_MAGIC) << TREE_VERSION << key << (uint64_t)paths.size();
+		for (size_t i = 0; i < paths.size(); i++) {
+			out << paths[i];
+		}
+		if (!out.ok()) {
+			Logger::warn() << "Warning: Unable to write tree listing to " << tmp << endl;
+			return;
+		}
+	}
+	sys::fs::rename(tmp, file);
+}
+
+// Reads a date index, checking that it has been built for the given head
+bool AbstractCache::readDateIndex(const std::string &file, const std::string &head, DateIndex *index)
+{
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic, recorded;
+	uint32_t version = 0;
+	uint64_t count = 0;
+	in >> magic >> version >> recorded >> count;
+	if (!in.ok() || magic != DATES_MAGIC || version != DATES_VERSION || recorded != head) {
+		return false;
+	}
+	index->ids.resize(count);
+	index->dates.resize(count);
+	for (uint64_t i = 0; i < count; i++) {
+		in >> index->ids[i] >> index->dates[i];
+	}
+	if (!in.ok()) {
+		return false;
+	}
+	index->head = head;
+	return true;
+}
+
+// Stores a date index
+void AbstractCache::writeDateIndex(const std::string &file, const DateIndex &index)
+{
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		out << std::string(DATES_MAGIC) << DATES_VERSION << index.head << (uint64_t)index.ids.size();
+		for (size_t i = 0; i < index.ids.size(); i++) {
+			out << index.ids[i] << index.dates[i];
+		}
+		if (!out.ok()) {
+			Logger::warn() << "Warning: Unable to write date index to " << tmp << endl;
+			return;
+		}
+	}
+	sys::fs::rename(tmp, file);
+	PDEBUG << "Cache: Built date index of " << index.ids.size() << " revisions at " << index.head << endl;
+}
+
+// Stores a log for the given head
+void AbstractCache::writeLog(const std::string &file, const std::string &head, const std::vector<std::string> &ids)
+{
+	// Write to a temporary file first, so concurrent readers never see a
+	// partial log
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		out << std::string(LOG_MAGIC) << LOG_VERSION << head << (uint64_t)ids.size();
+		for (size_t i = 0; i < ids.size(); i++) {
+			out << ids[i];
+		}
+		if (!out.ok()) {
+			Logger::warn() << "Warning: Unable to write log to " << tmp << endl;
+			return;
+		}
+	}
+	sys::fs::rename(tmp, file);
+	PDEBUG << "Cache: Recorded log of " << ids.size() << " revisions at " << head << endl;
+}
+
+// Checks whether the implementation stores logs for replaying them. By
+// default, this is not supported.
+bool AbstractCache::storesLogs() const
+{
+	return false;
+}
+
+// Removes the rollups file and drops the sums of new revisions
+void AbstractCache::dropRollups()
+{
+	sys::parallel::MutexLocker locker(&m_rollupsMutex);
+	std::string file = cacheDir() + "/rollups";
+	if (sys::fs::fileExists(file)) {
+		sys::fs::unlink(file);
+	}
+	m_rollupsState = RollupsMissing;
+	m_newRollups.clear();
+}
+
+// Removes unused data from the cache, if supported
+void AbstractCache::compact()
+{
+	PDEBUG << "Compaction is not supported by this cache" << endl;
+}
+
+// Checks whether the cache implementation supports shared diffstats
+bool AbstractCache::sharesDiffstats() const
+{
+	return false;
+}
+
+// Returns the diffstat linked to the given key, or a NULL pointer
+DiffstatPtr AbstractCache::getShared(const std::string &)
+{
+	return DiffstatPtr();
+}
+
+// Links the diffstat of a cached revision to the given key
+void AbstractCache::link(const std::string &, const std::string &)
+{
+
+}
+
+// Lists all cached revisions. The default implementation doesn't support
+// this.
+std::vector<std::string> AbstractCache::ids()
+{
+	throw PEX("Listing cached revisions is not supported by this cache");
+}
+
+// Returns the given parts of a cached revision, or NULL if it's not in
+// the cache
+Revision *AbstractCache::cached(const std::string &id, int parts)
+{
+	Revision *r = remembered(id, parts);
+	if (r != NULL) {
+		return r;
+	}
+	if (m_writer != NULL && m_writer->pending(id)) {
+		m_writer->sync();
+	}
+
+	{
+		Locker locker(this);
+		r = getCached(id, parts);
+	}
+	if (r != NULL && !complete(r)) {
+		delete r;
+		return NULL;
+	}
+	if (r != NULL) {
+		remember(r, parts);
+	}
+	return r;
+}
+
+// Batched version of cached(), waiting for pending writes of the given
+// revisions only if they are not in memory
+std::vector<Revision *> AbstractCache::cachedMany(const std::vector<std::string> &ids, int parts, bool background)
+{
+	std::vector<Revision *> revs(ids.size(), (Revision *)NULL);
+	std::vector<std::string> missing;
+	std::vector<size_t> indices;
+	for (size_t i = 0; i < ids.size(); i++) {
+		revs[i] = remembered(ids[i], parts);
+		if (revs[i] == NULL) {
+			missing.push_back(ids[i]);
+			indices.push_back(i);
+		}
+	}
+	if (missing.empty()) {
+		return revs;
+	}
+
+	if (!background) {
+		syncPending(missing);
+	}
+	std::vector<Revision *> loaded;
+	{
+		Locker locker(this, !background);
+		loaded = getCachedMany(missing, parts);
+	}
+	for (size_t i = 0; i < loaded.size(); i++) {
+		if (loaded[i] != NULL && !complete(loaded[i])) {
+			delete loaded[i];
+			loaded[i] = NULL;
+		}
+		if (loaded[i] != NULL) {
+			remember(loaded[i], parts);
+		}
+		revs[indices[i]] = loaded[i];
+	}
+	return revs;
+}
+
+// Runs the given function on the global thread pool
+void AbstractCache::readahead(const std::function<void()> &func)
+{
+	sys::parallel::MutexLocker locker(&m_readaheadMutex);
+	while (!m_readahead.empty() && m_readahead.front()->done()) {
+		delete m_readahead.front();
+		m_readahead.pop_front();
+	}
+	Readahead *task = new Readahead(func);
+	m_readahead.push_back(task);
+	sys::parallel::ThreadPool::global()->submit(task);
+}
+
+// Loads the given parts of the first cached revisions of the list in the
+// background and keeps them in memory, so they can be returned right away
+// once they are requested
+void AbstractCache::remember(const std::vector<std::string> &ids, int parts)
+{
+	if (m_memoryLimit == 0) {
+		return;
+	}
+
+	std::vector<std::string> unknown;
+	{
+		sys::parallel::MutexLocker locker(&m_memoryMutex);
+		for (size_t i = 0; i < ids.size() && unknown.size() < size_t(ReadaheadSize); i++) {
+			std::unordered_map<std::string, std::list<std::pair<std::string, MemoryEntry> >::iterator>::const_iterator it = m_memoryIndex.find(ids[i]);
+			if (it == m_memoryIndex.end() || (it->second->second.parts & parts) != parts) {
+				unknown.push_back(ids[i]);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < unknown.size(); i += LoadBatchSize) {
+		std::vector<std::string> batch(unknown.begin() + i, unknown.begin() + std::min(unknown.size(), i + LoadBatchSize));
+		readahead([this, batch, parts]() {
+			std::vector<Revision *> revs;
+			{
+				Locker locker(this, false);
+				revs = getCachedMany(batch, parts);
+			}
+			for (size_t j = 0; j < revs.size(); j++) {
+				if (revs[j] != NULL && complete(revs[j])) {
+					remember(revs[j], parts);
+				}
+				delete revs[j];
+			}
+		});
+	}
+}
+
+// Returns a copy of the given parts of a revision that is kept in memory,
+// or NULL if some of them are not available
+Revision *AbstractCache::remembered(const std::string &id, int parts)
+{
+	if (m_memoryLimit == 0) {
+		return NULL;
+	}
+
+	sys::parallel::MutexLocker locker(&m_memoryMutex);
+	std::unordered_map<std::string, std::list<std::pair<std::string, MemoryEntry> >::iterator>::iterator it = m_memoryIndex.find(id);
+	if (it == m_memoryIndex.end() || (it->second->second.parts & parts) != parts) {
+		Stats::add(Stats::MemoryMisses);
+		return NULL;
+	}
+	m_memory.splice(m_memory.begin(), m_memory, it->second);
+	Stats::add(Stats::MemoryHits);
+	return copy(it->second->second.rev, parts);
+}
+
+// Keeps a copy of the given parts of a revision in memory, merging them
+// with the parts that are already known. The least recently used
+// revisions are dropped once the memory limit is reached.
+void AbstractCache::remember(const Revision *rev, int parts)
+{
+	if (m_memoryLimit == 0) {
+		return;
+	}
+
+	Revision *r = copy(rev, parts);
+	sys::parallel::MutexLocker locker(&m_memoryMutex);
+	std::unordered_map<std::string, std::list<std::pair<std::string, MemoryEntry> >::iterator>::iterator it = m_memoryIndex.find(r->m_id);
+	if (it != m_memoryIndex.end()) {
+		MemoryEntry &e = it->second->second;
+		if ((e.parts & parts) == parts) {
+			m_memory.splice(m_memory.begin(), m_memory, it->second);
+			delete r;
+			return;
+		}
+		if ((e.parts & Revision::MetaPart) && !(parts & Revision::MetaPart)) {
+			r->m_date = e.rev->m_date;
+			r->m_author = e.rev->m_author;
+		}
+		if ((e.parts & Revision::MessagePart) && !(parts & Revision::MessagePart)) {
+			r->m_message = e.rev->m_message;
+		}
+		if ((e.parts & Revision::DiffstatPart) && !(parts & Revision::DiffstatPart)) {
+			r->m_diffstat = e.rev->m_diffstat;
+		}
+		parts |= e.parts;
+		m_memorySize -= e.size;
+		delete e.rev;
+		m_memory.erase(it->second);
+		m_memoryIndex.erase(it);
+	}
+
+	MemoryEntry e;
+	e.rev = r;
+	e.parts = parts;
+	e.size = sizeof(Revision) + r->m_id.capacity() + r->m_message.capacity() + (r->m_diffstat ? r->m_diffstat->footprint() : 0);
+	if (e.size > m_memoryLimit / 4) {
+		delete r;
+		return;
+	}
+	m_memory.push_front(std::make_pair(r->m_id, e));
+	m_memoryIndex[r->m_id] = m_memory.begin();
+	m_memorySize += e.size;
+	while (m_memorySize > m_memoryLimit) {
+		m_memorySize -= m_memory.back().second.size;
+		delete m_memory.back().second.rev;
+		m_memoryIndex.erase(m_memory.back().first);
+		m_memory.pop_back();
+	}
+}
+
+// Limits the memory used for keeping decoded revisions, where 0 disables
+// keeping them
+void AbstractCache::setMemoryLimit(size_t bytes)
+{
+	forget();
+	m_memoryLimit = bytes;
+}
+
+// Drops all revisions kept in memory
+void AbstractCache::forget()
+{
+	sys::parallel::MutexLocker locker(&m_memoryMutex);
+	for (std::list<std::pair<std::string, MemoryEntry> >::iterator it = m_memory.begin(); it != m_memory.end(); ++it) {
+		delete it->second.rev;
+	}
+	m_memory.clear();
+	m_memoryIndex.clear();
+	m_memorySize = 0;
+}
+
+// Checks whether the diffstat of a cached revision, if loaded, provides
+// all data that the backend would. Diffstats without byte counts need to
+// be fetched again unless only line counts are requested.
+bool AbstractCache::complete(const Revision *rev) const
+{
+	if (!rev->m_diffstat || rev->m_diffstat->hasBytes() || m_linesOnly) {
+		return true;
+	}
+	PTRACE << "Cached diffstat of " << rev->id() << " lacks byte counts" << endl;
+	return false;
+}
+
+// Queues copies of the given revisions for writing in the background,
+// together with the keys their diffstats should be linked to
+void AbstractCache::writeBehind(const std::vector<Revision *> &revs, const std::vector<std::string> &keys)
+{
+	if (m_writer == NULL) {
+		m_writer = new Writer(this);
+		m_writer->start();
+	}
+
+	std::vector<Revision *> copies(revs.size());
+	for (size_t i = 0; i < revs.size(); i++) {
+		copies[i] = copy(revs[i]);
+	}
+	m_writer->push(copies, keys);
+}
+
+// Returns a copy of the given revision, which may be modified by the
+// report thread while being written. Diffstats are immutable and shared.
+Revision *AbstractCache::copy(const Revision *rev)
+{
+	return new Revision(rev->m_id, rev->m_date, rev->m_author, rev->m_message, rev->m_diffstat);
+}
+
+// Returns a copy of the given parts of a revision, sharing the diffstat
+Revision *AbstractCache::copy(const Revision *rev, int parts)
+{
+	Revision *r = new Revision(rev->m_id, 0, std::string(), std::string(), DiffstatPtr());
+	if (parts & Revision::MetaPart) {
+		r->m_date = rev->m_date;
+		r->m_author = rev->m_author;
+	}
+	if (parts & Revision::MessagePart) {
+		r->m_message = rev->m_message;
+	}
+	if ((parts & Revision::DiffstatPart) && rev->m_diffstat) {
+		r->m_diffstat = rev->m_diffstat;
+	}
+	return r;
 }
 
 // Returns the full path for a cache file for the given backend
 std::string AbstractCache::cacheFile(Backend *backend, const std::string &name)
 {
-	std::string dir = backend->options().cacheDir() + "/" + backend->uuid();
+	std::string dir = backend->options().cacheDir() + "/" + cacheId(backend);
 	checkDir(dir);
 	return dir + "/" + sys::fs::escape(name);
 }
 
+// Returns the name of the cache directory for the given backend. Caches
+// are usually separated by repository UUID, but users may specify a
+// common ID for all clones and forks of a repository.
+std::string AbstractCache::cacheId(Backend *backend)
+{
+	std::string id = backend->options().cacheId();
+	id = (id.empty() ? backend->uuid() : sys::fs::escape(id));
+
+	// Diffstats without excluded paths are kept apart from complete ones
+	std::vector<std::string> excludes = backend->options().excludes();
+	if (!excludes.empty()) {
+		std::string key = str::join(excludes, ",");
+		unsigned char digest[20];
+		utils::sha1(key.data(), key.length(), digest);
+		id += "_exclude_";
+		for (size_t i = 0; i < 4; i++) {
+			id += str::printf("%02x", digest[i]);
+		}
+	}
+	if (backend->options().diffLimit() > 0) {
+		id += str::printf("_limit_%d", backend->options().diffLimit());
+	}
+	if (backend->options().approximateDiffstats()) {
+		id += "_approx";
+	}
+	return id;
+}
+
 // Returns the current cache directory
 std::string AbstractCache::cacheDir()
 {
-	return m_opts.cacheDir() + "/" + uuid();
+	return m_opts.cacheDir() + "/" + cacheId(this);
 }
 
 // Ensures that the cache dir is writable and exists
@@ -15,14 +15,28 @@
 #define ABSTRACTCACHE_H_
 
 
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <signal.h>
+
 #include "backend.h"
 
+#include "syslib/parallel.h"
+
 class Revision;
 
 
 // This cache should be transparent and inherits the wrapped class
 class AbstractCache : public Backend
 {
+	public:
+		// Number of cached revisions loaded at once by revisionsAsync(), and
+		// the maximum number of cached revisions read ahead by prefetch()
+		enum { LoadBatchSize = 64, ReadaheadSize = 1024 };
+
 	public:
 		AbstractCache(Backend *backend, const Options &options);
 		virtual ~AbstractCache();
@@ -39,32 +53,175 @@ class AbstractCache : public Backend
 		std::vector<std::string> branches() { return m_backend->branches(); }
 		std::vector<Tag> tags() { return m_backend->tags(); }
 		DiffstatPtr diffstat(const std::string &id);
-		void filterDiffstat(DiffstatPtr stat) { m_backend->filterDiffstat(stat); }
-		std::vector<std::string> tree(const std::string &id = std::string()) { return m_backend->tree(id); }
-		std::string cat(const std::string &path, const std::string &id = std::string()) { return m_backend->cat(path, id); };
+		DiffstatPtr filterDiffstat(DiffstatPtr stat) { return m_backend->filterDiffstat(stat); }
+		std::vector<std::string> tree(const std::string &id = std::string());
+		std::string cat(const std::string &path, const std::string &id = std::string());
+		std::vector<std::string> catMany(const std::vector<std::string> &paths, const std::string &id = std::string());
+		std::string treeKey(const std::string &id = std::string()) { return m_backend->treeKey(id); }
 
-		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1) { return m_backend->iterator(branch, start, end); }
+		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter());
 		void prefetch(const std::vector<std::string> &ids);
 		Revision *revision(const std::string &id);
+		std::vector<Revision *> revisions(const std::vector<std::string> &ids);
+		void prefetchMeta(const std::vector<std::string> &ids);
+		Revision *metaRevision(const std::string &id);
+		std::vector<Revision *> metaRevisions(const std::vector<std::string> &ids);
+		std::vector<RevisionFuture> revisionsAsync(const std::vector<std::string> &ids, bool diffstats = true);
+		bool inFlight(const std::string &id);
+		std::vector<std::string> diffstatKeys(const std::vector<std::string> &ids) { return m_backend->diffstatKeys(ids); }
+		std::map<std::string, uint64_t> lineCounts(const std::string &id = std::string());
+		std::vector<std::string> treeKeys(const std::string &id, std::vector<std::string> *paths) { return m_backend->treeKeys(id, paths); }
+		std::vector<uint64_t> countLines(const std::vector<std::string> &paths, const std::string &id) { return m_backend->countLines(paths, id); }
+		bool orderedDates() const { return m_backend->orderedDates(); }
 		void finalize() { m_backend->finalize(); }
+		std::vector<std::string> watchPaths() { return m_backend->watchPaths(); }
+		bool rollups(Rollups::Key key, int64_t start, int64_t end, std::vector<Rollups::Row> *rows);
 
 		static std::string cacheFile(Backend *backend, const std::string &name);
+		static std::string cacheId(Backend *backend);
 
 		virtual void flush() = 0;
 		virtual void check(bool force = false) = 0;
+		virtual void compact();
+
+		void sync();
+
+		size_t exportBundle(const std::string &path);
+		size_t exportShard(const std::string &path, int k, int n);
+		size_t warm();
+		size_t importBundle(const std::string &path);
 
 	protected:
 		std::string cacheDir();
 
 		virtual bool lookup(const std::string &id) = 0;
 		virtual void put(const std::string &id, const Revision &rev) = 0;
-		virtual Revision *get(const std::string &id) = 0;
+		virtual Revision *get(const std::string &id, int parts) = 0;
+
+		// Batched versions of the functions above
+		virtual std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		virtual void putMany(const std::vector<Revision *> &revs);
+		virtual std::vector<Revision *> getMany(const std::vector<std::string> &ids, int parts);
+
+		// Combined lookups and loads, returning NULL for uncached revisions
+		virtual Revision *getCached(const std::string &id, int parts);
+		virtual std::vector<Revision *> getCachedMany(const std::vector<std::string> &ids, int parts);
+
+		// Diffstats shared by revisions with equal content-based keys. Caches
+		// supporting this link the key to the diffstat of a cached revision.
+		virtual bool sharesDiffstats() const;
+		virtual DiffstatPtr getShared(const std::string &key);
+		virtual void link(const std::string &key, const std::string &id);
+
+		// Recorded logs, replayed while the branch head is unchanged, and
+		// line counts of files. Both are stored in the cache directory.
+		virtual bool storesLogs() const;
+
+		// Lists all cached revisions, if supported
+		virtual std::vector<std::string> ids();
 
 		static void checkDir(const std::string &path, bool *created = NULL);
 
+		// Limits the memory used for keeping decoded revisions
+		void setMemoryLimit(size_t bytes);
+
+		// Removes the rollups, e.g. when checking the cache. They are
+		// rebuilt from the cached revisions when needed.
+		void dropRollups();
+
+	private:
+		class Batch;
+		class Locker;
+		class LogRecorder;
+		class Readahead;
+		class Writer;
+
+		// Decoded revision kept in memory, with the parts that are available
+		struct MemoryEntry
+		{
+			Revision *rev;
+			int parts;
+			size_t size;
+		};
+
+		// Whether the rollups file exists, so new revisions are added to it
+		enum RollupsState {
+			RollupsUnknown,
+			RollupsMissing,
+			RollupsPresent
+		};
+
+		// Commit dates along the complete log of a branch
+		struct DateIndex
+		{
+			std::string head;
+			std::vector<std::string> ids;
+			std::vector<int64_t> dates; // Ascending
+		};
+
+		std::vector<std::string> history();
+		std::vector<std::string> uncached(const std::vector<std::string> &ids);
+		void request(const std::vector<std::string> &ids, bool diffstats);
+		void syncPending(const std::vector<std::string> &ids);
+		std::vector<Revision *> fetch(const std::vector<std::string> &ids, bool diffstats);
+		Revision *fetchUncached(const std::string &id, bool diffstats, std::string *key);
+		Revision *cached(const std::string &id, int parts);
+		std::vector<Revision *> cachedMany(const std::vector<std::string> &ids, int parts, bool background = false);
+		void readahead(const std::function<void()> &func);
+		void waitReadahead();
+		void remember(const std::vector<std::string> &ids, int parts);
+		Revision *remembered(const std::string &id, int parts);
+		void remember(const Revision *rev, int parts);
+		void forget();
+		bool complete(const Revision *rev) const;
+		size_t writeBundle(const std::string &path, const std::vector<std::string> &ids, bool fetch);
+		void writeBehind(const std::vector<Revision *> &revs, const std::vector<std::string> &keys);
+		static Revision *copy(const Revision *rev);
+		static Revision *copy(const Revision *rev, int parts);
+		std::string logFile(const std::string &branch, int64_t start, int64_t end);
+		bool datedLog(const std::string &branch, const std::string &head, int64_t start, int64_t end, std::vector<std::string> *ids);
+		bool loadDateIndex(const std::string &branch, const std::string &head, DateIndex *index);
+		static bool readTree(const std::string &file, const std::string &key, std::vector<std::string> *paths);
+		static void writeTree(const std::string &file, const std::string &key, const std::vector<std::string> &paths);
+		static bool readDateIndex(const std::string &file, const std::string &head, DateIndex *index);
+		static void writeDateIndex(const std::string &file, const DateIndex &index);
+		void loadLineCounts();
+		std::vector<Revision *> unindexed(const std::vector<Revision *> &revs);
+		void addRollups(const std::vector<Revision *> &revs);
+		void appendRollups();
+		void buildRollups(Rollups *rollups);
+		static bool readLog(const std::string &file, const std::string &head, std::vector<std::string> *ids);
+		static void writeLog(const std::string &file, const std::string &head, const std::vector<std::string> &ids);
+
 	protected:
 		Backend *m_backend;
 		std::string m_uuid; // Cached backend UUID
+
+	private:
+		Writer *m_writer;
+		std::deque<Readahead *> m_readahead; // Loads running on the global thread pool
+		sys::parallel::Mutex m_readaheadMutex;
+		std::map<std::string, std::string> m_keys; // Keys of prefetched revisions
+		std::map<std::string, DiffstatPtr> m_shared; // Shared diffstats of prefetched revisions
+		std::map<std::string, RevisionFuture> m_inflight; // Requested from the backend, but not claimed yet
+		std::map<std::string, DateIndex> m_dates; // Date indexes by branch
+		std::map<std::string, uint64_t> m_lineCounts; // Line counts by file key
+		bool m_lineCountsLoaded;
+		std::list<std::pair<std::string, std::string> > m_contents; // Recently read files, most recent first
+		std::unordered_map<std::string, std::list<std::pair<std::string, std::string> >::iterator> m_contentIndex;
+		size_t m_contentSize;
+		sys::parallel::Mutex m_contentMutex;
+		RollupsState m_rollupsState;
+		Rollups m_newRollups; // Sums of revisions added since the last sync
+		sys::parallel::Mutex m_rollupsMutex;
+		std::list<std::pair<std::string, MemoryEntry> > m_memory; // Recently used revisions, most recent first
+		std::unordered_map<std::string, std::list<std::pair<std::string, MemoryEntry> >::iterator> m_memoryIndex;
+		size_t m_memorySize, m_memoryLimit;
+		sys::parallel::Mutex m_memoryMutex;
+		sys::parallel::Mutex m_mutex; // Serializes access to the cache implementation
+		volatile sig_atomic_t m_busy; // Set while the report thread holds the mutex
+		bool m_direct; // Whether the wrapped backend is the repository, not another cache
+		bool m_linesOnly; // Whether diffstats without byte counts are sufficient
 };
 
 
@@ -0,0 +1,494 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: aggregator.cpp
+ * Native group-by aggregation of revision data
+ *
+ * Many reports build per-author or per-directory sums of diffstat values
+ * and derive cumulative series from them. Doing this in Lua means
+ * creating tables and strings for every file of every revision, so the
+ * Aggregator does it natively instead: revisions are split into (key,
+ * value) events once, and the results are returned as arrays that can be
+ * passed to the plotting functions directly.
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <map>
+
+#include "authortable.h"
+#include "luahelpers.h"
+#include "revision.h"
+#include "strlib.h"
+
+#include "aggregator.h"
+
+
+namespace
+{
+
+// Scales a value, keeping it exact for unscaled additions
+inline int64_t weigh(int64_t value, double scale)
+{
+	return (scale == 1.0 ? value : int64_t(llround(value * scale)));
+}
+
+} // anonymous namespace
+
+
+// Constructor. The parameter is the bucket size in seconds for date keys
+// and the maximum directory depth for directory keys (0 means unlimited).
+Aggregator::Aggregator(Key key, Value value, int64_t param)
+	: m_key(key), m_value(value), m_param(param)
+{
+	if (m_key == Date && m_param <= 0) {
+		m_param = 86400;
+	}
+}
+
+// Destructor
+Aggregator::~Aggregator()
+{
+
+}
+
+// Checks whether revisions need to provide diffstats
+bool Aggregator::needsDiffstats() const
+{
+	return (m_key == Directory || m_key == Extension || m_value != Commits);
+}
+
+// Adds a revision to the aggregation. Values are multiplied with the
+// given scale, e.g. for revisions of a sampled iteration that stand for
+// several revisions each.
+void Aggregator::add(const Revision *revision, double scale)
+{
+	uint32_t rev = m_dates.size();
+	if (m_key == Author || m_key == Date) {
+		uint32_t key;
+		if (m_key == Author) {
+			// Revisions without an author are ignored, just like the
+			// reports used to do it
+			if (revision->m_author == 0) {
+				return;
+			}
+			key = authorKeyId(revision->m_author);
+		} else {
+			int64_t date = revision->m_date;
+			date -= (((date % m_param) + m_param) % m_param);
+			key = keyId(str::itos(date));
+		}
+
+		Diffstat::Stat stat;
+		if (m_value != Commits && revision->m_diffstat) {
+			stat = revision->m_diffstat->total();
+		}
+
+		Event e;
+		e.revision = rev;
+		e.key = key;
+		switch (m_value) {
+			case Commits: e.value = 1; break;
+			case LinesAdded: e.value = stat.ladd; break;
+			case LinesRemoved: e.value = stat.ldel; break;
+			case Lines: e.value = int64_t(stat.ladd) - int64_t(stat.ldel); break;
+			case BytesAdded: e.value = stat.cadd; break;
+			case BytesRemoved: e.value = stat.cdel; break;
+		}
+		e.value = weigh(e.value, scale);
+		m_events.push_back(e);
+		m_totals[e.key] += e.value;
+		m_dates.push_back(revision->m_date);
+		return;
+	}
+
+	// Per-file keys: merge the values of all files with the same key, so
+	// there's a single event per key and revision
+	m_dates.push_back(revision->m_date);
+	if (!revision->m_diffstat) {
+		return;
+	}
+	size_t first = m_events.size();
+	const Diffstat::Entries &entries = revision->m_diffstat->entries();
+	for (size_t i = 0; i < entries.size(); i++) {
+		std::string key = fileKey(Diffstat::path(entries[i].first));
+		if (key.empty()) {
+			continue;
+		}
+
+		const Diffstat::Stat &stat = entries[i].second;
+		int64_t value = 0;
+		switch (m_value) {
+			case Commits: value = 0; break;
+			case LinesAdded: value = stat.ladd; break;
+			case LinesRemoved: value = stat.ldel; break;
+			case Lines: value = int64_t(stat.ladd) - int64_t(stat.ldel); break;
+			case BytesAdded: value = stat.cadd; break;
+			case BytesRemoved: value = stat.cdel; break;
+		}
+		value = weigh(value, scale);
+
+		uint32_t id = keyId(key);
+		size_t j = first;
+		while (j < m_events.size() && m_events[j].key != id) {
+			++j;
+		}
+		if (j == m_events.size()) {
+			Event e;
+			e.revision = rev;
+			e.key = id;
+			e.value = (m_value == Commits ? weigh(1, scale) : 0);
+			m_events.push_back(e);
+			m_totals[id] += e.value;
+		}
+		m_events[j].value += value;
+		m_totals[id] += value;
+	}
+}
+
+// Returns the number of revisions that have been added
+size_t Aggregator::count() const
+{
+	return m_dates.size();
+}
+
+// Returns all keys, in order of appearance
+std::vector<std::string> Aggregator::keys() const
+{
+	return m_keys;
+}
+
+// Returns the aggregated value for the given key
+int64_t Aggregator::total(const std::string &key) const
+{
+	std::unordered_map<std::string, uint32_t>::const_iterator it = m_keyIds.find(key);
+	if (it == m_keyIds.end()) {
+		return 0;
+	}
+	return m_totals[it->second];
+}
+
+// Returns the n keys with the largest aggregated values (all keys for n = 0)
+std::vector<std::pair<std::string, int64_t> > Aggregator::top(size_t n) const
+{
+	std::vector<uint32_t> ids(m_keys.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		ids[i] = i;
+	}
+	struct cmp {
+		const std::vector<int64_t> &totals;
+		cmp(const std::vector<int64_t> &totals) : totals(totals) { }
+		bool operator()(uint32_t a, uint32_t b) const { return totals[a] > totals[b]; }
+	};
+	std::stable_sort(ids.begin(), ids.end(), cmp(m_totals));
+	if (n > 0 && n < ids.size()) {
+		ids.resize(n);
+	}
+
+	std::vector<std::pair<std::string, int64_t> > result(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		result[i] = std::make_pair(m_keys[ids[i]], m_totals[ids[i]]);
+	}
+	return result;
+}
+
+// Returns all keys with their aggregated values, sorted by key. Date keys
+// are sorted numerically.
+std::vector<std::pair<std::string, int64_t> > Aggregator::histogram() const
+{
+	std::vector<std::pair<std::string, int64_t> > result;
+	if (m_key == Date) {
+		std::map<int64_t, int64_t> sorted;
+		for (size_t i = 0; i < m_keys.size(); i++) {
+			int64_t date = 0;
+			str::stoi(m_keys[i], &date);
+			sorted[date] = m_totals[i];
+		}
+		for (std::map<int64_t, int64_t>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+			result.push_back(std::make_pair(str::itos(it->first), it->second));
+		}
+	} else {
+		std::map<std::string, int64_t> sorted;
+		for (size_t i = 0; i < m_keys.size(); i++) {
+			sorted[m_keys[i]] = m_totals[i];
+		}
+		result.assign(sorted.begin(), sorted.end());
+	}
+	return result;
+}
+
+// Generates cumulative series for the given keys. There's one data point for
+// every added revision in chronological order, except for revisions prior
+// to start, which are accumulated but not included.
+void Aggregator::series(const std::vector<std::string> &keys, int64_t start, std::vector<int64_t> *dates, std::vector<std::vector<int64_t> > *values) const
+{
+	dates->clear();
+	values->clear();
+
+	// Map key IDs to columns
+	std::vector<int> column(m_keys.size(), -1);
+	for (size_t i = 0; i < keys.size(); i++) {
+		std::unordered_map<std::string, uint32_t>::const_iterator it = m_keyIds.find(keys[i]);
+		if (it != m_keyIds.end()) {
+			column[it->second] = i;
+		}
+	}
+
+	// Events are ordered by revision, so the events of each revision can be
+	// found by their offset
+	std::vector<uint32_t> offsets(m_dates.size() + 1, m_events.size());
+	for (size_t i = m_events.size(); i > 0; i--) {
+		offsets[m_events[i-1].revision] = i-1;
+	}
+	for (size_t i = m_dates.size(); i > 0; i--) {
+		offsets[i-1] = std::min(offsets[i-1], offsets[i]);
+	}
+
+	std::vector<uint32_t> order(m_dates.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	struct cmp {
+		const std::vector<int64_t> &dates;
+		cmp(const std::vector<int64_t> &dates) : dates(dates) { }
+		bool operator()(uint32_t a, uint32_t b) const { return dates[a] < dates[b]; }
+	};
+	std::stable_sort(order.begin(), order.end(), cmp(m_dates));
+
+	std::vector<int64_t> current(keys.size(), 0);
+	for (size_t i = 0; i < order.size(); i++) {
+		uint32_t rev = order[i];
+		for (size_t j = offsets[rev]; j < offsets[rev+1]; j++) {
+			if (column[m_events[j].key] >= 0) {
+				current[column[m_events[j].key]] += m_events[j].value;
+			}
+		}
+		if (start < 0 || m_dates[rev] >= start) {
+			dates->push_back(m_dates[rev]);
+			values->push_back(current);
+		}
+	}
+}
+
+// Converts a key name to the corresponding enum value
+bool Aggregator::parseKey(const std::string &name, Key *key)
+{
+	if (name == "author") *key = Author;
+	else if (name == "date") *key = Date;
+	else if (name == "directory") *key = Directory;
+	else if (name == "extension") *key = Extension;
+	else return false;
+	return true;
+}
+
+// Converts a value name to the corresponding enum value
+bool Aggregator::parseValue(const std::string &name, Value *value)
+{
+	if (name == "commits") *value = Commits;
+	else if (name == "lines_added") *value = LinesAdded;
+	else if (name == "lines_removed") *value = LinesRemoved;
+	else if (name == "lines") *value = Lines;
+	else if (name == "bytes_added") *value = BytesAdded;
+	else if (name == "bytes_removed") *value = BytesRemoved;
+	else return false;
+	return true;
+}
+
+// Returns the ID of the given key, adding it if necessary
+uint32_t Aggregator::keyId(const std::string &key)
+{
+	std::unordered_map<std::string, uint32_t>::const_iterator it = m_keyIds.find(key);
+	if (it != m_keyIds.end()) {
+		return it->second;
+	}
+	uint32_t id = m_keys.size();
+	m_keys.push_back(key);
+	m_keyIds[key] = id;
+	m_totals.push_back(0);
+	return id;
+}
+
+// Returns the key ID for the given author ID. Key IDs of authors are
+// cached, so the name doesn't have to be hashed for each revision.
+uint32_t Aggregator::authorKeyId(uint32_t author)
+{
+	if (author >= m_authorKeys.size()) {
+		m_authorKeys.resize(author + 1, 0);
+	}
+	if (m_authorKeys[author] == 0) {
+		m_authorKeys[author] = keyId(AuthorTable::name(author)) + 1;
+	}
+	return m_authorKeys[author] - 1;
+}
+
+// Returns the key for a file, i.e. its directory or its lower-case extension
+// (including the dot). Files without an extension have an empty key.
+std::string Aggregator::fileKey(const std::string &path) const
+{
+	size_t slash = path.find_last_of('/');
+	if (m_key == Extension) {
+		size_t base = (slash == std::string::npos ? 0 : slash + 1);
+		size_t dot = path.find_last_of('.');
+		if (dot == std::string::npos || dot < base || dot + 1 == path.length()) {
+			return std::string();
+		}
+		std::string ext = path.substr(dot);
+		for (size_t i = 0; i < ext.length(); i++) {
+			ext[i] = tolower(ext[i]);
+		}
+		return ext;
+	}
+
+	// Files in the root directory are grouped as "/"
+	if (slash == std::string::npos || slash == 0) {
+		return std::string("/");
+	}
+	if (m_param <= 0) {
+		return path.substr(0, slash);
+	}
+	size_t end = 0;
+	for (int64_t depth = 0; depth < m_param; depth++) {
+		end = path.find('/', end + (depth > 0 ? 1 : 0));
+		if (end == std::string::npos || end > slash) {
+			end = slash;
+			break;
+		}
+	}
+	return path.substr(0, end);
+}
+
+
+/*
+ * Lua binding
+ */
+
+const char Aggregator::className[] = "aggregator";
+Lunar<Aggregator>::RegType Aggregator::methods[] = {
+	LUNAR_DECLARE_METHOD(Aggregator, add),
+	LUNAR_DECLARE_METHOD(Aggregator, count),
+	LUNAR_DECLARE_METHOD(Aggregator, totals),
+	LUNAR_DECLARE_METHOD(Aggregator, top),
+	LUNAR_DECLARE_METHOD(Aggregator, histogram),
+	LUNAR_DECLARE_METHOD(Aggregator, series),
+	{0,0}
+};
+
+Aggregator::Aggregator(lua_State *L)
+	: m_key(Author), m_value(Commits), m_param(0)
+{
+	std::string error;
+	if (lua_gettop(L) > 0) {
+		std::string key = LuaHelpers::tablevb(L, "key", std::string("author"));
+		std::string value = LuaHelpers::tablevb(L, "value", std::string("commits"));
+		if (!parseKey(key, &m_key)) {
+			error = str::printf("Invalid aggregation key '%s'", key.c_str());
+		} else if (!parseValue(value, &m_value)) {
+			error = str::printf("Invalid aggregation value '%s'", value.c_str());
+		}
+		if (m_key == Date) {
+			m_param = LuaHelpers::tablevi(L, "bucket", 86400);
+		} else if (m_key == Directory) {
+			m_param = LuaHelpers::tablevi(L, "depth", 0);
+		}
+		lua_pop(L, 1);
+	}
+	if (m_key == Date && m_param <= 0) {
+		m_param = 86400;
+	}
+
+	if (!error.empty()) {
+		LuaHelpers::pushError(L, error);
+	}
+}
+
+int Aggregator::add(lua_State *L)
+{
+	double scale = 1.0;
+	if (lua_gettop(L) > 1) {
+		scale = LuaHelpers::popd(L);
+	}
+	add(LuaHelpers::popl<Revision>(L), scale);
+	return 0;
+}
+
+int Aggregator::count(lua_State *L)
+{
+	return LuaHelpers::push(L, (uint64_t)count());
+}
+
+int Aggregator::totals(lua_State *L)
+{
+	lua_createtable(L, 0, m_keys.size());
+	for (size_t i = 0; i < m_keys.size(); i++) {
+		LuaHelpers::push(L, m_keys[i]);
+		LuaHelpers::push(L, m_totals[i]);
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+int Aggregator::top(lua_State *L)
+{
+	size_t n = 0;
+	if (lua_gettop(L) > 0) {
+		n = std::max(0, LuaHelpers::popi(L));
+	}
+
+	std::vector<std::pair<std::string, int64_t> > t = top(n);
+	std::vector<std::string> keys(t.size());
+	std::vector<int64_t> values(t.size());
+	for (size_t i = 0; i < t.size(); i++) {
+		keys[i] = t[i].first;
+		values[i] = t[i].second;
+	}
+	LuaHelpers::push(L, keys);
+	LuaHelpers::push(L, values);
+	return 2;
+}
+
+int Aggregator::histogram(lua_State *L)
+{
+	std::vector<std::pair<std::string, int64_t> > h = histogram();
+	lua_createtable(L, h.size(), 0);
+	for (size_t i = 0; i < h.size(); i++) {
+		if (m_key == Date) {
+			int64_t date = 0;
+			str::stoi(h[i].first, &date);
+			LuaHelpers::push(L, date);
+		} else {
+			LuaHelpers::push(L, h[i].first);
+		}
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_createtable(L, h.size(), 0);
+	for (size_t i = 0; i < h.size(); i++) {
+		LuaHelpers::push(L, h[i].second);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 2;
+}
+
+int Aggregator::series(lua_State *L)
+{
+	int64_t start = -1;
+	if (lua_gettop(L) > 1) {
+		start = (int64_t)LuaHelpers::popd(L);
+	}
+	std::vector<std::string> keys = LuaHelpers::popvs(L);
+
+	std::vector<int64_t> dates;
+	std::vector<std::vector<int64_t> > values;
+	series(keys, start, &dates, &values);
+	LuaHelpers::push(L, dates);
+	LuaHelpers::push(L, values);
+	return 2;
+}
@@ -0,0 +1,104 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: aggregator.h
+ * Native group-by aggregation of revision data (interface)
+ */
+
+
+#ifndef AGGREGATOR_H_
+#define AGGREGATOR_H_
+
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "main.h"
+
+#include "lunar/lunar.h"
+
+class Revision;
+
+
+class Aggregator
+{
+	public:
+		enum Key {
+			Author,
+			Date,
+			Directory,
+			Extension
+		};
+
+		enum Value {
+			Commits,
+			LinesAdded,
+			LinesRemoved,
+			Lines,
+			BytesAdded,
+			BytesRemoved
+		};
+
+	public:
+		Aggregator(Key key = Author, Value value = Commits, int64_t param = 0);
+		~Aggregator();
+
+		bool needsDiffstats() const;
+		void add(const Revision *revision, double scale = 1.0);
+
+		size_t count() const;
+		std::vector<std::string> keys() const;
+		int64_t total(const std::string &key) const;
+		std::vector<std::pair<std::string, int64_t> > top(size_t n = 0) const;
+		std::vector<std::pair<std::string, int64_t> > histogram() const;
+		void series(const std::vector<std::string> &keys, int64_t start, std::vector<int64_t> *dates, std::vector<std::vector<int64_t> > *values) const;
+
+		static bool parseKey(const std::string &name, Key *key);
+		static bool parseValue(const std::string &name, Value *value);
+
+	private:
+		struct Event {
+			uint32_t revision;
+			uint32_t key;
+			int64_t value;
+		};
+
+		uint32_t keyId(const std::string &key);
+		uint32_t authorKeyId(uint32_t author);
+		std::string fileKey(const std::string &path) const;
+
+	private:
+		Key m_key;
+		Value m_value;
+		int64_t m_param;
+
+		std::vector<std::string> m_keys;
+		std::unordered_map<std::string, uint32_t> m_keyIds;
+		std::vector<uint32_t> m_authorKeys; // Key IDs + 1 by author ID
+		std::vector<int64_t> m_totals;
+		std::vector<int64_t> m_dates;
+		std::vector<Event> m_events;
+
+	// Lua binding
+	public:
+		Aggregator(lua_State *L);
+
+		int add(lua_State *L);
+		int count(lua_State *L);
+		int totals(lua_State *L);
+		int top(lua_State *L);
+		int histogram(lua_State *L);
+		int series(lua_State *L);
+
+		static const char className[];
+		static Lunar<Aggregator>::RegType methods[];
+};
+
+
+#endif // AGGREGATOR_H_
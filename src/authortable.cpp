@@ -0,0 +1,215 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: authortable.cpp
+ * Interned author names
+ */
+
+
+#include "main.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#include "strlib.h"
+
+#include "authortable.h"
+
+
+namespace
+{
+
+// Names are stored in chunks that are never moved, so lookups don't have
+// to acquire the mutex
+struct Table
+{
+	sys::parallel::Mutex mutex;
+	std::unordered_map<std::string, uint32_t> ids;
+	std::atomic<std::string *> chunks[AuthorTable::MaxChunks];
+	std::atomic<uint32_t> size;
+
+	Table() : size(1) {
+		for (int i = 0; i < AuthorTable::MaxChunks; i++) {
+			chunks[i] = NULL;
+		}
+		chunks[0] = new std::string[AuthorTable::ChunkSize];
+		ids[std::string()] = 0;
+	}
+};
+
+// The table is kept until the program exits, since revisions may be
+// released by static destructors
+Table &table()
+{
+	static Table *t = new Table();
+	return *t;
+}
+
+} // anonymous namespace
+
+
+// Returns the ID for the given name, adding it to the table if necessary
+uint32_t AuthorTable::intern(const std::string &name)
+{
+	Table &t = table();
+	sys::parallel::MutexLocker locker(&t.mutex);
+	std::unordered_map<std::string, uint32_t>::const_iterator it = t.ids.find(name);
+	if (it != t.ids.end()) {
+		return it->second;
+	}
+
+	uint32_t id = t.size.load();
+	if ((id >> ChunkBits) >= uint32_t(MaxChunks)) {
+		throw PEX(str::printf("Too many authors (%u)", id));
+	}
+	std::string *chunk = t.chunks[id >> ChunkBits].load();
+	if (chunk == NULL) {
+		chunk = new std::string[ChunkSize];
+		t.chunks[id >> ChunkBits].store(chunk);
+	}
+	chunk[id & (ChunkSize - 1)] = name;
+	t.ids[name] = id;
+	t.size.store(id + 1);
+	return id;
+}
+
+// Returns the name for the given ID, or an empty string for unknown IDs
+const std::string &AuthorTable::name(uint32_t id)
+{
+	static const std::string empty;
+	Table &t = table();
+	if (id >= t.size.load()) {
+		return empty;
+	}
+	return t.chunks[id >> ChunkBits].load()[id & (ChunkSize - 1)];
+}
+
+// Looks up the ID of the given name without adding it
+bool AuthorTable::find(const std::string &name, uint32_t *id)
+{
+	Table &t = table();
+	sys::parallel::MutexLocker locker(&t.mutex);
+	std::unordered_map<std::string, uint32_t>::const_iterator it = t.ids.find(name);
+	if (it == t.ids.end()) {
+		return false;
+	}
+	*id = it->second;
+	return true;
+}
+
+// Returns the number of interned names
+size_t AuthorTable::size()
+{
+	return table().size.load();
+}
+
+
+// Constructor
+AuthorDictionary::AuthorDictionary()
+	: m_loaded(0)
+{
+}
+
+// Sets the file storing the dictionary and reads it
+void AuthorDictionary::open(const std::string &path)
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	m_path = path;
+	m_loaded = 0;
+	m_authors.clear();
+	m_indexes.clear();
+	reload();
+}
+
+// Forgets all names, e.g. after the file has been removed
+void AuthorDictionary::clear()
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	m_loaded = 0;
+	m_authors.clear();
+	m_indexes.clear();
+}
+
+// Returns the index of the given author, appending the name to the file
+// if it is not part of the dictionary yet
+uint32_t AuthorDictionary::encode(uint32_t author)
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	std::unordered_map<uint32_t, uint32_t>::const_iterator it = m_indexes.find(author);
+	if (it != m_indexes.end()) {
+		return it->second;
+	}
+
+	// Another process may have added the name already
+	reload();
+	it = m_indexes.find(author);
+	if (it != m_indexes.end()) {
+		return it->second;
+	}
+
+	const std::string &name = AuthorTable::name(author);
+	FILE *f = fopen(m_path.c_str(), "ab");
+	if (f == NULL) {
+		throw PEX(str::printf("Unable to open author dictionary %s for writing", m_path.c_str()));
+	}
+	bool ok = (fwrite(name.c_str(), 1, name.length() + 1, f) == name.length() + 1);
+	if (fclose(f) != 0 || !ok) {
+		throw PEX(str::printf("Unable to write to author dictionary %s", m_path.c_str()));
+	}
+
+	reload();
+	it = m_indexes.find(author);
+	if (it == m_indexes.end()) {
+		throw PEX(str::printf("Author dictionary %s is corrupted", m_path.c_str()));
+	}
+	return it->second;
+}
+
+// Looks up the author with the given index
+bool AuthorDictionary::decode(uint32_t index, uint32_t *author)
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	if (index >= m_authors.size()) {
+		reload();
+		if (index >= m_authors.size()) {
+			return false;
+		}
+	}
+	*author = m_authors[index];
+	return true;
+}
+
+// Reads names that have been appended to the file since the last call.
+// The caller must hold the mutex.
+void AuthorDictionary::reload()
+{
+	FILE *f = fopen(m_path.c_str(), "rb");
+	if (f == NULL) {
+		return;
+	}
+	std::string data;
+	if (fseek(f, long(m_loaded), SEEK_SET) == 0) {
+		char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+			data.append(buffer, n);
+		}
+	}
+	fclose(f);
+
+	// A name that is being written by another process is read next time
+	size_t pos = 0, end;
+	while ((end = data.find('\0', pos)) != std::string::npos) {
+		uint32_t author = AuthorTable::intern(data.substr(pos, end - pos));
+		m_indexes.insert(std::make_pair(author, uint32_t(m_authors.size())));
+		m_authors.push_back(author);
+		pos = end + 1;
+	}
+	m_loaded += pos;
+}
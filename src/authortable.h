@@ -0,0 +1,81 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: authortable.h
+ * Interned author names (interface)
+ */
+
+
+#ifndef AUTHORTABLE_H_
+#define AUTHORTABLE_H_
+
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "main.h"
+
+#include "syslib/parallel.h"
+
+
+/*
+ * Process-wide table of author names. Repositories usually have a few
+ * thousand authors for millions of revisions, so revisions only store the
+ * ID of their author. IDs are assigned in the order in which names are
+ * interned and remain valid for the lifetime of the process. The empty
+ * name always has the ID 0.
+ */
+class AuthorTable
+{
+	public:
+		enum {
+			ChunkBits = 12,
+			ChunkSize = 1 << ChunkBits,
+			MaxChunks = 4096
+		};
+
+	public:
+		static uint32_t intern(const std::string &name);
+		static const std::string &name(uint32_t id);
+		static bool find(const std::string &name, uint32_t *id);
+		static size_t size();
+};
+
+
+/*
+ * Persistent mapping between author IDs and compact indexes for cache
+ * records. The names are appended to a file in the order of their indexes
+ * as NUL-terminated strings, so the file is only ever extended and other
+ * processes can pick up new names by reading its tail. Indexes must only
+ * be assigned while holding the write lock of the cache.
+ */
+class AuthorDictionary
+{
+	public:
+		AuthorDictionary();
+
+		void open(const std::string &path);
+		void clear();
+
+		uint32_t encode(uint32_t author);
+		bool decode(uint32_t index, uint32_t *author);
+
+	private:
+		void reload();
+
+	private:
+		sys::parallel::Mutex m_mutex;
+		std::string m_path;
+		size_t m_loaded; // Bytes of the file that have been read
+		std::vector<uint32_t> m_authors; // Author IDs by index
+		std::unordered_map<uint32_t, uint32_t> m_indexes;
+};
+
+
+#endif // AUTHORTABLE_H_
@@ -14,12 +14,16 @@
 #include "main.h"
 
 #include "options.h"
+#include "utils.h"
 
 #include "backend.h"
 
 #ifdef USE_GIT
  #include "backends/git.h"
 #endif
+#ifdef USE_LIBGIT2
+ #include "backends/libgit2.h"
+#endif
 #ifdef USE_MERCURIAL
  #include "backends/mercurial.h"
 #endif
@@ -65,7 +69,7 @@ void Backend::LogIterator::run()
 
 // Protected constructor
 Backend::Backend(const Options &options)
-	: m_opts(options)
+	: m_opts(options), m_excludes(options.excludes()), m_diffLimit(options.diffLimit())
 {
 
 }
@@ -96,6 +100,9 @@ void Backend::listBackends(std::ostream &out)
 #ifdef USE_GIT
 	Options::print("git", "Git", out);
 #endif
+#ifdef USE_LIBGIT2
+	Options::print("libgit2", "Git (using libgit2)", out);
+#endif
 #ifdef USE_MERCURIAL
 	Options::print("mercurial, hg", "Mercurial", out);
 #endif
@@ -125,10 +132,168 @@ void Backend::prefetch(const std::vector<std::string> &)
 	// The default implementation does nothing
 }
 
-// Optional diffstat filtering before it is presented to the report script
-void Backend::filterDiffstat(DiffstatPtr)
+// Returns the revision data for all given IDs
+std::vector<Revision *> Backend::revisions(const std::vector<std::string> &ids)
 {
-	// The default implementation does nothing
+	// The default implementation fetches the revisions one by one
+	std::vector<Revision *> revs;
+	revs.reserve(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		revs.push_back(revision(ids[i]));
+	}
+	return revs;
+}
+
+// Gives the backend the possibility to pre-fetch the meta-data of the given revisions
+void Backend::prefetchMeta(const std::vector<std::string> &ids)
+{
+	// The default implementation pre-fetches complete revisions
+	prefetch(ids);
+}
+
+// Returns the revision meta-data for the given ID
+Revision *Backend::metaRevision(const std::string &id)
+{
+	// The default implementation fetches the complete revision
+	return revision(id);
+}
+
+// Returns the revision meta-data for all given IDs
+std::vector<Revision *> Backend::metaRevisions(const std::vector<std::string> &ids)
+{
+	std::vector<Revision *> revs;
+	revs.reserve(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		revs.push_back(metaRevision(ids[i]));
+	}
+	return revs;
+}
+
+// Requests the given revisions, optionally without diffstats, and returns
+// a future for each of them
+std::vector<RevisionFuture> Backend::revisionsAsync(const std::vector<std::string> &ids, bool diffstats)
+{
+	// The default implementation lets the backend prefetch the revisions,
+	// which are claimed from the prefetcher by the futures
+	if (diffstats) {
+		prefetch(ids);
+	} else {
+		prefetchMeta(ids);
+	}
+
+	std::vector<RevisionFuture> futures;
+	futures.reserve(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		std::string id = ids[i];
+		futures.push_back(RevisionFuture(id, [this, id, diffstats]() {
+			return (diffstats ? revision(id) : metaRevision(id));
+		}));
+	}
+	return futures;
+}
+
+// Returns content-based keys for the diffstats of the given revisions.
+// Revisions with equal keys are guaranteed to have equal diffstats, and
+// empty keys mean that no such key is available.
+std::vector<std::string> Backend::diffstatKeys(const std::vector<std::string> &ids)
+{
+	// The default implementation doesn't provide any keys
+	return std::vector<std::string>(ids.size());
+}
+
+// Returns the contents of the given files at the given revision
+std::vector<std::string> Backend::catMany(const std::vector<std::string> &paths, const std::string &id)
+{
+	// The default implementation retrieves the files one by one
+	std::vector<std::string> contents;
+	contents.reserve(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		contents.push_back(cat(paths[i], id));
+	}
+	return contents;
+}
+
+// Returns a content-based key for the tree of the given revision
+std::string Backend::treeKey(const std::string &)
+{
+	// The default implementation doesn't provide any keys
+	return std::string();
+}
+
+// Returns the line counts of the files in the tree of the given revision,
+// skipping excluded paths
+std::map<std::string, uint64_t> Backend::lineCounts(const std::string &id)
+{
+	std::vector<std::string> tree, paths;
+	treeKeys(id, &tree);
+	for (size_t i = 0; i < tree.size(); i++) {
+		if (!Diffstat::excluded(tree[i].c_str(), m_excludes)) {
+			paths.push_back(tree[i]);
+		}
+	}
+
+	std::vector<uint64_t> counts = countLines(paths, id);
+	std::map<std::string, uint64_t> result;
+	for (size_t i = 0; i < paths.size(); i++) {
+		result[paths[i]] = counts[i];
+	}
+	return result;
+}
+
+// Lists the files in the tree of the given revision and returns their
+// content-based keys
+std::vector<std::string> Backend::treeKeys(const std::string &id, std::vector<std::string> *paths)
+{
+	// The default implementation doesn't provide any keys
+	*paths = tree(id);
+	return std::vector<std::string>(paths->size());
+}
+
+// Counts the lines of the given files at the given revision
+std::vector<uint64_t> Backend::countLines(const std::vector<std::string> &paths, const std::string &id)
+{
+	// The default implementation retrieves the files one by one
+	std::vector<uint64_t> counts;
+	counts.reserve(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		std::string data = cat(paths[i], id);
+		utils::LineCounter counter;
+		counter.feed(data.data(), data.length());
+		counts.push_back(counter.lines());
+	}
+	return counts;
+}
+
+// Checks whether revision dates are ordered along logs. This isn't
+// guaranteed in general, e.g. for commits with skewed clocks.
+bool Backend::orderedDates() const
+{
+	return false;
+}
+
+// Returns local directories whose entries change when new revisions are
+// added to the repository
+std::vector<std::string> Backend::watchPaths()
+{
+	// The default implementation returns an empty list
+	return std::vector<std::string>();
+}
+
+// Returns the per-day sums of the given key for all days overlapping the
+// given time range
+bool Backend::rollups(Rollups::Key, int64_t, int64_t, std::vector<Rollups::Row> *)
+{
+	// Rollups are only maintained by persistent caches
+	return false;
+}
+
+// Optional diffstat filtering before it is presented to the report script.
+// Backends should skip excluded paths and files exceeding the diff limit
+// while diffing already, but cached diffstats may still contain them.
+// Diffstats are shared, so a filtered copy is returned if necessary.
+DiffstatPtr Backend::filterDiffstat(DiffstatPtr stat)
+{
+	return Diffstat::limit(Diffstat::exclude(stat, m_excludes), m_diffLimit);
 }
 
 // Cleans up the backend after iteration has finished
@@ -162,6 +327,11 @@ Backend *Backend::backendForName(const std::string &name, const Options &options
 		return new GitBackend(options);
 	}
 #endif
+#ifdef USE_LIBGIT2
+	if (name == "libgit2") {
+		return new Libgit2Backend(options);
+	}
+#endif
 #ifdef USE_MERCURIAL
 	if (name == "hg" || name == "mercurial") {
 		return new MercurialBackend(options);
@@ -179,6 +349,12 @@ Backend *Backend::backendForUrl(const std::string &url, const Options &options)
 		return new SubversionBackend(options);
 	}
 #endif
+#ifdef USE_LIBGIT2
+	// Prefer the native implementation over the command-line one
+	if (Libgit2Backend::handles(url)) {
+		return new Libgit2Backend(options);
+	}
+#endif
 #ifdef USE_GIT
 	if (GitBackend::handles(url)) {
 		return new GitBackend(options);
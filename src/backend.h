@@ -16,11 +16,15 @@
 
 
 #include <iostream>
+#include <map>
 #include <queue>
 #include <string>
 #include <vector>
 
 #include "diffstat.h"
+#include "revisionfilter.h"
+#include "revisionfuture.h"
+#include "rollups.h"
 #include "tag.h"
 
 #include "syslib/parallel.h"
@@ -68,15 +72,56 @@ class Backend
 		virtual std::vector<std::string> branches() = 0;
 		virtual std::vector<Tag> tags() = 0;
 		virtual DiffstatPtr diffstat(const std::string &id) = 0;
-		virtual void filterDiffstat(DiffstatPtr stat);
+		virtual DiffstatPtr filterDiffstat(DiffstatPtr stat);
 		virtual std::vector<std::string> tree(const std::string &id = std::string()) = 0;
 		virtual std::string cat(const std::string &path, const std::string &id = std::string()) = 0;
+		virtual std::vector<std::string> catMany(const std::vector<std::string> &paths, const std::string &id = std::string());
 
-		virtual LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1) = 0;
+		// Content-based key of the tree of a revision, used for caching tree
+		// listings and file contents. An empty key means that no such key
+		// is available.
+		virtual std::string treeKey(const std::string &id = std::string());
+
+		// Backends may use the filter in order to skip unrelated revisions
+		virtual LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter()) = 0;
 		virtual void prefetch(const std::vector<std::string> &ids);
 		virtual Revision *revision(const std::string &id) = 0;
+		virtual std::vector<Revision *> revisions(const std::vector<std::string> &ids);
+
+		// Meta-data only versions of the functions above. The returned
+		// revisions may not contain diffstats.
+		virtual void prefetchMeta(const std::vector<std::string> &ids);
+		virtual Revision *metaRevision(const std::string &id);
+		virtual std::vector<Revision *> metaRevisions(const std::vector<std::string> &ids);
+
+		// Asynchronous retrieval. Revisions are requested at once and
+		// claimed from the returned futures, in any order.
+		virtual std::vector<RevisionFuture> revisionsAsync(const std::vector<std::string> &ids, bool diffstats = true);
+
+		// Content-based keys for diffstats, used for sharing cached diffstats
+		// between revisions with equal changes
+		virtual std::vector<std::string> diffstatKeys(const std::vector<std::string> &ids);
+
+		// Line counts of the files in the tree of a revision. Content-based
+		// keys of the files are used for caching the counts, and empty keys
+		// mean that no such key is available.
+		virtual std::map<std::string, uint64_t> lineCounts(const std::string &id = std::string());
+		virtual std::vector<std::string> treeKeys(const std::string &id, std::vector<std::string> *paths);
+		virtual std::vector<uint64_t> countLines(const std::vector<std::string> &paths, const std::string &id);
+
+		// Whether revision dates never decrease along a log, so the date
+		// bounds of an iterator select a contiguous part of the complete log
+		virtual bool orderedDates() const;
 		virtual void finalize();
 
+		// Local directories that change when new revisions are added, e.g. for
+		// watching refs. Repositories without such directories are polled.
+		virtual std::vector<std::string> watchPaths();
+
+		// Per-day sums maintained by persistent caches. Returns false if
+		// they are not available.
+		virtual bool rollups(Rollups::Key key, int64_t start, int64_t end, std::vector<Rollups::Row> *rows);
+
 		const Options &options() const;
 		virtual void printHelp() const;
 
@@ -85,6 +130,8 @@ class Backend
 
 	protected:
 		const Options &m_opts;
+		std::vector<std::string> m_excludes; // Patterns of paths excluded from diffstats
+		int m_diffLimit; // Maximum number of changed lines per file, if any
 
 	private:
 		static Backend *backendForName(const std::string &name, const Options &options);
@@ -14,93 +14,378 @@
 #include "main.h"
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <unordered_map>
 
 #include <unistd.h>
 
+#include "bstream.h"
+#include "cache.h"
 #include "jobqueue.h"
 #include "logger.h"
 #include "options.h"
 #include "revision.h"
+#include "revisionid.h"
 #include "strlib.h"
+#include "tracer.h"
 #include "utils.h"
 
 #include "syslib/datetime.h"
 #include "syslib/fs.h"
 #include "syslib/io.h"
 #include "syslib/parallel.h"
+#include "syslib/sigblock.h"
 
 #include "backends/git.h"
 
 
-// Diffstat fetching worker thread, using a pipe to write data to "git diff-tree"
-class GitDiffstatPipe : public sys::parallel::Thread
+// Worker thread running git commands. Cancelling the thread kills the
+// commands it is currently talking to, so it doesn't have to finish
+// expensive jobs whose results are no longer needed.
+class GitCommandThread : public sys::parallel::Thread
 {
 public:
-	GitDiffstatPipe(const std::string &gitpath, JobQueue<std::string, DiffstatPtr> *queue)
-		: m_gitpath(gitpath), m_queue(queue)
+	GitCommandThread()
+		: m_cancelled(false)
 	{
 	}
 
-	static DiffstatPtr diffstat(const std::string &gitpath, const std::string &id, const std::string &parent = std::string())
+	void cancel()
 	{
-		DiffstatPtr stat;
+		sys::parallel::MutexLocker locker(&m_bufMutex);
+		m_cancelled = true;
+		for (size_t i = 0; i < m_bufs.size(); i++) {
+			m_bufs[i]->kill();
+		}
+	}
+
+protected:
+	// Registers a command that is killed on cancellation while the
+	// attachment exists
+	class Attachment
+	{
+	public:
+		Attachment(GitCommandThread *thread, sys::io::PopenStreambuf *buf)
+			: m_thread(thread), m_buf(buf)
+		{
+			sys::parallel::MutexLocker locker(&m_thread->m_bufMutex);
+			m_thread->m_bufs.push_back(buf);
+			if (m_thread->m_cancelled) {
+				buf->kill();
+			}
+		}
+
+		~Attachment()
+		{
+			sys::parallel::MutexLocker locker(&m_thread->m_bufMutex);
+			std::vector<sys::io::PopenStreambuf *> &bufs = m_thread->m_bufs;
+			bufs.erase(std::find(bufs.begin(), bufs.end(), m_buf));
+		}
+
+	private:
+		GitCommandThread *m_thread;
+		sys::io::PopenStreambuf *m_buf;
+	};
+
+	bool cancelled()
+	{
+		sys::parallel::MutexLocker locker(&m_bufMutex);
+		return m_cancelled;
+	}
+
+private:
+	sys::parallel::Mutex m_bufMutex;
+	std::vector<sys::io::PopenStreambuf *> m_bufs;
+	bool m_cancelled;
+};
+
+
+// Diffstat fetching worker thread, using a pipe to write data to "git diff-tree".
+// If only line counts are requested, git diff-tree prints per-file counts
+// instead of complete diffs. Excluded paths are passed as pathspecs, so git
+// won't even diff them. If a split threshold is given, the changed paths
+// of each revision are listed first, and revisions changing more files are
+// diffed in parallel by path-partitioned commands on the thread pool, so a
+// single huge commit doesn't hold up everything behind it.
+class GitDiffstatPipe : public GitCommandThread
+{
+public:
+	enum {
+		MaxPartFiles = 384
+	};
+
+public:
+	GitDiffstatPipe(const std::string &gitpath, JobQueue<RevisionId, DiffstatPtr> *queue, bool lines = false, const std::vector<std::string> &excludes = std::vector<std::string>(), size_t split = 0)
+		: m_gitpath(gitpath), m_queue(queue), m_lines(lines), m_excludes(excludes), m_split(split)
+	{
+	}
+
+	static DiffstatPtr diffstat(const std::string &gitpath, const std::string &id, const std::string &parent = std::string(), bool lines = false, const std::vector<std::string> &excludes = std::vector<std::string>())
+	{
+		std::vector<std::string> args = arguments(format(lines), revisions(id, parent), excludes);
+		std::vector<const char *> argv = pointers(args);
+		sys::io::PopenStreambuf buf((gitpath+"/git-diff-tree").c_str(), &argv[0]);
+		std::istream in(&buf);
+		DiffstatPtr stat = DiffParser::parse(in, (lines ? DiffParser::Numstat : DiffParser::Unified));
+		if (buf.close() != 0) {
+			throw PEX("git diff-tree command failed");
+		}
+		return stat;
+	}
+
+private:
+	// Returns the output format option for "git diff-tree"
+	static const char *format(bool lines)
+	{
+		return (lines ? "--numstat" : "-U0");
+	}
+
+	// Returns the revision arguments for a single diff
+	static std::vector<std::string> revisions(const std::string &id, const std::string &parent)
+	{
+		std::vector<std::string> revs;
 		if (!parent.empty()) {
-			sys::io::PopenStreambuf buf((gitpath+"/git-diff-tree").c_str(), "-U0", "--no-renames", parent.c_str(), id.c_str());
-			std::istream in(&buf);
-			stat = DiffParser::parse(in);
-			if (buf.close() != 0) {
-				throw PEX("git diff-tree command failed");
+			revs.push_back(parent);
+		} else {
+			revs.push_back("--root");
+		}
+		revs.push_back(id);
+		return revs;
+	}
+
+	// Returns the arguments for "git diff-tree", followed by pathspecs for
+	// excluded paths. These are relative to the top-level directory.
+	static std::vector<std::string> arguments(const std::string &format, const std::vector<std::string> &revs, const std::vector<std::string> &excludes)
+	{
+		std::vector<std::string> args;
+		args.push_back(format);
+		args.push_back("--no-renames");
+		args.insert(args.end(), revs.begin(), revs.end());
+		if (!excludes.empty()) {
+			args.push_back("--");
+			args.push_back(":/");
+			for (size_t i = 0; i < excludes.size(); i++) {
+				args.push_back(":(top,exclude)" + excludes[i]);
+			}
+		}
+		return args;
+	}
+
+	// Returns a NULL-terminated argument vector for the given arguments
+	static std::vector<const char *> pointers(const std::vector<std::string> &args)
+	{
+		std::vector<const char *> argv;
+		for (size_t i = 0; i < args.size(); i++) {
+			argv.push_back(args[i].c_str());
+		}
+		argv.push_back(NULL);
+		return argv;
+	}
+
+	// Removes the C-style quoting that git applies to unusual paths
+	static std::string unquote(const std::string &path)
+	{
+		if (path.length() < 2 || path[0] != '"' || path[path.length()-1] != '"') {
+			return path;
+		}
+		std::string res;
+		for (size_t i = 1; i < path.length() - 1; i++) {
+			if (path[i] != '\\' || i + 1 >= path.length() - 1) {
+				res += path[i];
+				continue;
+			}
+			char c = path[++i];
+			if (c >= '0' && c <= '7' && i + 2 < path.length() - 1) {
+				res += char(((c - '0') << 6) | ((path[i+1] - '0') << 3) | (path[i+2] - '0'));
+				i += 2;
+				continue;
+			}
+			switch (c) {
+				case 'a': res += '\a'; break;
+				case 'b': res += '\b'; break;
+				case 'f': res += '\f'; break;
+				case 'n': res += '\n'; break;
+				case 'r': res += '\r'; break;
+				case 't': res += '\t'; break;
+				case 'v': res += '\v'; break;
+				default: res += c; break;
 			}
+		}
+		return res;
+	}
+
+	// Writes a revision to a "git diff-tree --stdin" pipe
+	static void request(std::ostream &out, const RevisionId &revision)
+	{
+		if (!revision.hasParent()) {
+			out << revision.childStr() << '\n';
 		} else {
-			sys::io::PopenStreambuf buf((gitpath+"/git-diff-tree").c_str(), "-U0", "--no-renames", "--root", id.c_str());
-			std::istream in(&buf);
-			stat = DiffParser::parse(in);
-			if (buf.close() != 0) {
-				throw PEX("git diff-tree command failed");
+			out << revision.childStr() << " " << revision.parentStr() << '\n';
+		}
+
+		// We use EOF characters to mark the end of a revision for
+		// the diff parser. git diff-tree won't understand this line
+		// and simply write the EOF.
+		out << (char)EOF << '\n' << std::flush;
+	}
+
+	// Reads the paths changed by a revision from the listing pipe
+	static bool files(std::istream &in, std::vector<std::string> *paths)
+	{
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.length() == 1 && line[0] == (char)EOF) {
+				return true;
 			}
+			paths->push_back(unquote(line));
+		}
+		return false;
+	}
+
+	// Diffs a subset of the paths changed by a revision
+	DiffstatPtr part(const RevisionId &revision, const std::vector<std::string> &paths, size_t begin, size_t end)
+	{
+		std::vector<std::string> args = arguments(format(m_lines), revisions(revision.childStr(), revision.parentStr()), std::vector<std::string>());
+		args.push_back("--");
+		for (size_t i = begin; i < end; i++) {
+			args.push_back(":(top,literal)" + paths[i]);
+		}
+		std::vector<const char *> argv = pointers(args);
+		sys::io::PopenStreambuf buf((m_gitpath+"/git-diff-tree").c_str(), &argv[0]);
+		Attachment attachment(this, &buf);
+		std::istream in(&buf);
+		DiffstatPtr stat = DiffParser::parse(in, (m_lines ? DiffParser::Numstat : DiffParser::Unified));
+		if (buf.close() != 0 && !cancelled()) {
+			throw PEX(str::printf("git diff-tree command failed for revision %s", revision.str().c_str()));
 		}
 		return stat;
 	}
 
+	// Diffs a revision with many changed files using multiple commands
+	DiffstatPtr split(const RevisionId &revision, const std::vector<std::string> &paths)
+	{
+		PTRACE_SCOPE("git.diff-tree.split");
+
+		// Use at least one part per pool thread, and keep the number of
+		// pathspecs within the argument limit of PopenStreambuf
+		sys::parallel::ThreadPool *pool = sys::parallel::ThreadPool::global();
+		size_t nparts = std::max(size_t(pool->size()), (paths.size() + MaxPartFiles - 1) / MaxPartFiles);
+		nparts = std::min(nparts, paths.size());
+		PDEBUG << "Splitting diff of revision " << revision.str() << " with " << paths.size() << " files into " << nparts << " parts" << endl;
+
+		// The first part is diffed by this thread while the pool
+		// works on the others
+		std::vector<sys::parallel::Future<DiffstatPtr> > futures;
+		for (size_t i = 1; i < nparts; i++) {
+			size_t begin = (paths.size() * i) / nparts, end = (paths.size() * (i+1)) / nparts;
+			futures.push_back(pool->submit<DiffstatPtr>(std::bind(&GitDiffstatPipe::part, this, std::cref(revision), std::cref(paths), begin, end)));
+		}
+
+		std::vector<DiffstatPtr> stats;
+		std::exception_ptr error;
+		try {
+			stats.push_back(part(revision, paths, 0, paths.size() / nparts));
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		// Wait for all parts, since they are referencing the arguments
+		for (size_t i = 0; i < futures.size(); i++) {
+			try {
+				stats.push_back(futures[i].get());
+			} catch (...) {
+				if (!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return Diffstat::merge(stats);
+	}
+
 protected:
 	void run()
 	{
 		// TODO: Error checking
-		sys::io::PopenStreambuf buf((m_gitpath+"/git-diff-tree").c_str(), "-U0", "--no-renames", "--stdin", "--root", NULL, NULL, NULL, std::ios::in | std::ios::out);
+		std::vector<std::string> revs;
+		revs.push_back("--stdin");
+		revs.push_back("--root");
+		std::vector<std::string> args = arguments(format(m_lines), revs, m_excludes);
+		std::vector<const char *> argv = pointers(args);
+		sys::io::PopenStreambuf buf((m_gitpath+"/git-diff-tree").c_str(), &argv[0], std::ios::in | std::ios::out);
+		Attachment attachment(this, &buf);
 		std::istream in(&buf);
 		std::ostream out(&buf);
 
-		std::string revision;
+		// Comparing the trees is cheap compared to diffing the files, so
+		// the changed paths are listed by a second pipe
+		std::unique_ptr<sys::io::PopenStreambuf> lbuf;
+		std::unique_ptr<Attachment> lattachment;
+		std::vector<std::string> largs;
+		if (m_split > 0) {
+			revs.push_back("-r");
+			revs.push_back("--no-commit-id");
+			largs = arguments("--name-only", revs, m_excludes);
+			std::vector<const char *> largv = pointers(largs);
+			lbuf.reset(new sys::io::PopenStreambuf((m_gitpath+"/git-diff-tree").c_str(), &largv[0], std::ios::in | std::ios::out));
+			lattachment.reset(new Attachment(this, lbuf.get()));
+		}
+		std::istream lin(lbuf.get());
+		std::ostream lout(lbuf.get());
+
+		RevisionId revision;
+		std::vector<std::string> paths;
 		while (m_queue->getArg(&revision)) {
-			std::vector<std::string> revs = str::split(revision, ":");
+			PTRACE_SCOPE("git.diff-tree");
+			paths.clear();
+			if (lbuf) {
+				request(lout, revision);
+				if (!files(lin, &paths)) {
+					m_queue->failed(revision);
+					return;
+				}
+			}
 
-			if (revs.size() < 2) {
-				out << revs[0] << '\n';
+			DiffstatPtr stat;
+			if (m_split > 0 && paths.size() > m_split) {
+				try {
+					stat = split(revision, paths);
+				} catch (const PepperException &ex) {
+					Logger::err() << "Error: " << ex.where() << ": " << ex.what() << endl;
+				}
 			} else {
-				out << revs[1] << " " << revs[0] << '\n';
+				request(out, revision);
+				stat = DiffParser::parse(in, (m_lines ? DiffParser::Numstat : DiffParser::Unified));
 			}
-
-			// We use EOF characters to mark the end of a revision for
-			// the diff parser. git diff-tree won't understand this line
-			// and simply write the EOF.
-			out << (char)EOF << '\n' << std::flush;
-
-			DiffstatPtr stat = DiffParser::parse(in);
-			m_queue->done(revision, stat);
+			if (cancelled() || !stat) {
+				// The diff is incomplete if the command has been killed
+				m_queue->failed(revision);
+				if (cancelled()) {
+					return;
+				}
+				continue;
+			}
+			m_queue->done(revision, stat, stat->footprint());
 		}
 	}
 
 private:
 	std::string m_gitpath;
-	JobQueue<std::string, DiffstatPtr> *m_queue;
+	JobQueue<RevisionId, DiffstatPtr> *m_queue;
+	bool m_lines;
+	std::vector<std::string> m_excludes;
+	size_t m_split; // Minimum number of files for splitting diffs
 };
 
 
 // Meta-data fetching worker thread, passing multiple revisions to git-rev-list at once.
 // Note that all IDs coming from the JobQueue are expected to contain a single hash,
 // i.e. no parent:child ID spec.
-class GitMetaDataThread : public sys::parallel::Thread
+class GitMetaDataThread : public GitCommandThread
 {
 public:
 	struct Data
@@ -108,160 +393,765 @@ public:
 		int64_t date;
 		std::string author;
 		std::string message;
+
+		inline size_t footprint() const { return sizeof(Data) + author.capacity() + message.capacity(); }
 	};
 
 public:
-	GitMetaDataThread(const std::string &gitpath, JobQueue<std::string, Data> *queue)
+	GitMetaDataThread(const std::string &gitpath, JobQueue<RevisionId, Data> *queue)
 		: m_gitpath(gitpath), m_queue(queue)
 	{
 	}
 
-	static void parseHeader(const std::vector<std::string> &header, Data *dest)
+	// Parses a raw commit object
+	static void parseCommit(const char *data, size_t len, Data *dest)
 	{
-		// TODO: Proper exception descriptions
-		if (header.size() < 5) {
-			throw PEX(str::printf("Unable to parse meta-data"));
-		}
-
-		// Here's the raw header format. The 'parent' line is not present for
-		// non-root commits.
-		// $ID_HASH
+		// Here's the raw object format. The 'parent' line is not present for
+		// root commits and is repeated for merges. Additional headers like
+		// 'encoding' or 'gpgsig' may follow the committer line.
 		// tree $TREE_HASH
 		// parent $PARENT_HASH
 		// author $AUTHOR_NAME $AUTHOR_EMAIL $DATE $OFFSET
 		// committer $AUTHOR_NAME $AUTHOR_EMAIL $DATE $OFFSET
 		//
-		//     $MESSAGE_INDENTED_BY_4_SPACES
-
-		// Find author line
-		size_t line = 0;
-		while (line < header.size() && header[line].compare(0, 7, "author ")) {
-			++line;
-		}
-		if (line >= header.size()) {
-			PDEBUG << "Invalid header:" << endl;
-			for (size_t i = 0; i < header.size(); i++) {
-				PDEBUG << header[i] << endl;
+		// $MESSAGE
+
+		// Locate author and committer lines
+		const char *author = NULL, *authorEnd = NULL;
+		const char *committer = NULL, *committerEnd = NULL;
+		const char *p = data, *end = data + len;
+		while (p < end) {
+			const char *eol = (const char *)memchr(p, '\n', end - p);
+			if (eol == NULL) {
+				eol = end;
+			}
+			if (eol == p) { // End of headers
+				++p;
+				break;
 			}
+			if (author == NULL && eol - p >= 7 && !memcmp(p, "author ", 7)) {
+				author = p + 7;
+				authorEnd = eol;
+			} else if (committer == NULL && eol - p >= 10 && !memcmp(p, "committer ", 10)) {
+				committer = p;
+				committerEnd = eol;
+			}
+			p = (eol < end ? eol + 1 : end);
+		}
+		if (author == NULL || committer == NULL) {
+			PDEBUG << "Invalid commit object:" << endl << std::string(data, len) << endl;
 			throw PEX(str::printf("Unable to parse meta-data"));
 		}
 
-		// Author information
-		dest->author = header[line].substr(7);
-
-		// Strip email address and date, assuming a start at the last "<" (not really compliant with RFC2882)
-		size_t pos = dest->author.find_last_of('<');
-		if (pos != std::string::npos) {
-			dest->author = dest->author.substr(0, pos);
+		// Author information. Strip email address and date, assuming a start
+		// at the last "<" (not really compliant with RFC2882)
+		const char *pos = authorEnd;
+		while (pos > author && pos[-1] != '<') {
+			--pos;
 		}
-		dest->author = str::trim(dest->author);
+		dest->author.assign(author, (pos > author ? pos - 1 : authorEnd));
+		str::trim(&dest->author);
 
 		// Commiter date
-		if (header[++line].compare(0, 10, "committer ")) {
-			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
+		std::string line(committer, committerEnd);
+		size_t i, j;
+		if ((i = line.find_last_of(' ')) == std::string::npos) {
+			throw PEX(str::printf("Unable to parse commit date from line: %s", line.c_str()));
 		}
-		if ((pos = header[line].find_last_of(' ')) == std::string::npos) {
-			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
-		}
-		size_t pos2 = header[line].find_last_of(' ', pos - 1);
-		if (pos2 == std::string::npos || !str::str2int(header[line].substr(pos2, pos - pos2), &(dest->date), 10)) {
-			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
+		j = line.find_last_of(' ', i - 1);
+		if (j == std::string::npos || !str::str2int(line.substr(j, i - j), &(dest->date), 10)) {
+			throw PEX(str::printf("Unable to parse commit date from line: %s", line.c_str()));
 		}
 		int64_t offset_hr = 0, offset_min = 0;
-		if (!str::str2int(header[line].substr(pos+1, 3), &offset_hr, 10) || !str::str2int(header[line].substr(pos+4, 2), &offset_min, 10)) {
-			throw PEX(str::printf("Unable to parse commit date from line: %s", header[line].c_str()));
+		if (i + 4 > line.length() || !str::str2int(line.substr(i+1, 3), &offset_hr, 10) || !str::str2int(line.substr(i+4, 2), &offset_min, 10)) {
+			throw PEX(str::printf("Unable to parse commit date from line: %s", line.c_str()));
 		}
 		dest->date += offset_hr * 60 * 60 + offset_min * 60;
 
-		// Commit message
-		dest->message.clear();
-		for (size_t i = line+1; i < header.size(); i++) {
-			if (header[i].length() > 4) {
-				dest->message += header[i].substr(4);
-			}
-			if (!header[i].empty() && header[i][0] != '\0') {
-				dest->message += "\n";
+		parseMessage(p, end, &dest->message);
+	}
+
+	// Copies a commit message without leading and trailing blank lines and
+	// with a terminating newline like in the output of git rev-list
+	static void parseMessage(const char *p, const char *end, std::string *dest)
+	{
+		const char *start = p, *stop = end;
+		for (const char *q = p; q < end && isspace((unsigned char)*q); q++) {
+			if (*q == '\n') {
+				start = q + 1;
 			}
 		}
+		while (stop > start && isspace((unsigned char)stop[-1])) {
+			--stop;
+		}
+		dest->clear();
+		if (stop > start) {
+			const char *eol = (const char *)memchr(stop, '\n', end - stop);
+			dest->assign(start, (eol ? eol : end) - start);
+			*dest += '\n';
+		}
 	}
 
 	static void metaData(const std::string &gitpath, const std::string &id, Data *dest)
 	{
 		int ret;
-		std::string header = sys::io::exec(&ret, (gitpath+"/git-rev-list").c_str(), "-1", "--header", id.c_str());
+		std::string object = sys::io::exec(&ret, (gitpath+"/git-cat-file").c_str(), "commit", id.c_str());
 		if (ret != 0) {
-			throw PEX(str::printf("Unable to retrieve meta-data for revision '%s' (%d, %s)", id.c_str(), ret, header.c_str()));
+			throw PEX(str::printf("Unable to retrieve meta-data for revision '%s' (%d, %s)", id.c_str(), ret, object.c_str()));
 		}
 
-		parseHeader(str::split(header, "\n"), dest);
+		parseCommit(object.data(), object.length(), dest);
 	}
 
 protected:
 	void run()
 	{
+		// The objects are read from a single git cat-file process, similar
+		// to the diffstat pipe
+		sys::io::PopenStreambuf buf((m_gitpath+"/git-cat-file").c_str(), "--batch", NULL, NULL, NULL, NULL, NULL, NULL, std::ios::in | std::ios::out);
+		Attachment attachment(this, &buf);
+		std::istream in(&buf);
+		std::ostream out(&buf);
+
 		Data data;
 		const size_t maxids = 64;
-		const char **args = new const char *[maxids + 4];
-		std::vector<std::string> ids;
+		std::vector<RevisionId> ids;
+		std::string str, object;
 
-		std::string revlist = m_gitpath + "/git-rev-list";
-		args[0] = "--no-walk";
-		args[1] = "--header"; // No support for message bodies in old git versions
-
-		// Try to fetch the revision headers for maxrevs revisions at once
 		while (m_queue->getArgs(&ids, maxids)) {
 			for (size_t i = 0; i < ids.size(); i++) {
-				args[i+2] = ids[i].c_str();
+				out << ids[i] << '\n';
+			}
+			out << std::flush;
+
+			for (size_t i = 0; i < ids.size(); i++) {
+				// Each object is printed as "$SHA1 $TYPE $SIZE\n$CONTENTS\n",
+				// or as "$ID missing\n" if it can't be found
+				if (!in.good() || !std::getline(in, str)) {
+					if (cancelled()) {
+						for (size_t j = i; j < ids.size(); j++) {
+							m_queue->failed(ids[j]);
+						}
+						return;
+					}
+
+					// The pipe is broken, so fall back to single lookups
+					try {
+						metaData(m_gitpath, ids[i].str(), &data);
+						m_queue->done(ids[i], data, data.footprint());
+					} catch (const std::exception &ex) {
+						PDEBUG << "Error retrieving revision meta-data: " << ex.what() << endl;
+						m_queue->failed(ids[i]);
+					}
+					continue;
+				}
+
+				size_t pos = str.find_last_of(' ');
+				size_t size = 0;
+				if (pos == std::string::npos || !str::str2int(str.substr(pos+1), &size, 10)) {
+					PDEBUG << "Error retrieving revision meta-data: " << str << endl;
+					m_queue->failed(ids[i]);
+					continue;
+				}
+
+				object.resize(size);
+				if (size > 0) {
+					in.read(&object[0], size);
+				}
+				in.ignore(1);
+
+				try {
+					size_t tpos = str.find(' ');
+					if (tpos == pos || str.compare(tpos+1, pos-tpos-1, "commit")) {
+						throw PEX(str::printf("Not a commit: %s", str.c_str()));
+					}
+					parseCommit(object.data(), object.length(), &data);
+					m_queue->done(ids[i], data, data.footprint());
+				} catch (const std::exception &ex) {
+					PDEBUG << "Error parsing revision header: " << ex.what() << endl;
+					m_queue->failed(ids[i]);
+				}
+			}
+		}
+	}
+
+private:
+	std::string m_gitpath;
+	JobQueue<RevisionId, Data> *m_queue;
+};
+
+
+// Reads objects from a single "git cat-file --batch" process that is kept
+// open for the lifetime of the backend
+class GitObjectReader
+{
+public:
+	// Receives the contents of the object with the given index in chunks
+	typedef std::function<void (size_t index, const char *data, size_t len)> Sink;
+
+	GitObjectReader(const std::string &gitpath)
+		: m_buf((gitpath+"/git-cat-file").c_str(), "--batch", NULL, NULL, NULL, NULL, NULL, NULL, std::ios::in | std::ios::out),
+		  m_in(&m_buf), m_out(&m_buf), m_data(65536)
+	{
+	}
+
+	~GitObjectReader()
+	{
+		m_buf.closeWrite();
+		m_buf.close();
+	}
+
+	// Requests the given objects and passes their contents to the sink.
+	// Throws if the process doesn't respond properly, and the reader can't
+	// be used afterwards.
+	std::vector<GitBackend::Object> read(const std::vector<std::string> &names, const Sink &sink)
+	{
+		std::vector<GitBackend::Object> objects(names.size());
+		const size_t chunk = 64;
+		std::string line;
+		for (size_t i = 0; i < names.size(); i += chunk) {
+			size_t n = std::min(chunk, names.size() - i);
+			for (size_t j = i; j < i + n; j++) {
+				if (names[j].find('\n') != std::string::npos) {
+					throw PEX(str::printf("Invalid object name: %s", names[j].c_str()));
+				}
+				m_out << names[j] << '\n';
 			}
-			args[ids.size()+2] = NULL;
+			m_out << std::flush;
+
+			// Each object is printed as "$SHA1 $TYPE $SIZE\n$CONTENTS\n", or
+			// as "$NAME missing\n" if it can't be found
+			for (size_t j = i; j < i + n; j++) {
+				if (!m_in.good() || !std::getline(m_in, line)) {
+					throw PEX(str::printf("Unable to read object %s", names[j].c_str()));
+				}
+				str::View parts[4];
+				size_t size = 0;
+				if (str::split(line, " ", parts, 4) != 3 || !str::str2int(parts[2].str(), &size, 10)) {
+					continue;
+				}
+
+				objects[j].sha1 = parts[0].str();
+				objects[j].type = parts[1].str();
+				while (size > 0 && m_in.good()) {
+					m_in.read(&m_data[0], std::min(size, m_data.size()));
+					sink(j, &m_data[0], m_in.gcount());
+					size -= m_in.gcount();
+				}
+				m_in.ignore(1);
+			}
+		}
+		return objects;
+	}
+
+private:
+	sys::io::PopenStreambuf m_buf;
+	std::istream m_in;
+	std::ostream m_out;
+	std::vector<char> m_data;
+};
+
+
+// Fetches the blobs that are missing in a partial clone in bulk before
+// handing revisions to the diffstat workers. Otherwise, git would fetch
+// them lazily, one round trip to the promisor remote per revision.
+class GitBlobBackfill : public GitCommandThread
+{
+public:
+	GitBlobBackfill(const std::string &gitpath, const std::string &remote, JobQueue<RevisionId, DiffstatPtr> *queue)
+		: m_gitpath(gitpath), m_remote(remote), m_queue(queue), m_end(false)
+	{
+	}
+
+	void put(const std::vector<RevisionId> &ids)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		m_batches.push_back(ids);
+		m_pending.insert(ids.begin(), ids.end());
+		m_cond.wakeAll();
+	}
+
+	void stop()
+	{
+		{
+			sys::parallel::MutexLocker locker(&m_mutex);
+			m_end = true;
+			m_batches.clear();
+			m_pending.clear();
+			m_cond.wakeAll();
+		}
+		cancel();
+	}
+
+	bool pending(const RevisionId &id)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		return (m_pending.find(id) != m_pending.end());
+	}
+
+	// Blocks until the revision has been passed to the diffstat workers
+	void wait(const RevisionId &id)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (m_pending.find(id) != m_pending.end()) {
+			m_cond.wait(&m_mutex);
+		}
+	}
+
+protected:
+	void run()
+	{
+		std::vector<RevisionId> ids;
+		while (take(&ids)) {
+			try {
+				backfill(ids);
+			} catch (const std::exception &ex) {
+				// Not fatal, git will still fetch the blobs on demand
+				if (cancelled()) {
+					break;
+				}
+				Logger::warn() << "Warning: Unable to fetch missing blobs: " << ex.what() << endl;
+			}
+
+			sys::parallel::MutexLocker locker(&m_mutex);
+			if (m_end) {
+				break;
+			}
+			m_queue->put(ids);
+			for (size_t i = 0; i < ids.size(); i++) {
+				m_pending.erase(ids[i]);
+			}
+			m_cond.wakeAll();
+		}
+	}
+
+private:
+	bool take(std::vector<RevisionId> *ids)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		while (!m_end && m_batches.empty()) {
+			m_cond.wait(&m_mutex);
+		}
+		if (m_end) {
+			return false;
+		}
+		ids->swap(m_batches.front());
+		m_batches.pop_front();
+		return true;
+	}
+
+	// Lists the objects introduced by the given revisions that are missing
+	// locally and fetches them at once. The blobs of the parent trees have
+	// usually been fetched with the previous batch.
+	void backfill(const std::vector<RevisionId> &ids)
+	{
+		PTRACE_SCOPE("git.backfill");
+		sys::datetime::Watch watch;
+		std::vector<std::string> missing;
+		{
+			sys::io::PopenStreambuf buf((m_gitpath+"/git-rev-list").c_str(), "--objects", "--missing=print", "--stdin", NULL, NULL, NULL, NULL, std::ios::in | std::ios::out);
+			Attachment attachment(this, &buf);
+			std::istream in(&buf);
+			std::ostream out(&buf);
+			for (size_t i = 0; i < ids.size(); i++) {
+				out << ids[i].childStr() << '\n';
+				if (ids[i].hasParent()) {
+					out << '^' << ids[i].parentStr() << '\n';
+				}
+			}
+			out << std::flush;
+			buf.closeWrite();
+
+			std::string line;
+			while (std::getline(in, line)) {
+				if (!line.empty() && line[0] == '?') {
+					missing.push_back(str::trim(line.substr(1)));
+				}
+			}
+			if (buf.close() != 0) {
+				throw PEX("git rev-list command failed");
+			}
+		}
+		if (missing.empty()) {
+			return;
+		}
+
+		sys::io::PopenStreambuf buf((m_gitpath+"/git-fetch").c_str(), "--quiet", "--no-tags", "--no-write-fetch-head", "--recurse-submodules=no", "--filter=blob:none", "--stdin", m_remote.c_str(), std::ios::in | std::ios::out);
+		Attachment attachment(this, &buf);
+		std::istream in(&buf);
+		std::ostream out(&buf);
+		for (size_t i = 0; i < missing.size(); i++) {
+			out << missing[i] << '\n';
+		}
+		out << std::flush;
+		buf.closeWrite();
+		in.ignore(std::numeric_limits<std::streamsize>::max());
+		if (buf.close() != 0) {
+			throw PEX(str::printf("git fetch from promisor remote '%s' failed", m_remote.c_str()));
+		}
+		PDEBUG << "Fetched " << missing.size() << " missing objects for " << ids.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+	}
+
+private:
+	std::string m_gitpath, m_remote;
+	JobQueue<RevisionId, DiffstatPtr> *m_queue;
+	sys::parallel::Mutex m_mutex;
+	sys::parallel::WaitCondition m_cond;
+	std::deque<std::vector<RevisionId> > m_batches;
+	std::unordered_set<RevisionId> m_pending;
+	bool m_end;
+};
+
+
+// Meta-data of the revisions read by the log streams. The streams report it
+// along with the diffstats, so unlike the meta queue, there are no workers
+// taking jobs from it.
+class GitStreamedMeta
+{
+public:
+	GitStreamedMeta()
+		: m_end(false)
+	{
+	}
+
+	~GitStreamedMeta()
+	{
+		std::unordered_map<RevisionId, Entry>::iterator it;
+		for (it = m_entries.begin(); it != m_entries.end(); ++it) {
+			MemoryBudget::release(it->second.bytes);
+		}
+	}
+
+	void put(const std::vector<RevisionId> &ids)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		for (size_t i = 0; i < ids.size(); i++) {
+			m_entries.insert(std::make_pair(ids[i], Entry()));
+		}
+	}
+
+	void stop()
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		m_end = true;
+		m_cond.wakeAll();
+	}
+
+	bool hasArg(const RevisionId &id)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		return (m_entries.find(id) != m_entries.end());
+	}
+
+	bool getResult(const RevisionId &id, GitMetaDataThread::Data *dest)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		std::unordered_map<RevisionId, Entry>::iterator it;
+		while ((it = m_entries.find(id)) != m_entries.end() && !m_end && it->second.status < 0) {
+			m_cond.wait(&m_mutex);
+		}
+		if (it == m_entries.end() || m_end) {
+			return false;
+		}
+
+		bool ok = (it->second.status > 0);
+		if (ok) {
+			*dest = it->second.data;
+		}
+		MemoryBudget::release(it->second.bytes);
+		m_entries.erase(it);
+		return ok;
+	}
+
+	void done(const RevisionId &id, const GitMetaDataThread::Data &data)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		std::unordered_map<RevisionId, Entry>::iterator it = m_entries.find(id);
+		if (it != m_entries.end() && it->second.status < 0) {
+			it->second.data = data;
+			it->second.status = 1;
+			it->second.bytes = data.footprint();
+			MemoryBudget::charge(it->second.bytes);
+			m_cond.wakeAll();
+		}
+	}
+
+	void failed(const RevisionId &id)
+	{
+		sys::parallel::MutexLocker locker(&m_mutex);
+		std::unordered_map<RevisionId, Entry>::iterator it = m_entries.find(id);
+		if (it != m_entries.end() && it->second.status < 0) {
+			it->second.status = 0;
+			m_cond.wakeAll();
+		}
+	}
+
+private:
+	struct Entry
+	{
+		GitMetaDataThread::Data data;
+		int status; // -1: pending, 0: failed, 1: done
+		size_t bytes; // Charged to the memory budget
+
+		Entry() : status(-1), bytes(0) { }
+	};
+
+	sys::parallel::Mutex m_mutex;
+	sys::parallel::WaitCondition m_cond;
+	std::unordered_map<RevisionId, Entry> m_entries;
+	bool m_end;
+};
+
+
+// Diffstat and meta-data fetching worker thread, reading runs of consecutive
+// revisions from a single "git log -p" process each. Commits are separated
+// by marker characters and parsed on the fly, so there are no round trips
+// per revision and no separate meta-data lookups. Since the log follows the
+// first parents, merges are diffed against their first parent like in the
+// revision IDs of the log iterator. Revisions missing from the output, e.g.
+// if the parent doesn't match, are fetched separately.
+class GitLogStream : public GitCommandThread
+{
+public:
+	enum {
+		MaxBatch = 512
+	};
+
+public:
+	GitLogStream(const std::string &gitpath, JobQueue<RevisionId, DiffstatPtr> *diffQueue, GitStreamedMeta *metaQueue, bool lines = false, const std::vector<std::string> &excludes = std::vector<std::string>())
+		: m_gitpath(gitpath), m_diffQueue(diffQueue), m_metaQueue(metaQueue), m_lines(lines), m_excludes(excludes)
+	{
+	}
+
+protected:
+	void run()
+	{
+		std::vector<RevisionId> ids;
+		while (m_diffQueue->getArgs(&ids, MaxBatch)) {
+			size_t begin = 0;
+			for (size_t i = 1; i <= ids.size() && !cancelled(); i++) {
+				if (i == ids.size() || !ids[i].hasParent() || ids[i].parentStr() != ids[i-1].childStr()) {
+					fetch(ids, begin, i);
+					begin = i;
+				}
+			}
+			if (cancelled()) {
+				for (size_t i = begin; i < ids.size(); i++) {
+					m_diffQueue->failed(ids[i]);
+					m_metaQueue->failed(ids[i].child());
+				}
+				return;
+			}
+		}
+	}
+
+private:
+	// A commit in the log output
+	struct Commit
+	{
+		std::string id, parent;
+		GitMetaDataThread::Data data;
+	};
+
+	// Returns the arguments for "git log" listing the given revisions. The
+	// output shouldn't depend on any configuration, and commits that touch
+	// excluded paths only must still be listed.
+	std::vector<std::string> arguments(const RevisionId &first, const RevisionId &last, size_t count)
+	{
+		std::vector<std::string> args;
+		args.push_back("--first-parent");
+		args.push_back("--reverse");
+		args.push_back(str::printf("--max-count=%lu", (unsigned long)count));
+		args.push_back("-m");
+		args.push_back("--root");
+		args.push_back("--no-renames");
+		args.push_back("--no-color");
+		args.push_back("--no-textconv");
+		args.push_back("--no-ext-diff");
+		args.push_back("--no-show-signature");
+		args.push_back("--submodule=short");
+		args.push_back("--src-prefix=a/");
+		args.push_back("--dst-prefix=b/");
+		args.push_back("--encoding=none");
+		args.push_back("--date=raw");
+		args.push_back(m_lines ? "--numstat" : "-U0");
+		args.push_back("--format=%x01%H %P%n%cd%n%an%n%B%x02");
+		if (first.hasParent()) {
+			args.push_back(first.parentStr() + ".." + last.childStr());
+		} else {
+			args.push_back(last.childStr());
+		}
+		if (!m_excludes.empty()) {
+			args.push_back("--full-history");
+			args.push_back("--sparse");
+			args.push_back("--");
+			args.push_back(":/");
+			for (size_t i = 0; i < m_excludes.size(); i++) {
+				args.push_back(":(top,exclude)" + m_excludes[i]);
+			}
+		}
+		return args;
+	}
+
+	// Parses the header of a commit, which consists of the IDs, the date,
+	// the author and the message that is terminated by a marker line
+	static bool parseHeader(const std::string &header, Commit *dest)
+	{
+		size_t l1 = header.find('\n');
+		size_t l2 = (l1 != std::string::npos ? header.find('\n', l1 + 1) : l1);
+		size_t l3 = (l2 != std::string::npos ? header.find('\n', l2 + 1) : l2);
+		if (l3 == std::string::npos || header.length() < l3 + 3) {
+			return false;
+		}
+
+		size_t pos = header.find(' ');
+		if (pos == std::string::npos || pos > l1) {
+			return false;
+		}
+		dest->id = header.substr(0, pos);
+		size_t end = header.find_first_of(" \n", pos + 1);
+		dest->parent = header.substr(pos + 1, end - pos - 1);
+
+		// Committer date and timezone offset: "$DATE $OFFSET"
+		std::string date = header.substr(l1 + 1, l2 - l1 - 1);
+		int64_t offset_hr = 0, offset_min = 0;
+		pos = date.find(' ');
+		if (pos == std::string::npos || !str::str2int(date.substr(0, pos), &dest->data.date, 10) || pos + 6 > date.length()
+			|| !str::str2int(date.substr(pos+1, 3), &offset_hr, 10) || !str::str2int(date.substr(pos+4, 2), &offset_min, 10)) {
+			return false;
+		}
+		dest->data.date += offset_hr * 60 * 60 + offset_min * 60;
+
+		dest->data.author = str::trim(header.substr(l2 + 1, l3 - l2 - 1));
+		GitMetaDataThread::parseMessage(header.data() + l3 + 1, header.data() + header.length() - 2, &dest->data.message);
+		return true;
+	}
+
+	// Reports the results of a parsed commit if it has been requested
+	void emit(const Commit &commit, const DiffstatPtr &stat, std::unordered_map<std::string, RevisionId> *pending)
+	{
+		std::unordered_map<std::string, RevisionId>::iterator it = pending->find(commit.id);
+		if (it == pending->end() || it->second.parentStr() != commit.parent) {
+			return;
+		}
+		m_diffQueue->done(it->second, stat, stat->footprint());
+		m_metaQueue->done(it->second.child(), commit.data);
+		pending->erase(it);
+	}
 
-			sys::io::PopenStreambuf buf(revlist.c_str(), args);
-			std::istream in(&buf);
+	// Fetches a run of consecutive revisions
+	void fetch(const std::vector<RevisionId> &ids, size_t begin, size_t end)
+	{
+		PTRACE_SCOPE("git.log");
+		std::unordered_map<std::string, RevisionId> pending;
+		for (size_t i = begin; i < end; i++) {
+			pending[ids[i].childStr()] = ids[i];
+		}
 
-			// Parse headers
-			std::string str;
-			std::vector<std::string> header;
-			while (in.good()) {
-				std::getline(in, str);
-				if (!str.empty() && str[0] == '\0') {
-					try {
-						parseHeader(header, &data);
-						m_queue->done(header[0], data);
-					} catch (const std::exception &ex) {
-						PDEBUG << "Error parsing revision header: " << ex.what() << endl;
-						m_queue->failed(header[0]);
+		std::vector<std::string> args = arguments(ids[begin], ids[end-1], end - begin);
+		std::vector<const char *> argv;
+		for (size_t i = 0; i < args.size(); i++) {
+			argv.push_back(args[i].c_str());
+		}
+		argv.push_back(NULL);
+		sys::io::PopenStreambuf buf((m_gitpath+"/git-log").c_str(), &argv[0]);
+		Attachment attachment(this, &buf);
+
+		// Each commit starts with a line beginning with \x01, and its
+		// header ends with a line ending with \x02. Diff lines can't start
+		// with \x01, since they are prefixed with their type.
+		DiffParser parser(m_lines ? DiffParser::Numstat : DiffParser::Unified);
+		Commit commit;
+		std::string header;
+		bool inHeader = false, valid = false, bol = true;
+		char data[16384];
+		std::streamsize n;
+		while ((n = buf.sgetn(data, sizeof(data))) > 0) {
+			const char *p = data, *e = data + n;
+			while (p < e) {
+				if (inHeader) {
+					const char *nl = (const char *)memchr(p, '\n', e - p);
+					header.append(p, (nl ? nl + 1 : e) - p);
+					p = (nl ? nl + 1 : e);
+					if (nl && header.length() >= 2 && header[header.length()-2] == '\x02') {
+						valid = parseHeader(header, &commit);
+						if (!valid) {
+							PDEBUG << "Unable to parse commit header:" << endl << header << endl;
+						}
+						inHeader = false;
+						bol = true;
 					}
-
-					header.clear();
-					header.push_back(str.substr(1));
-				} else {
-					header.push_back(str);
+					continue;
 				}
-			}
-
-			int ret = buf.close();
-			if (ret != 0) {
-				PDEBUG << "Error running rev-list, ret = " << ret << endl;
 
-				// Try all IDs one by one, so the incorrect ones can be identified
-				for (size_t i = 0; i < ids.size(); i++) {
-					try {
-						metaData(m_gitpath, ids[i], &data);
-						m_queue->done(ids[i], data);
-					} catch (const std::exception &ex) {
-						PDEBUG << "Error parsing revision header: " << ex.what() << endl;
-						m_queue->failed(ids[i]);
+				// Look for the start of the next commit
+				const char *marker = NULL;
+				for (const char *q = p; q < e && (q = (const char *)memchr(q, '\x01', e - q)) != NULL; q++) {
+					if ((q == p && bol) || (q > p && q[-1] == '\n')) {
+						marker = q;
+						break;
 					}
 				}
+				if (marker == NULL) {
+					parser.feed(p, e - p);
+					bol = (e[-1] == '\n');
+					p = e;
+					continue;
+				}
+
+				parser.feed(p, marker - p);
+				DiffstatPtr stat = parser.finish();
+				if (valid) {
+					emit(commit, stat, &pending);
+				}
+				header.clear();
+				inHeader = true;
+				valid = false;
+				p = marker + 1;
+			}
+		}
+		DiffstatPtr stat = parser.finish();
+		if (valid && !inHeader) {
+			emit(commit, stat, &pending);
+		}
+
+		int ret = buf.close();
+		if (cancelled()) {
+			for (size_t i = begin; i < end; i++) {
+				m_diffQueue->failed(ids[i]);
+				m_metaQueue->failed(ids[i].child());
 			}
+			return;
+		}
+		if (ret != 0) {
+			PDEBUG << "git log command failed with exit code " << ret << " for " << ids[begin].str() << " to " << ids[end-1].str() << endl;
 		}
 
-		delete[] args;
+		for (size_t i = begin; i < end; i++) {
+			if (pending.find(ids[i].childStr()) == pending.end()) {
+				continue;
+			}
+			PDEBUG << "Revision " << ids[i].str() << " not in log output, fetching it separately" << endl;
+			try {
+				GitMetaDataThread::Data data;
+				GitMetaDataThread::metaData(m_gitpath, ids[i].childStr(), &data);
+				DiffstatPtr stat = GitDiffstatPipe::diffstat(m_gitpath, ids[i].childStr(), ids[i].parentStr(), m_lines, m_excludes);
+				m_diffQueue->done(ids[i], stat, stat->footprint());
+				m_metaQueue->done(ids[i].child(), data);
+			} catch (const std::exception &ex) {
+				PDEBUG << "Error retrieving revision " << ids[i].str() << ": " << ex.what() << endl;
+				m_diffQueue->failed(ids[i]);
+				m_metaQueue->failed(ids[i].child());
+			}
+		}
 	}
 
 private:
 	std::string m_gitpath;
-	JobQueue<std::string, Data> *m_queue;
+	JobQueue<RevisionId, DiffstatPtr> *m_diffQueue;
+	GitStreamedMeta *m_metaQueue;
+	bool m_lines;
+	std::vector<std::string> m_excludes;
 };
 
 
@@ -269,27 +1159,44 @@ private:
 class GitRevisionPrefetcher
 {
 public:
-	GitRevisionPrefetcher(const std::string &git, int n = -1)
-		: m_metaQueue(4096)
+	GitRevisionPrefetcher(const std::string &git, bool lines, const std::vector<std::string> &excludes, const std::string &promisor = std::string(), size_t split = 0, bool stream = false, int n = -1)
+		: m_metaQueue(4096), m_backfill(NULL), m_stream(stream)
 	{
 		if (n < 0) {
-			n = std::max(1, sys::parallel::idealThreadCount() / 2);
+			n = std::max(1, sys::parallel::ThreadPool::globalSize() / 2);
 		}
 		for (int i = 0; i < n; i++) {
-			sys::parallel::Thread *thread = new GitDiffstatPipe(git, &m_diffQueue);
+			GitCommandThread *thread;
+			if (stream) {
+				thread = new GitLogStream(git, &m_diffQueue, &m_streamMeta, lines, excludes);
+			} else {
+				thread = new GitDiffstatPipe(git, &m_diffQueue, lines, excludes, split);
+			}
 			thread->start();
 			m_threads.push_back(thread);
 		}
 
 		// Limit to 4 threads to prevent meta queue congestions
+		int ndiff = n;
 		n = std::min(n, 4);
 		for (int i = 0; i < n; i++) {
-			sys::parallel::Thread *thread = new GitMetaDataThread(git, &m_metaQueue);
+			GitCommandThread *thread = new GitMetaDataThread(git, &m_metaQueue);
 			thread->start();
 			m_threads.push_back(thread);
 		}
 
-		Logger::info() << "GitBackend: Using " << m_threads.size() << " threads for prefetching diffstats ("
+		// Let the queues find out how many workers are actually needed
+		m_diffQueue.setLimits(1, ndiff, 64, 4096);
+		m_metaQueue.setLimits(1, n, 512, 16384);
+
+		if (!promisor.empty()) {
+			m_backfill = new GitBlobBackfill(git, promisor, &m_diffQueue);
+			m_backfill->start();
+			m_threads.push_back(m_backfill);
+			Logger::info() << "GitBackend: Fetching missing blobs from promisor remote " << promisor << " in bulk" << endl;
+		}
+
+		Logger::info() << "GitBackend: Using " << m_threads.size() << " threads for prefetching " << (stream ? "logs" : "diffstats") << " ("
 			<< m_threads.size()-n << ") / meta-data (" << n << ")" << endl;
 	}
 
@@ -300,10 +1207,19 @@ public:
 		}
 	}
 
+	// Drops all queued jobs and kills the commands of running ones, so
+	// waiting for the threads doesn't take longer than necessary
 	void stop()
 	{
+		if (m_backfill) {
+			m_backfill->stop();
+		}
 		m_diffQueue.stop();
 		m_metaQueue.stop();
+		m_streamMeta.stop();
+		for (size_t i = 0; i < m_threads.size(); i++) {
+			m_threads[i]->cancel();
+		}
 	}
 
 	void wait()
@@ -313,49 +1229,346 @@ public:
 		}
 	}
 
-	void prefetch(const std::vector<std::string> &revisions)
+	void prefetch(const std::vector<std::string> &revisions, bool diffstats = true)
 	{
-		m_diffQueue.put(revisions);
-
 		// Put child commits only to the meta queue
-		std::vector<std::string> children;
-		children.resize(revisions.size());
+		std::vector<RevisionId> ids, children;
+		ids.reserve(revisions.size());
+		children.reserve(revisions.size());
 		for (size_t i = 0; i < revisions.size(); i++) {
-			children[i] = utils::childId(revisions[i]);
+			ids.push_back(RevisionId(revisions[i]));
+			children.push_back(ids.back().child());
+		}
+
+		// The log streams read the meta-data along with the diffstats
+		if (m_stream) {
+			std::vector<RevisionId> missing;
+			for (size_t i = 0; i < children.size(); i++) {
+				if (diffstats ? !m_metaQueue.hasArg(children[i]) : !m_streamMeta.hasArg(children[i])) {
+					missing.push_back(children[i]);
+				}
+			}
+			children.swap(missing);
+		}
+
+		if (diffstats && m_backfill) {
+			m_backfill->put(ids);
+		} else if (diffstats) {
+			m_diffQueue.put(ids);
+		}
+		if (diffstats && m_stream) {
+			m_streamMeta.put(children);
+		} else {
+			m_metaQueue.put(children);
 		}
-		m_metaQueue.put(children);
 	}
 
-	bool getDiffstat(const std::string &revision, DiffstatPtr *dest)
+	bool getDiffstat(const RevisionId &revision, DiffstatPtr *dest)
 	{
+		if (m_backfill) {
+			m_backfill->wait(revision);
+		}
 		return m_diffQueue.getResult(revision, dest);
 	}
 
-	bool getMeta(const std::string &revision, GitMetaDataThread::Data *dest)
+	bool getMeta(const RevisionId &revision, GitMetaDataThread::Data *dest)
 	{
-		return m_metaQueue.getResult(utils::childId(revision), dest);
+		if (m_stream && !m_metaQueue.hasArg(revision.child())) {
+			return m_streamMeta.getResult(revision.child(), dest);
+		}
+		return m_metaQueue.getResult(revision.child(), dest);
 	}
 
-	bool willFetchDiffstat(const std::string &revision)
+	bool willFetchDiffstat(const RevisionId &revision)
 	{
-		return m_diffQueue.hasArg(revision);
+		return ((m_backfill && m_backfill->pending(revision)) || m_diffQueue.hasArg(revision));
 	}
 
-	bool willFetchMeta(const std::string &revision)
+	bool willFetchMeta(const RevisionId &revision)
 	{
-		return m_metaQueue.hasArg(utils::childId(revision));
+		return (m_metaQueue.hasArg(revision.child()) || (m_stream && m_streamMeta.hasArg(revision.child())));
 	}
 
 private:
-	JobQueue<std::string, DiffstatPtr> m_diffQueue;
-	JobQueue<std::string, GitMetaDataThread::Data> m_metaQueue;
-	std::vector<sys::parallel::Thread *> m_threads;
+	JobQueue<RevisionId, DiffstatPtr> m_diffQueue;
+	JobQueue<RevisionId, GitMetaDataThread::Data> m_metaQueue;
+	GitStreamedMeta m_streamMeta;
+	GitBlobBackfill *m_backfill;
+	bool m_stream;
+	std::vector<GitCommandThread *> m_threads;
 };
 
 
+// Constructor
+GitBackend::GitLogIterator::GitLogIterator(GitBackend *backend, const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter)
+	: LogIterator(), m_backend(backend), m_gitpath(backend->m_gitpath), m_branch(branch), m_start(start), m_end(end),
+	  m_index(0), m_finished(false), m_ret(0), m_filter(filter), m_filtered(false)
+{
+
+}
+
+// Adds the next revision IDs to the queue or returns false
+bool GitBackend::GitLogIterator::nextIds(std::queue<std::string> *queue)
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	while (m_index >= m_ids.size() && !m_finished) {
+		m_cond.wait(locker.mutex());
+	}
+
+	if (m_ret != 0) {
+		throw PEX(str::printf("Unable to retrieve log for branch '%s' (%d)", m_branch.c_str(), m_ret));
+	}
+	if (m_index == m_ids.size()) {
+		return false;
+	}
+
+	while (m_index < m_ids.size()) {
+		queue->push(m_ids[m_index++]);
+	}
+	return true;
+}
+
+// Main thread loop
+void GitBackend::GitLogIterator::run()
+{
+	// Commits matching the filter are determined first. The complete chain
+	// is still needed for determining the parents of the matching commits.
+	if (!m_filter.empty()) {
+		m_filtered = readMatches();
+	}
+
+	// The first-parent chain of the branch is cached, so only the commits
+	// added since the last run need to be listed
+	std::vector<std::string> chain;
+	std::vector<uint64_t> dates;
+	std::string cachefile = str::printf("gitlog_%s", m_branch.c_str());
+	bool useCache = m_backend->options().useCache();
+	if (useCache) {
+		readChainFromCache(cachefile, &chain, &dates);
+	}
+	size_t cached = chain.size();
+
+	int ret = 0;
+	std::string head;
+	if (!chain.empty()) {
+		head = str::trim(sys::io::exec(&ret, (m_gitpath+"/git-rev-parse").c_str(), "--verify", "-q", (m_branch + "^{commit}").c_str()));
+	}
+	if (!chain.empty() && ret == 0 && head == chain.back()) {
+		PDEBUG << "Cached log for branch '" << m_branch << "' is up to date" << endl;
+		for (size_t i = 0; i < chain.size(); i++) {
+			emit(chain[i], dates[i]);
+		}
+		ret = 0;
+	} else {
+		ret = readLog(chain.empty() ? std::string() : chain.back(), &chain, &dates);
+		if (ret < 0) {
+			PDEBUG << "Cached log for branch '" << m_branch << "' is invalid, listing all revisions" << endl;
+			chain.clear();
+			dates.clear();
+			cached = 0;
+			ret = readLog(std::string(), &chain, &dates);
+		}
+	}
+
+	m_mutex.lock();
+	m_ids.insert(m_ids.end(), m_temp.begin(), m_temp.end());
+	m_temp.clear();
+	m_ret = ret;
+	m_finished = true;
+	PDEBUG << "Finished reading " << m_ids.size() << " revisions, ret = " << ret << endl;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+
+	if (useCache && ret == 0 && chain.size() != cached) {
+		writeChainToCache(cachefile, chain, dates);
+	}
+}
+
+// Lists the first-parent commits after the given one and appends them to
+// the chain. Returns -1 if the commit is not part of the branch's
+// first-parent chain.
+int GitBackend::GitLogIterator::readLog(const std::string &from, std::vector<std::string> *chain, std::vector<uint64_t> *dates)
+{
+	// The cached head may have been dropped, e.g. after a forced push
+	if (!from.empty()) {
+		int ret;
+		sys::io::exec(&ret, (m_gitpath+"/git-rev-parse").c_str(), "--verify", "-q", (from + "^{commit}").c_str());
+		if (ret != 0) {
+			return -1;
+		}
+	}
+
+	std::string range = (from.empty() ? m_branch : from + ".." + m_branch);
+	const char *args[] = {"--first-parent", "--reverse", "--timestamp", "--parents", range.c_str(), "--", NULL};
+	sys::io::PopenStreambuf buf((m_gitpath+"/git-rev-list").c_str(), args);
+	std::istream in(&buf);
+
+	// Output lines are of the form "$TIMESTAMP $ID $PARENTS"
+	size_t n = 0;
+	std::string line;
+	str::View parts[3];
+	while (std::getline(in, line)) {
+		size_t nparts = str::split(line, " ", parts, 3);
+		if (nparts < 2) {
+			continue;
+		}
+
+		if (n++ == 0 && !from.empty()) {
+			if (nparts < 3 || parts[2] != from) {
+				buf.close();
+				return -1;
+			}
+
+			// The cached part of the chain is valid
+			for (size_t i = 0; i < chain->size(); i++) {
+				emit((*chain)[i], (*dates)[i]);
+			}
+		}
+
+		uint64_t date = 0;
+		str::stoi(parts[0], &date);
+		chain->push_back(parts[1].str());
+		dates->push_back(date);
+		emit(chain->back(), date);
+	}
+
+	int ret = buf.close();
+	if (ret == 0 && n == 0 && !from.empty()) {
+		// The branch has been moved to an ancestor
+		return -1;
+	}
+	return ret;
+}
+
+// Adds a revision to the list if it matches the date range, prepending the
+// previous one so diffstat fetching will give correct results
+void GitBackend::GitLogIterator::emit(const std::string &id, uint64_t date)
+{
+	if ((m_start >= 0 && date < (uint64_t)m_start) || (m_end >= 0 && date > (uint64_t)m_end)) {
+		return;
+	}
+
+	std::string parent = m_parent;
+	m_parent = id;
+	if (m_filtered && m_matches.find(id) == m_matches.end()) {
+		return;
+	}
+
+	m_temp.push_back(parent.empty() ? id : parent + ":" + id);
+	if (m_temp.size() >= 64) {
+		flushIds();
+	}
+}
+
+// Lists the commits of the first-parent chain that match the filter. The
+// previous commit of the chain is the first parent, so
+// "git rev-list --first-parent" compares changed paths against it, too.
+bool GitBackend::GitLogIterator::readMatches()
+{
+	std::vector<std::string> args;
+	args.push_back("--first-parent");
+	args.push_back("--extended-regexp");
+	for (size_t i = 0; i < m_filter.authors().size(); i++) {
+		// Authors are matched against "name <email>", so this may yield
+		// additional commits that are dropped by the RevisionIterator
+		std::string pattern;
+		const std::string &author = m_filter.authors()[i];
+		for (size_t j = 0; j < author.length(); j++) {
+			if (strchr(".[]{}()\\*+?^$|", author[j])) {
+				pattern += '\\';
+			}
+			pattern += author[j];
+		}
+		args.push_back("--author=" + pattern);
+	}
+	if (!m_filter.grep().empty()) {
+		args.push_back("--grep=" + m_filter.grep());
+	}
+	args.push_back(m_branch);
+	args.push_back("--");
+	for (size_t i = 0; i < m_filter.paths().size(); i++) {
+		args.push_back(m_filter.paths()[i].empty() ? "." : m_filter.paths()[i]);
+	}
+
+	std::vector<const char *> argv;
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+	}
+	argv.push_back(NULL);
+
+	sys::io::PopenStreambuf buf((m_gitpath+"/git-rev-list").c_str(), &argv[0]);
+	std::istream in(&buf);
+	std::string line;
+	while (std::getline(in, line)) {
+		m_matches.insert(str::trim(line));
+	}
+	int ret = buf.close();
+	if (ret != 0) {
+		PDEBUG << "Unable to list matching commits (" << ret << "), filtering disabled" << endl;
+		m_matches.clear();
+		return false;
+	}
+	PDEBUG << m_matches.size() << " commits match the filter" << endl;
+	return true;
+}
+
+// Makes the collected revisions available to nextIds()
+void GitBackend::GitLogIterator::flushIds()
+{
+	m_mutex.lock();
+	m_ids.insert(m_ids.end(), m_temp.begin(), m_temp.end());
+	m_cond.wakeAll();
+	m_mutex.unlock();
+	m_temp.clear();
+}
+
+// Reads a previous first-parent chain from the cache
+void GitBackend::GitLogIterator::readChainFromCache(const std::string &file, std::vector<std::string> *chain, std::vector<uint64_t> *dates)
+{
+	std::string cachefile = Cache::cacheFile(m_backend, file);
+	if (!sys::fs::fileExists(cachefile)) {
+		return;
+	}
+
+	GZIStream in(cachefile);
+	uint32_t version;
+	in >> version;
+	if (version != 1) {
+		Logger::warn() << "Unknown version number in cache file " << cachefile  << ": " << version << endl;
+		return;
+	}
+
+	in >> *chain >> *dates;
+	if (!in.ok() || chain->size() != dates->size()) {
+		PDEBUG << "Ignoring corrupted cache file " << cachefile << endl;
+		chain->clear();
+		dates->clear();
+		return;
+	}
+	PDEBUG << "Read " << chain->size() << " revisions from cache file " << cachefile << endl;
+}
+
+// Writes the first-parent chain to the cache
+void GitBackend::GitLogIterator::writeChainToCache(const std::string &file, const std::vector<std::string> &chain, const std::vector<uint64_t> &dates)
+{
+	std::string cachefile = Cache::cacheFile(m_backend, file);
+	PDEBUG << "Writing " << chain.size() << " revisions to cache file " << cachefile << endl;
+
+	// Defer any signals while writing to the cache
+	SIGBLOCK_DEFER();
+
+	GZOStream out(cachefile);
+	out << (uint32_t)1; // Version number
+	out << chain << dates;
+	if (!out.ok()) {
+		Logger::warn() << "Error writing cache file " << cachefile << endl;
+	}
+}
+
+
 // Constructor
 GitBackend::GitBackend(const Options &options)
-	: Backend(options), m_prefetcher(NULL)
+	: Backend(options), m_prefetcher(NULL), m_objects(NULL)
 {
 
 }
@@ -403,6 +1616,8 @@ void GitBackend::init()
 	PDEBUG << "git exec-path is " << m_gitpath << endl;
 
 	PDEBUG << "GIT_DIR has been set to " << getenv("GIT_DIR") << endl;
+
+	refs();
 }
 
 // Called after Report::run()
@@ -410,6 +1625,13 @@ void GitBackend::close()
 {
 	// Clean up any prefetching threads
 	finalize();
+
+	delete m_objects;
+	m_objects = NULL;
+
+	// Refs may have changed until the next run
+	sys::parallel::MutexLocker locker(&m_refsMutex);
+	m_refs = Refs();
 }
 
 // Returns true if this backend is able to access the given repository
@@ -427,6 +1649,13 @@ bool GitBackend::handles(const std::string &url)
 	return false;
 }
 
+// Prints a help screen
+void GitBackend::printHelp() const
+{
+	Options::print("--split-files=ARG", "Diff revisions with more than ARG files in parallel (0 disables)");
+	Options::print("--log-stream", "Read consecutive revisions from \"git log\" in one pass (for filling the cache)");
+}
+
 // Returns a unique identifier for this repository
 std::string GitBackend::uuid()
 {
@@ -520,6 +1749,21 @@ std::string GitBackend::uuid()
 // Returns the HEAD revision for the given branch
 std::string GitBackend::head(const std::string &branch)
 {
+	const Refs &r = refs();
+	if ((branch.empty() || branch == "HEAD") && !r.headId.empty()) {
+		return r.headId;
+	}
+
+	// Resolve the name like git does, but only for the refs in the snapshot
+	std::string candidates[] = {branch, "refs/" + branch, "refs/tags/" + branch, "refs/heads/" + branch, "refs/remotes/" + branch};
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && !branch.empty(); i++) {
+		std::map<std::string, std::string>::const_iterator it = r.commits.find(candidates[i]);
+		if (it != r.commits.end()) {
+			return it->second;
+		}
+	}
+
+	// Arbitrary revisions are left to git
 	int ret;
 	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "-1", (branch.empty() ? "HEAD" : branch).c_str(), "--");
 	if (ret != 0) {
@@ -531,25 +1775,14 @@ std::string GitBackend::head(const std::string &branch)
 // Returns the currently checked out branch
 std::string GitBackend::mainBranch()
 {
-	int ret;
-	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-branch").c_str());
-	if (ret != 0) {
-		throw PEX(str::printf("Unable to retrieve the list of branches (%d)", ret));
-	}
-	std::vector<std::string> branches = str::split(out, "\n");
-	for (unsigned int i = 0; i < branches.size(); i++) {
-		if (branches[i].empty()) {
-			continue;
-		}
-		if (branches[i][0] == '*') {
-			return branches[i].substr(2);
-		}
-		branches[i] = branches[i].substr(2);
+	const Refs &r = refs();
+	if (!r.headRef.compare(0, 11, "refs/heads/")) {
+		return r.headRef.substr(11);
 	}
 
-	if (std::search_n(branches.begin(), branches.end(), 1, "master") != branches.end()) {
+	if (std::find(r.branches.begin(), r.branches.end(), "master") != r.branches.end()) {
 		return "master";
-	} else if (std::search_n(branches.begin(), branches.end(), 1, "remotes/origin/master") != branches.end()) {
+	} else if (r.commits.find("refs/remotes/origin/master") != r.commits.end()) {
 		return "remotes/origin/master";
 	}
 
@@ -560,62 +1793,103 @@ std::string GitBackend::mainBranch()
 // Returns a list of available local branches
 std::vector<std::string> GitBackend::branches()
 {
-	int ret;
-	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-branch").c_str());
-	if (ret != 0) {
-		throw PEX(str::printf("Unable to retrieve the list of branches (%d)", ret));
-	}
-	std::vector<std::string> branches = str::split(out, "\n");
-	for (unsigned int i = 0; i < branches.size(); i++) {
-		if (branches[i].empty()) {
-			branches.erase(branches.begin()+i);
-			--i;
-			continue;
-		}
-		branches[i] = branches[i].substr(2);
-	}
-	return branches;
+	return refs().branches;
 }
 
 // Returns a list of available tags
 std::vector<Tag> GitBackend::tags()
 {
+	return refs().tags;
+}
+
+// Returns the snapshot of the repository's refs, reading it if necessary
+const GitBackend::Refs &GitBackend::refs()
+{
+	sys::parallel::MutexLocker locker(&m_refsMutex);
+	if (!m_refs.loaded) {
+		Refs refs;
+		readRefs(&refs);
+		m_refs = refs;
+	}
+	return m_refs;
+}
+
+// Reads all branches and tags at once, and the target of HEAD
+void GitBackend::readRefs(Refs *refs)
+{
+	PTRACE_SCOPE("git.refs");
+	sys::datetime::Watch watch;
 	int ret;
 
-	// Fetch list of tag names
-	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-tag").c_str());
+	// Fetch reference names and the objects they point to at once. Annotated
+	// tags are dereferenced by "*" fields, which are empty for other refs.
+	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-for-each-ref").c_str(), "--format=%(objecttype) %(objectname) %(*objecttype) %(*objectname) %(refname)", "refs/heads", "refs/remotes", "refs/tags");
 	if (ret != 0) {
-		throw PEX(str::printf("Unable to retrieve the list of tags (%d)", ret));
+		throw PEX(str::printf("Unable to retrieve the list of refs (%d)", ret));
 	}
-	std::vector<std::string> names = str::split(out, "\n");
-	std::vector<Tag> tags;
+	std::vector<std::string> lines = str::split(out, "\n");
+	for (unsigned int i = 0; i < lines.size(); i++) {
+		std::vector<std::string> parts = str::split(lines[i], " ");
+		if (parts.size() < 5) {
+			continue;
+		}
 
-	// Determine corresponding commits
-	for (unsigned int i = 0; i < names.size(); i++) {
-		if (names[i].empty()) {
+		const std::string &ref = parts[4];
+		bool tag = !ref.compare(0, 10, "refs/tags/");
+		std::string id;
+		if (parts[0] == "commit") {
+			id = parts[1];
+		} else if (parts[0] == "tag" && parts[2] == "commit") {
+			id = parts[3];
+		} else if (parts[0] == "tag" && parts[2] == "tag") {
+			// Tag of a tag, so let git resolve the whole chain
+			std::string out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "-1", ref.c_str());
+			if (ret != 0) {
+				throw PEX(str::printf("Unable to retrieve the list of tags (%d)", ret));
+			}
+			id = str::trim(out);
+		} else {
+			PDEBUG << "Skipping ref " << ref << ": not a commit" << endl;
 			continue;
 		}
 
-		std::string out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "-1", names[i].c_str());
-		if (ret != 0) {
-			throw PEX(str::printf("Unable to retrieve the list of tags (%d)", ret));
+		refs->commits[ref] = id;
+		if (tag) {
+			refs->tags.push_back(Tag(id, ref.substr(10)));
+		} else if (!ref.compare(0, 11, "refs/heads/")) {
+			refs->branches.push_back(ref.substr(11));
 		}
+	}
 
-		std::string id = str::trim(out);
-		if (!id.empty()) {
-			tags.push_back(Tag(id, names[i]));
+	// HEAD is either a symbolic ref or contains the ID of a detached commit
+	std::string head;
+	{
+		std::ifstream in((std::string(getenv("GIT_DIR")) + "/HEAD").c_str());
+		std::getline(in, head);
+		head = str::trim(head);
+	}
+	if (!head.compare(0, 5, "ref: ")) {
+		refs->headRef = str::trim(head.substr(5));
+		std::map<std::string, std::string>::const_iterator it = refs->commits.find(refs->headRef);
+		if (it != refs->commits.end()) {
+			refs->headId = it->second;
 		}
+	} else if (head.length() == 40) {
+		refs->headId = head;
 	}
-	return tags;
+
+	refs->loaded = true;
+	PDEBUG << "Read " << refs->commits.size() << " refs in " << watch.elapsedMSecs() << " ms" << endl;
 }
 
 // Returns a diffstat for the specified revision
 DiffstatPtr GitBackend::diffstat(const std::string &id)
 {
 	// Maybe it's prefetched
-	if (m_prefetcher && m_prefetcher->willFetchDiffstat(id)) {
+	RevisionId rid(id);
+	if (m_prefetcher && m_prefetcher->willFetchDiffstat(rid)) {
 		DiffstatPtr stat;
-		if (!m_prefetcher->getDiffstat(id, &stat)) {
+		if (!m_prefetcher->getDiffstat(rid, &stat)) {
 			throw PEX(str::printf("Failed to retrieve diffstat for revision %s", id.c_str()));
 		}
 		return stat;
@@ -623,11 +1897,10 @@ DiffstatPtr GitBackend::diffstat(const std::string &id)
 
 	PDEBUG << "Fetching revision " << id << " manually" << endl;
 
-	std::vector<std::string> revs = str::split(id, ":");
-	if (revs.size() > 1) {
-		return GitDiffstatPipe::diffstat(m_gitpath, revs[1], revs[0]);
+	if (rid.hasParent()) {
+		return GitDiffstatPipe::diffstat(m_gitpath, rid.childStr(), rid.parentStr(), m_opts.linesOnly(), m_excludes);
 	}
-	return GitDiffstatPipe::diffstat(m_gitpath, revs[0]);
+	return GitDiffstatPipe::diffstat(m_gitpath, rid.childStr(), std::string(), m_opts.linesOnly(), m_excludes);
 }
 
 // Returns a file listing for the given revision (defaults to HEAD)
@@ -647,6 +1920,58 @@ std::vector<std::string> GitBackend::tree(const std::string &id)
 
 // Returns the file contents of the given path at the given revision (defaults to HEAD)
 std::string GitBackend::cat(const std::string &path, const std::string &id)
+{
+	return catMany(std::vector<std::string>(1, path), id).front();
+}
+
+// Returns the contents of the given files at the given revision, reading
+// them through the object pipe. Other objects than files, e.g.
+// directories, are rendered by "git show".
+std::vector<std::string> GitBackend::catMany(const std::vector<std::string> &paths, const std::string &id)
+{
+	std::string rev = (id.empty() ? std::string("HEAD") : id);
+	std::vector<std::string> names, contents(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		names.push_back(rev + ":" + paths[i]);
+	}
+	std::vector<GitBackend::Object> objects = readObjects(names, [&](size_t i, const char *data, size_t len) {
+		contents[i].append(data, len);
+	});
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (objects[i].type != "blob") {
+			contents[i] = show(paths[i], id);
+		}
+	}
+	return contents;
+}
+
+// Returns the ID of the tree of the given revision
+std::string GitBackend::treeKey(const std::string &id)
+{
+	std::vector<GitBackend::Object> objects = readObjects(std::vector<std::string>(1, (id.empty() ? std::string("HEAD") : id) + "^{tree}"), [](size_t, const char *, size_t) { });
+	return (objects.front().type == "tree" ? "git:" + objects.front().sha1 : std::string());
+}
+
+// Reads objects through the object pipe, starting a new process if the
+// previous one failed
+std::vector<GitBackend::Object> GitBackend::readObjects(const std::vector<std::string> &names, const std::function<void (size_t, const char *, size_t)> &sink)
+{
+	sys::parallel::MutexLocker locker(&m_objectsMutex);
+	if (m_objects == NULL) {
+		m_objects = new GitObjectReader(m_gitpath);
+	}
+	try {
+		return m_objects->read(names, sink);
+	} catch (...) {
+		delete m_objects;
+		m_objects = NULL;
+		throw;
+	}
+}
+
+// Returns the output of "git show" for the given path at the given revision
+std::string GitBackend::show(const std::string &path, const std::string &id)
 {
 	int ret;
 	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-show").c_str(), ((id.empty() ? std::string("HEAD") : id)+":"+path).c_str());
@@ -656,55 +1981,132 @@ std::string GitBackend::cat(const std::string &path, const std::string &id)
 	return out;
 }
 
-// Returns a revision iterator for the given branch
-Backend::LogIterator *GitBackend::iterator(const std::string &branch, int64_t start, int64_t end)
+// Lists the files in the tree of the given revision, using the blob IDs
+// as content-based keys. Submodules are skipped.
+std::vector<std::string> GitBackend::treeKeys(const std::string &id, std::vector<std::string> *paths)
 {
 	int ret;
-	std::string out;
-	if (start >= 0) {
-		std::string maxage = str::printf("--max-age=%lld", start);
-		if (end >= 0) {
-			std::string minage = str::printf("--min-age=%lld", end);
-			out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "--first-parent", "--reverse", maxage.c_str(), minage.c_str(), branch.c_str(), "--");
-		} else {
-			out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "--first-parent", "--reverse", maxage.c_str(), branch.c_str(), "--");
-		}
-	} else {
-		if (end >= 0) {
-			std::string minage = str::printf("--min-age=%lld", end);
-			out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "--first-parent", "--reverse", minage.c_str(), branch.c_str(), "--");
-		} else {
-			out = sys::io::exec(&ret, (m_gitpath+"/git-rev-list").c_str(), "--first-parent", "--reverse", branch.c_str(), "--");
-		}
-	}
+	std::string out = sys::io::exec(&ret, (m_gitpath+"/git-ls-tree").c_str(), "-r", "-z", "--full-name", (id.empty() ? "HEAD" : id.c_str()));
 	if (ret != 0) {
-		throw PEX(str::printf("Unable to retrieve log for branch '%s' (%d)", branch.c_str(), ret));
+		throw PEX(str::printf("Unable to retrieve tree listing for ID '%s' (%d)", id.c_str(), ret));
 	}
-	std::vector<std::string> revisions = str::split(out, "\n");
-	while (!revisions.empty() && revisions[revisions.size()-1].empty()) {
-		revisions.pop_back();
+
+	// Entries are of the form "$MODE $TYPE $SHA1\t$PATH", terminated by NUL
+	std::vector<std::string> keys;
+	paths->clear();
+	size_t pos = 0;
+	while (pos < out.length()) {
+		size_t end = out.find('\0', pos);
+		if (end == std::string::npos) {
+			end = out.length();
+		}
+		size_t tab = out.find('\t', pos);
+		if (tab < end) {
+			std::vector<std::string> parts = str::split(out.substr(pos, tab - pos), " ");
+			if (parts.size() == 3 && parts[1] == "blob") {
+				paths->push_back(out.substr(tab + 1, end - tab - 1));
+				keys.push_back("git:" + parts[2]);
+			}
+		}
+		pos = end + 1;
 	}
+	return keys;
+}
 
-	// Add parent revisions, so diffstat fetching will give correct results
-	for (ssize_t i = revisions.size()-1; i > 0; i--) {
-		revisions[i] = revisions[i-1] + ":" + revisions[i];
+// Counts the lines of the given files, reading them through the object
+// pipe without keeping them in memory
+std::vector<uint64_t> GitBackend::countLines(const std::vector<std::string> &paths, const std::string &id)
+{
+	std::string rev = (id.empty() ? std::string("HEAD") : id);
+	std::vector<std::string> names;
+	for (size_t i = 0; i < paths.size(); i++) {
+		names.push_back(rev + ":" + paths[i]);
+	}
+	std::vector<utils::LineCounter> counters(paths.size());
+	std::vector<GitBackend::Object> objects = readObjects(names, [&](size_t i, const char *data, size_t len) {
+		counters[i].feed(data, len);
+	});
+
+	std::vector<uint64_t> counts(paths.size());
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (objects[i].type.empty()) {
+			throw PEX(str::printf("Unable to get file contents of %s@%s", paths[i].c_str(), rev.c_str()));
+		}
+		counts[i] = counters[i].lines();
 	}
+	return counts;
+}
 
-	return new LogIterator(revisions);
+// Returns a revision iterator for the given branch
+Backend::LogIterator *GitBackend::iterator(const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter)
+{
+	return new GitLogIterator(this, branch, start, end, filter);
 }
 
 // Starts prefetching the given revision IDs
 void GitBackend::prefetch(const std::vector<std::string> &ids)
+{
+	prefetcher()->prefetch(ids);
+	PDEBUG << "Started prefetching " << ids.size() << " revisions" << endl;
+}
+
+// Starts prefetching the meta-data of the given revision IDs
+void GitBackend::prefetchMeta(const std::vector<std::string> &ids)
+{
+	prefetcher()->prefetch(ids, false);
+	PDEBUG << "Started prefetching meta-data of " << ids.size() << " revisions" << endl;
+}
+
+// Returns the prefetcher, starting it if necessary
+GitRevisionPrefetcher *GitBackend::prefetcher()
 {
 	if (m_prefetcher == NULL) {
-		m_prefetcher = new GitRevisionPrefetcher(m_gitpath);
+		int64_t split;
+		if (!str::stoi(m_opts.value("split-files", "1000"), &split) || split < 0) {
+			Logger::warn() << "Warning: Expected non-negative number for --split-files parameter, not splitting diffs" << endl;
+			split = 0;
+		}
+		bool stream = (m_opts.options().find("log-stream") != m_opts.options().end());
+		m_prefetcher = new GitRevisionPrefetcher(m_gitpath, m_opts.linesOnly(), m_excludes, promisorRemote(), size_t(split), stream);
 	}
-	m_prefetcher->prefetch(ids);
-	PDEBUG << "Started prefetching " << ids.size() << " revisions" << endl;
+	return m_prefetcher;
+}
+
+// Returns the name of the promisor remote if the repository is a partial
+// clone, or an empty string
+std::string GitBackend::promisorRemote()
+{
+	int ret;
+	std::string remote = str::trim(sys::io::exec(&ret, (m_gitpath+"/git-config").c_str(), "--get", "extensions.partialclone"));
+	if (ret == 0 && !remote.empty()) {
+		return remote;
+	}
+
+	// Newer versions of git mark promisor remotes in their configuration
+	std::vector<std::string> lines = str::split(sys::io::exec(&ret, (m_gitpath+"/git-config").c_str(), "--get-regexp", "^remote\\..*\\.promisor$"), "\n");
+	for (size_t i = 0; i < lines.size() && ret == 0; i++) {
+		size_t pos = lines[i].rfind(".promisor ");
+		if (pos != std::string::npos && pos > 7 && str::trim(lines[i].substr(pos + 10)) == "true") {
+			return lines[i].substr(7, pos - 7);
+		}
+	}
+	return std::string();
 }
 
 // Returns the revision data for the given ID
 Revision *GitBackend::revision(const std::string &id)
+{
+	return fetchRevision(id, true);
+}
+
+// Returns the revision meta-data for the given ID
+Revision *GitBackend::metaRevision(const std::string &id)
+{
+	return fetchRevision(id, false);
+}
+
+// Returns the revision data for the given ID, optionally without diffstat
+Revision *GitBackend::fetchRevision(const std::string &id, bool diffstats)
 {
 	// Unfortunately, older git versions don't have the %B format specifier
 	// for unwrapped subject and body, so the raw commit headers will be parsed instead.
@@ -726,24 +2128,77 @@ Revision *GitBackend::revision(const std::string &id)
 		lines.erase(lines.begin());
 	}
 	std::string msg = str::join(lines, "\n");
-	return new Revision(id, date, author, msg, diffstat(id));
+	return new Revision(id, date, author, msg, (diffstats ? diffstat(id) : DiffstatPtr()));
 #else
 
 	// Check for pre-fetched meta data first
-	if (m_prefetcher && m_prefetcher->willFetchMeta(id)) {
+	RevisionId rid(id);
+	if (m_prefetcher && m_prefetcher->willFetchMeta(rid)) {
 		GitMetaDataThread::Data data;
-		if (!m_prefetcher->getMeta(id, &data)) {
+		if (!m_prefetcher->getMeta(rid, &data)) {
 			throw PEX(str::printf("Failed to retrieve meta-data for revision %s", id.c_str()));
 		}
-		return new Revision(id, data.date, data.author, data.message, diffstat(id));
+		return new Revision(id, data.date, data.author, data.message, (diffstats ? diffstat(id) : DiffstatPtr()));
 	}
 
 	GitMetaDataThread::Data data;
-	GitMetaDataThread::metaData(m_gitpath, utils::childId(id), &data);
-	return new Revision(id, data.date, data.author, data.message, diffstat(id));
+	GitMetaDataThread::metaData(m_gitpath, rid.childStr(), &data);
+	return new Revision(id, data.date, data.author, data.message, (diffstats ? diffstat(id) : DiffstatPtr()));
 #endif
 }
 
+// Returns the tree IDs of the parent and child commits as diffstat keys,
+// since "git diff-tree" doesn't depend on anything else
+std::vector<std::string> GitBackend::diffstatKeys(const std::vector<std::string> &ids)
+{
+	std::vector<std::string> keys(ids.size());
+	if (ids.empty()) {
+		return keys;
+	}
+
+	// Resolve the trees in small chunks using a single process, reading
+	// the result after each chunk so the pipe won't fill up
+	sys::io::PopenStreambuf buf((m_gitpath+"/git-cat-file").c_str(), "--batch-check", NULL, NULL, NULL, NULL, NULL, NULL, std::ios::in | std::ios::out);
+	std::istream in(&buf);
+	std::ostream out(&buf);
+
+	const size_t chunk = 64;
+	std::string line;
+	for (size_t i = 0; i < ids.size(); i += chunk) {
+		size_t n = std::min(chunk, ids.size() - i);
+		for (size_t j = i; j < i + n; j++) {
+			RevisionId rid(ids[j]);
+			if (rid.hasParent()) {
+				out << rid.parentStr() << "^{tree}\n";
+			}
+			out << rid.childStr() << "^{tree}\n";
+		}
+		out << std::flush;
+
+		// Each object is printed as "$SHA1 tree $SIZE", or as "$ID missing".
+		// Root commits are diffed against the empty tree.
+		for (size_t j = i; j < i + n; j++) {
+			size_t count = (RevisionId(ids[j]).hasParent() ? 2 : 1);
+			std::vector<std::string> trees;
+			for (size_t k = 0; k < count; k++) {
+				if (!in.good() || !std::getline(in, line)) {
+					throw PEX(str::printf("Unable to resolve trees for revision %s", ids[j].c_str()));
+				}
+				str::View parts[4];
+				if (str::split(line, " ", parts, 4) == 3 && parts[1] == "tree") {
+					trees.push_back(parts[0].str());
+				}
+			}
+			if (trees.size() == count) {
+				keys[j] = "git:" + (count > 1 ? trees.front() : std::string()) + ":" + trees.back();
+			}
+		}
+	}
+	buf.closeWrite();
+	buf.close();
+	return keys;
+}
+
 // Handle cleanup of diffstat scheduler
 void GitBackend::finalize()
 {
@@ -756,3 +2211,39 @@ void GitBackend::finalize()
 		PDEBUG << "done" << endl;
 	}
 }
+
+// Returns the git directory and the directories of loose refs. Updating a
+// ref renames a lock file in one of them, and packing refs rewrites the
+// packed-refs file in the git directory.
+std::vector<std::string> GitBackend::watchPaths()
+{
+	std::vector<std::string> dirs;
+	dirs.push_back(getenv("GIT_DIR"));
+
+	// Linked worktrees share the refs of the main repository
+	std::ifstream in((dirs[0] + "/commondir").c_str());
+	std::string common;
+	if (in.good() && std::getline(in, common) && !str::trim(common).empty()) {
+		common = str::trim(common);
+		dirs.push_back(common[0] == '/' ? common : dirs[0] + "/" + common);
+	}
+
+	std::vector<std::string> paths, pending;
+	for (size_t i = 0; i < dirs.size(); i++) {
+		paths.push_back(dirs[i]);
+		pending.push_back(dirs[i] + "/refs");
+	}
+	while (!pending.empty()) {
+		std::string path = pending.back();
+		pending.pop_back();
+		if (!sys::fs::dirExists(path)) {
+			continue;
+		}
+		paths.push_back(path);
+		std::vector<std::string> entries = sys::fs::ls(path);
+		for (size_t i = 0; i < entries.size(); i++) {
+			pending.push_back(path + "/" + entries[i]);
+		}
+	}
+	return paths;
+}
@@ -15,13 +15,61 @@
 #define GIT_BACKEND_H_
 
 
+#include <functional>
+#include <unordered_set>
+
 #include "backend.h"
 
+class GitObjectReader;
 class GitRevisionPrefetcher;
 
 
 class GitBackend : public Backend
 {
+	public:
+		// Streams the output of git rev-list, using a cached first-parent chain
+		class GitLogIterator : public LogIterator
+		{
+			public:
+				GitLogIterator(GitBackend *backend, const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter = RevisionFilter());
+
+				bool nextIds(std::queue<std::string> *queue);
+
+			protected:
+				void run();
+
+			private:
+				int readLog(const std::string &from, std::vector<std::string> *chain, std::vector<uint64_t> *dates);
+				bool readMatches();
+				void emit(const std::string &id, uint64_t date);
+				void flushIds();
+				void readChainFromCache(const std::string &file, std::vector<std::string> *chain, std::vector<uint64_t> *dates);
+				void writeChainToCache(const std::string &file, const std::vector<std::string> &chain, const std::vector<uint64_t> &dates);
+
+			private:
+				GitBackend *m_backend;
+				std::string m_gitpath;
+				std::string m_branch;
+				int64_t m_start, m_end;
+				sys::parallel::Mutex m_mutex;
+				sys::parallel::WaitCondition m_cond;
+				std::vector<std::string>::size_type m_index;
+				bool m_finished;
+				int m_ret;
+				std::vector<std::string> m_temp;
+				std::string m_parent;
+				RevisionFilter m_filter;
+				bool m_filtered;
+				std::unordered_set<std::string> m_matches;
+		};
+
+		// Header of an object read through the object pipe, with an empty
+		// type if the object can't be found
+		struct Object
+		{
+			std::string sha1, type;
+		};
+
 	public:
 		GitBackend(const Options &options);
 		~GitBackend();
@@ -31,6 +79,7 @@ class GitBackend : public Backend
 
 		std::string name() const { return "git"; }
 		static bool handles(const std::string &url);
+		void printHelp() const;
 
 		std::string uuid();
 		std::string head(const std::string &branch = std::string());
@@ -40,15 +89,49 @@ class GitBackend : public Backend
 		DiffstatPtr diffstat(const std::string &id);
 		std::vector<std::string> tree(const std::string &id = std::string());
 		std::string cat(const std::string &path, const std::string &id = std::string());
+		std::vector<std::string> catMany(const std::vector<std::string> &paths, const std::string &id = std::string());
+		std::string treeKey(const std::string &id = std::string());
+		std::vector<std::string> treeKeys(const std::string &id, std::vector<std::string> *paths);
+		std::vector<uint64_t> countLines(const std::vector<std::string> &paths, const std::string &id);
 
-		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1);
+		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter());
 		void prefetch(const std::vector<std::string> &ids);
 		Revision *revision(const std::string &id);
+		void prefetchMeta(const std::vector<std::string> &ids);
+		Revision *metaRevision(const std::string &id);
+		std::vector<std::string> diffstatKeys(const std::vector<std::string> &ids);
 		void finalize();
+		std::vector<std::string> watchPaths();
+
+	private:
+		// Refs of the repository, read once per run
+		struct Refs
+		{
+			bool loaded;
+			std::string headRef, headId; // Empty reference name if HEAD is detached
+			std::map<std::string, std::string> commits; // Commits of branches and tags, by full reference name
+			std::vector<std::string> branches;
+			std::vector<Tag> tags;
+
+			Refs() : loaded(false) { }
+		};
+
+	private:
+		const Refs &refs();
+		void readRefs(Refs *refs);
+		GitRevisionPrefetcher *prefetcher();
+		std::string promisorRemote();
+		Revision *fetchRevision(const std::string &id, bool diffstats);
+		std::vector<Object> readObjects(const std::vector<std::string> &names, const std::function<void (size_t, const char *, size_t)> &sink);
+		std::string show(const std::string &path, const std::string &id);
 
 	private:
 		std::string m_gitpath;
 		GitRevisionPrefetcher *m_prefetcher;
+		GitObjectReader *m_objects;
+		sys::parallel::Mutex m_objectsMutex;
+		Refs m_refs;
+		sys::parallel::Mutex m_refsMutex;
 };
 
 
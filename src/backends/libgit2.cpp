@@ -0,0 +1,643 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: libgit2.cpp
+ * Git repository backend using libgit2
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+
+#include <git2.h>
+
+#include "jobqueue.h"
+#include "logger.h"
+#include "options.h"
+#include "revision.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+#include "backends/libgit2.h"
+
+
+// Repository handle, used by a single thread only. libgit2 objects may not
+// be shared between threads, so every prefetching thread opens its own.
+class Libgit2Connection
+{
+public:
+	struct Data
+	{
+		int64_t date;
+		std::string author;
+		std::string message;
+		DiffstatPtr diffstat;
+
+		inline size_t footprint() const {
+			return sizeof(Data) + author.capacity() + message.capacity() + (diffstat ? diffstat->footprint() : 0);
+		}
+	};
+
+public:
+	Libgit2Connection(const std::string &gitdir, const std::vector<std::string> &excludes)
+		: m_repo(NULL), m_excludes(excludes)
+	{
+		check(git_repository_open(&m_repo, gitdir.c_str()), "Unable to open repository");
+	}
+
+	~Libgit2Connection()
+	{
+		git_repository_free(m_repo);
+	}
+
+	git_repository *repo() const
+	{
+		return m_repo;
+	}
+
+	// Throws an exception containing the last libgit2 error message
+	static void check(int error, const char *what)
+	{
+		if (error >= 0) {
+			return;
+		}
+		const git_error *e = git_error_last();
+		throw PEX(str::printf("%s: %s (%d)", what, (e && e->message ? e->message : "unknown error"), error));
+	}
+
+	// Resolves the given revision specification to a commit ID
+	git_oid resolve(const std::string &spec)
+	{
+		git_object *obj, *commit;
+		check(git_revparse_single(&obj, m_repo, spec.c_str()), str::printf("Unable to resolve '%s'", spec.c_str()).c_str());
+		int error = git_object_peel(&commit, obj, GIT_OBJECT_COMMIT);
+		git_object_free(obj);
+		check(error, str::printf("Not a commit: '%s'", spec.c_str()).c_str());
+
+		git_oid oid;
+		git_oid_cpy(&oid, git_object_id(commit));
+		git_object_free(commit);
+		return oid;
+	}
+
+	static std::string str(const git_oid *oid)
+	{
+		char buffer[GIT_OID_HEXSZ+1];
+		git_oid_tostr(buffer, sizeof(buffer), oid);
+		return std::string(buffer);
+	}
+
+	// Computes the diffstat between two commits. The parent ID may be empty
+	// for root commits.
+	DiffstatPtr diffstat(const std::string &id, const std::string &parent = std::string())
+	{
+		git_commit *commit = lookup(id);
+		git_commit *pcommit = NULL;
+		git_tree *tree = NULL, *ptree = NULL;
+		git_diff *diff = NULL;
+		DiffstatPtr stat = Diffstat::create();
+
+		int error = git_commit_tree(&tree, commit);
+		if (error >= 0 && !parent.empty()) {
+			try {
+				pcommit = lookup(parent);
+			} catch (...) {
+				git_tree_free(tree);
+				git_commit_free(commit);
+				throw;
+			}
+			error = git_commit_tree(&ptree, pcommit);
+		}
+		if (error >= 0) {
+			// Mimic "git diff-tree -U0 --no-renames": no context lines and
+			// no rename detection (which is off by default in libgit2)
+			git_diff_options opts = GIT_DIFF_OPTIONS_INIT;
+			opts.context_lines = 0;
+			opts.interhunk_lines = 0;
+			if (!m_excludes.empty()) {
+				opts.notify_cb = &Libgit2Connection::notifyCallback;
+				opts.payload = &m_excludes;
+			}
+			error = git_diff_tree_to_tree(&diff, m_repo, ptree, tree, &opts);
+		}
+		if (error >= 0) {
+			LineData data;
+			data.stat = stat.get();
+			data.delta = NULL;
+			error = git_diff_foreach(diff, NULL, NULL, NULL, &Libgit2Connection::lineCallback, &data);
+			stat->sort();
+		}
+
+		git_diff_free(diff);
+		git_tree_free(ptree);
+		git_tree_free(tree);
+		git_commit_free(pcommit);
+		git_commit_free(commit);
+		check(error, str::printf("Unable to compute diffstat for revision '%s'", id.c_str()).c_str());
+
+		return stat;
+	}
+
+	// Reads author, commit date and message directly from the commit object
+	void metaData(const std::string &id, Data *dest)
+	{
+		git_commit *commit = lookup(id);
+
+		// Same semantics as for the command-line backend: committer date,
+		// adjusted by the time zone offset
+		dest->date = (int64_t)git_commit_time(commit) + (int64_t)git_commit_time_offset(commit) * 60;
+
+		const git_signature *author = git_commit_author(commit);
+		dest->author = str::trim(author && author->name ? author->name : "");
+
+		const char *message = git_commit_message(commit);
+		dest->message = (message ? message : "");
+		git_commit_free(commit);
+	}
+
+	// Fetches diffstat and meta-data for a "parent:child" ID
+	void data(const std::string &id, Data *dest)
+	{
+		std::vector<std::string> revs = str::split(id, ":");
+		if (revs.size() > 1) {
+			dest->diffstat = diffstat(revs[1], revs[0]);
+		} else {
+			dest->diffstat = diffstat(revs[0]);
+		}
+		metaData(utils::childId(id), dest);
+	}
+
+private:
+	git_commit *lookup(const std::string &id)
+	{
+		git_oid oid;
+		if (git_oid_fromstr(&oid, id.c_str()) < 0) {
+			oid = resolve(id);
+		}
+		git_commit *commit;
+		check(git_commit_lookup(&commit, m_repo, &oid), str::printf("Unable to lookup commit '%s'", id.c_str()).c_str());
+		return commit;
+	}
+
+	// Payload for lineCallback(). Lines are reported file by file, so a new
+	// stat is only appended if the file delta changes.
+	struct LineData
+	{
+		Diffstat *stat;
+		const git_diff_delta *delta;
+	};
+
+	// Sums up the line and byte counts of added and removed lines. Byte
+	// counts include the leading diff marker but not the line terminator,
+	// in order to match the output of DiffParser.
+	static int lineCallback(const git_diff_delta *delta, const git_diff_hunk *, const git_diff_line *line, void *payload)
+	{
+		if (line->origin != GIT_DIFF_LINE_ADDITION && line->origin != GIT_DIFF_LINE_DELETION) {
+			return 0;
+		}
+
+		LineData *data = (LineData *)payload;
+		if (data->delta != delta) {
+			const char *path = (delta->status == GIT_DELTA_DELETED ? delta->old_file.path : delta->new_file.path);
+			data->stat->append(Diffstat::intern(path));
+			data->delta = delta;
+		}
+		Diffstat::Stat &stat = data->stat->m_stats.back().second;
+
+		size_t len = line->content_len;
+		if (len > 0 && line->content[len-1] == '\n') {
+			--len;
+		}
+		if (line->origin == GIT_DIFF_LINE_ADDITION) {
+			stat.cadd += len + 1;
+			++stat.ladd;
+		} else {
+			stat.cdel += len + 1;
+			++stat.ldel;
+		}
+		return 0;
+	}
+
+	// Skips deltas of excluded paths before their contents are loaded
+	static int notifyCallback(const git_diff *, const git_diff_delta *delta, const char *, void *payload)
+	{
+		const char *path = (delta->status == GIT_DELTA_DELETED ? delta->old_file.path : delta->new_file.path);
+		return (Diffstat::excluded(path, *(const std::vector<std::string> *)payload) ? 1 : 0);
+	}
+
+private:
+	git_repository *m_repo;
+	std::vector<std::string> m_excludes;
+};
+
+
+// Prefetching worker thread. Since there is no process spawning involved,
+// diffstats and meta-data are fetched at once.
+class Libgit2Worker : public sys::parallel::Thread
+{
+public:
+	Libgit2Worker(const std::string &gitdir, const std::vector<std::string> &excludes, JobQueue<std::string, Libgit2Connection::Data> *queue)
+		: m_gitdir(gitdir), m_excludes(excludes), m_queue(queue)
+	{
+	}
+
+protected:
+	void run()
+	{
+		Libgit2Connection *conn;
+		try {
+			conn = new Libgit2Connection(m_gitdir, m_excludes);
+		} catch (const std::exception &ex) {
+			Logger::err() << "Error: " << ex.what() << endl;
+			std::string id;
+			while (m_queue->getArg(&id)) {
+				m_queue->failed(id);
+			}
+			return;
+		}
+
+		std::string id;
+		Libgit2Connection::Data data;
+		while (m_queue->getArg(&id)) {
+			try {
+				conn->data(id, &data);
+				m_queue->done(id, data, data.footprint());
+			} catch (const std::exception &ex) {
+				PDEBUG << "Error fetching revision " << id << ": " << ex.what() << endl;
+				m_queue->failed(id);
+			}
+		}
+
+		delete conn;
+	}
+
+private:
+	std::string m_gitdir;
+	std::vector<std::string> m_excludes;
+	JobQueue<std::string, Libgit2Connection::Data> *m_queue;
+};
+
+
+// Handles the prefetching of revisions
+class Libgit2Prefetcher
+{
+public:
+	Libgit2Prefetcher(const std::string &gitdir, const std::vector<std::string> &excludes, int n = -1)
+	{
+		if (n < 0) {
+			n = std::max(1, sys::parallel::ThreadPool::globalSize());
+		}
+		for (int i = 0; i < n; i++) {
+			sys::parallel::Thread *thread = new Libgit2Worker(gitdir, excludes, &m_queue);
+			thread->start();
+			m_threads.push_back(thread);
+		}
+		m_queue.setLimits(1, n, 64, 4096);
+
+		Logger::info() << "Libgit2Backend: Using " << n << " threads for prefetching revisions" << endl;
+	}
+
+	~Libgit2Prefetcher()
+	{
+		for (unsigned int i = 0; i < m_threads.size(); i++) {
+			delete m_threads[i];
+		}
+	}
+
+	void stop()
+	{
+		m_queue.stop();
+	}
+
+	void wait()
+	{
+		for (unsigned int i = 0; i < m_threads.size(); i++) {
+			m_threads[i]->wait();
+		}
+	}
+
+	void prefetch(const std::vector<std::string> &revisions)
+	{
+		m_queue.put(revisions);
+	}
+
+	bool get(const std::string &revision, Libgit2Connection::Data *dest)
+	{
+		return m_queue.getResult(revision, dest);
+	}
+
+	bool willFetch(const std::string &revision)
+	{
+		return m_queue.hasArg(revision);
+	}
+
+private:
+	JobQueue<std::string, Libgit2Connection::Data> m_queue;
+	std::vector<sys::parallel::Thread *> m_threads;
+};
+
+
+// Internal helper functions
+namespace {
+
+// Collects all blobs and submodule links while walking a tree
+int treeWalkCallback(const char *root, const git_tree_entry *entry, void *payload)
+{
+	if (git_tree_entry_type(entry) != GIT_OBJECT_TREE) {
+		((std::vector<std::string> *)payload)->push_back(std::string(root) + git_tree_entry_name(entry));
+	}
+	return 0;
+}
+
+// Collects tag names
+int tagCallback(const char *name, git_oid *, void *payload)
+{
+	std::string ref(name);
+	if (!ref.compare(0, 10, "refs/tags/")) {
+		ref = ref.substr(10);
+	}
+	((std::vector<std::string> *)payload)->push_back(ref);
+	return 0;
+}
+
+} // anonymous namespace
+
+
+// Constructor
+Libgit2Backend::Libgit2Backend(const Options &options)
+	: Backend(options), m_conn(NULL), m_prefetcher(NULL)
+{
+	git_libgit2_init();
+}
+
+// Destructor
+Libgit2Backend::~Libgit2Backend()
+{
+	close();
+	delete m_conn;
+	git_libgit2_shutdown();
+}
+
+// Initializes the backend
+void Libgit2Backend::init()
+{
+	std::string repo = m_opts.repository();
+	git_buf buf = GIT_BUF_INIT;
+	if (git_repository_discover(&buf, repo.c_str(), 0, NULL) < 0) {
+		throw PEX(str::printf("Not a git repository: %s", repo.c_str()));
+	}
+	m_gitdir = std::string(buf.ptr, buf.size);
+	git_buf_dispose(&buf);
+	PDEBUG << "Repository directory is " << m_gitdir << endl;
+
+	m_conn = new Libgit2Connection(m_gitdir, m_excludes);
+}
+
+// Called after Report::run()
+void Libgit2Backend::close()
+{
+	// Clean up any prefetching threads
+	finalize();
+}
+
+// Returns true if this backend is able to access the given repository
+bool Libgit2Backend::handles(const std::string &url)
+{
+	if (sys::fs::dirExists(url+"/.git") || sys::fs::fileExists(url+"/.git")) {
+		return true;
+	} else if (sys::fs::dirExists(url) && sys::fs::fileExists(url+"/HEAD") && sys::fs::dirExists(url+"/objects")) {
+		PDEBUG << "Bare repository detected" << endl;
+		return true;
+	}
+	return false;
+}
+
+// Returns a unique identifier for this repository
+std::string Libgit2Backend::uuid()
+{
+	// Use the root commit of the main branch, just like GitBackend
+	git_oid oid = m_conn->resolve(mainBranch());
+
+	git_revwalk *walk;
+	Libgit2Connection::check(git_revwalk_new(&walk, m_conn->repo()), "Unable to create revision walker");
+	git_revwalk_sorting(walk, GIT_SORT_TIME | GIT_SORT_REVERSE);
+	int error = git_revwalk_push(walk, &oid);
+	if (error >= 0) {
+		error = git_revwalk_next(&oid, walk);
+	}
+	git_revwalk_free(walk);
+	Libgit2Connection::check(error, "Unable to determine the root commit");
+	return Libgit2Connection::str(&oid);
+}
+
+// Returns the HEAD revision for the given branch
+std::string Libgit2Backend::head(const std::string &branch)
+{
+	git_oid oid = m_conn->resolve(branch.empty() ? "HEAD" : branch);
+	return Libgit2Connection::str(&oid);
+}
+
+// Returns the currently checked out branch
+std::string Libgit2Backend::mainBranch()
+{
+	git_reference *ref;
+	if (git_repository_head_detached(m_conn->repo()) != 1 && git_repository_head(&ref, m_conn->repo()) >= 0) {
+		std::string branch = git_reference_shorthand(ref);
+		git_reference_free(ref);
+		return branch;
+	}
+
+	std::vector<std::string> names = branches();
+	if (std::search_n(names.begin(), names.end(), 1, "master") != names.end()) {
+		return "master";
+	}
+
+	git_object *obj;
+	if (git_revparse_single(&obj, m_conn->repo(), "remotes/origin/master") >= 0) {
+		git_object_free(obj);
+		return "remotes/origin/master";
+	}
+
+	// Fallback
+	return "master";
+}
+
+// Returns a list of available local branches
+std::vector<std::string> Libgit2Backend::branches()
+{
+	git_branch_iterator *it;
+	Libgit2Connection::check(git_branch_iterator_new(&it, m_conn->repo(), GIT_BRANCH_LOCAL), "Unable to retrieve the list of branches");
+
+	std::vector<std::string> branches;
+	git_reference *ref;
+	git_branch_t type;
+	while (git_branch_next(&ref, &type, it) == 0) {
+		const char *name;
+		if (git_branch_name(&name, ref) >= 0) {
+			branches.push_back(name);
+		}
+		git_reference_free(ref);
+	}
+	git_branch_iterator_free(it);
+	return branches;
+}
+
+// Returns a list of available tags
+std::vector<Tag> Libgit2Backend::tags()
+{
+	std::vector<std::string> names;
+	Libgit2Connection::check(git_tag_foreach(m_conn->repo(), &tagCallback, &names), "Unable to retrieve the list of tags");
+
+	// Determine corresponding commits
+	std::vector<Tag> tags;
+	for (size_t i = 0; i < names.size(); i++) {
+		try {
+			git_oid oid = m_conn->resolve(names[i]);
+			tags.push_back(Tag(Libgit2Connection::str(&oid), names[i]));
+		} catch (const std::exception &ex) {
+			PDEBUG << "Skipping tag " << names[i] << ": " << ex.what() << endl;
+		}
+	}
+	return tags;
+}
+
+// Returns a diffstat for the specified revision
+DiffstatPtr Libgit2Backend::diffstat(const std::string &id)
+{
+	// Maybe it's prefetched
+	if (m_prefetcher && m_prefetcher->willFetch(id)) {
+		Libgit2Connection::Data data;
+		if (!m_prefetcher->get(id, &data)) {
+			throw PEX(str::printf("Failed to retrieve diffstat for revision %s", id.c_str()));
+		}
+		return data.diffstat;
+	}
+
+	PDEBUG << "Fetching revision " << id << " manually" << endl;
+
+	std::vector<std::string> revs = str::split(id, ":");
+	if (revs.size() > 1) {
+		return m_conn->diffstat(revs[1], revs[0]);
+	}
+	return m_conn->diffstat(revs[0]);
+}
+
+// Returns a file listing for the given revision (defaults to HEAD)
+std::vector<std::string> Libgit2Backend::tree(const std::string &id)
+{
+	git_oid oid = m_conn->resolve(id.empty() ? "HEAD" : id);
+	git_commit *commit;
+	git_tree *tree;
+	Libgit2Connection::check(git_commit_lookup(&commit, m_conn->repo(), &oid), str::printf("Unable to retrieve tree listing for ID '%s'", id.c_str()).c_str());
+	int error = git_commit_tree(&tree, commit);
+	git_commit_free(commit);
+	Libgit2Connection::check(error, str::printf("Unable to retrieve tree listing for ID '%s'", id.c_str()).c_str());
+
+	std::vector<std::string> contents;
+	error = git_tree_walk(tree, GIT_TREEWALK_PRE, &treeWalkCallback, &contents);
+	git_tree_free(tree);
+	Libgit2Connection::check(error, str::printf("Unable to retrieve tree listing for ID '%s'", id.c_str()).c_str());
+	return contents;
+}
+
+// Returns the file contents of the given path at the given revision (defaults to HEAD)
+std::string Libgit2Backend::cat(const std::string &path, const std::string &id)
+{
+	std::string spec = (id.empty() ? std::string("HEAD") : id) + ":" + path;
+	git_object *obj, *blob;
+	Libgit2Connection::check(git_revparse_single(&obj, m_conn->repo(), spec.c_str()), str::printf("Unable to get file contents of %s@%s", path.c_str(), id.c_str()).c_str());
+	int error = git_object_peel(&blob, obj, GIT_OBJECT_BLOB);
+	git_object_free(obj);
+	Libgit2Connection::check(error, str::printf("Unable to get file contents of %s@%s", path.c_str(), id.c_str()).c_str());
+
+	std::string out((const char *)git_blob_rawcontent((git_blob *)blob), (size_t)git_blob_rawsize((git_blob *)blob));
+	git_object_free(blob);
+	return out;
+}
+
+// Returns a revision iterator for the given branch
+Backend::LogIterator *Libgit2Backend::iterator(const std::string &branch, int64_t start, int64_t end, const RevisionFilter &)
+{
+	git_oid oid = m_conn->resolve(branch.empty() ? "HEAD" : branch);
+
+	// Equivalent to "git rev-list --first-parent --reverse"
+	git_revwalk *walk;
+	Libgit2Connection::check(git_revwalk_new(&walk, m_conn->repo()), "Unable to create revision walker");
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+	git_revwalk_simplify_first_parent(walk);
+	int error = git_revwalk_push(walk, &oid);
+
+	std::vector<std::string> revisions;
+	while (error >= 0 && (error = git_revwalk_next(&oid, walk)) == 0) {
+		if (start >= 0 || end >= 0) {
+			// Commit dates are compared like --max-age and --min-age do
+			git_commit *commit;
+			if ((error = git_commit_lookup(&commit, m_conn->repo(), &oid)) < 0) {
+				break;
+			}
+			int64_t time = git_commit_time(commit);
+			git_commit_free(commit);
+			if ((start >= 0 && time < start) || (end >= 0 && time > end)) {
+				continue;
+			}
+		}
+		revisions.push_back(Libgit2Connection::str(&oid));
+	}
+	git_revwalk_free(walk);
+	if (error != GIT_ITEROVER) {
+		Libgit2Connection::check(error, str::printf("Unable to retrieve log for branch '%s'", branch.c_str()).c_str());
+	}
+
+	// Add parent revisions, so diffstat fetching will give correct results
+	for (ssize_t i = revisions.size()-1; i > 0; i--) {
+		revisions[i] = revisions[i-1] + ":" + revisions[i];
+	}
+
+	return new LogIterator(revisions);
+}
+
+// Starts prefetching the given revision IDs
+void Libgit2Backend::prefetch(const std::vector<std::string> &ids)
+{
+	if (m_prefetcher == NULL) {
+		m_prefetcher = new Libgit2Prefetcher(m_gitdir, m_excludes);
+	}
+	m_prefetcher->prefetch(ids);
+	PDEBUG << "Started prefetching " << ids.size() << " revisions" << endl;
+}
+
+// Returns the revision data for the given ID
+Revision *Libgit2Backend::revision(const std::string &id)
+{
+	Libgit2Connection::Data data;
+	if (m_prefetcher && m_prefetcher->willFetch(id)) {
+		if (!m_prefetcher->get(id, &data)) {
+			throw PEX(str::printf("Failed to retrieve revision %s", id.c_str()));
+		}
+	} else {
+		m_conn->data(id, &data);
+	}
+	return new Revision(id, data.date, data.author, data.message, data.diffstat);
+}
+
+// Handle cleanup of the prefetcher
+void Libgit2Backend::finalize()
+{
+	if (m_prefetcher) {
+		PDEBUG << "Waiting for prefetcher... " << endl;
+		m_prefetcher->stop();
+		m_prefetcher->wait();
+		delete m_prefetcher;
+		m_prefetcher = NULL;
+		PDEBUG << "done" << endl;
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: libgit2.h
+ * Git repository backend using libgit2 (interface)
+ */
+
+
+#ifndef LIBGIT2_BACKEND_H_
+#define LIBGIT2_BACKEND_H_
+
+
+#include "backend.h"
+
+class Libgit2Connection;
+class Libgit2Prefetcher;
+
+
+class Libgit2Backend : public Backend
+{
+	public:
+		Libgit2Backend(const Options &options);
+		~Libgit2Backend();
+
+		void init();
+		void close();
+
+		// Reports the same name as the command-line git backend, so that
+		// existing caches can be used by both implementations
+		std::string name() const { return "git"; }
+		static bool handles(const std::string &url);
+
+		std::string uuid();
+		std::string head(const std::string &branch = std::string());
+		std::string mainBranch();
+		std::vector<std::string> branches();
+		std::vector<Tag> tags();
+		DiffstatPtr diffstat(const std::string &id);
+		std::vector<std::string> tree(const std::string &id = std::string());
+		std::string cat(const std::string &path, const std::string &id = std::string());
+
+		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter());
+		void prefetch(const std::vector<std::string> &ids);
+		Revision *revision(const std::string &id);
+		void finalize();
+
+	private:
+		std::string m_gitdir;
+		Libgit2Connection *m_conn;
+		Libgit2Prefetcher *m_prefetcher;
+};
+
+
+#endif // LIBGIT2_BACKEND_H_
@@ -17,19 +17,419 @@
 #include <algorithm>
 #include <sstream>
 
+#include "jobqueue.h"
 #include "logger.h"
 #include "options.h"
 #include "revision.h"
 #include "strlib.h"
+#include "utils.h"
 
 #include "syslib/fs.h"
+#include "syslib/io.h"
+#include "syslib/parallel.h"
 
 #include "backends/mercurial.h"
+#include "backends/mercurial_p.h"
+
+
+namespace
+{
+
+// Feeds command server output to a diff parser. Parser errors are stored
+// until the command has finished in order to keep the protocol in sync.
+class DiffParserSink : public HgCommandServer::Sink
+{
+public:
+	DiffParserSink(DiffParser *parser) : m_parser(parser), m_failed(false) { }
+
+	void write(const char *data, size_t len)
+	{
+		if (m_failed) {
+			return;
+		}
+		try {
+			m_parser->feed(data, len);
+		} catch (const PepperException &ex) {
+			m_failed = true;
+			m_error = ex.what();
+		}
+	}
+
+	void check() const
+	{
+		if (m_failed) {
+			throw PEX(m_error);
+		}
+	}
+
+private:
+	DiffParser *m_parser;
+	bool m_failed;
+	std::string m_error;
+};
+
+// Converts a glob pattern of an excluded path to a regular expression for
+// Mercurial. Unlike "glob:" patterns, these are relative to the repository
+// root, and wildcards match slashes like they do for the other backends.
+std::string excludePattern(const std::string &glob)
+{
+	std::string re = "re:";
+	for (size_t i = 0; i < glob.length(); i++) {
+		char c = glob[i];
+		if (c == '*') {
+			re += ".*";
+		} else if (c == '?') {
+			re += '.';
+		} else if (c == '[') {
+			re += c;
+			if (i + 1 < glob.length() && glob[i+1] == '!') {
+				re += '^';
+				++i;
+			}
+		} else if (c == ']') {
+			re += c;
+		} else if (isalnum((unsigned char)c) || c == '/' || c == '_') {
+			re += c;
+		} else {
+			re += '\\';
+			re += c;
+		}
+	}
+	return re + "(?:/|$)";
+}
+
+// Returns a Python string literal
+std::string pyString(const std::string &str)
+{
+	std::string lit = "\"";
+	for (size_t i = 0; i < str.length(); i++) {
+		if (str[i] == '\\' || str[i] == '"') {
+			lit += '\\';
+		}
+		lit += str[i];
+	}
+	return lit + "\"";
+}
+
+// Returns the "hg diff" arguments for the given revision
+std::vector<std::string> diffArgs(const std::string &id, const std::vector<std::string> &excludes)
+{
+	std::vector<std::string> ids = str::split(id, ":");
+	std::vector<std::string> args;
+	args.push_back("diff");
+	if (ids.size() > 1) {
+		args.push_back("-r");
+		args.push_back(ids[0]);
+		args.push_back("-r");
+		args.push_back(ids[1]);
+	} else {
+		args.push_back("--change");
+		args.push_back(ids[0]);
+	}
+	for (size_t i = 0; i < excludes.size(); i++) {
+		args.push_back("--exclude");
+		args.push_back(excludePattern(excludes[i]));
+	}
+	return args;
+}
+
+// Runs the hg executable with the given arguments and returns a stream buffer
+// for reading its output
+sys::io::PopenStreambuf *spawn(const std::string &hg, const std::string &repo, const std::vector<std::string> &args)
+{
+	std::vector<const char *> argv;
+	argv.push_back("--noninteractive");
+	argv.push_back("--repository");
+	argv.push_back(repo.c_str());
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+	}
+	argv.push_back(NULL);
+	return new sys::io::PopenStreambuf(hg.c_str(), &argv[0]);
+}
+
+// Starts a command server for a worker thread, or returns NULL if that
+// isn't possible
+HgCommandServer *startServer(const std::string &hg, const std::string &repo)
+{
+	try {
+		return new HgCommandServer(hg, repo);
+	} catch (const PepperException &ex) {
+		PDEBUG << "Unable to start command server, running hg for every job: " << ex.what() << endl;
+	}
+	return NULL;
+}
+
+} // anonymous namespace
+
+
+// Diffstat fetching worker thread, running "hg diff" for single revisions
+class MercurialDiffstatThread : public sys::parallel::Thread
+{
+public:
+	MercurialDiffstatThread(const std::string &hg, const std::string &repo, const std::vector<std::string> &excludes, JobQueue<std::string, DiffstatPtr> *queue)
+		: m_hg(hg), m_repo(repo), m_excludes(excludes), m_queue(queue)
+	{
+	}
+
+	static DiffstatPtr diffstat(const std::string &hg, const std::string &repo, const std::string &id, const std::vector<std::string> &excludes)
+	{
+		sys::io::PopenStreambuf *buf = spawn(hg, repo, diffArgs(id, excludes));
+		std::istream in(buf);
+		DiffstatPtr stat;
+		try {
+			stat = DiffParser::parse(in);
+		} catch (...) {
+			delete buf;
+			throw;
+		}
+		int ret = buf->close();
+		delete buf;
+		if (ret != 0) {
+			throw PEX(str::printf("hg diff command failed for revision %s", id.c_str()));
+		}
+		return stat;
+	}
+
+	static DiffstatPtr diffstat(HgCommandServer *server, const std::string &id, const std::vector<std::string> &excludes)
+	{
+		DiffParser parser;
+		DiffParserSink sink(&parser);
+		std::string err;
+		int ret = server->runcommand(diffArgs(id, excludes), &sink, &err);
+		if (ret != 0) {
+			throw PEX(str::printf("hg diff command failed for revision %s: %s", id.c_str(), str::trim(err).c_str()));
+		}
+		sink.check();
+		return parser.finish();
+	}
+
+protected:
+	void run()
+	{
+		HgCommandServer *server = startServer(m_hg, m_repo);
+		std::string revision;
+		while (m_queue->getArg(&revision)) {
+			try {
+				DiffstatPtr stat = (server ? diffstat(server, revision, m_excludes) : diffstat(m_hg, m_repo, revision, m_excludes));
+				m_queue->done(revision, stat, stat->footprint());
+			} catch (const PepperException &ex) {
+				PDEBUG << "Error: " << ex.where() << ": " << ex.what() << endl;
+				m_queue->failed(revision);
+			}
+		}
+		delete server;
+	}
+
+private:
+	std::string m_hg, m_repo;
+	std::vector<std::string> m_excludes;
+	JobQueue<std::string, DiffstatPtr> *m_queue;
+};
+
+
+// Meta-data fetching worker thread, running "hg log" for batches of revisions
+class MercurialMetaDataThread : public sys::parallel::Thread
+{
+public:
+	struct Data
+	{
+		int64_t date;
+		std::string author, message;
+
+		inline size_t footprint() const { return sizeof(Data) + author.capacity() + message.capacity(); }
+	};
+
+public:
+	MercurialMetaDataThread(const std::string &hg, const std::string &repo, JobQueue<std::string, Data> *queue)
+		: m_hg(hg), m_repo(repo), m_queue(queue)
+	{
+	}
+
+	// Parses a "{date|hgdate}" template output line
+	static int64_t parseDate(const std::string &str)
+	{
+		// Date is given as seconds and timezone offset from UTC
+		int64_t date = 0;
+		std::vector<std::string> parts = str::split(str, " ");
+		if (parts.size() > 1) {
+			int64_t offset = 0;
+			str::str2int(parts[0], &date);
+			str::str2int(parts[1], &offset);
+			date += offset;
+		}
+		return date;
+	}
+
+protected:
+	void run()
+	{
+		HgCommandServer *server = startServer(m_hg, m_repo);
+		std::vector<std::string> revisions;
+		while (m_queue->getArgs(&revisions, 64)) {
+			std::vector<std::string> args;
+			args.push_back("log");
+			args.push_back("--template");
+			args.push_back("{node}\\n{date|hgdate}\\n{author|person}\\n{desc}\\0");
+			for (size_t i = 0; i < revisions.size(); i++) {
+				args.push_back("-r");
+				args.push_back(revisions[i]);
+			}
+
+			std::string out;
+			try {
+				if (server) {
+					out = server->runcommand(args);
+				} else {
+					sys::io::PopenStreambuf *buf = spawn(m_hg, m_repo, args);
+					std::istream in(buf);
+					std::ostringstream ss;
+					ss << in.rdbuf();
+					out = ss.str();
+					if (buf->close() != 0) {
+						PDEBUG << "hg log command failed" << endl;
+					}
+					delete buf;
+				}
+			} catch (const PepperException &ex) {
+				PDEBUG << "Error: " << ex.where() << ": " << ex.what() << endl;
+			}
+
+			std::istringstream in(out);
+			std::string record;
+			std::vector<bool> found(revisions.size(), false);
+			while (std::getline(in, record, '\0')) {
+				std::vector<std::string> lines = str::split(record, "\n");
+				if (lines.size() < 3) {
+					continue;
+				}
+
+				Data data;
+				data.date = parseDate(lines[1]);
+				data.author = lines[2];
+				lines.erase(lines.begin(), lines.begin() + 3);
+				data.message = str::join(lines, "\n");
+
+				// The requested IDs may be abbreviated
+				for (size_t i = 0; i < revisions.size(); i++) {
+					if (!found[i] && str::startsWith(record, revisions[i])) {
+						m_queue->done(revisions[i], data, data.footprint());
+						found[i] = true;
+					}
+				}
+			}
+
+			for (size_t i = 0; i < revisions.size(); i++) {
+				if (!found[i]) {
+					m_queue->failed(revisions[i]);
+				}
+			}
+		}
+		delete server;
+	}
+
+private:
+	std::string m_hg, m_repo;
+	JobQueue<std::string, Data> *m_queue;
+};
+
+
+// Handles the prefetching of revision meta-data and diffstats
+class MercurialRevisionPrefetcher
+{
+public:
+	MercurialRevisionPrefetcher(const std::string &hg, const std::string &repo, const std::vector<std::string> &excludes, int n = -1)
+		: m_metaQueue(4096)
+	{
+		if (n < 0) {
+			n = std::max(1, sys::parallel::ThreadPool::globalSize());
+		}
+		for (int i = 0; i < n; i++) {
+			sys::parallel::Thread *thread = new MercurialDiffstatThread(hg, repo, excludes, &m_diffQueue);
+			thread->start();
+			m_threads.push_back(thread);
+		}
+
+		// A single thread is sufficient for meta-data, which is fetched in batches
+		sys::parallel::Thread *thread = new MercurialMetaDataThread(hg, repo, &m_metaQueue);
+		thread->start();
+		m_threads.push_back(thread);
+
+		// Let the diffstat queue find out how many workers are actually needed
+		m_diffQueue.setLimits(1, n, 64, 4096);
+
+		Logger::info() << "MercurialBackend: Using " << m_threads.size() << " threads for prefetching diffstats ("
+			<< n << ") / meta-data (1)" << endl;
+	}
+
+	~MercurialRevisionPrefetcher()
+	{
+		for (unsigned int i = 0; i < m_threads.size(); i++) {
+			delete m_threads[i];
+		}
+	}
+
+	void stop()
+	{
+		m_diffQueue.stop();
+		m_metaQueue.stop();
+	}
+
+	void wait()
+	{
+		for (unsigned int i = 0; i < m_threads.size(); i++) {
+			m_threads[i]->wait();
+		}
+	}
+
+	void prefetch(const std::vector<std::string> &revisions, bool diffstats = true, bool meta = true)
+	{
+		if (diffstats) {
+			m_diffQueue.put(revisions);
+		}
+		if (!meta) {
+			return;
+		}
+
+		// Put child revisions only to the meta queue
+		std::vector<std::string> children;
+		children.resize(revisions.size());
+		for (size_t i = 0; i < revisions.size(); i++) {
+			children[i] = utils::childId(revisions[i]);
+		}
+		m_metaQueue.put(children);
+	}
+
+	bool getDiffstat(const std::string &revision, DiffstatPtr *dest)
+	{
+		return m_diffQueue.getResult(revision, dest);
+	}
+
+	bool getMeta(const std::string &revision, MercurialMetaDataThread::Data *dest)
+	{
+		return m_metaQueue.getResult(utils::childId(revision), dest);
+	}
+
+	bool willFetchDiffstat(const std::string &revision)
+	{
+		return m_diffQueue.hasArg(revision);
+	}
+
+	bool willFetchMeta(const std::string &revision)
+	{
+		return m_metaQueue.hasArg(utils::childId(revision));
+	}
+
+private:
+	JobQueue<std::string, DiffstatPtr> m_diffQueue;
+	JobQueue<std::string, MercurialMetaDataThread::Data> m_metaQueue;
+	std::vector<sys::parallel::Thread *> m_threads;
+};
 
 
 // Constructor
 MercurialBackend::MercurialBackend(const Options &options)
-	: Backend(options)
+	: Backend(options), m_changelog(NULL), m_server(NULL), m_prefetcher(NULL)
 {
 	Py_Initialize();
 }
@@ -37,6 +437,7 @@ MercurialBackend::MercurialBackend(const Options &options)
 // Destructor
 MercurialBackend::~MercurialBackend()
 {
+	close();
 	Py_Finalize();
 }
 
@@ -48,6 +449,24 @@ void MercurialBackend::init()
 		throw PEX(str::printf("Not a mercurial repository: %s", repo.c_str()));
 	}
 
+	// Meta-data is read from the changelog directly if its format is known
+	m_changelog = new HgChangelog();
+	if (!m_changelog->open(repo)) {
+		PDEBUG << "Unable to read changelog natively, using hg for meta-data" << endl;
+		delete m_changelog;
+		m_changelog = NULL;
+	}
+
+	// The command server replaces the embedded Python interpreter if requested
+	if (m_opts.options().find("cmdserver") != m_opts.options().end()) {
+		std::string hg = sys::fs::which("hg");
+		if (hg.empty()) {
+			throw PEX("hg executable not found, command server unavailable");
+		}
+		m_server = new HgCommandServer(hg, repo);
+		return;
+	}
+
 	int res = simpleString(str::printf("\
 import sys \n\
 from cStringIO import StringIO\n\
@@ -61,17 +480,40 @@ repo = hg.repository(myui, '%s') \n\n", repo.c_str()));
 	}
 }
 
+// Called after Report::run()
+void MercurialBackend::close()
+{
+	// Clean up any prefetching threads
+	finalize();
+
+	delete m_server;
+	m_server = NULL;
+	delete m_changelog;
+	m_changelog = NULL;
+}
+
 // Returns true if this backend is able to access the given repository
 bool MercurialBackend::handles(const std::string &url)
 {
 	return sys::fs::dirExists(url+"/.hg");
 }
 
+// Prints a help screen
+void MercurialBackend::printHelp() const
+{
+	Options::print("--cmdserver", "Talk to a Mercurial command server instead of using the Python API");
+}
+
 // Returns a unique identifier for this repository
 std::string MercurialBackend::uuid()
 {
 	// Use the ID of the first commit of the master branch as the UUID.
-	std::string out = hgcmd("log", "date=None, user=None, quiet=None, rev=\"0\"");
+	std::string out;
+	if (m_server) {
+		out = m_server->runcommand(args("log", "--quiet", "-r", "0"));
+	} else {
+		out = hgcmd("log", "date=None, user=None, quiet=None, rev=\"0\"");
+	}
 	size_t pos = out.find(':');
 	if (pos != std::string::npos) {
 		out = out.substr(pos+1);
@@ -82,7 +524,17 @@ std::string MercurialBackend::uuid()
 // Returns the HEAD revision for the current branch
 std::string MercurialBackend::head(const std::string &branch)
 {
-	std::string out = hgcmd("log", str::printf("date=None, rev=None, user=None, quiet=None, limit=1, branch=[\"%s\"]", branch.c_str()));
+	std::string out;
+	if (m_server) {
+		std::vector<std::string> a = args("log", "--quiet", "--limit", "1");
+		if (!branch.empty()) {
+			a.push_back("--branch");
+			a.push_back(branch);
+		}
+		out = m_server->runcommand(a);
+	} else {
+		out = hgcmd("log", str::printf("date=None, rev=None, user=None, quiet=None, limit=1, branch=[\"%s\"]", branch.c_str()));
+	}
 	size_t pos = out.find(':');
 	if (pos != std::string::npos) {
 		out = out.substr(pos+1);
@@ -93,7 +545,7 @@ std::string MercurialBackend::head(const std::string &branch)
 // Returns the currently checked out branch
 std::string MercurialBackend::mainBranch()
 {
-	std::string out = hgcmd("branch");
+	std::string out = (m_server ? m_server->runcommand(args("branch")) : hgcmd("branch"));
 	return str::trim(out);
 }
 
@@ -101,7 +553,7 @@ std::string MercurialBackend::mainBranch()
 std::vector<std::string> MercurialBackend::branches()
 {
 #if 1
-	std::string out = hgcmd("branches");
+	std::string out = (m_server ? m_server->runcommand(args("branches", "--quiet")) : hgcmd("branches"));
 #else
 	int ret;
 	std::string out = sys::io::exec(&ret, "hg", "--noninteractive", "--repository", m_opts.repository().c_str(), "branches", "--quiet");
@@ -119,10 +571,15 @@ std::vector<std::string> MercurialBackend::branches()
 // Returns a list of available tags
 std::vector<Tag> MercurialBackend::tags()
 {
-	// TODO: Determine correct keyword for non-quiet output, if any
-	simpleString("myui.quiet = False\n");
-	std::string out = hgcmd("tags");
-	simpleString("myui.quiet = True\n");
+	std::string out;
+	if (m_server) {
+		out = m_server->runcommand(args("tags"));
+	} else {
+		// TODO: Determine correct keyword for non-quiet output, if any
+		simpleString("myui.quiet = False\n");
+		out = hgcmd("tags");
+		simpleString("myui.quiet = True\n");
+	}
 
 	std::vector<std::string> lines = str::split(out, "\n");
 	std::vector<Tag> tags;
@@ -145,26 +602,52 @@ std::vector<Tag> MercurialBackend::tags()
 // Returns a diffstat for the specified revision
 DiffstatPtr MercurialBackend::diffstat(const std::string &id)
 {
+	// Maybe it's prefetched
+	if (m_prefetcher && m_prefetcher->willFetchDiffstat(id)) {
+		DiffstatPtr stat;
+		if (!m_prefetcher->getDiffstat(id, &stat)) {
+			throw PEX(str::printf("Failed to retrieve diffstat for revision %s", id.c_str()));
+		}
+		return stat;
+	}
+
+	if (m_server) {
+		return MercurialDiffstatThread::diffstat(m_server, id, m_excludes);
+	}
+
 	std::vector<std::string> ids = str::split(id, ":");
 #if 1
+	std::string exclude;
+	for (size_t i = 0; i < m_excludes.size(); i++) {
+		exclude += (i == 0 ? "" : ", ") + pyString(excludePattern(m_excludes[i]));
+	}
+
 	std::string out;
 	if (ids.size() > 1) {
-		out = hgcmd("diff", str::printf("rev=[\"%s:%s\"]", ids[0].c_str(), ids[1].c_str()));
+		out = hgcmd("diff", str::printf("rev=[\"%s:%s\"], exclude=[%s]", ids[0].c_str(), ids[1].c_str(), exclude.c_str()));
 	} else {
-		out = hgcmd("diff", str::printf("change=\"%s\"", ids[0].c_str()));
+		out = hgcmd("diff", str::printf("change=\"%s\", exclude=[%s]", ids[0].c_str(), exclude.c_str()));
 	}
 #else
 	std::string out = sys::io::exec(hgcmd()+" diff --change "+id);
 #endif
-	std::istringstream in(out);
-	return DiffParser::parse(in);
+	DiffParser parser;
+	parser.feed(out.data(), out.length());
+	return parser.finish();
 }
 
 // Returns a file listing for the given revision (defaults to HEAD)
 std::vector<std::string> MercurialBackend::tree(const std::string &id)
 {
 	std::string out;
-	if (id.empty()) {
+	if (m_server) {
+		std::vector<std::string> a = args("manifest");
+		if (!id.empty()) {
+			a.push_back("-r");
+			a.push_back(id);
+		}
+		out = m_server->runcommand(a);
+	} else if (id.empty()) {
 		out = hgcmd("status", str::printf("change=\"%s\", all=True, no_status=True", id.c_str()));
 	} else {
 		out = hgcmd("status", str::printf("all=True, no_status=True", id.c_str()));
@@ -179,6 +662,16 @@ std::vector<std::string> MercurialBackend::tree(const std::string &id)
 // Returns the file contents of the given path at the given revision (defaults to HEAD)
 std::string MercurialBackend::cat(const std::string &path, const std::string &id)
 {
+	if (m_server) {
+		std::vector<std::string> a = args("cat");
+		if (!id.empty()) {
+			a.push_back("-r");
+			a.push_back(id);
+		}
+		a.push_back(m_opts.repository() + "/" + path);
+		return m_server->runcommand(a);
+	}
+
 	// stdout redirection to a cStringIO object doesn't work here,
 	// because Mercurial's cat will close the file after writing,
 	// which discards all contents of a cStringIO object.
@@ -202,22 +695,42 @@ std::string MercurialBackend::cat(const std::string &path, const std::string &id
 }
 
 // Returns a revision iterator for the given branch
-Backend::LogIterator *MercurialBackend::iterator(const std::string &branch, int64_t start, int64_t end)
+Backend::LogIterator *MercurialBackend::iterator(const std::string &branch, int64_t start, int64_t end, const RevisionFilter &)
 {
-	std::string date = "None";
+	std::string date;
 	if (start >= 0) {
 		if (end >= 0) {
-			date = str::printf("\"%lld 0 to %lld 0\"", start, end);
+			date = str::printf("%lld 0 to %lld 0", start, end);
 		} else {
-			date = str::printf("\">%lld 0\"", start);
+			date = str::printf(">%lld 0", start);
 		}
 	} else if (end >= 0) {
-		date = str::printf("\"<%lld 0\"", end);
+		date = str::printf("<%lld 0", end);
+	}
+
+	// Walk the first-parent chain natively if possible
+	std::vector<std::string> revisions;
+	if (m_changelog && m_changelog->firstParents(head(branch), start, end, &revisions)) {
+		for (int i = revisions.size()-1; i > 0; i--) {
+			revisions[i] = revisions[i-1] + ":" + revisions[i];
+		}
+		return new LogIterator(revisions);
 	}
 
 	// Request log from HEAD to 0, so follow_first is effective
-	std::string out = hgcmd("log", str::printf("date=%s, user=None, follow_first=True, quiet=None, rev=[\"%s:0\"]", date.c_str(), (head(branch)).c_str()));
-	std::vector<std::string> revisions = str::split(out, "\n");
+	std::string out;
+	if (m_server) {
+		std::vector<std::string> a = args("log", "--quiet", "--follow-first", "-r", head(branch) + ":0");
+		if (!date.empty()) {
+			a.push_back("--date");
+			a.push_back(date);
+		}
+		out = m_server->runcommand(a);
+	} else {
+		date = (date.empty() ? "None" : "\"" + date + "\"");
+		out = hgcmd("log", str::printf("date=%s, user=None, follow_first=True, quiet=None, rev=[\"%s:0\"]", date.c_str(), (head(branch)).c_str()));
+	}
+	revisions = str::split(out, "\n");
 	if (!revisions.empty()) {
 		revisions.pop_back();
 	}
@@ -238,12 +751,65 @@ Backend::LogIterator *MercurialBackend::iterator(const std::string &branch, int6
 	return new LogIterator(revisions);
 }
 
+// Adds the given revision IDs to the revision prefetcher
+void MercurialBackend::prefetch(const std::vector<std::string> &ids)
+{
+	if (startPrefetcher()) {
+		m_prefetcher->prefetch(ids, true, m_changelog == NULL);
+		PDEBUG << "Started prefetching " << ids.size() << " revisions" << endl;
+	}
+}
+
+// Starts prefetching the meta-data of the given revision IDs
+void MercurialBackend::prefetchMeta(const std::vector<std::string> &ids)
+{
+	// Reading the changelog is cheap enough
+	if (m_changelog) {
+		return;
+	}
+	if (startPrefetcher()) {
+		m_prefetcher->prefetch(ids, false);
+		PDEBUG << "Started prefetching meta-data of " << ids.size() << " revisions" << endl;
+	}
+}
+
 // Returns the revision data for the given ID
 Revision *MercurialBackend::revision(const std::string &id)
 {
+	return fetchRevision(id, true);
+}
+
+// Returns the revision meta-data for the given ID
+Revision *MercurialBackend::metaRevision(const std::string &id)
+{
+	return fetchRevision(id, false);
+}
+
+// Returns the revision data for the given ID, optionally without diffstat
+Revision *MercurialBackend::fetchRevision(const std::string &id, bool diffstats)
+{
+	// Check for pre-fetched meta data first
+	if (m_prefetcher && m_prefetcher->willFetchMeta(id)) {
+		MercurialMetaDataThread::Data data;
+		if (m_prefetcher->getMeta(id, &data)) {
+			return new Revision(id, data.date, data.author, data.message, (diffstats ? diffstat(id) : DiffstatPtr()));
+		}
+		PDEBUG << "Failed to prefetch meta-data for revision " << id << ", fetching it manually" << endl;
+	}
+
+	HgChangelog::Entry entry;
+	if (m_changelog && m_changelog->entry(m_changelog->rev(utils::childId(id)), &entry)) {
+		return new Revision(id, entry.date, entry.author, entry.message, (diffstats ? diffstat(id) : DiffstatPtr()));
+	}
+
 	std::vector<std::string> ids = str::split(id, ":");
 #if 1
-	std::string meta = hgcmd("log", str::printf("rev=[\"%s\"], date=None, user=None, template=\"{date|hgdate}\\n{author|person}\\n{desc}\"", ids.back().c_str()));
+	std::string meta;
+	if (m_server) {
+		meta = m_server->runcommand(args("log", "-r", ids.back(), "--template", "{date|hgdate}\\n{author|person}\\n{desc}"));
+	} else {
+		meta = hgcmd("log", str::printf("rev=[\"%s\"], date=None, user=None, template=\"{date|hgdate}\\n{author|person}\\n{desc}\"", ids.back().c_str()));
+	}
 #else
 	std::string meta = sys::io::exec(hgcmd()+" log -r "+id+" --template=\"{date|hgdate}\n{author|person}\n{desc}\"");
 #endif
@@ -251,14 +817,7 @@ Revision *MercurialBackend::revision(const std::string &id)
 	int64_t date = 0;
 	std::string author;
 	if (!lines.empty()) {
-		// Date is given as seconds and timezone offset from UTC
-		std::vector<std::string> parts = str::split(lines[0], " ");
-		if (parts.size() > 1) {
-			int64_t offset = 0;
-			str::str2int(parts[0], &date);
-			str::str2int(parts[1], &offset);
-			date += offset;
-		}
+		date = MercurialMetaDataThread::parseDate(lines[0]);
 		lines.erase(lines.begin());
 	}
 	if (!lines.empty()) {
@@ -266,7 +825,49 @@ Revision *MercurialBackend::revision(const std::string &id)
 		lines.erase(lines.begin());
 	}
 	std::string msg = str::join(lines, "\n");
-	return new Revision(id, date, author, msg, diffstat(id));
+	return new Revision(id, date, author, msg, (diffstats ? diffstat(id) : DiffstatPtr()));
+}
+
+// Handle cleanup of the revision prefetcher
+void MercurialBackend::finalize()
+{
+	if (m_prefetcher) {
+		PDEBUG << "Waiting for prefetcher... " << endl;
+		m_prefetcher->stop();
+		m_prefetcher->wait();
+		delete m_prefetcher;
+		m_prefetcher = NULL;
+		PDEBUG << "done" << endl;
+	}
+}
+
+// Starts the revision prefetcher if possible
+bool MercurialBackend::startPrefetcher()
+{
+	if (m_prefetcher == NULL) {
+		// The prefetcher runs the hg executable in order to avoid
+		// contention on the Python interpreter
+		std::string hg = sys::fs::which("hg");
+		if (hg.empty()) {
+			PDEBUG << "hg executable not found, prefetching disabled" << endl;
+			return false;
+		}
+		PDEBUG << "hg executable is " << hg << endl;
+		m_prefetcher = new MercurialRevisionPrefetcher(hg, m_opts.repository(), m_excludes);
+	}
+	return true;
+}
+
+// Returns an argument list for the command server
+std::vector<std::string> MercurialBackend::args(const std::string &a1, const std::string &a2, const std::string &a3, const std::string &a4, const std::string &a5) const
+{
+	std::vector<std::string> a;
+	a.push_back(a1);
+	if (!a2.empty()) a.push_back(a2);
+	if (!a3.empty()) a.push_back(a3);
+	if (!a4.empty()) a.push_back(a4);
+	if (!a5.empty()) a.push_back(a5);
+	return a;
 }
 
 // Returns the hg command with the correct --repository command line switch
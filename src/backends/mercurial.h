@@ -17,6 +17,9 @@
 
 #include "backend.h"
 
+class HgChangelog;
+class HgCommandServer;
+class MercurialRevisionPrefetcher;
 
 class MercurialBackend : public Backend
 {
@@ -25,6 +28,7 @@ class MercurialBackend : public Backend
 		~MercurialBackend();
 
 		void init();
+		void close();
 
 		std::string name() const { return "mercurial"; }
 		static bool handles(const std::string &url);
@@ -38,13 +42,27 @@ class MercurialBackend : public Backend
 		std::vector<std::string> tree(const std::string &id = std::string());
 		std::string cat(const std::string &path, const std::string &id = std::string());
 
-		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1);
+		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter());
+		void prefetch(const std::vector<std::string> &ids);
 		Revision *revision(const std::string &id);
+		void prefetchMeta(const std::vector<std::string> &ids);
+		Revision *metaRevision(const std::string &id);
+		void finalize();
+
+		void printHelp() const;
 
 	private:
+		Revision *fetchRevision(const std::string &id, bool diffstats);
+		bool startPrefetcher();
+		std::vector<std::string> args(const std::string &a1, const std::string &a2 = std::string(), const std::string &a3 = std::string(), const std::string &a4 = std::string(), const std::string &a5 = std::string()) const;
 		std::string hgcmd() const;
 		std::string hgcmd(const std::string &cmd, const std::string &args = std::string()) const;
 		int simpleString(const std::string &str) const;
+
+	private:
+		HgChangelog *m_changelog;
+		HgCommandServer *m_server;
+		MercurialRevisionPrefetcher *m_prefetcher;
 };
 
 
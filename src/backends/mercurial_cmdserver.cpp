@@ -0,0 +1,203 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: mercurial_cmdserver.cpp
+ * Client for the Mercurial command server
+ */
+
+
+#include "main.h"
+
+#include <cctype>
+
+#include "logger.h"
+#include "strlib.h"
+
+#include "syslib/io.h"
+
+#include "backends/mercurial_p.h"
+
+
+namespace
+{
+
+// Collects command output in a string
+class StringSink : public HgCommandServer::Sink
+{
+	public:
+		StringSink(std::string *str) : m_str(str) { }
+
+		void write(const char *data, size_t len) {
+			m_str->append(data, len);
+		}
+
+	private:
+		std::string *m_str;
+};
+
+} // anonymous namespace
+
+
+// Constructor, starts the command server and reads its hello message
+HgCommandServer::HgCommandServer(const std::string &hg, const std::string &repo)
+	: m_buf(NULL), m_repo(repo)
+{
+	m_buf = new sys::io::PopenStreambuf(hg.c_str(), "--config", "ui.interactive=False", "--repository", repo.c_str(), "serve", "--cmdserver", "pipe", std::ios::in | std::ios::out);
+
+	try {
+		char channel;
+		read(&channel, 1);
+		std::string hello(readLength(), '\0');
+		if (!hello.empty()) {
+			read(&hello[0], hello.length());
+		}
+		if (channel != 'o' || hello.find("runcommand") == std::string::npos) {
+			throw PEX(str::printf("Unexpected hello message from command server: %s", hello.c_str()));
+		}
+		PDEBUG << "Command server for " << repo << " started: " << str::trim(hello) << endl;
+	} catch (...) {
+		delete m_buf;
+		throw;
+	}
+}
+
+// Destructor, stops the command server
+HgCommandServer::~HgCommandServer()
+{
+	// The server exits once its input has been closed
+	try {
+		m_buf->closeWrite();
+		m_buf->close();
+	} catch (const PepperException &ex) {
+		PDEBUG << "Error stopping command server: " << ex.what() << endl;
+	}
+	delete m_buf;
+}
+
+// Runs the given command and passes all output to the sink. Returns the
+// command's return code.
+int HgCommandServer::runcommand(const std::vector<std::string> &args, Sink *out, std::string *err)
+{
+	PTRACE << "hg " << str::join(args, " ") << endl;
+
+	std::string data;
+	for (size_t i = 0; i < args.size(); i++) {
+		if (i > 0) {
+			data += '\0';
+		}
+		data += args[i];
+	}
+	write("runcommand\n", 11);
+	writeLength(data.length());
+	write(data.data(), data.length());
+	if (m_buf->pubsync() != 0) {
+		throw PEX("Unable to write to command server");
+	}
+
+	char buffer[4096];
+	while (true) {
+		char channel;
+		read(&channel, 1);
+		uint32_t len = readLength();
+
+		switch (channel) {
+			case 'o':
+			case 'e':
+				while (len > 0) {
+					size_t n = std::min(len, uint32_t(sizeof(buffer)));
+					read(buffer, n);
+					if (channel == 'o') {
+						out->write(buffer, n);
+					} else if (err) {
+						err->append(buffer, n);
+					}
+					len -= n;
+				}
+				break;
+
+			case 'r': {
+				char result[4];
+				if (len != sizeof(result)) {
+					throw PEX(str::printf("Invalid result length from command server: %u", len));
+				}
+				read(result, sizeof(result));
+				return (int32_t)(((uint32_t)(unsigned char)result[0] << 24) | ((uint32_t)(unsigned char)result[1] << 16)
+					| ((uint32_t)(unsigned char)result[2] << 8) | (uint32_t)(unsigned char)result[3]);
+			}
+
+			case 'I':
+			case 'L':
+				// Input is never provided
+				writeLength(0);
+				if (m_buf->pubsync() != 0) {
+					throw PEX("Unable to write to command server");
+				}
+				break;
+
+			default:
+				// Unknown mandatory channels are identified by upper case letters
+				if (isupper((unsigned char)channel)) {
+					throw PEX(str::printf("Unexpected command server channel '%c'", channel));
+				}
+				while (len > 0) {
+					size_t n = std::min(len, uint32_t(sizeof(buffer)));
+					read(buffer, n);
+					len -= n;
+				}
+				break;
+		}
+	}
+}
+
+// Runs the given command and returns its output. An exception will be
+// thrown if the command fails.
+std::string HgCommandServer::runcommand(const std::vector<std::string> &args)
+{
+	std::string out, err;
+	StringSink sink(&out);
+	int ret = runcommand(args, &sink, &err);
+	if (ret != 0) {
+		throw PEX(str::printf("hg %s failed (%d): %s", (args.empty() ? "" : args[0].c_str()), ret, str::trim(err).c_str()));
+	}
+	return out;
+}
+
+// Reads exactly len bytes from the server
+void HgCommandServer::read(char *data, size_t len)
+{
+	if (m_buf->sgetn(data, len) != (std::streamsize)len) {
+		throw PEX(str::printf("Unexpected end of data from command server for %s", m_repo.c_str()));
+	}
+}
+
+// Writes data to the server
+void HgCommandServer::write(const char *data, size_t len)
+{
+	if (m_buf->sputn(data, len) != (std::streamsize)len) {
+		throw PEX("Unable to write to command server");
+	}
+}
+
+// Reads a big-endian length field
+uint32_t HgCommandServer::readLength()
+{
+	unsigned char data[4];
+	read((char *)data, sizeof(data));
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+// Writes a big-endian length field
+void HgCommandServer::writeLength(uint32_t len)
+{
+	char data[4];
+	data[0] = (char)((len >> 24) & 0xFF);
+	data[1] = (char)((len >> 16) & 0xFF);
+	data[2] = (char)((len >> 8) & 0xFF);
+	data[3] = (char)(len & 0xFF);
+	write(data, sizeof(data));
+}
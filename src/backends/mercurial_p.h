@@ -0,0 +1,122 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: mercurial_p.h
+ * Interfaces of internal classes for the Mercurial backend
+ */
+
+
+#ifndef MERCURIAL_BACKEND_P_H_
+#define MERCURIAL_BACKEND_P_H_
+
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+namespace sys { namespace io { class PopenStreambuf; } }
+
+
+/*
+ * Client for the Mercurial command server ("hg serve --cmdserver pipe").
+ * Commands are sent using the binary channel protocol, and output is passed
+ * to a sink while it is being received.
+ */
+class HgCommandServer
+{
+	public:
+		// Receiver for command output
+		class Sink
+		{
+			public:
+				virtual ~Sink() { }
+				virtual void write(const char *data, size_t len) = 0;
+		};
+
+	public:
+		HgCommandServer(const std::string &hg, const std::string &repo);
+		~HgCommandServer();
+
+		int runcommand(const std::vector<std::string> &args, Sink *out, std::string *err = NULL);
+		std::string runcommand(const std::vector<std::string> &args);
+
+	private:
+		void read(char *data, size_t len);
+		void write(const char *data, size_t len);
+		uint32_t readLength();
+		void writeLength(uint32_t len);
+
+	private:
+		sys::io::PopenStreambuf *m_buf;
+		std::string m_repo;
+};
+
+
+/*
+ * Native reader for the changelog of a repository, which is stored in a
+ * revlog at .hg/store/00changelog.[id]. The index and data files are
+ * mapped into memory, and revisions are reconstructed by applying their
+ * delta chains. Only version 1 revlogs are supported; open() returns false
+ * for other formats, so callers can fall back to Mercurial itself.
+ */
+class HgChangelog
+{
+	public:
+		struct Entry
+		{
+			int64_t time; // UTC
+			int64_t date; // Adjusted by the timezone offset
+			std::string author, message;
+		};
+
+	public:
+		HgChangelog();
+		~HgChangelog();
+
+		bool open(const std::string &repo);
+		void close();
+		inline bool isOpen() const { return m_index.isOpen(); }
+
+		inline int size() const { return int(m_revs.size()); }
+		int rev(const std::string &id) const;
+		std::string id(int rev) const;
+		int parent(int rev) const;
+		bool entry(int rev, Entry *entry);
+		bool firstParents(const std::string &head, int64_t start, int64_t end, std::vector<std::string> *ids);
+
+		static std::string person(const std::string &author);
+
+	private:
+		struct Rev
+		{
+			const char *data;
+			uint32_t length, size;
+			int32_t base, p1;
+			const unsigned char *node;
+		};
+
+		bool readIndex();
+		bool text(int rev, std::string *text);
+		bool chunk(int rev, std::string *data) const;
+
+	private:
+		sys::fs::MappedFile m_index, m_data;
+		bool m_generaldelta;
+		std::vector<Rev> m_revs;
+		std::unordered_map<std::string, int> m_ids;
+
+		sys::parallel::Mutex m_mutex;
+		int m_lastRev;
+		std::string m_lastText;
+};
+
+
+#endif // MERCURIAL_BACKEND_P_H_
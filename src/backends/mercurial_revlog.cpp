@@ -0,0 +1,496 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: mercurial_revlog.cpp
+ * Native reader for the Mercurial changelog
+ */
+
+
+#include "main.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#ifdef HAVE_LIBZ
+ #include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+ #include <zstd.h>
+#endif
+
+#include "logger.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+
+#include "backends/mercurial_p.h"
+
+
+// Revlog format details
+#define REVLOG_ENTRY_SIZE 64
+#define REVLOG_VERSION 1
+#define REVLOG_INLINE (1 << 16)
+#define REVLOG_GENERALDELTA (1 << 17)
+#define REVLOG_SHORT_ID 6 // Bytes of the node used for IDs
+
+
+namespace
+{
+
+// Reads a big-endian 32 bit integer
+inline uint32_t readU32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+// Reads a big-endian 48 bit integer
+inline uint64_t readU48(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	uint64_t v = 0;
+	for (int i = 0; i < 6; i++) {
+		v = (v << 8) | u[i];
+	}
+	return v;
+}
+
+// Returns the hexadecimal representation of the given bytes
+std::string hex(const unsigned char *data, size_t n)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string str(2 * n, '0');
+	for (size_t i = 0; i < n; i++) {
+		str[2*i] = digits[data[i] >> 4];
+		str[2*i+1] = digits[data[i] & 0x0F];
+	}
+	return str;
+}
+
+// Returns the line-separated words of a requirements file
+std::vector<std::string> readRequires(const std::string &path)
+{
+	std::vector<std::string> requires;
+	std::ifstream in(path.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		line = str::trim(line);
+		if (!line.empty()) {
+			requires.push_back(line);
+		}
+	}
+	return requires;
+}
+
+// Replaces all occurrences of a string
+std::string replace(std::string str, const std::string &from, const std::string &to)
+{
+	size_t pos = 0;
+	while ((pos = str.find(from, pos)) != std::string::npos) {
+		str.replace(pos, from.length(), to);
+		pos += to.length();
+	}
+	return str;
+}
+
+// Decompresses a zlib stream of unknown size
+bool inflate(const char *data, size_t length, std::string *out)
+{
+#ifdef HAVE_LIBZ
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		return false;
+	}
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = length;
+
+	char buffer[16384];
+	int ret;
+	out->clear();
+	do {
+		zs.next_out = (Bytef *)buffer;
+		zs.avail_out = sizeof(buffer);
+		ret = ::inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			break;
+		}
+		out->append(buffer, sizeof(buffer) - zs.avail_out);
+	} while (ret != Z_STREAM_END);
+	inflateEnd(&zs);
+	return (ret == Z_STREAM_END);
+#else
+	(void)data;
+	(void)length;
+	(void)out;
+	return false;
+#endif
+}
+
+// Applies a binary delta (a list of hunks replacing byte ranges) to the text
+bool patch(const std::string &text, const std::string &delta, std::string *out)
+{
+	out->clear();
+	out->reserve(text.length() + delta.length());
+	size_t last = 0, pos = 0;
+	while (pos + 12 <= delta.length()) {
+		uint32_t start = readU32(&delta[pos]);
+		uint32_t end = readU32(&delta[pos + 4]);
+		uint32_t length = readU32(&delta[pos + 8]);
+		pos += 12;
+		if (start < last || end < start || end > text.length() || pos + length > delta.length()) {
+			return false;
+		}
+		out->append(text, last, start - last);
+		out->append(delta, pos, length);
+		pos += length;
+		last = end;
+	}
+	out->append(text, last, std::string::npos);
+	return (pos == delta.length());
+}
+
+} // anonymous namespace
+
+
+// Constructor
+HgChangelog::HgChangelog()
+	: m_generaldelta(false), m_lastRev(-1)
+{
+}
+
+// Destructor
+HgChangelog::~HgChangelog()
+{
+	close();
+}
+
+// Opens the changelog of the given repository. Returns false if the
+// repository format isn't supported.
+bool HgChangelog::open(const std::string &repo)
+{
+	close();
+
+	// Shared repositories point to the actual store
+	std::string root = repo + "/.hg";
+	if (sys::fs::fileExists(root + "/sharedpath")) {
+		std::ifstream in((root + "/sharedpath").c_str());
+		std::getline(in, root);
+		root = str::trim(root);
+	}
+
+	std::vector<std::string> requires = readRequires(root + "/requires");
+	std::vector<std::string> store = readRequires(root + "/store/requires");
+	requires.insert(requires.end(), store.begin(), store.end());
+	bool hasStore = false;
+	for (size_t i = 0; i < requires.size(); i++) {
+		const std::string &r = requires[i];
+		if (r == "store") {
+			hasStore = true;
+		} else if (r == "revlogv2" || r == "changelogv2" || str::startsWith(r, "exp-revlogv2") || str::startsWith(r, "exp-changelog-v2")) {
+			PDEBUG << "Unsupported repository requirement " << r << endl;
+			return false;
+		}
+#ifndef HAVE_ZSTD
+		if (r == "revlog-compression-zstd") {
+			PDEBUG << "Unsupported repository requirement " << r << endl;
+			return false;
+		}
+#endif
+	}
+
+	std::string path = root + (hasStore ? "/store/00changelog" : "/00changelog");
+	try {
+		if (!sys::fs::fileExists(path + ".i")) {
+			return false;
+		}
+		m_index.open(path + ".i");
+		if (m_index.size() >= 4 && !(readU32(m_index.data()) & REVLOG_INLINE) && sys::fs::fileExists(path + ".d")) {
+			m_data.open(path + ".d");
+		}
+	} catch (const PepperException &ex) {
+		PDEBUG << "Unable to map changelog " << path << ": " << ex.what() << endl;
+		close();
+		return false;
+	}
+
+	if (!readIndex()) {
+		close();
+		return false;
+	}
+	PDEBUG << "Mapped changelog " << path << " with " << m_revs.size() << " revisions" << endl;
+	return true;
+}
+
+// Unmaps the changelog
+void HgChangelog::close()
+{
+	m_index.close();
+	m_data.close();
+	m_revs.clear();
+	m_ids.clear();
+	m_lastRev = -1;
+	m_lastText.clear();
+}
+
+// Returns the revision number for the given node ID, or -1
+int HgChangelog::rev(const std::string &id) const
+{
+	if (id.length() < 2 * REVLOG_SHORT_ID) {
+		return -1;
+	}
+	std::unordered_map<std::string, int>::const_iterator it = m_ids.find(id.substr(0, 2 * REVLOG_SHORT_ID));
+	if (it == m_ids.end() || id.length() > 40 || hex(m_revs[it->second].node, 20).compare(0, id.length(), id) != 0) {
+		return -1;
+	}
+	return it->second;
+}
+
+// Returns the short node ID of the given revision
+std::string HgChangelog::id(int rev) const
+{
+	return hex(m_revs[rev].node, REVLOG_SHORT_ID);
+}
+
+// Returns the first parent of the given revision, or -1
+int HgChangelog::parent(int rev) const
+{
+	return m_revs[rev].p1;
+}
+
+// Decodes the meta-data of the given revision
+bool HgChangelog::entry(int rev, Entry *entry)
+{
+	std::string data;
+	if (!text(rev, &data)) {
+		return false;
+	}
+
+	// The changelog entry consists of the manifest node, the user, the
+	// date, the list of modified files and the description
+	size_t user = data.find('\n');
+	size_t date = (user == std::string::npos ? user : data.find('\n', user + 1));
+	size_t desc = (date == std::string::npos ? date : data.find("\n\n", date + 1));
+	if (desc == std::string::npos) {
+		return false;
+	}
+	entry->author = person(data.substr(user + 1, date - user - 1));
+	entry->message = data.substr(desc + 2);
+
+	// Date is given as seconds and timezone offset from UTC
+	std::vector<std::string> parts = str::split(data.substr(date + 1, data.find('\n', date + 1) - date - 1), " ");
+	entry->time = entry->date = 0;
+	if (parts.size() > 1) {
+		int64_t offset = 0;
+		str::str2int(parts[1], &offset);
+		entry->time = int64_t(strtod(parts[0].c_str(), NULL));
+		entry->date = entry->time + offset;
+	}
+	return true;
+}
+
+// Collects the IDs of the first-parent chain ending at the given revision,
+// oldest first, optionally limited to the given (inclusive) time range
+bool HgChangelog::firstParents(const std::string &head, int64_t start, int64_t end, std::vector<std::string> *ids)
+{
+	int r = rev(head);
+	if (r < 0) {
+		return false;
+	}
+	std::vector<int> chain;
+	for (; r >= 0; r = m_revs[r].p1) {
+		chain.push_back(r);
+	}
+
+	// Decode entries in ascending order, so deltas can be applied
+	// incrementally
+	ids->clear();
+	ids->reserve(chain.size());
+	for (int i = int(chain.size()) - 1; i >= 0; i--) {
+		if (start >= 0 || end >= 0) {
+			Entry e;
+			if (!entry(chain[i], &e)) {
+				return false;
+			}
+			if ((start >= 0 && e.time < start) || (end >= 0 && e.time > end)) {
+				continue;
+			}
+		}
+		ids->push_back(id(chain[i]));
+	}
+	return true;
+}
+
+// Returns the name part of an author string, like the "person" template filter
+std::string HgChangelog::person(const std::string &author)
+{
+	if (author.find('@') == std::string::npos) {
+		return author;
+	}
+	size_t pos = author.find('<');
+	if (pos != std::string::npos) {
+		std::string name = author.substr(0, pos);
+		size_t start = name.find_first_not_of(" \"");
+		size_t end = name.find_last_not_of(" \"");
+		name = (start == std::string::npos ? std::string() : name.substr(start, end - start + 1));
+		return replace(name, "\\\"", "\"");
+	}
+	return replace(author.substr(0, author.find('@')), ".", " ");
+}
+
+// Parses the index entries
+bool HgChangelog::readIndex()
+{
+	const char *data = m_index.data();
+	size_t size = m_index.size();
+	if (size == 0) {
+		return true;
+	}
+	if (size < REVLOG_ENTRY_SIZE) {
+		return false;
+	}
+
+	uint32_t header = readU32(data);
+	if ((header & 0xFFFF) != REVLOG_VERSION) {
+		PDEBUG << "Unsupported changelog version " << (header & 0xFFFF) << endl;
+		return false;
+	}
+	bool inlineData = (header & REVLOG_INLINE);
+	m_generaldelta = (header & REVLOG_GENERALDELTA);
+
+	m_revs.reserve(inlineData ? size / (2 * REVLOG_ENTRY_SIZE) : size / REVLOG_ENTRY_SIZE);
+	size_t pos = 0;
+	while (pos + REVLOG_ENTRY_SIZE <= size) {
+		const char *e = data + pos;
+		Rev r;
+		uint64_t offset = (m_revs.empty() ? 0 : readU48(e));
+		r.length = readU32(e + 8);
+		r.size = readU32(e + 12);
+		r.base = int32_t(readU32(e + 16));
+		r.p1 = int32_t(readU32(e + 24));
+		r.node = (const unsigned char *)(e + 32);
+
+		if (inlineData) {
+			if (pos + REVLOG_ENTRY_SIZE + r.length > size) {
+				break; // Truncated by a running transaction
+			}
+			r.data = e + REVLOG_ENTRY_SIZE;
+			pos += REVLOG_ENTRY_SIZE + r.length;
+		} else {
+			if (offset + r.length > m_data.size()) {
+				break;
+			}
+			r.data = m_data.data() + offset;
+			pos += REVLOG_ENTRY_SIZE;
+		}
+
+		int rev = int(m_revs.size());
+		if (r.base < 0 || r.base > rev || r.p1 < -1 || r.p1 >= rev) {
+			PDEBUG << "Invalid changelog entry for revision " << rev << endl;
+			return false;
+		}
+		m_revs.push_back(r);
+		m_ids[id(rev)] = rev;
+	}
+	return true;
+}
+
+// Reconstructs the full text of the given revision
+bool HgChangelog::text(int rev, std::string *text)
+{
+	sys::parallel::MutexLocker locker(&m_mutex);
+	if (rev < 0 || rev >= int(m_revs.size())) {
+		return false;
+	}
+	if (rev == m_lastRev) {
+		*text = m_lastText;
+		return true;
+	}
+
+	// Collect the delta chain, stopping at the last reconstructed
+	// revision if possible, which is common for sequential access
+	std::vector<int> chain;
+	int r = rev;
+	bool cached = false;
+	while (true) {
+		if (r == m_lastRev) {
+			cached = true;
+			break;
+		}
+		chain.push_back(r);
+		if (m_revs[r].base == r) {
+			break;
+		}
+		r = (m_generaldelta ? m_revs[r].base : r - 1);
+		if (!m_generaldelta && r < m_revs[rev].base) {
+			return false;
+		}
+	}
+
+	std::string base, delta, patched;
+	if (cached) {
+		base = m_lastText;
+	} else {
+		if (!chunk(chain.back(), &base)) {
+			return false;
+		}
+		chain.pop_back();
+	}
+	for (int i = int(chain.size()) - 1; i >= 0; i--) {
+		if (!chunk(chain[i], &delta) || !patch(base, delta, &patched)) {
+			PDEBUG << "Unable to apply delta for changelog revision " << chain[i] << endl;
+			return false;
+		}
+		base.swap(patched);
+	}
+	if (base.length() != m_revs[rev].size) {
+		PDEBUG << "Size mismatch for changelog revision " << rev << endl;
+		return false;
+	}
+
+	m_lastRev = rev;
+	m_lastText = base;
+	text->swap(base);
+	return true;
+}
+
+// Decompresses the stored data of the given revision
+bool HgChangelog::chunk(int rev, std::string *data) const
+{
+	const Rev &r = m_revs[rev];
+	if (r.length == 0) {
+		data->clear();
+		return true;
+	}
+	switch (r.data[0]) {
+		case '\0':
+			data->assign(r.data, r.length);
+			return true;
+		case 'u':
+			data->assign(r.data + 1, r.length - 1);
+			return true;
+		case 'x':
+			return inflate(r.data, r.length, data);
+#ifdef HAVE_ZSTD
+		case '\x28': {
+			unsigned long long n = ZSTD_getFrameContentSize(r.data, r.length);
+			if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR) {
+				return false;
+			}
+			data->resize(n);
+			size_t ret = ZSTD_decompress(&(*data)[0], n, r.data, r.length);
+			return (!ZSTD_isError(ret) && ret == n);
+		}
+#endif
+		default:
+			break;
+	}
+	PDEBUG << "Unsupported compression for changelog revision " << rev << endl;
+	return false;
+}
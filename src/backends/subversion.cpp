@@ -17,6 +17,8 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <deque>
+#include <set>
 #include <stack>
 
 #include <svn_client.h>
@@ -35,13 +37,28 @@
 #include "options.h"
 #include "revision.h"
 #include "strlib.h"
+#include "utils.h"
 
+#include "syslib/datetime.h"
 #include "syslib/fs.h"
 #include "syslib/parallel.h"
+#include "syslib/sigblock.h"
 
 #include "backends/subversion.h"
 #include "backends/subversion_p.h"
 
+#define LOG_MIN_RANGE 16384 // Smaller log intervals are fetched in one piece
+#define LOG_MIN_WINDOW 128
+#define LOG_MAX_WINDOW 65536
+#define LOG_FAST_MSECS 500 // Log windows are doubled if they are fetched faster
+#define LOG_SLOW_MSECS 2000 // ... and halved if fetching them takes longer
+#define TREE_MAX_LOG 50000 // Cached tree listings are only updated for nearby revisions
+
+// Log interval cache files
+#define LOGCACHE_MAGIC "pepper-svnlog"
+#define LOGCACHE_VERSION 2
+#define LOGCACHE_MAX_RECORDS 64 // Appended intervals until the file is compacted
+
 
 namespace {
 
@@ -74,7 +91,7 @@ std::vector<HashKey> getHashKeys(apr_hash_t *hash, apr_pool_t *pool)
 
 // Constructor
 SvnConnection::SvnConnection()
-	: pool(NULL), ctx(NULL), ra(NULL), url(NULL), root(NULL), prefix(NULL)
+	: pool(NULL), ctx(NULL), ra(NULL), url(NULL), root(NULL), prefix(NULL), repos(NULL), fs(NULL), approximate(false), m_cancelFlag(false), m_cancel(&m_cancelFlag)
 {
 }
 
@@ -106,6 +123,10 @@ void SvnConnection::open(const std::string &url, const std::map<std::string, std
 		throw PEX(strerr(err));
 	}
 
+	// Requests of this connection and its children can be cancelled
+	ctx->cancel_func = checkCancel;
+	ctx->cancel_baton = m_cancel;
+
 	// Setup the authentication data
 	svn_auth_baton_t *auth_baton;
 	svn_config_t *config = hashget<svn_config_t *>(ctx->config, SVN_CONFIG_CATEGORY_CONFIG);
@@ -140,6 +161,8 @@ void SvnConnection::open(const std::string &url, const std::map<std::string, std
 	if ((err = svn_ra_reparent(ra, root, pool))) {
 		throw PEX(strerr(err));
 	}
+
+	openLocal();
 }
 
 // Opens the connection to the Subversion repository, using the client context
@@ -156,15 +179,76 @@ void SvnConnection::open(SvnConnection *parent)
 
 	// Copy connection data from parent
 	ctx = parent->ctx;
+	m_cancel = parent->m_cancel;
 	url = apr_pstrdup(pool, parent->url);
 	root = apr_pstrdup(pool, parent->root);
 	prefix = apr_pstrdup(pool, parent->prefix);
+	excludes = parent->excludes;
+	approximate = parent->approximate;
 
 	// Setup the RA session
 	svn_error_t *err;
 	if ((err = svn_client_open_ra_session(&ra, root, ctx, pool))) {
 		throw PEX(strerr(err));
 	}
+
+	// Filesystem handles can't be shared between threads
+	if (parent->fs != NULL) {
+		openLocal();
+	}
+}
+
+// Hands out an auxiliary RA session for the repository root, reusing a
+// previously released one if possible
+svn_error_t *SvnConnection::acquire(svn_ra_session_t **session)
+{
+	if (m_idle.empty()) {
+		PTRACE << "Opening auxiliary session to " << root << endl;
+		return svn_client_open_ra_session(session, root, ctx, pool);
+	}
+
+	*session = m_idle.back();
+	m_idle.pop_back();
+
+	// Sessions may have been reparented by their previous user
+	apr_pool_t *subpool = svn_pool_create(pool);
+	const char *sessionUrl;
+	svn_error_t *err = svn_ra_get_session_url(*session, &sessionUrl, subpool);
+	if (err == NULL && strcmp(sessionUrl, root) != 0) {
+		err = svn_ra_reparent(*session, root, subpool);
+	}
+	svn_pool_destroy(subpool);
+	return err;
+}
+
+// Returns an auxiliary RA session to the connection for later use
+void SvnConnection::release(svn_ra_session_t *session)
+{
+	if (session) {
+		m_idle.push_back(session);
+	}
+}
+
+// Lets all running requests of the connection and its child connections
+// fail as soon as possible, or allows new requests again
+void SvnConnection::cancel(bool cancel)
+{
+	*m_cancel = cancel;
+}
+
+// Returns whether the requests of the connection are being cancelled
+bool SvnConnection::cancelled() const
+{
+	return *m_cancel;
+}
+
+// Cancellation callback for the client context
+svn_error_t *SvnConnection::checkCancel(void *baton)
+{
+	if (*static_cast<std::atomic<bool> *>(baton)) {
+		return svn_error_create(SVN_ERR_CANCELLED, NULL, "Request cancelled");
+	}
+	return SVN_NO_ERROR;
 }
 
 // Similar to svn_handle_error2(), but returns the error description as a std::string
@@ -224,6 +308,26 @@ std::string SvnConnection::strerr(svn_error_t *err)
 	return str;
 }
 
+// Opens local repositories through the filesystem layer. The RA session
+// will be used for diffstats if this fails.
+void SvnConnection::openLocal()
+{
+	if (strncmp(root, "file://", strlen("file://")) != 0) {
+		return;
+	}
+
+	const char *path = svn_path_uri_decode(root + strlen("file://"), pool);
+	svn_error_t *err = svn_repos_open(&repos, path, pool);
+	if (err != NULL) {
+		PDEBUG << "Unable to open local repository at " << path << ": " << strerr(err) << endl;
+		svn_error_clear(err);
+		repos = NULL;
+		return;
+	}
+	fs = svn_repos_fs(repos);
+	PDEBUG << "Opened local repository at " << path << endl;
+}
+
 void SvnConnection::init()
 {
 	svn_error_t *err;
@@ -244,6 +348,7 @@ class SvnDiffstatPrefetcher
 {
 public:
 	SvnDiffstatPrefetcher(SvnConnection *connection, int n = 4)
+		: m_connection(connection)
 	{
 		Logger::info() << "SubversionBackend: Using " << n << " threads for prefetching diffstats" << endl;
 		for (int i = 0; i < n; i++) {
@@ -251,6 +356,9 @@ public:
 			thread->start();
 			m_threads.push_back(thread);
 		}
+
+		// Let the queue find out how many sessions are actually needed
+		m_queue.setLimits(1, n, 64, 4096);
 	}
 
 	~SvnDiffstatPrefetcher()
@@ -260,9 +368,11 @@ public:
 		}
 	}
 
+	// Drops all queued jobs and cancels the requests of running ones
 	void stop()
 	{
 		m_queue.stop();
+		m_connection->cancel();
 	}
 
 	void wait()
@@ -288,6 +398,7 @@ public:
 	}
 
 private:
+	SvnConnection *m_connection;
 	JobQueue<std::string, DiffstatPtr> m_queue;
 	std::vector<SvnDiffstatThread *> m_threads;
 };
@@ -297,9 +408,9 @@ private:
 sys::parallel::Mutex SubversionBackend::SvnLogIterator::s_cacheMutex;
 
 // Constructor
-SubversionBackend::SvnLogIterator::SvnLogIterator(SubversionBackend *backend, const std::string &prefix, uint64_t startrev, uint64_t endrev)
+SubversionBackend::SvnLogIterator::SvnLogIterator(SubversionBackend *backend, const std::string &prefix, uint64_t startrev, uint64_t endrev, const RevisionFilter &filter)
 	: Backend::LogIterator(), m_backend(backend), d(new SvnConnection()), m_prefix(prefix), m_startrev(startrev), m_endrev(endrev),
-	  m_index(0), m_finished(false), m_failed(false)
+	  m_filter(filter), m_index(0), m_cacheRecords(0), m_compactCache(false), m_finished(false), m_failed(false)
 {
 	d->open(m_backend->d);
 }
@@ -338,15 +449,46 @@ struct logReceiverBaton
 	std::vector<std::string> temp;
 	std::vector<std::string> *ids;
 	uint64_t latest;
+
+	sys::parallel::Mutex *metaMutex;
+	std::map<uint64_t, SubversionBackend::MetaData> *meta;
+
+	const RevisionFilter *filter;
 };
 
 // Subversion callback for log messages
-static svn_error_t *logReceiver(void *baton, svn_log_entry_t *entry, apr_pool_t *)
+static svn_error_t *logReceiver(void *baton, svn_log_entry_t *entry, apr_pool_t *pool)
 {
 	logReceiverBaton *b = static_cast<logReceiverBaton *>(baton);
 	b->latest = entry->revision;
-	b->temp.push_back(str::itos(b->latest));
 
+	// Stash the revision properties for SubversionBackend::revision()
+	if (entry->revprops) {
+		SubversionBackend::MetaData meta;
+		svn_string_t *value;
+		if ((value = static_cast<svn_string_t *>(apr_hash_get(entry->revprops, "svn:author", APR_HASH_KEY_STRING)))) {
+			meta.author = value->data;
+		}
+		if ((value = static_cast<svn_string_t *>(apr_hash_get(entry->revprops, "svn:date", APR_HASH_KEY_STRING)))) {
+			apr_time_t when;
+			SVN_ERR(svn_time_from_cstring(&when, value->data, pool));
+			meta.date = apr_time_sec(when);
+		}
+		if ((value = static_cast<svn_string_t *>(apr_hash_get(entry->revprops, "svn:log", APR_HASH_KEY_STRING)))) {
+			meta.message = value->data;
+		}
+
+		// Author and message filters can be applied right here
+		if (!b->filter->matchesAuthor(meta.author) || !b->filter->matchesMessage(meta.message)) {
+			return SVN_NO_ERROR;
+		}
+
+		b->metaMutex->lock();
+		(*b->meta)[b->latest] = meta;
+		b->metaMutex->unlock();
+	}
+
+	b->temp.push_back(str::itos(b->latest));
 	if (b->temp.size() > 64) {
 		b->mutex->lock();
 		for (size_t i = 0; i < b->temp.size(); i++) {
@@ -359,11 +501,466 @@ static svn_error_t *logReceiver(void *baton, svn_log_entry_t *entry, apr_pool_t
 	return SVN_NO_ERROR;
 }
 
-// Main thread function
+// Revision range of the server log that is fetched by a log thread
+struct SvnLogRange
+{
+	uint64_t start, end;
+	std::vector<uint64_t> cached; // Cached revisions following the range
+	std::vector<std::string> ids; // Fetched revisions
+	bool done, failed;
+
+	SvnLogRange(uint64_t start, uint64_t end) : start(start), end(end), done(false), failed(false) { }
+};
+
+// Log ranges and parameters shared by the log threads
+struct SvnLogFetch
+{
+	apr_array_header_t *paths, *props;
+	int windowSize;
+	std::vector<SvnLogRange> ranges;
+	size_t next; // Index of the next range to fetch
+
+	sys::parallel::Mutex *mutex;
+	sys::parallel::WaitCondition *cond;
+	sys::parallel::Mutex *metaMutex;
+	std::map<uint64_t, SubversionBackend::MetaData> *meta;
+	const RevisionFilter *filter;
+};
+
+// Fetches the log of a single range in windows, adapting the window size to
+// the response time of the server
+static bool fetchLogRange(SvnConnection *c, SvnLogFetch *f, SvnLogRange *range, apr_pool_t *pool)
+{
+	logReceiverBaton baton;
+	baton.mutex = f->mutex;
+	baton.cond = f->cond;
+	baton.ids = &range->ids;
+	baton.latest = 0;
+	baton.metaMutex = f->metaMutex;
+	baton.meta = f->meta;
+	baton.filter = f->filter;
+
+	apr_pool_t *iterpool = svn_pool_create(pool);
+	int windowSize = f->windowSize;
+	uint64_t wstart = range->start, lastStart = range->start;
+	bool ok = true;
+	while (ok && wstart <= range->end) {
+		svn_pool_clear(iterpool);
+		PDEBUG << "Fetching log from " << wstart << " to " << range->end << " with window size " << windowSize << endl;
+		sys::datetime::Watch watch;
+		svn_error_t *err = svn_ra_get_log2(c->ra, f->paths, wstart, range->end, windowSize, FALSE, FALSE /* otherwise, copy history will be ignored */, FALSE, f->props, &logReceiver, &baton, iterpool);
+		if (err != NULL) {
+			Logger::err() << "Error: Unable to fetch server log: " << SvnConnection::strerr(err) << endl;
+			svn_error_clear(err);
+			ok = false;
+			break;
+		}
+
+		if (baton.latest + 1 > lastStart) {
+			lastStart = baton.latest + 1;
+		} else {
+			lastStart += std::max(windowSize, 1);
+		}
+		wstart = lastStart;
+
+		if (windowSize > 0) {
+			int msecs = watch.elapsedMSecs();
+			if (msecs < LOG_FAST_MSECS && windowSize < LOG_MAX_WINDOW) {
+				windowSize *= 2;
+			} else if (msecs > LOG_SLOW_MSECS && windowSize > LOG_MIN_WINDOW) {
+				windowSize /= 2;
+			}
+		}
+	}
+	svn_pool_destroy(iterpool);
+
+	f->mutex->lock();
+	range->ids.insert(range->ids.end(), baton.temp.begin(), baton.temp.end());
+	range->done = true;
+	range->failed = !ok;
+	f->cond->wakeAll();
+	f->mutex->unlock();
+	return ok;
+}
+
+// Thread fetching log ranges over its own RA session
+class SvnLogThread : public sys::parallel::Thread
+{
+	public:
+		SvnLogThread(SvnConnection *connection, bool owner, SvnLogFetch *fetch)
+			: d(connection), m_owner(owner), m_fetch(fetch)
+		{
+		}
+
+		~SvnLogThread()
+		{
+			if (m_owner) {
+				delete d;
+			}
+		}
+
+	protected:
+		void run()
+		{
+			apr_pool_t *pool = svn_pool_create(d->pool);
+			do {
+				m_fetch->mutex->lock();
+				SvnLogRange *range = NULL;
+				if (m_fetch->next < m_fetch->ranges.size()) {
+					range = &m_fetch->ranges[m_fetch->next++];
+				}
+				m_fetch->mutex->unlock();
+				if (range == NULL) {
+					break;
+				}
+
+				svn_pool_clear(pool);
+				if (!fetchLogRange(d, m_fetch, range, pool)) {
+					// Don't start any further ranges
+					m_fetch->mutex->lock();
+					m_fetch->next = m_fetch->ranges.size();
+					m_fetch->mutex->unlock();
+				}
+			} while (true);
+			svn_pool_destroy(pool);
+		}
+
+	private:
+		SvnConnection *d;
+		bool m_owner;
+		SvnLogFetch *m_fetch;
+};
+
+// Entry of a directory listing
+struct SvnDirEntry
+{
+	std::string name;
+	char kind;
+	svn_revnum_t created;
+
+	SvnDirEntry() : kind(svn_node_none), created(0) { }
+	SvnDirEntry(const std::string &name, char kind, svn_revnum_t created) : name(name), kind(kind), created(created) { }
+
+	bool operator<(const SvnDirEntry &other) const {
+		return name < other.name;
+	}
+};
+
+// Listings of all directories in a tree, by path
+typedef std::map<std::string, std::vector<SvnDirEntry> > SvnDirListing;
+
+// Directories whose listings have changed between two revisions
+struct SvnTreeChanges
+{
+	std::set<std::string> dirty; // Parents of changed paths
+	std::set<std::string> replaced; // Added, deleted or replaced paths
+
+	// Returns whether the listing of the given directory may have changed
+	bool changed(const std::string &dir) const {
+		if (dirty.find(dir) != dirty.end()) {
+			return true;
+		}
+		std::string path = dir;
+		while (true) {
+			if (replaced.find(path) != replaced.end()) {
+				return true;
+			}
+			size_t pos = path.rfind('/');
+			if (pos == std::string::npos) {
+				break;
+			}
+			path.resize(pos);
+		}
+		return false;
+	}
+};
+
+// Subversion callback for the changed paths of a log entry
+static svn_error_t *treeChangesReceiver(void *baton, svn_log_entry_t *entry, apr_pool_t *pool)
+{
+	SvnTreeChanges *changes = static_cast<SvnTreeChanges *>(baton);
+	if (entry->changed_paths2 == NULL) {
+		return SVN_NO_ERROR;
+	}
+
+	std::vector<HashKey> keys = getHashKeys(entry->changed_paths2, pool);
+	for (size_t i = 0; i < keys.size(); i++) {
+		svn_log_changed_path2_t *change = (svn_log_changed_path2_t *)apr_hash_get(entry->changed_paths2, keys[i].data, keys[i].len);
+		std::string path(keys[i].data, keys[i].len);
+		while (!path.empty() && path[0] == '/') {
+			path.erase(0, 1);
+		}
+		if (change->action != 'M') {
+			changes->replaced.insert(path);
+		}
+
+		// The entries of all parents change, as their last changed
+		// revisions are updated
+		changes->dirty.insert(path);
+		while (!path.empty()) {
+			size_t pos = path.rfind('/');
+			path.resize(pos == std::string::npos ? 0 : pos);
+			if (!changes->dirty.insert(path).second) {
+				break;
+			}
+		}
+	}
+	return SVN_NO_ERROR;
+}
+
+// Pending directories and results shared by the tree listing threads
+struct SvnListFetch
+{
+	svn_revnum_t revision;
+	const SvnDirListing *cached; // Listings of a previous revision, if any
+	const SvnTreeChanges *changes;
+	std::string url;
+
+	sys::parallel::Mutex mutex;
+	sys::parallel::WaitCondition cond;
+	std::deque<std::string> pending;
+	size_t busy; // Directories that are currently being listed
+	size_t fetched; // Directories that have not been in the cache
+	bool failed;
+	std::string error;
+	SvnDirListing result;
+
+	SvnListFetch() : revision(SVN_INVALID_REVNUM), cached(NULL), changes(NULL), busy(0), fetched(0), failed(false) { }
+
+	// Returns whether the given entry of a directory is skipped
+	bool skipped(const std::string &dir, const std::string &name) const {
+		return (str::endsWith(dir, name) || str::endsWith(url, name));
+	}
+};
+
+// Thread listing directories over its own RA session. Subdirectories are
+// added to the queue of pending directories, so the listing of large trees
+// is shared by all threads.
+class SvnListThread : public sys::parallel::Thread
+{
+	public:
+		SvnListThread(SvnConnection *connection, bool owner, SvnListFetch *fetch)
+			: d(connection), m_owner(owner), m_fetch(fetch)
+		{
+		}
+
+		~SvnListThread()
+		{
+			if (m_owner) {
+				delete d;
+			}
+		}
+
+	protected:
+		void run()
+		{
+			apr_pool_t *pool = svn_pool_create(d->pool);
+			SvnListFetch *f = m_fetch;
+			while (true) {
+				f->mutex.lock();
+				while (f->pending.empty() && f->busy > 0 && !f->failed) {
+					f->cond.wait(&f->mutex);
+				}
+				if (f->pending.empty() || f->failed) {
+					f->cond.wakeAll();
+					f->mutex.unlock();
+					break;
+				}
+				std::string dir = f->pending.front();
+				f->pending.pop_front();
+				++f->busy;
+				f->mutex.unlock();
+
+				std::vector<SvnDirEntry> entries;
+				bool cached = false;
+				if (f->cached && !f->changes->changed(dir)) {
+					SvnDirListing::const_iterator it = f->cached->find(dir);
+					if (it != f->cached->end()) {
+						entries = it->second;
+						cached = true;
+					}
+				}
+
+				svn_error_t *err = NULL;
+				if (!cached) {
+					PDEBUG << "Listing directory contents in " << dir << "@" << f->revision << endl;
+					svn_pool_clear(pool);
+					apr_hash_t *dirents;
+					err = svn_ra_get_dir2(d->ra, &dirents, NULL, NULL, dir.c_str(), f->revision, SVN_DIRENT_KIND | SVN_DIRENT_CREATED_REV, pool);
+					if (err == NULL) {
+						std::vector<HashKey> keys = getHashKeys(dirents, pool);
+						for (size_t i = 0; i < keys.size(); i++) {
+							svn_dirent_t *dirent = (svn_dirent_t *)apr_hash_get(dirents, keys[i].data, keys[i].len);
+							if (dirent->kind == svn_node_file || dirent->kind == svn_node_dir) {
+								entries.push_back(SvnDirEntry(std::string(keys[i].data, keys[i].len), dirent->kind, dirent->created_rev));
+							}
+						}
+						std::sort(entries.begin(), entries.end());
+					}
+				}
+
+				f->mutex.lock();
+				--f->busy;
+				if (err != NULL) {
+					f->failed = true;
+					f->error = SvnConnection::strerr(err);
+					f->cond.wakeAll();
+					f->mutex.unlock();
+					break;
+				}
+				std::string prefix = (dir.empty() ? "" : dir + "/");
+				for (size_t i = 0; i < entries.size(); i++) {
+					if (entries[i].kind == svn_node_dir && !f->skipped(dir, entries[i].name)) {
+						f->pending.push_back(prefix + entries[i].name);
+					}
+				}
+				if (!cached) {
+					++f->fetched;
+				}
+				f->result[dir].swap(entries);
+				f->cond.wakeAll();
+				f->mutex.unlock();
+			}
+			svn_pool_destroy(pool);
+		}
+
+	private:
+		SvnConnection *d;
+		bool m_owner;
+		SvnListFetch *m_fetch;
+};
+
+// Reads the cached directory listings of a tree
+static bool readTreeCache(const std::string &cachefile, svn_revnum_t *revision, SvnDirListing *dirs)
+{
+	if (!sys::fs::fileExists(cachefile)) {
+		return false;
+	}
+
+	GZIStream in(cachefile);
+	uint32_t version = 0;
+	uint64_t rev = 0, ndirs = 0;
+	in >> version >> rev >> ndirs;
+	if (!in.ok() || version != 1) {
+		return false;
+	}
+	for (uint64_t i = 0; i < ndirs && in.ok(); i++) {
+		std::string path;
+		uint32_t n = 0;
+		in >> path >> n;
+		std::vector<SvnDirEntry> &entries = (*dirs)[path];
+		entries.resize(n);
+		for (uint32_t j = 0; j < n && in.ok(); j++) {
+			uint64_t created;
+			in >> entries[j].name >> entries[j].kind >> created;
+			entries[j].created = created;
+		}
+	}
+	if (!in.ok()) {
+		Logger::warn() << "Error reading from cache file " << cachefile << endl;
+		dirs->clear();
+		return false;
+	}
+	*revision = rev;
+	return true;
+}
+
+// Writes the directory listings of a tree to the cache
+static void writeTreeCache(const std::string &cachefile, svn_revnum_t revision, const SvnDirListing &dirs)
+{
+	// Defer any signals while writing to the cache
+	SIGBLOCK_DEFER();
+
+	std::string tmpfile = cachefile + ".tmp";
+	bool ok;
+	{
+		GZOStream out(tmpfile);
+		out << (uint32_t)1 << (uint64_t)revision << (uint64_t)dirs.size();
+		for (SvnDirListing::const_iterator it = dirs.begin(); it != dirs.end() && out.ok(); ++it) {
+			out << it->first << (uint32_t)it->second.size();
+			for (size_t j = 0; j < it->second.size(); j++) {
+				out << it->second[j].name << it->second[j].kind << (uint64_t)it->second[j].created;
+			}
+		}
+		ok = out.ok();
+	}
+	if (!ok) {
+		Logger::warn() << "Error writing to cache file: " << cachefile << endl;
+		sys::fs::unlink(tmpfile);
+		return;
+	}
+	sys::fs::rename(tmpfile, cachefile);
+}
+
+// Lists the subdirectories of the given directory, e.g. of the branches or
+// tags directory. The listing is cached together with the last changed
+// revision of the directory, which also changes when anything below it is
+// committed, so a single stat verifies the cached listing. Returns false
+// if there is no such directory.
+static bool listDirs(Backend *backend, SvnConnection *d, const std::string &dir, std::vector<SvnDirEntry> *entries)
+{
+	apr_pool_t *pool = svn_pool_create(d->pool);
+	char *absPrefix = svn_path_join(d->prefix, dir.c_str(), pool);
+
+	svn_dirent_t *dirent;
+	svn_error_t *err = svn_ra_stat(d->ra, absPrefix, SVN_INVALID_REVNUM, &dirent, pool);
+	if (err != NULL) {
+		svn_pool_destroy(pool);
+		throw PEX(SvnConnection::strerr(err));
+	}
+	if (dirent == NULL || dirent->kind != svn_node_dir) {
+		svn_pool_destroy(pool);
+		return false;
+	}
+
+	std::string cachefile;
+	if (backend->options().useCache()) {
+		cachefile = Cache::cacheFile(backend, str::printf("list_%s", absPrefix));
+		SvnDirListing cached;
+		svn_revnum_t cachedRevision = SVN_INVALID_REVNUM;
+		if (readTreeCache(cachefile, &cachedRevision, &cached) && cachedRevision == dirent->created_rev) {
+			PDEBUG << "Using cached listing of " << absPrefix << " at revision " << cachedRevision << endl;
+			entries->swap(cached[absPrefix]);
+			svn_pool_destroy(pool);
+			return true;
+		}
+	}
+
+	apr_hash_t *dirents;
+	err = svn_ra_get_dir2(d->ra, &dirents, NULL, NULL, absPrefix, dirent->created_rev, SVN_DIRENT_KIND | SVN_DIRENT_CREATED_REV, pool);
+	if (err != NULL) {
+		svn_pool_destroy(pool);
+		throw PEX(SvnConnection::strerr(err));
+	}
+
+	entries->clear();
+	for (apr_hash_index_t *hi = apr_hash_first(pool, dirents); hi; hi = apr_hash_next(hi)) {
+		const char *key;
+		svn_dirent_t *entry;
+		apr_hash_this(hi, (const void **)(void *)&key, NULL, (void **)(void *)&entry);
+		if (entry->kind == svn_node_dir) {
+			entries->push_back(SvnDirEntry(std::string(key), entry->kind, entry->created_rev));
+		}
+	}
+
+	// Let's be nice
+	std::sort(entries->begin(), entries->end());
+
+	if (!cachefile.empty()) {
+		SvnDirListing listing;
+		listing[absPrefix] = *entries;
+		writeTreeCache(cachefile, dirent->created_rev, listing);
+	}
+	svn_pool_destroy(pool);
+	return true;
+}
+
+// Main thread function. Large missing intervals are split into ranges that
+// are fetched by several threads, and the fetched revisions are merged in
+// order.
 void SubversionBackend::SvnLogIterator::run()
 {
 	apr_pool_t *pool = svn_pool_create(d->pool);
-	apr_pool_t *iterpool = svn_pool_create(pool);
 	apr_array_header_t *path = apr_array_make(pool, 1, sizeof (const char *));
 	std::string sessionPrefix = d->prefix;
 	if (m_prefix.empty()) {
@@ -373,11 +970,40 @@ void SubversionBackend::SvnLogIterator::run()
 	} else {
 		APR_ARRAY_PUSH(path, const char *) = svn_path_canonicalize((sessionPrefix+"/"+m_prefix).c_str(), pool);
 	}
-	apr_array_header_t *props = apr_array_make(pool, 1, sizeof (const char *)); // Intentionally empty
 
-	int windowSize = 1024;
-	if (!strncmp(d->url, "file://", strlen("file://"))) {
+	// Paths of the filter are relative to the repository root, like the
+	// paths in diffstats. They are only used if all of them are inside the
+	// branch.
+	const char *base = APR_ARRAY_IDX(path, 0, const char *);
+	if (!m_filter.paths().empty()) {
+		apr_array_header_t *paths = apr_array_make(pool, m_filter.paths().size(), sizeof (const char *));
+		for (size_t i = 0; i < m_filter.paths().size() && paths; i++) {
+			const char *p = svn_path_canonicalize(m_filter.paths()[i].c_str(), pool);
+			if (svn_path_is_ancestor(base, p)) {
+				APR_ARRAY_PUSH(paths, const char *) = p;
+			} else {
+				paths = NULL;
+			}
+		}
+		if (paths) {
+			path = paths;
+		}
+	}
+
+	apr_array_header_t *props = apr_array_make(pool, 3, sizeof (const char *));
+	APR_ARRAY_PUSH(props, const char *) = "svn:author";
+	APR_ARRAY_PUSH(props, const char *) = "svn:date";
+	APR_ARRAY_PUSH(props, const char *) = "svn:log";
+
+	// Local repositories are read in one piece
+	int windowSize = 1024, sessions = 4;
+	bool local = !strncmp(d->url, "file://", strlen("file://"));
+	if (local) {
 		windowSize = 0;
+		sessions = 1;
+	} else if (!str::stoi(m_backend->options().value("log-sessions", "4"), &sessions) || sessions < 1) {
+		Logger::warn() << "Warning: Expected positive number for --log-sessions parameter, using a single session" << endl;
+		sessions = 1;
 	}
 
 	PDEBUG << "Path is " << APR_ARRAY_IDX(path, 0, const char *)
@@ -389,8 +1015,10 @@ void SubversionBackend::SvnLogIterator::run()
 	std::vector<Interval> fetch;
 	fetch.push_back(Interval(m_startrev, m_endrev));
 
-	std::string cachefile = str::printf("log_%s", APR_ARRAY_IDX(path, 0, const char *));
-	if (m_backend->options().useCache()) {
+	// Filtered logs are not cached
+	std::string cachefile = str::printf("log_%s", base);
+	bool useCache = (m_backend->options().useCache() && m_filter.empty());
+	if (useCache) {
 		readIntervalsFromCache(cachefile);
 
 		// Check if a cached interval intersects with the interval that should be fetched. It's
@@ -402,60 +1030,102 @@ void SubversionBackend::SvnLogIterator::run()
 		}
 	}
 
-	logReceiverBaton baton;
-	baton.mutex = &m_mutex;
-	baton.cond = &m_cond;
-	baton.ids = &m_ids;
-	baton.latest = 0;
+	// Split the intervals into disjoint ranges. Cached revisions follow the
+	// last range of their interval.
+	SvnLogFetch f;
+	f.paths = path;
+	f.props = props;
+	f.windowSize = windowSize;
+	f.next = 0;
+	f.mutex = &m_mutex;
+	f.cond = &m_cond;
+	f.metaMutex = &m_backend->m_metaMutex;
+	f.meta = &m_backend->m_meta;
+	f.filter = &m_filter;
+	std::vector<size_t> owners; // Indexes of the intervals of the ranges
+	for (size_t i = 0; i < fetch.size(); i++) {
+		uint64_t start = fetch[i].start, end = fetch[i].end;
+		uint64_t size = (end >= start ? end - start + 1 : 0);
+		uint64_t step = std::max((uint64_t)LOG_MIN_RANGE, (size + sessions - 1) / sessions);
+		while (size > 0 && end - start + 1 > step) {
+			f.ranges.push_back(SvnLogRange(start, start + step - 1));
+			owners.push_back(i);
+			start += step;
+		}
+		f.ranges.push_back(SvnLogRange(start, end));
+		f.ranges.back().cached = fetch[i].revisions;
+		owners.push_back(i);
+	}
 
-	// Fetch all revision intervals that are required
+	// Revisions fetched from the server, which will be added to the cache
+	std::vector<Interval> fetched;
 	for (size_t i = 0; i < fetch.size(); i++) {
-		svn_pool_clear(iterpool);
+		fetched.push_back(Interval(fetch[i].start, fetch[i].end));
+	}
+
+	// The iterator's own connection is used by the first thread
+	std::vector<SvnLogThread *> threads;
+	size_t nthreads = std::min((size_t)sessions, f.ranges.size());
+	threads.push_back(new SvnLogThread(d, false, &f));
+	for (size_t i = 1; i < nthreads; i++) {
+		SvnConnection *c = new SvnConnection();
+		try {
+			c->open(m_backend->d);
+		} catch (const PepperException &ex) {
+			PDEBUG << "Unable to open extra log session: " << ex.what() << endl;
+			delete c;
+			break;
+		}
+		threads.push_back(new SvnLogThread(c, true, &f));
+	}
+	PDEBUG << "Fetching " << f.ranges.size() << " log ranges with " << threads.size() << " sessions" << endl;
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->start();
+	}
 
-		uint64_t wstart = fetch[i].start, lastStart = fetch[i].start;
-		while (wstart <= fetch[i].end) {
-			PDEBUG << "Fetching log from " << wstart << " to " << fetch[i].end << " with window size " << windowSize << endl;
-			svn_error_t *err = svn_ra_get_log2(d->ra, path, wstart, fetch[i].end, windowSize, FALSE, FALSE /* otherwise, copy history will be ignored */, FALSE, props, &logReceiver, &baton, iterpool);
-			if (err != NULL) {
-				Logger::err() << "Error: Unable to fetch server log: " << SvnConnection::strerr(err) << endl;
-				m_mutex.lock();
-				m_failed = true;
-				m_finished = true;
+	// Merge the ranges in order while they are being fetched
+	m_mutex.lock();
+	for (size_t i = 0; i < f.ranges.size() && !m_failed; i++) {
+		SvnLogRange &range = f.ranges[i];
+		size_t merged = 0;
+		do {
+			if (merged < range.ids.size()) {
+				m_ids.insert(m_ids.end(), range.ids.begin() + merged, range.ids.end());
+				merged = range.ids.size();
 				m_cond.wakeAll();
-				m_mutex.unlock();
-				svn_pool_destroy(pool);
-				return;
 			}
-
-			if (baton.latest + 1 > lastStart) {
-				lastStart = baton.latest + 1;
-			} else {
-				lastStart += std::max(windowSize, 1);
+			if (!range.done) {
+				m_cond.wait(&m_mutex);
 			}
-			wstart = lastStart;
-		}
+		} while (!range.done || merged < range.ids.size());
 
-		m_mutex.lock();
-		Logger &l = PTRACE << "Appending " << baton.temp.size() << " fetched revisions: ";
-		for (size_t j = 0; j < baton.temp.size(); j++) {
-			l << baton.temp[j] << " ";
-			m_ids.push_back(baton.temp[j]);
+		if (range.failed) {
+			m_failed = true;
+			break;
 		}
-		l << endl;
-		baton.temp.clear();
-
-		// Append cached revisions
-		if (!fetch[i].revisions.empty()) {
-			l << "Appending " << fetch[i].revisions.size() << " cached revisions: ";
-			for (size_t j = 0; j < fetch[i].revisions.size(); j++) {
-				l << fetch[i].revisions[j] << " ";
-				m_ids.push_back(str::itos(fetch[i].revisions[j]));
+		if (useCache) {
+			std::vector<uint64_t> &revisions = fetched[owners[i]].revisions;
+			for (size_t j = 0; j < range.ids.size(); j++) {
+				uint64_t rev;
+				str::stoi(range.ids[j], &rev);
+				revisions.push_back(rev);
 			}
-			l << endl;
 		}
-
+		if (!range.cached.empty()) {
+			size_t first = m_ids.size();
+			for (size_t j = 0; j < range.cached.size(); j++) {
+				m_ids.push_back(str::itos(range.cached[j]));
+			}
+			PTRACE << "Appending " << range.cached.size() << " cached revisions: " << str::join(m_ids.begin() + first, m_ids.end(), " ") << endl;
+		}
+		std::vector<std::string>().swap(range.ids);
 		m_cond.wakeAll();
-		m_mutex.unlock();
+	}
+	m_mutex.unlock();
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->wait();
+		delete threads[i];
 	}
 
 	m_mutex.lock();
@@ -463,34 +1133,106 @@ void SubversionBackend::SvnLogIterator::run()
 	m_cond.wakeAll();
 	m_mutex.unlock();
 
-	if (m_backend->options().useCache()) {
-		// Add current interval
-		Interval current(m_startrev, m_endrev);
-		for (size_t i = 0; i < m_ids.size(); i++) {
-			uint64_t rev;
-			str::stoi(m_ids[i], &rev);
-			current.revisions.push_back(rev);
+	if (useCache && !m_failed) {
+		// Add the fetched intervals. Pseudo intervals of cached revisions
+		// end before they start.
+		std::vector<Interval> added;
+		for (size_t i = 0; i < fetched.size(); i++) {
+			if (fetched[i].start <= fetched[i].end) {
+				std::sort(fetched[i].revisions.begin(), fetched[i].revisions.end());
+				mergeInterval(fetched[i]);
+				added.push_back(fetched[i]);
+			}
+		}
+		if (!added.empty()) {
+			writeIntervalsToCache(cachefile, added);
 		}
-
-		mergeInterval(current);
-		writeIntervalsToCache(cachefile);
 	}
 
 	svn_pool_destroy(pool);
 }
 
-// Reads previous log intervals from the cache
+// Reads previous log intervals from the cache. The cache file is a log of
+// intervals, each of them stored as a length-prefixed record holding the
+// revision numbers as delta-encoded varints. Intervals are merged while
+// reading, since later records may extend previous ones.
 void SubversionBackend::SvnLogIterator::readIntervalsFromCache(const std::string &file)
 {
 	sys::parallel::MutexLocker locker(&s_cacheMutex);
 	std::string cachefile = Cache::cacheFile(m_backend, file);
 
 	m_cachedIntervals.clear();
+	m_cacheRecords = 0;
+	m_compactCache = false;
 
 	if (!sys::fs::fileExists(cachefile)) {
 		return;
 	}
 
+	sys::fs::MappedFile map(cachefile);
+	if (map.size() >= 2 && (unsigned char)map.data()[0] == 0x1F && (unsigned char)map.data()[1] == 0x8B) {
+		// Compressed files have been written by previous versions
+		readLegacyIntervals(cachefile);
+		m_compactCache = true;
+		return;
+	}
+
+	MIStream in(map.data(), map.size(), false);
+	std::string magic;
+	uint32_t version = 0;
+	in >> magic >> version;
+	if (!in.ok() || magic != LOGCACHE_MAGIC || version != LOGCACHE_VERSION) {
+		Logger::warn() << "Ignoring invalid cache file " << cachefile << endl;
+		m_compactCache = true;
+		return;
+	}
+
+	while (in.tell() < map.size()) {
+		// A partial record at the end has been left by an interrupted run
+		uint32_t length = 0;
+		bool truncated = (map.size() - in.tell() < 4);
+		if (!truncated) {
+			in >> length;
+		}
+		size_t offset = in.tell();
+		if (truncated || offset + length > map.size()) {
+			PDEBUG << "Ignoring truncated interval in cache file " << cachefile << endl;
+			m_compactCache = true;
+			break;
+		}
+
+		MIStream record(map.data() + offset, length, false);
+		Interval interval;
+		uint64_t size = 0, num = 0;
+		record.readVarint(interval.start).readVarint(size).readVarint(num);
+		interval.end = interval.start + size;
+		uint64_t rev = interval.start;
+		for (uint64_t i = 0; i < num && record.tell() < length; i++) {
+			uint64_t delta;
+			record.readVarint(delta);
+			rev += delta;
+			interval.revisions.push_back(rev);
+		}
+		in.seek(offset + length);
+		++m_cacheRecords;
+
+		if (interval.revisions.size() != num || record.tell() != length || interval.end < interval.start) {
+			PTRACE << "Skipping bogus interval: [" << interval.start << ":" << interval.end
+				<< "] with " << interval.revisions.size() << " revisions" << endl;
+			m_compactCache = true;
+			continue;
+		}
+
+		PTRACE << "New revision range: [" << interval.start << ":" << interval.end
+			<< "] with " << interval.revisions.size() << " revisions" << endl;
+		mergeInterval(interval);
+	}
+	PDEBUG << "Read " << m_cacheRecords << " log intervals from cache file " << cachefile << endl;
+}
+
+// Reads log intervals from a cache file written by previous versions
+void SubversionBackend::SvnLogIterator::readLegacyIntervals(const std::string &cachefile)
+{
 	GZIStream in(cachefile);
 	uint32_t version;
 	in >> version;
@@ -525,29 +1267,62 @@ void SubversionBackend::SvnLogIterator::readIntervalsFromCache(const std::string
 	}
 }
 
-// Writes the current intervals to the cache
-void SubversionBackend::SvnLogIterator::writeIntervalsToCache(const std::string &file)
+// Adds the given intervals to the cache. They are appended to the cache
+// file, which is rewritten with the merged intervals after a number of
+// runs, or if it couldn't be read completely.
+void SubversionBackend::SvnLogIterator::writeIntervalsToCache(const std::string &file, const std::vector<Interval> &added)
 {
 	sys::parallel::MutexLocker locker(&s_cacheMutex);
 	std::string cachefile = Cache::cacheFile(m_backend, file);
 
-	PDEBUG << "Writing log intervals to cache file " << cachefile << endl;
-	GZOStream *out = new GZOStream(cachefile);
-	*out << (uint32_t)1; // Version number
-	for (size_t i = 0; i < m_cachedIntervals.size() && out->ok(); i++) {
-		const std::vector<uint64_t> &revisions = m_cachedIntervals[i].revisions;
-		*out << m_cachedIntervals[i].start << m_cachedIntervals[i].end << (uint64_t)revisions.size();
-		for (size_t j = 0; j < revisions.size() && out->ok(); j++) {
-			*out << revisions[j];
+	// Defer any signals while writing to the cache
+	SIGBLOCK_DEFER();
+
+	if (!m_compactCache && m_cacheRecords + added.size() <= LOGCACHE_MAX_RECORDS && sys::fs::fileExists(cachefile)) {
+		PDEBUG << "Appending " << added.size() << " log intervals to cache file " << cachefile << endl;
+		BOStream out(cachefile, true);
+		for (size_t i = 0; i < added.size() && out.ok(); i++) {
+			writeInterval(out, added[i]);
 		}
+		if (!out.ok()) {
+			Logger::warn() << "Error writing to cache file: " << cachefile << endl;
+		}
+		m_cacheRecords += added.size();
+		return;
 	}
-	if (!out->ok()) {
+
+	PDEBUG << "Writing " << m_cachedIntervals.size() << " log intervals to cache file " << cachefile << endl;
+	std::string tmpfile = cachefile + ".tmp";
+	bool ok;
+	{
+		BOStream out(tmpfile);
+		out << std::string(LOGCACHE_MAGIC) << (uint32_t)LOGCACHE_VERSION;
+		for (size_t i = 0; i < m_cachedIntervals.size() && out.ok(); i++) {
+			writeInterval(out, m_cachedIntervals[i]);
+		}
+		ok = out.ok();
+	}
+	if (!ok) {
 		Logger::warn() << "Error writing to cache file: " << cachefile << endl;
-		delete out;
-		out = NULL;
-		sys::fs::unlink(cachefile);
+		sys::fs::unlink(tmpfile);
+		return;
 	}
-	delete out;
+	sys::fs::rename(tmpfile, cachefile);
+	m_cacheRecords = m_cachedIntervals.size();
+	m_compactCache = false;
+}
+
+// Writes a single interval record
+void SubversionBackend::SvnLogIterator::writeInterval(BOStream &out, const Interval &interval)
+{
+	MOStream record;
+	record.writeVarint(interval.start).writeVarint(interval.end - interval.start).writeVarint(interval.revisions.size());
+	uint64_t prev = interval.start;
+	for (size_t i = 0; i < interval.revisions.size(); i++) {
+		record.writeVarint(interval.revisions[i] - prev);
+		prev = interval.revisions[i];
+	}
+	out << record.buffer();
 }
 
 // Merges the given interval into the intervals that have been already known
@@ -556,9 +1331,8 @@ void SubversionBackend::SvnLogIterator::mergeInterval(const Interval &interval)
 	PDEBUG << "Merging new interval [" << interval.start << ":" << interval.end << "]" << endl;
 	for (size_t i = 0; i < m_cachedIntervals.size(); i++) {
 		const Interval &candidate = m_cachedIntervals[i];
-		if ((interval.start <= candidate.start && interval.end >= candidate.start) ||
-			(interval.start <= candidate.end && interval.end >= candidate.end)) {
-			// Intervals intersect, let's merge them.
+		if (interval.start <= candidate.end + 1 && candidate.start <= interval.end + 1) {
+			// Intervals intersect or are adjacent, let's merge them.
 			// NOTE: It's assumed that the repository is immutable, i.e. no
 			// revisions will ever be deleted.
 			PDEBUG << "Intervals [" << interval.start << ":" << interval.end << "] and ["
@@ -567,15 +1341,14 @@ void SubversionBackend::SvnLogIterator::mergeInterval(const Interval &interval)
 			Interval merged(std::min(interval.start, candidate.start), std::max(interval.end, candidate.end));
 			merged.revisions.insert(merged.revisions.begin(), interval.revisions.begin(), interval.revisions.end());
 			merged.revisions.insert(merged.revisions.end(), candidate.revisions.begin(), candidate.revisions.end());
-			std::sort(merged.revisions.begin(), merged.revisions.end());
+			if (std::is_sorted(interval.revisions.begin(), interval.revisions.end()) && std::is_sorted(candidate.revisions.begin(), candidate.revisions.end())) {
+				std::inplace_merge(merged.revisions.begin(), merged.revisions.begin() + interval.revisions.size(), merged.revisions.end());
+			} else {
+				std::sort(merged.revisions.begin(), merged.revisions.end());
+			}
 
 			// Remove duplicates
-			for (size_t j = 0; j < merged.revisions.size()-1; j++) {
-				if (merged.revisions[j] == merged.revisions[j+1]) {
-					merged.revisions.erase(merged.revisions.begin()+j);
-					--j;
-				}
-			}
+			merged.revisions.erase(std::unique(merged.revisions.begin(), merged.revisions.end()), merged.revisions.end());
 
 			// Merge the merged interval
 			m_cachedIntervals.erase(m_cachedIntervals.begin()+i);
@@ -697,6 +1470,8 @@ void SubversionBackend::init()
 		svn_pool_destroy(pool);
 	}
 	d->open(url, m_opts.options());
+	d->excludes = m_excludes;
+	d->approximate = m_opts.approximateDiffstats();
 }
 
 // Called after Report::run()
@@ -783,87 +1558,30 @@ std::string SubversionBackend::mainBranch()
 // Returns a list of available branches
 std::vector<std::string> SubversionBackend::branches()
 {
-	std::string prefix = m_opts.value("branches", "branches");
 	std::vector<std::string> branches;
-
-	apr_pool_t *pool = svn_pool_create(d->pool);
-	char *absPrefix = svn_path_join(d->prefix, prefix.c_str(), pool);
-
-	// Check if branches directoy is present
-	svn_dirent_t *dirent;
-	svn_error_t *err = svn_ra_stat(d->ra, absPrefix, SVN_INVALID_REVNUM, &dirent, pool);
-	if (err != NULL) {
-		throw PEX(SvnConnection::strerr(err));
-	}
-
-	if (dirent == NULL || dirent->kind != svn_node_dir) {
-		// It's not here; let's call the main branch "trunk"
-		branches.push_back("trunk");
-		return branches;
-	}
-
-	// Get directory entries
-	apr_hash_t *dirents;
-	err = svn_ra_get_dir2(d->ra, &dirents, NULL, NULL, absPrefix, dirent->created_rev, SVN_DIRENT_KIND, pool);
-	if (err != NULL) {
-		throw PEX(SvnConnection::strerr(err));
-	}
-
 	branches.push_back("trunk");
-	for (apr_hash_index_t *hi = apr_hash_first(pool, dirents); hi; hi = apr_hash_next(hi)) {
-		const char *entry;
-		svn_dirent_t *dirent;
-		apr_hash_this(hi, (const void **)(void *)&entry, NULL, (void **)(void *)&dirent);
-		if (dirent->kind == svn_node_dir) {
-			branches.push_back(std::string(entry));
+
+	// If there's no branches directory, let's call the main branch "trunk"
+	std::vector<SvnDirEntry> entries;
+	if (listDirs(this, d, m_opts.value("branches", "branches"), &entries)) {
+		for (size_t i = 0; i < entries.size(); i++) {
+			branches.push_back(entries[i].name);
 		}
 	}
-
-	// Let's be nice
-	std::sort(branches.begin()+1, branches.end());
-	svn_pool_destroy(pool);
 	return branches;
 }
 
 // Returns a list of available tags
 std::vector<Tag> SubversionBackend::tags()
 {
-	std::string prefix = m_opts.value("tags", "tags");
 	std::vector<Tag> tags;
-
-	apr_pool_t *pool = svn_pool_create(d->pool);
-	char *absPrefix = svn_path_join(d->prefix, prefix.c_str(), pool);
-
-	// Check if tags directoy is present
-	svn_dirent_t *dirent;
-	svn_error_t *err = svn_ra_stat(d->ra, absPrefix, SVN_INVALID_REVNUM, &dirent, pool);
-	if (err != NULL) {
-		throw PEX(SvnConnection::strerr(err));
-	}
-
-	if (dirent == NULL || dirent->kind != svn_node_dir) {
-		// No tags here
-		return tags;
-	}
-
-	// Get directory entries
-	apr_hash_t *dirents;
-	err = svn_ra_get_dir2(d->ra, &dirents, NULL, NULL, absPrefix, dirent->created_rev, SVN_DIRENT_KIND | SVN_DIRENT_CREATED_REV, pool);
-	if (err != NULL) {
-		throw PEX(SvnConnection::strerr(err));
-	}
-
-	for (apr_hash_index_t *hi = apr_hash_first(pool, dirents); hi; hi = apr_hash_next(hi)) {
-		const char *key;
-		svn_dirent_t *dirent;
-		apr_hash_this(hi, (const void **)&key, NULL, (void **)&dirent);
-		if (dirent->kind == svn_node_dir) {
-			tags.push_back(Tag(str::itos(dirent->created_rev), key));
+	std::vector<SvnDirEntry> entries;
+	if (listDirs(this, d, m_opts.value("tags", "tags"), &entries)) {
+		for (size_t i = 0; i < entries.size(); i++) {
+			tags.push_back(Tag(str::itos(entries[i].created), entries[i].name));
 		}
 	}
 	std::sort(tags.begin(), tags.end());
-
-	svn_pool_destroy(pool);
 	return tags;
 }
 
@@ -902,16 +1620,36 @@ DiffstatPtr SubversionBackend::diffstat(const std::string &id)
 }
 
 // Filters a diffstat by prefix
-void SubversionBackend::filterDiffstat(DiffstatPtr stat)
+DiffstatPtr SubversionBackend::filterDiffstat(DiffstatPtr stat)
 {
 	// Strip prefix
 	if (d->prefix && strlen(d->prefix)) {
-		stat->filter(d->prefix);
+		stat = Diffstat::filter(stat, d->prefix);
 	}
+	return Backend::filterDiffstat(stat);
 }
 
 // Returns a file listing for the given revision (defaults to HEAD)
 std::vector<std::string> SubversionBackend::tree(const std::string &id)
+{
+	return list(id, NULL);
+}
+
+// Lists the files in the tree of the given revision. A file's content is
+// identified by its path and the revision it has last been changed in.
+std::vector<std::string> SubversionBackend::treeKeys(const std::string &id, std::vector<std::string> *paths)
+{
+	std::vector<std::string> keys;
+	*paths = list(id, &keys);
+	return keys;
+}
+
+// Lists the files in the tree of the given revision, optionally
+// determining their content-based keys. Directories are listed by several
+// sessions in parallel. The listings are cached, so listing a nearby
+// revision only requires listing the directories that have changed
+// according to the log.
+std::vector<std::string> SubversionBackend::list(const std::string &id, std::vector<std::string> *fileKeys)
 {
 	svn_revnum_t revision;
 	if (id.empty()) {
@@ -921,52 +1659,181 @@ std::vector<std::string> SubversionBackend::tree(const std::string &id)
 	}
 
 	apr_pool_t *pool = svn_pool_create(d->pool);
-	apr_pool_t *iterpool = svn_pool_create(pool);
+	svn_error_t *err;
+	if (revision == SVN_INVALID_REVNUM && (err = svn_ra_get_latest_revnum(d->ra, &revision, pool)) != NULL) {
+		svn_pool_destroy(pool);
+		throw PEX(SvnConnection::strerr(err));
+	}
 
-	std::vector<std::string> contents;
+	// Determine the directories that changed since the cached listing
+	SvnDirListing cached;
+	SvnTreeChanges changes;
+	svn_revnum_t cachedRevision = SVN_INVALID_REVNUM;
+	std::string cachefile;
+	if (m_opts.useCache() && strchr(d->prefix, '%') == NULL) {
+		// Changed paths are compared to the prefix, which must not be URI-encoded
+		cachefile = Cache::cacheFile(this, str::printf("dirs_%s", d->prefix));
+		if (readTreeCache(cachefile, &cachedRevision, &cached) && cachedRevision != revision) {
+			svn_revnum_t start = std::min(revision, cachedRevision) + 1, end = std::max(revision, cachedRevision);
+			apr_array_header_t *paths = apr_array_make(pool, 1, sizeof (const char *));
+			APR_ARRAY_PUSH(paths, const char *) = d->prefix;
+			apr_array_header_t *props = apr_array_make(pool, 0, sizeof (const char *));
+			if (end - start >= TREE_MAX_LOG) {
+				cached.clear();
+			} else if ((err = svn_ra_get_log2(d->ra, paths, end, start, 0, TRUE, TRUE, FALSE, props, &treeChangesReceiver, &changes, pool)) != NULL) {
+				PDEBUG << "Unable to fetch the changed paths since revision " << cachedRevision << ": " << SvnConnection::strerr(err) << endl;
+				svn_error_clear(err);
+				cached.clear();
+			}
+		}
+	}
 
-	// Pseudo-recursively list directory entries
-	std::stack<std::pair<std::string, int> > stack;
-	stack.push(std::pair<std::string, int>(d->prefix, svn_node_dir));
-	while (!stack.empty()) {
-		svn_pool_clear(iterpool);
+	int sessions = 4;
+	if (!strncmp(d->url, "file://", strlen("file://"))) {
+		sessions = 1;
+	} else if (!str::stoi(m_opts.value("tree-sessions", "4"), &sessions) || sessions < 1) {
+		Logger::warn() << "Warning: Expected positive number for --tree-sessions parameter, using a single session" << endl;
+		sessions = 1;
+	}
+
+	SvnListFetch f;
+	f.revision = revision;
+	f.cached = (cached.empty() ? NULL : &cached);
+	f.changes = &changes;
+	f.url = d->url;
+	f.pending.push_back(d->prefix);
+
+	// The backend's own connection is used by the first thread
+	std::vector<SvnListThread *> threads;
+	threads.push_back(new SvnListThread(d, false, &f));
+	for (int i = 1; i < sessions; i++) {
+		SvnConnection *c = new SvnConnection();
+		try {
+			c->open(d);
+		} catch (const PepperException &ex) {
+			PDEBUG << "Unable to open extra list session: " << ex.what() << endl;
+			delete c;
+			break;
+		}
+		threads.push_back(new SvnListThread(c, true, &f));
+	}
+	sys::datetime::Watch watch;
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->start();
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+	svn_pool_destroy(pool);
+	if (f.failed) {
+		throw PEX(f.error);
+	}
+	PDEBUG << "Listed " << f.result.size() << " directories (" << f.fetched << " uncached) with "
+		<< threads.size() << " sessions in " << watch.elapsedMSecs() << " ms" << endl;
+
+	if (!cachefile.empty() && (f.fetched > 0 || cachedRevision != revision)) {
+		writeTreeCache(cachefile, revision, f.result);
+	}
 
+	// Pseudo-recursively collect the files. Entries are pushed in reverse
+	// order, so they are visited in order.
+	std::vector<std::string> contents;
+	std::stack<std::pair<std::string, const SvnDirEntry *> > stack;
+	stack.push(std::pair<std::string, const SvnDirEntry *>(d->prefix, NULL));
+	while (!stack.empty()) {
 		std::string node = stack.top().first;
-		if (stack.top().second != svn_node_dir) {
+		const SvnDirEntry *entry = stack.top().second;
+		stack.pop();
+		if (entry != NULL && entry->kind != svn_node_dir) {
 			contents.push_back(node);
-			stack.pop();
+			if (fileKeys) {
+				fileKeys->push_back(str::printf("svn:%ld:", (long)entry->created) + node);
+			}
 			continue;
 		}
-		stack.pop();
-
-		PDEBUG << "Listing directory contents in " << node << "@" << revision << endl;
 
-		apr_hash_t *dirents;
-		svn_error_t *err = svn_ra_get_dir2(d->ra, &dirents, NULL, NULL, node.c_str(), revision, SVN_DIRENT_KIND, iterpool);
-		if (err != NULL) {
-			throw PEX(SvnConnection::strerr(err));
+		SvnDirListing::const_iterator it = f.result.find(node);
+		if (it == f.result.end()) {
+			continue;
 		}
-
 		std::string prefix = (node.empty() ? "" : node + "/");
-		std::stack<std::pair<std::string, int> > next;
-
-		std::vector<HashKey> keys = getHashKeys(dirents, iterpool);
-		std::sort(keys.begin(), keys.end());
-		for (size_t i = 0; i < keys.size(); i++) {
-			svn_dirent_t *dirent = (svn_dirent_t *)apr_hash_get(dirents, keys[i].data, keys[i].len);
-			if (str::endsWith(node, keys[i].data) || str::endsWith(d->url, keys[i].data)) {
-				continue;
+		const std::vector<SvnDirEntry> &entries = it->second;
+		for (size_t i = entries.size(); i > 0; i--) {
+			if (!f.skipped(node, entries[i-1].name)) {
+				stack.push(std::pair<std::string, const SvnDirEntry *>(prefix + entries[i-1].name, &entries[i-1]));
 			}
-			if (dirent->kind == svn_node_file || dirent->kind == svn_node_dir) {
-				next.push(std::pair<std::string, int>(prefix + keys[i].data, dirent->kind));
-			}
-		}
-		while (!next.empty()) {
-			stack.push(next.top());
-			next.pop();
 		}
 	}
+	return contents;
+}
+
+// Returns a key for the tree of the given revision, given by the revision
+// in which the repository prefix has last been changed
+std::string SubversionBackend::treeKey(const std::string &id)
+{
+	svn_revnum_t revision;
+	if (id.empty()) {
+		revision = SVN_INVALID_REVNUM;
+	} else if (!str::stoi(id, &revision)) {
+		return std::string();
+	}
+
+	apr_pool_t *pool = svn_pool_create(d->pool);
+	svn_dirent_t *dirent = NULL;
+	svn_error_t *err = svn_ra_stat(d->ra, d->prefix, revision, &dirent, pool);
+	std::string key;
+	if (err != NULL) {
+		svn_error_clear(err);
+	} else if (dirent != NULL) {
+		key = str::printf("svn:%ld:", (long)dirent->created_rev) + d->prefix;
+	}
+	svn_pool_destroy(pool);
+	return key;
+}
+
+// Returns the contents of the given files at the given revision. Local
+// repositories are read through the filesystem layer.
+std::vector<std::string> SubversionBackend::catMany(const std::vector<std::string> &paths, const std::string &id)
+{
+	if (d->fs == NULL) {
+		return Backend::catMany(paths, id);
+	}
+
+	svn_revnum_t revision;
+	if (!id.empty() && !str::stoi(id, &revision)) {
+		throw PEX(std::string("Error parsing revision number ") + id);
+	}
 
+	apr_pool_t *pool = svn_pool_create(d->pool);
+	apr_pool_t *iterpool = svn_pool_create(pool);
+	svn_error_t *err;
+	svn_fs_root_t *root;
+	if ((id.empty() && (err = svn_fs_youngest_rev(&revision, d->fs, pool)) != NULL)
+			|| (err = svn_fs_revision_root(&root, d->fs, revision, pool)) != NULL) {
+		svn_pool_destroy(pool);
+		throw PEX(SvnConnection::strerr(err));
+	}
+
+	std::vector<std::string> contents(paths.size());
+	char buffer[16384];
+	for (size_t i = 0; i < paths.size(); i++) {
+		svn_pool_clear(iterpool);
+		svn_stream_t *stream;
+		if ((err = svn_fs_file_contents(&stream, root, ("/" + paths[i]).c_str(), iterpool)) != NULL) {
+			svn_pool_destroy(pool);
+			throw PEX(SvnConnection::strerr(err));
+		}
+		apr_size_t len;
+		do {
+			len = sizeof(buffer);
+			if ((err = svn_stream_read(stream, buffer, &len)) != NULL) {
+				svn_pool_destroy(pool);
+				throw PEX(SvnConnection::strerr(err));
+			}
+			contents[i].append(buffer, len);
+		} while (len == sizeof(buffer));
+	}
 	svn_pool_destroy(pool);
 	return contents;
 }
@@ -1015,7 +1882,7 @@ std::string SubversionBackend::cat(const std::string &path, const std::string &i
 }
 
 // Returns a log iterator for the given branch
-Backend::LogIterator *SubversionBackend::iterator(const std::string &branch, int64_t start, int64_t end)
+Backend::LogIterator *SubversionBackend::iterator(const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter)
 {
 	// Check if the branch exists
 	apr_pool_t *pool = svn_pool_create(d->pool);
@@ -1056,7 +1923,7 @@ Backend::LogIterator *SubversionBackend::iterator(const std::string &branch, int
 	PDEBUG << "Revision range: [ " << start << " : " << end << "] -> [" << startrev << " : " << endrev << "]" << endl;
 
 	svn_pool_destroy(pool);
-	return new SvnLogIterator(this, prefix, startrev, endrev);
+	return new SvnLogIterator(this, prefix, startrev, endrev, filter);
 }
 
 // Adds the given revision IDs to the diffstat scheduler
@@ -1072,9 +1939,13 @@ void SubversionBackend::prefetch(const std::vector<std::string> &ids)
 			return;
 		}
 
-		// Don't use that many threads for local repositories
-		if (!strncmp(d->url, "file://", strlen("file://"))) {
-			nthreads = std::max(1, sys::parallel::idealThreadCount() / 2);
+		// Don't use that many threads for local repositories. If they are
+		// accessed through the filesystem layer, all diffstats are computed
+		// in-process and can make use of all processors.
+		if (d->fs != NULL) {
+			nthreads = sys::parallel::ThreadPool::globalSize();
+		} else if (!strncmp(d->url, "file://", strlen("file://"))) {
+			nthreads = std::max(1, sys::parallel::ThreadPool::globalSize() / 2);
 		}
 		m_prefetcher = new SvnDiffstatPrefetcher(d, nthreads);
 	}
@@ -1089,6 +1960,7 @@ void SubversionBackend::finalize()
 		m_prefetcher->wait();
 		delete m_prefetcher;
 		m_prefetcher = NULL;
+		d->cancel(false);
 	}
 }
 
@@ -1103,6 +1975,8 @@ void SubversionBackend::printHelp() const
 	Options::print("--branches=ARG", "Branches are in subdirectory ARG");
 	Options::print("--tags=ARG", "Tags are in subdirectory ARG");
 	Options::print("--threads=ARG", "Use ARG threads for requesting diffstats");
+	Options::print("--log-sessions=ARG", "Use ARG sessions for fetching the log");
+	Options::print("--tree-sessions=ARG", "Use ARG sessions for listing trees");
 }
 
 // Returns the prefix for the given branch
@@ -1123,15 +1997,45 @@ std::string SubversionBackend::prefix(const std::string &branch, apr_pool_t *poo
 
 // Returns the revision data for the given ID
 Revision *SubversionBackend::revision(const std::string &id)
+{
+	return fetchRevision(id, true);
+}
+
+// Starts prefetching the meta-data of the given revision IDs
+void SubversionBackend::prefetchMeta(const std::vector<std::string> &)
+{
+	// Revision properties are received along with the log, and the
+	// prefetcher only handles diffstats
+}
+
+// Returns the revision meta-data for the given ID
+Revision *SubversionBackend::metaRevision(const std::string &id)
+{
+	return fetchRevision(id, false);
+}
+
+// Returns the revision data for the given ID, optionally without diffstat
+Revision *SubversionBackend::fetchRevision(const std::string &id, bool diffstats)
 {
 	std::map<std::string, std::string> data;
-	std::string rev = str::split(id, ":").back();
+	std::string rev = utils::childId(id);
 
 	svn_revnum_t revnum;
 	if (!str::stoi(rev, &(revnum))) {
 		throw PEX(std::string("Error parsing revision number ") + id);
 	}
 
+	// Use the revision properties from the log if possible
+	m_metaMutex.lock();
+	std::map<uint64_t, MetaData>::iterator it = m_meta.find(revnum);
+	if (it != m_meta.end()) {
+		MetaData meta = it->second;
+		m_meta.erase(it);
+		m_metaMutex.unlock();
+		return new Revision(id, meta.date, meta.author, meta.message, (diffstats ? diffstat(id) : DiffstatPtr()));
+	}
+	m_metaMutex.unlock();
+
 	apr_pool_t *pool = svn_pool_create(d->pool);
 	apr_hash_t *props;
 
@@ -1158,5 +2062,5 @@ Revision *SubversionBackend::revision(const std::string &id)
 	}
 
 	svn_pool_destroy(pool);
-	return new Revision(id, date, author, message, diffstat(id));
+	return new Revision(id, date, author, message, (diffstats ? diffstat(id) : DiffstatPtr()));
 }
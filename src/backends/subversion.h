@@ -17,6 +17,7 @@
 
 #include "backend.h"
 
+class BOStream;
 class SvnConnection;
 class SvnDiffstatPrefetcher;
 
@@ -24,6 +25,15 @@ class SvnDiffstatPrefetcher;
 class SubversionBackend : public Backend
 {
 	public:
+		// Revision properties that have been received with the log
+		struct MetaData
+		{
+			MetaData() : date(0) { }
+
+			int64_t date;
+			std::string author, message;
+		};
+
 		class SvnLogIterator : public LogIterator
 		{
 			struct Interval
@@ -36,7 +46,7 @@ class SubversionBackend : public Backend
 			};
 
 			public:
-				SvnLogIterator(SubversionBackend *backend, const std::string &prefix, uint64_t startrev, uint64_t endrev);
+				SvnLogIterator(SubversionBackend *backend, const std::string &prefix, uint64_t startrev, uint64_t endrev, const RevisionFilter &filter = RevisionFilter());
 				~SvnLogIterator();
 
 				bool nextIds(std::queue<std::string> *queue);
@@ -46,7 +56,9 @@ class SubversionBackend : public Backend
 
 			private:
 				void readIntervalsFromCache(const std::string &file);
-				void writeIntervalsToCache(const std::string &file);
+				void readLegacyIntervals(const std::string &cachefile);
+				void writeIntervalsToCache(const std::string &file, const std::vector<Interval> &added);
+				static void writeInterval(BOStream &out, const Interval &interval);
 				void mergeInterval(const Interval &interval);
 				std::vector<Interval> missingIntervals(uint64_t start, uint64_t end);
 
@@ -55,10 +67,13 @@ class SubversionBackend : public Backend
 				SvnConnection *d;
 				std::string m_prefix;
 				uint64_t m_startrev, m_endrev;
+				RevisionFilter m_filter;
 				sys::parallel::Mutex m_mutex;
 				sys::parallel::WaitCondition m_cond;
 				std::vector<std::string>::size_type m_index;
 				std::vector<Interval> m_cachedIntervals;
+				size_t m_cacheRecords; // Number of intervals in the cache file
+				bool m_compactCache;
 				bool m_finished, m_failed;
 
 				static sys::parallel::Mutex s_cacheMutex;
@@ -80,23 +95,33 @@ class SubversionBackend : public Backend
 		std::vector<std::string> branches();
 		std::vector<Tag> tags();
 		DiffstatPtr diffstat(const std::string &id);
-		void filterDiffstat(DiffstatPtr stat);
+		DiffstatPtr filterDiffstat(DiffstatPtr stat);
 		std::vector<std::string> tree(const std::string &id = std::string());
 		std::string cat(const std::string &path, const std::string &id = std::string());
+		std::vector<std::string> catMany(const std::vector<std::string> &paths, const std::string &id = std::string());
+		std::string treeKey(const std::string &id = std::string());
+		std::vector<std::string> treeKeys(const std::string &id, std::vector<std::string> *paths);
 
-		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1);
+		LogIterator *iterator(const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, const RevisionFilter &filter = RevisionFilter());
 		void prefetch(const std::vector<std::string> &ids);
 		Revision *revision(const std::string &id);
+		void prefetchMeta(const std::vector<std::string> &ids);
+		bool orderedDates() const { return true; }
+		Revision *metaRevision(const std::string &id);
 		void finalize();
 
 		void printHelp() const;
 
 	private:
 		std::string prefix(const std::string &branch, struct apr_pool_t *pool);
+		std::vector<std::string> list(const std::string &id, std::vector<std::string> *fileKeys);
+		Revision *fetchRevision(const std::string &id, bool diffstats);
 
 	private:
 		SvnConnection *d;
 		SvnDiffstatPrefetcher *m_prefetcher;
+		sys::parallel::Mutex m_metaMutex;
+		std::map<uint64_t, MetaData> m_meta;
 };
 
 
@@ -15,6 +15,9 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <map>
+
 #include <svn_delta.h>
 #include <svn_path.h>
 #include <svn_pools.h>
@@ -37,67 +40,23 @@
 	} while (0)
 
 
-// streambuf implementation for apr_file_t
-class AprStreambuf : public std::streambuf
-{
-public:
-	explicit AprStreambuf(apr_file_t *file) 
-		: std::streambuf(), f(file), m_putback(8), m_buffer(4096 + 8)
-	{
-		char *end = &m_buffer.front() + m_buffer.size();
-		setg(end, end, end);
-	}
-
-private:
-	int_type underflow()
-	{
-		if (gptr() < egptr()) // buffer not exhausted
-			return traits_type::to_int_type(*gptr());
-
-		char *base = &m_buffer.front();
-		char *start = base;
-
-		if (eback() == base) // true when this isn't the first fill
-		{
-			// Make arrangements for putback characters
-			memmove(base, egptr() - m_putback, m_putback);
-			start += m_putback;
-		}
-
-		// start is now the start of the buffer, proper.
-		// Read from fptr_ in to the provided buffer
-		size_t n = m_buffer.size() - (start - base);
-		apr_status_t status = apr_file_read(f, start, &n);
-		if (n == 0 || status == APR_EOF)
-			return traits_type::eof();
-
-		// Set buffer pointers
-		setg(base, start, start + n);
-
-		return traits_type::to_int_type(*gptr());
-	}
-
-private:
-	apr_file_t *f;
-	const std::size_t m_putback;
-	std::vector<char> m_buffer;
-
-private:
-	// Not allowed
-	AprStreambuf(const AprStreambuf &);
-	AprStreambuf &operator=(const AprStreambuf &);
-};
-
-
 // Extra namespace for local structures
 namespace SvnDelta
 {
 
+// Files up to this size are kept in memory and diffed without temporary files
+const apr_size_t MaxMemoryFileSize = 1024 * 1024;
+
+// Assumed line length for estimating removed lines if a file doesn't
+// provide any new lines
+const apr_uint64_t ApproxLineLength = 40;
+
 // Baton for delta editor
 struct Baton
 {
 	const char *target;
-	apr_file_t *out;
+	DiffParser *parser;
+	std::map<std::string, Diffstat::Stat> *stats;
 
 	svn_ra_session_t *ra;
 	svn_revnum_t revision;
@@ -107,15 +66,18 @@ struct Baton
 
 	const char *tempdir;
 	const char *empty_file;
+	const std::vector<std::string> *excludes;
+	bool approximate; // Estimate changes from delta windows
 
 	apr_pool_t *pool;
 
-	static Baton *make(svn_revnum_t baserev, svn_revnum_t rev, apr_file_t *outfile, apr_pool_t *pool)
+	static Baton *make(svn_revnum_t baserev, svn_revnum_t rev, DiffParser *parser, std::map<std::string, Diffstat::Stat> *stats, apr_pool_t *pool)
 	{
 		Baton *baton = (Baton *)apr_pcalloc(pool, sizeof(Baton));
 
 		baton->target = "";
-		baton->out = outfile;
+		baton->parser = parser;
+		baton->stats = stats;
 		baton->base_revision = baserev;
 		baton->revision = rev;
 		baton->deleted_paths = apr_hash_make(pool);
@@ -124,6 +86,12 @@ struct Baton
 		baton->pool = pool;
 		return baton;
 	}
+
+	// Excluded files are neither fetched nor diffed
+	bool excluded(const char *path) const
+	{
+		return (excludes != NULL && Diffstat::excluded(path, *excludes));
+	}
 };
 
 struct DirBaton
@@ -146,17 +114,26 @@ struct DirBaton
 	}
 };
 
+// File contents are either kept in text_*_revision or, for large files,
+// written to a temporary file at path_*_revision
 struct FileBaton
 {
 	const char *path;
+	svn_stringbuf_t *text_start_revision;
 	const char *path_start_revision;
 	apr_file_t *file_start_revision;
 	apr_hash_t *pristine_props;
 	apr_array_header_t *propchanges;
+	svn_stringbuf_t *text_end_revision;
 	const char *path_end_revision;
 	apr_file_t *file_end_revision;
 	svn_txdelta_window_handler_t apply_handler;
 	void *apply_baton;
+	bool skip; // The file is excluded
+
+	// Changes estimated from delta windows
+	bool delta;
+	apr_uint64_t bytes_added, lines_added, bytes_deleted;
 
 	Baton *edit_baton;
 	apr_pool_t *pool;
@@ -182,18 +159,225 @@ svn_error_t *open_tempfile(apr_file_t **file, const char **path, FileBaton *b)
 	return svn_io_open_unique_file2(file, path, temp, ".tmp", svn_io_file_del_on_pool_cleanup, b->pool);
 }
 
-svn_error_t *get_file_from_ra(FileBaton *b, svn_revnum_t revision)
+// Writes the given in-memory file contents to a temporary file
+svn_error_t *spill_tempfile(svn_stringbuf_t **text, const char **path, FileBaton *b)
 {
-	PTRACE << b->path << "@" << revision << endl;
-	svn_stream_t *fstream;
 	apr_file_t *file;
+	SVN_ERR(open_tempfile(&file, path, b));
+	SVN_ERR(svn_io_file_write_full(file, (*text)->data, (*text)->len, NULL, b->pool));
+	*text = NULL;
+	return svn_io_file_close(file, b->pool);
+}
+
+// Baton for streams that switch to a temporary file once the data gets too large
+struct SpillBaton
+{
+	svn_stringbuf_t **text;
+	const char **path;
+	apr_file_t *file;
+	FileBaton *file_baton;
+};
+
+svn_error_t *spill_write(void *baton, const char *data, apr_size_t *len)
+{
+	SpillBaton *sb = static_cast<SpillBaton *>(baton);
+	if (sb->file == NULL && (*sb->text)->len + *len <= MaxMemoryFileSize) {
+		svn_stringbuf_appendbytes(*sb->text, data, *len);
+		return SVN_NO_ERROR;
+	}
+
+	FileBaton *b = sb->file_baton;
+	if (sb->file == NULL) {
+		PTRACE << b->path << " exceeds " << MaxMemoryFileSize << " bytes, using temporary file" << endl;
+		SVN_ERR(open_tempfile(&(sb->file), sb->path, b));
+		SVN_ERR(svn_io_file_write_full(sb->file, (*sb->text)->data, (*sb->text)->len, NULL, b->pool));
+		*sb->text = NULL;
+	}
+	return svn_io_file_write_full(sb->file, data, *len, NULL, b->pool);
+}
 
-	SVN_ERR(open_tempfile(&file, &(b->path_start_revision), b));
-	fstream = svn_stream_from_aprfile2(file, FALSE, b->pool);
+svn_error_t *spill_close(void *baton)
+{
+	SpillBaton *sb = static_cast<SpillBaton *>(baton);
+	if (sb->file != NULL) {
+		return svn_io_file_close(sb->file, sb->file_baton->pool);
+	}
+	return SVN_NO_ERROR;
+}
+
+// Returns a stream that stores file contents in memory or in a temporary file
+svn_stream_t *spill_stream(svn_stringbuf_t **text, const char **path, FileBaton *b)
+{
+	SpillBaton *sb = (SpillBaton *)apr_pcalloc(b->pool, sizeof(SpillBaton));
+	sb->text = text;
+	sb->path = path;
+	sb->file_baton = b;
+	*text = svn_stringbuf_create("", b->pool);
+	*path = NULL;
+
+	svn_stream_t *stream = svn_stream_create(sb, b->pool);
+	svn_stream_set_write(stream, spill_write);
+	svn_stream_set_close(stream, spill_close);
+	return stream;
+}
+
+svn_error_t *get_file_from_ra(FileBaton *b, svn_revnum_t revision)
+{
+	PTRACE << b->path << "@" << revision << endl;
+	svn_stream_t *fstream = spill_stream(&(b->text_start_revision), &(b->path_start_revision), b);
 	SVN_ERR(svn_ra_get_file(b->edit_baton->ra, b->path, revision, fstream, NULL, &(b->pristine_props), b->pool));
 	return svn_stream_close(fstream);
 }
 
+// Passes unified diff output to the diff parser
+svn_error_t *parser_write(void *baton, const char *data, apr_size_t *len)
+{
+	try {
+		static_cast<DiffParser *>(baton)->feed(data, *len);
+	} catch (const PepperException &ex) {
+		return svn_error_create(SVN_ERR_BASE, NULL, ex.what());
+	}
+	return SVN_NO_ERROR;
+}
+
+// Computes the lengths of all lines in a text, excluding the trailing newline.
+// Lines are split like svn_diff_mem_string_diff() does, i.e. at "\n", "\r\n"
+// and single "\r" characters.
+void line_lengths(const svn_stringbuf_t *text, std::vector<apr_size_t> *lengths)
+{
+	const char *start = text->data, *end = text->data + text->len;
+	for (const char *p = start; p != end; ++p) {
+		if (*p == '\r' && p + 1 != end && p[1] == '\n') {
+			++p;
+		}
+		if (*p == '\r' || *p == '\n') {
+			lengths->push_back(p - start + (*p == '\n' ? 0 : 1));
+			start = p + 1;
+		}
+	}
+	if (start != end) {
+		lengths->push_back(end - start);
+	}
+}
+
+// Baton for counting changes from a svn_diff_t
+struct DiffCounter
+{
+	std::vector<apr_size_t> lines[2];
+	Diffstat::Stat stat;
+};
+
+// Counts lines and bytes like DiffParser does for unified diffs, i.e.
+// including the leading '-' or '+'
+svn_error_t *count_modified(void *baton, apr_off_t original_start, apr_off_t original_length, apr_off_t modified_start, apr_off_t modified_length, apr_off_t, apr_off_t)
+{
+	DiffCounter *c = static_cast<DiffCounter *>(baton);
+	for (apr_off_t i = original_start; i < original_start + original_length && i < (apr_off_t)c->lines[0].size(); i++) {
+		c->stat.cdel += 1 + c->lines[0][i];
+	}
+	for (apr_off_t i = modified_start; i < modified_start + modified_length && i < (apr_off_t)c->lines[1].size(); i++) {
+		c->stat.cadd += 1 + c->lines[1][i];
+	}
+	c->stat.ldel += original_length;
+	c->stat.ladd += modified_length;
+	return SVN_NO_ERROR;
+}
+
+// Diffs two in-memory texts and counts the changes
+svn_error_t *count_texts(const svn_stringbuf_t *text1, const svn_stringbuf_t *text2, Diffstat::Stat *stat, apr_pool_t *pool)
+{
+	svn_diff_t *diff;
+	svn_diff_file_options_t *opts = svn_diff_file_options_create(pool);
+	svn_string_t original, modified;
+	original.data = text1->data;
+	original.len = text1->len;
+	modified.data = text2->data;
+	modified.len = text2->len;
+	SVN_ERR(svn_diff_mem_string_diff(&diff, &original, &modified, opts, pool));
+
+	svn_diff_output_fns_t fns;
+	memset(&fns, 0, sizeof(fns));
+	fns.output_diff_modified = count_modified;
+	DiffCounter counter;
+	line_lengths(text1, &counter.lines[0]);
+	line_lengths(text2, &counter.lines[1]);
+	SVN_ERR(svn_diff_output(diff, &counter, &fns));
+
+	*stat = counter.stat;
+	return SVN_NO_ERROR;
+}
+
+// Estimates the number of lines in the given number of bytes from the
+// average length of the lines that have been added to the file
+apr_uint64_t estimate_lines(apr_uint64_t bytes, apr_uint64_t bytes_added, apr_uint64_t lines_added)
+{
+	if (bytes == 0) {
+		return 0;
+	}
+	apr_uint64_t length = (lines_added > 0 ? std::max(bytes_added / lines_added, (apr_uint64_t)1) : ApproxLineLength);
+	return (bytes + length - 1) / length;
+}
+
+// Counts the changes described by a delta window without applying it. New
+// data is added, and the parts of the source view that aren't copied have
+// been removed. Lines can only be counted in the new data, as the source
+// is not available.
+void count_window(const svn_txdelta_window_t *window, FileBaton *b)
+{
+	std::vector<std::pair<apr_size_t, apr_size_t> > copied;
+	for (int i = 0; i < window->num_ops; i++) {
+		const svn_txdelta_op_t &op = window->ops[i];
+		if (op.action_code == svn_txdelta_source) {
+			copied.push_back(std::make_pair(op.offset, std::min(op.offset + op.length, window->sview_len)));
+		} else if (op.action_code == svn_txdelta_new) {
+			const char *data = window->new_data->data + op.offset;
+			b->bytes_added += op.length;
+			b->lines_added += std::count(data, data + op.length, '\n');
+		} else {
+			b->bytes_added += op.length; // Repeats earlier data of the target view
+		}
+	}
+
+	std::sort(copied.begin(), copied.end());
+	apr_size_t covered = 0, end = 0;
+	for (size_t i = 0; i < copied.size(); i++) {
+		if (copied[i].second > end) {
+			covered += copied[i].second - std::max(copied[i].first, end);
+			end = copied[i].second;
+		}
+	}
+	b->bytes_deleted += window->sview_len - covered;
+}
+
+// Checks whether the file has a binary mime-type in either revision
+bool is_binary(const FileBaton *b)
+{
+	const char *mimetype1 = NULL, *mimetype2 = NULL;
+	if (b->pristine_props) {
+		svn_string_t *pristine_val;
+		pristine_val = (svn_string_t *)apr_hash_get(b->pristine_props, SVN_PROP_MIME_TYPE, strlen(SVN_PROP_MIME_TYPE));
+		if (pristine_val) {
+			mimetype1 = pristine_val->data;
+		}
+	}
+	if (b->propchanges) {
+		int i;
+		svn_prop_t *propchange;
+		for (i = 0; i < b->propchanges->nelts; i++) {
+			propchange = &APR_ARRAY_IDX(b->propchanges, i, svn_prop_t);
+			if (strcmp(propchange->name, SVN_PROP_MIME_TYPE) == 0) {
+				if (propchange->value) {
+					mimetype2 = propchange->value->data;
+				}
+				break;
+			}
+		}
+	}
+
+	// TODO: Proper handling of mime-type changes
+	return ((mimetype1 && svn_mime_type_is_binary(mimetype1)) || (mimetype2 && svn_mime_type_is_binary(mimetype2)));
+}
+
 
 // Delta editor callback functions
 svn_error_t *set_target_revision(void *edit_baton, svn_revnum_t target_revision, apr_pool_t * /*pool*/)
@@ -221,6 +405,10 @@ svn_error_t *delete_entry(const char *path, svn_revnum_t target_revision, void *
 {
 	DirBaton *pb = static_cast<DirBaton *>(parent_baton);
 	Baton *eb = pb->edit_baton;
+	if (eb->excluded(path)) {
+		PTRACE << "Skipping excluded path " << path << endl;
+		return SVN_NO_ERROR;
+	}
 
 	// File or directory?
 	svn_dirent_t *dirent;
@@ -234,8 +422,15 @@ svn_error_t *delete_entry(const char *path, svn_revnum_t target_revision, void *
 
 	if (dirent->kind == svn_node_file) {
 		FileBaton *b = FileBaton::make(path, eb, pool);
+		if (eb->approximate) {
+			// The properties are sufficient for skipping binary files
+			SVN_ERR(svn_ra_get_file(eb->ra, path, eb->base_revision, NULL, NULL, &(b->pristine_props), pool));
+			b->delta = true;
+			b->bytes_deleted = dirent->size;
+			return close_file(b, "", pool);
+		}
 		SVN_ERR(get_file_from_ra(b, eb->base_revision));
-		SVN_ERR(open_tempfile(&(b->file_end_revision), &(b->path_end_revision), b));
+		b->text_end_revision = svn_stringbuf_create("", b->pool);
 		SVN_ERR(close_file(b, "", pool));
 	} else {
 		PTRACE << "Listing " << path << "@" << eb->base_revision << endl;
@@ -287,9 +482,11 @@ svn_error_t *add_file(const char *path, void *parent_baton, const char * /*copyf
 	DirBaton *db = static_cast<DirBaton *>(parent_baton);
 	FileBaton *b = FileBaton::make(path, db->edit_baton, pool);
 	*file_baton = b;
+	b->skip = db->edit_baton->excluded(path);
 
 	b->pristine_props = apr_hash_make(pool);
-	return open_tempfile(&(b->file_start_revision), &(b->path_start_revision), b);
+	b->text_start_revision = svn_stringbuf_create("", pool);
+	return SVN_NO_ERROR;
 }
 
 svn_error_t *open_file(const char *path, void *parent_baton, svn_revnum_t base_revision, apr_pool_t *pool, void **file_baton)
@@ -298,18 +495,42 @@ svn_error_t *open_file(const char *path, void *parent_baton, svn_revnum_t base_r
 	DirBaton *db = static_cast<DirBaton *>(parent_baton);
 	FileBaton *b = FileBaton::make(path, db->edit_baton, pool);
 	*file_baton = b;
+	if (db->edit_baton->excluded(path)) {
+		PTRACE << "Skipping excluded file " << path << endl;
+		b->skip = true;
+		return SVN_NO_ERROR;
+	}
+
+	// Replay drives don't specify a base revision
+	if (!SVN_IS_VALID_REVNUM(base_revision)) {
+		base_revision = db->edit_baton->base_revision;
+	}
+
+	// Deltas are counted without applying them, so only the properties
+	// of the base file are needed
+	if (db->edit_baton->approximate) {
+		return svn_ra_get_file(db->edit_baton->ra, b->path, base_revision, NULL, NULL, &(b->pristine_props), b->pool);
+	}
 
 	// TODO: No need to get the whole file if it is binary...
 	return get_file_from_ra(b, base_revision);
 }
 
+// Window handler for approximate diffstats
+svn_error_t *count_window_handler(svn_txdelta_window_t *window, void *window_baton)
+{
+	if (window != NULL) {
+		count_window(window, static_cast<FileBaton *>(window_baton));
+	}
+	return SVN_NO_ERROR;
+}
+
 svn_error_t *window_handler(svn_txdelta_window_t *window, void *window_baton)
 {
 	FileBaton *b = static_cast<FileBaton *>(window_baton);
 	SVN_ERR(b->apply_handler(window, b->apply_baton));
-	if (!window) {
+	if (!window && b->file_start_revision) {
 		SVN_ERR(svn_io_file_close(b->file_start_revision, b->pool));
-		SVN_ERR(svn_io_file_close(b->file_end_revision, b->pool));
 	}
 	return SVN_NO_ERROR;
 }
@@ -317,12 +538,31 @@ svn_error_t *window_handler(svn_txdelta_window_t *window, void *window_baton)
 svn_error_t *apply_textdelta(void *file_baton, const char * /*base_checksum*/, apr_pool_t * /*pool*/, svn_txdelta_window_handler_t *handler, void **handler_baton)
 {
 	FileBaton *b = static_cast<FileBaton *>(file_baton);
-	PTRACE << "base is " << b->path_start_revision << endl;
-	SVN_ERR(svn_io_file_open(&(b->file_start_revision), b->path_start_revision, APR_READ, APR_OS_DEFAULT, b->pool));
+	if (b->skip) {
+		*handler = svn_delta_noop_window_handler;
+		*handler_baton = NULL;
+		return SVN_NO_ERROR;
+	}
+	if (b->edit_baton->approximate) {
+		b->delta = true;
+		*handler = count_window_handler;
+		*handler_baton = file_baton;
+		return SVN_NO_ERROR;
+	}
 
-	SVN_ERR(open_tempfile(&(b->file_end_revision), &(b->path_end_revision), b));
+	svn_stream_t *source;
+	if (b->text_start_revision) {
+		PTRACE << "base is in memory (" << b->text_start_revision->len << " bytes)" << endl;
+		source = svn_stream_from_stringbuf(b->text_start_revision, b->pool);
+	} else {
+		PTRACE << "base is " << b->path_start_revision << endl;
+		SVN_ERR(svn_io_file_open(&(b->file_start_revision), b->path_start_revision, APR_READ, APR_OS_DEFAULT, b->pool));
+		source = svn_stream_from_aprfile2(b->file_start_revision, TRUE, b->pool);
+	}
 
-	svn_txdelta_apply(svn_stream_from_aprfile2(b->file_start_revision, TRUE, b->pool), svn_stream_from_aprfile2(b->file_end_revision, TRUE, b->pool), NULL, b->path, b->pool, &(b->apply_handler), &(b->apply_baton));
+	// The target stream will be closed by the delta handler
+	svn_stream_t *target = spill_stream(&(b->text_end_revision), &(b->path_end_revision), b);
+	svn_txdelta_apply(source, target, NULL, b->path, b->pool, &(b->apply_handler), &(b->apply_baton));
 	*handler = window_handler;
 	*handler_baton = file_baton;
 	return SVN_NO_ERROR;
@@ -332,51 +572,70 @@ svn_error_t *close_file(void *file_baton, const char * /*text_checksum*/, apr_po
 {
 	FileBaton *b = static_cast<FileBaton *>(file_baton);
 	Baton *eb = b->edit_baton;
-
-	if (b->path_start_revision == NULL || b->path_end_revision == NULL) {
-		PDEBUG << b->path << "@" << eb->target_revision << " Insufficient diff data (nothing has changed)" << endl;
+	if (b->skip) {
 		return SVN_NO_ERROR;
 	}
 
-	PTRACE << b->path_start_revision << " -> " << b->path_end_revision << endl;
+	if (eb->approximate) {
+		if (!b->delta) {
+			PDEBUG << b->path << "@" << eb->target_revision << " No text delta (nothing has changed)" << endl;
+			return SVN_NO_ERROR;
+		} else if (is_binary(b)) {
+			PDEBUG << "Skipping binary files" << endl;
+			return SVN_NO_ERROR;
+		}
 
-	// Skip binary diffs
-	const char *mimetype1 = NULL, *mimetype2 = NULL;
-	if (b->pristine_props) {
-		svn_string_t *pristine_val;
-		pristine_val = (svn_string_t *)apr_hash_get(b->pristine_props, SVN_PROP_MIME_TYPE, strlen(SVN_PROP_MIME_TYPE));
-		if (pristine_val) {
-			mimetype1 = pristine_val->data;
+		Diffstat::Stat stat;
+		stat.cadd = b->bytes_added;
+		stat.ladd = b->lines_added;
+		stat.cdel = b->bytes_deleted;
+		stat.ldel = estimate_lines(b->bytes_deleted, b->bytes_added, b->lines_added);
+		if (!stat.empty()) {
+			(*eb->stats)[b->path] = stat;
 		}
+		return SVN_NO_ERROR;
 	}
-	if (b->propchanges) {
-		int i;
-		svn_prop_t *propchange;
-		for (i = 0; i < b->propchanges->nelts; i++) {
-			propchange = &APR_ARRAY_IDX(b->propchanges, i, svn_prop_t);
-			if (strcmp(propchange->name, SVN_PROP_MIME_TYPE) == 0) {
-				if (propchange->value) {
-					mimetype2 = propchange->value->data;
-				}
-				break;
-			}
-		}
+
+	if ((b->text_start_revision == NULL && b->path_start_revision == NULL) || (b->text_end_revision == NULL && b->path_end_revision == NULL)) {
+		PDEBUG << b->path << "@" << eb->target_revision << " Insufficient diff data (nothing has changed)" << endl;
+		return SVN_NO_ERROR;
 	}
 
-	// TODO: Proper handling of mime-type changes
-	if ((mimetype1 && svn_mime_type_is_binary(mimetype1)) || (mimetype2 && svn_mime_type_is_binary(mimetype2))) {
+	// Skip binary diffs
+	if (is_binary(b)) {
 		PDEBUG << "Skipping binary files" << endl;
 		return SVN_NO_ERROR;
 	}
 
-	// Finally, perform the diff
+	// Finally, perform the diff. If both versions are in memory, the
+	// changes can be counted directly from the diff.
+	svn_diff_t *diff;
+	svn_diff_file_options_t *opts = svn_diff_file_options_create(b->pool);
+	if (b->text_start_revision && b->text_end_revision) {
+		PTRACE << b->path << ": " << b->text_start_revision->len << " -> " << b->text_end_revision->len << " bytes" << endl;
+
+		Diffstat::Stat stat;
+		SVN_ERR(count_texts(b->text_start_revision, b->text_end_revision, &stat, b->pool));
+		if (!stat.empty()) {
+			(*eb->stats)[b->path] = stat;
+		}
+		return SVN_NO_ERROR;
+	}
+
+	// Large files are diffed on disk and the output is parsed by the DiffParser
+	if (b->text_start_revision) {
+		SVN_ERR(spill_tempfile(&(b->text_start_revision), &(b->path_start_revision), b));
+	}
+	if (b->text_end_revision) {
+		SVN_ERR(spill_tempfile(&(b->text_end_revision), &(b->path_end_revision), b));
+	}
+	PTRACE << b->path_start_revision << " -> " << b->path_end_revision << endl;
+
 	static const char equal_string[] =
 		"===================================================================";
 
-	svn_diff_t *diff;
-	svn_stream_t *os;
-	os = svn_stream_from_aprfile2(eb->out, TRUE, b->pool);
-	svn_diff_file_options_t *opts = svn_diff_file_options_create(b->pool);
+	svn_stream_t *os = svn_stream_create(eb->parser, b->pool);
+	svn_stream_set_write(os, parser_write);
 	SVN_ERR(svn_diff_file_diff_2(&diff, b->path_start_revision, b->path_end_revision, opts, b->pool));
 	// Print out the diff header
 	SVN_ERR(svn_stream_printf_from_utf8(os, APR_LOCALE_CHARSET, b->pool, "Index: %s" APR_EOL_STR "%s" APR_EOL_STR, b->path, equal_string));
@@ -422,12 +681,250 @@ svn_error_t *close_edit(void * /*edit_baton*/, apr_pool_t * /*pool*/)
 	return SVN_NO_ERROR;
 }
 
+// Returns a new diff editor
+svn_delta_editor_t *make_editor(apr_pool_t *pool)
+{
+	svn_delta_editor_t *editor = svn_delta_default_editor(pool);
+	editor->set_target_revision = set_target_revision;
+	editor->open_root = open_root;
+	editor->delete_entry = delete_entry;
+	editor->add_directory = add_directory;
+	editor->open_directory = open_directory;
+	editor->add_file = add_file;
+	editor->open_file = open_file;
+	editor->apply_textdelta = apply_textdelta;
+	editor->close_file = close_file;
+	editor->close_directory = close_directory;
+	editor->change_file_prop = change_file_prop;
+	editor->change_dir_prop = change_dir_prop;
+	editor->close_edit = close_edit;
+	editor->absent_directory = absent_directory;
+	editor->absent_file = absent_file;
+	return editor;
+}
+
+
+// Baton for replaying a range of revisions
+struct ReplayBaton
+{
+	svn_ra_session_t *ra;
+	const svn_delta_editor_t *editor;
+	const std::map<svn_revnum_t, std::string> *ids;
+	const std::vector<std::string> *excludes;
+	bool approximate;
+	JobQueue<std::string, DiffstatPtr> *queue;
+	std::vector<svn_revnum_t> finished;
+
+	DiffParser parser;
+	std::map<std::string, Diffstat::Stat> stats;
+
+	apr_pool_t *pool;
+	apr_pool_t *revpool;
+};
+
+// Replay callback for the start of a revision
+svn_error_t *replay_revstart(svn_revnum_t revision, void *replay_baton, const svn_delta_editor_t **editor, void **edit_baton, apr_hash_t * /*rev_props*/, apr_pool_t * /*pool*/)
+{
+	ReplayBaton *rb = static_cast<ReplayBaton *>(replay_baton);
+	PTRACE << "Replaying revision " << revision << endl;
+
+	rb->revpool = svn_pool_create(rb->pool);
+	rb->stats.clear();
+	Baton *eb = Baton::make(revision - 1, revision, &(rb->parser), &(rb->stats), rb->revpool);
+	eb->ra = rb->ra;
+	eb->excludes = rb->excludes;
+	eb->approximate = rb->approximate;
+	eb->target_revision = revision;
+
+	*editor = rb->editor;
+	*edit_baton = eb;
+	return SVN_NO_ERROR;
+}
+
+// Replay callback for the end of a revision
+svn_error_t *replay_revfinish(svn_revnum_t revision, void *replay_baton, const svn_delta_editor_t * /*editor*/, void * /*edit_baton*/, apr_hash_t * /*rev_props*/, apr_pool_t * /*pool*/)
+{
+	ReplayBaton *rb = static_cast<ReplayBaton *>(replay_baton);
+	DiffstatPtr stat;
+	try {
+		stat = SvnDiffstatThread::collect(&(rb->parser), rb->stats);
+	} catch (const PepperException &ex) {
+		return svn_error_create(SVN_ERR_BASE, NULL, ex.what());
+	}
+	svn_pool_destroy(rb->revpool);
+	rb->revpool = NULL;
+
+	std::map<svn_revnum_t, std::string>::const_iterator it = rb->ids->find(revision);
+	if (it != rb->ids->end()) {
+		rb->queue->done(it->second, stat, stat->footprint());
+		rb->finished.push_back(revision);
+	}
+	return SVN_NO_ERROR;
+}
+
+
+// Files that differ between two revisions of a local repository
+struct LocalChange
+{
+	bool base; // File exists in the base revision
+	bool target; // File exists in the target revision
+
+	LocalChange() : base(false), target(false) { }
+};
+
+// Collects the paths of all files at or below the given path
+svn_error_t *local_files(svn_fs_root_t *root, const char *path, std::vector<const char *> *files, apr_pool_t *pool)
+{
+	svn_node_kind_t kind;
+	SVN_ERR(svn_fs_check_path(&kind, root, path, pool));
+	if (kind == svn_node_file) {
+		files->push_back(path);
+		return SVN_NO_ERROR;
+	} else if (kind != svn_node_dir) {
+		return SVN_NO_ERROR;
+	}
+
+	apr_hash_t *entries;
+	SVN_ERR(svn_fs_dir_entries(&entries, root, path, pool));
+	for (apr_hash_index_t *hi = apr_hash_first(pool, entries); hi; hi = apr_hash_next(hi)) {
+		const char *name;
+		svn_fs_dirent_t *dirent;
+		apr_hash_this(hi, (const void **)(void *)&name, NULL, (void **)(void *)&dirent);
+		const char *child = svn_path_join(path, name, pool);
+		if (dirent->kind == svn_node_dir) {
+			SVN_ERR(local_files(root, child, files, pool));
+		} else {
+			files->push_back(child);
+		}
+	}
+	return SVN_NO_ERROR;
+}
+
+// Reads the contents of a file, unless it has a binary mime-type
+svn_error_t *local_read(svn_fs_root_t *root, const char *path, svn_stringbuf_t **text, bool *binary, apr_pool_t *pool)
+{
+	svn_string_t *mimetype;
+	SVN_ERR(svn_fs_node_prop(&mimetype, root, path, SVN_PROP_MIME_TYPE, pool));
+	*binary = (mimetype && svn_mime_type_is_binary(mimetype->data));
+	if (*binary) {
+		return SVN_NO_ERROR;
+	}
+
+	svn_filesize_t length;
+	SVN_ERR(svn_fs_file_length(&length, root, path, pool));
+	svn_stringbuf_ensure(*text, (apr_size_t)length);
+
+	svn_stream_t *stream;
+	SVN_ERR(svn_fs_file_contents(&stream, root, path, pool));
+	char buffer[16384];
+	apr_size_t len;
+	do {
+		len = sizeof(buffer);
+		SVN_ERR(svn_stream_read(stream, buffer, &len));
+		svn_stringbuf_appendbytes(*text, buffer, len);
+	} while (len == sizeof(buffer));
+	return svn_stream_close(stream);
+}
+
+// Counts the changes of a single revision by comparing its filesystem root
+// with the root of the previous revision. Like for svn_ra_do_diff3(),
+// deleted directories are deleted recursively, copies are treated as plain
+// additions and binary files are skipped.
+svn_error_t *local_diff(svn_fs_t *fs, svn_revnum_t revision, const std::vector<std::string> &excludes, std::map<std::string, Diffstat::Stat> *stats, apr_pool_t *pool)
+{
+	svn_fs_root_t *root1, *root2;
+	SVN_ERR(svn_fs_revision_root(&root1, fs, revision - 1, pool));
+	SVN_ERR(svn_fs_revision_root(&root2, fs, revision, pool));
+
+	apr_hash_t *changed;
+	SVN_ERR(svn_fs_paths_changed2(&changed, root2, pool));
+
+	std::map<std::string, LocalChange> files;
+	for (apr_hash_index_t *hi = apr_hash_first(pool, changed); hi; hi = apr_hash_next(hi)) {
+		const char *path;
+		svn_fs_path_change2_t *change;
+		apr_hash_this(hi, (const void **)(void *)&path, NULL, (void **)(void *)&change);
+
+		std::vector<const char *> paths;
+		svn_node_kind_t kind;
+		switch (change->change_kind) {
+			case svn_fs_path_change_delete:
+			case svn_fs_path_change_replace:
+				SVN_ERR(local_files(root1, path, &paths, pool));
+				for (size_t i = 0; i < paths.size(); i++) {
+					files[paths[i]].base = true;
+				}
+				if (change->change_kind == svn_fs_path_change_delete) {
+					break;
+				}
+				paths.clear();
+				// Fall through
+
+			case svn_fs_path_change_add:
+				SVN_ERR(local_files(root2, path, &paths, pool));
+				for (size_t i = 0; i < paths.size(); i++) {
+					files[paths[i]].target = true;
+				}
+				break;
+
+			case svn_fs_path_change_modify:
+				// Modified files in copied directories may not exist in the
+				// base revision
+				if (change->text_mod) {
+					SVN_ERR(svn_fs_check_path(&kind, root1, path, pool));
+					files[path].base = (kind == svn_node_file);
+					files[path].target = true;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	PTRACE << files.size() << " files changed in revision " << revision << endl;
+
+	apr_pool_t *iterpool = svn_pool_create(pool);
+	for (std::map<std::string, LocalChange>::const_iterator it = files.begin(); it != files.end(); ++it) {
+		svn_pool_clear(iterpool);
+
+		// Diffstat paths are relative to the repository root
+		const char *path = it->first.c_str();
+		const char *relpath = (*path == '/' ? path + 1 : path);
+		if (Diffstat::excluded(relpath, excludes)) {
+			continue;
+		}
+
+		svn_stringbuf_t *text1 = svn_stringbuf_create("", iterpool);
+		svn_stringbuf_t *text2 = svn_stringbuf_create("", iterpool);
+		bool binary1 = false, binary2 = false;
+		if (it->second.base) {
+			SVN_ERR(local_read(root1, path, &text1, &binary1, iterpool));
+		}
+		if (it->second.target && !binary1) {
+			SVN_ERR(local_read(root2, path, &text2, &binary2, iterpool));
+		}
+		if (binary1 || binary2) {
+			PDEBUG << "Skipping binary file " << path << endl;
+			continue;
+		}
+
+		Diffstat::Stat stat;
+		SVN_ERR(count_texts(text1, text2, &stat, iterpool));
+		if (!stat.empty()) {
+			(*stats)[relpath] = stat;
+		}
+	}
+	svn_pool_destroy(iterpool);
+	return SVN_NO_ERROR;
+}
+
 } // namespace SvnDelta
 
 
 // Constructor
 SvnDiffstatThread::SvnDiffstatThread(SvnConnection *connection, JobQueue<std::string, DiffstatPtr> *queue)
-	: d(new SvnConnection()), m_queue(queue)
+	: d(new SvnConnection()), m_queue(queue), m_replay(true)
 {
 	d->open(connection);
 }
@@ -443,7 +940,7 @@ SvnDiffstatThread::~SvnDiffstatThread()
 DiffstatPtr SvnDiffstatThread::diffstat(SvnConnection *c, svn_revnum_t r1, svn_revnum_t r2, apr_pool_t *pool)
 {
 	if (r2 <= 0) {
-		return std::make_shared<Diffstat>();
+		return Diffstat::create();
 	}
 
 	svn_opt_revision_t rev1, rev2;
@@ -452,118 +949,221 @@ DiffstatPtr SvnDiffstatThread::diffstat(SvnConnection *c, svn_revnum_t r1, svn_r
 	rev2.value.number = r2;
 	svn_error_t *err;
 
-	apr_file_t *infile = NULL, *outfile = NULL, *errfile = NULL;
-	if (apr_file_open_stderr(&errfile, pool) != APR_SUCCESS) {
-		throw PEX("Unable to open stderr");
+	// Single revisions of local repositories are read from the filesystem
+	if (c->fs != NULL && r1 == r2 - 1) {
+		return localDiffstat(c, r2, pool);
 	}
-	if (apr_file_pipe_create(&infile, &outfile, pool) != APR_SUCCESS) {
-		throw PEX("Unable to create pipe for reading diff data");
-	}
-
-	AprStreambuf buf(infile);
-	std::istream in(&buf);
-	DiffParser parser(in);
-	parser.start();
 
 	PTRACE << "Fetching diffstat for revision " << r1 << ":" << r2 << endl;
 
 	// Setup the diff editor
 	apr_pool_t *subpool = svn_pool_create(pool);
-	svn_delta_editor_t *editor = svn_delta_default_editor(subpool);
-	SvnDelta::Baton *baton = SvnDelta::Baton::make(r1, r2, outfile, subpool);
-
-	// Open RA session for extra calls during diff
-	err = svn_client_open_ra_session(&baton->ra, c->root, c->ctx, pool);
+	svn_delta_editor_t *editor = SvnDelta::make_editor(subpool);
+	DiffParser parser;
+	std::map<std::string, Diffstat::Stat> stats;
+	SvnDelta::Baton *baton = SvnDelta::Baton::make(r1, r2, &parser, &stats, subpool);
+	baton->excludes = &c->excludes;
+	baton->approximate = c->approximate;
+
+	// Use an auxiliary RA session for extra calls during diff
+	err = c->acquire(&baton->ra);
 	if (err != NULL) {
-		apr_file_close(outfile);
-		apr_file_close(infile);
 		throw PEX(str::printf("Diffstat fetching of revision %ld:%ld failed: %s", r1, r2, SvnConnection::strerr(err).c_str()));
 	}
 
-	editor->set_target_revision = SvnDelta::set_target_revision;
-	editor->open_root = SvnDelta::open_root;
-	editor->delete_entry = SvnDelta::delete_entry;
-	editor->add_directory = SvnDelta::add_directory;
-	editor->open_directory = SvnDelta::open_directory;
-	editor->add_file = SvnDelta::add_file;
-	editor->open_file = SvnDelta::open_file;
-	editor->apply_textdelta = SvnDelta::apply_textdelta;
-	editor->close_file = SvnDelta::close_file;
-	editor->close_directory = SvnDelta::close_directory;
-	editor->change_file_prop = SvnDelta::change_file_prop;
-	editor->change_dir_prop = SvnDelta::change_dir_prop;
-	editor->close_edit = SvnDelta::close_edit;
-	editor->absent_directory = SvnDelta::absent_directory;
-	editor->absent_file = SvnDelta::absent_file;
-
 	const svn_ra_reporter3_t *reporter;
 	void *report_baton;
 	err = svn_ra_do_diff3(c->ra, &reporter, &report_baton, rev2.value.number, "", svn_depth_infinity, TRUE, TRUE, c->root, editor, baton, pool);
 	if (err != NULL) {
-		apr_file_close(outfile);
-		apr_file_close(infile);
 		throw PEX(str::printf("Diffstat fetching of revision %ld:%ld failed: %s", r1, r2, SvnConnection::strerr(err).c_str()));
 	}
 
 	err = reporter->set_path(report_baton, "", rev1.value.number, svn_depth_infinity, FALSE, NULL, pool);
 	if (err != NULL) {
-		apr_file_close(outfile);
-		apr_file_close(infile);
 		throw PEX(str::printf("Diffstat fetching of revision %ld:%ld failed: %s", r1, r2, SvnConnection::strerr(err).c_str()));
 	}
 
 	err = reporter->finish_report(report_baton, pool);
 	if (err != NULL) {
-		apr_file_close(outfile);
-		apr_file_close(infile);
 		throw PEX(str::printf("Diffstat fetching of revision %ld:%ld failed: %s", r1, r2, SvnConnection::strerr(err).c_str()));
 	}
 
-	if (apr_file_close(outfile) != APR_SUCCESS) {
-		throw PEX("Unable to close outfile");
+	// Sessions of failed diffs are not reused, since they might still be
+	// in the middle of a request
+	c->release(baton->ra);
+	return collect(&parser, stats);
+}
+
+// Computes the diffstat of a single revision directly from the filesystem
+// of a local repository
+DiffstatPtr SvnDiffstatThread::localDiffstat(SvnConnection *c, svn_revnum_t revision, apr_pool_t *pool)
+{
+	PTRACE << "Computing diffstat for revision " << revision << " from filesystem" << endl;
+
+	apr_pool_t *subpool = svn_pool_create(pool);
+	std::map<std::string, Diffstat::Stat> stats;
+	svn_error_t *err = SvnDelta::local_diff(c->fs, revision, c->excludes, &stats, subpool);
+	svn_pool_destroy(subpool);
+	if (err != NULL) {
+		throw PEX(str::printf("Diffstat fetching of revision %ld failed: %s", revision, SvnConnection::strerr(err).c_str()));
 	}
-	parser.wait();
-	if (apr_file_close(infile) != APR_SUCCESS) {
-		throw PEX("Unable to close infile");
+
+	DiffParser parser;
+	return collect(&parser, stats);
+}
+
+// Returns the diffstat of the parsed diff output, merged with the changes
+// that have been counted in memory
+DiffstatPtr SvnDiffstatThread::collect(DiffParser *parser, const std::map<std::string, Diffstat::Stat> &stats)
+{
+	DiffstatPtr stat = parser->finish();
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+		stat->append(Diffstat::intern(it->first)) = it->second;
 	}
-	return parser.stat();
+	stat->sort();
+	return stat;
+}
+
+// Fetches the diffstats of a contiguous range of single revisions by
+// replaying them over the thread's RA session. Returns the revisions that
+// have been reported to the job queue.
+std::vector<svn_revnum_t> SvnDiffstatThread::replay(const std::map<svn_revnum_t, std::string> &ids, svn_ra_session_t *aux, apr_pool_t *pool)
+{
+	svn_revnum_t start = ids.begin()->first, end = ids.rbegin()->first;
+	PDEBUG << "Replaying revisions " << start << " to " << end << endl;
+
+	SvnDelta::ReplayBaton baton;
+	baton.ra = aux;
+	baton.editor = SvnDelta::make_editor(pool);
+	baton.ids = &ids;
+	baton.excludes = &d->excludes;
+	baton.approximate = d->approximate;
+	baton.queue = m_queue;
+	baton.pool = pool;
+	baton.revpool = NULL;
+
+	// Copies are sent as plain additions when their source is older than
+	// the low water mark, so that copied files will be included in the
+	// diffstat, like they are for svn_ra_do_diff3().
+	svn_error_t *err = svn_ra_replay_range(d->ra, start, end, end, TRUE, SvnDelta::replay_revstart, SvnDelta::replay_revfinish, &baton, pool);
+	if (baton.revpool) {
+		svn_pool_destroy(baton.revpool);
+	}
+	if (err != NULL) {
+		if (err->apr_err == SVN_ERR_RA_NOT_IMPLEMENTED) {
+			PDEBUG << "Replaying is not supported by the server" << endl;
+			m_replay = false;
+		} else if (err->apr_err == SVN_ERR_CANCELLED) {
+			PDEBUG << "Replaying revisions " << start << " to " << end << " cancelled" << endl;
+		} else {
+			Logger::err() << "Error: Replaying revisions " << start << " to " << end << " failed: " << SvnConnection::strerr(err) << endl;
+		}
+		svn_error_clear(err);
+	}
+	return baton.finished;
+}
+
+// Fetches the diffstat for a single job queue argument
+void SvnDiffstatThread::fetch(const std::string &revision, apr_pool_t *pool)
+{
+	svn_revnum_t r1, r2;
+	if (!parse(revision, &r1, &r2)) {
+		PEX(std::string("Error parsing revision number ") + revision);
+		m_queue->failed(revision);
+		return;
+	}
+
+	// Skip remaining jobs once the prefetcher has been stopped
+	if (d->cancelled()) {
+		m_queue->failed(revision);
+		return;
+	}
+
+	apr_pool_t *subpool = svn_pool_create(pool);
+	try {
+		DiffstatPtr stat = diffstat(d, r1, r2, subpool);
+		m_queue->done(revision, stat, stat->footprint());
+	} catch (const PepperException &ex) {
+		if (!d->cancelled()) {
+			Logger::err() << "Error: " << ex.where() << ": " << ex.what() << endl;
+		}
+		m_queue->failed(revision);
+	}
+	svn_pool_destroy(subpool);
+}
+
+// Parses a job queue argument, which is either a single revision or a
+// revision range
+bool SvnDiffstatThread::parse(const std::string &revision, svn_revnum_t *r1, svn_revnum_t *r2)
+{
+	std::vector<std::string> revs = str::split(revision, ":");
+	if (revs.size() > 1) {
+		return (str::stoi(revs[0], r1) && str::stoi(revs[1], r2));
+	}
+	if (!str::stoi(revs[0], r2)) {
+		return false;
+	}
+	*r1 = *r2 - 1;
+	return true;
 }
 
 // Main Thread function for fetching diffstats from a job queue
 void SvnDiffstatThread::run()
 {
 	apr_pool_t *pool = svn_pool_create(d->pool);
-	std::string revision;
-	while (m_queue->getArg(&revision)) {
+
+	// Keep an auxiliary RA session for calls during replays. Local
+	// repositories are read from the filesystem instead.
+	svn_ra_session_t *aux = NULL;
+	svn_error_t *err = NULL;
+	if (d->fs != NULL) {
+		m_replay = false;
+	} else if ((err = d->acquire(&aux)) != NULL) {
+		PDEBUG << "Unable to open extra RA session, not replaying: " << SvnConnection::strerr(err) << endl;
+		svn_error_clear(err);
+		aux = NULL;
+		m_replay = false;
+	}
+
+	std::vector<std::string> revisions;
+	while (m_queue->getArgs(&revisions, 32)) {
 		apr_pool_t *subpool = svn_pool_create(pool);
 
-		std::vector<std::string> revs = str::split(revision, ":");
-		svn_revnum_t r1, r2;
-		if (revs.size() > 1) {
-			if (!str::stoi(revs[0], &r1) || !str::stoi(revs[1], &r2)) {
-				goto parse_error;
+		// Group single revisions into contiguous ranges that can be
+		// replayed. Everything else will be diffed separately.
+		std::vector<std::string> single;
+		std::vector<std::map<svn_revnum_t, std::string> > ranges;
+		for (size_t i = 0; i < revisions.size(); i++) {
+			svn_revnum_t r1, r2;
+			if (!m_replay || !parse(revisions[i], &r1, &r2) || r1 != r2 - 1 || r2 <= 0) {
+				single.push_back(revisions[i]);
+			} else if (!ranges.empty() && ranges.back().rbegin()->first == r2 - 1) {
+				ranges.back()[r2] = revisions[i];
+			} else {
+				ranges.push_back(std::map<svn_revnum_t, std::string>());
+				ranges.back()[r2] = revisions[i];
 			}
-		} else {
-			if (!str::stoi(revs[0], &r2)) {
-				goto parse_error;
+		}
+
+		for (size_t i = 0; i < ranges.size(); i++) {
+			std::vector<svn_revnum_t> finished;
+			if (m_replay) {
+				finished = replay(ranges[i], aux, subpool);
+			}
+			std::sort(finished.begin(), finished.end());
+			for (std::map<svn_revnum_t, std::string>::const_iterator it = ranges[i].begin(); it != ranges[i].end(); ++it) {
+				if (!std::binary_search(finished.begin(), finished.end(), it->first)) {
+					single.push_back(it->second);
+				}
 			}
-			r1 = r2 - 1;
 		}
 
-		try {
-			DiffstatPtr stat = diffstat(d, r1, r2, subpool);
-			m_queue->done(revision, stat);
-		} catch (const PepperException &ex) {
-			Logger::err() << "Error: " << ex.where() << ": " << ex.what() << endl;
-			m_queue->failed(revision);
+		for (size_t i = 0; i < single.size(); i++) {
+			fetch(single[i], subpool);
 		}
-		goto next;
 
-parse_error:
-		PEX(std::string("Error parsing revision number ") + revision);
-		m_queue->failed(revision);
-next:
 		svn_pool_destroy(subpool);
 	}
+	d->release(aux);
 	svn_pool_destroy(pool);
 }
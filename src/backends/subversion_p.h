@@ -15,16 +15,25 @@
 #define SUBVERSION_BACKEND_P_H_
 
 
+#include <atomic>
+
 #include <apr_pools.h>
 #include <svn_client.h>
+#include <svn_fs.h>
 #include <svn_ra.h>
+#include <svn_repos.h>
 
 #include "diffstat.h"
 
 template <typename Arg, typename Result> class JobQueue;
 
 
-// Repository connection
+// Repository connection. Besides its main RA session, a connection hands
+// out auxiliary sessions for calls made during diffs and replays. They are
+// kept open after being released, so the setup (and the authentication
+// for remote repositories) only happens once per connection.
+// Local repositories are additionally opened through the filesystem layer,
+// which is used for fetching diffstats without any RA overhead.
 class SvnConnection
 {
 	public:
@@ -33,10 +42,17 @@ class SvnConnection
 
 		void open(const std::string &url, const std::map<std::string, std::string> &options);
 		void open(SvnConnection *parent);
+		svn_error_t *acquire(svn_ra_session_t **session);
+		void release(svn_ra_session_t *session);
 		static std::string strerr(svn_error_t *err);
+
+		void cancel(bool cancel = true);
+		bool cancelled() const;
 		
 	private:
 		void init();
+		void openLocal();
+		static svn_error_t *checkCancel(void *baton);
 
 		template <typename T>
 		static T hashget(apr_hash_t *hash, const char *key)
@@ -49,6 +65,15 @@ class SvnConnection
 		svn_client_ctx_t *ctx;
 		svn_ra_session_t *ra;
 		const char *url, *root, *prefix;
+		svn_repos_t *repos; // Only set for local repositories
+		svn_fs_t *fs;
+		std::vector<std::string> excludes; // Paths that are skipped during diffs
+		bool approximate; // Estimate diffstats from delta windows
+
+	private:
+		std::vector<svn_ra_session_t *> m_idle; // Auxiliary sessions for reuse
+		std::atomic<bool> m_cancelFlag;
+		std::atomic<bool> *m_cancel; // Shared with child connections
 };
 
 
@@ -60,13 +85,21 @@ class SvnDiffstatThread : public sys::parallel::Thread
 		~SvnDiffstatThread();
 
 		static DiffstatPtr diffstat(SvnConnection *c, svn_revnum_t r1, svn_revnum_t r2, apr_pool_t *pool);
+		static DiffstatPtr localDiffstat(SvnConnection *c, svn_revnum_t revision, apr_pool_t *pool);
+		static DiffstatPtr collect(DiffParser *parser, const std::map<std::string, Diffstat::Stat> &stats);
 
 	protected:
 		void run();
 
+	private:
+		std::vector<svn_revnum_t> replay(const std::map<svn_revnum_t, std::string> &ids, svn_ra_session_t *aux, apr_pool_t *pool);
+		void fetch(const std::string &revision, apr_pool_t *pool);
+		static bool parse(const std::string &revision, svn_revnum_t *r1, svn_revnum_t *r2);
+
 	private:
 		SvnConnection *d;
 		JobQueue<std::string, DiffstatPtr> *m_queue;
+		bool m_replay;
 };
 
 
@@ -13,7 +13,9 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cstring>
+#include <utility>
 
 #ifdef HAVE_LIBZ
  #include <zlib.h>
@@ -54,18 +56,22 @@ public:
 	FILE *f;
 };
 
-// RawStream implementation for memory buffers
+// RawStream implementation for memory buffers. The stream either owns its
+// data or provides a read-only view on external memory.
 class MemoryStream : public BStream::RawStream
 {
 public:
-	MemoryStream() : p(0), size(0), asize(512) {
-		m_buffer = new char[asize];
+	MemoryStream() : m_view(NULL), p(0), size(0) {
+		m_data.reserve(512);
 	}
-	MemoryStream(const char *data, size_t n) : p(0), size(n) {
-		m_buffer = new char[n];
-		memcpy(m_buffer, data, n);
+	MemoryStream(const char *data, size_t n, bool copy = true) : m_view(NULL), p(0), size(n) {
+		if (copy) {
+			m_data.assign(data, data + n);
+		} else {
+			m_view = data;
+		}
 	}
-	~MemoryStream() { delete[] m_buffer;} 
+	MemoryStream(std::vector<char> &&data) : m_data(std::move(data)), m_view(NULL), p(0), size(m_data.size()) { }
 
 	bool ok() const {
 		return true;
@@ -88,29 +94,43 @@ public:
 			return 0;
 		}
 		size_t nr = std::min(size - p, n);
-		memcpy(ptr, m_buffer + p, nr);
+		memcpy(ptr, buffer() + p, nr);
 		p += nr;
 		return nr;
 	}
 	ssize_t write(const void *ptr, size_t n) {
-		if (p + n >= asize) {
-			size_t oldsize = size;
-			do {
-				asize *= 2;
-			} while (p + n >= asize);
-			char *newbuf = new char[asize];
-			memcpy(newbuf, m_buffer, oldsize);
-			delete[] m_buffer;
-			m_buffer = newbuf;
+		if (m_view != NULL) {
+			return -1;
 		}
-		memcpy(m_buffer + p, ptr, n);
+		const char *data = (const char *)ptr;
+		size_t overlap = std::min(m_data.size() - p, n);
+		std::copy(data, data + overlap, m_data.begin() + p);
+		m_data.insert(m_data.end(), data + overlap, data + n);
 		p += n;
-		size += n;
+		size = m_data.size();
 		return n;
 	}
 
-	char *m_buffer;
-	size_t p, size, asize;
+	const char *view(size_t *n) {
+		const char *data = buffer() + p;
+		*n = size - p;
+		p = size;
+		return data;
+	}
+
+	inline const char *buffer() const { return (m_view ? m_view : m_data.data()); }
+
+	// Moves the owned data out of the stream, leaving it empty
+	std::vector<char> release() {
+		std::vector<char> data;
+		data.swap(m_data);
+		p = size = 0;
+		return data;
+	}
+
+	std::vector<char> m_data;
+	const char *m_view;
+	size_t p, size;
 };
 
 #ifdef HAVE_LIBZ
@@ -151,25 +171,83 @@ public:
 
 #endif // HAVE_LIBZ
 
+#define READ_BUFFER_SIZE 4096
+
 
 // Constructors
 BIStream::BIStream(const std::string &path)
 #if (__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 3)
-	: BStream(new FileStream(fopen(path.c_str(), "rbm")))
+	: BStream(new FileStream(fopen(path.c_str(), "rbm"))),
 #else
-	: BStream(new FileStream(fopen(path.c_str(), "rb")))
+	: BStream(new FileStream(fopen(path.c_str(), "rb"))),
 #endif
+	  m_cur(NULL), m_end(NULL)
 {
 }
 
 BIStream::BIStream(FILE *f)
-	: BStream(new FileStream(f))
+	: BStream(new FileStream(f)), m_cur(NULL), m_end(NULL)
 {
 }
 
 BIStream::BIStream(RawStream *stream)
-	: BStream(stream)
+	: BStream(stream), m_cur(NULL), m_end(NULL)
+{
+}
+
+// Moves to the given offset, discarding the current window
+bool BIStream::seek(size_t offset)
 {
+	m_cur = m_end = NULL;
+	return BStream::seek(offset);
+}
+
+// Reads up to n bytes, starting with the current window
+ssize_t BIStream::read(void *ptr, size_t n)
+{
+	char *out = (char *)ptr;
+	size_t nr = 0;
+	while (nr < n) {
+		if (m_cur == m_end) {
+			// Large reads of buffered streams bypass the read buffer
+			if (n - nr >= READ_BUFFER_SIZE && !m_buffer.empty()) {
+				ssize_t r = BStream::read(out + nr, n - nr);
+				return nr + (r > 0 ? r : 0);
+			}
+			if (!fill()) {
+				break;
+			}
+		}
+		size_t chunk = std::min(size_t(m_end - m_cur), n - nr);
+		memcpy(out + nr, m_cur, chunk);
+		m_cur += chunk;
+		nr += chunk;
+	}
+	return nr;
+}
+
+// Provides a new window on the remaining data. Returns false at the end of
+// the stream.
+bool BIStream::fill()
+{
+	if (m_stream == NULL) {
+		return false;
+	}
+
+	size_t n;
+	const char *data = (m_buffer.empty() ? m_stream->view(&n) : NULL);
+	if (data == NULL) {
+		m_buffer.resize(READ_BUFFER_SIZE);
+		ssize_t r = m_stream->read(&m_buffer[0], m_buffer.size());
+		if (r <= 0) {
+			return false;
+		}
+		data = &m_buffer[0];
+		n = r;
+	}
+	m_cur = data;
+	m_end = data + n;
+	return (n > 0);
 }
 
 BOStream::BOStream(const std::string &path, bool append)
@@ -182,13 +260,18 @@ BOStream::BOStream(RawStream *stream)
 {
 }
 
-MIStream::MIStream(const char *data, size_t n)
-	: BIStream(new MemoryStream(data, n))
+MIStream::MIStream(const char *data, size_t n, bool copy)
+	: BIStream(new MemoryStream(data, n, copy))
 {
 }
 
 MIStream::MIStream(const std::vector<char> &data)
-	: BIStream(new MemoryStream(&data[0], data.size()))
+	: BIStream(new MemoryStream(data.data(), data.size()))
+{
+}
+
+MIStream::MIStream(std::vector<char> &&data)
+	: BIStream(new MemoryStream(std::move(data)))
 {
 }
 
@@ -197,11 +280,22 @@ MOStream::MOStream()
 {
 }
 
-// Returns the stream's internal buffer
+// Returns a copy of the stream's internal buffer
 std::vector<char> MOStream::data() const
 {
-	MemoryStream *ms = (MemoryStream *)m_stream;
-	return std::vector<char>(ms->m_buffer, ms->m_buffer + ms->size);
+	return ((MemoryStream *)m_stream)->m_data;
+}
+
+// Returns the stream's internal buffer without copying it
+const std::vector<char> &MOStream::buffer() const
+{
+	return ((MemoryStream *)m_stream)->m_data;
+}
+
+// Moves the internal buffer out of the stream, which is empty afterwards
+std::vector<char> MOStream::release()
+{
+	return ((MemoryStream *)m_stream)->release();
 }
 
 
@@ -215,58 +309,13 @@ GZIStream::GZIStream(const std::string &path)
 {
 }
 
-#ifdef HAVE_LIBZ
-
-// Single-linked buffer
-struct LBuffer {
-	char *data;
-	int size;
-	LBuffer *next;
-	LBuffer() : data(NULL), size(0), next(NULL) { }
-	~LBuffer() { delete[] data; }
-};
-
-#endif // HAVE_LIBZ
-
-// Constructor
+// Constructor. Appending adds a new gzip member to the file, which is
+// read transparently together with the previous ones.
 GZOStream::GZOStream(const std::string &path, bool append)
 #ifdef HAVE_LIBZ
-	: BOStream(append ? NULL : new GzStream(gzopen(path.c_str(), "wb")))
+	: BOStream(new GzStream(gzopen(path.c_str(), (append ? "ab" : "wb"))))
 #else
 	: BOStream(path, append)
 #endif
 {
-#ifdef HAVE_LIBZ
-	// Appending to gzipped files does not work. Instead, read the whole
-	// file and re-write it.
-	if (append) {
-		LBuffer *buf = NULL, *first = NULL;
-		gzFile in = gzopen(path.c_str(), "rb");
-		if (in) {
-			while (!gzeof(in)) {
-				if (buf) {
-					buf->next = new LBuffer();
-					buf = buf->next;
-				} else {
-					buf = new LBuffer();
-					first = buf;
-				}
-				buf->data = new char[4096];
-				buf->size = gzread(in, buf->data, 4096);
-			}
-			gzclose(in);
-		}
-
-		gzFile gz = gzopen(path.c_str(), "wb");
-		buf = first;
-		while (buf != NULL) {
-			gzwrite(gz, buf->data, buf->size);
-			LBuffer *tmp = buf;
-			buf = buf->next;
-			delete tmp;
-		}
-
-		m_stream = new GzStream(gz);
-	}
-#endif // HAVE_LIBZ
 }
@@ -17,6 +17,7 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -51,6 +52,10 @@ class BStream
 				virtual bool seek(size_t offset) = 0;
 				virtual ssize_t read(void *ptr, size_t n) = 0;
 				virtual ssize_t write(const void *ptr, size_t n) = 0;
+
+				// Returns the remaining data if it is available in memory and
+				// moves to the end, or NULL if the stream needs to be read
+				virtual const char *view(size_t *n) { (void)n; return NULL; }
 		};
 
 		BStream(RawStream *stream) : m_stream(stream) { }
@@ -63,38 +68,51 @@ class BStream
 		inline ssize_t read(void *ptr, size_t n) { return (m_stream ? m_stream->read(ptr, n) : 0); }
 		inline ssize_t write(const void *ptr, size_t n) { return (m_stream ? m_stream->write(ptr, n) : 0); }
 
-		// Byte swapping (from Qt)
+		// Byte swapping
 		static inline uint32_t bswap(uint32_t source) {
+#ifdef __GNUC__
+			return __builtin_bswap32(source);
+#else
 			return 0
 				| ((source & 0x000000ff) << 24) 
 				| ((source & 0x0000ff00) << 8)
 				| ((source & 0x00ff0000) >> 8)
 				| ((source & 0xff000000) >> 24);
+#endif
 		}
 		static inline uint64_t bswap(uint64_t source) {
-			char *t = (char *)&source;
-			std::swap(t[0], t[7]), std::swap(t[1], t[6]);
-			std::swap(t[2], t[5]), std::swap(t[3], t[4]);
-			return source;
+#ifdef __GNUC__
+			return __builtin_bswap64(source);
+#else
+			return (uint64_t(bswap(uint32_t(source))) << 32) | bswap(uint32_t(source >> 32));
+#endif
 		}
 
 	protected:
 		RawStream *m_stream;
 };
 
-// Input stream
+// Input stream. Data is consumed from a window that either points to the
+// memory of the underlying stream or to an internal read buffer, so most
+// fields are decoded without calling into the raw stream.
 class BIStream : public BStream
 {
 	public:
 		BIStream(const std::string &path);
 		BIStream(FILE *f);
 
+		inline bool eof() const { return (m_cur == m_end && BStream::eof()); }
+		inline size_t tell() const { return BStream::tell() - (m_end - m_cur); }
+		bool seek(size_t offset);
+		ssize_t read(void *ptr, size_t n);
+
 		BIStream &operator>>(char &c);
 		BIStream &operator>>(uint32_t &i);
 		BIStream &operator>>(uint64_t &i);
 		inline BIStream &operator>>(int64_t &i) { return (*this >> reinterpret_cast<uint64_t &>(i)); }
 		BIStream &operator>>(std::string &s);
 		BIStream &operator>>(std::vector<char> &v);
+		BIStream &readVarint(uint64_t &i);
 		template<typename T> BIStream &operator>>(std::vector<T> &v) {
 			uint32_t size;
 			(*this) >> size;
@@ -107,6 +125,13 @@ class BIStream : public BStream
 
 	protected:
 		BIStream(RawStream *stream);
+
+	private:
+		bool fill();
+
+	private:
+		const char *m_cur, *m_end;
+		std::vector<char> m_buffer;
 };
 
 // Output stream
@@ -122,6 +147,7 @@ class BOStream : public BStream
 		inline BOStream &operator<<(int64_t i) { return (*this << static_cast<uint64_t>(i)); }
 		BOStream &operator<<(const std::string &s);
 		BOStream &operator<<(const std::vector<char> &v);
+		BOStream &writeVarint(uint64_t i);
 		template<typename T> BOStream &operator<<(const std::vector<T> &v) {
 			(*this) << (uint32_t)v.size();
 			for (uint32_t i = 0; i < v.size(); i++) {
@@ -134,12 +160,14 @@ class BOStream : public BStream
 		BOStream(RawStream *stream);
 };
 
-// Memory input stream
+// Memory input stream. With copy = false, the stream reads directly from
+// the given buffer, which must outlive the stream.
 class MIStream : public BIStream
 {
 	public:
-		MIStream(const char *data, size_t n);
+		MIStream(const char *data, size_t n, bool copy = true);
 		MIStream(const std::vector<char> &data);
+		MIStream(std::vector<char> &&data);
 };
 
 // Memory output stream
@@ -149,6 +177,8 @@ class MOStream : public BOStream
 		MOStream();
 
 		std::vector<char> data() const;
+		const std::vector<char> &buffer() const;
+		std::vector<char> release();
 };
 
 // Compressed input stream
@@ -199,13 +229,36 @@ inline BOStream &BOStream::operator<<(const std::vector<char> &v) {
 	return *this;
 }
 
+// Writes an unsigned LEB128 integer: 7 bits per byte, least significant
+// group first, with the high bit set on all but the last byte
+inline BOStream &BOStream::writeVarint(uint64_t i) {
+	char buffer[10];
+	size_t n = 0;
+	while (i >= 0x80) {
+		buffer[n++] = char(i | 0x80);
+		i >>= 7;
+	}
+	buffer[n++] = char(i);
+	ASSERT_WRITE(buffer, n);
+	return *this;
+}
+
 inline BIStream &BIStream::operator>>(char &c) {
-	ASSERT_READ((char *)&c, 1);
+	if (m_cur < m_end) {
+		c = *m_cur++;
+	} else {
+		ASSERT_READ((char *)&c, 1);
+	}
 	return *this;
 }
 
 inline BIStream &BIStream::operator>>(uint32_t &i) {
-	ASSERT_READ((char *)&i, 4);
+	if (m_end - m_cur >= 4) {
+		memcpy(&i, m_cur, 4);
+		m_cur += 4;
+	} else {
+		ASSERT_READ((char *)&i, 4);
+	}
 #ifndef WORDS_BIGENDIAN
 	i = bswap(i);
 #endif
@@ -213,7 +266,12 @@ inline BIStream &BIStream::operator>>(uint32_t &i) {
 }
 
 inline BIStream &BIStream::operator>>(uint64_t &i) {
-	ASSERT_READ((char *)&i, 8);
+	if (m_end - m_cur >= 8) {
+		memcpy(&i, m_cur, 8);
+		m_cur += 8;
+	} else {
+		ASSERT_READ((char *)&i, 8);
+	}
 #ifndef WORDS_BIGENDIAN
 	i = bswap(i);
 #endif
@@ -221,33 +279,34 @@ inline BIStream &BIStream::operator>>(uint64_t &i) {
 }
 
 inline BIStream &BIStream::operator>>(std::string &s) {
-	char buffer[120], *bptr = buffer;
-	char c;
 	s.clear();
 	do {
-		if (eof()) {
+		if (m_cur == m_end && !fill()) {
 			s.clear();
 			return *this;
 		}
-		(*this) >> c;
-		switch (c) {
-			case 0: break;
-			default: {
-				*bptr = c;
-				if (bptr-buffer == sizeof(buffer)-1) {
-					s.append(buffer, sizeof(buffer));
-					bptr = buffer;
-				} else {
-					++bptr;
-				}
-				continue;
-			}
+		const char *nul = (const char *)memchr(m_cur, '\0', m_end - m_cur);
+		if (nul != NULL) {
+			s.append(m_cur, nul - m_cur);
+			m_cur = nul + 1;
+			return *this;
 		}
-		break;
+		s.append(m_cur, m_end - m_cur);
+		m_cur = m_end;
 	} while (true);
+}
 
-	if (bptr != buffer) {
-		s.append(buffer, bptr-buffer);
+inline BIStream &BIStream::readVarint(uint64_t &i) {
+	i = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (m_cur == m_end && !fill()) {
+			break;
+		}
+		unsigned char c = (unsigned char)*m_cur++;
+		i |= uint64_t(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			break;
+		}
 	}
 	return *this;
 }
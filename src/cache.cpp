@@ -13,31 +13,173 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cstring>
 #include <fcntl.h>
+#include <set>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "bstream.h"
+#include "legacycache.h"
 #include "logger.h"
+#include "memstats.h"
 #include "options.h"
 #include "revision.h"
+#include "stats.h"
 #include "strlib.h"
+#include "tracer.h"
 #include "utils.h"
 
 #include "syslib/datetime.h"
-#include "syslib/fs.h"
+#include "syslib/parallel.h"
 #include "syslib/sigblock.h"
 
 #include "cache.h"
 
-#define CACHE_VERSION (uint32_t)5
-#define MAX_CACHEFILE_SIZE 4194304
+#define CACHE_VERSION (uint32_t)9
+#define CACHE_MAGIC "PCIX"
+#define INDEX_FILE "cache.index"
+#define MAX_SEGMENT_SIZE 16777216
+#define INDEX_HEADER_SIZE 16
+#define INDEX_RECORD_SIZE 44
+#define JOURNAL_FILE "cache.journal"
+#define JOURNAL_MAGIC "PCJL"
+#define JOURNAL_VERSION (uint32_t)1
+#define JOURNAL_HEADER_SIZE 8
+#define JOURNAL_MIN_MERGE 4096 // Journal entries that are always kept before merging
+#define JOURNAL_MERGE_RATIO 8 // The journal is merged when it exceeds a fraction of the index
+#define RECORD_HEADER_SIZE 8
+#define MIN_VERIFY_RECORDS 1024 // Minimum number of records per verification task
+#define COMPACT_DEAD_RATIO 0.5 // Fraction of unused data that triggers compaction when checking
+#define COMPACT_MIN_SIZE 4194304 // Smaller caches aren't compacted automatically
+#define DICT_FILE "codec.dict"
+#define DICT_SIZE 65536
+#define DICT_SAMPLES 4096 // Number of records for training a dictionary
+#define AUTHORS_FILE "authors.dict"
+#define LINK_PREFIX "#" // Index keys of shared diffstats
+
+
+namespace
+{
+
+// File name prefixes of the stores
+const char *storeNames[] = { "meta", "messages", "diffstats" };
+
+// Reads a big-endian 32-bit integer
+inline uint32_t readu32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+
+// Returns the path of a segment file
+inline std::string segmentPath(const std::string &dir, int store, uint32_t index)
+{
+	return str::printf("%s/%s.%u", dir.c_str(), storeNames[store], index);
+}
+
+// Copies records to the segment files of a store in another directory
+class SegmentWriter
+{
+	public:
+		SegmentWriter(const std::string &dir, int store) : m_dir(dir), m_store(store), m_out(NULL), m_segment(0), m_written(0) { }
+		~SegmentWriter() { delete m_out; }
+
+		void write(const std::vector<char> &data, uint32_t *segment, uint32_t *offset) {
+			if (m_out != NULL && m_out->tell() >= MAX_SEGMENT_SIZE) {
+				delete m_out;
+				m_out = NULL;
+				++m_segment;
+			}
+			if (m_out == NULL) {
+				m_out = new BOStream(segmentPath(m_dir, m_store, m_segment));
+			}
+			*segment = m_segment;
+			*offset = m_out->tell();
+			*m_out << (uint32_t)data.size() << utils::crc32c(data);
+			m_out->write(&data[0], data.size());
+			if (!m_out->ok()) {
+				throw PEX(str::printf("Unable to write to cache file: %s", segmentPath(m_dir, m_store, m_segment).c_str()));
+			}
+			m_written += RECORD_HEADER_SIZE + data.size();
+		}
+
+		size_t written() const { return m_written; }
+
+	private:
+		std::string m_dir;
+		int m_store;
+		BOStream *m_out;
+		uint32_t m_segment;
+		size_t m_written;
+};
+
+} // anonymous namespace
+
+
+// Holds the write lock of the cache directory
+class Cache::WriteLocker
+{
+	public:
+		WriteLocker(Cache *cache) : m_cache(cache) {
+			m_cache->lockWrites();
+		}
+		~WriteLocker() {
+			m_cache->unlockWrites();
+		}
+
+	private:
+		Cache *m_cache;
+};
+
+// Verifies a range of records while checking the cache
+class Cache::Verifier : public sys::parallel::Task
+{
+	public:
+		Verifier(const Cache *cache, int store, const std::vector<const char *> &records, size_t begin, size_t end, std::vector<char> *valid)
+			: m_cache(cache), m_store(store), m_records(records), m_begin(begin), m_end(end), m_valid(valid) {
+		}
+
+	protected:
+		void run() {
+			std::string id;
+			for (size_t i = m_begin; i < m_end; i++) {
+				(*m_valid)[i] = m_cache->verify(m_store, m_records[i], &id);
+			}
+		}
+
+	private:
+		const Cache *m_cache;
+		int m_store;
+		const std::vector<const char *> &m_records;
+		size_t m_begin, m_end;
+		std::vector<char> *m_valid;
+};
+
+
+// Constructs an index entry for the given revision
+Cache::Entry::Entry(const std::string &id)
+{
+	utils::sha1(id.data(), id.length(), key);
+}
+
+// Constructs an index entry from a record of the index file
+Cache::Entry::Entry(const char *record)
+{
+	memcpy(key, record, sizeof(key));
+	for (int i = 0; i < NumStores; i++) {
+		locations[i].segment = readu32(record + 20 + 8*i);
+		locations[i].offset = readu32(record + 24 + 8*i);
+	}
+}
 
 
 // Constructor
 Cache::Cache(Backend *backend, const Options &options)
-	: AbstractCache(backend, options), m_iout(NULL), m_cout(NULL),
-	  m_cin(0), m_coindex(0), m_ciindex(0), m_loaded(false), m_lock(-1)
+	: AbstractCache(backend, options), m_loaded(false), m_lock(-1), m_writing(0), m_size(0),
+	  m_codec(Codec::parse(options.cacheCodec())), m_memory(MemStats::CacheIndex)
 {
 
 }
@@ -46,19 +188,44 @@ Cache::Cache(Backend *backend, const Options &options)
 Cache::~Cache()
 {
 	flush();
+	closeSegments();
 	unlock();
 }
 
-// Flushes and closes the cache streams
+// Writes pending data and merges new revisions into the index file
 void Cache::flush()
 {
 	PTRACE << "Flushing cache..." << endl;
-	delete m_iout;
-	m_iout = NULL;
-	delete m_cout;
-	m_cout = NULL;
-	delete m_cin;
-	m_cin = NULL;
+	sync();
+
+	for (int i = 0; i < NumStores; i++) {
+		delete m_stores[i].out;
+		m_stores[i].out = NULL;
+	}
+
+	if (!m_added.empty()) {
+		// Other processes may have updated the index in the meantime
+		WriteLocker locker(this);
+		reloadIndex();
+
+		std::vector<Entry> added;
+		added.reserve(m_added.size());
+		for (std::map<std::string, Entry>::const_iterator it = m_added.begin(); it != m_added.end(); ++it) {
+			added.push_back(it->second);
+		}
+		std::sort(added.begin(), added.end());
+
+		// Small batches of new revisions are appended to the journal, so the
+		// index file doesn't have to be rewritten for each of them
+		size_t limit = std::max((size_t)JOURNAL_MIN_MERGE, m_size / JOURNAL_MERGE_RATIO);
+		if (sys::fs::fileExists(cacheDir() + "/" INDEX_FILE) && m_journal.size() + added.size() <= limit) {
+			appendJournal(added);
+		} else {
+			writeIndex(entries(added));
+		}
+		m_added.clear();
+		openIndex();
+	}
 	PTRACE << "Cache flushed" << endl;
 }
 
@@ -69,159 +236,552 @@ bool Cache::lookup(const std::string &id)
 		load();
 	}
 
-	return (m_index.find(id) != m_index.end());
+	Entry e;
+	return find(id, &e);
 }
 
 // Adds the revision to the cache
 void Cache::put(const std::string &id, const Revision &rev)
 {
+	PTRACE_SCOPE("cache.put");
 	if (!m_loaded) {
 		load();
 	}
 
 	// Defer any signals while writing to the cache
 	SIGBLOCK_DEFER();
+	WriteLocker locker(this);
 
-	// Add revision to cache
-	std::string dir = m_opts.cacheDir() + "/" + uuid(), path;
-	if (m_cout == NULL) {
-		m_coindex = 0;
-		do {
-			path = str::printf("%s/cache.%u", dir.c_str(), m_coindex);
-			if (!sys::fs::fileExists(path) || sys::fs::filesize(path) < MAX_CACHEFILE_SIZE) {
-				break;
-			}
-			++m_coindex;
-		} while (true);
+	// Each record stores the ID, followed by the data. Messages and
+	// diffstats are compressed by append().
+	Entry e(id);
+	{
+		MOStream rout;
+		rout << id;
+		rev.writeMeta(rout, &m_authors);
+		e.locations[MetaStore] = append(MetaStore, rout.buffer());
+	}
+	{
+		MOStream rout;
+		rout << id << rev.m_message;
+		e.locations[MessageStore] = append(MessageStore, rout.buffer());
+	}
+	{
+		MOStream rout;
+		rout << id;
+		rev.m_diffstat->write(rout);
+		e.locations[DiffstatStore] = append(DiffstatStore, rout.buffer());
+	}
+
+	m_added[id] = e;
+	account();
+}
 
-		delete m_cout;
-		m_cout = new BOStream(path, true);
-	} else if (m_cout->tell() >= MAX_CACHEFILE_SIZE) {
-		delete m_cout;
-		path = str::printf("%s/cache.%u", dir.c_str(), ++m_coindex);
-		m_cout = new BOStream(path, true);
+// Adds the given revisions to the cache, acquiring the write lock only once
+void Cache::putMany(const std::vector<Revision *> &revs)
+{
+	PTRACE_SCOPE("cache.putMany");
+	if (!m_loaded) {
+		load();
 	}
 
-	uint32_t offset = m_cout->tell();
-	MOStream rout;
-	rev.write03(rout);
-	std::vector<char> compressed = utils::compress(rout.data());
-	*m_cout << compressed;
+	WriteLocker locker(this);
+	for (size_t i = 0; i < revs.size(); i++) {
+		put(revs[i]->id(), *revs[i]);
+	}
+}
 
-	// Add revision to index
-	if (m_iout == NULL) {
-		if (sys::fs::exists(dir + "/index")) {
-			m_iout = new GZOStream(dir + "/index", true);
-		} else {
-			m_iout = new GZOStream(dir + "/index", false);
-			// Version number
-			*m_iout << CACHE_VERSION;
-		}
+// Loads the given parts of a revision from the cache
+Revision *Cache::get(const std::string &id, int parts)
+{
+	PTRACE_SCOPE("cache.get");
+	if (!m_loaded) {
+		load();
 	}
-	*m_iout << id;
-	*m_iout << m_coindex << offset << utils::crc32(compressed);
 
-	// Update cached index
-	m_index[id] = std::pair<uint32_t, uint32_t>(m_coindex, offset);
+	Entry e;
+	if (!find(id, &e)) {
+		throw PEX(str::printf("Revision %s not found in cache", id.c_str()));
+	}
+	return read(id, e, parts);
 }
 
-// Loads a revision from the cache
-Revision *Cache::get(const std::string &id)
+// Loads the given parts of multiple revisions from the cache, reading the
+// segments sequentially
+std::vector<Revision *> Cache::getMany(const std::vector<std::string> &ids, int parts)
 {
+	PTRACE_SCOPE("cache.getMany");
 	if (!m_loaded) {
 		load();
 	}
 
-	std::string dir = cacheDir();
-	std::pair<uint32_t, uint32_t> offset = m_index[id];
-	std::string path = str::printf("%s/cache.%u", dir.c_str(), offset.first);
-	if (m_cin == NULL || offset.first != m_ciindex) {
-		delete m_cin;
-		m_cin = new BIStream(path);
-		m_ciindex = offset.first;
-		if (!m_cin->ok()) {
-			throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	// Order by the first store that will be read
+	int store = MetaStore;
+	while (store < DiffstatStore && !(parts & (1 << store))) {
+		++store;
+	}
+
+	std::vector<std::pair<Location, size_t> > order(ids.size());
+	std::vector<Entry> entries(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (!find(ids[i], &entries[i])) {
+			throw PEX(str::printf("Revision %s not found in cache", ids[i].c_str()));
 		}
+		order[i] = std::make_pair(entries[i].locations[store], i);
 	}
-	if (!m_cin->seek(offset.second)) {
-		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	std::sort(order.begin(), order.end());
+
+	std::vector<Revision *> revs(ids.size(), (Revision *)NULL);
+	for (size_t i = 0; i < order.size(); i++) {
+		size_t j = order[i].second;
+		revs[j] = read(ids[j], entries[j], parts);
 	}
+	return revs;
+}
 
+// Parses the requested parts of a revision directly from the mapped
+// segments. Revisions without diffstat will fetch it on demand.
+Revision *Cache::read(const std::string &id, const Entry &e, int parts)
+{
 	Revision *rev = new Revision(id);
-	std::vector<char> data;
-	*m_cin >> data;
-	data = utils::uncompress(data);
-	if (data.empty()) {
-		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	if (!(parts & Revision::DiffstatPart)) {
+		rev->m_diffstat.reset();
 	}
-	MIStream rin(data);
-	if (!rev->load03(rin)) {
-		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+
+	for (int i = 0; i < NumStores; i++) {
+		if (!(parts & (1 << i))) {
+			continue;
+		}
+
+		uint32_t length;
+		const char *data = payload(i, id, e.locations[i], &length);
+		if (data == NULL || !parse(i, data, length, rev)) {
+			delete rev;
+			throw PEX(str::printf("Unable to read from cache file: %s", segmentPath(cacheDir(), i, e.locations[i].segment).c_str()));
+		}
 	}
 	return rev;
 }
 
-// Loads the index file
+// Parses the payload of a record from the given store into the revision
+bool Cache::parse(int store, const char *data, size_t length, Revision *rev) const
+{
+	std::vector<char> buffer;
+	Stats::add(Stats::CacheBytesRead, length);
+	if (store != MetaStore && !m_codec.decode(data, length, &buffer, &data, &length)) {
+		return false;
+	}
+	if (!buffer.empty()) {
+		Stats::add(Stats::CacheBytesDecoded, length);
+	}
+
+	MIStream rin(data, length, false);
+	switch (store) {
+		case MetaStore:
+			return rev->loadMeta(rin, &m_authors);
+		case MessageStore:
+			rin >> rev->m_message;
+			return rin.ok();
+		case DiffstatStore:
+			return (rev->m_diffstat->load(rin) && rin.ok());
+		default:
+			break;
+	}
+	return false;
+}
+
+// Orders index entries by the position of their meta-data records
+bool Cache::writeOrder(const Entry &a, const Entry &b)
+{
+	return (a.locations[MetaStore] < b.locations[MetaStore]);
+}
+
+// Checks the CRC and payload of the record at the given address, storing
+// the revision ID
+bool Cache::verify(int store, const char *record, std::string *id) const
+{
+	uint32_t length = readu32(record), crc = readu32(record + 4);
+	const char *data = record + RECORD_HEADER_SIZE;
+	size_t idlen = strnlen(data, length);
+	id->assign(data, idlen);
+	if (idlen == 0 || idlen >= length || utils::crc32c(data, length) != crc) {
+		return false;
+	}
+	Revision rev(*id);
+	return parse(store, data + idlen + 1, length - idlen - 1, &rev);
+}
+
+// Opens the index file, importing old caches if necessary
 void Cache::load()
 {
 	std::string path = cacheDir();
 	PDEBUG << "Using cache dir: " << path << endl;
 
-	m_index.clear();
 	m_loaded = true;
 
+	recover();
 	bool created;
 	checkDir(path, &created);
 	lock();
+	m_authors.open(path + "/" AUTHORS_FILE);
 	if (created) {
 		return;
 	}
+	loadDictionary();
 
-	// For git repositories, the hardest part is calling uuid()
 	sys::datetime::Watch watch;
 
-	GZIStream *in = new GZIStream(path+"/index");
-	if (!in->ok()) {
-		Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
+	if (!sys::fs::fileExists(path + "/" INDEX_FILE)) {
+		// Converting the cache requires exclusive access
+		bool legacy = LegacyCache::exists(path);
+		bool segments = (!legacy && sys::fs::fileExists(segmentPath(path, MetaStore, 0)));
+		if (legacy || segments) {
+			lock(true);
+		}
+		if (legacy) {
+			import();
+		} else if (segments) {
+			rebuildIndex();
+		} else {
+			Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
+		}
+		lock();
 		return;
 	}
 
-	uint32_t version;
-	*in >> version;
-	switch (checkVersion(version)) {
-		case OutOfDate:
-			delete in;
-			throw PEX(str::printf("Cache is out of date - please run the check_cache report", version));
-		case UnknownVersion:
-			delete in;
-			throw PEX(str::printf("Unknown cache version number %u - please run the check_cache report", version));
-		default:
-			break;
+	openIndex();
+	Logger::info() << "Cache: Opened index with " << m_size + m_journal.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+}
+
+// Maps the index file into memory
+void Cache::openIndex()
+{
+	std::string path = cacheDir() + "/" INDEX_FILE;
+	m_size = 0;
+	m_index.open(path);
+
+	const char *data = m_index.data();
+	if (m_index.size() < INDEX_HEADER_SIZE || memcmp(data, CACHE_MAGIC, 4) != 0) {
+		m_index.close();
+		throw PEX(str::printf("Cache index %s is corrupted - please run the check_cache report", path.c_str()));
+	}
+	uint32_t version = readu32(data + 4);
+	if (version != CACHE_VERSION) {
+		m_index.close();
+		throw PEX(str::printf("Unknown cache version number %u - please run the check_cache report", version));
 	}
+	uint32_t count = readu32(data + 8);
+	if (m_index.size() != INDEX_HEADER_SIZE + (size_t)count * INDEX_RECORD_SIZE) {
+		m_index.close();
+		throw PEX(str::printf("Cache index %s is corrupted - please run the check_cache report", path.c_str()));
+	}
+	m_size = count;
+	openJournal();
+	account();
+}
+
+// Maps the current index file, which may have been replaced by another
+// process
+void Cache::reloadIndex()
+{
+	if (sys::fs::fileExists(cacheDir() + "/" INDEX_FILE)) {
+		openIndex();
+	} else {
+		m_index.close();
+		m_size = 0;
+		m_journal.clear();
+		account();
+	}
+}
+
+// Reads the entries that have been appended to the journal file since the
+// index file has been written. Later entries replace earlier ones.
+void Cache::openJournal()
+{
+	m_journal.clear();
+	std::string path = cacheDir() + "/" JOURNAL_FILE;
+	if (!sys::fs::fileExists(path)) {
+		return;
+	}
+
+	sys::fs::MappedFile file(path);
+	if (file.size() < JOURNAL_HEADER_SIZE) {
+		return; // Interrupted while creating the journal
+	} else if (memcmp(file.data(), JOURNAL_MAGIC, 4) != 0 || readu32(file.data() + 4) != JOURNAL_VERSION) {
+		throw PEX(str::printf("Cache journal %s is corrupted - please run the check_cache report", path.c_str()));
+	}
+
+	// A partial record at the end has been left by an interrupted flush
+	size_t count = (file.size() - JOURNAL_HEADER_SIZE) / INDEX_RECORD_SIZE;
+	std::vector<Entry> entries;
+	entries.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		entries.push_back(Entry(file.data() + JOURNAL_HEADER_SIZE + i * INDEX_RECORD_SIZE));
+	}
+	std::stable_sort(entries.begin(), entries.end());
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (!m_journal.empty() && memcmp(m_journal.back().key, entries[i].key, sizeof(entries[i].key)) == 0) {
+			m_journal.back() = entries[i];
+		} else {
+			m_journal.push_back(entries[i]);
+		}
+	}
+}
+
+// Appends the given sorted entries to the journal file
+void Cache::appendJournal(const std::vector<Entry> &entries)
+{
+	// Defer any signals while writing to the cache
+	SIGBLOCK_DEFER();
+
+	std::string path = cacheDir() + "/" JOURNAL_FILE;
+	size_t size = (sys::fs::fileExists(path) ? sys::fs::filesize(path) : 0);
+	size_t valid = (size < JOURNAL_HEADER_SIZE ? 0 : size - (size - JOURNAL_HEADER_SIZE) % INDEX_RECORD_SIZE);
+	if (valid != size) {
+		// Drop the partial record of an interrupted flush
+		if (::truncate(path.c_str(), valid) != 0) {
+			throw PEX_ERRNO();
+		}
+		size = valid;
+	}
+
+	BOStream out(path, true);
+	if (size == 0) {
+		out.write(JOURNAL_MAGIC, 4);
+		out << JOURNAL_VERSION;
+	}
+	for (size_t i = 0; i < entries.size(); i++) {
+		out.write(entries[i].key, sizeof(entries[i].key));
+		for (int j = 0; j < NumStores; j++) {
+			out << entries[i].locations[j].segment << entries[i].locations[j].offset;
+		}
+	}
+	if (!out.ok()) {
+		throw PEX(str::printf("Unable to write cache journal: %s", path.c_str()));
+	}
+}
+
+// Returns all entries of the index and the journal, merged with the given
+// sorted entries. Entries of the journal replace those of the index file,
+// and the given entries replace both.
+std::vector<Cache::Entry> Cache::entries(const std::vector<Entry> &added) const
+{
+	std::vector<Entry> recent = overlay(m_journal, added);
+	std::vector<Entry> entries;
+	entries.reserve(m_size + recent.size());
+	size_t i = 0, j = 0;
+	while (i < m_size || j < recent.size()) {
+		int cmp = (j >= recent.size() ? -1 : (i >= m_size ? 1 : memcmp(entry(i), recent[j].key, sizeof(recent[j].key))));
+		if (cmp < 0) {
+			entries.push_back(Entry(entry(i++)));
+		} else {
+			if (cmp == 0) {
+				++i; // Replaced
+			}
+			entries.push_back(recent[j++]);
+		}
+	}
+	return entries;
+}
+
+// Rebuilds the index file from the segment files
+void Cache::rebuildIndex()
+{
+	Logger::info() << "Cache: Rebuilding index file" << endl;
+	std::vector<Entry> entries;
+	scan(&entries);
+	std::sort(entries.begin(), entries.end());
+	writeIndex(entries);
+	openIndex();
+}
+
+// Reads all revisions from the segment files and returns the number of
+// corrupted or incomplete ones
+size_t Cache::scan(std::vector<Entry> *entries)
+{
+	std::map<std::string, Location> records[NumStores];
+	size_t corrupted = 0;
+	for (int i = 0; i < NumStores; i++) {
+		corrupted += scan(i, &records[i]);
+	}
+
+	// Only revisions with all parts are usable
+	for (std::map<std::string, Location>::const_iterator it = records[MetaStore].begin(); it != records[MetaStore].end(); ++it) {
+		Entry e(it->first);
+		e.locations[MetaStore] = it->second;
+		bool complete = true;
+		for (int i = MetaStore + 1; i < NumStores && complete; i++) {
+			std::map<std::string, Location>::iterator jt = records[i].find(it->first);
+			if (jt == records[i].end()) {
+				complete = false;
+			} else {
+				e.locations[i] = jt->second;
+				records[i].erase(jt);
+			}
+		}
+
+		if (complete) {
+			PTRACE << "Revision " << it->first << " ok" << endl;
+			entries->push_back(e);
+		} else {
+			PTRACE << "Revision " << it->first << " incomplete!" << endl;
+			std::cerr << "Cache: Revision " << it->first << " is incomplete, removing from index file" << std::endl;
+			++corrupted;
+		}
+	}
+	for (int i = MetaStore + 1; i < NumStores; i++) {
+		corrupted += records[i].size();
+	}
+	return corrupted;
+}
 
-	Logger::status() << "Loading cache index... " << ::flush;
+// Reads all records of a single store and returns the number of corrupted
+// ones. Later records override earlier ones with the same ID. The records
+// are verified in parallel by the global thread pool.
+size_t Cache::scan(int store, std::map<std::string, Location> *records)
+{
+	std::string path = cacheDir();
+	size_t corrupted = 0;
+
+	// Collect the record positions first, keeping all segments mapped
+	std::vector<sys::fs::MappedFile *> files;
+	std::vector<const char *> starts;
+	std::vector<Location> locations;
+	for (uint32_t segment = 0; sys::fs::fileExists(segmentPath(path, store, segment)); segment++) {
+		sys::fs::MappedFile *file = new sys::fs::MappedFile(segmentPath(path, store, segment));
+		files.push_back(file);
+		size_t offset = 0;
+		while (offset + RECORD_HEADER_SIZE <= file->size()) {
+			uint32_t length = readu32(file->data() + offset);
+			if (offset + RECORD_HEADER_SIZE + length > file->size()) {
+				PTRACE << "Truncated record in " << storeNames[store] << " segment " << segment << " at offset " << offset << endl;
+				++corrupted;
+				break;
+			}
+			starts.push_back(file->data() + offset);
+			Location l;
+			l.segment = segment;
+			l.offset = offset;
+			locations.push_back(l);
+			offset += RECORD_HEADER_SIZE + length;
+		}
+	}
+
+	std::vector<char> valid(starts.size(), 0);
+	sys::parallel::ThreadPool *pool = sys::parallel::ThreadPool::global();
+	size_t ntasks = std::max(size_t(1), std::min(size_t(pool->size()), starts.size() / MIN_VERIFY_RECORDS));
+	std::vector<Verifier *> tasks;
+	for (size_t i = 0; i < ntasks; i++) {
+		tasks.push_back(new Verifier(this, store, starts, (starts.size() * i) / ntasks, (starts.size() * (i+1)) / ntasks, &valid));
+		pool->submit(tasks.back());
+	}
+	for (size_t i = 0; i < tasks.size(); i++) {
+		tasks[i]->wait();
+		delete tasks[i];
+	}
+
+	// Merge in file order
+	for (size_t i = 0; i < starts.size(); i++) {
+		const char *data = starts[i] + RECORD_HEADER_SIZE;
+		std::string id(data, strnlen(data, readu32(starts[i])));
+		if (valid[i]) {
+			(*records)[id] = locations[i];
+		} else if (store != MetaStore && id.length() + 1 < readu32(starts[i]) && !Codec::supported(data + id.length() + 1, readu32(starts[i]) - id.length() - 1)) {
+			throw PEX(str::printf("Revision %s has been compressed with a codec that is not supported by this build", id.c_str()));
+		} else {
+			PTRACE << "Revision " << id << " corrupted!" << endl;
+			std::cerr << "Cache: Revision " << id << " is corrupted, removing from index file" << std::endl;
+			records->erase(id);
+			++corrupted;
+		}
+	}
+
+	for (size_t i = 0; i < files.size(); i++) {
+		delete files[i];
+	}
+	return corrupted;
+}
+
+// Replaces the index file in the given directory (the cache directory by
+// default) with the given sorted entries
+void Cache::writeIndex(const std::vector<Entry> &entries, const std::string &dir)
+{
+	// Defer any signals while writing to the cache
+	SIGBLOCK_DEFER();
+
+	std::string path = (dir.empty() ? cacheDir() : dir) + "/" INDEX_FILE;
+	{
+		BOStream out(path + ".tmp");
+		out.write(CACHE_MAGIC, 4);
+		out << CACHE_VERSION << (uint32_t)entries.size() << (uint32_t)0;
+		for (size_t i = 0; i < entries.size(); i++) {
+			out.write(entries[i].key, sizeof(entries[i].key));
+			for (int j = 0; j < NumStores; j++) {
+				out << entries[i].locations[j].segment << entries[i].locations[j].offset;
+			}
+		}
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write cache index: %s", path.c_str()));
+		}
+	}
+
+	m_index.close();
+	m_journal.clear();
+	account();
+	sys::fs::rename(path + ".tmp", path);
 
-	std::string buffer;
-	std::pair<uint32_t, uint32_t> pos;
-	uint32_t crc;
-	while (!(*in >> buffer).eof()) {
-		if (buffer.empty()) {
+	// The journal has been merged into the new index file
+	std::string journal = (dir.empty() ? cacheDir() : dir) + "/" JOURNAL_FILE;
+	if (sys::fs::fileExists(journal)) {
+		sys::fs::unlink(journal);
+	}
+}
+
+// Imports all revisions from a cache of version 5 or older
+void Cache::import()
+{
+	std::string path = cacheDir();
+	LegacyCache legacy(path, m_backend->name());
+	switch (legacy.load()) {
+		case LegacyCache::OutOfDate:
+			throw PEX("Cache is out of date - please run the check_cache report");
+		case LegacyCache::UnknownVersion:
+			throw PEX(str::printf("Unknown cache version number %u - please run the check_cache report", legacy.version()));
+		default:
 			break;
+	}
+
+	Logger::info() << "Cache: Found old cache, importing revisions..." << endl;
+	std::vector<std::string> ids = legacy.ids();
+	{
+		WriteLocker locker(this);
+		for (size_t i = 0; i < ids.size(); i++) {
+			Revision *rev = legacy.get(ids[i]);
+			put(ids[i], *rev);
+			delete rev;
 		}
-		*in >> pos.first >> pos.second;
-		*in >> crc;
-		m_index[buffer] = pos;
+	}
+	flush();
+	if (m_size == 0) {
+		writeIndex(std::vector<Entry>());
+		openIndex();
 	}
 
-	Logger::status() << "done" << endl;
-	delete in;
-	Logger::info() << "Cache: Loaded " << m_index.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+	legacy.remove();
+	Logger::info() << "Cache: Imported " << ids.size() << " revisions" << endl;
 }
 
 // Clears all cache files
 void Cache::clear()
 {
-	flush();
+	dropRollups();
+	m_added.clear();
+	m_index.close();
+	m_size = 0;
+	m_journal.clear();
+	account();
+	m_authors.clear();
+	closeSegments();
 
 	std::string path = cacheDir();
 	if (!sys::fs::dirExists(path)) {
@@ -231,31 +791,145 @@ void Cache::clear()
 	PDEBUG << "Clearing cache in dir: " << path << endl;
 	std::vector<std::string> files = sys::fs::ls(path);
 	for (size_t i = 0; i < files.size(); i++) {
+		if (files[i] == "lock") {
+			continue;
+		}
 		std::string fullpath = path + "/" + files[i];
 		PDEBUG << "Unlinking " << fullpath << endl;
 		sys::fs::unlink(fullpath);
 	}
 }
 
-// Locks the cache directory for this process
-void Cache::lock()
+// Loads the dictionary for decoding messages and diffstats, if any
+void Cache::loadDictionary()
 {
-	if (m_lock >= 0) {
-		PDEBUG << "Already locked (" << m_lock << ")" << endl;
+	std::string path = cacheDir() + "/" DICT_FILE;
+	std::vector<char> dict;
+	if (sys::fs::fileExists(path)) {
+		sys::fs::MappedFile file(path);
+		dict.assign(file.data(), file.data() + file.size());
+	}
+	m_codec.setDictionary(dict);
+}
+
+// Trains a dictionary on a sample of the messages and diffstats of the
+// given revisions
+std::vector<char> Cache::trainDictionary(const std::vector<Entry> &entries)
+{
+	std::vector<std::string> samples;
+	size_t step = std::max(size_t(1), (2 * entries.size()) / DICT_SAMPLES);
+	std::string id;
+	for (size_t i = 0; i < entries.size(); i += step) {
+		samples.push_back(decoded(MessageStore, entries[i].locations[MessageStore], &id));
+		samples.push_back(decoded(DiffstatStore, entries[i].locations[DiffstatStore], &id));
+	}
+	return Codec::train(samples, DICT_SIZE);
+}
+
+// Returns the decoded payload of a message or diffstat record and stores
+// the revision ID
+std::string Cache::decoded(int store, const Location &location, std::string *id)
+{
+	uint32_t length;
+	const char *data = record(store, location, &length);
+	size_t skip = strnlen(data, length) + 1;
+	std::vector<char> buffer;
+	const char *payload;
+	size_t plength;
+	if (skip > length || !m_codec.decode(data + skip, length - skip, &buffer, &payload, &plength)) {
+		throw PEX(str::printf("Unable to read from cache file: %s", segmentPath(cacheDir(), store, location.segment).c_str()));
+	}
+	id->assign(data, skip - 1);
+	return std::string(payload, plength);
+}
+
+// Finishes a compaction that has been interrupted while swapping the old
+// cache directory with the compacted one
+void Cache::recover()
+{
+	std::string path = cacheDir();
+	if (!sys::fs::dirExists(path + ".old")) {
 		return;
 	}
 
+	if (!sys::fs::dirExists(path) && sys::fs::dirExists(path + ".compact")) {
+		Logger::info() << "Cache: Finishing interrupted compaction" << endl;
+		sys::fs::rename(path + ".compact", path);
+	}
+	if (sys::fs::dirExists(path)) {
+		sys::fs::unlinkr(path + ".old");
+	}
+}
+
+// Returns the fraction of the segment files that isn't referenced by the
+// index. The total size of all segment files is stored in total.
+double Cache::deadRatio(size_t *total)
+{
+	std::string path = cacheDir();
+	*total = 0;
+	for (int i = 0; i < NumStores; i++) {
+		for (uint32_t segment = 0; sys::fs::fileExists(segmentPath(path, i, segment)); segment++) {
+			*total += sys::fs::filesize(segmentPath(path, i, segment));
+		}
+	}
+	if (*total == 0) {
+		return 0.0;
+	}
+
+	size_t live = 0;
+	std::set<Location> diffstats;
+	std::vector<Entry> all = entries();
+	for (size_t i = 0; i < all.size(); i++) {
+		const Entry &e = all[i];
+		for (int j = 0; j < NumStores; j++) {
+			if (e.locations[j].segment == NoSegment || (j == DiffstatStore && !diffstats.insert(e.locations[j]).second)) {
+				continue;
+			}
+			uint32_t length;
+			record(j, e.locations[j], &length);
+			live += RECORD_HEADER_SIZE + length;
+		}
+	}
+	return 1.0 - std::min(1.0, double(live) / *total);
+}
+
+// Closes all segment files
+void Cache::closeSegments()
+{
+	for (int i = 0; i < NumStores; i++) {
+		delete m_stores[i].out;
+		m_stores[i].out = NULL;
+		for (size_t j = 0; j < m_stores[i].files.size(); j++) {
+			delete m_stores[i].files[j];
+		}
+		m_stores[i].files.clear();
+	}
+}
+
+// Locks the cache directory for this process. Any number of processes
+// may share the cache, but converting or checking it requires an exclusive
+// lock. An existing lock will be converted to the requested type.
+void Cache::lock(bool exclusive)
+{
 	std::string path = cacheDir();
 	std::string lock = path + "/lock";
-	m_lock = ::open(lock.c_str(), O_WRONLY | O_CREAT, S_IWUSR);
-	if (m_lock == -1) {
-		throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+	if (m_lock < 0) {
+		// Lock files of previous versions are write-only
+		m_lock = ::open(lock.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (m_lock == -1 && errno == EACCES && ::chmod(lock.c_str(), S_IRUSR | S_IWUSR) == 0) {
+			m_lock = ::open(lock.c_str(), O_RDWR);
+		}
+		if (m_lock == -1) {
+			throw PEX(str::printf("Unable to lock cache %s: %s", path.c_str(), PepperException::strerror(errno).c_str()));
+		}
 	}
 
-	PTRACE << "Locking file " << lock << endl;
+	PTRACE << "Locking file " << lock << (exclusive ? " exclusively" : "") << endl;
 	struct flock flck;
 	memset(&flck, 0x00, sizeof(struct flock));
-	flck.l_type = F_WRLCK;
+	flck.l_type = (exclusive ? F_WRLCK : F_RDLCK);
+	flck.l_start = 0;
+	flck.l_len = 1;
 	if (fcntl(m_lock, F_SETLK, &flck) == -1) {
 		throw PEX(str::printf("Unable to lock cache %s, it may be used by another instance", path.c_str()));
 	}
@@ -277,79 +951,365 @@ void Cache::unlock()
 	if (fcntl(m_lock, F_SETLK, &flck) == -1) {
 		throw PEX(str::printf("Unable to unlock cache, please delete %s/lock manually if required", path.c_str()));
 	}
-	if (::close(m_lock) == -1) {
+	int fd = m_lock;
+	m_lock = -1;
+	if (::close(fd) == -1) {
 		throw PEX_ERRNO();
 	}
 }
 
-// Checks the cache version
-Cache::VersionCheckResult Cache::checkVersion(int version)
+// Acquires the write lock, waiting for other processes to release it.
+// Appending to segment files and merging the index file is serialized this
+// way, while readers don't need to wait at all.
+void Cache::lockWrites()
 {
-	if (version <= 0) {
-		return UnknownVersion;
+	if (m_writing++ > 0) {
+		return;
 	}
-	if (version <= 1) {
-		// The diffstats for Mercurial and Git have been flawed in version 1.
-		// The Subversion backend uses repository-wide diffstats now.
-		return OutOfDate;
+
+	PTRACE << "Acquiring write lock" << endl;
+	struct flock flck;
+	memset(&flck, 0x00, sizeof(struct flock));
+	flck.l_type = F_WRLCK;
+	flck.l_start = 1;
+	flck.l_len = 1;
+	while (fcntl(m_lock, F_SETLKW, &flck) == -1) {
+		if (errno != EINTR) {
+			m_writing = 0;
+			throw PEX(str::printf("Unable to lock cache %s for writing: %s", cacheDir().c_str(), PepperException::strerror(errno).c_str()));
+		}
 	}
-	if (version <= 2 && m_backend->name() == "subversion") {
-		// Invalid diffstats for deleted files in version 2 (Subversion backend)
-		return OutOfDate;
+}
+
+// Releases the write lock. Segment files are closed first, since other
+// processes may append to them afterwards.
+void Cache::unlockWrites()
+{
+	if (--m_writing > 0) {
+		return;
 	}
-	if (version <= 4 && m_backend->name() == "git") {
-		// Invalid commit times in version 3 (Git backend)
-		return OutOfDate;
+
+	for (int i = 0; i < NumStores; i++) {
+		delete m_stores[i].out;
+		m_stores[i].out = NULL;
 	}
-	if ((uint32_t)version <= CACHE_VERSION) {
-		return Ok;
+
+	PTRACE << "Releasing write lock" << endl;
+	struct flock flck;
+	memset(&flck, 0x00, sizeof(struct flock));
+	flck.l_type = F_UNLCK;
+	flck.l_start = 1;
+	flck.l_len = 1;
+	if (fcntl(m_lock, F_SETLK, &flck) == -1) {
+		PDEBUG << "Unable to release write lock: " << PepperException::strerror(errno) << endl;
+	}
+}
+
+// Searches for the given revision
+bool Cache::find(const std::string &id, Entry *e)
+{
+	std::map<std::string, Entry>::const_iterator it = m_added.find(id);
+	if (it != m_added.end()) {
+		*e = it->second;
+		return true;
 	}
 
-	return UnknownVersion;
+	return findIndexed(Entry(id).key, e);
 }
 
-// Checks cache entries and removes invalid ones from the index file
-void Cache::check(bool force)
+// Searches for the given key in the journal and the index file
+bool Cache::findIndexed(const unsigned char *key, Entry *e) const
+{
+	Entry probe;
+	memcpy(probe.key, key, sizeof(probe.key));
+	std::vector<Entry>::const_iterator it = std::lower_bound(m_journal.begin(), m_journal.end(), probe);
+	if (it != m_journal.end() && memcmp(it->key, key, sizeof(probe.key)) == 0) {
+		*e = *it;
+		return true;
+	}
+
+	// Binary search in the index file, which touches the index pages only
+	size_t lo = 0, hi = m_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (memcmp(entry(mid), key, sizeof(probe.key)) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < m_size && memcmp(entry(lo), key, sizeof(probe.key)) == 0) {
+		*e = Entry(entry(lo));
+		return true;
+	}
+	return false;
+}
+
+// Merges two sorted lists of entries. Entries of the second list replace
+// those of the first one.
+std::vector<Cache::Entry> Cache::overlay(const std::vector<Entry> &base, const std::vector<Entry> &top)
+{
+	std::vector<Entry> entries;
+	entries.reserve(base.size() + top.size());
+	size_t i = 0, j = 0;
+	while (i < base.size() || j < top.size()) {
+		if (j >= top.size() || (i < base.size() && base[i] < top[j])) {
+			entries.push_back(base[i++]);
+		} else {
+			if (i < base.size() && !(top[j] < base[i])) {
+				++i;
+			}
+			entries.push_back(top[j++]);
+		}
+	}
+	return entries;
+}
+
+// Returns a pointer to the i-th record of the index file
+inline const char *Cache::entry(size_t i) const
+{
+	return m_index.data() + INDEX_HEADER_SIZE + i * INDEX_RECORD_SIZE;
+}
+
+// Updates the memory accounted to the index. Nodes of the map of added
+// revisions are estimated, excluding IDs that don't fit into the strings.
+void Cache::account()
+{
+	if (!MemStats::enabled()) {
+		return;
+	}
+	const size_t node = sizeof(std::map<std::string, Entry>::value_type) + 4 * sizeof(void *);
+	m_memory.set(m_index.size() + m_journal.capacity() * sizeof(Entry) + m_added.size() * node);
+}
+
+// Appends a record to the given store and returns its location
+Cache::Location Cache::append(int store, const std::vector<char> &data)
+{
+	Segments &segments = m_stores[store];
+
+	// Messages and diffstats are encoded after the revision ID
+	std::vector<char> encoded;
+	if (store != MetaStore) {
+		size_t skip = std::min(strnlen(&data[0], data.size()) + 1, data.size());
+		encoded.assign(data.begin(), data.begin() + skip);
+		m_codec.encode(&data[0] + skip, data.size() - skip, &encoded);
+	}
+	const std::vector<char> &record = (store != MetaStore ? encoded : data);
+
+	// Find a segment with some space left
+	std::string dir = cacheDir(), path;
+	if (segments.out == NULL) {
+		do {
+			path = segmentPath(dir, store, segments.outindex);
+			if (!sys::fs::fileExists(path) || sys::fs::filesize(path) < MAX_SEGMENT_SIZE) {
+				break;
+			}
+			++segments.outindex;
+		} while (true);
+
+		segments.out = new BOStream(path, true);
+	} else if (segments.out->tell() >= MAX_SEGMENT_SIZE) {
+		delete segments.out;
+		segments.out = new BOStream(segmentPath(dir, store, ++segments.outindex), true);
+	}
+	if (!segments.out->ok()) {
+		throw PEX(str::printf("Unable to write to cache file: %s", segmentPath(dir, store, segments.outindex).c_str()));
+	}
+
+	Location location;
+	location.segment = segments.outindex;
+	location.offset = segments.out->tell();
+	*segments.out << (uint32_t)record.size() << utils::crc32c(&record[0], record.size());
+	segments.out->write(&record[0], record.size());
+	return location;
+}
+
+// Returns a pointer to a record in a mapped segment
+const char *Cache::record(int store, const Location &location, uint32_t *length)
+{
+	Segments &segments = m_stores[store];
+	uint32_t segment = location.segment;
+	size_t offset = location.offset;
+
+	// Make sure that all pending data is visible
+	if (segments.out != NULL && segment == segments.outindex) {
+		delete segments.out;
+		segments.out = NULL;
+	}
+
+	if (segment >= segments.files.size()) {
+		segments.files.resize(segment + 1, NULL);
+	}
+	if (segments.files[segment] == NULL) {
+		segments.files[segment] = new sys::fs::MappedFile();
+	}
+
+	sys::fs::MappedFile *file = segments.files[segment];
+	if (file->size() < offset + RECORD_HEADER_SIZE) {
+		// The segment may have grown since it has been mapped
+		file->open(segmentPath(cacheDir(), store, segment));
+	}
+	if (file->size() < offset + RECORD_HEADER_SIZE) {
+		throw PEX(str::printf("Unable to read from cache file: %s", segmentPath(cacheDir(), store, segment).c_str()));
+	}
+
+	*length = readu32(file->data() + offset);
+	if (file->size() < offset + RECORD_HEADER_SIZE + *length) {
+		file->open(segmentPath(cacheDir(), store, segment));
+		if (file->size() < offset + RECORD_HEADER_SIZE + *length) {
+			throw PEX(str::printf("Unable to read from cache file: %s", segmentPath(cacheDir(), store, segment).c_str()));
+		}
+	}
+	return file->data() + offset + RECORD_HEADER_SIZE;
+}
+
+// Returns a pointer to the data following the ID of a record, or NULL if
+// the record doesn't belong to the given revision
+const char *Cache::payload(int store, const std::string &id, const Location &location, uint32_t *length)
+{
+	const char *data = record(store, location, length);
+	size_t skip = id.length() + 1;
+	if (*length < skip || memcmp(data, id.c_str(), skip) != 0) {
+		return NULL;
+	}
+	*length -= skip;
+	return data + skip;
+}
+
+// Shared diffstats are supported
+bool Cache::sharesDiffstats() const
+{
+	return true;
+}
+
+// Logs are stored in the cache directory
+bool Cache::storesLogs() const
 {
-	std::map<std::string, std::pair<uint32_t, uint32_t> > index;
+	return true;
+}
+
+// Returns the diffstat linked to the given key, or a NULL pointer
+DiffstatPtr Cache::getShared(const std::string &key)
+{
+	if (!m_loaded) {
+		load();
+	}
+
+	Entry e;
+	if (!find(LINK_PREFIX + key, &e)) {
+		return DiffstatPtr();
+	}
+
+	// The record belongs to the revision that has been linked, so the
+	// revision ID is skipped without checking
+	uint32_t length;
+	const char *data = record(DiffstatStore, e.locations[DiffstatStore], &length);
+	size_t skip = strnlen(data, length) + 1;
+	Revision rev(std::string(data, skip - 1));
+	if (skip > length || !parse(DiffstatStore, data + skip, length - skip, &rev)) {
+		PDEBUG << "Unable to read shared diffstat for key " << key << endl;
+		return DiffstatPtr();
+	}
+	return rev.m_diffstat;
+}
+
+// Links the diffstat of a cached revision to the given key. Links only
+// reference the existing diffstat record.
+void Cache::link(const std::string &key, const std::string &id)
+{
+	Entry e;
+	if (!find(id, &e)) {
+		return;
+	}
+
+	Entry l(LINK_PREFIX + key);
+	for (int i = 0; i < NumStores; i++) {
+		if (i != DiffstatStore) {
+			l.locations[i].segment = NoSegment;
+		}
+	}
+	l.locations[DiffstatStore] = e.locations[DiffstatStore];
+	m_added[LINK_PREFIX + key] = l;
+	account();
+}
+
+// Returns the index entries of all links to the diffstats of the given
+// revisions
+std::vector<Cache::Entry> Cache::links(const std::vector<Entry> &entries)
+{
+	std::set<Location> valid;
+	for (size_t i = 0; i < entries.size(); i++) {
+		valid.insert(entries[i].locations[DiffstatStore]);
+	}
+
+	std::vector<Entry> linked, all = this->entries();
+	for (size_t i = 0; i < all.size(); i++) {
+		const Entry &e = all[i];
+		if (e.linked() && valid.find(e.locations[DiffstatStore]) != valid.end()) {
+			linked.push_back(e);
+		}
+	}
+	return linked;
+}
+
+// Returns the IDs of all cached revisions
+std::vector<std::string> Cache::ids()
+{
+	if (!m_loaded) {
+		load();
+	}
+
+	std::vector<std::string> ids;
+	std::vector<Entry> all = entries();
+	ids.reserve(all.size() + m_added.size());
+	for (size_t i = 0; i < all.size(); i++) {
+		const Entry &e = all[i];
+		if (e.linked()) {
+			continue;
+		}
+		uint32_t length;
+		const char *data = record(MetaStore, e.locations[MetaStore], &length);
+		ids.push_back(std::string(data, strnlen(data, length)));
+	}
+	for (std::map<std::string, Entry>::const_iterator it = m_added.begin(); it != m_added.end(); ++it) {
+		if (!it->second.linked()) {
+			ids.push_back(it->first);
+		}
+	}
+	return ids;
+}
 
+// Checks all cache segments and rebuilds the index file from valid records
+void Cache::check(bool force)
+{
 	std::string path = cacheDir();
 	PDEBUG << "Checking cache in dir: " << path << endl;
 
+	flush();
+	dropRollups();
+
+	recover();
 	bool created;
 	checkDir(path, &created);
+	m_authors.open(path + "/" AUTHORS_FILE);
 	if (created) {
 		Logger::info() << "Cache: Created empty cache for '" << uuid() << '\'' << endl;
 		return;
 	}
-	sys::datetime::Watch watch;
-
-	GZIStream *in = new GZIStream(path+"/index");
-	if (!in->ok()) {
-		Logger::info() << "Cache: Empty cache for '" << uuid() << '\'' << endl;
-		delete in;
-		return;
-	}
+	lock(true);
+	loadDictionary();
 
-	BIStream *cache_in = NULL;
-	uint32_t cache_index = -1;
-
-	uint32_t version;
-	*in >> version;
-	switch (checkVersion(version)) {
-		case OutOfDate:
-			delete in;
-			Logger::warn() << "Cache: Cache is out of date";
-			if (!force) {
-				Logger::warn() << " - won't clear it until forced to do so" << endl;
+	// Old caches are imported first
+	bool indexed = sys::fs::fileExists(path + "/" INDEX_FILE);
+	if (!indexed && LegacyCache::exists(path)) {
+		LegacyCache legacy(path, m_backend->name());
+		LegacyCache::VersionCheckResult result = legacy.load();
+		if (result == LegacyCache::OutOfDate || result == LegacyCache::UnknownVersion) {
+			if (result == LegacyCache::OutOfDate) {
+				Logger::warn() << "Cache: Cache is out of date";
 			} else {
-				Logger::warn() << ", clearing" << endl;
-				clear();
+				Logger::warn() << "Cache: Unknown cache version number " << legacy.version();
 			}
-			return;
-		case UnknownVersion:
-			delete in;
-			Logger::warn() << "Cache: Unknown cache version number " << version;
 			if (!force) {
 				Logger::warn() << " - won't clear it until forced to do so" << endl;
 			} else {
@@ -357,93 +1317,183 @@ void Cache::check(bool force)
 				clear();
 			}
 			return;
-		default:
-			break;
+		}
+		m_loaded = true;
+		import();
 	}
 
-	Logger::status() << "Checking all indexed revisions... " << ::flush;
+	sys::datetime::Watch watch;
+	Logger::status() << "Checking all cached revisions... " << ::flush;
 
-	std::string id;
-	std::pair<uint32_t, uint32_t> pos;
-	uint32_t crc;
-	std::map<std::string, uint32_t> crcs;
-	std::vector<std::string> corrupted;
-	while (!(*in >> id).eof()) {
-		if (!in->ok()) {
-			goto corrupt;
-		}
-
-		*in >> pos.first >> pos.second;
-		*in >> crc;
-		if (!in->ok()) {
-			goto corrupt;
-		}
-
-		index[id] = pos;
-		crcs[id] = crc;
-
-		if (cache_in == NULL || cache_index != pos.first) {
-			delete cache_in;
-			cache_in = new BIStream(str::printf("%s/cache.%u", path.c_str(), pos.first));
-			cache_index = pos.first;
-			if (!cache_in->ok()) {
-				delete cache_in; cache_in = NULL;
-				goto corrupt;
-			}
-		}
-		if (cache_in != NULL) {
-			if (!cache_in->seek(pos.second)) {
-				goto corrupt;
-			} else {
-				std::vector<char> data;
-				*cache_in >> data;
-				if (utils::crc32(data) != crc) {
-					goto corrupt;
-				}
-			}
+	std::vector<Entry> entries;
+	size_t corrupted = scan(&entries);
+
+	Logger::status() << "done" << endl;
+	Logger::info() << "Cache: Checked " << entries.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+
+	bool indexOk = true;
+	try {
+		openIndex();
+	} catch (const std::exception &ex) {
+		PDEBUG << "Error opening index: " << ex.what() << endl;
+		indexOk = false;
+	}
+
+	// Keep shared diffstat links to valid revisions
+	std::vector<Entry> linked;
+	if (indexOk) {
+		linked = links(entries);
+	}
+	if (corrupted == 0 && indexOk && m_journal.empty() && m_size == entries.size() + linked.size()) {
+		Logger::info() << "Cache: Everything's alright" << endl;
+	} else {
+		if (corrupted > 0) {
+			Logger::info() << "Cache: " << corrupted << " corrupted revisions, rewriting index file" << endl;
+		} else {
+			Logger::info() << "Cache: Rebuilding index file" << endl;
 		}
+		entries.insert(entries.end(), linked.begin(), linked.end());
+		std::stable_sort(entries.begin(), entries.end());
+		writeIndex(entries);
+		openIndex();
+	}
+	m_loaded = true;
 
-		PTRACE << "Revision " << id << " ok" << endl;
-		continue;
+	// Get rid of dropped and replaced records if there are many of them
+	size_t total;
+	double ratio = deadRatio(&total);
+	if (total >= COMPACT_MIN_SIZE && ratio >= COMPACT_DEAD_RATIO) {
+		Logger::info() << "Cache: " << int(ratio * 100) << "% of the cache files are unused" << endl;
+		compact();
+	}
+}
 
-corrupt:
-		PTRACE << "Revision " << id << " corrupted!" << endl;
-		std::cerr << "Cache: Revision " << id << " is corrupted, removing from index file" << std::endl;
-		corrupted.push_back(id);
+// Rewrites all revisions that are referenced by the index into new segment
+// files, dropping the records of corrupted or replaced revisions. The
+// revisions are written in the order in which they have been added, which
+// is usually the order of the repository log, so they will be read
+// sequentially. The new files are written to a separate directory that
+// replaces the cache directory afterwards. Requires exclusive access.
+void Cache::compact()
+{
+	if (!m_loaded) {
+		load();
+	}
+	flush();
+	lock(true);
+
+	std::string path = cacheDir(), tmp = path + ".compact";
+	if (sys::fs::dirExists(tmp)) {
+		sys::fs::unlinkr(tmp);
 	}
-	delete cache_in;
-	delete in;
+	sys::fs::mkdir(tmp);
 
-	Logger::status() << "done" << endl;
+	sys::datetime::Watch watch;
+	Logger::status() << "Compacting cache... " << ::flush;
 
-	Logger::info() << "Cache: Checked " << index.size() << " revisions in " << watch.elapsedMSecs() << " ms" << endl;
+	std::vector<Entry> entries, linked, all = this->entries();
+	entries.reserve(all.size());
+	for (size_t i = 0; i < all.size(); i++) {
+		(all[i].linked() ? linked : entries).push_back(all[i]);
+	}
+	std::sort(entries.begin(), entries.end(), writeOrder);
 
-	if (corrupted.empty()) {
-		Logger::info() << "Cache: Everything's alright" << endl;
-		return;
+	size_t before = 0, after = 0;
+	for (int i = 0; i < NumStores; i++) {
+		for (uint32_t segment = 0; sys::fs::fileExists(segmentPath(path, i, segment)); segment++) {
+			before += sys::fs::filesize(segmentPath(path, i, segment));
+		}
 	}
 
-	Logger::info() << "Cache: " << corrupted.size() << " corrupted revisions, rewriting index file" << endl;
+	try {
+		// Messages and diffstats are encoded again with the current codec,
+		// using a new dictionary for Zstd
+		Codec codec(m_codec.id());
+		if (codec.id() == Codec::Zstd) {
+			codec.setDictionary(trainDictionary(entries));
+		}
+		if (!codec.dictionary().empty()) {
+			BOStream out(tmp + "/" DICT_FILE);
+			out.write(&codec.dictionary()[0], codec.dictionary().size());
+			if (!out.ok()) {
+				throw PEX(str::printf("Unable to write to cache file: %s", (tmp + "/" DICT_FILE).c_str()));
+			}
+		}
 
-	// Remove corrupted revisions from index file
-	for (unsigned int i = 0; i < corrupted.size(); i++) {
-		std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = index.find(corrupted[i]);
-		if (it != index.end()) {
-			index.erase(it);
+		// Meta-data records are copied as they are, so they still refer
+		// to the same author dictionary
+		if (sys::fs::fileExists(path + "/" AUTHORS_FILE) && sys::fs::filesize(path + "/" AUTHORS_FILE) > 0) {
+			sys::fs::MappedFile file(path + "/" AUTHORS_FILE);
+			BOStream out(tmp + "/" AUTHORS_FILE);
+			out.write(file.data(), file.size());
+			if (!out.ok()) {
+				throw PEX(str::printf("Unable to write to cache file: %s", (tmp + "/" AUTHORS_FILE).c_str()));
+			}
 		}
+
+		// Diffstat records may be shared by links, so they are only
+		// copied once
+		std::map<Location, Location> diffstats;
+		for (int i = 0; i < NumStores; i++) {
+			SegmentWriter writer(tmp, i);
+			for (size_t j = 0; j < entries.size(); j++) {
+				Location &l = entries[j].locations[i];
+				if (i == DiffstatStore && diffstats.find(l) != diffstats.end()) {
+					l = diffstats[l];
+					continue;
+				}
+				std::vector<char> data;
+				if (i == MetaStore) {
+					uint32_t length;
+					const char *p = record(i, l, &length);
+					data.assign(p, p + length);
+				} else {
+					std::string id, payload = decoded(i, l, &id);
+					data.assign(id.c_str(), id.c_str() + id.length() + 1);
+					codec.encode(payload.data(), payload.length(), &data);
+				}
+				Location old = l;
+				writer.write(data, &l.segment, &l.offset);
+				if (i == DiffstatStore) {
+					diffstats[old] = l;
+				}
+			}
+			after += writer.written();
+		}
+
+		for (size_t i = 0; i < linked.size(); i++) {
+			std::map<Location, Location>::const_iterator it = diffstats.find(linked[i].locations[DiffstatStore]);
+			if (it != diffstats.end()) {
+				linked[i].locations[DiffstatStore] = it->second;
+				entries.push_back(linked[i]);
+			}
+		}
+		std::sort(entries.begin(), entries.end());
+		writeIndex(entries, tmp);
+		m_codec.setDictionary(codec.dictionary());
+	} catch (...) {
+		sys::fs::unlinkr(tmp);
+		throw;
 	}
 
-	// Defer any signals while writing to the cache
+	// Swap the directories. An interrupted swap is finished by recover().
 	{
 		SIGBLOCK_DEFER();
-
-		// Rewrite index file
-		GZOStream out(path+"/index");
-		out << CACHE_VERSION;
-		for (std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it = index.begin(); it != index.end(); ++it) {
-			out << it->first;
-			out << it->second.first << it->second.second;
-			out << crcs[it->first];
-		}
+		m_index.close();
+		m_size = 0;
+		m_journal.clear();
+		account();
+		closeSegments();
+		sys::fs::rename(path, path + ".old");
+		sys::fs::rename(tmp, path);
+		sys::fs::unlinkr(path + ".old");
 	}
+
+	// The old lock file has been removed as well
+	unlock();
+	lock();
+	openIndex();
+
+	Logger::status() << "done" << endl;
+	Logger::info() << "Cache: Compacted " << entries.size() << " entries from " << before << " to " << after << " bytes in " << watch.elapsedMSecs() << " ms" << endl;
 }
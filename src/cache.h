@@ -15,23 +15,77 @@
 #define CACHE_H_
 
 
+#include <cstring>
+#include <map>
+
 #include "abstractcache.h"
+#include "authortable.h"
+#include "codec.h"
+#include "memstats.h"
+
+#include "syslib/fs.h"
 
-class BIStream;
 class BOStream;
 
 
+/*
+ * Revisions are split into their meta-data, messages and diffstats, which
+ * are appended to separate segment files ("stores"). The index maps the
+ * SHA-1 of each revision ID to the location of its three records, so
+ * iterations that don't need diffstats never touch the diffstat segments.
+ * Entries of new revisions are appended to a journal file, which is merged
+ * into the index file once it has grown large enough.
+ */
 class Cache : public AbstractCache
 {
 	friend class LdbCache; // For importing revisions
 
 	private:
-		typedef enum {
-			Ok,
-			Abort,
-			UnknownVersion,
-			OutOfDate
-		} VersionCheckResult;
+		class WriteLocker;
+		class Verifier;
+
+		enum Store {
+			MetaStore = 0,
+			MessageStore,
+			DiffstatStore,
+			NumStores
+		};
+
+		// Segment index of missing records
+		enum { NoSegment = 0xFFFFFFFF };
+
+		// Location of a record in a store
+		struct Location
+		{
+			uint32_t segment;
+			uint32_t offset;
+
+			Location() : segment(0), offset(0) { }
+			inline bool operator<(const Location &other) const { return (segment < other.segment || (segment == other.segment && offset < other.offset)); }
+		};
+
+		struct Entry
+		{
+			unsigned char key[20]; // SHA-1 of the revision ID
+			Location locations[NumStores];
+
+			Entry() { memset(key, 0x00, sizeof(key)); }
+			Entry(const std::string &id);
+			Entry(const char *record);
+
+			inline bool operator<(const Entry &other) const { return memcmp(key, other.key, sizeof(key)) < 0; }
+			inline bool linked() const { return locations[MetaStore].segment == NoSegment; }
+		};
+
+		// Segment files of a single store
+		struct Segments
+		{
+			BOStream *out;
+			uint32_t outindex;
+			std::vector<sys::fs::MappedFile *> files;
+
+			Segments() : out(NULL), outindex(0) { }
+		};
 
 	public:
 		Cache(Backend *backend, const Options &options);
@@ -39,27 +93,75 @@ class Cache : public AbstractCache
 
 		void flush();
 		void check(bool force = false);
+		void compact();
 
 	protected:
 		bool lookup(const std::string &id);
 		void put(const std::string &id, const Revision &rev);
-		Revision *get(const std::string &id);
+		Revision *get(const std::string &id, int parts);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids, int parts);
+		void putMany(const std::vector<Revision *> &revs);
+
+		bool sharesDiffstats() const;
+		DiffstatPtr getShared(const std::string &key);
+		void link(const std::string &key, const std::string &id);
+
+		bool storesLogs() const;
+
+		std::vector<std::string> ids();
 
 	private:
 		void load();
+		void openIndex();
+		void reloadIndex();
+		void openJournal();
+		void appendJournal(const std::vector<Entry> &entries);
+		std::vector<Entry> entries(const std::vector<Entry> &added = std::vector<Entry>()) const;
+		void rebuildIndex();
+		size_t scan(std::vector<Entry> *entries);
+		size_t scan(int store, std::map<std::string, Location> *records);
+		void writeIndex(const std::vector<Entry> &entries, const std::string &dir = std::string());
+		std::vector<Entry> links(const std::vector<Entry> &entries);
+		void import();
 		void clear();
-		void lock();
+		void closeSegments();
+		void recover();
+		double deadRatio(size_t *total);
+		void lock(bool exclusive = false);
 		void unlock();
-		VersionCheckResult checkVersion(int version);
+		void lockWrites();
+		void unlockWrites();
+
+		bool find(const std::string &id, Entry *entry);
+		bool findIndexed(const unsigned char *key, Entry *entry) const;
+		Revision *read(const std::string &id, const Entry &entry, int parts);
+		inline const char *entry(size_t i) const;
+		void account();
+		Location append(int store, const std::vector<char> &data);
+		const char *record(int store, const Location &location, uint32_t *length);
+		const char *payload(int store, const std::string &id, const Location &location, uint32_t *length);
+
+		void loadDictionary();
+		std::vector<char> trainDictionary(const std::vector<Entry> &entries);
+		std::string decoded(int store, const Location &location, std::string *id);
+		bool parse(int store, const char *data, size_t length, Revision *rev) const;
+		bool verify(int store, const char *record, std::string *id) const;
+		static bool writeOrder(const Entry &a, const Entry &b);
+		static std::vector<Entry> overlay(const std::vector<Entry> &base, const std::vector<Entry> &top);
 
 	private:
-		BOStream *m_iout, *m_cout;
-		BIStream *m_cin;
-		uint32_t m_coindex, m_ciindex;
 		bool m_loaded;
 		int m_lock;
-
-		std::map<std::string, std::pair<uint32_t, uint32_t> > m_index;
+		int m_writing; // Nesting level of the write lock
+
+		sys::fs::MappedFile m_index;
+		size_t m_size;
+		std::vector<Entry> m_journal; // Sorted entries that have been appended after writing the index file
+		Segments m_stores[NumStores];
+		std::map<std::string, Entry> m_added; // Revisions that are not in the index file yet
+		Codec m_codec; // For messages and diffstats
+		mutable AuthorDictionary m_authors; // For meta-data
+		MemStats::Gauge m_memory;
 };
 
 
@@ -0,0 +1,391 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: canvas.cpp
+ * Drawing surfaces for the native chart renderer
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef HAVE_LIBZ
+ #include <zlib.h>
+#endif
+
+#include "strlib.h"
+#include "utils.h"
+
+#include "canvas.h"
+
+
+namespace
+{
+
+// 5x7 font for the printable ASCII characters. Each glyph consists of five
+// columns, with the least significant bit at the top.
+const unsigned char font[95][5] = {
+	{0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00}, {0x14, 0x7F, 0x14, 0x7F, 0x14},
+	{0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62}, {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00},
+	{0x00, 0x1C, 0x22, 0x41, 0x00}, {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x08, 0x2A, 0x1C, 0x2A, 0x08}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+	{0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00}, {0x20, 0x10, 0x08, 0x04, 0x02},
+	{0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00}, {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31},
+	{0x18, 0x14, 0x12, 0x7F, 0x10}, {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+	{0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00}, {0x00, 0x56, 0x36, 0x00, 0x00},
+	{0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14}, {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06},
+	{0x32, 0x49, 0x79, 0x41, 0x3E}, {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+	{0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x01, 0x01}, {0x3E, 0x41, 0x41, 0x51, 0x32},
+	{0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00}, {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41},
+	{0x7F, 0x40, 0x40, 0x40, 0x40}, {0x7F, 0x02, 0x04, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+	{0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46}, {0x46, 0x49, 0x49, 0x49, 0x31},
+	{0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F}, {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x7F, 0x20, 0x18, 0x20, 0x7F},
+	{0x63, 0x14, 0x08, 0x14, 0x63}, {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},
+	{0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04}, {0x40, 0x40, 0x40, 0x40, 0x40},
+	{0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78}, {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20},
+	{0x38, 0x44, 0x44, 0x48, 0x7F}, {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x08, 0x54, 0x54, 0x54, 0x3C},
+	{0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3D, 0x00}, {0x00, 0x7F, 0x10, 0x28, 0x44},
+	{0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78}, {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38},
+	{0x7C, 0x14, 0x14, 0x14, 0x08}, {0x08, 0x14, 0x14, 0x18, 0x7C}, {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+	{0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C}, {0x1C, 0x20, 0x40, 0x20, 0x1C}, {0x3C, 0x40, 0x30, 0x40, 0x3C},
+	{0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C}, {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00},
+	{0x00, 0x00, 0x7F, 0x00, 0x00}, {0x00, 0x41, 0x36, 0x08, 0x00}, {0x02, 0x01, 0x02, 0x04, 0x02}
+};
+
+// Returns the color in SVG notation
+inline std::string svgColor(uint32_t color)
+{
+	return str::printf("#%06x", color & 0xFFFFFF);
+}
+
+// Escapes text for XML documents
+std::string xmlEscape(const std::string &text)
+{
+	std::string out;
+	for (size_t i = 0; i < text.length(); i++) {
+		switch (text[i]) {
+			case '<': out += "&lt;"; break;
+			case '>': out += "&gt;"; break;
+			case '&': out += "&amp;"; break;
+			case '"': out += "&quot;"; break;
+			default: out += text[i]; break;
+		}
+	}
+	return out;
+}
+
+// Appends a 32-bit big-endian number
+inline void append32(std::string *out, uint32_t value)
+{
+	out->push_back(char(value >> 24));
+	out->push_back(char(value >> 16));
+	out->push_back(char(value >> 8));
+	out->push_back(char(value));
+}
+
+// Writes a PNG chunk of the given type
+void writeChunk(std::ostream &out, const char *type, const std::string &data)
+{
+	std::string chunk;
+	append32(&chunk, data.length());
+	chunk.append(type, 4);
+	chunk += data;
+	append32(&chunk, utils::crc32(chunk.data() + 4, chunk.length() - 4));
+	out.write(chunk.data(), chunk.length());
+}
+
+// Returns the data in zlib format
+std::string deflate(const std::string &data)
+{
+#ifdef HAVE_LIBZ
+	uLongf n = compressBound(data.length());
+	std::string out(n, '\0');
+	if (::compress2((Bytef *)&out[0], &n, (const Bytef *)data.data(), data.length(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+		throw PEX("Image compression failed");
+	}
+	out.resize(n);
+	return out;
+#else
+	// Use uncompressed blocks
+	std::string out("\x78\x01", 2);
+	size_t pos = 0;
+	do {
+		size_t n = std::min(data.length() - pos, size_t(65535));
+		out.push_back(pos + n == data.length() ? 1 : 0);
+		out.push_back(char(n));
+		out.push_back(char(n >> 8));
+		out.push_back(char(~n));
+		out.push_back(char(~n >> 8));
+		out.append(data, pos, n);
+		pos += n;
+	} while (pos < data.length());
+
+	uint32_t a = 1, b = 0;
+	for (size_t i = 0; i < data.length(); i++) {
+		a = (a + (unsigned char)data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	append32(&out, (b << 16) | a);
+	return out;
+#endif
+}
+
+} // anonymous namespace
+
+
+// Constructor
+Painter::Painter(int width, int height)
+	: m_width(width), m_height(height)
+{
+}
+
+// Destructor
+Painter::~Painter()
+{
+}
+
+// Returns the width of the surface
+int Painter::width() const
+{
+	return m_width;
+}
+
+// Returns the height of the surface
+int Painter::height() const
+{
+	return m_height;
+}
+
+// Draws connected lines through the given x,y pairs
+void Painter::polyline(const std::vector<double> &points, uint32_t color, double width)
+{
+	for (size_t i = 2; i + 1 < points.size(); i += 2) {
+		line(points[i-2], points[i-1], points[i], points[i+1], color, width);
+	}
+}
+
+// Returns the width of the given text in pixels
+int Painter::textWidth(const std::string &text)
+{
+	return CharWidth * text.length();
+}
+
+
+// Constructor
+SvgPainter::SvgPainter(int width, int height)
+	: Painter(width, height)
+{
+}
+
+// Draws a line
+void SvgPainter::line(double x0, double y0, double x1, double y1, uint32_t color, double width)
+{
+	m_body << str::printf("<line x1=\"%.1f\" y1=\"%.1f\" x2=\"%.1f\" y2=\"%.1f\" stroke=\"%s\" stroke-width=\"%.1f\"/>\n", x0, y0, x1, y1, svgColor(color).c_str(), width);
+}
+
+// Draws connected lines through the given x,y pairs
+void SvgPainter::polyline(const std::vector<double> &points, uint32_t color, double width)
+{
+	m_body << "<polyline fill=\"none\" stroke=\"" << svgColor(color) << "\" stroke-width=\"" << str::printf("%.1f", width) << "\" points=\"";
+	for (size_t i = 0; i + 1 < points.size(); i += 2) {
+		m_body << str::printf(i > 0 ? " %.1f,%.1f" : "%.1f,%.1f", points[i], points[i+1]);
+	}
+	m_body << "\"/>\n";
+}
+
+// Fills a rectangle
+void SvgPainter::rect(double x, double y, double w, double h, uint32_t color)
+{
+	m_body << str::printf("<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\" fill=\"%s\"/>\n", x, y, w, h, svgColor(color).c_str());
+}
+
+// Fills a polygon through the given x,y pairs
+void SvgPainter::polygon(const std::vector<double> &points, uint32_t color)
+{
+	m_body << "<polygon fill=\"" << svgColor(color) << "\" points=\"";
+	for (size_t i = 0; i + 1 < points.size(); i += 2) {
+		m_body << str::printf(i > 0 ? " %.1f,%.1f" : "%.1f,%.1f", points[i], points[i+1]);
+	}
+	m_body << "\"/>\n";
+}
+
+// Fills a circle
+void SvgPainter::circle(double x, double y, double r, uint32_t color)
+{
+	m_body << str::printf("<circle cx=\"%.1f\" cy=\"%.1f\" r=\"%.1f\" fill=\"%s\"/>\n", x, y, r, svgColor(color).c_str());
+}
+
+// Draws text that is vertically centered at y. Vertical text reads from
+// bottom to top and is horizontally centered at x.
+void SvgPainter::text(double x, double y, const std::string &text, uint32_t color, Align align, bool vertical)
+{
+	const char *anchor = (align == Left ? "start" : (align == Center ? "middle" : "end"));
+	m_body << str::printf("<text x=\"%.1f\" y=\"%.1f\" dy=\"0.35em\" fill=\"%s\" text-anchor=\"%s\"", x, y, svgColor(color).c_str(), anchor);
+	if (vertical) {
+		m_body << str::printf(" transform=\"rotate(-90 %.1f %.1f)\"", x, y);
+	}
+	m_body << ">" << xmlEscape(text) << "</text>\n";
+}
+
+// Writes the document
+void SvgPainter::write(std::ostream &out)
+{
+	out << "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"no\"?>\n";
+	out << str::printf("<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" font-family=\"monospace\" font-size=\"10\">\n", m_width, m_height, m_width, m_height);
+	out << str::printf("<rect x=\"0\" y=\"0\" width=\"%d\" height=\"%d\" fill=\"#ffffff\"/>\n", m_width, m_height);
+	out << m_body.str();
+	out << "</svg>" << std::endl;
+}
+
+
+// Constructor
+Canvas::Canvas(int width, int height, uint32_t background)
+	: Painter(std::max(width, 1), std::max(height, 1))
+{
+	m_pixels.resize(3 * size_t(m_width) * m_height);
+	for (size_t i = 0; i < m_pixels.size(); i += 3) {
+		m_pixels[i] = (unsigned char)(background >> 16);
+		m_pixels[i+1] = (unsigned char)(background >> 8);
+		m_pixels[i+2] = (unsigned char)background;
+	}
+}
+
+// Draws a line by stamping squares of the line width along it
+void Canvas::line(double x0, double y0, double x1, double y1, uint32_t color, double width)
+{
+	int w = std::max(1, int(width + 0.5));
+	int steps = std::max(1, int(std::max(fabs(x1 - x0), fabs(y1 - y0)) + 0.5));
+	double dx = (x1 - x0) / steps, dy = (y1 - y0) / steps;
+	for (int i = 0; i <= steps; i++) {
+		int x = int(floor(x0 + i * dx)) - (w - 1) / 2, y = int(floor(y0 + i * dy)) - (w - 1) / 2;
+		for (int j = 0; j < w; j++) {
+			for (int k = 0; k < w; k++) {
+				set(x + k, y + j, color);
+			}
+		}
+	}
+}
+
+// Fills a rectangle
+void Canvas::rect(double x, double y, double w, double h, uint32_t color)
+{
+	int x0 = std::max(0, int(floor(x + 0.5))), y0 = std::max(0, int(floor(y + 0.5)));
+	int x1 = std::min(m_width, int(floor(x + w + 0.5))), y1 = std::min(m_height, int(floor(y + h + 0.5)));
+	for (int j = y0; j < y1; j++) {
+		for (int i = x0; i < x1; i++) {
+			set(i, j, color);
+		}
+	}
+}
+
+// Fills a polygon through the given x,y pairs, using the even-odd rule
+// at pixel centers
+void Canvas::polygon(const std::vector<double> &points, uint32_t color)
+{
+	size_t n = points.size() / 2;
+	if (n < 3) {
+		return;
+	}
+	double ymin = points[1], ymax = points[1];
+	for (size_t i = 1; i < n; i++) {
+		ymin = std::min(ymin, points[2*i+1]);
+		ymax = std::max(ymax, points[2*i+1]);
+	}
+
+	std::vector<double> xs;
+	for (int y = std::max(0, int(floor(ymin))); y <= std::min(m_height - 1, int(ceil(ymax))); y++) {
+		double cy = y + 0.5;
+		xs.clear();
+		for (size_t i = 0, j = n - 1; i < n; j = i++) {
+			double xi = points[2*i], yi = points[2*i+1], xj = points[2*j], yj = points[2*j+1];
+			if ((yi <= cy && yj > cy) || (yj <= cy && yi > cy)) {
+				xs.push_back(xi + (cy - yi) * (xj - xi) / (yj - yi));
+			}
+		}
+		std::sort(xs.begin(), xs.end());
+		for (size_t i = 0; i + 1 < xs.size(); i += 2) {
+			for (int x = std::max(0, int(ceil(xs[i] - 0.5))); x <= std::min(m_width - 1, int(floor(xs[i+1] - 0.5))); x++) {
+				set(x, y, color);
+			}
+		}
+	}
+}
+
+// Fills a circle
+void Canvas::circle(double x, double y, double r, uint32_t color)
+{
+	for (int j = int(floor(y - r)); j <= int(ceil(y + r)); j++) {
+		for (int i = int(floor(x - r)); i <= int(ceil(x + r)); i++) {
+			double dx = i + 0.5 - x, dy = j + 0.5 - y;
+			if (dx * dx + dy * dy <= r * r) {
+				set(i, j, color);
+			}
+		}
+	}
+}
+
+// Draws text that is vertically centered at y. Vertical text reads from
+// bottom to top and is horizontally centered at x.
+void Canvas::text(double x, double y, const std::string &text, uint32_t color, Align align, bool vertical)
+{
+	int w = textWidth(text);
+	int offset = (align == Left ? 0 : (align == Center ? w / 2 : w));
+	int ox = int(floor(x + 0.5)), oy = int(floor(y + 0.5));
+	for (size_t i = 0; i < text.length(); i++) {
+		unsigned char c = (unsigned char)text[i];
+		const unsigned char *glyph = font[(c >= 32 && c < 127 ? c : '?') - 32];
+		for (int col = 0; col < 5; col++) {
+			for (int row = 0; row < 7; row++) {
+				if (!(glyph[col] & (1 << row))) {
+					continue;
+				}
+				int u = int(i) * CharWidth + col - offset, v = row - CharHeight / 2;
+				if (vertical) {
+					set(ox + v, oy - u, color);
+				} else {
+					set(ox + u, oy + v, color);
+				}
+			}
+		}
+	}
+}
+
+// Writes the image in PNG format
+void Canvas::write(std::ostream &out)
+{
+	out.write("\x89PNG\r\n\x1a\n", 8);
+
+	std::string header;
+	append32(&header, m_width);
+	append32(&header, m_height);
+	header.append("\x08\x02\x00\x00\x00", 5); // 8-bit RGB, no interlacing
+	writeChunk(out, "IHDR", header);
+
+	// Scanlines without filtering
+	std::string raw;
+	raw.reserve(m_pixels.size() + m_height);
+	for (int y = 0; y < m_height; y++) {
+		raw.push_back('\0');
+		raw.append((const char *)&m_pixels[3 * size_t(y) * m_width], 3 * m_width);
+	}
+	writeChunk(out, "IDAT", deflate(raw));
+	writeChunk(out, "IEND", std::string());
+	out.flush();
+}
+
+// Returns the color of the given pixel
+uint32_t Canvas::pixel(int x, int y) const
+{
+	if (x < 0 || y < 0 || x >= m_width || y >= m_height) {
+		return 0;
+	}
+	const unsigned char *p = &m_pixels[3 * (size_t(y) * m_width + x)];
+	return (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | p[2];
+}
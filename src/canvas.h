@@ -0,0 +1,119 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: canvas.h
+ * Drawing surfaces for the native chart renderer (interface)
+ */
+
+
+#ifndef CANVAS_H_
+#define CANVAS_H_
+
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+
+/*
+ * Abstract drawing surface. Coordinates are in pixels, with the origin at
+ * the top left corner. Colors are 0xRRGGBB values. Text is drawn with a
+ * fixed-width font of CharWidth x CharHeight pixels per character, so that
+ * layouts are the same for all surfaces.
+ */
+class Painter
+{
+	public:
+		enum Align {
+			Left,
+			Center,
+			Right
+		};
+
+		enum {
+			CharWidth = 6,
+			CharHeight = 8
+		};
+
+		Painter(int width, int height);
+		virtual ~Painter();
+
+		int width() const;
+		int height() const;
+
+		virtual void line(double x0, double y0, double x1, double y1, uint32_t color, double width = 1) = 0;
+		virtual void polyline(const std::vector<double> &points, uint32_t color, double width = 1);
+		virtual void rect(double x, double y, double w, double h, uint32_t color) = 0;
+		virtual void polygon(const std::vector<double> &points, uint32_t color) = 0;
+		virtual void circle(double x, double y, double r, uint32_t color) = 0;
+		virtual void text(double x, double y, const std::string &text, uint32_t color, Align align = Left, bool vertical = false) = 0;
+
+		virtual void write(std::ostream &out) = 0;
+
+		static int textWidth(const std::string &text);
+
+	protected:
+		int m_width, m_height;
+};
+
+
+// Writes SVG documents
+class SvgPainter : public Painter
+{
+	public:
+		SvgPainter(int width, int height);
+
+		void line(double x0, double y0, double x1, double y1, uint32_t color, double width = 1);
+		void polyline(const std::vector<double> &points, uint32_t color, double width = 1);
+		void rect(double x, double y, double w, double h, uint32_t color);
+		void polygon(const std::vector<double> &points, uint32_t color);
+		void circle(double x, double y, double r, uint32_t color);
+		void text(double x, double y, const std::string &text, uint32_t color, Align align = Left, bool vertical = false);
+
+		void write(std::ostream &out);
+
+	private:
+		std::ostringstream m_body;
+};
+
+
+// Rasterizes into an RGB image that is written as PNG
+class Canvas : public Painter
+{
+	public:
+		Canvas(int width, int height, uint32_t background = 0xFFFFFF);
+
+		void line(double x0, double y0, double x1, double y1, uint32_t color, double width = 1);
+		void rect(double x, double y, double w, double h, uint32_t color);
+		void polygon(const std::vector<double> &points, uint32_t color);
+		void circle(double x, double y, double r, uint32_t color);
+		void text(double x, double y, const std::string &text, uint32_t color, Align align = Left, bool vertical = false);
+
+		void write(std::ostream &out);
+
+		uint32_t pixel(int x, int y) const;
+
+	private:
+		inline void set(int x, int y, uint32_t color) {
+			if (x >= 0 && y >= 0 && x < m_width && y < m_height) {
+				unsigned char *p = &m_pixels[3 * (size_t(y) * m_width + x)];
+				p[0] = (unsigned char)(color >> 16);
+				p[1] = (unsigned char)(color >> 8);
+				p[2] = (unsigned char)color;
+			}
+		}
+
+	private:
+		std::vector<unsigned char> m_pixels;
+};
+
+
+#endif // CANVAS_H_
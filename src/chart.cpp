@@ -0,0 +1,781 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: chart.cpp
+ * Native chart renderer
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include "canvas.h"
+#include "logger.h"
+#include "strlib.h"
+#include "tracer.h"
+
+#include "chart.h"
+
+
+#define GNUPLOT_EPOCH 946684800 // 2000-01-01 in UNIX time
+#define TEXT_COLOR 0x000000
+#define GRID_COLOR 0xDDDDDD
+#define MARK_COLOR 0xBBBBBB
+
+
+namespace
+{
+
+// Line colors, same as the Gnuplot defaults
+const uint32_t palette[] = {
+	0x9400D3, 0x009E73, 0x56B4E9, 0xE69F00, 0xF0E442, 0x0072B2, 0xE51E10, 0x000000
+};
+
+inline uint32_t color(size_t i)
+{
+	return palette[i % (sizeof(palette) / sizeof(uint32_t))];
+}
+
+// Splits commands into statements at newlines and semicolons
+std::vector<std::string> statements(const std::string &commands)
+{
+	std::vector<std::string> result;
+	std::string current;
+	char quote = 0;
+	for (size_t i = 0; i <= commands.length(); i++) {
+		char c = (i < commands.length() ? commands[i] : '\n');
+		if (quote) {
+			if (c == '\\' && quote == '"' && i + 1 < commands.length()) {
+				current += c;
+				c = commands[++i];
+			} else if (c == quote) {
+				quote = 0;
+			}
+			current += c;
+		} else if (c == '\n' || c == ';') {
+			current = str::trim(current);
+			if (!current.empty() && current[0] != '#') {
+				result.push_back(current);
+			}
+			current.clear();
+		} else {
+			if (c == '"' || c == '\'') {
+				quote = c;
+			}
+			current += c;
+		}
+	}
+	return result;
+}
+
+// Splits a statement into words, removing quotes from strings
+std::vector<std::string> words(const std::string &statement)
+{
+	std::vector<std::string> result;
+	size_t i = 0, n = statement.length();
+	while (i < n) {
+		if (isspace((unsigned char)statement[i])) {
+			++i;
+		} else if (statement[i] == '"' || statement[i] == '\'') {
+			char quote = statement[i++];
+			std::string word;
+			while (i < n && statement[i] != quote) {
+				if (statement[i] == '\\' && quote == '"' && i + 1 < n) {
+					++i;
+					word += (statement[i] == 'n' ? '\n' : statement[i]);
+				} else {
+					word += statement[i];
+				}
+				++i;
+			}
+			++i;
+			result.push_back(word);
+		} else {
+			size_t start = i;
+			while (i < n && !isspace((unsigned char)statement[i]) && statement[i] != '"' && statement[i] != '\'') {
+				++i;
+			}
+			result.push_back(statement.substr(start, i - start));
+		}
+	}
+	return result;
+}
+
+// Returns a step size of 1, 2 or 5 times a power of ten that is at least
+// the given one
+double niceStep(double step)
+{
+	double e = pow(10.0, floor(log10(step)));
+	double f = step / e;
+	return e * (f <= 1 ? 1 : (f <= 2 ? 2 : (f <= 5 ? 5 : 10)));
+}
+
+// Returns the number of days since the UNIX epoch for the given date
+int64_t daysFromCivil(int y, int m, int d)
+{
+	y -= (m <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+// Breaks a UNIX timestamp down into UTC date and time
+inline struct tm utc(double t)
+{
+	time_t tt = time_t(floor(t));
+	struct tm tm;
+	gmtime_r(&tt, &tm);
+	return tm;
+}
+
+// Maps a value to a pixel coordinate
+inline double scale(double v, double min, double max, double p0, double p1)
+{
+	return p0 + (v - min) / (max - min) * (p1 - p0);
+}
+
+} // anonymous namespace
+
+
+// Constructor
+Chart::Chart(std::ostream &out)
+	: m_out(out), m_terminal("svg"), m_width(640), m_height(480), m_timeData(false), m_key(true), m_grid(false), m_stacked(false), m_type(None)
+{
+}
+
+// Applies the given Gnuplot commands
+void Chart::command(const std::string &commands)
+{
+	std::vector<std::string> s = statements(commands);
+	for (size_t i = 0; i < s.size(); i++) {
+		std::vector<std::string> args = words(s[i]);
+		if (!args.empty() && (args[0] == "set" || args[0] == "unset")) {
+			set(args, s[i]);
+		} else {
+			PTRACE << "Ignoring unsupported command: " << s[i] << endl;
+		}
+	}
+}
+
+// Plots the given series
+void Chart::plot(const std::vector<Series> &series)
+{
+	m_type = SeriesPlot;
+	m_series = series;
+	render();
+	m_series.clear();
+}
+
+// Plots a histogram. The values contain the bar heights for each label,
+// separately for each series.
+void Chart::plotHistogram(const std::vector<std::string> &labels, const std::vector<std::vector<double> > &values, const std::vector<std::string> &titles)
+{
+	m_type = HistogramPlot;
+	m_labels = labels;
+	m_bars = values;
+	m_titles = titles;
+	render();
+	m_bars.clear();
+}
+
+// Plots a pie chart
+void Chart::plotPie(const std::vector<std::string> &labels, const std::vector<double> &values)
+{
+	m_type = PiePlot;
+	m_labels = labels;
+	m_slices = values;
+	render();
+	m_slices.clear();
+}
+
+// Returns the plotting style for the given Gnuplot style, which may be
+// preceded by "with"
+Chart::Style Chart::parseStyle(const std::string &style)
+{
+	std::vector<std::string> w = words(style);
+	std::string name;
+	for (size_t i = 0; i < w.size() && name.empty(); i++) {
+		if (w[i] != "with" && w[i] != "w") {
+			name = w[i];
+		}
+	}
+	if (name == "points" || name == "p" || name == "dots") {
+		return Points;
+	} else if (name == "linespoints" || name == "lp") {
+		return LinesPoints;
+	} else if (name == "circles") {
+		return Circles;
+	} else if (name == "impulses" || name == "i" || name == "boxes") {
+		return Impulses;
+	}
+	return Lines;
+}
+
+// Checks whether the given terminal can be rendered
+bool Chart::supported(const std::string &terminal)
+{
+	return (terminal == "svg" || terminal == "png" || terminal == "pngcairo");
+}
+
+// Handles set and unset commands
+void Chart::set(const std::vector<std::string> &args, const std::string &raw)
+{
+	bool unset = (args[0] == "unset");
+	std::string what = (args.size() > 1 ? args[1] : std::string());
+	std::string arg = (args.size() > 2 ? args[2] : std::string());
+	if (!unset && what.length() > 2 && what.compare(0, 2, "no") == 0) {
+		unset = true;
+		what = what.substr(2);
+	}
+
+	if (what == "output" || what == "o") {
+		m_output = (unset ? std::string() : arg);
+	} else if (what == "terminal" || what == "term") {
+		if (!unset && !arg.empty()) {
+			m_terminal = arg;
+			for (size_t i = 3; i + 1 < args.size(); i++) {
+				if (args[i] == "size") {
+					sscanf(args[i+1].c_str(), "%d,%d", &m_width, &m_height);
+				}
+			}
+		}
+	} else if (what == "title") {
+		m_title = (unset ? std::string() : arg);
+	} else if (what == "xlabel") {
+		m_xlabel = (unset ? std::string() : arg);
+	} else if (what == "ylabel") {
+		m_ylabel = (unset ? std::string() : arg);
+	} else if (what == "xrange") {
+		m_xrange = (unset ? Range() : parseRange(arg));
+	} else if (what == "yrange") {
+		m_yrange = (unset ? Range() : parseRange(arg));
+	} else if (what == "xdata") {
+		m_timeData = (!unset && arg == "time");
+	} else if (what == "format") {
+		if (args.size() == 3) {
+			m_xformat = m_yformat = arg;
+		} else if (arg == "x" && args.size() > 3) {
+			m_xformat = args[3];
+		} else if (arg == "y" && args.size() > 3) {
+			m_yformat = args[3];
+		}
+	} else if (what == "key") {
+		m_key = (!unset && std::find(args.begin(), args.end(), "off") == args.end());
+	} else if (what == "grid") {
+		m_grid = !unset;
+	} else if (what == "style" && arg == "histogram") {
+		m_stacked = (!unset && args.size() > 3 && args[3] == "rowstacked");
+	} else if (what == "x2tics") {
+		// Only explicit lists of labels and positions are supported
+		m_x2tics.clear();
+		size_t pos = raw.find('(');
+		while (!unset && pos != std::string::npos && pos < raw.length()) {
+			size_t start = raw.find_first_of("\"'", pos);
+			if (start == std::string::npos) {
+				break;
+			}
+			size_t end = raw.find(raw[start], start + 1);
+			if (end == std::string::npos) {
+				break;
+			}
+			char *next;
+			double value = strtod(raw.c_str() + end + 1, &next);
+			if (next == raw.c_str() + end + 1) {
+				break;
+			}
+			m_x2tics.push_back(std::make_pair(value, raw.substr(start + 1, end - start - 1)));
+			pos = next - raw.c_str();
+		}
+	} else {
+		PTRACE << "Ignoring unsupported command: " << raw << endl;
+	}
+}
+
+// Renders the chart to the output file or stream
+void Chart::render()
+{
+	PTRACE_SCOPE("chart.render");
+	if (!supported(m_terminal)) {
+		throw PEX(str::printf("Terminal '%s' is not supported by the native plotter (use svg or png)", m_terminal.c_str()));
+	}
+
+	Painter *p;
+	if (m_terminal == "svg") {
+		p = new SvgPainter(m_width, m_height);
+	} else {
+		p = new Canvas(m_width, m_height);
+	}
+	draw(p);
+
+	if (m_output.empty()) {
+		p->write(m_out);
+	} else {
+		std::ofstream out(m_output.c_str(), std::ios::out | std::ios::binary);
+		if (!out.good()) {
+			delete p;
+			throw PEX(str::printf("Unable to open output file '%s'", m_output.c_str()));
+		}
+		p->write(out);
+	}
+	delete p;
+}
+
+// Draws the chart
+void Chart::draw(Painter *p) const
+{
+	int x0 = 10, y0 = 10, x1 = p->width() - 10, y1 = p->height() - 10;
+	if (!m_title.empty()) {
+		p->text(p->width() / 2, y0 + Painter::CharHeight / 2, m_title, TEXT_COLOR, Painter::Center);
+		y0 += Painter::CharHeight + 10;
+	}
+	if (m_type != PiePlot) {
+		if (!m_xlabel.empty()) {
+			p->text((x0 + x1) / 2, y1 - Painter::CharHeight / 2, m_xlabel, TEXT_COLOR, Painter::Center);
+			y1 -= Painter::CharHeight + 6;
+		}
+		if (!m_ylabel.empty()) {
+			p->text(x0 + Painter::CharHeight / 2, (y0 + y1) / 2, m_ylabel, TEXT_COLOR, Painter::Center, true);
+			x0 += Painter::CharHeight + 6;
+		}
+	}
+
+	switch (m_type) {
+		case SeriesPlot: drawSeries(p, x0, y0, x1, y1); break;
+		case HistogramPlot: drawHistogram(p, x0, y0, x1, y1); break;
+		case PiePlot: drawPie(p, x0, y0, x1, y1); break;
+		default: break;
+	}
+}
+
+// Draws XY series into the given area
+void Chart::drawSeries(Painter *p, int x0, int y0, int x1, int y1) const
+{
+	double xmin = HUGE_VAL, xmax = -HUGE_VAL, ymin = HUGE_VAL, ymax = -HUGE_VAL;
+	for (size_t i = 0; i < m_series.size(); i++) {
+		const Series &s = m_series[i];
+		for (size_t j = 0; j < s.keys.size() && j < s.values.size(); j++) {
+			if (std::isfinite(s.keys[j]) && std::isfinite(s.values[j])) {
+				xmin = std::min(xmin, s.keys[j]);
+				xmax = std::max(xmax, s.keys[j]);
+				ymin = std::min(ymin, s.values[j]);
+				ymax = std::max(ymax, s.values[j]);
+			}
+		}
+	}
+	if (xmin > xmax) {
+		xmin = ymin = 0;
+		xmax = ymax = 1;
+	}
+
+	int top = y0 + (m_x2tics.empty() ? 0 : Painter::CharHeight + 6);
+	int bottom = y1 - Painter::CharHeight - 8;
+	Axis y = axis(ymin, ymax, m_yrange, false, m_yformat, bottom - top);
+	int left = x0 + leftMargin(y);
+	Axis x = axis(xmin, xmax, m_xrange, m_timeData, m_xformat, x1 - left);
+	drawFrame(p, left, top, x1, bottom, x, y, true);
+
+	// Tag marks
+	int lastEnd = -1;
+	for (size_t i = 0; i < m_x2tics.size(); i++) {
+		double v = m_x2tics[i].first + (m_timeData ? GNUPLOT_EPOCH : 0);
+		if (v < x.min || v > x.max) {
+			continue;
+		}
+		double px = scale(v, x.min, x.max, left, x1);
+		p->line(px, top, px, bottom, MARK_COLOR);
+		int w = Painter::textWidth(m_x2tics[i].second);
+		if (px - w / 2 > lastEnd) {
+			p->text(px, top - Painter::CharHeight / 2 - 3, m_x2tics[i].second, TEXT_COLOR, Painter::Center);
+			lastEnd = px + w / 2 + Painter::CharWidth;
+		}
+	}
+
+	std::vector<std::string> titles;
+	for (size_t i = 0; i < m_series.size(); i++) {
+		const Series &s = m_series[i];
+		uint32_t c = color(i);
+		titles.push_back(s.title);
+
+		std::vector<double> points;
+		double ybase = scale(std::max(y.min, std::min(0.0, y.max)), y.min, y.max, bottom, top);
+		for (size_t j = 0; j <= s.keys.size() && j <= s.values.size(); j++) {
+			bool valid = (j < s.keys.size() && j < s.values.size() && std::isfinite(s.keys[j]) && std::isfinite(s.values[j]));
+			if (!valid) {
+				// Lines are interrupted by undefined values
+				if (s.style == Lines || s.style == LinesPoints) {
+					p->polyline(points, c, 1.5);
+				}
+				points.clear();
+				continue;
+			}
+
+			double px = scale(s.keys[j], x.min, x.max, left, x1), py = scale(s.values[j], y.min, y.max, bottom, top);
+			points.push_back(px);
+			points.push_back(py);
+			switch (s.style) {
+				case Points:
+				case LinesPoints:
+					p->circle(px, py, 2, c);
+					break;
+				case Circles: {
+					double r = (j < s.sizes.size() ? fabs(s.sizes[j] * (bottom - top) / (y.max - y.min)) : 3);
+					p->circle(px, py, r, c);
+					break;
+				}
+				case Impulses:
+					p->line(px, ybase, px, py, c, 1.5);
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	drawKey(p, x1, top, titles, false);
+}
+
+// Draws a histogram into the given area
+void Chart::drawHistogram(Painter *p, int x0, int y0, int x1, int y1) const
+{
+	size_t n = m_labels.size();
+	double ymin = 0, ymax = 0;
+	for (size_t i = 0; i < n; i++) {
+		double sum = 0;
+		for (size_t j = 0; j < m_bars.size(); j++) {
+			double v = (i < m_bars[j].size() ? m_bars[j][i] : 0);
+			if (m_stacked) {
+				sum += v;
+				ymax = std::max(ymax, sum);
+			} else {
+				ymax = std::max(ymax, v);
+			}
+			ymin = std::min(ymin, v);
+		}
+	}
+	if (ymax <= ymin) {
+		ymax = ymin + 1;
+	}
+
+	int bottom = y1 - Painter::CharHeight - 8;
+	Axis y = axis(ymin, ymax, m_yrange, false, m_yformat, bottom - y0);
+	int left = x0 + leftMargin(y);
+	Axis x;
+	x.min = 0;
+	x.max = 1;
+	drawFrame(p, left, y0, x1, bottom, x, y, false);
+	if (n == 0) {
+		return;
+	}
+
+	double slot = double(x1 - left) / n;
+	size_t labelWidth = 0;
+	for (size_t i = 0; i < n; i++) {
+		labelWidth = std::max(labelWidth, size_t(Painter::textWidth(m_labels[i])));
+	}
+	size_t every = std::max(size_t(1), size_t(ceil((labelWidth + Painter::CharWidth) / slot)));
+
+	for (size_t i = 0; i < n; i++) {
+		double sum = 0;
+		for (size_t j = 0; j < m_bars.size(); j++) {
+			double v = (i < m_bars[j].size() ? m_bars[j][i] : 0);
+			double bx, bw, from, to;
+			if (m_stacked) {
+				bw = slot * 0.8;
+				bx = left + i * slot + slot * 0.1;
+				from = sum;
+				to = sum + v;
+				sum += v;
+			} else {
+				bw = slot * 0.8 / m_bars.size();
+				bx = left + i * slot + slot * 0.1 + j * bw;
+				from = 0;
+				to = v;
+			}
+			double py0 = scale(std::max(y.min, std::min(from, to)), y.min, y.max, bottom, y0);
+			double py1 = scale(std::min(y.max, std::max(from, to)), y.min, y.max, bottom, y0);
+			p->rect(bx, py1, bw, py0 - py1, color(j));
+		}
+		if (i % every == 0) {
+			p->text(left + (i + 0.5) * slot, bottom + Painter::CharHeight, m_labels[i], TEXT_COLOR, Painter::Center);
+		}
+	}
+
+	drawKey(p, x1, y0, m_titles, true);
+}
+
+// Draws a pie chart into the given area
+void Chart::drawPie(Painter *p, int x0, int y0, int x1, int y1) const
+{
+	double sum = 0;
+	for (size_t i = 0; i < m_slices.size(); i++) {
+		sum += std::max(0.0, m_slices[i]);
+	}
+	if (sum <= 0) {
+		return;
+	}
+
+	int keyWidth = 0;
+	if (m_key) {
+		for (size_t i = 0; i < m_labels.size(); i++) {
+			keyWidth = std::max(keyWidth, Painter::textWidth(m_labels[i]) + 40);
+		}
+	}
+	double cx = (x0 + x1 - keyWidth) / 2.0, cy = (y0 + y1) / 2.0;
+	double r = std::max(10.0, std::min(x1 - x0 - keyWidth, y1 - y0) / 2.0 - 3 * Painter::CharHeight);
+
+	double start = 0;
+	for (size_t i = 0; i < m_slices.size(); i++) {
+		double f = std::max(0.0, m_slices[i]) / sum;
+		double end = start + f * 2 * M_PI;
+		int steps = std::max(2, int(f * 256));
+		std::vector<double> points;
+		points.push_back(cx);
+		points.push_back(cy);
+		for (int j = 0; j <= steps; j++) {
+			double a = start + (end - start) * j / steps;
+			points.push_back(cx + r * cos(a));
+			points.push_back(cy - r * sin(a));
+		}
+		p->polygon(points, color(i));
+
+		double m = (start + end) / 2;
+		p->text(cx + 1.12 * r * cos(m), cy - 1.12 * r * sin(m), str::printf("%d%%", int(100 * f + 0.5)), TEXT_COLOR, (cos(m) >= 0 ? Painter::Left : Painter::Right));
+		start = end;
+	}
+
+	drawKey(p, x1, y0, m_labels, true);
+}
+
+// Draws the plot border, the tics and tic labels
+void Chart::drawFrame(Painter *p, int x0, int y0, int x1, int y1, const Axis &x, const Axis &y, bool xtics) const
+{
+	for (size_t i = 0; i < y.tics.size(); i++) {
+		double py = scale(y.tics[i].first, y.min, y.max, y1, y0);
+		if (m_grid) {
+			p->line(x0, py, x1, py, GRID_COLOR);
+		}
+		p->line(x0, py, x0 + 4, py, TEXT_COLOR);
+		p->text(x0 - 4, py, y.tics[i].second, TEXT_COLOR, Painter::Right);
+	}
+
+	int lastEnd = -1;
+	for (size_t i = 0; xtics && i < x.tics.size(); i++) {
+		double px = scale(x.tics[i].first, x.min, x.max, x0, x1);
+		p->line(px, y1, px, y1 - 4, TEXT_COLOR);
+		int w = Painter::textWidth(x.tics[i].second);
+		if (px - w / 2 > lastEnd && px + w / 2 <= p->width()) {
+			p->text(px, y1 + Painter::CharHeight, x.tics[i].second, TEXT_COLOR, Painter::Center);
+			lastEnd = px + w / 2 + Painter::CharWidth;
+		}
+	}
+
+	p->line(x0, y0, x1, y0, TEXT_COLOR);
+	p->line(x1, y0, x1, y1, TEXT_COLOR);
+	p->line(x1, y1, x0, y1, TEXT_COLOR);
+	p->line(x0, y1, x0, y0, TEXT_COLOR);
+}
+
+// Draws the key at the top right of the plot area
+void Chart::drawKey(Painter *p, int x1, int y0, const std::vector<std::string> &titles, bool boxes) const
+{
+	int width = 0, entries = 0;
+	for (size_t i = 0; i < titles.size(); i++) {
+		if (!titles[i].empty()) {
+			width = std::max(width, Painter::textWidth(titles[i]));
+			++entries;
+		}
+	}
+	if (!m_key || entries == 0) {
+		return;
+	}
+
+	int lineHeight = Painter::CharHeight + 6;
+	int kx = x1 - width - 36, ky = y0 + 6;
+	p->rect(kx, ky, width + 30, entries * lineHeight + 6, 0xFFFFFF);
+	int k = 0;
+	for (size_t i = 0; i < titles.size(); i++) {
+		if (titles[i].empty()) {
+			continue;
+		}
+		double ly = ky + 3 + k * lineHeight + lineHeight / 2.0;
+		if (boxes) {
+			p->rect(kx + 6, ly - 4, 14, 8, color(i));
+		} else {
+			p->line(kx + 4, ly, kx + 22, ly, color(i), 1.5);
+		}
+		p->text(kx + 26, ly, titles[i], TEXT_COLOR);
+		++k;
+	}
+}
+
+// Computes the range and tics of an axis of the given length in pixels
+Chart::Axis Chart::axis(double min, double max, const Range &range, bool time, const std::string &format, int length) const
+{
+	double offset = (time ? GNUPLOT_EPOCH : 0);
+	Axis a;
+	a.min = (range.autoMin ? min : range.min + offset);
+	a.max = (range.autoMax ? max : range.max + offset);
+	if (a.max < a.min) {
+		std::swap(a.min, a.max);
+	}
+	if (a.max - a.min <= 0) {
+		double d = (time ? 86400 : std::max(1.0, fabs(a.min) * 0.1));
+		a.min -= d;
+		a.max += d;
+	}
+
+	if (!time) {
+		int count = std::max(2, length / 50);
+		double step = niceStep((a.max - a.min) / count);
+		if (range.autoMin) {
+			a.min = floor(a.min / step) * step;
+		}
+		if (range.autoMax) {
+			a.max = ceil(a.max / step) * step;
+		}
+		for (double v = ceil(a.min / step) * step; v <= a.max + step * 1e-9; v += step) {
+			if (fabs(v) < step * 1e-9) {
+				v = 0;
+			}
+			a.tics.push_back(std::make_pair(v, formatNumber(format, v)));
+		}
+		return a;
+	}
+
+	// Time tics are aligned to calendar units
+	static const int64_t steps[] = {60, 300, 900, 1800, 3600, 3 * 3600, 6 * 3600, 12 * 3600, 86400, 2 * 86400, 7 * 86400, 14 * 86400};
+	static const int months[] = {1, 2, 3, 6, 12, 24, 60, 120, 240};
+	std::string fmt = format;
+	std::string sample = formatTime(fmt.empty() ? "%b %y" : fmt, a.min);
+	int count = std::max(2, length / (Painter::textWidth(sample) + 3 * Painter::CharWidth));
+	double span = (a.max - a.min) / count;
+
+	int64_t step = 0;
+	for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]) && step == 0; i++) {
+		if (steps[i] >= span) {
+			step = steps[i];
+		}
+	}
+	if (step > 0) {
+		if (fmt.empty()) {
+			fmt = (step < 86400 ? "%H:%M" : "%d %b");
+		}
+		for (double v = ceil(a.min / step) * step; v <= a.max; v += step) {
+			a.tics.push_back(std::make_pair(v, formatTime(fmt, v)));
+		}
+		return a;
+	}
+
+	int mstep = months[sizeof(months) / sizeof(months[0]) - 1];
+	for (size_t i = 0; i < sizeof(months) / sizeof(months[0]); i++) {
+		if (months[i] * 30.44 * 86400 >= span) {
+			mstep = months[i];
+			break;
+		}
+	}
+	if (fmt.empty()) {
+		fmt = (mstep < 12 ? "%b %y" : "%Y");
+	}
+	struct tm tm = utc(a.min);
+	int64_t m = int64_t(tm.tm_year + 1900) * 12 + tm.tm_mon;
+	m = (m + mstep - 1) / mstep * mstep;
+	while (true) {
+		double v = double(daysFromCivil(int(m / 12), int(m % 12) + 1, 1)) * 86400;
+		if (v > a.max) {
+			break;
+		}
+		if (v >= a.min) {
+			a.tics.push_back(std::make_pair(v, formatTime(fmt, v)));
+		}
+		m += mstep;
+	}
+	return a;
+}
+
+// Returns the space needed for the Y tic labels
+int Chart::leftMargin(const Axis &y) const
+{
+	int width = 0;
+	for (size_t i = 0; i < y.tics.size(); i++) {
+		width = std::max(width, Painter::textWidth(y.tics[i].second));
+	}
+	return width + 8;
+}
+
+// Parses a Gnuplot range like "[0:*]"
+Chart::Range Chart::parseRange(const std::string &str)
+{
+	Range r;
+	size_t colon = str.find(':');
+	if (str.empty() || str[0] != '[' || colon == std::string::npos) {
+		return r;
+	}
+	std::string min = str::trim(str.substr(1, colon - 1));
+	std::string max = str::trim(str.substr(colon + 1, str.find(']', colon) - colon - 1));
+	char *end;
+	if (!min.empty() && min != "*") {
+		r.min = strtod(min.c_str(), &end);
+		r.autoMin = (*end != '\0');
+	}
+	if (!max.empty() && max != "*") {
+		r.max = strtod(max.c_str(), &end);
+		r.autoMax = (*end != '\0');
+	}
+	return r;
+}
+
+// Formats a number using a printf-style format with a single floating
+// point conversion, falling back to "%g" for anything else
+std::string Chart::formatNumber(const std::string &format, double value)
+{
+	int conversions = 0;
+	for (size_t i = 0; i < format.length(); i++) {
+		if (format[i] != '%') {
+			continue;
+		}
+		if (i + 1 < format.length() && format[i+1] == '%') {
+			++i;
+			continue;
+		}
+		size_t j = i + 1;
+		while (j < format.length() && strchr("-+ #0'.123456789", format[j]) != NULL) {
+			++j;
+		}
+		if (j >= format.length() || strchr("feEgG", format[j]) == NULL) {
+			conversions = -1;
+			break;
+		}
+		++conversions;
+		i = j;
+	}
+	if (conversions != 1) {
+		return str::printf("%g", value);
+	}
+
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), format.c_str(), value);
+	return buffer;
+}
+
+// Formats a UNIX timestamp using strftime()
+std::string Chart::formatTime(const std::string &format, double time)
+{
+	struct tm tm = utc(time);
+	char buffer[128];
+	size_t n = strftime(buffer, sizeof(buffer), format.c_str(), &tm);
+	return std::string(buffer, n);
+}
@@ -0,0 +1,119 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: chart.h
+ * Native chart renderer (interface)
+ */
+
+
+#ifndef CHART_H_
+#define CHART_H_
+
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "main.h"
+
+class Painter;
+
+
+/*
+ * Renders line charts, histograms and pie charts to SVG or PNG files
+ * without a Gnuplot process. The chart is configured using the subset of
+ * Gnuplot commands that the bundled reports use: output, terminal, title,
+ * axis labels, ranges, formats, time data, key, grid, histogram style and
+ * x2tics. Commands that are not understood are ignored. As with Gnuplot,
+ * X ranges and tics of time data are given as seconds since 2000-01-01,
+ * while the data itself contains UNIX timestamps.
+ *
+ * Each plot call renders a complete chart to the current output file, or
+ * to the stream passed to the constructor if no output file is set.
+ */
+class Chart
+{
+	public:
+		enum Style {
+			Lines,
+			Points,
+			LinesPoints,
+			Circles,
+			Impulses
+		};
+
+		struct Series
+		{
+			std::string title;
+			std::vector<double> keys, values;
+			std::vector<double> sizes; // Circle radii in units of the Y axis, if any
+			Style style;
+
+			Series() : style(Lines) { }
+		};
+
+		Chart(std::ostream &out = std::cout);
+
+		void command(const std::string &commands);
+
+		void plot(const std::vector<Series> &series);
+		void plotHistogram(const std::vector<std::string> &labels, const std::vector<std::vector<double> > &values, const std::vector<std::string> &titles);
+		void plotPie(const std::vector<std::string> &labels, const std::vector<double> &values);
+
+		static Style parseStyle(const std::string &style);
+		static bool supported(const std::string &terminal);
+
+	private:
+		struct Range
+		{
+			double min, max;
+			bool autoMin, autoMax;
+
+			Range() : min(0), max(0), autoMin(true), autoMax(true) { }
+		};
+
+		struct Axis
+		{
+			double min, max;
+			std::vector<std::pair<double, std::string> > tics;
+		};
+
+		void set(const std::vector<std::string> &args, const std::string &raw);
+		void render();
+		void draw(Painter *p) const;
+		void drawSeries(Painter *p, int x0, int y0, int x1, int y1) const;
+		void drawHistogram(Painter *p, int x0, int y0, int x1, int y1) const;
+		void drawPie(Painter *p, int x0, int y0, int x1, int y1) const;
+		void drawFrame(Painter *p, int x0, int y0, int x1, int y1, const Axis &x, const Axis &y, bool xtics) const;
+		void drawKey(Painter *p, int x1, int y0, const std::vector<std::string> &titles, bool boxes) const;
+		Axis axis(double min, double max, const Range &range, bool time, const std::string &format, int length) const;
+		int leftMargin(const Axis &y) const;
+
+		static Range parseRange(const std::string &str);
+		static std::string formatNumber(const std::string &format, double value);
+		static std::string formatTime(const std::string &format, double time);
+
+	PEPPER_PVARS:
+		std::ostream &m_out;
+		std::string m_output, m_terminal;
+		int m_width, m_height;
+		std::string m_title, m_xlabel, m_ylabel, m_xformat, m_yformat;
+		Range m_xrange, m_yrange;
+		bool m_timeData, m_key, m_grid, m_stacked;
+		std::vector<std::pair<double, std::string> > m_x2tics;
+
+		enum { None, SeriesPlot, HistogramPlot, PiePlot } m_type;
+		std::vector<Series> m_series;
+		std::vector<std::string> m_labels, m_titles;
+		std::vector<std::vector<double> > m_bars;
+		std::vector<double> m_slices;
+};
+
+
+#endif // CHART_H_
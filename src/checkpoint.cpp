@@ -0,0 +1,266 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: checkpoint.cpp
+ * Persistent report state
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "abstractcache.h"
+#include "backend.h"
+#include "bstream.h"
+#include "logger.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+
+#include "checkpoint.h"
+
+
+// Checkpoint file format
+#define CHECKPOINT_MAGIC "pepper-checkpoint"
+#define CHECKPOINT_VERSION 1
+
+// Value tags
+enum ValueTag {
+	TagNil = 'n',
+	TagBoolean = 'b',
+	TagNumber = 'd',
+	TagString = 's',
+	TagTable = 't',
+	TagEnd = 'e'
+};
+
+
+// Constructor
+Checkpoint::Checkpoint(Backend *backend, const std::string &report, const std::map<std::string, std::string> &options, const std::string &key)
+	: m_backend(backend), m_name("checkpoint_" + Checkpoint::key(report, options, key))
+{
+}
+
+// Returns the path to the checkpoint file
+std::string Checkpoint::path() const
+{
+	return AbstractCache::cacheFile(m_backend, m_name);
+}
+
+// Stores the value at the given stack index, together with the given
+// revision ID
+void Checkpoint::save(lua_State *L, int index, const std::string &id)
+{
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+
+	// Write to a temporary file first, so a crashing report won't leave
+	// a truncated checkpoint
+	std::string file = path();
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to open checkpoint file %s for writing", tmp.c_str()));
+		}
+		out << std::string(CHECKPOINT_MAGIC) << uint32_t(CHECKPOINT_VERSION) << id;
+		try {
+			write(out, L, index);
+		} catch (...) {
+			sys::fs::unlink(tmp);
+			throw;
+		}
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write checkpoint file %s", tmp.c_str()));
+		}
+	}
+	sys::fs::rename(tmp, file);
+	PDEBUG << "Saved checkpoint at " << id << " to " << file << endl;
+}
+
+// Pushes the stored value onto the stack and returns the corresponding
+// revision ID. Returns false if there's no valid checkpoint.
+bool Checkpoint::load(lua_State *L, std::string *id)
+{
+	std::string file = path();
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic;
+	uint32_t version = 0;
+	in >> magic >> version >> *id;
+	if (!in.ok() || magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION) {
+		Logger::warn() << "Warning: Ignoring invalid checkpoint file " << file << endl;
+		return false;
+	}
+
+	int top = lua_gettop(L);
+	if (!read(in, L)) {
+		lua_settop(L, top);
+		Logger::warn() << "Warning: Ignoring corrupted checkpoint file " << file << endl;
+		return false;
+	}
+	PDEBUG << "Loaded checkpoint at " << *id << " from " << file << endl;
+	return true;
+}
+
+// Removes the checkpoint file
+void Checkpoint::remove()
+{
+	std::string file = path();
+	if (sys::fs::fileExists(file)) {
+		sys::fs::unlink(file);
+	}
+}
+
+// Returns a unique key for the given report, options and user key
+std::string Checkpoint::key(const std::string &report, const std::map<std::string, std::string> &options, const std::string &key)
+{
+	// Options are sorted by name, so the key doesn't depend on the order
+	// in which they have been specified
+	std::string data = report + '\0' + key + '\0';
+	for (std::map<std::string, std::string>::const_iterator it = options.begin(); it != options.end(); ++it) {
+		data += it->first + '\0' + it->second + '\0';
+	}
+
+	unsigned char digest[20];
+	utils::sha1(data.data(), data.length(), digest);
+	std::string hex;
+	for (size_t i = 0; i < sizeof(digest); i++) {
+		hex += str::printf("%02x", digest[i]);
+	}
+	return sys::fs::basename(report) + "_" + hex;
+}
+
+// Serializes the value at the given stack index
+void Checkpoint::write(BOStream &out, lua_State *L, int index, int depth)
+{
+	if (index < 0) {
+		index = lua_gettop(L) + index + 1;
+	}
+
+	switch (lua_type(L, index)) {
+		case LUA_TNIL:
+			out << char(TagNil);
+			break;
+
+		case LUA_TBOOLEAN:
+			out << char(TagBoolean) << char(lua_toboolean(L, index) ? 1 : 0);
+			break;
+
+		case LUA_TNUMBER: {
+			lua_Number n = lua_tonumber(L, index);
+			uint64_t bits = 0;
+			memcpy(&bits, &n, std::min(sizeof(bits), sizeof(n)));
+			out << char(TagNumber) << bits;
+			break;
+		}
+
+		case LUA_TSTRING: {
+			size_t len = 0;
+			const char *s = lua_tolstring(L, index, &len);
+			out << char(TagString) << std::string(s, len);
+			break;
+		}
+
+		case LUA_TTABLE:
+			if (depth >= MaxDepth) {
+				throw PEX("Unable to store checkpoint: tables are nested too deeply");
+			}
+			luaL_checkstack(L, 3, "checkpoint table too deep");
+			out << char(TagTable);
+			lua_pushnil(L);
+			while (lua_next(L, index) != 0) {
+				write(out, L, -2, depth + 1);
+				write(out, L, -1, depth + 1);
+				lua_pop(L, 1);
+			}
+			out << char(TagEnd);
+			break;
+
+		default:
+			throw PEX(str::printf("Unable to store checkpoint: unsupported value of type %s", lua_typename(L, lua_type(L, index))));
+	}
+}
+
+// Reads a value and pushes it onto the stack. Returns false on errors,
+// leaving an arbitrary number of values on the stack.
+bool Checkpoint::read(BIStream &in, lua_State *L, int depth)
+{
+	char tag = 0;
+	in >> tag;
+	if (!in.ok() || in.eof()) {
+		return false;
+	}
+	return readValue(in, L, tag, depth);
+}
+
+// Reads a value with the given tag and pushes it onto the stack
+bool Checkpoint::readValue(BIStream &in, lua_State *L, char tag, int depth)
+{
+	switch (tag) {
+		case TagNil:
+			lua_pushnil(L);
+			break;
+
+		case TagBoolean: {
+			char b = 0;
+			in >> b;
+			lua_pushboolean(L, b != 0);
+			break;
+		}
+
+		case TagNumber: {
+			uint64_t bits = 0;
+			lua_Number n = 0;
+			in >> bits;
+			memcpy(&n, &bits, std::min(sizeof(bits), sizeof(n)));
+			lua_pushnumber(L, n);
+			break;
+		}
+
+		case TagString: {
+			std::string s;
+			in >> s;
+			lua_pushlstring(L, s.data(), s.length());
+			break;
+		}
+
+		case TagTable:
+			if (depth >= MaxDepth) {
+				return false;
+			}
+			luaL_checkstack(L, 3, "checkpoint table too deep");
+			lua_newtable(L);
+			while (true) {
+				char next = 0;
+				in >> next;
+				if (!in.ok() || in.eof()) {
+					return false;
+				}
+				if (next == TagEnd) {
+					break;
+				}
+				if (next == TagNil || !readValue(in, L, next, depth + 1) || !read(in, L, depth + 1)) {
+					return false;
+				}
+				lua_rawset(L, -3);
+			}
+			break;
+
+		default:
+			return false;
+	}
+	return (in.ok() && !in.eof());
+}
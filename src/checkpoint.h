@@ -0,0 +1,66 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: checkpoint.h
+ * Persistent report state (interface)
+ */
+
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+
+#include <map>
+#include <string>
+
+#include "lunar/lunar.h"
+
+class Backend;
+class BIStream;
+class BOStream;
+
+
+/*
+ * Stores a Lua value together with the ID of the last revision that has
+ * been processed by a report. Checkpoints are kept in the repository's
+ * cache directory and are keyed by the report script, the report options
+ * and an optional user-supplied key (e.g. the branch name), so runs with
+ * different options don't share state.
+ *
+ * Supported values are nil, booleans, numbers, strings and (nested) tables
+ * of these.
+ */
+class Checkpoint
+{
+	public:
+		// Maximum table nesting depth, protects against cyclic tables
+		enum { MaxDepth = 64 };
+
+	public:
+		Checkpoint(Backend *backend, const std::string &report, const std::map<std::string, std::string> &options, const std::string &key = std::string());
+
+		std::string path() const;
+
+		void save(lua_State *L, int index, const std::string &id);
+		bool load(lua_State *L, std::string *id);
+		void remove();
+
+		static std::string key(const std::string &report, const std::map<std::string, std::string> &options, const std::string &key);
+		static void write(BOStream &out, lua_State *L, int index, int depth = 0);
+		static bool read(BIStream &in, lua_State *L, int depth = 0);
+
+	private:
+		static bool readValue(BIStream &in, lua_State *L, char tag, int depth);
+
+	private:
+		Backend *m_backend;
+		std::string m_name;
+};
+
+
+#endif // CHECKPOINT_H_
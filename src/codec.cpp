@@ -0,0 +1,337 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: codec.cpp
+ * Compression codecs for cached data
+ */
+
+
+#include "main.h"
+
+#include <cstring>
+
+#ifdef HAVE_LIBZ
+ #include <zlib.h>
+#endif
+#ifdef HAVE_LZ4
+ #include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+ #include <zdict.h>
+ #include <zstd.h>
+#endif
+
+#include "logger.h"
+#include "strlib.h"
+
+#include "codec.h"
+
+
+#define MARKER '\xFF' // First byte of encoded data
+#define HEADER_SIZE 6 // Marker, codec ID and decoded size
+#define MAX_DECODED_SIZE 268435456 // Don't trust corrupted headers
+#define ZSTD_LEVEL 3
+
+
+namespace
+{
+
+// Writes the header of encoded data
+inline void writeHeader(char *p, Codec::Id id, uint32_t size)
+{
+	p[0] = MARKER;
+	p[1] = char(id);
+	p[2] = char(size >> 24);
+	p[3] = char(size >> 16);
+	p[4] = char(size >> 8);
+	p[5] = char(size);
+}
+
+// Reads the decoded size from the header of encoded data
+inline uint32_t readSize(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p + 2;
+	return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+} // anonymous namespace
+
+
+// Constructor
+Codec::Codec(Id id)
+	: m_id(id), m_cdict(NULL), m_ddict(NULL)
+{
+	if (!available(id)) {
+		throw PEX(str::printf("Compression codec %d is not supported by this build", int(id)));
+	}
+}
+
+// Destructor
+Codec::~Codec()
+{
+	setDictionary(std::vector<char>());
+}
+
+// Returns the ID of the codec that is used for encoding
+Codec::Id Codec::id() const
+{
+	return m_id;
+}
+
+// Sets the dictionary for encoding and decoding. Zstd codecs will use the
+// dictionary for encoding data if it's not empty.
+void Codec::setDictionary(const std::vector<char> &dict)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_freeCDict((ZSTD_CDict *)m_cdict);
+	ZSTD_freeDDict((ZSTD_DDict *)m_ddict);
+	m_cdict = m_ddict = NULL;
+	if (!dict.empty()) {
+		m_cdict = ZSTD_createCDict(&dict[0], dict.size(), ZSTD_LEVEL);
+		m_ddict = ZSTD_createDDict(&dict[0], dict.size());
+	}
+#endif
+	m_dict = dict;
+}
+
+// Returns the current dictionary
+const std::vector<char> &Codec::dictionary() const
+{
+	return m_dict;
+}
+
+// Appends the encoded data to the given buffer. The data is stored as it
+// is if it can't be compressed.
+void Codec::encode(const char *data, size_t length, std::vector<char> *out) const
+{
+	size_t start = out->size();
+	Id id = (m_id == Zstd && m_cdict != NULL ? ZstdDict : m_id);
+	if (id != None && length > 0 && length <= MAX_DECODED_SIZE) {
+		out->resize(start + HEADER_SIZE);
+		if (compress(id, data, length, out) && out->size() - start < length) {
+			writeHeader(&(*out)[start], id, length);
+			return;
+		}
+		out->resize(start);
+	}
+
+	// Raw data that starts like encoded data needs a header as well
+	if (length > 0 && data[0] == MARKER) {
+		out->resize(start + HEADER_SIZE);
+		writeHeader(&(*out)[start], None, length);
+	}
+	out->insert(out->end(), data, data + length);
+}
+
+// Decodes the given data. The result may point to the input data if it
+// hasn't been compressed, or to the buffer otherwise. Returns false if the
+// data is corrupted or has been encoded with an unsupported codec.
+bool Codec::decode(const char *data, size_t length, std::vector<char> *buffer, const char **result, size_t *rlength) const
+{
+	if (length == 0 || data[0] != MARKER) {
+		*result = data;
+		*rlength = length;
+		return true;
+	}
+	if (length < HEADER_SIZE) {
+		return false;
+	}
+
+	Id id = Id((unsigned char)data[1]);
+	uint32_t size = readSize(data);
+	if (id == None) {
+		*result = data + HEADER_SIZE;
+		*rlength = length - HEADER_SIZE;
+		return (*rlength == size);
+	}
+	if (size == 0 || size > MAX_DECODED_SIZE || !available(id)) {
+		return false;
+	}
+
+	buffer->resize(size);
+	if (!uncompress(id, data + HEADER_SIZE, length - HEADER_SIZE, &(*buffer)[0], size)) {
+		return false;
+	}
+	*result = &(*buffer)[0];
+	*rlength = size;
+	return true;
+}
+
+// Checks whether the codec of the given data is supported
+bool Codec::supported(const char *data, size_t length)
+{
+	return (length < HEADER_SIZE || data[0] != MARKER || available(Id((unsigned char)data[1])));
+}
+
+// Returns the codec with the given name, which must be supported
+Codec::Id Codec::parse(const std::string &name)
+{
+	Id id;
+	if (name == "none") {
+		id = None;
+	} else if (name == "zlib") {
+		id = Zlib;
+	} else if (name == "lz4") {
+		id = LZ4;
+	} else if (name == "zstd") {
+		id = Zstd;
+	} else {
+		throw PEX(str::printf("Unknown compression codec '%s'", name.c_str()));
+	}
+	if (!available(id)) {
+		throw PEX(str::printf("Compression codec '%s' is not supported by this build", name.c_str()));
+	}
+	return id;
+}
+
+// Checks whether the given codec has been compiled in
+bool Codec::available(Id id)
+{
+	switch (id) {
+		case None:
+			return true;
+#ifdef HAVE_LIBZ
+		case Zlib:
+			return true;
+#endif
+#ifdef HAVE_LZ4
+		case LZ4:
+			return true;
+#endif
+#ifdef HAVE_ZSTD
+		case Zstd:
+		case ZstdDict:
+			return true;
+#endif
+		default:
+			break;
+	}
+	return false;
+}
+
+// Trains a Zstd dictionary of the given maximum size on the samples.
+// Returns an empty dictionary if that's not possible.
+std::vector<char> Codec::train(const std::vector<std::string> &samples, size_t size)
+{
+	std::vector<char> dict;
+#ifdef HAVE_ZSTD
+	std::string data;
+	std::vector<size_t> sizes;
+	for (size_t i = 0; i < samples.size(); i++) {
+		if (!samples[i].empty()) {
+			data += samples[i];
+			sizes.push_back(samples[i].length());
+		}
+	}
+	if (sizes.empty()) {
+		return dict;
+	}
+
+	dict.resize(size);
+	size_t n = ZDICT_trainFromBuffer(&dict[0], dict.size(), data.data(), &sizes[0], sizes.size());
+	if (ZDICT_isError(n)) {
+		PDEBUG << "Unable to train dictionary: " << ZDICT_getErrorName(n) << endl;
+		dict.clear();
+	} else {
+		dict.resize(n);
+	}
+#else
+	(void)samples;
+	(void)size;
+#endif
+	return dict;
+}
+
+// Appends the compressed data to the given buffer
+bool Codec::compress(Id id, const char *data, size_t length, std::vector<char> *out) const
+{
+	size_t start = out->size();
+	switch (id) {
+#ifdef HAVE_LIBZ
+		case Zlib: {
+			uLongf n = compressBound(length);
+			out->resize(start + n);
+			if (::compress2((Bytef *)&(*out)[start], &n, (const Bytef *)data, length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+				return false;
+			}
+			out->resize(start + n);
+			return true;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case LZ4: {
+			out->resize(start + LZ4_compressBound(length));
+			int n = LZ4_compress_default(data, &(*out)[start], length, out->size() - start);
+			if (n <= 0) {
+				return false;
+			}
+			out->resize(start + n);
+			return true;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case Zstd:
+		case ZstdDict: {
+			out->resize(start + ZSTD_compressBound(length));
+			size_t n;
+			if (id == ZstdDict) {
+				ZSTD_CCtx *ctx = ZSTD_createCCtx();
+				n = ZSTD_compress_usingCDict(ctx, &(*out)[start], out->size() - start, data, length, (const ZSTD_CDict *)m_cdict);
+				ZSTD_freeCCtx(ctx);
+			} else {
+				n = ZSTD_compress(&(*out)[start], out->size() - start, data, length, ZSTD_LEVEL);
+			}
+			if (ZSTD_isError(n)) {
+				return false;
+			}
+			out->resize(start + n);
+			return true;
+		}
+#endif
+		default:
+			break;
+	}
+	return false;
+}
+
+// Decompresses data of the given decoded size
+bool Codec::uncompress(Id id, const char *data, size_t length, char *out, size_t olength) const
+{
+	switch (id) {
+#ifdef HAVE_LIBZ
+		case Zlib: {
+			uLongf n = olength;
+			return (::uncompress((Bytef *)out, &n, (const Bytef *)data, length) == Z_OK && n == olength);
+		}
+#endif
+#ifdef HAVE_LZ4
+		case LZ4:
+			return (LZ4_decompress_safe(data, out, length, olength) == int(olength));
+#endif
+#ifdef HAVE_ZSTD
+		case Zstd:
+		case ZstdDict: {
+			size_t n;
+			if (id == ZstdDict) {
+				if (m_ddict == NULL) {
+					return false;
+				}
+				ZSTD_DCtx *ctx = ZSTD_createDCtx();
+				n = ZSTD_decompress_usingDDict(ctx, out, olength, data, length, (const ZSTD_DDict *)m_ddict);
+				ZSTD_freeDCtx(ctx);
+			} else {
+				n = ZSTD_decompress(out, olength, data, length);
+			}
+			return (!ZSTD_isError(n) && n == olength);
+		}
+#endif
+		default:
+			break;
+	}
+	return false;
+}
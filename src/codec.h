@@ -0,0 +1,75 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: codec.h
+ * Compression codecs for cached data (interface)
+ */
+
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+
+#include <string>
+#include <vector>
+
+
+/*
+ * Compresses revision parts for the revision caches. Encoded data starts
+ * with a marker byte that can't start a serialized revision part, followed
+ * by the ID of the codec and the size of the decoded data. Data written
+ * with different codecs, or without any, can be mixed freely this way.
+ *
+ * Zstd can use a dictionary, which improves the compression of small
+ * records considerably. Data that has been encoded with a dictionary can
+ * only be decoded with the same one.
+ *
+ * Encoding and decoding don't modify the codec, so a single codec may be
+ * used by several threads.
+ */
+class Codec
+{
+	public:
+		enum Id {
+			None = 0,
+			Zlib = 1,
+			LZ4 = 2,
+			Zstd = 3,
+			ZstdDict = 4
+		};
+
+		Codec(Id id = None);
+		~Codec();
+
+		Id id() const;
+		void setDictionary(const std::vector<char> &dict);
+		const std::vector<char> &dictionary() const;
+
+		void encode(const char *data, size_t length, std::vector<char> *out) const;
+		bool decode(const char *data, size_t length, std::vector<char> *buffer, const char **result, size_t *rlength) const;
+
+		static bool supported(const char *data, size_t length);
+		static Id parse(const std::string &name);
+		static bool available(Id id);
+		static std::vector<char> train(const std::vector<std::string> &samples, size_t size);
+
+	private:
+		Codec(const Codec &);
+		Codec &operator=(const Codec &);
+
+		bool compress(Id id, const char *data, size_t length, std::vector<char> *out) const;
+		bool uncompress(Id id, const char *data, size_t length, char *out, size_t olength) const;
+
+	private:
+		Id m_id;
+		std::vector<char> m_dict;
+		void *m_cdict, *m_ddict;
+};
+
+
+#endif // CODEC_H_
@@ -0,0 +1,468 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: columns.cpp
+ * Columnar storage of revision data
+ *
+ * Reports that dump raw history data used to build a Lua table for every
+ * revision. Columns stores the requested fields in typed arrays instead:
+ * dates and counters as plain integers, authors dictionary-encoded and
+ * free text in a single character buffer. Values are converted to Lua
+ * objects only when they are accessed.
+ */
+
+
+#include "main.h"
+
+#include <fstream>
+
+#include "bstream.h"
+#include "luahelpers.h"
+#include "report.h"
+#include "revision.h"
+#include "strlib.h"
+
+#include "columns.h"
+
+
+// Magic string and version of binary column files
+static const char magic[] = "pepper-columns";
+static const uint32_t version = 1;
+
+
+// Appends a string to a dictionary or text column
+void Columns::Column::append(const std::string &s)
+{
+	if (type == Dictionary) {
+		std::unordered_map<std::string, uint32_t>::const_iterator it = index.find(s);
+		if (it == index.end()) {
+			it = index.insert(std::make_pair(s, uint32_t(dict.size()))).first;
+			dict.push_back(s);
+		}
+		codes.push_back(it->second);
+	} else {
+		text.insert(text.end(), s.begin(), s.end());
+		offsets.push_back(text.size());
+	}
+}
+
+// Returns the string representation of a value
+std::string Columns::Column::str(size_t row) const
+{
+	switch (type) {
+		case Int64: return str::itos(ints[row]);
+		case UInt64: return str::itos(uints[row]);
+		case Dictionary: return dict[codes[row]];
+		case Text: {
+			size_t start = (row > 0 ? offsets[row-1] : 0);
+			return std::string(text.begin() + start, text.begin() + offsets[row]);
+		}
+	}
+	return std::string();
+}
+
+
+// Constructor
+Columns::Columns()
+	: m_rows(0), m_total(0)
+{
+
+}
+
+// Destructor
+Columns::~Columns()
+{
+
+}
+
+// Sets the fields to store. Throws an exception for unknown fields.
+void Columns::setFields(const std::vector<std::string> &names)
+{
+	m_columns.clear();
+	m_rows = 0;
+	m_total = 0;
+	for (size_t i = 0; i < names.size(); i++) {
+		Column c;
+		if (!parseField(names[i], &c.field)) {
+			throw PEX(str::printf("Unknown column: %s", names[i].c_str()));
+		}
+		c.name = names[i];
+		c.type = type(c.field);
+		m_columns.push_back(c);
+	}
+}
+
+// Checks whether revisions need to provide diffstats
+bool Columns::needsDiffstats() const
+{
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		switch (m_columns[i].field) {
+			case Id:
+			case Date:
+			case Author:
+			case Message: break;
+			default: return true;
+		}
+	}
+	return false;
+}
+
+// Appends the fields of a revision
+void Columns::add(const Revision *revision)
+{
+	Diffstat::Stat stat;
+	size_t files = 0;
+	if (revision->m_diffstat) {
+		stat = revision->m_diffstat->total();
+		files = revision->m_diffstat->size();
+	}
+	m_total += int64_t(stat.ladd) - int64_t(stat.ldel);
+
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		Column &c = m_columns[i];
+		switch (c.field) {
+			case Id: c.append(revision->m_id); break;
+			case Date: c.ints.push_back(revision->m_date); break;
+			case Author: c.append(revision->author()); break;
+			case Message: c.append(revision->m_message); break;
+			case LinesAdded: c.uints.push_back(stat.ladd); break;
+			case LinesRemoved: c.uints.push_back(stat.ldel); break;
+			case BytesAdded: c.uints.push_back(stat.cadd); break;
+			case BytesRemoved: c.uints.push_back(stat.cdel); break;
+			case Delta: c.ints.push_back(int64_t(stat.ladd) - int64_t(stat.ldel)); break;
+			case Total: c.ints.push_back(m_total); break;
+			case Files: c.uints.push_back(files); break;
+		}
+	}
+	++m_rows;
+}
+
+// Returns the number of rows
+size_t Columns::size() const
+{
+	return m_rows;
+}
+
+// Returns the number of columns
+size_t Columns::width() const
+{
+	return m_columns.size();
+}
+
+// Returns the i-th column
+const Columns::Column &Columns::columnAt(size_t i) const
+{
+	return m_columns[i];
+}
+
+// Returns the index of the column with the given name, or -1
+int Columns::find(const std::string &name) const
+{
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		if (m_columns[i].name == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Writes all rows in CSV format, preceded by a header line
+void Columns::writeCsv(std::ostream &out) const
+{
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		out << (i > 0 ? "," : "") << m_columns[i].name;
+	}
+	out << "\n";
+
+	std::string value;
+	for (size_t row = 0; row < m_rows; row++) {
+		for (size_t i = 0; i < m_columns.size(); i++) {
+			if (i > 0) {
+				out << ",";
+			}
+			value = m_columns[i].str(row);
+			if (m_columns[i].type == Int64 || m_columns[i].type == UInt64) {
+				out << value;
+				continue;
+			}
+
+			// Quote strings as specified in RFC 4180
+			out << '"';
+			for (size_t j = 0; j < value.length(); j++) {
+				if (value[j] == '"') {
+					out << '"';
+				}
+				out << value[j];
+			}
+			out << '"';
+		}
+		out << "\n";
+	}
+	out << std::flush;
+}
+
+// Writes all columns to a binary stream
+void Columns::write(BOStream &out) const
+{
+	out << std::string(magic) << version << (uint64_t)m_rows << (uint32_t)m_columns.size();
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		const Column &c = m_columns[i];
+		out << c.name;
+		switch (c.type) {
+			case Int64: out << c.ints; break;
+			case UInt64: out << c.uints; break;
+			case Dictionary: out << c.dict << c.codes; break;
+			case Text: out << c.text << c.offsets; break;
+		}
+	}
+}
+
+// Reads columns from a binary stream
+bool Columns::load(BIStream &in)
+{
+	std::string m;
+	uint32_t v, ncolumns;
+	uint64_t rows;
+	in >> m >> v;
+	if (m != magic || v != version) {
+		return false;
+	}
+	in >> rows >> ncolumns;
+
+	std::vector<Column> columns;
+	for (uint32_t i = 0; i < ncolumns && !in.eof(); i++) {
+		Column c;
+		in >> c.name;
+		if (!parseField(c.name, &c.field)) {
+			return false;
+		}
+		c.type = type(c.field);
+		size_t n = 0;
+		switch (c.type) {
+			case Int64: in >> c.ints; n = c.ints.size(); break;
+			case UInt64: in >> c.uints; n = c.uints.size(); break;
+			case Dictionary:
+				in >> c.dict >> c.codes;
+				n = c.codes.size();
+				for (size_t j = 0; j < c.codes.size(); j++) {
+					if (c.codes[j] >= c.dict.size()) {
+						return false;
+					}
+				}
+				for (size_t j = 0; j < c.dict.size(); j++) {
+					c.index[c.dict[j]] = j;
+				}
+				break;
+			case Text:
+				in >> c.text >> c.offsets;
+				n = c.offsets.size();
+				for (size_t j = 0; j < c.offsets.size(); j++) {
+					if (c.offsets[j] < (j > 0 ? c.offsets[j-1] : 0) || c.offsets[j] > c.text.size()) {
+						return false;
+					}
+				}
+				break;
+		}
+		if (n != rows) {
+			return false;
+		}
+		columns.push_back(c);
+	}
+	if (columns.size() != ncolumns) {
+		return false;
+	}
+
+	m_columns.swap(columns);
+	m_rows = rows;
+	m_total = 0;
+	return true;
+}
+
+// Converts a field name to the corresponding enum value
+bool Columns::parseField(const std::string &name, Field *field)
+{
+	if (name == "id") *field = Id;
+	else if (name == "date") *field = Date;
+	else if (name == "author") *field = Author;
+	else if (name == "message") *field = Message;
+	else if (name == "ladd") *field = LinesAdded;
+	else if (name == "ldel") *field = LinesRemoved;
+	else if (name == "cadd") *field = BytesAdded;
+	else if (name == "cdel") *field = BytesRemoved;
+	else if (name == "delta") *field = Delta;
+	else if (name == "total") *field = Total;
+	else if (name == "files") *field = Files;
+	else return false;
+	return true;
+}
+
+// Returns the storage type of a field
+Columns::Type Columns::type(Field field)
+{
+	switch (field) {
+		case Id:
+		case Message: return Text;
+		case Author: return Dictionary;
+		case Date:
+		case Delta:
+		case Total: return Int64;
+		default: break;
+	}
+	return UInt64;
+}
+
+// Pushes a single value onto the Lua stack
+int Columns::push(lua_State *L, size_t col, size_t row) const
+{
+	const Column &c = m_columns[col];
+	switch (c.type) {
+		case Int64: return LuaHelpers::push(L, c.ints[row]);
+		case UInt64: return LuaHelpers::push(L, c.uints[row]);
+		case Dictionary: {
+			const std::string &s = c.dict[c.codes[row]];
+			lua_pushlstring(L, s.data(), s.length());
+			return 1;
+		}
+		case Text: {
+			size_t start = (row > 0 ? c.offsets[row-1] : 0);
+			lua_pushlstring(L, c.text.data() + start, c.offsets[row] - start);
+			return 1;
+		}
+	}
+	return LuaHelpers::pushNil(L);
+}
+
+
+/*
+ * Lua binding
+ */
+
+const char Columns::className[] = "columns";
+Lunar<Columns>::RegType Columns::methods[] = {
+	LUNAR_DECLARE_METHOD(Columns, size),
+	LUNAR_DECLARE_METHOD(Columns, names),
+	LUNAR_DECLARE_METHOD(Columns, get),
+	LUNAR_DECLARE_METHOD(Columns, row),
+	LUNAR_DECLARE_METHOD(Columns, column),
+	LUNAR_DECLARE_METHOD(Columns, dictionary),
+	LUNAR_DECLARE_METHOD(Columns, write_csv),
+	LUNAR_DECLARE_METHOD(Columns, write),
+	{0,0}
+};
+
+Columns::Columns(lua_State *L)
+	: m_rows(0), m_total(0)
+{
+	// Load columns from a binary file if a file name has been given
+	if (lua_gettop(L) > 0) {
+		std::string path = LuaHelpers::pops(L);
+		BIStream in(path);
+		if (!in.ok()) {
+			LuaHelpers::pushError(L, str::printf("Unable to open %s", path.c_str()));
+		} else if (!load(in)) {
+			LuaHelpers::pushError(L, str::printf("Unable to read columns from %s", path.c_str()));
+		}
+	}
+}
+
+int Columns::size(lua_State *L)
+{
+	return LuaHelpers::push(L, (uint64_t)m_rows);
+}
+
+int Columns::names(lua_State *L)
+{
+	lua_createtable(L, m_columns.size(), 0);
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		LuaHelpers::push(L, m_columns[i].name);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+int Columns::get(lua_State *L)
+{
+	if (lua_gettop(L) != 2) {
+		return luaL_error(L, "Invalid number of arguments (2 expected)");
+	}
+	size_t row = luaL_checkinteger(L, 2);
+	int col = (lua_type(L, 1) == LUA_TNUMBER ? lua_tointeger(L, 1) - 1 : find(luaL_checkstring(L, 1)));
+	if (col < 0 || col >= int(m_columns.size())) {
+		return luaL_error(L, "No such column: %s", lua_tostring(L, 1));
+	}
+	if (row < 1 || row > m_rows) {
+		return LuaHelpers::pushNil(L);
+	}
+	return push(L, col, row-1);
+}
+
+int Columns::row(lua_State *L)
+{
+	size_t row = luaL_checkinteger(L, 1);
+	if (row < 1 || row > m_rows) {
+		return LuaHelpers::pushNil(L);
+	}
+	luaL_checkstack(L, m_columns.size(), "too many columns");
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		push(L, i, row-1);
+	}
+	return m_columns.size();
+}
+
+int Columns::column(lua_State *L)
+{
+	int col = (lua_type(L, 1) == LUA_TNUMBER ? lua_tointeger(L, 1) - 1 : find(luaL_checkstring(L, 1)));
+	if (col < 0 || col >= int(m_columns.size())) {
+		return luaL_error(L, "No such column: %s", lua_tostring(L, 1));
+	}
+	lua_createtable(L, m_rows, 0);
+	for (size_t i = 0; i < m_rows; i++) {
+		push(L, col, i);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+int Columns::dictionary(lua_State *L)
+{
+	int col = (lua_type(L, 1) == LUA_TNUMBER ? lua_tointeger(L, 1) - 1 : find(luaL_checkstring(L, 1)));
+	if (col < 0 || col >= int(m_columns.size())) {
+		return luaL_error(L, "No such column: %s", lua_tostring(L, 1));
+	}
+	if (m_columns[col].type != Dictionary) {
+		return LuaHelpers::pushNil(L);
+	}
+	return LuaHelpers::push(L, m_columns[col].dict);
+}
+
+int Columns::write_csv(lua_State *L)
+{
+	if (lua_gettop(L) == 0) {
+		writeCsv(Report::current() == NULL ? std::cout : Report::current()->out());
+		return 0;
+	}
+
+	std::string path = LuaHelpers::pops(L);
+	std::ofstream out(path.c_str());
+	if (!out.good()) {
+		return LuaHelpers::pushError(L, str::printf("Unable to open %s for writing", path.c_str()));
+	}
+	writeCsv(out);
+	return 0;
+}
+
+int Columns::write(lua_State *L)
+{
+	std::string path = LuaHelpers::pops(L);
+	BOStream out(path);
+	if (!out.ok()) {
+		return LuaHelpers::pushError(L, str::printf("Unable to open %s for writing", path.c_str()));
+	}
+	write(out);
+	return 0;
+}
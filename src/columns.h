@@ -0,0 +1,119 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: columns.h
+ * Columnar storage of revision data (interface)
+ */
+
+
+#ifndef COLUMNS_H_
+#define COLUMNS_H_
+
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "main.h"
+
+#include "lunar/lunar.h"
+
+class BIStream;
+class BOStream;
+class Revision;
+
+
+class Columns
+{
+	public:
+		enum Field {
+			Id,
+			Date,
+			Author,
+			Message,
+			LinesAdded,
+			LinesRemoved,
+			BytesAdded,
+			BytesRemoved,
+			Delta,
+			Total,
+			Files
+		};
+
+		enum Type {
+			Int64,
+			UInt64,
+			Dictionary,
+			Text
+		};
+
+		// A single typed column
+		struct Column {
+			std::string name;
+			Field field;
+			Type type;
+			std::vector<int64_t> ints;
+			std::vector<uint64_t> uints;
+			std::vector<uint32_t> codes;
+			std::vector<std::string> dict;
+			std::unordered_map<std::string, uint32_t> index;
+			std::vector<char> text;
+			std::vector<uint32_t> offsets;
+
+			void append(const std::string &s);
+			std::string str(size_t row) const;
+		};
+
+	public:
+		Columns();
+		~Columns();
+
+		void setFields(const std::vector<std::string> &names);
+		bool needsDiffstats() const;
+		void add(const Revision *revision);
+
+		size_t size() const;
+		size_t width() const;
+		const Column &columnAt(size_t i) const;
+		int find(const std::string &name) const;
+
+		void writeCsv(std::ostream &out) const;
+		void write(BOStream &out) const;
+		bool load(BIStream &in);
+
+		static bool parseField(const std::string &name, Field *field);
+		static Type type(Field field);
+
+	private:
+		int push(lua_State *L, size_t col, size_t row) const;
+
+	private:
+		std::vector<Column> m_columns;
+		size_t m_rows;
+		int64_t m_total;
+
+	// Lua binding
+	public:
+		Columns(lua_State *L);
+
+		int size(lua_State *L);
+		int names(lua_State *L);
+		int get(lua_State *L);
+		int row(lua_State *L);
+		int column(lua_State *L);
+		int dictionary(lua_State *L);
+		int write_csv(lua_State *L);
+		int write(lua_State *L);
+
+		static const char className[];
+		static Lunar<Columns>::RegType methods[];
+};
+
+
+#endif // COLUMNS_H_
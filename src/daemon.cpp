@@ -0,0 +1,405 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: daemon.cpp
+ * Long-running report server
+ */
+
+
+#include "main.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "abstractcache.h"
+#include "backend.h"
+#include "logger.h"
+#include "memorycache.h"
+#include "options.h"
+#include "plot.h"
+#include "remotecache.h"
+#include "report.h"
+#include "reportcache.h"
+#include "strlib.h"
+
+#ifdef USE_LDBCACHE
+ #include "ldbcache.h"
+#else
+ #include "cache.h"
+#endif
+
+#include "syslib/fs.h"
+#include "syslib/sigblock.h"
+
+#include "daemon.h"
+
+
+// Flushes all caches and removes the socket before the daemon terminates
+struct DaemonSignalHandler : public sys::sigblock::Handler
+{
+	DaemonSignalHandler(Daemon *daemon) : daemon(daemon) { }
+
+	void operator()(int signum)
+	{
+		Logger::unlock();
+		Logger::status() << "Catched signal " << signum << ", flushing caches" << endl;
+		daemon->terminate();
+	}
+
+	Daemon *daemon;
+};
+
+
+namespace
+{
+
+// Options that don't affect the setup of backends and caches
+const char *requestOptions[] = {
+	"report", "reports", "connect", "export_cache", "import_cache", "stats", "trace"
+};
+
+} // anonymous namespace
+
+
+// Destructor
+Daemon::Entry::~Entry()
+{
+	delete cache; // This will also flush the cache
+	delete remote;
+	delete backend;
+	delete options;
+}
+
+
+// Constructor
+Daemon::Daemon(const Options &options)
+	: m_opts(options)
+{
+	// Requests change the working directory
+	m_path = m_opts.daemonSocket();
+	if (!m_path.empty() && m_path[0] != '/') {
+		m_path = sys::fs::cwd() + "/" + m_path;
+	}
+}
+
+// Destructor
+Daemon::~Daemon()
+{
+	m_server.close();
+	for (std::map<std::string, Entry *>::iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+		delete it->second;
+	}
+}
+
+// Serves requests until the program is terminated by a signal
+int Daemon::run()
+{
+	try {
+		m_server.listen(m_path);
+	} catch (const PepperException &ex) {
+		std::cerr << "Error starting daemon: " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	DaemonSignalHandler sighandler(this);
+	int signums[] = {SIGINT, SIGTERM};
+	sys::sigblock::block(2, signums, &sighandler);
+	sys::sigblock::ignore(SIGPIPE);
+
+	Logger::status() << "Listening on " << m_path << endl;
+	while (m_server.isOpen()) {
+		sys::net::Socket *socket = m_server.accept();
+		if (socket) {
+			serve(socket);
+			delete socket;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+// Flushes the revision caches of all repositories and removes the socket
+// before the program is terminated by a signal
+void Daemon::terminate()
+{
+	for (std::map<std::string, Entry *>::iterator it = m_entries.begin(); it != m_entries.end(); ++it) {
+		if (it->second->cache) {
+			it->second->cache->flush();
+		}
+	}
+	unlink(m_path.c_str());
+}
+
+// Sends the command line to the daemon listening on the given socket and
+// prints its response. Returns the exit status of the request.
+int Daemon::request(const std::string &socket, int argc, char **argv)
+{
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--connect=", 10) != 0) {
+			args.push_back(argv[i]);
+		}
+	}
+
+	std::string response;
+	try {
+		sys::net::Socket s;
+		s.connect(socket);
+		std::string data = encodeRequest(sys::fs::cwd(), args);
+		s.write(data.data(), data.length());
+
+		char buffer[4096];
+		ssize_t n;
+		while ((n = s.read(buffer, sizeof(buffer))) > 0) {
+			response.append(buffer, n);
+		}
+	} catch (const PepperException &ex) {
+		std::cerr << "Error connecting to daemon: " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int status;
+	size_t outlen, errlen;
+	size_t pos = response.find('\n');
+	if (pos == std::string::npos || sscanf(response.c_str(), "%d %zu %zu", &status, &outlen, &errlen) != 3 || response.length() - pos - 1 != outlen + errlen) {
+		std::cerr << "Error: Invalid response from daemon" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout.write(response.data() + pos + 1, outlen);
+	std::cout.flush();
+	std::cerr.write(response.data() + pos + 1 + outlen, errlen);
+	return status;
+}
+
+// Encodes a request for the daemon
+std::string Daemon::encodeRequest(const std::string &cwd, const std::vector<std::string> &args)
+{
+	std::string data = str::itos(args.size());
+	data += '\0';
+	data += cwd;
+	data += '\0';
+	for (size_t i = 0; i < args.size(); i++) {
+		data += args[i];
+		data += '\0';
+	}
+	return data;
+}
+
+// Decodes a request. Returns false if the data is incomplete.
+bool Daemon::decodeRequest(const std::string &data, std::string *cwd, std::vector<std::string> *args)
+{
+	std::vector<std::string> fields;
+	size_t pos = 0, end;
+	size_t count = 0;
+	while ((end = data.find('\0', pos)) != std::string::npos) {
+		fields.push_back(data.substr(pos, end - pos));
+		pos = end + 1;
+		if (fields.size() == 1 && !str::stoi(fields[0], &count, 10)) {
+			throw PEX(str::printf("Invalid request header: %s", fields[0].c_str()));
+		}
+		if (fields.size() >= 2 && fields.size() == count + 2) {
+			break;
+		}
+	}
+	if (fields.size() < 2 || fields.size() != count + 2) {
+		return false;
+	}
+
+	*cwd = fields[1];
+	args->assign(fields.begin() + 2, fields.end());
+	return true;
+}
+
+// Reads a request from the given client, runs it and sends the response
+void Daemon::serve(sys::net::Socket *socket)
+{
+	std::string data, cwd;
+	std::vector<std::string> args;
+	std::ostringstream out, err;
+	int ret = EXIT_FAILURE;
+	try {
+		char buffer[4096];
+		ssize_t n;
+		bool complete = false;
+		while (!complete && (n = socket->read(buffer, sizeof(buffer))) > 0) {
+			data.append(buffer, n);
+			complete = decodeRequest(data, &cwd, &args);
+		}
+		if (!complete) {
+			PDEBUG << "Incomplete request, ignoring it" << endl;
+			return;
+		}
+
+		sys::fs::chdir(cwd);
+		ret = handle(args, out, err);
+	} catch (const PepperException &ex) {
+		err << "Error handling request: " << ex.where() << ": " << ex.what() << std::endl;
+	} catch (const std::exception &ex) {
+		err << "Error handling request: " << ex.what() << std::endl;
+	}
+
+	std::string o = out.str(), e = err.str();
+	std::string header = str::printf("%d %lu %lu\n", ret, (unsigned long)o.length(), (unsigned long)e.length());
+	try {
+		socket->write(header.data(), header.length());
+		socket->write(o.data(), o.length());
+		socket->write(e.data(), e.length());
+	} catch (const PepperException &ex) {
+		PDEBUG << "Error sending response: " << ex.what() << endl;
+	}
+}
+
+// Runs a single request
+int Daemon::handle(const std::vector<std::string> &args, std::ostream &out, std::ostream &err)
+{
+	std::vector<char *> argv;
+	argv.push_back((char *)PACKAGE_NAME);
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back((char *)args[i].c_str());
+	}
+	argv.push_back(NULL);
+
+	// Verbosity flags only apply to the request
+	int level = Logger::level();
+	Options opts;
+	try {
+		opts.parse(argv.size() - 1, &argv[0]);
+	} catch (const std::exception &ex) {
+		Logger::setLevel(level);
+		err << "Error parsing arguments: " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	struct LevelRestorer {
+		int level;
+		~LevelRestorer() { Logger::setLevel(level); }
+	} restorer = {level};
+
+	bool transfer = (!opts.exportCache().empty() || !opts.importCache().empty());
+	if (opts.helpRequested() || opts.versionRequested() || opts.backendListRequested() || opts.reportListRequested() || !opts.daemonSocket().empty()) {
+		err << "Error: This request can't be handled by the daemon" << std::endl;
+		return EXIT_FAILURE;
+	} else if (opts.repository().empty() || (opts.reports().empty() && !transfer)) {
+		err << "Error: No report given" << std::endl;
+		return EXIT_FAILURE;
+	} else if (transfer && !opts.useCache()) {
+		err << "Error: Cache bundles can't be transferred with --no-cache" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	Entry *e = entry(opts);
+	Backend *source = (e->cache ? e->cache : e->backend);
+
+	int ret = EXIT_SUCCESS;
+	try {
+		std::vector<std::string> bundles = opts.importCaches();
+		for (size_t i = 0; i < bundles.size(); i++) {
+			size_t n = e->cache->importBundle(bundles[i]);
+			Logger::info() << "Imported " << n << " new revisions from " << bundles[i] << endl;
+		}
+		int k, n;
+		if (opts.exportCache().empty()) {
+			// Nothing to export
+		} else if (opts.shard(&k, &n)) {
+			e->cache->exportShard(opts.exportCache(), k, n);
+		} else {
+			e->cache->exportBundle(opts.exportCache());
+		}
+	} catch (const PepperException &ex) {
+		err << "Error transferring cache bundle: " << ex.where() << ": " << ex.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+
+	std::vector<std::string> reports = opts.reports();
+	if (reports.empty() || ret != EXIT_SUCCESS) {
+		// Only cache bundles have been transferred
+	} else if (reports.size() == 1) {
+		Report r(reports[0], opts.reportOptions(reports[0]), source);
+		ret = r.run(out, err);
+	} else {
+		MemoryCache memcache(source, opts);
+		for (size_t i = 0; i < reports.size(); i++) {
+			Report r(reports[i], opts.reportOptions(reports[i]), &memcache);
+			if (r.run(out, err) != EXIT_SUCCESS) {
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	Plot::wait(&out);
+	if (e->cache) {
+		e->cache->flush();
+	}
+	ReportCache::flush();
+	return ret;
+}
+
+// Returns the backend and caches for the given options, setting them up
+// if necessary
+Daemon::Entry *Daemon::entry(const Options &options)
+{
+	std::string k = key(options);
+	std::map<std::string, Entry *>::iterator it = m_entries.find(k);
+	if (it != m_entries.end()) {
+		PDEBUG << "Reusing backend for " << options.repository() << endl;
+		return it->second;
+	}
+
+	// The backend and the caches keep a reference to the options
+	Entry *e = new Entry();
+	e->options = new Options(options);
+	try {
+		e->backend = Backend::backendFor(*e->options);
+		if (e->backend == NULL) {
+			throw PEX(str::printf("No backend found for url: %s", options.repository().c_str()));
+		}
+		e->backend->init();
+
+		if (e->options->useCache()) {
+			Backend *source = e->backend;
+			if (!e->options->remoteCache().empty()) {
+				e->remote = new RemoteCache(e->backend, *e->options);
+				source = e->remote;
+			}
+#ifdef USE_LDBCACHE
+			e->cache = new LdbCache(source, *e->options);
+#else
+			e->cache = new Cache(source, *e->options);
+#endif
+			e->cache->init();
+		}
+	} catch (...) {
+		delete e;
+		throw;
+	}
+
+	Logger::info() << "Opened " << e->backend->name() << " repository " << options.repository() << endl;
+	m_entries[k] = e;
+	return e;
+}
+
+// Returns a key that identifies the backend setup for the given options
+std::string Daemon::key(const Options &options)
+{
+	std::map<std::string, std::string> opts = options.options();
+	for (size_t i = 0; i < sizeof(requestOptions) / sizeof(requestOptions[0]); i++) {
+		opts.erase(requestOptions[i]);
+	}
+
+	std::string k;
+	for (std::map<std::string, std::string>::const_iterator it = opts.begin(); it != opts.end(); ++it) {
+		k += it->first;
+		k += '=';
+		k += it->second;
+		k += '\0';
+	}
+	return k;
+}
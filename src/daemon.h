@@ -0,0 +1,83 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: daemon.h
+ * Long-running report server (interface)
+ */
+
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+#include "syslib/net.h"
+
+class AbstractCache;
+class Backend;
+class Options;
+
+
+/*
+ * Runs reports on behalf of clients connecting to a UNIX domain socket.
+ * The backend and the revision caches of a repository are set up for the
+ * first request and kept open for the following ones, so their setup cost
+ * and the cache index are only paid for once.
+ *
+ * A request contains the working directory of the client and its command
+ * line, as NUL-terminated strings preceded by the number of arguments. The
+ * response consists of a "<status> <output length> <error length>" line,
+ * followed by the report output and the error messages. Requests are
+ * handled one after another.
+ */
+class Daemon
+{
+	public:
+		Daemon(const Options &options);
+		~Daemon();
+
+		int run();
+		void terminate();
+
+		static int request(const std::string &socket, int argc, char **argv);
+
+		static std::string encodeRequest(const std::string &cwd, const std::vector<std::string> &args);
+		static bool decodeRequest(const std::string &data, std::string *cwd, std::vector<std::string> *args);
+
+	private:
+		struct Entry
+		{
+			Options *options;
+			Backend *backend;
+			AbstractCache *remote, *cache;
+
+			Entry() : options(NULL), backend(NULL), remote(NULL), cache(NULL) { }
+			~Entry();
+		};
+
+		void serve(sys::net::Socket *socket);
+		int handle(const std::vector<std::string> &args, std::ostream &out, std::ostream &err);
+		Entry *entry(const Options &options);
+
+		static std::string key(const Options &options);
+
+	PEPPER_PVARS:
+		const Options &m_opts;
+		std::string m_path;
+		sys::net::Server m_server;
+		std::map<std::string, Entry *> m_entries;
+};
+
+
+#endif // DAEMON_H_
@@ -13,75 +13,539 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <unordered_map>
+
+#include <fnmatch.h>
+
 #include "bstream.h"
 #include "logger.h"
 #include "luahelpers.h"
+#include "pool.h"
 #include "strlib.h"
+#include "tracer.h"
+
+#include "syslib/parallel.h"
 
 #include "diffstat.h"
 
+#define COMPACT_MARKER 0xFF // Can't be the first byte of a legacy file count
+#define COMPACT_VERSION 2
+#define COMPACT_LINES_VERSION 3 // Same as above, without byte counts
+#define MAX_PATH_LENGTH 65536 // Longer paths indicate corrupted data
+#define MAX_LINE_PREFIX 65536 // Only the beginning of longer diff lines is kept
+
+
+namespace
+{
+
+/*
+ * Reads the next chunk of data from a stream buffer. The function never
+ * requests more than the stream buffer holds after a single refill, so it
+ * won't block on pipes that are still open, like the one of the git
+ * diff-tree prefetcher.
+ */
+std::streamsize readChunk(std::streambuf *buf, char *data, std::streamsize max)
+{
+	// Let the stream buffer refill its get area before asking for
+	// the number of characters available
+	std::streamsize n = buf->in_avail();
+	if (n <= 0) {
+		if (buf->sgetc() == std::streambuf::traits_type::eof()) {
+			return 0;
+		}
+		n = buf->in_avail();
+	}
+	n = (n > 0 ? std::min(n, max) : 1);
+	return buf->sgetn(data, n);
+}
+
+// Removes white-space characters from both ends of a range
+inline void trim(const char **begin, const char **end)
+{
+	while (*begin < *end && isspace((unsigned char)**begin)) {
+		++*begin;
+	}
+	while (*end > *begin && isspace((unsigned char)(*end)[-1])) {
+		--*end;
+	}
+}
+
+// Returns whether the line marks a binary file that has no textual diff
+bool binaryMarker(const char *line, size_t len)
+{
+	static const char *markers[] = {
+		"Binary file", // git, diff and Mercurial
+		"GIT binary patch",
+		"Cannot display: file marked as a binary type." // Subversion
+	};
+	for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+		size_t n = strlen(markers[i]);
+		if (len >= n && !memcmp(line, markers[i], n)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parses a line count of a hunk header, like str::str2int()
+inline void parseCount(const char *begin, const char *end, int *count)
+{
+	char buffer[32];
+	size_t n = end - begin;
+	if (n >= sizeof(buffer)) {
+		str::str2int(std::string(begin, n), count);
+		return;
+	}
+	memcpy(buffer, begin, n);
+	buffer[n] = '\0';
+
+	char *last;
+	long long val = strtoll(buffer, &last, 0);
+	if (errno == ERANGE || last == buffer || val > std::numeric_limits<int>::max() || val < std::numeric_limits<int>::min()) {
+		return;
+	}
+	*count = (int)val;
+}
+
+// Key for path lookups that doesn't own or copy the string data
+struct PathKey
+{
+	const char *data;
+	size_t len;
+
+	PathKey(const char *data, size_t len) : data(data), len(len) { }
+
+	inline bool operator==(const PathKey &other) const {
+		return (len == other.len && !memcmp(data, other.data, len));
+	}
+};
+
+// FNV-1a hash for path keys
+struct PathKeyHash
+{
+	inline size_t operator()(const PathKey &key) const {
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < key.len; i++) {
+			h = (h ^ (unsigned char)key.data[i]) * 1099511628211ULL;
+		}
+		return (size_t)h;
+	}
+};
+
+// Process-wide path intern table. Strings are stored in a deque, so
+// references to them (and the keys pointing to their data) stay valid when
+// new paths are added.
+struct PathTable
+{
+	sys::parallel::Mutex mutex;
+	std::deque<std::string> paths;
+	std::unordered_map<PathKey, uint32_t, PathKeyHash> ids;
+};
+
+PathTable &pathTable()
+{
+	static PathTable table;
+	return table;
+}
+
+// Orders entries by path ID
+inline bool entryLess(const Diffstat::Entry &a, const Diffstat::Entry &b)
+{
+	return a.first < b.first;
+}
+
+// Orders path/stat pairs by path name
+inline bool nameLess(const std::pair<const std::string *, const Diffstat::Stat *> &a, const std::pair<const std::string *, const Diffstat::Stat *> &b)
+{
+	return *a.first < *b.first;
+}
+
+} // anonymous namespace
+
+
 
 // Constructor
 Diffstat::Diffstat()
+	: m_linesOnly(false)
 {
 
 }
 
+// Returns a new, empty diffstat allocated from the object pool
+std::shared_ptr<Diffstat> Diffstat::create()
+{
+	return std::allocate_shared<Diffstat>(PoolAllocator<Diffstat>());
+}
+
+// Returns a copy of the given diffstat allocated from the object pool
+std::shared_ptr<Diffstat> Diffstat::create(const Diffstat &other)
+{
+	return std::allocate_shared<Diffstat>(PoolAllocator<Diffstat>(), other);
+}
+
 // Destructor
 Diffstat::~Diffstat()
 {
 
 }
 
-// Returns the actual stats
+// Returns a copy of the stats, keyed by path. Use entries() for iterating
+// over the stats without copying them.
 std::map<std::string, Diffstat::Stat> Diffstat::stats() const
 {
-	return m_stats;
+	std::map<std::string, Stat> stats;
+	for (size_t i = 0; i < m_stats.size(); i++) {
+		stats[path(m_stats[i].first)] = m_stats[i].second;
+	}
+	return stats;
 }
 
-// Removes all paths not matching the given filter
-void Diffstat::filter(const std::string &prefix)
+// Returns the stat for the given path, or NULL if the path is not included
+const Diffstat::Stat *Diffstat::stat(const char *path, size_t len) const
 {
-	std::map<std::string, Stat>::iterator it = m_stats.begin();
-	while (it != m_stats.end()) {
-		if (it->first.compare(0, prefix.length(), prefix)) {
-			PTRACE << "Removed " << it->first << " from diffstat" << endl;
-			m_stats.erase(it++);
-		} else {
-			++it;
+	uint32_t id;
+	if (!lookup(path, len, &id)) {
+		return NULL;
+	}
+	Entries::const_iterator it = std::lower_bound(m_stats.begin(), m_stats.end(), Entry(id, Stat()), entryLess);
+	if (it == m_stats.end() || it->first != id) {
+		return NULL;
+	}
+	return &it->second;
+}
+
+// Adds a stat for the given path, merging it with any existing stat
+void Diffstat::add(const std::string &path, const Stat &stat)
+{
+	Entry entry(intern(path), stat);
+	Entries::iterator it = std::lower_bound(m_stats.begin(), m_stats.end(), entry, entryLess);
+	if (it != m_stats.end() && it->first == entry.first) {
+		it->second.merge(stat);
+	} else {
+		m_stats.insert(it, entry);
+	}
+	m_total.merge(stat);
+}
+
+// Returns the diffstat without paths not matching the given prefix
+std::shared_ptr<Diffstat> Diffstat::filter(const std::shared_ptr<Diffstat> &stat, const std::string &prefix)
+{
+	std::vector<bool> keep(stat->m_stats.size(), true);
+	for (size_t i = 0; i < keep.size(); i++) {
+		const std::string &file = path(stat->m_stats[i].first);
+		if (file.compare(0, prefix.length(), prefix)) {
+			PTRACE << "Removed " << file << " from diffstat" << endl;
+			keep[i] = false;
+		}
+	}
+	return select(stat, keep, true);
+}
+
+// Returns the diffstat without files matching one of the given patterns
+std::shared_ptr<Diffstat> Diffstat::exclude(const std::shared_ptr<Diffstat> &stat, const std::vector<std::string> &patterns)
+{
+	if (patterns.empty()) {
+		return stat;
+	}
+
+	std::vector<bool> keep(stat->m_stats.size(), true);
+	for (size_t i = 0; i < keep.size(); i++) {
+		if (excluded(path(stat->m_stats[i].first).c_str(), patterns)) {
+			PTRACE << "Excluded " << path(stat->m_stats[i].first) << " from diffstat" << endl;
+			keep[i] = false;
+		}
+	}
+	return select(stat, keep, true);
+}
+
+// Returns the diffstat without files with more than the given number of
+// changed lines, or the diffstat itself if the limit is 0
+std::shared_ptr<Diffstat> Diffstat::limit(const std::shared_ptr<Diffstat> &stat, uint64_t lines)
+{
+	if (lines == 0) {
+		return stat;
+	}
+
+	std::vector<bool> keep(stat->m_stats.size(), true);
+	for (size_t i = 0; i < keep.size(); i++) {
+		const Stat &s = stat->m_stats[i].second;
+		if (s.ladd + s.ldel > lines) {
+			PTRACE << "Skipped " << path(stat->m_stats[i].first) << " with " << (s.ladd + s.ldel) << " changed lines" << endl;
+			keep[i] = false;
+		}
+	}
+	return select(stat, keep, false);
+}
+
+// Returns the union of the given diffstats, e.g. of diffs of disjoint sets
+// of paths. Stats of paths contained in more than one diffstat are merged.
+std::shared_ptr<Diffstat> Diffstat::merge(const std::vector<std::shared_ptr<Diffstat> > &stats)
+{
+	std::shared_ptr<Diffstat> d = create();
+	size_t n = 0;
+	for (size_t i = 0; i < stats.size(); i++) {
+		n += stats[i]->m_stats.size();
+	}
+	d->m_stats.reserve(n);
+	for (size_t i = 0; i < stats.size(); i++) {
+		d->m_stats.insert(d->m_stats.end(), stats[i]->m_stats.begin(), stats[i]->m_stats.end());
+		d->m_linesOnly = (d->m_linesOnly || stats[i]->m_linesOnly);
+	}
+	d->sort();
+	return d;
+}
+
+// Returns a new diffstat with the flagged entries of the given one, or the
+// diffstat itself if all entries are kept. Totals are either recomputed or
+// reduced by the dropped entries.
+std::shared_ptr<Diffstat> Diffstat::select(const std::shared_ptr<Diffstat> &stat, const std::vector<bool> &keep, bool recount)
+{
+	size_t n = std::count(keep.begin(), keep.end(), true);
+	if (n == keep.size()) {
+		return stat;
+	}
+
+	std::shared_ptr<Diffstat> d = create();
+	d->m_linesOnly = stat->m_linesOnly;
+	d->m_stats.reserve(n);
+	d->m_total = (recount ? Stat() : stat->m_total);
+	for (size_t i = 0; i < keep.size(); i++) {
+		const Stat &s = stat->m_stats[i].second;
+		if (keep[i]) {
+			d->m_stats.push_back(stat->m_stats[i]);
+			if (recount) {
+				d->m_total.merge(s);
+			}
+		} else if (!recount) {
+			d->m_total.ladd -= s.ladd; d->m_total.ldel -= s.ldel;
+			d->m_total.cadd -= s.cadd; d->m_total.cdel -= s.cdel;
 		}
 	}
+	return d;
 }
 
-// Writes the stat to a binary stream
+// Writes the stat to a binary stream in the compact format: each path is
+// front-coded against the previous one in lexicographical order, and the
+// counters are written as varints, grouped column-wise
 void Diffstat::write(BOStream &out) const
 {
-	out << (uint32_t)m_stats.size();
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		out << it->first.data();
-		out << it->second.cadd << it->second.ladd << it->second.cdel << it->second.ldel;
+	std::vector<std::pair<const std::string *, const Stat *> > files = sorted();
+	out << char(COMPACT_MARKER) << char(m_linesOnly ? COMPACT_LINES_VERSION : COMPACT_VERSION);
+	out.writeVarint(files.size());
+
+	const std::string *prev = NULL;
+	for (size_t i = 0; i < files.size(); i++) {
+		const std::string &file = *files[i].first;
+		size_t shared = 0;
+		if (prev != NULL) {
+			size_t n = std::min(prev->length(), file.length());
+			while (shared < n && (*prev)[shared] == file[shared]) {
+				++shared;
+			}
+		}
+		out.writeVarint(shared);
+		out.writeVarint(file.length() - shared);
+		out.write(file.data() + shared, file.length() - shared);
+		prev = &file;
+	}
+
+	// Lines-only diffstats skip the byte columns
+	uint64_t Stat::*columns[] = { &Stat::cadd, &Stat::ladd, &Stat::cdel, &Stat::ldel };
+	for (int j = 0; j < 4; j++) {
+		if (m_linesOnly && (j == 0 || j == 2)) {
+			continue;
+		}
+		for (size_t i = 0; i < files.size(); i++) {
+			out.writeVarint(files[i].second->*columns[j]);
+		}
+	}
+	for (int j = 0; j < 4; j++) {
+		if (!m_linesOnly || (j != 0 && j != 2)) {
+			out.writeVarint(m_total.*columns[j]);
+		}
 	}
 }
 
-// Loads the stat from a binary stream
+// Writes the stat in the format of revision version 1
+void Diffstat::writeLegacy(BOStream &out) const
+{
+	// Files are written in lexicographical order, independent of path IDs
+	std::vector<std::pair<const std::string *, const Stat *> > files = sorted();
+	out << (uint32_t)files.size();
+	for (size_t i = 0; i < files.size(); i++) {
+		out << files[i].first->data();
+		out << files[i].second->cadd << files[i].second->ladd << files[i].second->cdel << files[i].second->ldel;
+	}
+}
+
+// Loads the stat from a binary stream in either format. For the legacy
+// format, the totals are computed from the file stats.
 bool Diffstat::load(BIStream &in)
 {
 	m_stats.clear();
-	uint32_t i = 0, n;
-	in >> n;
+	char c;
+	in >> c;
+	if ((unsigned char)c != COMPACT_MARKER) {
+		return loadLegacy(in, c);
+	}
+	in >> c;
+	if (c != COMPACT_VERSION && c != COMPACT_LINES_VERSION) {
+		PDEBUG << "Unknown diffstat version number " << int(c) << ", aborting" << endl;
+		return false;
+	}
+	m_linesOnly = (c == COMPACT_LINES_VERSION);
+
+	uint64_t n;
+	in.readVarint(n);
+	m_stats.reserve(std::min(n, (uint64_t)4096)); // Don't trust corrupted data
+	std::string buffer;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t shared, length;
+		in.readVarint(shared).readVarint(length);
+		if (in.eof() || shared > buffer.length() || shared + length == 0 || length > MAX_PATH_LENGTH) {
+			return false;
+		}
+		buffer.resize(shared + length);
+		if (length > 0 && in.read(&buffer[shared], length) != (ssize_t)length) {
+			return false;
+		}
+		append(intern(buffer));
+	}
+
+	uint64_t Stat::*columns[] = { &Stat::cadd, &Stat::ladd, &Stat::cdel, &Stat::ldel };
+	for (int j = 0; j < 4; j++) {
+		if (m_linesOnly && (j == 0 || j == 2)) {
+			continue;
+		}
+		for (size_t i = 0; i < m_stats.size(); i++) {
+			in.readVarint(m_stats[i].second.*columns[j]);
+		}
+	}
+	sort();
+	for (int j = 0; j < 4; j++) {
+		if (!m_linesOnly || (j != 0 && j != 2)) {
+			in.readVarint(m_total.*columns[j]);
+		}
+	}
+	return true;
+}
+
+// Loads the stat in the legacy format, given the first byte of the data
+bool Diffstat::loadLegacy(BIStream &in, char first)
+{
+	unsigned char rest[3] = {0, 0, 0};
+	in.read(rest, sizeof(rest));
+	uint32_t i = 0, n = (uint32_t((unsigned char)first) << 24) | (uint32_t(rest[0]) << 16) | (uint32_t(rest[1]) << 8) | uint32_t(rest[2]);
+	m_stats.reserve(std::min(n, (uint32_t)4096)); // Don't trust corrupted data
 	std::string buffer;
-	Stat stat;
 	while (i++ < n && !in.eof()) {
 		in >> buffer;
 		if (buffer.empty()) {
 			return false;
 		}
+		Stat &stat = append(intern(buffer));
 		in >> stat.cadd >> stat.ladd >> stat.cdel >> stat.ldel;
-		m_stats[buffer] = stat;
 	}
+	sort();
 	return true;
 }
 
+// Returns the ID of the given path, adding it to the intern table if needed
+uint32_t Diffstat::intern(const std::string &path)
+{
+	PathTable &table = pathTable();
+	table.mutex.lock();
+	std::unordered_map<PathKey, uint32_t, PathKeyHash>::const_iterator it = table.ids.find(PathKey(path.data(), path.length()));
+	uint32_t id;
+	if (it != table.ids.end()) {
+		id = it->second;
+	} else {
+		id = (uint32_t)table.paths.size();
+		table.paths.push_back(path);
+		table.ids[PathKey(table.paths.back().data(), path.length())] = id;
+	}
+	table.mutex.unlock();
+	return id;
+}
+
+// Looks up the ID of the given path without interning it
+bool Diffstat::lookup(const char *path, size_t len, uint32_t *id)
+{
+	PathTable &table = pathTable();
+	table.mutex.lock();
+	std::unordered_map<PathKey, uint32_t, PathKeyHash>::const_iterator it = table.ids.find(PathKey(path, len));
+	bool found = (it != table.ids.end());
+	if (found) {
+		*id = it->second;
+	}
+	table.mutex.unlock();
+	return found;
+}
+
+// Returns the path with the given ID
+const std::string &Diffstat::path(uint32_t id)
+{
+	PathTable &table = pathTable();
+	table.mutex.lock();
+	const std::string &path = table.paths[id];
+	table.mutex.unlock();
+	return path;
+}
+
+// Checks whether a path matches one of the given glob patterns, like Git
+// does for pathspecs: wildcards match slashes as well, and a pattern that
+// matches a directory applies to everything below it
+bool Diffstat::excluded(const char *path, const std::vector<std::string> &patterns)
+{
+	for (size_t i = 0; i < patterns.size(); i++) {
+		const std::string &pattern = patterns[i];
+		if (fnmatch(pattern.c_str(), path, 0) == 0) {
+			return true;
+		}
+		for (const char *p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/')) {
+			std::string dir(path, p - path);
+			if (fnmatch(pattern.c_str(), dir.c_str(), 0) == 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Sorts the stats by path ID, merges entries of the same path and updates
+// the totals. This has to be called after adding entries with append().
+void Diffstat::sort()
+{
+	std::stable_sort(m_stats.begin(), m_stats.end(), entryLess);
+	Entries::iterator out = m_stats.begin();
+	m_total = Stat();
+	for (Entries::iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
+		m_total.merge(it->second);
+		if (out != m_stats.begin() && (out-1)->first == it->first) {
+			(out-1)->second.merge(it->second);
+		} else {
+			*out++ = *it;
+		}
+	}
+	m_stats.erase(out, m_stats.end());
+}
+
+// Returns pointers to all paths and their stats, sorted by path name
+std::vector<std::pair<const std::string *, const Diffstat::Stat *> > Diffstat::sorted() const
+{
+	std::vector<std::pair<const std::string *, const Stat *> > files(m_stats.size());
+	for (size_t i = 0; i < m_stats.size(); i++) {
+		files[i] = std::make_pair(&path(m_stats[i].first), &m_stats[i].second);
+	}
+	std::sort(files.begin(), files.end(), nameLess);
+	return files;
+}
+
 /*
  * Lua binding
  */
@@ -93,186 +557,357 @@ Lunar<Diffstat>::RegType Diffstat::methods[] = {
 	LUNAR_DECLARE_METHOD(Diffstat, bytes_added),
 	LUNAR_DECLARE_METHOD(Diffstat, lines_removed),
 	LUNAR_DECLARE_METHOD(Diffstat, bytes_removed),
+	LUNAR_DECLARE_METHOD(Diffstat, totals),
+	LUNAR_DECLARE_METHOD(Diffstat, has_bytes),
 	{0,0}
 };
 
-Diffstat::Diffstat(lua_State *L) {
+Diffstat::Diffstat(lua_State *L)
+	: m_linesOnly(false) {
 	Diffstat *other = Lunar<Diffstat>::check(L, 1);
 	if (other == NULL) {
 		return;
 	}
 	m_stats = other->m_stats;
+	m_total = other->m_total;
+	m_linesOnly = other->m_linesOnly;
 }
 
 int Diffstat::files(lua_State *L) {
-	std::vector<std::string> v(m_stats.size());
-	int i = 0;
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		v[i++] = it->first;
+	std::vector<std::pair<const std::string *, const Stat *> > files = sorted();
+	lua_createtable(L, files.size(), 0);
+	for (size_t i = 0; i < files.size(); i++) {
+		lua_pushlstring(L, files[i].first->data(), files[i].first->length());
+		lua_rawseti(L, -2, i+1);
 	}
-	return LuaHelpers::push(L, v);
+	return 1;
 }
 
 int Diffstat::lines_added(lua_State *L) {
-	if (lua_gettop(L) >= 1) {
-		std::string file = LuaHelpers::pops(L);
-		if (m_stats.find(file) != m_stats.end()) {
-			return LuaHelpers::push(L, m_stats[file].ladd);
-		}
-		return LuaHelpers::push(L, 0);
-	}
+	return push(L, &Stat::ladd);
+}
+
+int Diffstat::bytes_added(lua_State *L) {
+	return push(L, &Stat::cadd);
+}
+
+int Diffstat::lines_removed(lua_State *L) {
+	return push(L, &Stat::ldel);
+}
+
+int Diffstat::bytes_removed(lua_State *L) {
+	return push(L, &Stat::cdel);
+}
 
-	// Return total
-	int n = 0;
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		n += it->second.ladd;
+int Diffstat::totals(lua_State *L) {
+	LuaHelpers::push(L, m_total.ladd);
+	LuaHelpers::push(L, m_total.cadd);
+	LuaHelpers::push(L, m_total.ldel);
+	LuaHelpers::push(L, m_total.cdel);
+	return 4;
+}
+
+int Diffstat::has_bytes(lua_State *L) {
+	return LuaHelpers::push(L, !m_linesOnly);
+}
+
+// Returns an iterator function for generic for loops, yielding the path,
+// lines added, lines removed, bytes added and bytes removed of every file.
+// The diffstat is referenced by the iterator's upvalues.
+int Diffstat::share(lua_State *L) {
+	lua_remove(L, 1);
+	return LuaHelpers::push(L, Lunar<Diffstat>::ptr(L, 1));
+}
+
+int Diffstat::each(lua_State *L) {
+	Lunar<Diffstat>::check(L, 1);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, &Diffstat::next, 2);
+	return 1;
+}
+
+// Iterator function returned by each()
+int Diffstat::next(lua_State *L) {
+	Diffstat *d = Lunar<Diffstat>::check(L, lua_upvalueindex(1));
+	size_t i = lua_tointeger(L, lua_upvalueindex(2));
+	if (i >= d->m_stats.size()) {
+		return 0;
 	}
-	return LuaHelpers::push(L, n);
+	lua_pushinteger(L, i+1);
+	lua_replace(L, lua_upvalueindex(2));
+
+	const std::string &file = path(d->m_stats[i].first);
+	const Stat &s = d->m_stats[i].second;
+	lua_pushlstring(L, file.data(), file.length());
+	LuaHelpers::push(L, s.ladd);
+	LuaHelpers::push(L, s.ldel);
+	LuaHelpers::push(L, s.cadd);
+	LuaHelpers::push(L, s.cdel);
+	return 5;
 }
 
-int Diffstat::bytes_added(lua_State *L) {
+// Pushes a field of the stat of the file given as the first argument, or
+// the total if there is no argument
+int Diffstat::push(lua_State *L, uint64_t Stat::*field) {
 	if (lua_gettop(L) >= 1) {
-		std::string file = LuaHelpers::pops(L);
-		if (m_stats.find(file) != m_stats.end()) {
-			return LuaHelpers::push(L, m_stats[file].cadd);
-		}
-		return LuaHelpers::push(L, 0);
+		// The string is used directly from the stack without copying it
+		size_t len;
+		const char *file = luaL_checklstring(L, -1, &len);
+		const Stat *s = stat(file, len);
+		lua_pop(L, 1);
+		return LuaHelpers::push(L, (s ? s->*field : 0));
 	}
+	return LuaHelpers::push(L, m_total.*field);
+}
 
-	// Return total
-	int n = 0;
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		n += it->second.cadd;
-	}
-	return LuaHelpers::push(L, n);
+
+uint64_t DiffParser::s_limit = 0;
+
+// Constructor
+DiffParser::DiffParser(Format format)
+	: m_format(format)
+{
+	reset();
 }
 
-int Diffstat::lines_removed(lua_State *L) {
-	if (lua_gettop(L) >= 1) {
-		std::string file = LuaHelpers::pops(L);
-		if (m_stats.find(file) != m_stats.end()) {
-			return LuaHelpers::push(L, m_stats[file].ldel);
+// Parses a chunk of diff data. Lines may span multiple chunks. Only the
+// beginning of very long lines is kept in memory, since the remainder
+// doesn't matter for the line and byte counts.
+void DiffParser::feed(const char *data, size_t len)
+{
+	while (len > 0 && !m_done) {
+		const char *nl = (const char *)memchr(data, '\n', len);
+		if (nl == NULL) {
+			carry(data, len);
+			break;
 		}
-		return LuaHelpers::push(L, 0);
-	}
 
-	// Return total
-	int n = 0;
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		n += it->second.ldel;
+		if (m_carryLength == 0) {
+			parseLine(data, nl - data, nl - data);
+		} else {
+			carry(data, nl - data);
+			parseLine(m_carry.data(), m_carry.length(), m_carryLength);
+			m_carry.clear();
+			m_carryLength = 0;
+		}
+		len -= (nl - data) + 1;
+		data = nl + 1;
 	}
-	return LuaHelpers::push(L, n);
 }
 
-int Diffstat::bytes_removed(lua_State *L) {
-	if (lua_gettop(L) >= 1) {
-		std::string file = LuaHelpers::pops(L);
-		if (m_stats.find(file) != m_stats.end()) {
-			return LuaHelpers::push(L, m_stats[file].cdel);
-		}
-		return LuaHelpers::push(L, 0);
+// Parses any remaining data and returns the resulting diffstat. The parser
+// can be used for another diff afterwards.
+DiffstatPtr DiffParser::finish()
+{
+	if (m_carryLength > 0 && !m_done) {
+		parseLine(m_carry.data(), m_carry.length(), m_carryLength);
 	}
+	flush();
+	m_stat->sort();
 
-	// Return total
-	int n = 0;
-	for (std::map<std::string, Stat>::const_iterator it = m_stats.begin(); it != m_stats.end(); ++it) {
-		n += it->second.cdel;
+	DiffstatPtr stat = m_stat;
+	reset();
+	return stat;
+}
+
+// Sets the maximum number of changed lines per file. Larger files are
+// skipped like binary files, and their remaining diff lines aren't
+// counted. A limit of 0 disables the check.
+void DiffParser::setLimit(uint64_t lines)
+{
+	s_limit = lines;
+}
+
+// Static diff parsing function
+DiffstatPtr DiffParser::parse(std::istream &in, Format format)
+{
+	PTRACE_SCOPE("diff.parse");
+	DiffParser parser(format);
+	char data[16384];
+	std::streambuf *buf = in.rdbuf();
+	while (!parser.done()) {
+		std::streamsize n = readChunk(buf, data, sizeof(data));
+		if (n <= 0) {
+			break;
+		}
+		parser.feed(data, n);
 	}
-	return LuaHelpers::push(L, n);
+	return parser.finish();
 }
 
+// Resets the parser state
+void DiffParser::reset()
+{
+	m_stat = Diffstat::create();
+	m_stat->m_linesOnly = (m_format == Numstat);
+	m_file.clear();
+	m_fstat = Diffstat::Stat();
+	m_chunk[0] = m_chunk[1] = 0;
+	m_carry.clear();
+	m_carryLength = 0;
+	m_skip = false;
+	m_done = false;
+}
 
-// Constructor
-DiffParser::DiffParser(std::istream &in)
-	: sys::parallel::Thread(), m_in(in)
+// Appends part of an incomplete line to the carry-over buffer
+void DiffParser::carry(const char *data, size_t len)
 {
+	if (m_carry.length() < MAX_LINE_PREFIX) {
+		m_carry.append(data, std::min(len, MAX_LINE_PREFIX - m_carry.length()));
+	}
+	m_carryLength += len;
+}
 
+// Adds the stat of the current file to the diffstat
+void DiffParser::flush()
+{
+	if (!m_file.empty() && !m_fstat.empty()) {
+		m_stat->append(Diffstat::intern(m_file)) = m_fstat;
+	}
+	m_file.clear();
+	m_fstat = Diffstat::Stat();
 }
 
-// Returns the internal diffstat object
-DiffstatPtr DiffParser::stat() const
+// Checks the number of changed lines of the current file against the limit
+void DiffParser::checkLimit()
 {
-	return m_stat;
+	if (s_limit > 0 && m_fstat.ladd + m_fstat.ldel > s_limit) {
+		PTRACE << "Skipping " << m_file << " with more than " << s_limit << " changed lines" << endl;
+		m_fstat = Diffstat::Stat();
+		m_skip = true;
+	}
 }
 
-// Static diff parsing function for unified diffs
-DiffstatPtr DiffParser::parse(std::istream &in)
+// Parses a single line without the trailing newline character. Only the
+// first len bytes of the line are available, while length is its actual
+// length.
+void DiffParser::parseLine(const char *line, size_t len, size_t length)
 {
 	static const char marker[] = "===================================================================";
 
-	std::string str, file;
-	DiffstatPtr ds = std::make_shared<Diffstat>();
-	Diffstat::Stat stat;
-	int chunk[2] = {0, 0};
-
-	while (in.good()) {
-		std::getline(in, str);
-		if (chunk[0] <= 0 && chunk[1] <= 0 && (!str.compare(0, 4, "--- ") || !str.compare(0, 4, "+++ "))) {
-			if (!file.empty() && !stat.empty()) {
-				ds->m_stats[file] = stat;
-				file = std::string();
-			}
-			stat = Diffstat::Stat();
-			std::vector<std::string> header = str::split(str.substr(4), "\t");
-			if (header.empty()) {
-				throw PEX(std::string("EMPTY HEADER: ")+str);
-			}
-			if (header[0] != "/dev/null") {
-				file = header[0];
-				if (file[0] == '"' && file[file.length()-1] == '"') {
-					file = file.substr(1, file.length()-2);
-				}
-				if (!file.compare(0, 2, "a/") || !file.compare(0, 2, "b/")) {
-					file = file.substr(2);
-				}
+	if (m_format == Numstat) {
+		parseNumstat(line, len);
+		return;
+	}
+
+	if (m_chunk[0] <= 0 && m_chunk[1] <= 0 && len >= 4 && (!memcmp(line, "--- ", 4) || !memcmp(line, "+++ ", 4))) {
+		flush();
+		m_skip = false;
+
+		// The file name is terminated by a tab, if any
+		const char *name = line + 4;
+		const char *end = (const char *)memchr(name, '\t', len - 4);
+		if (end == NULL) {
+			end = line + len;
+		}
+		if (end - name != 9 || memcmp(name, "/dev/null", 9)) {
+			if (end > name && name[0] == '"' && end[-1] == '"') {
+				end = (end - name > 1 ? end - 1 : name + 1);
+				++name;
 			}
-		} else if (!str.compare(0, 2, "@@")) {
-			std::vector<std::string> header = str::split(str.substr(2), "@@", true);
-			if (header.empty()) {
-				throw PEX(std::string("EMPTY HEADER: ")+str);
+			if (end - name >= 2 && (name[0] == 'a' || name[0] == 'b') && name[1] == '/') {
+				name += 2;
 			}
-			std::vector<std::string> ranges = str::split(header[0], " ", true);
-			if (ranges.size() < 2 || ranges[0].empty() || ranges[1].empty()) {
-				throw PEX(std::string("EMPTY HEADER: ")+str);
+			m_file.assign(name, end - name);
+		}
+	} else if (len >= 2 && line[0] == '@' && line[1] == '@') {
+		// Only the first two ranges are used: "@@ -a,b +c,d @@"
+		const char *begin = line + 2, *end = line + len;
+		for (const char *p = begin; p + 1 < end; p++) {
+			if (p[0] == '@' && p[1] == '@') {
+				end = p;
+				break;
 			}
-			size_t pos;
-			if ((pos = ranges[0].find(',')) != std::string::npos) {
-				str::str2int(ranges[0].substr(pos+1), &chunk[(ranges[0][0] == '-' ? 0 : 1)]);
-			} else {
-				chunk[(ranges[0][0] == '-' ? 0 : 1)] = 1;
+		}
+		trim(&begin, &end);
+
+		const char *sep = (const char *)memchr(begin, ' ', end - begin);
+		if (sep == NULL) {
+			throw PEX(std::string("EMPTY HEADER: ")+std::string(line, len));
+		}
+		const char *next = (const char *)memchr(sep + 1, ' ', end - (sep + 1));
+		const char *r[2][2] = {{begin, sep}, {sep + 1, (next ? next : end)}};
+		for (int i = 0; i < 2; i++) {
+			trim(&r[i][0], &r[i][1]);
+			if (r[i][0] == r[i][1]) {
+				throw PEX(std::string("EMPTY HEADER: ")+std::string(line, len));
 			}
-			if ((pos = ranges[1].find(',')) != std::string::npos) {
-				str::str2int(ranges[1].substr(pos+1), &chunk[(ranges[1][0] == '-' ? 0 : 1)]);
+		}
+		for (int i = 0; i < 2; i++) {
+			int *count = &m_chunk[(r[i][0][0] == '-' ? 0 : 1)];
+			const char *comma = (const char *)memchr(r[i][0], ',', r[i][1] - r[i][0]);
+			if (comma != NULL) {
+				parseCount(comma + 1, r[i][1], count);
 			} else {
-				chunk[(ranges[1][0] == '-' ? 0 : 1)] = 1;
+				*count = 1;
 			}
-		} else if (!str.empty() && str[0] == '-') {
-			stat.cdel += str.length();
-			++stat.ldel;
-			--chunk[0];
-		} else if (!str.empty() && str[0] == '+') {
-			stat.cadd += str.length();
-			++stat.ladd;
-			--chunk[1];
-		} else if (str == marker) {
-			chunk[0] = chunk[1] = 0;
-		} else if (!str.empty() && str[0] == (char)EOF) {
-			// git diff-tree pipe prints EOF after diff data
-			break;
-		} else {
-			if (chunk[0] > 0) --chunk[0];
-			if (chunk[1] > 0) --chunk[1];
 		}
+	} else if (len > 0 && line[0] == '-') {
+		--m_chunk[0];
+		if (!m_skip) {
+			m_fstat.cdel += length;
+			++m_fstat.ldel;
+			checkLimit();
+		}
+	} else if (len > 0 && line[0] == '+') {
+		--m_chunk[1];
+		if (!m_skip) {
+			m_fstat.cadd += length;
+			++m_fstat.ladd;
+			checkLimit();
+		}
+	} else if (m_chunk[0] <= 0 && m_chunk[1] <= 0 && binaryMarker(line, len)) {
+		// Binary files are skipped until the next file header
+		flush();
+		m_skip = true;
+	} else if (len == sizeof(marker) - 1 && !memcmp(line, marker, len)) {
+		m_chunk[0] = m_chunk[1] = 0;
+	} else if (len > 0 && line[0] == (char)EOF) {
+		// git diff-tree pipe prints EOF after diff data
+		m_done = true;
+	} else {
+		if (m_chunk[0] > 0) --m_chunk[0];
+		if (m_chunk[1] > 0) --m_chunk[1];
 	}
-
-	if (!file.empty() && !stat.empty()) {
-		ds->m_stats[file] = stat;
-	}
-	return ds;
 }
 
-// Main thread function
-void DiffParser::run()
+// Parses a single line of numstat output, i.e. "<added>\t<removed>\t<path>".
+// Binary files are listed with dashes instead of numbers and are skipped,
+// like for unified diffs. Other lines, e.g. the commit IDs printed by
+// "git diff-tree --stdin", are ignored.
+void DiffParser::parseNumstat(const char *line, size_t len)
 {
-	m_stat = parse(m_in);
+	if (len > 0 && line[0] == (char)EOF) {
+		m_done = true;
+		return;
+	}
+
+	const char *end = line + len;
+	const char *t1 = (const char *)memchr(line, '\t', len);
+	const char *t2 = (t1 ? (const char *)memchr(t1 + 1, '\t', end - t1 - 1) : NULL);
+	if (t2 == NULL || t2 + 1 == end || *line == '-') {
+		return;
+	}
+
+	int counts[2] = {0, 0};
+	parseCount(line, t1, &counts[0]);
+	parseCount(t1 + 1, t2, &counts[1]);
+	if (counts[0] <= 0 && counts[1] <= 0) {
+		return;
+	}
+	if (s_limit > 0 && (uint64_t)std::max(counts[0], 0) + std::max(counts[1], 0) > s_limit) {
+		return;
+	}
+
+	Diffstat::Stat stat;
+	stat.ladd = std::max(counts[0], 0);
+	stat.ldel = std::max(counts[1], 0);
+
+	const char *name = t2 + 1;
+	if (end - name >= 2 && name[0] == '"' && end[-1] == '"') {
+		++name;
+		--end;
+	}
+	m_stat->append(Diffstat::intern(std::string(name, end - name))) = stat;
 }
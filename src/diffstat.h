@@ -19,20 +19,34 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "main.h"
 
-#include "lunar/lunar.h"
+#include "memstats.h"
 
-#include "syslib/parallel.h"
+#include "lunar/lunar.h"
 
 class BIStream;
 class BOStream;
 
 
+/*
+ * Per-file change statistics of a single revision. File paths are interned
+ * in a process-wide table, and the statistics are stored in a flat vector
+ * sorted by path ID. Paths are thus only allocated once for the whole
+ * history, no matter how many revisions touch them.
+ *
+ * Diffstats are immutable once they have been handed out by the parser or
+ * a backend, so revisions, caches and report scripts share them via
+ * DiffstatPtr instead of copying. Filtering returns a new diffstat.
+ */
 class Diffstat
 {
 	friend class DiffParser;
+	friend class Libgit2Connection;
+	friend class SvnDiffstatThread;
 
 	public:
 		struct Stat
@@ -45,21 +59,64 @@ class Diffstat
 			inline bool empty() const {
 				return (cadd == 0 && ladd == 0 && cdel == 0 && ldel == 0);
 			}
+
+			inline void merge(const Stat &other) {
+				cadd += other.cadd; ladd += other.ladd;
+				cdel += other.cdel; ldel += other.ldel;
+			}
 		};
 
+		typedef std::pair<uint32_t, Stat> Entry;
+		typedef std::vector<Entry, CountingAllocator<Entry, MemStats::Diffstats> > Entries;
+
 	public:
 		Diffstat();
 		~Diffstat();
 
-		std::map<std::string, Stat> stats() const;
+		static std::shared_ptr<Diffstat> create();
+		static std::shared_ptr<Diffstat> create(const Diffstat &other);
 
-		void filter(const std::string &prefix);
+		std::map<std::string, Stat> stats() const;
+		inline const Entries &entries() const { return m_stats; }
+		const Stat *stat(const char *path, size_t len) const;
+		inline const Stat *stat(const std::string &path) const { return stat(path.data(), path.length()); }
+		inline const Stat &total() const { return m_total; }
+		inline size_t size() const { return m_stats.size(); }
+		inline bool hasBytes() const { return !m_linesOnly; }
+		inline size_t footprint() const { return sizeof(Diffstat) + m_stats.capacity() * sizeof(Entry); }
+
+		void add(const std::string &path, const Stat &stat);
+		static std::shared_ptr<Diffstat> filter(const std::shared_ptr<Diffstat> &stat, const std::string &prefix);
+		static std::shared_ptr<Diffstat> exclude(const std::shared_ptr<Diffstat> &stat, const std::vector<std::string> &patterns);
+		static std::shared_ptr<Diffstat> limit(const std::shared_ptr<Diffstat> &stat, uint64_t lines);
+		static std::shared_ptr<Diffstat> merge(const std::vector<std::shared_ptr<Diffstat> > &stats);
 
 		void write(BOStream &out) const;
+		void writeLegacy(BOStream &out) const;
 		bool load(BIStream &in);
 
+		static uint32_t intern(const std::string &path);
+		static bool lookup(const char *path, size_t len, uint32_t *id);
+		static inline bool lookup(const std::string &path, uint32_t *id) { return lookup(path.data(), path.length(), id); }
+		static const std::string &path(uint32_t id);
+		static bool excluded(const char *path, const std::vector<std::string> &patterns);
+
+	private:
+		inline Stat &append(uint32_t id) {
+			m_stats.push_back(Entry(id, Stat()));
+			return m_stats.back().second;
+		}
+		bool loadLegacy(BIStream &in, char first);
+		static std::shared_ptr<Diffstat> select(const std::shared_ptr<Diffstat> &stat, const std::vector<bool> &keep, bool recount);
+		void sort();
+		std::vector<std::pair<const std::string *, const Stat *> > sorted() const;
+		int push(lua_State *L, uint64_t Stat::*field);
+		static int next(lua_State *L);
+
 	PEPPER_PVARS:
-		std::map<std::string, Stat> m_stats;
+		Entries m_stats;
+		Stat m_total;
+		bool m_linesOnly; // Byte counts are not available
 
 	// Lua binding
 	public:
@@ -70,6 +127,15 @@ class Diffstat
 		int bytes_added(lua_State *L);
 		int lines_removed(lua_State *L);
 		int bytes_removed(lua_State *L);
+		int totals(lua_State *L);
+		int has_bytes(lua_State *L);
+
+		// Registered without Lunar, as the iterator needs to keep a
+		// reference to the object's userdata
+		static int each(lua_State *L);
+
+		// Replaces the Lunar constructor, sharing the given diffstat
+		static int share(lua_State *L);
 
 		static const char className[];
 		static Lunar<Diffstat>::RegType methods[];
@@ -78,21 +144,52 @@ class Diffstat
 typedef std::shared_ptr<Diffstat> DiffstatPtr;
 
 
-class DiffParser : public sys::parallel::Thread
+/*
+ * Incremental parser for unified diffs. Data can be passed in arbitrary
+ * chunks via feed(), and finish() returns the resulting diffstat. The
+ * parser also understands the output of "git diff-tree --numstat", which
+ * results in diffstats without byte counts.
+ */
+class DiffParser
 {
 	public:
-		DiffParser(std::istream &in);
+		enum Format {
+			Unified,
+			Numstat
+		};
+
+		DiffParser(Format format = Unified);
 
-		DiffstatPtr stat() const;
+		void feed(const char *data, size_t len);
+		DiffstatPtr finish();
 
-		static DiffstatPtr parse(std::istream &in);
+		// Returns whether an EOF character has been encountered, which marks
+		// the end of the current diff. Further data will be ignored.
+		inline bool done() const { return m_done; }
 
-	protected:
-		void run();
+		static DiffstatPtr parse(std::istream &in, Format format = Unified);
+		static void setLimit(uint64_t lines);
+
+	private:
+		void reset();
+		void carry(const char *data, size_t len);
+		void flush();
+		void checkLimit();
+		void parseLine(const char *line, size_t len, size_t length);
+		void parseNumstat(const char *line, size_t len);
 
 	private:
-		std::istream &m_in;
+		Format m_format;
 		DiffstatPtr m_stat;
+		std::string m_file;
+		Diffstat::Stat m_fstat;
+		int m_chunk[2];
+		std::string m_carry;
+		size_t m_carryLength;
+		bool m_skip;
+		bool m_done;
+
+		static uint64_t s_limit;
 };
 
 
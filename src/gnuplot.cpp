@@ -11,11 +11,18 @@
  */
 
 
-#include "gnuplot.h"
+#include "main.h"
+
+#include <algorithm>
+
+#include "logger.h"
+#include "tracer.h"
 
 #include "syslib/fs.h"
 #include "syslib/parallel.h"
 
+#include "gnuplot.h"
+
 using sys::io::PopenStreambuf;
 
 
@@ -44,27 +51,48 @@ private:
 	std::ostream &m_out;
 };
 
+// Closes the pipe of a finished instance and waits for Gnuplot to exit
+class GnuplotCloser : public sys::parallel::Thread
+{
+public:
+	GnuplotCloser(Gnuplot *g)
+		: g(g)
+	{
+	}
+
+	Gnuplot *g;
+
+protected:
+	void run()
+	{
+		g->close();
+	}
+};
+
 
 // Standard output terminal
 std::string Gnuplot::s_stdTerminal;
 
+// Instances that are closed in the background, only used by the main thread
+std::vector<GnuplotCloser *> Gnuplot::s_closers;
+
 // Constructor
 Gnuplot::Gnuplot(const char * const *args, std::ostream &out)
+	: m_out(out)
 {
 	std::string path = sys::fs::which("gnuplot");
 
 	m_buf = new PopenStreambuf(path.c_str(), args, std::ios::in | std::ios::out);
-	m_reader = new StreambufReader(m_buf, out);
+	m_reader = new StreambufReader(m_buf, m_output);
 	m_reader->start();
 	m_pipe = new std::ostream(m_buf);
 }
 
-// Destructor
+// Destructor, waiting for Gnuplot to exit
 Gnuplot::~Gnuplot()
 {
-	delete m_pipe;
-	m_buf->closeWrite();
-	m_reader->wait();
+	close();
+	cleanup();
 	delete m_reader;
 	delete m_buf;
 }
@@ -72,12 +100,92 @@ Gnuplot::~Gnuplot()
 // Writes a command to the Gnuplot pipe
 void Gnuplot::cmd(const std::string &str)
 {
-	*m_pipe << str << "\n" << std::flush;
+	*m_pipe << str << "\n";
 }
 
 // Writes a command to the Gnuplot pipe
 void Gnuplot::cmd(const char *str, size_t len)
 {
 	m_pipe->write(str, len);
-	*m_pipe << std::flush;
+}
+
+// Registers a file that will be removed once Gnuplot has exited
+void Gnuplot::removeOnExit(const std::string &path)
+{
+	m_tempfiles.push_back(path);
+}
+
+// Closes the given instance in the background. The instance will be
+// deleted by wait().
+void Gnuplot::finish(Gnuplot *g)
+{
+	if (g == NULL) {
+		return;
+	}
+
+	size_t max = std::max(2, sys::parallel::idealThreadCount());
+	while (s_closers.size() >= max) {
+		finishFirst();
+	}
+
+	GnuplotCloser *closer = new GnuplotCloser(g);
+	closer->start();
+	s_closers.push_back(closer);
+}
+
+// Waits until the finished instances writing to the given stream (or all
+// instances if no stream is given) have exited and writes their output
+void Gnuplot::wait(std::ostream *out)
+{
+	PTRACE_SCOPE("gnuplot.wait");
+	std::vector<GnuplotCloser *> closers;
+	std::swap(closers, s_closers);
+	for (size_t i = 0; i < closers.size(); i++) {
+		if (out == NULL || &closers[i]->g->m_out == out) {
+			closers[i]->wait();
+			delete closers[i]->g;
+			delete closers[i];
+		} else {
+			s_closers.push_back(closers[i]);
+		}
+	}
+}
+
+// Closes the pipe and waits for the process to exit. This is a no-op if
+// the instance has already been closed.
+void Gnuplot::close()
+{
+	if (m_pipe == NULL) {
+		return;
+	}
+	m_pipe->flush();
+	delete m_pipe;
+	m_pipe = NULL;
+	m_buf->closeWrite();
+	m_reader->wait();
+}
+
+// Writes the collected output of the process and removes temporary files
+void Gnuplot::cleanup()
+{
+	std::string output = m_output.str();
+	if (!output.empty()) {
+		m_out.write(output.data(), output.length());
+		m_out.flush();
+	}
+	for (size_t i = 0; i < m_tempfiles.size(); i++) {
+		sys::fs::unlink(m_tempfiles[i]);
+	}
+	m_tempfiles.clear();
+}
+
+// Waits for the oldest finished instance
+void Gnuplot::finishFirst()
+{
+	GnuplotCloser *closer = s_closers.front();
+	s_closers.erase(s_closers.begin());
+	PDEBUG << "Waiting for Gnuplot, " << s_closers.size() << " more rendering in the background" << endl;
+	closer->wait();
+	delete closer->g;
+	delete closer;
 }
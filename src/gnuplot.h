@@ -16,33 +16,63 @@
 
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "syslib/io.h"
 
+class GnuplotCloser;
 class StreambufReader;
 
 
+/*
+ * Commands are buffered and sent to the Gnuplot process in larger chunks.
+ * The output of the process is collected and written to the output
+ * stream once the process has exited, so that the output of several
+ * processes isn't interleaved.
+ *
+ * Instead of deleting an instance, which waits until Gnuplot has finished
+ * rendering, it can be passed to finish(). The pipe is then closed in a
+ * background thread, and wait() blocks until all finished instances have
+ * exited and their output has been written, in the order they have been
+ * finished. At most as many instances as there are processors are
+ * rendering in the background at the same time.
+ */
 class Gnuplot
 {
+	friend class GnuplotCloser;
+
 	public:
 		Gnuplot(const char * const *args, std::ostream &out = std::cout);
 		~Gnuplot();
 
 		void cmd(const std::string &str);
 		void cmd(const char *ptr, size_t len);
+		void removeOnExit(const std::string &path);
+
+		static void finish(Gnuplot *g);
+		static void wait(std::ostream *out = NULL);
 
 		inline Gnuplot& operator<<(const std::string &str) {
 			cmd(str);
 			return (*this);
 		}
 
+	private:
+		void close();
+		void cleanup();
+		static void finishFirst();
+
 	private:
 		sys::io::PopenStreambuf *m_buf;
 		StreambufReader *m_reader;
 		std::ostream *m_pipe;
+		std::ostream &m_out;
+		std::ostringstream m_output;
+		std::vector<std::string> m_tempfiles;
 		static std::string s_stdTerminal;
+		static std::vector<GnuplotCloser *> s_closers;
 };
 
 
@@ -15,129 +15,579 @@
 #define JOBQUEUE_H_
 
 
-#include <map>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 #include <vector>
 
 #include "logger.h"
+#include "memstats.h"
+#include "stats.h"
 
+#include "syslib/datetime.h"
 #include "syslib/parallel.h"
 
 
+/*
+ * Byte budget shared by all job queues. A limit of 0 disables it.
+ */
+class MemoryBudget
+{
+	public:
+		static inline void setLimit(uint64_t bytes) { state().limit = bytes; }
+		static inline uint64_t limit() { return state().limit; }
+		static inline uint64_t used() { return state().used; }
+
+		static inline bool exhausted() {
+			State &s = state();
+			uint64_t limit = s.limit.load(std::memory_order_relaxed);
+			return (limit > 0 && s.used.load(std::memory_order_relaxed) >= limit);
+		}
+
+		static inline void charge(uint64_t bytes) {
+			Stats::peak(Stats::BufferedPeak, state().used.fetch_add(bytes) + bytes);
+			MemStats::add(MemStats::Queues, bytes);
+		}
+		static inline void release(uint64_t bytes) {
+			state().used.fetch_sub(bytes);
+			MemStats::add(MemStats::Queues, -int64_t(bytes));
+		}
+
+	private:
+		struct State
+		{
+			std::atomic<uint64_t> limit, used;
+
+			State() : limit(0), used(0) { }
+		};
+
+		static State &state() {
+			static State s;
+			return s;
+		}
+};
+
+
+/*
+ * The queue is used by the backend prefetchers: worker threads fetch
+ * arguments and report results, and the main thread waits for the result
+ * of a specific argument.
+ *
+ * Every argument is assigned a sequence number in the order it has been
+ * put into the queue, which is the order of the repository log. The job
+ * slots are kept in a window ordered by this number, so a consumer
+ * requesting results in log order finds the next slot in constant time.
+ * Workers may only start jobs that are less than "max" positions ahead of
+ * the consumer, which bounds the number of buffered results.
+ *
+ * Slots are additionally indexed by argument for the worker threads. The
+ * index is distributed over several shards, each guarded by its own mutex.
+ * Every slot has its own wait condition, so finishing a job only wakes up
+ * the thread that is waiting for that specific result.
+ *
+ * If limits have been set, the number of active workers and the lookahead
+ * are adapted at runtime. The queue measures how long the consumer waits
+ * for results, how long active workers wait for jobs and how long jobs
+ * take. A waiting consumer with busy workers means that more workers are
+ * needed, while idle workers and a busy consumer mean that fewer would do.
+ * Workers beyond the active count are parked in getArg(). A worker counts
+ * as busy from receiving jobs until it asks for the next ones.
+ *
+ * A consumer waiting for a job that hasn't been started yet moves it to
+ * the head of the queue, and a parked worker may pick it up. Batches are
+ * capped by the distance of their first job from the consumer, so jobs
+ * that will be needed soon are handed out in small batches and come back
+ * quickly, while jobs further ahead are batched more efficiently.
+ *
+ * Results that haven't been consumed yet are charged to the global memory
+ * budget with the size given by the worker. While the budget is exhausted,
+ * workers of all queues only start the jobs that the consumer is waiting
+ * for, so the memory used by buffered results stays bounded no matter how
+ * large individual results are.
+ */
 template <typename Arg, typename Result>
 class JobQueue
 {
+	private:
+		struct Slot
+		{
+			Arg arg;
+			size_t seq;
+			bool consumed; // Protected by the window mutex
+			bool started;  // Protected by the window mutex
+
+			Result result;
+			int status; // -1: pending, 0: failed, 1: done; protected by the shard mutex
+			size_t bytes; // Charged to the memory budget; protected by the shard mutex
+			sys::parallel::WaitCondition ready;
+
+			Slot(const Arg &arg, size_t seq) : arg(arg), seq(seq), consumed(false), started(false), status(-1), bytes(0) { }
+		};
+
+		struct Shard
+		{
+			sys::parallel::Mutex mutex;
+			std::unordered_map<Arg, Slot *> slots;
+			bool end;
+
+			Shard() : end(false) { }
+		};
+
+		// Jobs handed out to the calling worker thread
+		struct Handout
+		{
+			size_t queue; // ID of the queue
+			int64_t started;
+			size_t jobs;
+		};
+
+		enum {
+			NumShards = 16,
+			AdaptResults = 32,     // Minimum number of results between adaptions
+			AdaptInterval = 50000, // Minimum time between adaptions in microseconds
+			BudgetPoll = 20,       // Interval for checking an exhausted memory budget in milliseconds
+			NearBatch = 8          // Maximum batch size for jobs next to the consumer
+		};
+
 	public:
-		JobQueue(size_t max = 512) : m_max(max), m_end(false) { }
+		JobQueue(size_t max = 512)
+			: m_max(max), m_base(0), m_next(0), m_expect(0), m_cursor(0), m_end(false), m_id(++ids()),
+			  m_adaptive(false), m_minWorkers(0), m_maxWorkers(0), m_active((size_t)-1), m_minAhead(max), m_maxAhead(max), m_busy(0) {
+			resetStats(sys::datetime::usecs());
+		}
+
+		~JobQueue() {
+			for (size_t i = 0; i < m_window.size(); i++) {
+				MemoryBudget::release(m_window[i]->bytes);
+				delete m_window[i];
+			}
+		}
 
 		void put(const std::vector<Arg> &args) {
 			m_mutex.lock();
-			for (unsigned int i = 0; i < args.size(); i++) {
-				m_queue.push(args[i]);
-				m_status[args[i]] = -1;
+			for (size_t i = 0; i < args.size(); i++) {
+				Shard &shard = this->shard(args[i]);
+				shard.mutex.lock();
+				if (shard.slots.find(args[i]) == shard.slots.end()) {
+					Slot *slot = new Slot(args[i], m_next++);
+					shard.slots[args[i]] = slot;
+					m_window.push_back(slot);
+					m_queue.push_back(slot);
+				}
+				shard.mutex.unlock();
 			}
+			Stats::peak(Stats::QueuePeak, m_window.size());
 			m_mutex.unlock();
 			m_argWait.wakeAll();
 		}
 
+		// Enables adapting the number of active workers and the lookahead
+		// within the given bounds, starting with the maximum number of workers
+		void setLimits(size_t minWorkers, size_t maxWorkers, size_t minAhead, size_t maxAhead) {
+			m_mutex.lock();
+			m_adaptive = true;
+			m_minWorkers = std::max(size_t(1), minWorkers);
+			m_maxWorkers = std::max(m_minWorkers, maxWorkers);
+			m_active = m_maxWorkers;
+			m_minAhead = std::max(size_t(1), minAhead);
+			m_maxAhead = std::max(m_minAhead, maxAhead);
+			m_max = std::min(m_maxAhead, std::max(m_minAhead, m_max));
+			resetStats(sys::datetime::usecs());
+			m_mutex.unlock();
+			m_argWait.wakeAll();
+		}
+
+		size_t activeWorkers() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			return m_active;
+		}
+
+		size_t lookahead() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			return m_max;
+		}
+
 		void stop() {
 			m_mutex.lock();
 			m_end = true;
 			m_mutex.unlock();
 			m_argWait.wakeAll();
-			m_resultWait.wakeAll();
+
+			for (int i = 0; i < NumShards; i++) {
+				m_shards[i].mutex.lock();
+				m_shards[i].end = true;
+				typename std::unordered_map<Arg, Slot *>::iterator it;
+				for (it = m_shards[i].slots.begin(); it != m_shards[i].slots.end(); ++it) {
+					it->second->ready.wakeAll();
+				}
+				m_shards[i].mutex.unlock();
+			}
 		}
 
 		bool getArg(Arg *arg) {
 			m_mutex.lock();
-			while (!m_end && (m_queue.empty() || m_results.size() > m_max)) {
-				m_argWait.wait(&m_mutex);
-			}
-			if (m_end) {
+			if (!waitForArgs()) {
 				m_mutex.unlock();
 				return false;
 			}
-			*arg = m_queue.front();
-			m_queue.pop();
+			*arg = take()->arg;
+			handout(1);
 			m_mutex.unlock();
 			return true;
 		}
 
 		bool getArgs(std::vector<Arg> *args, size_t max) {
 			m_mutex.lock();
-			while (!m_end && (m_queue.empty() || m_results.size() > m_max)) {
-				m_argWait.wait(&m_mutex);
-			}
-			if (m_end) {
+			if (!waitForArgs()) {
 				m_mutex.unlock();
 				return false;
 			}
 			args->clear();
-			while (args->size() < max && !m_queue.empty()) {
-				args->push_back(m_queue.front());
-				m_queue.pop();
+			size_t limit = max;
+			while (args->size() < limit && available()) {
+				bool urgent = (this->urgent() != NULL);
+				Slot *slot = take();
+				if (args->empty()) {
+					size_t distance = (urgent || slot->seq < m_expect ? 0 : slot->seq - m_expect);
+					limit = std::min(max, std::max(size_t(NearBatch), distance));
+				}
+				args->push_back(slot->arg);
 			}
+			handout(args->size());
 			m_mutex.unlock();
 			return true;
 		}
 
 		bool hasArg(const Arg &arg) {
-			m_mutex.lock();
-			bool has = (m_status.find(arg) != m_status.end());
-			m_mutex.unlock();
+			Shard &shard = this->shard(arg);
+			shard.mutex.lock();
+			bool has = (shard.slots.find(arg) != shard.slots.end());
+			shard.mutex.unlock();
 			return has;
 		}
 
 		bool getResult(const Arg &arg, Result *res) {
+			// Check the next slot in log order first
+			Slot *slot = NULL;
 			m_mutex.lock();
-			if (m_status.find(arg) == m_status.end()) {
-				m_mutex.unlock();
-				return false;
+			if (m_expect >= m_base && m_expect - m_base < m_window.size()) {
+				Slot *next = m_window[m_expect - m_base];
+				if (!next->consumed && next->arg == arg) {
+					slot = next;
+				}
+			}
+			m_mutex.unlock();
+
+			// Fall back to the index for out-of-order requests
+			Shard &shard = this->shard(arg);
+			if (slot == NULL) {
+				shard.mutex.lock();
+				typename std::unordered_map<Arg, Slot *>::iterator it = shard.slots.find(arg);
+				if (it == shard.slots.end()) {
+					shard.mutex.unlock();
+					return false;
+				}
+				slot = it->second;
+				shard.mutex.unlock();
+			}
+
+			// Let the workers advance to this slot if they are behind, and
+			// start it next if it is still queued
+			m_mutex.lock();
+			bool wake = false, urgent = false;
+			if (slot->seq + 1 > m_cursor) {
+				m_cursor = slot->seq + 1;
+				wake = true;
+			}
+			if (!slot->started) {
+				m_urgent.push_back(slot);
+				wake = urgent = true;
+			}
+			m_mutex.unlock();
+			if (wake) {
+				m_argWait.wakeAll();
+			}
+
+			shard.mutex.lock();
+			int64_t waited = 0;
+			if (slot->status < 0) {
+				int64_t start = sys::datetime::usecs();
+				while (!shard.end && slot->status < 0) {
+					slot->ready.wait(&shard.mutex);
+				}
+				waited = sys::datetime::usecs() - start;
 			}
-			while (!m_end && m_status[arg] < 0) {
-				m_resultWait.wait(&m_mutex);
+			Stats::record(Stats::ConsumerWait, waited);
+			bool end = shard.end;
+			if (!end) {
+				shard.slots.erase(slot->arg);
 			}
-			if (m_end || !m_status[arg]) {
+			shard.mutex.unlock();
+
+			if (urgent) {
+				// The slot has been started through the regular queue
+				// if it is still marked
+				m_mutex.lock();
+				m_urgent.erase(std::remove(m_urgent.begin(), m_urgent.end(), slot), m_urgent.end());
 				m_mutex.unlock();
+			}
+			if (end) {
 				return false;
 			}
-			*res = m_results[arg];
-			m_results.erase(arg);
-			m_status.erase(arg);
-			m_mutex.unlock();
-			m_argWait.wake();
-			return true;
+
+			bool ok = (slot->status > 0);
+			if (ok) {
+				*res = slot->result;
+			}
+			MemoryBudget::release(slot->bytes);
+			slot->bytes = 0;
+			consume(slot, waited);
+			return ok;
 		}
 
-		void done(const Arg &arg, const Result &result) {
-			m_mutex.lock();
-			m_results[arg] = result;
-			m_status[arg] = 1;
+		// Reports the result of a job, which occupies the given number of bytes
+		void done(const Arg &arg, const Result &result, size_t bytes = 0) {
+			Shard &shard = this->shard(arg);
+			shard.mutex.lock();
+			typename std::unordered_map<Arg, Slot *>::iterator it = shard.slots.find(arg);
+			bool queued = (it != shard.slots.end());
+			if (queued) {
+				it->second->result = result;
+				it->second->status = 1;
+				MemoryBudget::release(it->second->bytes);
+				MemoryBudget::charge(bytes);
+				it->second->bytes = bytes;
+				it->second->ready.wakeAll();
+			}
+			shard.mutex.unlock();
 #ifdef DEBUG
-			PTRACE << arg << " ok, " << m_results.size() << " results in queue" << endl;
+			PTRACE << arg << (queued ? " ok" : " not queued, ignored") << endl;
+#else
+			(void)queued;
 #endif
-			m_mutex.unlock();
-			m_resultWait.wakeAll();
 		}
-		
+
 		void failed(const Arg &arg) {
-			m_mutex.lock();
-			m_status[arg] = 0;
+			Shard &shard = this->shard(arg);
+			shard.mutex.lock();
+			typename std::unordered_map<Arg, Slot *>::iterator it = shard.slots.find(arg);
+			if (it != shard.slots.end()) {
+				it->second->status = 0;
+				it->second->ready.wakeAll();
+			}
+			shard.mutex.unlock();
 #ifdef DEBUG
-			PTRACE << arg << " FAILED, " << m_results.size() << " results in queue" << endl;
+			PTRACE << arg << " FAILED" << endl;
 #endif
+		}
+
+	private:
+		inline Shard &shard(const Arg &arg) {
+			return m_shards[std::hash<Arg>()(arg) % NumShards];
+		}
+
+		// Returns whether a job may be started, which is only the case for
+		// the job the consumer needs next if the memory budget is exhausted.
+		// The caller must hold the window mutex.
+		inline bool available() {
+			if (urgent() != NULL) {
+				return true;
+			}
+			size_t ahead = (MemoryBudget::exhausted() ? 1 : m_max);
+			Slot *slot = next();
+			return (slot != NULL && slot->seq < std::max(m_cursor, m_expect) + ahead);
+		}
+
+		// Returns the first job the consumer is waiting for that hasn't been
+		// started yet, if any. The caller must hold the window mutex.
+		inline Slot *urgent() const {
+			for (size_t i = 0; i < m_urgent.size(); i++) {
+				if (!m_urgent[i]->started) {
+					return m_urgent[i];
+				}
+			}
+			return NULL;
+		}
+
+		// Returns the first job in the queue that hasn't been started ahead
+		// of the others. The caller must hold the window mutex.
+		inline Slot *next() {
+			while (!m_queue.empty() && m_queue.front()->started) {
+				m_queue.pop_front();
+			}
+			return (m_queue.empty() ? NULL : m_queue.front());
+		}
+
+		// Removes the next job from the queue, preferring jobs the consumer
+		// is waiting for. The caller must hold the window mutex.
+		Slot *take() {
+			Slot *slot = urgent();
+			if (slot != NULL) {
+				m_urgent.erase(std::find(m_urgent.begin(), m_urgent.end(), slot));
+			} else {
+				slot = next();
+				m_queue.pop_front();
+			}
+			slot->started = true;
+			return slot;
+		}
+
+		// Marks a slot as consumed and advances the window. The slot may stay
+		// in the window behind earlier ones, so its result is released now.
+		void consume(Slot *slot, int64_t waited) {
+			m_mutex.lock();
+			m_consumerWait += waited;
+			++m_results;
+			bool adapted = adapt();
+			slot->consumed = true;
+			slot->result = Result();
+			slot->arg = Arg();
+			m_expect = std::max(m_expect, slot->seq + 1);
+			bool advanced = (m_expect > m_cursor);
+
+			// Slots that have been started ahead of the queue are still
+			// referenced by it. Since both are in sequence order, all of
+			// them are dropped before advancing the window.
+			next();
+			while (!m_window.empty() && m_window.front()->consumed) {
+				delete m_window.front();
+				m_window.pop_front();
+				++m_base;
+				advanced = true;
+			}
 			m_mutex.unlock();
-			m_resultWait.wakeAll();
+			if (advanced || adapted) {
+				m_argWait.wakeAll();
+			}
+		}
+
+		// Waits until the calling worker may start a job, parking workers
+		// beyond the active count. Returns false if the queue has been
+		// stopped. The caller must hold the window mutex.
+		bool waitForArgs() {
+			Handout &h = current();
+			if (h.queue == m_id) {
+				// The worker has finished its previous jobs
+				m_jobTime += sys::datetime::usecs() - h.started;
+				m_jobs += h.jobs;
+				++m_handouts;
+				--m_busy;
+				h.queue = 0;
+			}
+
+			while (!m_end) {
+				if (m_busy >= m_active && urgent() == NULL) {
+					m_argWait.wait(&m_mutex);
+				} else if (!available()) {
+					int64_t start = sys::datetime::usecs(), idle;
+					if (!m_queue.empty() && MemoryBudget::exhausted()) {
+						// The budget may be freed by the consumer of another queue
+						m_argWait.wait(&m_mutex, BudgetPoll);
+					} else {
+						m_argWait.wait(&m_mutex);
+					}
+					idle = sys::datetime::usecs() - start;
+					m_workerIdle += idle;
+					Stats::record(Stats::WorkerIdle, idle);
+				} else {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Marks the calling worker as busy. The caller must hold the window mutex.
+		void handout(size_t jobs) {
+			Handout &h = current();
+			h.queue = m_id;
+			h.started = sys::datetime::usecs();
+			h.jobs = jobs;
+			++m_busy;
+		}
+
+		// Adjusts the number of active workers and the lookahead based on
+		// the statistics of the last interval. Returns true if workers may
+		// be able to continue. The caller must hold the window mutex.
+		bool adapt() {
+			int64_t now = sys::datetime::usecs(), elapsed = now - m_intervalStart;
+			if (!m_adaptive || m_results < AdaptResults || elapsed < AdaptInterval) {
+				return false;
+			}
+
+			double wait = double(m_consumerWait) / elapsed;
+			double idle = double(m_workerIdle) / (double(elapsed) * m_active);
+			double latency = (m_handouts > 0 ? double(m_jobTime) / m_handouts : 0.0);
+			double rate = double(m_results) / elapsed;
+
+			size_t active = m_active, ahead = m_max;
+			if (wait > 0.05 && idle < 0.2) {
+				// The workers are the bottleneck
+				active = std::min(m_maxWorkers, active + std::max(size_t(1), active / 2));
+			} else if (wait < 0.01 && idle > 0.5 && active > m_minWorkers) {
+				// The consumer is the bottleneck
+				--active;
+			}
+			if (wait > 0.05 && idle >= 0.2) {
+				// Idle workers may be held back by the lookahead
+				ahead = std::min(m_maxAhead, ahead * 2);
+			} else if (wait < 0.01) {
+				ahead = std::max(m_minAhead, ahead - ahead / 4);
+			}
+
+			// Keep enough jobs ahead for the results that are in flight
+			ahead = std::min(m_maxAhead, std::max(ahead, size_t(2.0 * rate * latency) + active));
+
+			if (active != m_active || ahead != m_max) {
+				PDEBUG << "Adapting to " << active << " workers and lookahead " << ahead << " (consumer wait "
+					<< int(wait * 100) << "%, worker idle " << int(idle * 100) << "%, job latency "
+					<< (m_jobs > 0 ? m_jobTime / int64_t(m_jobs) : 0) << " us)" << endl;
+			}
+			bool grown = (active > m_active || ahead > m_max);
+			m_active = active;
+			m_max = ahead;
+			resetStats(now);
+			return grown;
+		}
+
+		inline void resetStats(int64_t now) {
+			m_intervalStart = now;
+			m_consumerWait = m_workerIdle = m_jobTime = 0;
+			m_jobs = m_handouts = m_results = 0;
+		}
+
+		static Handout &current() {
+			static thread_local Handout h = { 0, 0, 0 };
+			return h;
+		}
+
+		static std::atomic<size_t> &ids() {
+			static std::atomic<size_t> n(0);
+			return n;
 		}
 
 	private:
 		sys::parallel::Mutex m_mutex;
-		sys::parallel::WaitCondition m_argWait, m_resultWait;
-		std::queue<Arg> m_queue;
-		std::map<Arg, Result> m_results;
-		std::map<Arg, int> m_status;
+		sys::parallel::WaitCondition m_argWait;
+		std::deque<Slot *> m_window;  // All slots that haven't been consumed, in sequence order
+		std::deque<Slot *> m_queue;   // Slots that haven't been started, in sequence order
+		std::vector<Slot *> m_urgent; // Slots the consumer is waiting for
+		Shard m_shards[NumShards];
 		size_t m_max;
+		size_t m_base, m_next;   // Sequence numbers of the first slot in the window and the next slot to put
+		size_t m_expect;         // Sequence number of the slot after the last consumed one
+		size_t m_cursor;         // Sequence number after the latest requested slot
 		bool m_end;
+		size_t m_id;
+
+		// Adaptive concurrency, protected by the window mutex
+		bool m_adaptive;
+		size_t m_minWorkers, m_maxWorkers, m_active;
+		size_t m_minAhead, m_maxAhead;
+		size_t m_busy;           // Workers that have been handed jobs
+		int64_t m_intervalStart, m_consumerWait, m_workerIdle, m_jobTime;
+		size_t m_jobs, m_handouts, m_results;
 };
 
 
@@ -13,23 +13,140 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 
 #include "bstream.h"
 #include "cache.h"
 #include "logger.h"
+#include "memstats.h"
+#include "options.h"
 #include "revision.h"
+#include "stats.h"
 #include "strlib.h"
+#include "tracer.h"
 #include "utils.h"
 
+#include "syslib/datetime.h"
 #include "syslib/fs.h"
+#include "syslib/parallel.h"
 
 #include "ldbcache.h"
 
 
+// Prefix of the keys of shared diffstats
+#define LINK_PREFIX '\x03'
+
+// Number of database entries that are verified at once while checking
+#define VERIFY_BATCH 1024
+
+// Database tuning. The bloom filters let lookups of uncached revisions
+// skip reading any blocks from disk.
+#define BLOOM_BITS_PER_KEY 10
+#define WRITE_BUFFER_SIZE 16777216
+
+// Number of revisions that are decoded and written at once while importing
+#define IMPORT_BATCH 1024
+
+
+// Decodes a batch of database entries while checking the cache
+class LdbCache::Verifier : public sys::parallel::Task
+{
+	public:
+		typedef std::vector<std::pair<std::string, std::string> > EntryBatch;
+
+		Verifier(const LdbCache *cache) : m_cache(cache), m_revisions(0), m_unsupported(false) { }
+
+		EntryBatch batch;
+
+		const std::vector<std::string> &corrupted() const { return m_corrupted; }
+		size_t revisions() const { return m_revisions; }
+		bool unsupported() const { return m_unsupported; }
+
+	protected:
+		void run() {
+			for (size_t i = 0; i < batch.size(); i++) {
+				const std::string &key = batch[i].first, &value = batch[i].second;
+				int part = partOf(key);
+				std::string id = (part == Revision::MetaPart ? key : key.substr(1));
+				Revision rev(id);
+				if (part != Revision::MetaPart && !Codec::supported(value.data(), value.size())) {
+					m_unsupported = true;
+				} else if (!m_cache->parse(part, value.data(), value.size(), &rev)) {
+					m_corrupted.push_back(id);
+				}
+				if (part == Revision::MetaPart) {
+					++m_revisions;
+				}
+			}
+			batch.clear();
+		}
+
+	private:
+		const LdbCache *m_cache;
+		std::vector<std::string> m_corrupted;
+		size_t m_revisions;
+		bool m_unsupported;
+};
+
+// Decodes a batch of revisions from the records of an old cache and
+// encodes them into a write batch while importing
+class LdbCache::Importer : public sys::parallel::Task
+{
+	public:
+		struct Record
+		{
+			std::string id;
+			const char *data[Cache::NumStores];
+			uint32_t length[Cache::NumStores];
+		};
+
+		Importer(LdbCache *cache, const Cache *old) : m_cache(cache), m_old(old), m_revisions(0) { }
+
+		std::vector<Record> records;
+		leveldb::WriteBatch batch;
+
+		size_t revisions() const { return m_revisions; }
+		const std::vector<std::string> &corrupted() const { return m_corrupted; }
+
+	protected:
+		void run() {
+			for (size_t i = 0; i < records.size(); i++) {
+				const Record &r = records[i];
+				Revision rev(r.id);
+				bool ok = true;
+				for (int j = 0; j < Cache::NumStores && ok; j++) {
+					ok = m_old->parse(j, r.data[j], r.length[j], &rev);
+				}
+				if (ok) {
+					m_cache->add(&batch, r.id, rev);
+					++m_revisions;
+				} else {
+					m_corrupted.push_back(r.id);
+				}
+			}
+			records.clear();
+		}
+
+	private:
+		LdbCache *m_cache;
+		const Cache *m_old;
+		size_t m_revisions;
+		std::vector<std::string> m_corrupted;
+};
+
+
 // Constructor
 LdbCache::LdbCache(Backend *backend, const Options &options)
-	: AbstractCache(backend, options), m_db(NULL)
+	: AbstractCache(backend, options), m_db(NULL), m_blockCache(NULL), m_filterPolicy(NULL), m_bypass(false), m_codec(Codec::parse(options.cacheCodec())),
+	  m_memory(MemStats::LevelDB)
 {
 
 }
@@ -37,24 +154,29 @@ LdbCache::LdbCache(Backend *backend, const Options &options)
 // Destructor
 LdbCache::~LdbCache()
 {
+	flush();
 	closedb();
 }
 
 // Flushes the cache to disk
 void LdbCache::flush()
 {
-
+	sync();
 }
 
 // Checks cache consistency
 void LdbCache::check(bool force)
 {
 	try {
-		if (!m_db) opendb();
+		opendb();
 	} catch (const std::exception &ex) {
 		PDEBUG << "Exception while opening database: " << ex.what() << endl;
 		Logger::info() << "LdbCache: Database can't be opened, trying to repair it" << endl;
 	}
+	if (m_bypass) {
+		throw PEX("Unable to check the cache while it is used by another process");
+	}
+	dropRollups();
 
 	if (force || !m_db) {
 		std::string path = cacheDir() + "/ldb";
@@ -68,23 +190,63 @@ void LdbCache::check(bool force)
 		opendb();
 	}
 
-	// Simply try to read all revisions
+	// Simply try to read all revision parts. The database is read by this
+	// thread and the entries are decoded by the global thread pool, with a
+	// bounded number of batches in flight.
 	Logger::info() << "LdbCache: Checking revisions..." << endl;
+	sys::parallel::ThreadPool *pool = sys::parallel::ThreadPool::global();
+	std::deque<Verifier *> tasks;
 	std::vector<std::string> corrupted;
 	size_t n = 0;
-	leveldb::Iterator* it = m_db->NewIterator(leveldb::ReadOptions());
-	for (it->SeekToFirst(); it->Valid(); it->Next()) {
-		Revision rev(it->key().ToString());
-		std::string value = it->value().ToString();
-		MIStream rin(value.c_str(), value.length());
-		if (!rev.load(rin)) {
-			PDEBUG << "Revision " << it->key().ToString() << " corrupted!" << endl;
-			corrupted.push_back(it->key().ToString());
+	bool unsupported = false;
+
+	leveldb::ReadOptions options;
+	options.verify_checksums = true;
+	options.fill_cache = false;
+	leveldb::Iterator* it = m_db->NewIterator(options);
+	Verifier *task = new Verifier(this);
+	for (it->SeekToFirst(); ; it->Next()) {
+		bool valid = it->Valid();
+		if (valid && it->key().size() > 0 && it->key()[0] == LINK_PREFIX) {
+			continue;
+		}
+		if (valid) {
+			task->batch.push_back(std::make_pair(it->key().ToString(), it->value().ToString()));
+		}
+		if (task->batch.size() >= VERIFY_BATCH || !valid) {
+			pool->submit(task);
+			tasks.push_back(task);
+			task = (valid ? new Verifier(this) : NULL);
+		}
+
+		// Merge the results
+		while (!tasks.empty() && (tasks.size() > size_t(2 * pool->size()) || !valid)) {
+			Verifier *done = tasks.front();
+			tasks.pop_front();
+			done->wait();
+			corrupted.insert(corrupted.end(), done->corrupted().begin(), done->corrupted().end());
+			n += done->revisions();
+			unsupported = (unsupported || done->unsupported());
+			delete done;
+		}
+		if (!valid) {
+			break;
 		}
-		++n;
 	}
-	if (!it->status().ok()) {
-		Logger::err() << "Error iterating over cached revisions: " << it->status().ToString() << endl;
+	leveldb::Status s = it->status();
+	delete it;
+
+	if (unsupported) {
+		throw PEX("The cache contains revisions that have been compressed with a codec that is not supported by this build");
+	}
+	std::sort(corrupted.begin(), corrupted.end());
+	corrupted.erase(std::unique(corrupted.begin(), corrupted.end()), corrupted.end());
+	for (size_t i = 0; i < corrupted.size(); i++) {
+		PDEBUG << "Revision " << corrupted[i] << " corrupted!" << endl;
+	}
+
+	if (!s.ok()) {
+		Logger::err() << "Error iterating over cached revisions: " << s.ToString() << endl;
 		Logger::err() << "Please re-run with --force to repair the database (might cause data loss)" << endl;
 		return;
 	}
@@ -92,7 +254,11 @@ void LdbCache::check(bool force)
 
 	for (size_t i = 0; i < corrupted.size(); i++) {
 		Logger::err() << "LdbCache: Revision " << corrupted[i] << " is corrupted, removing from index file" << endl;
-		leveldb::Status status = m_db->Delete(leveldb::WriteOptions(), corrupted[i]);
+		leveldb::WriteBatch batch;
+		batch.Delete(corrupted[i]);
+		batch.Delete(key(Revision::MessagePart, corrupted[i]));
+		batch.Delete(key(Revision::DiffstatPart, corrupted[i]));
+		leveldb::Status status = m_db->Write(leveldb::WriteOptions(), &batch);
 		if (!status.ok()) {
 			Logger::err() << "Error: Can't remove from revision " << corrupted[i] << " from database: " << status.ToString() << endl;
 			return;
@@ -100,10 +266,23 @@ void LdbCache::check(bool force)
 	}
 }
 
+// Lets LevelDB compact the whole key range
+void LdbCache::compact()
+{
+	if (!opendb()) {
+		throw PEX("Unable to compact the cache while it is used by another process");
+	}
+
+	Logger::info() << "LdbCache: Compacting database..." << endl;
+	sys::datetime::Watch watch;
+	m_db->CompactRange(NULL, NULL);
+	Logger::info() << "LdbCache: Compacted database in " << watch.elapsedMSecs() << " ms" << endl;
+}
+
 // Checks if the diffstat of the given revision is already cached
 bool LdbCache::lookup(const std::string &id)
 {
-	if (!m_db) opendb();
+	if (!opendb()) return false;
 
 	std::string value;
 	leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &value);
@@ -119,48 +298,369 @@ bool LdbCache::lookup(const std::string &id)
 // Adds the revision to the cache
 void LdbCache::put(const std::string &id, const Revision &rev)
 {
-	if (!m_db) opendb();
+	PTRACE_SCOPE("ldbcache.put");
+	if (!opendb()) return;
 
-	MOStream rout;
-	rev.write(rout);
-	std::vector<char> data(rout.data());
-	leveldb::Status s = m_db->Put(leveldb::WriteOptions(), id, std::string(data.begin(), data.end()));
+	leveldb::WriteBatch batch;
+	add(&batch, id, rev);
+	leveldb::Status s = m_db->Write(leveldb::WriteOptions(), &batch);
 	if (!s.ok()) {
 		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
 	}
+	account();
+}
+
+// Loads the given parts of a revision from the cache
+Revision *LdbCache::get(const std::string &id, int parts)
+{
+	return getMany(std::vector<std::string>(1, id), parts).front();
+}
+
+// Checks which of the given revisions are cached, using a single iterator
+std::vector<bool> LdbCache::lookupMany(const std::vector<std::string> &ids)
+{
+	if (!opendb()) return std::vector<bool>(ids.size(), false);
+
+	// Seek in key order, so the iterator moves forward only
+	std::vector<std::pair<std::string, size_t> > order(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		order[i] = std::make_pair(ids[i], i);
+	}
+	std::sort(order.begin(), order.end());
+
+	std::vector<bool> cached(ids.size(), false);
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (size_t i = 0; i < order.size(); i++) {
+		it->Seek(order[i].first);
+		cached[order[i].second] = (it->Valid() && it->key() == order[i].first);
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
+	return cached;
+}
+
+// Adds the given revisions to the cache in a single write batch
+void LdbCache::putMany(const std::vector<Revision *> &revs)
+{
+	PTRACE_SCOPE("ldbcache.putMany");
+	if (!opendb()) return;
+
+	leveldb::WriteBatch batch;
+	for (size_t i = 0; i < revs.size(); i++) {
+		add(&batch, revs[i]->id(), *revs[i]);
+	}
+	leveldb::Status s = m_db->Write(leveldb::WriteOptions(), &batch);
+	if (!s.ok()) {
+		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
+	}
+	account();
+}
+
+// Loads the given parts of the given revisions from the cache
+std::vector<Revision *> LdbCache::getMany(const std::vector<std::string> &ids, int parts)
+{
+	if (!opendb()) {
+		throw PEX("Error reading from cache: Database is used by another process");
+	}
+
+	std::vector<Revision *> revs = getCachedMany(ids, parts);
+	std::vector<Revision *>::iterator it = std::find(revs.begin(), revs.end(), (Revision *)NULL);
+	if (it != revs.end()) {
+		std::string id = ids[it - revs.begin()];
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw PEX(str::printf("Error reading from cache: Revision %s not found", id.c_str()));
+	}
+	return revs;
+}
+
+// Loads the given parts of a revision, or returns NULL if it's not cached
+Revision *LdbCache::getCached(const std::string &id, int parts)
+{
+	return getCachedMany(std::vector<std::string>(1, id), parts).front();
+}
+
+// Loads the given parts of the given revisions, or NULL for revisions that
+// are not cached. The meta-data answers whether a revision is cached, so
+// it is read with a single Get() that can use the bloom filters. The other
+// parts are read using a single iterator per part.
+std::vector<Revision *> LdbCache::getCachedMany(const std::vector<std::string> &ids, int parts)
+{
+	PTRACE_SCOPE("ldbcache.get");
+	if (!opendb()) return std::vector<Revision *>(ids.size(), (Revision *)NULL);
+
+	std::vector<std::pair<std::string, size_t> > order(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		order[i] = std::make_pair(ids[i], i);
+	}
+	std::sort(order.begin(), order.end());
+
+	// The meta-data is always read, since revisions that have been written
+	// by previous versions are stored completely with the meta-data key
+	const int allParts[] = { Revision::MetaPart, Revision::MessagePart, Revision::DiffstatPart };
+	leveldb::Iterator *its[3] = { NULL, NULL, NULL };
+	for (int i = 1; i < 3; i++) {
+		if (parts & allParts[i]) {
+			its[i] = m_db->NewIterator(leveldb::ReadOptions());
+		}
+	}
+
+	std::vector<Revision *> revs(ids.size(), (Revision *)NULL);
+	std::string error, meta;
+	for (size_t i = 0; i < order.size() && error.empty(); i++) {
+		const std::string &id = order[i].first;
+		leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &meta);
+		if (s.IsNotFound()) {
+			continue;
+		}
+		if (!s.ok()) {
+			error = str::printf("Error reading from cache: %s", s.ToString().c_str());
+			break;
+		}
+
+		Revision *rev = new Revision(id);
+		revs[order[i].second] = rev;
+		if (!parse(Revision::MetaPart, meta.data(), meta.size(), rev)) {
+			error = "Unable to read from cache: Data corrupted";
+		}
+		for (int j = 1; j < 3 && error.empty() && !complete(meta.data(), meta.size()); j++) {
+			if (its[j] == NULL) {
+				continue;
+			}
+
+			std::string k = key(allParts[j], id);
+			its[j]->Seek(k);
+			if (!its[j]->Valid() || its[j]->key() != k) {
+				error = str::printf("Error reading from cache: Revision %s not found", id.c_str());
+				break;
+			}
+
+			leveldb::Slice value = its[j]->value();
+			if (!parse(allParts[j], value.data(), value.size(), rev)) {
+				error = "Unable to read from cache: Data corrupted";
+			}
+		}
+		if (!(parts & Revision::DiffstatPart)) {
+			rev->m_diffstat.reset();
+		}
+	}
+
+	for (int i = 0; i < 3; i++) {
+		delete its[i];
+	}
+	if (!error.empty()) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw PEX(error);
+	}
+	account();
+	return revs;
+}
+
+// Shared diffstats are supported
+bool LdbCache::sharesDiffstats() const
+{
+	return true;
+}
+
+// Logs are stored in the cache directory
+bool LdbCache::storesLogs() const
+{
+	return true;
 }
 
-Revision *LdbCache::get(const std::string &id)
+// Returns the diffstat linked to the given key, or a NULL pointer
+DiffstatPtr LdbCache::getShared(const std::string &key)
 {
-	if (!m_db) opendb();
+	if (!opendb()) return DiffstatPtr();
+
+	std::string id;
+	leveldb::Status s = m_db->Get(leveldb::ReadOptions(), LINK_PREFIX + key, &id);
+	if (s.IsNotFound()) {
+		return DiffstatPtr();
+	}
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
 
+	// Revisions written by previous versions are stored completely
 	std::string value;
-	leveldb::Status s = m_db->Get(leveldb::ReadOptions(), id, &value);
+	int part = Revision::DiffstatPart;
+	s = m_db->Get(leveldb::ReadOptions(), this->key(part, id), &value);
+	if (s.IsNotFound()) {
+		part = Revision::MetaPart;
+		s = m_db->Get(leveldb::ReadOptions(), id, &value);
+	}
+	if (s.IsNotFound()) {
+		return DiffstatPtr();
+	}
 	if (!s.ok()) {
 		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
 	}
 
-	Revision *rev = new Revision(id);
-	MIStream rin(value.c_str(), value.length());
-	if (!rev->load(rin)) {
-		throw PEX(str::printf("Unable to read from cache: Data corrupted"));
+	Revision rev(id);
+	if ((part == Revision::MetaPart && !complete(value.data(), value.size())) || !parse(part, value.data(), value.size(), &rev)) {
+		PDEBUG << "Unable to read shared diffstat for key " << key << endl;
+		return DiffstatPtr();
 	}
-	return rev;
+	return rev.m_diffstat;
 }
 
-// Opens the database connection
-void LdbCache::opendb()
+// Links the diffstat of a cached revision to the given key
+void LdbCache::link(const std::string &key, const std::string &id)
 {
-	if (m_db) return;
+	if (!opendb()) return;
+
+	leveldb::Status s = m_db->Put(leveldb::WriteOptions(), LINK_PREFIX + key, id);
+	if (!s.ok()) {
+		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
+	}
+}
+
+// Returns the IDs of all cached revisions
+std::vector<std::string> LdbCache::ids()
+{
+	std::vector<std::string> ids;
+	if (!opendb()) {
+		return ids;
+	}
+
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		std::string key = it->key().ToString();
+		if (!key.empty() && key[0] != LINK_PREFIX && partOf(key) == Revision::MetaPart) {
+			ids.push_back(key);
+		}
+	}
+	leveldb::Status s = it->status();
+	delete it;
+	if (!s.ok()) {
+		throw PEX(str::printf("Error reading from cache: %s", s.ToString().c_str()));
+	}
+	return ids;
+}
+
+// Adds a revision to the write batch. The meta-data, message and diffstat
+// are stored with different keys.
+void LdbCache::add(leveldb::WriteBatch *batch, const std::string &id, const Revision &rev)
+{
+	{
+		MOStream rout;
+		rev.writeMeta(rout);
+		const std::vector<char> &data = rout.buffer();
+		batch->Put(id, leveldb::Slice(&data[0], data.size()));
+	}
+	{
+		MOStream rout;
+		rout << rev.m_message;
+		const std::vector<char> &raw = rout.buffer();
+		std::vector<char> data;
+		m_codec.encode(&raw[0], raw.size(), &data);
+		batch->Put(key(Revision::MessagePart, id), leveldb::Slice(&data[0], data.size()));
+	}
+	{
+		MOStream rout;
+		rev.m_diffstat->write(rout);
+		const std::vector<char> &raw = rout.buffer();
+		std::vector<char> data;
+		m_codec.encode(&raw[0], raw.size(), &data);
+		batch->Put(key(Revision::DiffstatPart, id), leveldb::Slice(&data[0], data.size()));
+	}
+}
+
+// Returns the database key for the given part of a revision. Messages and
+// diffstats are prefixed with non-printable characters, so that all
+// meta-data keys are stored next to each other.
+std::string LdbCache::key(int part, const std::string &id)
+{
+	switch (part) {
+		case Revision::MessagePart: return '\x01' + id;
+		case Revision::DiffstatPart: return '\x02' + id;
+		default: break;
+	}
+	return id;
+}
+
+// Returns the revision part stored with the given key
+int LdbCache::partOf(const std::string &key)
+{
+	if (!key.empty() && key[0] == '\x01') {
+		return Revision::MessagePart;
+	} else if (!key.empty() && key[0] == '\x02') {
+		return Revision::DiffstatPart;
+	}
+	return Revision::MetaPart;
+}
+
+// Checks whether the meta-data value contains a complete revision, as
+// written by previous versions
+bool LdbCache::complete(const char *data, size_t length)
+{
+	return (length > 0 && data[0] == 'R');
+}
+
+// Parses a stored revision part
+bool LdbCache::parse(int part, const char *data, size_t length, Revision *rev) const
+{
+	std::vector<char> buffer;
+	Stats::add(Stats::CacheBytesRead, length);
+	if (part != Revision::MetaPart && !m_codec.decode(data, length, &buffer, &data, &length)) {
+		return false;
+	}
+	if (!buffer.empty()) {
+		Stats::add(Stats::CacheBytesDecoded, length);
+	}
+
+	MIStream in(data, length, false);
+	switch (part) {
+		case Revision::MetaPart:
+			return (complete(data, length) ? rev->load(in) : rev->loadMeta(in));
+		case Revision::MessagePart:
+			in >> rev->m_message;
+			return in.ok();
+		case Revision::DiffstatPart:
+			return (rev->m_diffstat->load(in) && in.ok());
+		default:
+			break;
+	}
+	return false;
+}
+
+// Opens the database connection. Returns false if the database is used by
+// another process, in which case the cache is bypassed.
+bool LdbCache::opendb()
+{
+	if (m_db) return true;
+	if (m_bypass) return false;
 
 	std::string path = cacheDir() + "/ldb";
 	PDEBUG << "Using cache dir: " << path << endl;
 	if (!sys::fs::dirExists(path)) {
 		sys::fs::mkpath(path);
 	}
+	if (m_blockCache == NULL) {
+		m_blockCache = leveldb::NewLRUCache((size_t)m_opts.cacheMemory() * 1024 * 1024);
+		m_filterPolicy = leveldb::NewBloomFilterPolicy(BLOOM_BITS_PER_KEY);
+	}
 	leveldb::Options options;
 	options.create_if_missing = false;
+	options.block_cache = m_blockCache;
+	options.filter_policy = m_filterPolicy;
+	options.write_buffer_size = WRITE_BUFFER_SIZE;
 	leveldb::Status s = leveldb::DB::Open(options, path, &m_db);
+	if (!s.ok() && s.IsIOError() && sys::fs::fileExists(path + "/CURRENT")) {
+		// The database is locked by another process. Leveldb doesn't
+		// support concurrent access, so simply don't use the cache.
+		PDEBUG << "Unable to open database " << path << ": " << s.ToString() << endl;
+		Logger::warn() << "Warning: Revision cache " << path << " is used by another process, bypassing it" << endl;
+		m_bypass = true;
+		return false;
+	}
 	if (!s.ok()) {
 		// New cache: Import revisions from old cache
 		options.create_if_missing = true;
@@ -172,6 +672,7 @@ void LdbCache::opendb()
 		Cache c(m_backend, m_opts);
 		import(&c);
 	}
+	return true;
 }
 
 // Closes the database connection
@@ -179,26 +680,127 @@ void LdbCache::closedb()
 {
 	delete m_db;
 	m_db = NULL;
+
+	// These are used by the database until it has been closed
+	delete m_blockCache;
+	delete m_filterPolicy;
+	m_blockCache = NULL;
+	m_filterPolicy = NULL;
+	m_memory.set(0);
+}
+
+// Updates the memory accounted to the memtables and the block cache
+void LdbCache::account()
+{
+	std::string usage;
+	if (MemStats::enabled() && m_db->GetProperty("leveldb.approximate-memory-usage", &usage)) {
+		m_memory.set(strtoll(usage.c_str(), NULL, 10));
+	}
 }
 
-// Imports all revisions from the given cache
+// Imports all revisions from the given cache. The records are located by
+// this thread in the order they have been written to the old segments, and
+// they are decoded and encoded again by the global thread pool, with a
+// bounded number of batches in flight. The writes aren't synced until the
+// end, since the old cache can be imported again if the import is
+// interrupted.
 void LdbCache::import(Cache *cache)
 {
+	std::vector<Cache::Entry> entries;
 	try {
-		cache->load();
+		if (!cache->m_loaded) {
+			cache->load();
+		}
+		std::vector<Cache::Entry> all = cache->entries();
+		for (size_t i = 0; i < all.size(); i++) {
+			if (!all[i].linked()) {
+				entries.push_back(all[i]);
+			}
+		}
 	} catch (const std::exception &ex) {
 		PDEBUG << "Error loading old cache for import: " << ex.what() << endl;
 		return;
 	}
+	if (entries.empty()) {
+		return;
+	}
+	std::sort(entries.begin(), entries.end(), Cache::writeOrder);
 
-	Logger::info() << "LdbCache: Found old cache, importing revisions..." << endl;
-	std::map<std::string, std::pair<uint32_t, uint32_t> >::const_iterator it;
+	Logger::info() << "LdbCache: Found old cache, importing " << entries.size() << " revisions..." << endl;
+	sys::parallel::ThreadPool *pool = sys::parallel::ThreadPool::global();
+	sys::datetime::Watch watch, status;
+	std::deque<Importer *> tasks;
+	std::vector<std::string> corrupted;
 	size_t n = 0;
-	for (it = cache->m_index.begin(); it != cache->m_index.end(); ++it) {
-		Revision *rev = cache->get(it->first);
-		put(it->first, *rev);
-		delete rev;
-		++n;
+	Importer *task = new Importer(this, cache);
+	try {
+		for (size_t i = 0; i <= entries.size(); i++) {
+			bool valid = (i < entries.size());
+			if (valid) {
+				const Cache::Entry &e = entries[i];
+				Importer::Record r;
+				uint32_t length;
+				const char *meta = cache->record(Cache::MetaStore, e.locations[Cache::MetaStore], &length);
+				r.id.assign(meta, strnlen(meta, length));
+				bool found = true;
+				for (int j = 0; j < Cache::NumStores && found; j++) {
+					r.data[j] = cache->payload(j, r.id, e.locations[j], &r.length[j]);
+					found = (r.data[j] != NULL);
+				}
+				if (found) {
+					task->records.push_back(r);
+				} else {
+					corrupted.push_back(r.id);
+				}
+			}
+			if (task->records.size() >= IMPORT_BATCH || !valid) {
+				pool->submit(task);
+				tasks.push_back(task);
+				task = (valid ? new Importer(this, cache) : NULL);
+			}
+
+			// Write the batches in order
+			while (!tasks.empty() && (tasks.size() > size_t(2 * pool->size()) || !valid)) {
+				Importer *done = tasks.front();
+				tasks.pop_front();
+				done->wait();
+				leveldb::Status s = m_db->Write(leveldb::WriteOptions(), &done->batch);
+				corrupted.insert(corrupted.end(), done->corrupted().begin(), done->corrupted().end());
+				n += done->revisions();
+				delete done;
+				if (!s.ok()) {
+					throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
+				}
+			}
+
+			if (status.elapsedMSecs() > 1000) {
+				status.start();
+				Logger::status() << "\r\033[0K";
+				Logger::status() << "Importing revisions... " << i << " of " << entries.size() << " (" << (100 * i / entries.size()) << "%)" << ::flush;
+			}
+		}
+	} catch (...) {
+		delete task;
+		for (size_t i = 0; i < tasks.size(); i++) {
+			tasks[i]->wait();
+			delete tasks[i];
+		}
+		throw;
+	}
+
+	// Sync all writes at once
+	leveldb::WriteOptions options;
+	options.sync = true;
+	leveldb::WriteBatch empty;
+	leveldb::Status s = m_db->Write(options, &empty);
+	if (!s.ok()) {
+		throw PEX(str::printf("Error writing to cache: %s", s.ToString().c_str()));
+	}
+	account();
+
+	for (size_t i = 0; i < corrupted.size(); i++) {
+		Logger::warn() << "Warning: Skipping corrupted revision " << corrupted[i] << " of old cache" << endl;
 	}
-	Logger::info() << "LdbCache: Imported " << n << " revisions" << endl;
+	Logger::status() << "\r\033[0K";
+	Logger::info() << "LdbCache: Imported " << n << " revisions in " << str::printf("%.1f", watch.elapsed()) << " s" << endl;
 }
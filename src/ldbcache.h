@@ -16,11 +16,16 @@
 
 
 #include "abstractcache.h"
+#include "codec.h"
+#include "memstats.h"
 
 class Cache;
 
 namespace leveldb {
+	class Cache;
 	class DB;
+	class FilterPolicy;
+	class WriteBatch;
 }
 
 
@@ -32,19 +37,50 @@ class LdbCache : public AbstractCache
 
 		void flush();
 		void check(bool force = false);
+		void compact();
 
 	protected:
 		bool lookup(const std::string &id);
 		void put(const std::string &id, const Revision &rev);
-		Revision *get(const std::string &id);
+		Revision *get(const std::string &id, int parts);
+
+		std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		void putMany(const std::vector<Revision *> &revs);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids, int parts);
+
+		Revision *getCached(const std::string &id, int parts);
+		std::vector<Revision *> getCachedMany(const std::vector<std::string> &ids, int parts);
+
+		bool sharesDiffstats() const;
+		DiffstatPtr getShared(const std::string &key);
+		void link(const std::string &key, const std::string &id);
+
+		bool storesLogs() const;
+
+		std::vector<std::string> ids();
 
 	private:
-		void opendb();
+		class Importer;
+		class Verifier;
+
+		bool opendb();
 		void closedb();
+		void account();
 		void import(Cache *cache);
+		void add(leveldb::WriteBatch *batch, const std::string &id, const Revision &rev);
+
+		static std::string key(int part, const std::string &id);
+		static int partOf(const std::string &key);
+		static bool complete(const char *data, size_t length);
+		bool parse(int part, const char *data, size_t length, Revision *rev) const;
 
 	private:
 		leveldb::DB *m_db;
+		leveldb::Cache *m_blockCache;
+		const leveldb::FilterPolicy *m_filterPolicy;
+		bool m_bypass; // Set if the database is used by another process
+		Codec m_codec; // For messages and diffstats
+		MemStats::Gauge m_memory;
 };
 
 
@@ -0,0 +1,170 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: legacycache.cpp
+ * Read-only access to revision caches of format version 5 and older
+ */
+
+
+#include "main.h"
+
+#include <utility>
+
+#include "bstream.h"
+#include "logger.h"
+#include "revision.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+
+#include "legacycache.h"
+
+#define LEGACY_CACHE_VERSION (uint32_t)5
+
+
+// Constructor
+LegacyCache::LegacyCache(const std::string &dir, const std::string &backend)
+	: m_dir(dir), m_backend(backend), m_version(0), m_cin(NULL), m_ciindex(0)
+{
+
+}
+
+// Destructor
+LegacyCache::~LegacyCache()
+{
+	delete m_cin;
+}
+
+// Checks whether the given cache directory contains a legacy index file
+bool LegacyCache::exists(const std::string &dir)
+{
+	return sys::fs::fileExists(dir + "/index");
+}
+
+// Loads the index file
+LegacyCache::VersionCheckResult LegacyCache::load()
+{
+	m_index.clear();
+
+	GZIStream in(m_dir + "/index");
+	if (!in.ok()) {
+		return Missing;
+	}
+
+	in >> m_version;
+	VersionCheckResult result = checkVersion(m_version);
+	if (result != Ok) {
+		return result;
+	}
+
+	std::string buffer;
+	std::pair<uint32_t, uint32_t> pos;
+	uint32_t crc;
+	while (!(in >> buffer).eof()) {
+		if (buffer.empty()) {
+			break;
+		}
+		in >> pos.first >> pos.second;
+		in >> crc;
+		m_index[buffer] = pos;
+	}
+	return Ok;
+}
+
+// Returns the IDs of all indexed revisions
+std::vector<std::string> LegacyCache::ids() const
+{
+	std::vector<std::string> ids;
+	ids.reserve(m_index.size());
+	std::map<std::string, std::pair<uint32_t, uint32_t> >::const_iterator it;
+	for (it = m_index.begin(); it != m_index.end(); ++it) {
+		ids.push_back(it->first);
+	}
+	return ids;
+}
+
+// Loads a revision from the cache
+Revision *LegacyCache::get(const std::string &id)
+{
+	std::map<std::string, std::pair<uint32_t, uint32_t> >::const_iterator it = m_index.find(id);
+	if (it == m_index.end()) {
+		throw PEX(str::printf("Revision %s not found in legacy cache", id.c_str()));
+	}
+
+	std::pair<uint32_t, uint32_t> offset = it->second;
+	std::string path = str::printf("%s/cache.%u", m_dir.c_str(), offset.first);
+	if (m_cin == NULL || offset.first != m_ciindex) {
+		delete m_cin;
+		m_cin = new BIStream(path);
+		m_ciindex = offset.first;
+		if (!m_cin->ok()) {
+			throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+		}
+	}
+	if (!m_cin->seek(offset.second)) {
+		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	}
+
+	Revision *rev = new Revision(id);
+	std::vector<char> data;
+	*m_cin >> data;
+	data = utils::uncompress(data);
+	if (data.empty()) {
+		delete rev;
+		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	}
+	MIStream rin(std::move(data));
+	if (!rev->load03(rin)) {
+		delete rev;
+		throw PEX(str::printf("Unable to read from cache file: %s", path.c_str()));
+	}
+	return rev;
+}
+
+// Removes the index and all cache files
+void LegacyCache::remove()
+{
+	delete m_cin;
+	m_cin = NULL;
+	m_index.clear();
+
+	std::vector<std::string> files = sys::fs::ls(m_dir);
+	for (size_t i = 0; i < files.size(); i++) {
+		if (files[i] == "index" || files[i].compare(0, 6, "cache.") == 0) {
+			PDEBUG << "Unlinking " << m_dir << "/" << files[i] << endl;
+			sys::fs::unlink(m_dir + "/" + files[i]);
+		}
+	}
+}
+
+// Checks the cache version
+LegacyCache::VersionCheckResult LegacyCache::checkVersion(uint32_t version) const
+{
+	if (version == 0) {
+		return UnknownVersion;
+	}
+	if (version <= 1) {
+		// The diffstats for Mercurial and Git have been flawed in version 1.
+		// The Subversion backend uses repository-wide diffstats now.
+		return OutOfDate;
+	}
+	if (version <= 2 && m_backend == "subversion") {
+		// Invalid diffstats for deleted files in version 2 (Subversion backend)
+		return OutOfDate;
+	}
+	if (version <= 4 && m_backend == "git") {
+		// Invalid commit times in version 3 (Git backend)
+		return OutOfDate;
+	}
+	if (version <= LEGACY_CACHE_VERSION) {
+		return Ok;
+	}
+
+	return UnknownVersion;
+}
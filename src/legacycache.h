@@ -0,0 +1,65 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: legacycache.h
+ * Read-only access to revision caches of format version 5 and older (interface)
+ */
+
+
+#ifndef LEGACYCACHE_H_
+#define LEGACYCACHE_H_
+
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "main.h"
+
+class BIStream;
+class Revision;
+
+
+class LegacyCache
+{
+	public:
+		typedef enum {
+			Ok,
+			Missing,
+			UnknownVersion,
+			OutOfDate
+		} VersionCheckResult;
+
+	public:
+		LegacyCache(const std::string &dir, const std::string &backend);
+		~LegacyCache();
+
+		static bool exists(const std::string &dir);
+
+		VersionCheckResult load();
+		std::vector<std::string> ids() const;
+		Revision *get(const std::string &id);
+		void remove();
+
+		inline uint32_t version() const { return m_version; }
+
+	private:
+		VersionCheckResult checkVersion(uint32_t version) const;
+
+	private:
+		std::string m_dir;
+		std::string m_backend;
+		uint32_t m_version;
+		BIStream *m_cin;
+		uint32_t m_ciindex;
+
+		std::map<std::string, std::pair<uint32_t, uint32_t> > m_index;
+};
+
+
+#endif // LEGACYCACHE_H_
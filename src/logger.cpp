@@ -13,6 +13,10 @@
 
 #include "main.h"
 
+#include <cstdlib>
+#include <map>
+#include <sstream>
+
 #include "logger.h"
 
 
@@ -32,6 +36,54 @@ int Logger::s_level = Logger::Debug;
 int Logger::s_level = Logger::None;
 #endif
 sys::parallel::Mutex Logger::s_mutex;
+std::atomic<Logger::Record *> Logger::s_queue(NULL);
+std::atomic<bool> Logger::s_draining(false);
+Logger::Drainer *Logger::s_drainer = NULL;
+
+
+// A finished log record
+struct Logger::Record
+{
+	std::ostream *out;
+	std::string text;
+	Record *next;
+};
+
+// Formatting buffers of a thread, one for each level. Unfinished records
+// are committed when the thread exits.
+struct Logger::Buffers
+{
+	std::ostringstream streams[NumLevels];
+
+	~Buffers() {
+		for (int i = 0; i < NumLevels; i++) {
+			s_instances[i].commit();
+		}
+	}
+};
+
+// Background thread writing queued records
+class Logger::Drainer : public sys::parallel::Thread
+{
+	public:
+		Drainer() : m_end(false) { }
+
+		void stop() {
+			m_end = true;
+			wait();
+		}
+
+	protected:
+		void run() {
+			while (!m_end) {
+				msleep(RefreshInterval);
+				drain();
+			}
+		}
+
+	private:
+		std::atomic<bool> m_end;
+};
 
 
 // Constructor
@@ -41,9 +93,11 @@ Logger::Logger(int level, std::ostream &out)
 
 }
 
-// Sets the output device for the logger instances
+// Sets the output device for the logger instances. Queued records are
+// written to the previous device first.
 void Logger::setOutput(std::ostream &out, int level)
 {
+	drain();
 	if (level < 0) {
 		for (int i = 0; i < Logger::NumLevels; i++) {
 			if (i != Logger::Error && i != Logger::Warn) {
@@ -67,10 +121,95 @@ int Logger::level()
 	return s_level;
 }
 
-// Flushes all loggers
+// Writes all queued records, including unfinished ones of the calling
+// thread, and flushes all outputs
 void Logger::flush()
 {
+	for (int i = 0; i < Logger::NumLevels; i++) {
+		s_instances[i].commit();
+	}
+	drain();
 	for (int i = 0; i < Logger::NumLevels; i++) {
 		s_instances[i].m_out->flush();
 	}
 }
+
+// Returns the formatting buffer of the calling thread for this level
+std::ostream &Logger::stream()
+{
+	static thread_local Buffers buffers;
+	return buffers.streams[m_level];
+}
+
+// Queues the current record of the calling thread
+void Logger::commit()
+{
+	std::ostringstream &buffer = static_cast<std::ostringstream &>(stream());
+	Record *record = new Record;
+	record->text = buffer.str();
+	if (record->text.empty()) {
+		delete record;
+		return;
+	}
+	buffer.str(std::string());
+	record->out = m_out;
+
+	record->next = s_queue.load(std::memory_order_relaxed);
+	while (!s_queue.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) ;
+
+	if (m_level <= Warn) {
+		drain();
+	} else if (!s_draining.exchange(true)) {
+		s_drainer = new Drainer();
+		s_drainer->start();
+		atexit(stopDrainer);
+	}
+}
+
+// Writes all queued records
+void Logger::drain()
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	Record *latest = s_queue.exchange(NULL, std::memory_order_acquire);
+	if (latest == NULL) {
+		return;
+	}
+
+	// Reverse the queue, dropping progress updates that would be
+	// overwritten immediately
+	std::map<std::ostream *, bool> overwritten;
+	Record *first = NULL;
+	while (latest != NULL) {
+		Record *record = latest;
+		latest = latest->next;
+
+		bool progress = (record->text[0] == '\r' && record->text.find('\n') == std::string::npos);
+		bool &next = overwritten[record->out];
+		bool drop = (progress && next);
+		next = (record->text[0] == '\r');
+		if (drop) {
+			delete record;
+		} else {
+			record->next = first;
+			first = record;
+		}
+	}
+
+	while (first != NULL) {
+		Record *record = first;
+		first = first->next;
+		*record->out << record->text;
+		delete record;
+	}
+	std::map<std::ostream *, bool>::iterator it;
+	for (it = overwritten.begin(); it != overwritten.end(); ++it) {
+		it->first->flush();
+	}
+}
+
+// Stops the background thread when the program exits
+void Logger::stopDrainer()
+{
+	s_drainer->stop();
+	drain();
+}
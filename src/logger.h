@@ -15,17 +15,24 @@
 #define LOGGER_H_
 
 
+#include <atomic>
 #include <iostream>
 
 #include "syslib/parallel.h"
 
-// Easy logging
+// Easy logging. Nothing that is streamed into a disabled level will be
+// evaluated, and trace messages can be stripped at compile time.
 #ifndef POS_WIN
- #define PDEBUG (Logger::debug() << __PRETTY_FUNCTION__ << " [" << __LINE__ << "]: ")
- #define PTRACE (Logger::trace() << __PRETTY_FUNCTION__ << " [" << __LINE__  << "]: ")
+ #define PLOG_FUNCTION __PRETTY_FUNCTION__
 #else
- #define PDEBUG (Logger::debug() << __FUNCTION__ << " [" << __LINE__ << "]: ")
- #define PTRACE (Logger::trace() << __FUNCTION__ << " [" << __LINE__  << "]: ")
+ #define PLOG_FUNCTION __FUNCTION__
+#endif
+#define PLOG(level) !Logger::enabled(Logger::level) ? (void)0 : LogVoidify() & Logger::instance(Logger::level) << PLOG_FUNCTION << " [" << __LINE__ << "]: "
+#define PDEBUG PLOG(Debug)
+#ifndef PEPPER_NO_TRACE_LOGGING
+ #define PTRACE PLOG(Trace)
+#else
+ #define PTRACE true ? (void)0 : LogVoidify() & Logger::trace()
 #endif
 
 
@@ -35,9 +42,21 @@ enum LogModifier
 	flush
 };
 
+/*
+ * Log statements are formatted into buffers of the calling thread without
+ * any locking. Finished records (terminated by endl or flush) are pushed
+ * to a lock-free queue, which is drained by a background thread at a
+ * fixed rate. Errors and warnings are written immediately.
+ *
+ * Progress updates, i.e. records starting with a carriage return that
+ * don't end the line, are dropped if they would be overwritten by the
+ * next record for the same output anyway. This limits terminal updates
+ * to the refresh rate.
+ */
 class Logger
 {
 	friend struct SignalHandler;
+	friend struct DaemonSignalHandler;
 
 	public:
 		enum Level
@@ -48,6 +67,9 @@ class Logger
 			NumLevels
 		};
 
+		// Interval for writing queued records in milliseconds
+		enum { RefreshInterval = 50 };
+
 	public:
 		static void setOutput(std::ostream &out, int level = -1);
 		static void setLevel(int level);
@@ -55,6 +77,9 @@ class Logger
 
 		static void flush();
 
+		static inline bool enabled(Level level) { return level <= s_level; }
+		static inline Logger &instance(Level level) { return s_instances[level]; }
+
 		static inline Logger &err() { return s_instances[Error]; }
 		static inline Logger &warn() { return s_instances[Warn]; }
 		static inline Logger &status() { return s_instances[Status]; }
@@ -65,50 +90,38 @@ class Logger
 		template <typename T>
 		inline Logger &operator<<(const T &s) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
-			*m_out << s;
-			s_mutex.unlock();
+			stream() << s;
 			return *this;
 		}
 
 		inline Logger &operator<<(const char *s) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
-			*m_out << (s ? s : "(null)");
-			s_mutex.unlock();
+			stream() << (s ? s : "(null)");
 			return *this;
 		}
 		inline Logger &operator<<(std::ios_base& (* pf)(std::ios_base &)) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
-			*m_out << pf;
-			s_mutex.unlock();
+			stream() << pf;
 			return *this;
 		}
 		inline Logger &operator<<(std::ios& (* pf)(std::ios &)) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
-			*m_out << pf;
-			s_mutex.unlock();
+			stream() << pf;
 			return *this;
 		}
 		inline Logger &operator<<(std::ostream& (* pf)(std::ostream &)) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
-			*m_out << pf;
-			s_mutex.unlock();
+			stream() << pf;
 			return *this;
 		}
 
 		inline Logger &operator<<(LogModifier mod) {
 			if (m_level > s_level) return *this;
-			s_mutex.lock();
 			switch (mod) {
-				case endl: *m_out << std::endl; break;
-				case ::flush: *m_out << std::flush; break;
+				case endl: stream() << '\n'; commit(); break;
+				case ::flush: commit(); break;
 				default: break;
 			}
-			s_mutex.unlock();
 			return *this;
 		}
 
@@ -116,6 +129,15 @@ class Logger
 		Logger(int level, std::ostream &out);
 
 	private:
+		struct Record;
+		struct Buffers;
+		class Drainer;
+
+		std::ostream &stream();
+		void commit();
+
+		static void drain();
+		static void stopDrainer();
 		static inline void unlock() {
 			s_mutex.unlock();
 		}
@@ -126,7 +148,17 @@ class Logger
 
 		static Logger s_instances[NumLevels];
 		static int s_level;
-		static sys::parallel::Mutex s_mutex;
+		static sys::parallel::Mutex s_mutex; // Serializes writing records
+		static std::atomic<Record *> s_queue; // Committed records, latest first
+		static std::atomic<bool> s_draining;
+		static Drainer *s_drainer;
+};
+
+
+// Turns logging statements into void expressions for the macros above
+struct LogVoidify
+{
+	inline void operator&(Logger &) { }
 };
 
 
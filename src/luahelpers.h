@@ -156,6 +156,72 @@ inline int pushError(lua_State *L, const char *what, const char *where) {
 }
 
 
+// Appends chunks of dumped Lua functions to a string
+inline int dumpWriter(lua_State *, const void *p, size_t sz, void *ud) {
+	static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+	return 0;
+}
+
+// Returns the byte code of the Lua function at the top of the stack
+inline std::string dump(lua_State *L) {
+	std::string code;
+	lua_dump(L, dumpWriter, &code);
+	return code;
+}
+
+// Pushes a copy of a value from another Lua state. Only nil, booleans,
+// numbers, strings and (acyclic) tables of these can be copied. Returns
+// false without pushing anything otherwise.
+inline bool copy(lua_State *from, int index, lua_State *to, int depth = 0) {
+	if (index < 0) {
+		index = lua_gettop(from) + index + 1;
+	}
+	switch (lua_type(from, index)) {
+		case LUA_TNIL:
+			lua_pushnil(to);
+			return true;
+		case LUA_TBOOLEAN:
+			lua_pushboolean(to, lua_toboolean(from, index));
+			return true;
+		case LUA_TNUMBER:
+			lua_pushnumber(to, lua_tonumber(from, index));
+			return true;
+		case LUA_TSTRING: {
+			size_t len;
+			const char *s = lua_tolstring(from, index, &len);
+			lua_pushlstring(to, s, len);
+			return true;
+		}
+		case LUA_TTABLE:
+			break;
+		default:
+			return false;
+	}
+
+	// Tables nested this deep are likely to be cyclic
+	if (depth >= 64 || !lua_checkstack(from, 2) || !lua_checkstack(to, 3)) {
+		return false;
+	}
+	lua_newtable(to);
+	lua_pushnil(from);
+	while (lua_next(from, index) != 0) {
+		if (!copy(from, -2, to, depth+1)) {
+			lua_pop(from, 2);
+			lua_pop(to, 1);
+			return false;
+		}
+		if (!copy(from, -1, to, depth+1)) {
+			lua_pop(from, 2);
+			lua_pop(to, 2);
+			return false;
+		}
+		lua_rawset(to, -3);
+		lua_pop(from, 1);
+	}
+	return true;
+}
+
+
 inline int topi(lua_State *L, int index = -1) {
 	return luaL_checkinteger(L, index);
 }
@@ -306,6 +372,17 @@ inline int tablevi(lua_State *L, const std::string &key, int def = -1, int index
 	return popi(L);
 }
 
+inline double tablevd(lua_State *L, const std::string &key, double def = 0.0, int index = -1) {
+	luaL_checktype(L, index, LUA_TTABLE);
+	push(L, key);
+	lua_gettable(L, index-1);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return def;
+	}
+	return popd(L);
+}
+
 inline bool tablevb(lua_State *L, const std::string &key, bool def = false, int index = -1) {
 	luaL_checktype(L, index, LUA_TTABLE);
 	push(L, key);
@@ -328,6 +405,19 @@ inline std::string tablevb(lua_State *L, const std::string &key, const std::stri
 	return pops(L);
 }
 
+inline std::vector<std::string> tablevvs(lua_State *L, const std::string &key, int index = -1) {
+	luaL_checktype(L, index, LUA_TTABLE);
+	push(L, key);
+	lua_gettable(L, index-1);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return std::vector<std::string>();
+	} else if (lua_isstring(L, -1)) {
+		return std::vector<std::string>(1, pops(L));
+	}
+	return popvs(L);
+}
+
 
 inline size_t tablesize(lua_State *L, int index = -1) {
 	return lua_objlen(L, index);
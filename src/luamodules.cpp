@@ -13,8 +13,10 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cstring>
 
+#include "authortable.h"
 #include "cache.h"
 #include "luahelpers.h"
 #include "report.h"
@@ -66,12 +68,152 @@ int version(lua_State *L)
 	return LuaHelpers::push(L, PACKAGE_VERSION);
 }
 
+// Returns the ID of an author name, as returned by revision:author_id()
+int author_id(lua_State *L)
+{
+	return LuaHelpers::push(L, (int64_t)AuthorTable::intern(luaL_checkstring(L, 1)));
+}
+
+// Returns the author name for the given ID
+int author_name(lua_State *L)
+{
+	return LuaHelpers::push(L, AuthorTable::name(uint32_t(luaL_checknumber(L, 1))));
+}
+
+// Returns the output stream of the current report
+inline std::ostream &output()
+{
+	return (Report::current() == NULL ? std::cout : Report::current()->out());
+}
+
+// Writes formatted output to the report output stream, using the
+// conversions of string.format() except %q. Arguments must be strings or
+// numbers, which are written without converting them to Lua strings first.
+int write(lua_State *L)
+{
+	size_t flen;
+	const char *fmt = luaL_checklstring(L, 1, &flen);
+	const char *end = fmt + flen;
+	std::ostream &out = output();
+	int arg = 1;
+	char spec[32], buffer[512];
+	while (fmt < end) {
+		const char *pct = (const char *)memchr(fmt, '%', end - fmt);
+		if (pct == NULL) {
+			out.write(fmt, end - fmt);
+			break;
+		}
+		out.write(fmt, pct - fmt);
+		fmt = pct + 1;
+		if (fmt < end && *fmt == '%') {
+			out.put('%');
+			++fmt;
+			continue;
+		}
+
+		// Copy the conversion specification
+		size_t n = 0;
+		spec[n++] = '%';
+		while (fmt < end && n < 20 && strchr("-+ #0.123456789", *fmt) != NULL) {
+			spec[n++] = *fmt++;
+		}
+		if (fmt == end || n >= 20) {
+			return luaL_error(L, "invalid conversion in format string to 'write'");
+		}
+
+		char conv = *fmt++;
+		++arg;
+		int len = 0;
+		switch (conv) {
+			case 'd': case 'i':
+				spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+				len = snprintf(buffer, sizeof(buffer), spec, (long long)luaL_checknumber(L, arg));
+				break;
+			case 'u': case 'o': case 'x': case 'X':
+				spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+				len = snprintf(buffer, sizeof(buffer), spec, (unsigned long long)(long long)luaL_checknumber(L, arg));
+				break;
+			case 'c':
+				spec[n++] = conv; spec[n] = '\0';
+				len = snprintf(buffer, sizeof(buffer), spec, (int)luaL_checknumber(L, arg));
+				break;
+			case 'e': case 'E': case 'f': case 'g': case 'G':
+				spec[n++] = conv; spec[n] = '\0';
+				len = snprintf(buffer, sizeof(buffer), spec, (double)luaL_checknumber(L, arg));
+				break;
+			case 's': {
+				size_t l;
+				const char *str = luaL_checklstring(L, arg, &l);
+				if (n == 1) {
+					out.write(str, l);
+					continue;
+				}
+				spec[n++] = conv; spec[n] = '\0';
+				std::string s(str, l);
+				std::string f = str::printf(spec, s.c_str());
+				out.write(f.data(), f.length());
+				continue;
+			}
+			default:
+				return luaL_error(L, "invalid option '%%%c' to 'write'", conv);
+		}
+		out.write(buffer, std::min(len, int(sizeof(buffer) - 1)));
+	}
+	return 0;
+}
+
+// Writes the arguments as a single CSV row to the report output stream.
+// Numbers are written as they are, while strings are quoted as specified
+// in RFC 4180.
+int write_csv(lua_State *L)
+{
+	std::ostream &out = output();
+	int n = lua_gettop(L);
+	for (int i = 1; i <= n; i++) {
+		if (i > 1) {
+			out.put(',');
+		}
+		size_t l;
+		if (lua_type(L, i) == LUA_TNUMBER) {
+			const char *s = lua_tolstring(L, i, &l);
+			out.write(s, l);
+			continue;
+		} else if (lua_isnil(L, i)) {
+			continue;
+		}
+
+		const char *s = lua_tolstring(L, i, &l);
+		if (s == NULL) {
+			return luaL_error(L, "cannot write %s value to CSV", lua_typename(L, lua_type(L, i)));
+		}
+		out.put('"');
+		const char *end = s + l;
+		while (s < end) {
+			const char *quote = (const char *)memchr(s, '"', end - s);
+			if (quote == NULL) {
+				out.write(s, end - s);
+				break;
+			}
+			out.write(s, quote - s + 1);
+			out.put('"');
+			s = quote + 1;
+		}
+		out.put('"');
+	}
+	out.put('\n');
+	return 0;
+}
+
 // Function table of main functions
 const struct luaL_reg table[] = {
 	{"current_report", current_report},
 	{"run", run},
 	{"list_reports", list_reports},
 	{"version", version},
+	{"author_id", author_id},
+	{"author_name", author_name},
+	{"write", write},
+	{"write_csv", write_csv},
 	{NULL, NULL}
 };
 
@@ -152,9 +294,19 @@ int unlink(lua_State *L)
 // Splits a string
 int split(lua_State *L)
 {
-	std::string pattern = LuaHelpers::pops(L);
-	std::string string = LuaHelpers::pops(L);
-	return LuaHelpers::push(L, str::split(string, pattern));
+	size_t slen, plen;
+	const char *string = luaL_checklstring(L, 1, &slen);
+	const char *pattern = luaL_checklstring(L, 2, &plen);
+
+	// Push the fields directly instead of copying them to a vector first
+	str::Tokenizer tok(str::View(string, slen), str::View(pattern, plen));
+	str::View field;
+	lua_newtable(L);
+	for (int i = 1; tok.next(&field); i++) {
+		lua_pushlstring(L, field.data(), field.size());
+		lua_rawseti(L, -2, i);
+	}
+	return 1;
 }
 
 // Wrapper for strptime
@@ -228,6 +380,28 @@ int check_cache(lua_State *L)
 	return LuaHelpers::pushNil(L);
 }
 
+// Compacts the revision cache of the given repository
+int compact_cache(lua_State *L)
+{
+	if (lua_gettop(L) != 1) {
+		return LuaHelpers::pushError(L, "Invalid number of arguments (1 expected)");
+	}
+	Repository *repo = LuaHelpers::popl<Repository>(L);
+	AbstractCache *cache = dynamic_cast<AbstractCache *>(repo->backend());
+	if (cache == NULL) {
+		return LuaHelpers::pushError(L, "No active cache found");
+	}
+
+	try {
+		cache->compact();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error compacting cache: %s: %s", ex.where(), ex.what()));
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, str::printf("Error compacting cache: %s", ex.what()));
+	}
+	return LuaHelpers::pushNil(L);
+}
+
 // Lua wrapper for sys::datetime::Watch
 class Watch : public sys::datetime::Watch
 {
@@ -253,6 +427,7 @@ Lunar<Watch>::RegType Watch::methods[] = {
 // Function table of internal functions
 const struct luaL_reg table[] = {
 	{"check_cache", check_cache},
+	{"compact_cache", compact_cache},
 	{NULL, NULL}
 };
 
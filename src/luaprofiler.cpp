@@ -0,0 +1,243 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: luaprofiler.cpp
+ * Sampling profiler for report scripts
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "luahelpers.h"
+#include "strlib.h"
+
+#include "syslib/datetime.h"
+
+#include "luaprofiler.h"
+
+
+namespace
+{
+
+// Sample clock of the calling thread
+struct Clock
+{
+	int64_t last, next;
+};
+
+Clock &sampleClock()
+{
+	static thread_local Clock c = { 0, 0 };
+	return c;
+}
+
+// Frame names are separated by semicolons in collapsed stacks
+std::string sanitize(std::string name)
+{
+	std::replace(name.begin(), name.end(), ';', ',');
+	return name;
+}
+
+// Orders profile entries by self time, then by total time
+bool entryLess(const std::pair<std::string, std::pair<int64_t, int64_t> > &a, const std::pair<std::string, std::pair<int64_t, int64_t> > &b)
+{
+	if (a.second.first != b.second.first) {
+		return a.second.first > b.second.first;
+	}
+	if (a.second.second != b.second.second) {
+		return a.second.second > b.second.second;
+	}
+	return a.first < b.first;
+}
+
+} // anonymous namespace
+
+
+// Static variables
+std::atomic<bool> LuaProfiler::s_enabled(false);
+sys::parallel::Mutex LuaProfiler::s_mutex;
+std::unordered_map<std::string, int64_t> *LuaProfiler::s_stacks = NULL;
+
+
+// Enables profiling of Lua states that are attached afterwards
+void LuaProfiler::start()
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	if (s_stacks == NULL) {
+		s_stacks = new std::unordered_map<std::string, int64_t>();
+	}
+	lunarHook() = &LuaProfiler::methodHook;
+	s_enabled = true;
+}
+
+// Installs the sampling hook in the given state. The sample clock of the
+// calling thread is reset, so time spent before isn't charged to the script.
+void LuaProfiler::attach(lua_State *L)
+{
+	lua_sethook(L, &LuaProfiler::hook, LUA_MASKCOUNT, HookCount);
+	Clock &c = sampleClock();
+	c.last = sys::datetime::cpuUsecs();
+	c.next = c.last + Interval;
+}
+
+// Adds time to the given collapsed stack
+void LuaProfiler::add(const std::string &stack, int64_t usecs)
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	if (s_stacks == NULL) {
+		s_stacks = new std::unordered_map<std::string, int64_t>();
+	}
+	(*s_stacks)[stack] += usecs;
+}
+
+// Drops all recorded samples
+void LuaProfiler::clear()
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	if (s_stacks != NULL) {
+		s_stacks->clear();
+	}
+}
+
+// Prints the functions with the highest self time, including the time
+// spent in the functions they called
+void LuaProfiler::print(std::ostream &out, size_t max)
+{
+	std::map<std::string, std::pair<int64_t, int64_t> > functions; // Self and total time
+	int64_t sum = 0;
+	{
+		sys::parallel::MutexLocker locker(&s_mutex);
+		std::unordered_map<std::string, int64_t> empty;
+		const std::unordered_map<std::string, int64_t> &stacks = (s_stacks != NULL ? *s_stacks : empty);
+		for (std::unordered_map<std::string, int64_t>::const_iterator it = stacks.begin(); it != stacks.end(); ++it) {
+			std::vector<std::string> frames = str::split(it->first, ";");
+			if (frames.empty()) {
+				continue;
+			}
+			std::set<std::string> seen; // Recursive calls are counted once
+			for (size_t i = 0; i < frames.size(); i++) {
+				if (seen.insert(frames[i]).second) {
+					functions[frames[i]].second += it->second;
+				}
+			}
+			functions[frames.back()].first += it->second;
+			sum += it->second;
+		}
+	}
+
+	std::vector<std::pair<std::string, std::pair<int64_t, int64_t> > > entries(functions.begin(), functions.end());
+	std::sort(entries.begin(), entries.end(), entryLess);
+
+	out << str::printf("Lua profile (%.1f ms CPU time):", sum / 1000.0) << std::endl;
+	out << str::printf("  %10s %6s %10s %6s  %s", "self", "", "total", "", "function") << std::endl;
+	for (size_t i = 0; i < entries.size() && i < max; i++) {
+		int64_t self = entries[i].second.first, total = entries[i].second.second;
+		out << str::printf("  %7.1f ms %5.1f%% %7.1f ms %5.1f%%  %s", self / 1000.0, (sum > 0 ? 100.0 * self / sum : 0.0),
+			total / 1000.0, (sum > 0 ? 100.0 * total / sum : 0.0), entries[i].first.c_str()) << std::endl;
+	}
+}
+
+// Writes the recorded stacks in the collapsed format of flamegraph.pl,
+// with the time in microseconds as sample counts
+void LuaProfiler::writeCollapsed(std::ostream &out)
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	std::map<std::string, int64_t> sorted;
+	if (s_stacks != NULL) {
+		sorted.insert(s_stacks->begin(), s_stacks->end());
+	}
+	for (std::map<std::string, int64_t>::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+		out << it->first << " " << it->second << "\n";
+	}
+	out << std::flush;
+}
+
+// Writes the recorded stacks to the given file
+void LuaProfiler::save(const std::string &path)
+{
+	std::ofstream out(path.c_str());
+	if (!out.good()) {
+		throw PEX(str::printf("Unable to open profile file %s for writing", path.c_str()));
+	}
+	writeCollapsed(out);
+	out.close();
+	if (out.fail()) {
+		throw PEX(str::printf("Unable to write profile file %s", path.c_str()));
+	}
+}
+
+// Count hook, sampling the running Lua function
+void LuaProfiler::hook(lua_State *L, lua_Debug *)
+{
+	sample(L, NULL, NULL);
+}
+
+// Called after member functions of bound classes
+void LuaProfiler::methodHook(lua_State *L, const char *className, const char *method)
+{
+	sample(L, className, method);
+}
+
+// Records the current call stack if the sampling interval has passed
+void LuaProfiler::sample(lua_State *L, const char *className, const char *method)
+{
+	int64_t now = sys::datetime::cpuUsecs();
+	Clock &c = sampleClock();
+	if (c.last == 0) {
+		// First sample of a worker thread
+		c.last = now;
+		c.next = now + Interval;
+		return;
+	}
+	if (now < c.next) {
+		return;
+	}
+
+	// The frame of a member function is replaced by a proper name
+	std::vector<std::string> frames;
+	lua_Debug ar;
+	for (int level = (method != NULL ? 1 : 0); level < MaxDepth && lua_getstack(L, level, &ar); level++) {
+		lua_getinfo(L, "Sn", &ar);
+		frames.push_back(frame(&ar));
+	}
+
+	std::string stack;
+	for (size_t i = frames.size(); i > 0; i--) {
+		stack += frames[i-1];
+		stack += ';';
+	}
+	if (method != NULL) {
+		stack += sanitize(std::string(className) + ":" + method);
+	} else if (!stack.empty()) {
+		stack.erase(stack.length() - 1);
+	}
+	if (!stack.empty()) {
+		add(stack, now - c.last);
+	}
+	c.last = now;
+	c.next = now + Interval;
+}
+
+// Returns a readable name for the given stack frame
+std::string LuaProfiler::frame(const lua_Debug *ar)
+{
+	std::string name = (ar->name != NULL ? ar->name : "?");
+	if (ar->what != NULL && !strcmp(ar->what, "C")) {
+		return sanitize(name + " [C]");
+	} else if (ar->what != NULL && !strcmp(ar->what, "main")) {
+		return sanitize(std::string("main chunk (") + ar->short_src + ")");
+	}
+	return sanitize(str::printf("%s (%s:%d)", name.c_str(), ar->short_src, ar->linedefined));
+}
@@ -0,0 +1,78 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: luaprofiler.h
+ * Sampling profiler for report scripts (interface)
+ */
+
+
+#ifndef LUAPROFILER_H_
+#define LUAPROFILER_H_
+
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include "syslib/parallel.h"
+
+struct lua_State;
+struct lua_Debug;
+
+
+/*
+ * Attributes the CPU time of report scripts to Lua call stacks. A count
+ * hook checks the CPU time of the calling thread every few VM instructions
+ * and records the current call stack after each sampling interval, weighted
+ * with the time since the last sample. Since the VM doesn't run hooks while
+ * a C function is executing, member functions of bound classes are sampled
+ * after they have returned, with the function itself as the innermost frame.
+ * This way, time spent in bindings and their conversions isn't charged to
+ * the calling Lua function.
+ *
+ * Only CPU time is counted, so worker states don't accumulate the time they
+ * spend waiting for jobs. Code compiled by LuaJIT doesn't run hooks and
+ * is charged to the next sample.
+ */
+class LuaProfiler
+{
+	public:
+		enum {
+			HookCount = 1000, // VM instructions between checks of the sample clock
+			Interval = 1000,  // Sampling interval in microseconds
+			MaxDepth = 128    // Innermost frames that are recorded
+		};
+
+	public:
+		static void start();
+		static inline bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+		static void attach(lua_State *L);
+
+		static void add(const std::string &stack, int64_t usecs);
+		static void clear();
+
+		static void print(std::ostream &out, size_t max = 30);
+		static void writeCollapsed(std::ostream &out);
+		static void save(const std::string &path);
+
+	private:
+		static void hook(lua_State *L, lua_Debug *ar);
+		static void methodHook(lua_State *L, const char *className, const char *method);
+		static void sample(lua_State *L, const char *className, const char *method);
+		static std::string frame(const lua_Debug *ar);
+
+	private:
+		static std::atomic<bool> s_enabled;
+		static sys::parallel::Mutex s_mutex;
+		static std::unordered_map<std::string, int64_t> *s_stacks; // Collapsed stacks and their time
+};
+
+
+#endif // LUAPROFILER_H_
@@ -15,7 +15,10 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <memory>
+#include <sstream>
 
 #if defined(POS_LINUX) && defined(DEBUG)
  #include <sys/resource.h>
@@ -23,9 +26,21 @@
 
 #include "backend.h"
 #include "abstractcache.h"
+#include "daemon.h"
+#include "diffstat.h"
+#include "jobqueue.h"
 #include "logger.h"
+#include "luaprofiler.h"
+#include "memstats.h"
+#include "memorycache.h"
 #include "options.h"
+#include "plot.h"
+#include "remotecache.h"
 #include "report.h"
+#include "reportcache.h"
+#include "stats.h"
+#include "tracer.h"
+#include "watcher.h"
 
 #ifdef USE_LDBCACHE
  #include "ldbcache.h"
@@ -33,6 +48,8 @@
  #include "cache.h"
 #endif
 
+#include "syslib/io.h"
+#include "syslib/parallel.h"
 #include "syslib/sigblock.h"
 
 
@@ -68,7 +85,8 @@ static void printFooter()
 // Prints program usage information
 static void printHelp(const Options &opts)
 {
-	std::cout << "USAGE: " << PACKAGE_NAME << " [options] <report> [report options] [repository]" << std::endl << std::endl;
+	std::cout << "USAGE: " << PACKAGE_NAME << " [options] <report> [report options] [repository]" << std::endl;
+	std::cout << "       " << PACKAGE_NAME << " [options] --reports=<list> [report options] [repository]" << std::endl << std::endl;
 
 	std::cout << "Main options:" << std::endl;
 	Options::printHelp();
@@ -134,9 +152,49 @@ static void setupLogger(std::vector<std::ofstream *> *streams, const Options &)
 #endif
 }
 
+// Runs a single report
+static int runReport(Report *report)
+{
+	try {
+		return report->run();
+	} catch (const PepperException &ex) {
+		std::cerr << "Received exception while running report:" << std::endl;
+		std::cerr << "  what():  " << ex.what() << std::endl;
+		std::cerr << "  where(): " << ex.where() << std::endl;
+		std::cerr << "  trace(): " << ex.trace() << std::endl;
+	} catch (const std::exception &ex) {
+		std::cerr << "Received exception while running report:" << std::endl;
+		std::cerr << "  what(): " << ex.what() << std::endl;
+	}
+	return EXIT_FAILURE;
+}
+
+// Runs the requested reports once. Several reports read the history from
+// a memory cache, so the cache or repository is only read once.
+static int runReports(const Options &opts, Backend *source, MemoryCache *memcache)
+{
+	std::vector<std::string> reports = opts.reports();
+	if (memcache == NULL) {
+		Report r(reports[0], source);
+		return runReport(&r);
+	}
+
+	int ret = EXIT_SUCCESS;
+	for (size_t i = 0; i < reports.size(); i++) {
+		PDEBUG << "Running report " << reports[i] << " (" << (i+1) << " of " << reports.size() << ")" << endl;
+		Report r(reports[i], opts.reportOptions(reports[i]), memcache);
+		if (runReport(&r) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
+
 // Runs the program according to the given actions
 int start(const Options &opts)
 {
+	ReportCache::setDir(opts.cacheDir());
+
 	// Print requested help screens or listings
 	if (opts.helpRequested()) {
 		printHelp(opts);
@@ -152,9 +210,26 @@ int start(const Options &opts)
 		Report::printReportListing();
 		printFooter();
 		return EXIT_SUCCESS;
-	} else if (opts.repository().empty() || opts.report().empty()) {
+	}
+
+	// Keep backends and caches open for reports requested by clients
+	if (!opts.daemonSocket().empty()) {
+		Daemon daemon(opts);
+		return daemon.run();
+	}
+
+	// Cache bundles may be transferred and the cache may be filled without
+	// running any reports
+	bool transfer = (!opts.exportCache().empty() || !opts.importCache().empty() || opts.warmCache());
+	if (opts.repository().empty() || (opts.reports().empty() && !transfer)) {
 		printHelp(opts);
 		return EXIT_FAILURE;
+	} else if (transfer && !opts.useCache()) {
+		std::cerr << "Error: Cache bundles can't be transferred or warmed up with --no-cache" << std::endl;
+		return EXIT_FAILURE;
+	} else if (opts.watch() >= 0 && opts.reports().empty()) {
+		std::cerr << "Error: No report given for --watch" << std::endl;
+		return EXIT_FAILURE;
 	}
 
 	// Setup backend
@@ -173,15 +248,22 @@ int start(const Options &opts)
 
 	SignalHandler sighandler;
 
-	AbstractCache *cache = NULL;
+	AbstractCache *cache = NULL, *remote = NULL;
 	try {
 		if (opts.useCache()) {
 			backend->init();
 
+			// The remote cache is consulted after the local one
+			Backend *source = backend;
+			if (!opts.remoteCache().empty()) {
+				remote = new RemoteCache(backend, opts);
+				source = remote;
+			}
+
 #ifdef USE_LDBCACHE
-			cache = new LdbCache(backend, opts);
+			cache = new LdbCache(source, opts);
 #else
-			cache = new Cache(backend, opts);
+			cache = new Cache(source, opts);
 #endif
 			sighandler.cache = cache;
 
@@ -199,24 +281,147 @@ int start(const Options &opts)
 	sys::sigblock::block(2, signums, &sighandler);
 	sys::sigblock::ignore(SIGPIPE);
 
-	int ret;
+	int ret = EXIT_SUCCESS;
 	try {
-		Report r(opts.report(), (cache ? cache : backend));
-		ret = r.run();
+		std::vector<std::string> bundles = opts.importCaches();
+		for (size_t i = 0; i < bundles.size(); i++) {
+			size_t n = cache->importBundle(bundles[i]);
+			Logger::info() << "Imported " << n << " new revisions from " << bundles[i] << endl;
+		}
+		if (opts.warmCache()) {
+			size_t n = cache->warm();
+			Logger::status() << "Added " << n << " new revisions to the cache" << endl;
+		}
+		int k, n;
+		if (opts.exportCache().empty()) {
+			// Nothing to export
+		} else if (opts.shard(&k, &n)) {
+			cache->exportShard(opts.exportCache(), k, n);
+		} else {
+			cache->exportBundle(opts.exportCache());
+		}
 	} catch (const PepperException &ex) {
-		std::cerr << "Received exception while running report:" << std::endl;
+		std::cerr << "Error transferring cache bundle: " << ex.where() << ": " << ex.what() << std::endl;
+		ret = EXIT_FAILURE;
+	}
+
+	std::vector<std::string> reports = opts.reports();
+	if (reports.empty() || ret != EXIT_SUCCESS) {
+		// Only cache bundles have been transferred
+	} else {
+		Backend *source = (cache ? cache : backend);
+		std::unique_ptr<MemoryCache> memcache;
+		if (reports.size() > 1 || opts.options().find("reports") != opts.options().end()) {
+			memcache.reset(new MemoryCache(source, opts));
+		}
+
+		// The backend, the caches and the memory cache stay open between
+		// runs, so later runs only read the new revisions. Reports that
+		// restore checkpoints only process these, too.
+		std::unique_ptr<Watcher> watcher;
+		if (opts.watch() >= 0) {
+			watcher.reset(new Watcher(backend, opts.branch(), opts.watch()));
+		}
+		while (true) {
+			ret = runReports(opts, source, memcache.get());
+			if (!watcher) {
+				break;
+			}
+
+			// Wait for plots that are still being rendered in the background
+			Plot::wait();
+			std::cout.flush();
+			if (cache) {
+				cache->flush();
+			}
+
+			Logger::status() << "Watching for new revisions" << endl;
+			std::string head = watcher->wait();
+			Logger::status() << "Head moved to " << head << ", running reports again" << endl;
+		}
+	}
+
+	// Wait for plots that are still being rendered in the background
+	Plot::wait();
+
+	delete cache; // This will also flush the cache
+	delete remote;
+	delete backend;
+	return ret;
+}
+
+// Runs the program and reports unhandled exceptions
+static int run(const Options &opts)
+{
+	try {
+		return start(opts);
+	} catch (const PepperException &ex) {
+		std::cerr << "Received unhandled exception:" << std::endl;
 		std::cerr << "  what():  " << ex.what() << std::endl;
 		std::cerr << "  where(): " << ex.where() << std::endl;
 		std::cerr << "  trace(): " << ex.trace() << std::endl;
-		ret = EXIT_FAILURE;
 	} catch (const std::exception &ex) {
-		std::cerr << "Received exception while running report:" << std::endl;
+		std::cerr << "Received unhandled exception:" << std::endl;
 		std::cerr << "  what(): " << ex.what() << std::endl;
-		ret = EXIT_FAILURE;
 	}
+	return EXIT_FAILURE;
+}
 
-	delete cache; // This will also flush the cache
-	delete backend;
+// Runs the program for every repository listed in the batch file. The
+// remaining arguments of each line are added to the command line in front
+// of the repository.
+static int runBatch(const Options &opts, int argc, char **argv)
+{
+	std::ifstream in(opts.batchFile().c_str());
+	if (!in.good()) {
+		std::cerr << "Error: Unable to open batch file " << opts.batchFile() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::vector<std::string> > jobs;
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream iss(line);
+		std::vector<std::string> args;
+		std::string arg;
+		while (iss >> arg) {
+			args.push_back(arg);
+		}
+		if (!args.empty() && args[0][0] != '#') {
+			jobs.push_back(args);
+		}
+	}
+
+	int ret = EXIT_SUCCESS;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		std::vector<std::string> args;
+		for (int j = 0; j < argc; j++) {
+			if (strncmp(argv[j], "--batch=", 8) != 0) {
+				args.push_back(argv[j]);
+			}
+		}
+		args.insert(args.end(), jobs[i].begin() + 1, jobs[i].end());
+		args.push_back(jobs[i][0]);
+		std::vector<char *> cargs;
+		for (size_t j = 0; j < args.size(); j++) {
+			cargs.push_back((char *)args[j].c_str());
+		}
+		cargs.push_back(NULL);
+
+		Options jopts;
+		try {
+			jopts.parse(cargs.size() - 1, &cargs[0]);
+		} catch (const std::exception &ex) {
+			std::cerr << "Error parsing arguments for " << jobs[i][0] << ": " << ex.what() << std::endl;
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		Logger::status() << "Processing " << jopts.repository() << " (" << (i+1) << " of " << jobs.size() << ")" << endl;
+		if (run(jopts) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
+	}
 	return ret;
 }
 
@@ -238,6 +443,13 @@ int main(int argc, char **argv)
 	}
 #endif
 
+	// Use a large buffer for report output unless it is shown on a terminal,
+	// so it is only written when the buffer is full and at exit
+	static char outbuf[256 * 1024];
+	if (!sys::io::isterm(stdout)) {
+		setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+	}
+
 	Options opts;
 	try {
 		opts.parse(argc, argv);
@@ -247,22 +459,78 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	// Let a daemon run the reports
+	if (!opts.connectSocket().empty()) {
+		return Daemon::request(opts.connectSocket(), argc, argv);
+	}
+
 	std::vector<std::ofstream *> streams;
 	setupLogger(&streams, opts);
 
-	int ret;
 	try {
-		ret = start(opts);
-	} catch (const PepperException &ex) {
-		std::cerr << "Received unhandled exception:" << std::endl;
-		std::cerr << "  what():  " << ex.what() << std::endl;
-		std::cerr << "  where(): " << ex.where() << std::endl;
-		std::cerr << "  trace(): " << ex.trace() << std::endl;
-		ret = EXIT_FAILURE;
+		sys::parallel::ThreadPool::setGlobalSize(opts.jobs());
+		DiffParser::setLimit(opts.diffLimit());
+		MemoryBudget::setLimit(opts.maxMemory());
+		if (opts.memStats() >= 0) {
+			MemStats::start(opts.memStats());
+		}
+		if (opts.watch() >= 0 && (!opts.batchFile().empty() || !opts.daemonSocket().empty())) {
+			throw PEX("--watch can't be combined with --batch or --daemon");
+		}
 	} catch (const std::exception &ex) {
-		std::cerr << "Received unhandled exception:" << std::endl;
-		std::cerr << "  what(): " << ex.what() << std::endl;
-		ret = EXIT_FAILURE;
+		std::cerr << "Error parsing arguments: " << ex.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!opts.traceFile().empty()) {
+		Tracer::start();
+	}
+	if (!opts.luaProfile().empty()) {
+		LuaProfiler::start();
+	}
+
+	int ret;
+	if (!opts.batchFile().empty() && !opts.helpRequested()) {
+		ret = runBatch(opts, argc, argv);
+	} else {
+		ret = run(opts);
+	}
+
+	if (!opts.traceFile().empty()) {
+		Tracer::stop();
+		try {
+			Tracer::save(opts.traceFile());
+		} catch (const PepperException &ex) {
+			std::cerr << "Error writing trace: " << ex.what() << std::endl;
+		}
+	}
+
+	if (opts.stats() == "true") {
+		Logger::flush();
+		Stats::print(std::cerr);
+	} else if (!opts.stats().empty()) {
+		std::ofstream out(opts.stats().c_str());
+		Stats::writeJson(out);
+		if (out.fail()) {
+			std::cerr << "Error writing statistics to " << opts.stats() << std::endl;
+		}
+	}
+
+	if (opts.luaProfile() == "true") {
+		Logger::flush();
+		LuaProfiler::print(std::cerr);
+	} else if (!opts.luaProfile().empty()) {
+		try {
+			LuaProfiler::save(opts.luaProfile());
+		} catch (const PepperException &ex) {
+			std::cerr << "Error writing Lua profile: " << ex.what() << std::endl;
+		}
+	}
+
+	if (opts.memStats() >= 0) {
+		MemStats::stop();
+		Logger::flush();
+		MemStats::print(std::cerr);
 	}
 
 	Logger::flush();
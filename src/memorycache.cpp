@@ -0,0 +1,109 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: memorycache.cpp
+ * In-memory revision cache
+ */
+
+
+#include "main.h"
+
+#include "logger.h"
+#include "revision.h"
+
+#include "memorycache.h"
+
+
+// Constructor
+MemoryCache::MemoryCache(Backend *backend, const Options &options)
+	: AbstractCache(backend, options)
+{
+	// All revisions are kept in memory anyway
+	setMemoryLimit(0);
+}
+
+// Destructor
+MemoryCache::~MemoryCache()
+{
+	flush();
+	for (std::unordered_map<std::string, Revision *>::iterator it = m_revisions.begin(); it != m_revisions.end(); ++it) {
+		delete it->second;
+	}
+}
+
+// Waits for pending revisions. There's nothing to write.
+void MemoryCache::flush()
+{
+	PDEBUG << "Memory cache holds " << m_revisions.size() << " revisions" << endl;
+	sync();
+}
+
+// Checks the wrapped cache, if any
+void MemoryCache::check(bool force)
+{
+	AbstractCache *cache = dynamic_cast<AbstractCache *>(m_backend);
+	if (cache == NULL) {
+		throw PEX("No persistent cache found");
+	}
+	cache->check(force);
+}
+
+// Compacts the wrapped cache, if any
+void MemoryCache::compact()
+{
+	AbstractCache *cache = dynamic_cast<AbstractCache *>(m_backend);
+	if (cache == NULL) {
+		throw PEX("No persistent cache found");
+	}
+	cache->compact();
+}
+
+// Returns the number of cached revisions
+size_t MemoryCache::size() const
+{
+	return m_revisions.size();
+}
+
+// Checks if the diffstat of the given revision is already cached
+bool MemoryCache::lookup(const std::string &id)
+{
+	return (m_revisions.find(id) != m_revisions.end());
+}
+
+// Adds the revision to the cache
+void MemoryCache::put(const std::string &id, const Revision &rev)
+{
+	std::unordered_map<std::string, Revision *>::iterator it = m_revisions.find(id);
+	if (it != m_revisions.end()) {
+		delete it->second;
+	}
+	m_revisions[id] = new Revision(rev.m_id, rev.m_date, rev.m_author, rev.m_message, rev.m_diffstat);
+}
+
+// Returns a copy of a cached revision, which the report may modify. The
+// immutable diffstat is only shared if requested.
+Revision *MemoryCache::get(const std::string &id, int parts)
+{
+	const Revision *rev = m_revisions.find(id)->second;
+	DiffstatPtr stat;
+	if (parts & Revision::DiffstatPart) {
+		stat = rev->m_diffstat;
+	}
+	return new Revision(rev->m_id, rev->m_date, rev->m_author, rev->m_message, stat);
+}
+
+// Returns the IDs of all cached revisions
+std::vector<std::string> MemoryCache::ids()
+{
+	std::vector<std::string> ids;
+	ids.reserve(m_revisions.size());
+	for (std::unordered_map<std::string, Revision *>::const_iterator it = m_revisions.begin(); it != m_revisions.end(); ++it) {
+		ids.push_back(it->first);
+	}
+	return ids;
+}
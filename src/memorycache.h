@@ -0,0 +1,52 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: memorycache.h
+ * In-memory revision cache (interface)
+ */
+
+
+#ifndef MEMORYCACHE_H_
+#define MEMORYCACHE_H_
+
+
+#include <unordered_map>
+
+#include "abstractcache.h"
+
+
+/*
+ * Keeps all fetched revisions in memory, so they are only read and decoded
+ * once if several reports are run in a single process. The wrapped backend
+ * is usually a persistent cache.
+ */
+class MemoryCache : public AbstractCache
+{
+	public:
+		MemoryCache(Backend *backend, const Options &options);
+		~MemoryCache();
+
+		void flush();
+		void check(bool force = false);
+		void compact();
+
+		size_t size() const;
+
+	protected:
+		bool lookup(const std::string &id);
+		void put(const std::string &id, const Revision &rev);
+		Revision *get(const std::string &id, int parts);
+
+		std::vector<std::string> ids();
+
+	PEPPER_PVARS:
+		std::unordered_map<std::string, Revision *> m_revisions;
+};
+
+
+#endif // MEMORYCACHE_H_
@@ -0,0 +1,201 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: memstats.cpp
+ * Per-subsystem memory accounting
+ */
+
+
+#include "main.h"
+
+#include <cstdlib>
+
+#include "strlib.h"
+
+#include "syslib/parallel.h"
+
+#include "memstats.h"
+
+
+namespace
+{
+
+const char *subsystemNames[] = {
+	"Cache index",
+	"Queues",
+	"Diffstats",
+	"Lua",
+	"LevelDB"
+};
+
+// Formats a number of bytes
+std::string size(int64_t bytes)
+{
+	if (bytes < 10240 && bytes > -10240) {
+		return str::itos(bytes) + " B";
+	} else if (bytes < 10485760 && bytes > -10485760) {
+		return str::itos(bytes / 1024) + " kB";
+	}
+	return str::printf("%.1f MB", bytes / 1048576.0);
+}
+
+// Periodically prints the current usage to stderr
+class Reporter : public sys::parallel::Thread
+{
+	public:
+		Reporter(int interval) : m_interval(interval), m_stopped(false) { }
+
+		void stop() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			m_stopped = true;
+			m_cond.wakeAll();
+		}
+
+	protected:
+		void run() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			while (!m_stopped) {
+				m_cond.wait(&m_mutex, m_interval * 1000);
+				if (m_stopped) {
+					break;
+				}
+				std::string line = "Memory:";
+				for (int i = 0; i < MemStats::NumSubsystems; i++) {
+					MemStats::Subsystem s = MemStats::Subsystem(i);
+					line += str::printf(" %s %s (peak %s)%s", subsystemNames[i], size(MemStats::current(s)).c_str(),
+						size(MemStats::peak(s)).c_str(), (i < MemStats::NumSubsystems - 1 ? "," : ""));
+				}
+				std::cerr << line << std::endl;
+			}
+		}
+
+	private:
+		int m_interval; // Seconds
+		bool m_stopped;
+		sys::parallel::Mutex m_mutex;
+		sys::parallel::WaitCondition m_cond;
+};
+
+Reporter *reporter = NULL;
+
+} // anonymous namespace
+
+
+// Static variables
+std::atomic<bool> MemStats::s_enabled(false);
+std::atomic<int64_t> MemStats::s_current[MemStats::NumSubsystems];
+std::atomic<int64_t> MemStats::s_peak[MemStats::NumSubsystems];
+
+
+// Constructor
+MemStats::Gauge::Gauge(Subsystem subsystem)
+	: m_subsystem(subsystem), m_bytes(0)
+{
+}
+
+// Destructor
+MemStats::Gauge::~Gauge()
+{
+	int64_t bytes = m_bytes.exchange(0);
+	if (bytes != 0) {
+		update(m_subsystem, -bytes);
+	}
+}
+
+// Sets the size of the object. Nothing is recorded while accounting is
+// disabled.
+void MemStats::Gauge::set(int64_t bytes)
+{
+	if (!enabled()) {
+		return;
+	}
+	int64_t previous = m_bytes.exchange(bytes);
+	if (previous != bytes) {
+		update(m_subsystem, bytes - previous);
+	}
+}
+
+// Enables accounting. The current usage is printed to stderr every
+// interval seconds if the interval is positive.
+void MemStats::start(int interval)
+{
+	s_enabled = true;
+	if (interval > 0 && reporter == NULL) {
+		reporter = new Reporter(interval);
+		reporter->start();
+	}
+}
+
+// Stops the periodic output
+void MemStats::stop()
+{
+	if (reporter != NULL) {
+		reporter->stop();
+		reporter->wait();
+		delete reporter;
+		reporter = NULL;
+	}
+}
+
+// Returns the number of bytes currently used by a subsystem
+int64_t MemStats::current(Subsystem subsystem)
+{
+	return s_current[subsystem].load();
+}
+
+// Returns the maximum number of bytes used by a subsystem
+int64_t MemStats::peak(Subsystem subsystem)
+{
+	return s_peak[subsystem].load();
+}
+
+// Resets the peaks to the current usage
+void MemStats::reset()
+{
+	for (int i = 0; i < NumSubsystems; i++) {
+		s_peak[i] = s_current[i].load();
+	}
+}
+
+// Prints the current and peak usage of all subsystems
+void MemStats::print(std::ostream &out)
+{
+	out << "Memory usage:" << std::endl;
+	out << str::printf("  %-20s %10s %10s", "", "current", "peak") << std::endl;
+	for (int i = 0; i < NumSubsystems; i++) {
+		Subsystem s = Subsystem(i);
+		out << str::printf("  %-20s %10s %10s", (std::string(subsystemNames[i]) + ":").c_str(), size(current(s)).c_str(),
+			size(peak(s)).c_str()) << std::endl;
+	}
+}
+
+// Allocator for Lua states, charging their memory to the Lua subsystem
+void *MemStats::luaAlloc(void *, void *ptr, size_t osize, size_t nsize)
+{
+	// Lua passes the type of the object instead of the old size for new
+	// blocks, so osize only counts if there's a block
+	int64_t delta = int64_t(nsize) - (ptr != NULL ? int64_t(osize) : 0);
+	if (nsize == 0) {
+		free(ptr);
+		add(Lua, delta);
+		return NULL;
+	}
+	void *block = realloc(ptr, nsize);
+	if (block != NULL) {
+		add(Lua, delta);
+	}
+	return block;
+}
+
+// Adds to the current usage of a subsystem, raising its peak if necessary
+void MemStats::update(Subsystem subsystem, int64_t bytes)
+{
+	int64_t value = s_current[subsystem].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	int64_t peak = s_peak[subsystem].load(std::memory_order_relaxed);
+	while (peak < value && !s_peak[subsystem].compare_exchange_weak(peak, value, std::memory_order_relaxed)) ;
+}
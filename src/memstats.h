@@ -0,0 +1,126 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: memstats.h
+ * Per-subsystem memory accounting (interface)
+ */
+
+
+#ifndef MEMSTATS_H_
+#define MEMSTATS_H_
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+
+
+/*
+ * Current and peak number of bytes used by the subsystems that may hold
+ * large amounts of memory. Accounting is disabled by default and enabled
+ * once at startup, so the hooks only cost a relaxed load otherwise. The
+ * numbers are estimates of the payload sizes, excluding the overhead of
+ * the general-purpose allocator.
+ */
+class MemStats
+{
+	public:
+		enum Subsystem {
+			CacheIndex,        // Mapped index file, journal and new entries of the revision cache
+			Queues,            // Prefetched results waiting for the consumer
+			Diffstats,         // File statistics of diffstats
+			Lua,               // Lua states of report scripts
+			LevelDB,           // Memtables and block cache of the LevelDB cache
+			NumSubsystems
+		};
+
+		// Tracks the size of a single object, e.g. a cache. Setting a new
+		// size adds the difference to the subsystem.
+		class Gauge
+		{
+			public:
+				Gauge(Subsystem subsystem);
+				~Gauge();
+
+				void set(int64_t bytes);
+
+			private:
+				Gauge(const Gauge &);
+				Gauge &operator=(const Gauge &);
+
+				Subsystem m_subsystem;
+				std::atomic<int64_t> m_bytes;
+		};
+
+	public:
+		static void start(int interval = 0);
+		static void stop();
+		static inline bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+		static inline void add(Subsystem subsystem, int64_t bytes) {
+			if (enabled()) {
+				update(subsystem, bytes);
+			}
+		}
+
+		static int64_t current(Subsystem subsystem);
+		static int64_t peak(Subsystem subsystem);
+		static void reset();
+
+		static void print(std::ostream &out);
+
+		static void *luaAlloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+	private:
+		static void update(Subsystem subsystem, int64_t bytes);
+
+	private:
+		static std::atomic<bool> s_enabled;
+		static std::atomic<int64_t> s_current[NumSubsystems];
+		static std::atomic<int64_t> s_peak[NumSubsystems];
+};
+
+
+/*
+ * Standard allocator charging its memory to a subsystem, e.g. for the
+ * containers of frequently created objects
+ */
+template <typename T, MemStats::Subsystem S>
+class CountingAllocator
+{
+	public:
+		typedef T value_type;
+
+		template <typename U>
+		struct rebind { typedef CountingAllocator<U, S> other; };
+
+	public:
+		CountingAllocator() { }
+		template <typename U>
+		CountingAllocator(const CountingAllocator<U, S> &) { }
+
+		inline T *allocate(size_t n) {
+			T *ptr = std::allocator<T>().allocate(n);
+			MemStats::add(S, n * sizeof(T));
+			return ptr;
+		}
+		inline void deallocate(T *ptr, size_t n) {
+			MemStats::add(S, -int64_t(n * sizeof(T)));
+			std::allocator<T>().deallocate(ptr, n);
+		}
+};
+
+template <typename T, typename U, MemStats::Subsystem S>
+inline bool operator==(const CountingAllocator<T, S> &, const CountingAllocator<U, S> &) { return true; }
+template <typename T, typename U, MemStats::Subsystem S>
+inline bool operator!=(const CountingAllocator<T, S> &, const CountingAllocator<U, S> &) { return false; }
+
+
+#endif // MEMSTATS_H_
@@ -62,6 +62,168 @@ bool Options::reportListRequested() const
 	return (value("list_reports") == "true");
 }
 
+// Returns the number of worker threads for parallel processing, or 0 for
+// using all processors
+int Options::jobs() const
+{
+	int n;
+	if (!str::stoi(value("jobs", "0"), &n, 10) || n < 0) {
+		throw PEX(str::printf("Expected number for --jobs parameter: %s", value("jobs").c_str()));
+	}
+	return n;
+}
+
+// Returns the maximum number of revisions that are prefetched ahead of the
+// revision iterator, or 0 for prefetching all revisions from the log
+int Options::prefetchWindow() const
+{
+	int n;
+	if (!str::stoi(value("prefetch_window", "16384"), &n, 10) || n < 0) {
+		throw PEX(str::printf("Expected number for --prefetch-window parameter: %s", value("prefetch_window").c_str()));
+	}
+	return n;
+}
+
+// Returns the maximum number of bytes of prefetched revision data, or 0
+// for no limit. The value may have a K, M or G suffix.
+uint64_t Options::maxMemory() const
+{
+	std::string str = value("max_memory", "0");
+	uint64_t n, unit = 1;
+	if (!str.empty()) {
+		switch (str[str.length()-1]) {
+			case 'k': case 'K': unit = 1024; break;
+			case 'm': case 'M': unit = 1024 * 1024; break;
+			case 'g': case 'G': unit = 1024 * 1024 * 1024; break;
+			default: break;
+		}
+	}
+	if (unit > 1) {
+		str.erase(str.length()-1);
+	}
+	if (!str::stoi(str, &n, 10)) {
+		throw PEX(str::printf("Expected size for --max-memory parameter: %s", value("max_memory").c_str()));
+	}
+	return n * unit;
+}
+
+// Returns the file that a timeline trace should be written to, if any
+std::string Options::traceFile() const
+{
+	return value("trace");
+}
+
+// Returns "true" if runtime statistics should be printed, or the file that
+// they should be written to in JSON format
+std::string Options::stats() const
+{
+	return value("stats");
+}
+
+// Returns "true" if a profile of the report scripts should be printed, or
+// the file that the collapsed stacks should be written to
+std::string Options::luaProfile() const
+{
+	return value("profile_lua");
+}
+
+// Returns the interval in seconds at which memory usage should be printed,
+// 0 for printing it at exit only or -1 if it shouldn't be tracked
+int Options::memStats() const
+{
+	std::string interval = value("memstats");
+	if (interval.empty()) {
+		return -1;
+	} else if (interval == "true") {
+		return 0;
+	}
+	int n;
+	if (!str::stoi(interval, &n, 10) || n <= 0) {
+		throw PEX(str::printf("Expected number of seconds for --memstats parameter: %s", interval.c_str()));
+	}
+	return n;
+}
+
+// Returns the name of the renderer for graphical reports
+std::string Options::plotter() const
+{
+#ifdef USE_GNUPLOT
+	std::string name = value("plotter", "gnuplot");
+#else
+	std::string name = value("plotter", "native");
+#endif
+	if (name == "native") {
+		return name;
+	} else if (name == "gnuplot") {
+#ifndef USE_GNUPLOT
+		throw PEX("Built without Gnuplot support, use --plotter=native");
+#endif
+		return name;
+	}
+	throw PEX(str::printf("Unknown plotter: %s", name.c_str()));
+}
+
+// Returns the path of the socket that a daemon should listen on, if any
+std::string Options::daemonSocket() const
+{
+	return value("daemon");
+}
+
+// Returns the path of the socket of a daemon that should run the reports
+std::string Options::connectSocket() const
+{
+	return value("connect");
+}
+
+// Returns the file listing the repositories of a batch run, if any
+std::string Options::batchFile() const
+{
+	return value("batch");
+}
+
+// Returns whether diffstats should only count lines, omitting byte counts
+bool Options::linesOnly() const
+{
+	std::string mode = value("diffstat", "full");
+	if (mode == "lines") {
+		return true;
+	} else if (mode != "full" && mode != "approx") {
+		throw PEX(str::printf("Unknown diffstat mode: %s", mode.c_str()));
+	}
+	return false;
+}
+
+// Returns whether diffstats may be estimated from deltas instead of being
+// counted from complete diffs
+bool Options::approximateDiffstats() const
+{
+	return (!linesOnly() && value("diffstat") == "approx");
+}
+
+// Returns the maximum number of changed lines of files in diffstats, or 0
+// if there's no limit
+int Options::diffLimit() const
+{
+	int n;
+	if (!str::stoi(value("diff_limit", "0"), &n, 10) || n < 0) {
+		throw PEX(str::printf("Expected number for --diff-limit parameter: %s", value("diff_limit").c_str()));
+	}
+	return n;
+}
+
+// Returns the patterns of paths that should be excluded from diffstats
+std::vector<std::string> Options::excludes() const
+{
+	std::vector<std::string> patterns;
+	std::vector<std::string> parts = str::split(value("exclude"), ",");
+	for (size_t i = 0; i < parts.size(); i++) {
+		if (!parts[i].empty()) {
+			patterns.push_back(parts[i]);
+		}
+	}
+	return patterns;
+}
+
 bool Options::useCache() const
 {
 	return (value("cache") == "true");
@@ -72,6 +234,132 @@ std::string Options::cacheDir() const
 	return value("cache_dir");
 }
 
+// Returns the URL of the remote cache server, if any
+std::string Options::remoteCache() const
+{
+	return value("remote_cache");
+}
+
+// Returns the name of the compression codec for new cache records. Zlib
+// is the default, as caches have always been compressed with it.
+std::string Options::cacheCodec() const
+{
+#if defined(HAVE_LIBZ)
+	return value("cache_codec", "zlib");
+#elif defined(HAVE_ZSTD)
+	return value("cache_codec", "zstd");
+#elif defined(HAVE_LZ4)
+	return value("cache_codec", "lz4");
+#else
+	return value("cache_codec", "none");
+#endif
+}
+
+// Returns the memory for caching blocks of the LevelDB revision cache in MB
+int Options::cacheMemory() const
+{
+	int mb;
+	if (!str::stoi(value("cache_memory", "32"), &mb, 10) || mb < 0) {
+		throw PEX(str::printf("Invalid cache memory size: %s", value("cache_memory").c_str()));
+	}
+	return mb;
+}
+
+// Returns the memory for keeping decoded revisions of the revision cache in MB
+int Options::revisionMemory() const
+{
+	int mb;
+	if (!str::stoi(value("revision_memory", "16"), &mb, 10) || mb < 0) {
+		throw PEX(str::printf("Invalid revision memory size: %s", value("revision_memory").c_str()));
+	}
+	return mb;
+}
+
+// Returns the file that the revision cache should be exported to, if any
+std::string Options::exportCache() const
+{
+	return value("export_cache");
+}
+
+// Returns the file that should be imported into the revision cache, if any
+std::string Options::importCache() const
+{
+	return value("import_cache");
+}
+
+// Returns the files that should be imported into the revision cache
+std::vector<std::string> Options::importCaches() const
+{
+	std::vector<std::string> files;
+	std::vector<std::string> parts = str::split(value("import_cache"), ",");
+	for (size_t i = 0; i < parts.size(); i++) {
+		if (!parts[i].empty()) {
+			files.push_back(parts[i]);
+		}
+	}
+	return files;
+}
+
+// Parses the range of revisions that --export-cache should write, given
+// as "K/N" for the K-th of N parts of the history. Returns false if the
+// whole cache should be exported.
+bool Options::shard(int *k, int *n) const
+{
+	std::string str = value("shard");
+	if (str.empty()) {
+		return false;
+	}
+	std::vector<std::string> parts = str::split(str, "/");
+	if (parts.size() != 2 || !str::stoi(parts[0], k, 10) || !str::stoi(parts[1], n, 10) || *n < 1 || *k < 1 || *k > *n) {
+		throw PEX(str::printf("Invalid shard: %s", str.c_str()));
+	}
+	return true;
+}
+
+// Returns whether missing revisions should be added to the revision cache
+// without running a report
+bool Options::warmCache() const
+{
+	return (value("warm_cache") == "true");
+}
+
+// Returns whether report results should be memoized
+bool Options::memoize() const
+{
+	return (value("memoize") == "true");
+}
+
+// Returns the branch given as a main option, which selects the history
+// for --warm-cache and --shard and the branch watched by --watch
+std::string Options::branch() const
+{
+	return value("branch");
+}
+
+// Returns the interval in seconds at which the repository should be checked
+// for new revisions, or -1 if the reports should only be run once
+int Options::watch() const
+{
+	std::string interval = value("watch");
+	if (interval.empty()) {
+		return -1;
+	} else if (interval == "true") {
+		return 60;
+	}
+	int n;
+	if (!str::stoi(interval, &n, 10) || n <= 0) {
+		throw PEX(str::printf("Expected number of seconds for --watch parameter: %s", interval.c_str()));
+	}
+	return n;
+}
+
+// Returns the user-defined name of the cache directory for the repository.
+// If empty, the backend's repository UUID will be used.
+std::string Options::cacheId() const
+{
+	return value("cache_id");
+}
+
 std::string Options::forcedBackend() const
 {
 	return value("backend");
@@ -101,11 +389,54 @@ std::string Options::report() const
 	return value("report");
 }
 
+// Returns the list of reports that should be run. This is either the
+// single report given on the command line or the list given by --reports.
+std::vector<std::string> Options::reports() const
+{
+	std::vector<std::string> reports;
+	if (m_options.find("reports") != m_options.end()) {
+		std::vector<std::string> names = str::split(value("reports"), ",");
+		for (size_t i = 0; i < names.size(); i++) {
+			if (!names[i].empty()) {
+				reports.push_back(names[i]);
+			}
+		}
+	} else if (!report().empty()) {
+		reports.push_back(report());
+	}
+	return reports;
+}
+
 std::map<std::string, std::string> Options::reportOptions() const
 {
 	return m_reportOptions;
 }
 
+// Returns the options for a single report of a --reports run. Options
+// prefixed with the report name and a period (e.g., "--loc.output=loc.svg")
+// override common options, and options for other reports are dropped.
+std::map<std::string, std::string> Options::reportOptions(const std::string &report) const
+{
+	std::string name = sys::fs::basename(report);
+	if (name.length() > 4 && name.compare(name.length()-4, 4, ".lua") == 0) {
+		name = name.substr(0, name.length()-4);
+	}
+
+	std::map<std::string, std::string> options;
+	std::map<std::string, std::string>::const_iterator it;
+	for (it = m_reportOptions.begin(); it != m_reportOptions.end(); ++it) {
+		if (it->first.find('.') == std::string::npos) {
+			options[it->first] = it->second;
+		}
+	}
+	for (it = m_reportOptions.begin(); it != m_reportOptions.end(); ++it) {
+		if (it->first.length() > name.length()+1 && !it->first.compare(0, name.length(), name) && it->first[name.length()] == '.') {
+			options[it->first.substr(name.length()+1)] = it->second;
+		}
+	}
+	return options;
+}
+
 
 // Pretty-prints a help screen option
 void Options::print(const std::string &option, const std::string &text, std::ostream &out)
@@ -155,7 +486,36 @@ void Options::printHelp(std::ostream &out)
 	print("-v, --verbose", "Increase verbosity", out);
 	print("-q, --quiet", "Set verbosity to minimum", out);
 	print("-bARG, --backend=ARG", "Force usage of backend named ARG", out);
+	print("-jN, --jobs=N", "Use N worker threads for parallel processing (default: number of processors)", out);
+	print("--prefetch-window=N", "Let the backend prefetch at most N revisions ahead of the report, 0 for all (default: 16384)", out);
+	print("--max-memory=SIZE", "Limit the memory used by prefetched revisions to SIZE bytes, e.g. 2G (default: no limit)", out);
+	print("--trace=FILE", "Write a timeline of the program run to FILE in the Chrome trace format", out);
+	print("--stats[=FILE]", "Print runtime statistics at exit, or write them to FILE in JSON format", out);
+	print("--profile-lua[=FILE]", "Print the functions of report scripts using the most CPU time at exit, or write collapsed stacks for flame graphs to FILE", out);
+	print("--memstats[=SECONDS]", "Print the current and peak memory usage of caches, queues, diffstats and Lua at exit, and every SECONDS seconds", out);
+	print("--plotter=NAME", "Render graphical reports using NAME (gnuplot or native)", out);
+	print("--batch=FILE", "Run the reports for each repository listed in FILE, one after another in a single process", out);
+	print("--daemon=SOCKET", "Keep backends and caches open and run reports requested on the UNIX socket SOCKET", out);
+	print("--connect=SOCKET", "Let the daemon listening on SOCKET run the reports", out);
+	print("--diffstat=MODE", "Count changed lines and bytes (full), only lines (lines) or estimate them from deltas (approx), which may be faster (default: full)", out);
+	print("--diff-limit=N", "Skip files with more than N changed lines in a revision, like binary files", out);
+	print("--exclude=LIST", "Exclude files matching the comma-separated list of glob patterns from diffstats, e.g. --exclude=vendor,*.lock", out);
 	print("--no-cache", "Disable revision cache usage", out);
+	print("--cache-id=ID", "Use the revision cache named ID, e.g. for sharing it between clones of a repository", out);
+	print("--remote-cache=URL", "Use the HTTP server at URL as a second-level revision cache", out);
+	print("--cache-codec=NAME", "Compress new revision cache records with the codec NAME (none, zlib, lz4 or zstd, default: zlib)", out);
+#ifdef USE_LDBCACHE
+	print("--cache-memory=MB", "Use up to MB megabytes of memory for caching revision cache blocks (default: 32)", out);
+#endif
+	print("--revision-memory=MB", "Keep up to MB megabytes of recently used revisions in memory (default: 16)", out);
+	print("--export-cache=FILE", "Write all cached revisions of the repository to FILE", out);
+	print("--import-cache=FILES", "Add the revisions in the comma-separated list of FILES, written by --export-cache, to the revision cache", out);
+	print("--warm-cache", "Add all revisions that are not cached yet to the revision cache without running a report", out);
+	print("--branch=NAME", "Select the branch NAME for --warm-cache, --shard and --watch instead of the main branch", out);
+	print("--shard=K/N", "Let --export-cache write the K-th of N ranges of the history, retrieving missing revisions from the repository", out);
+	print("--memoize", "Reuse the output of a previous run of the report with the same options if the branch head hasn't changed", out);
+	print("--watch[=SECONDS]", "Keep the repository open and run the reports again whenever the branch head changes, checking at least every SECONDS seconds (default: 60)", out);
+	print("--reports=LIST", "Run the comma-separated list of reports, reading the history only once. Options prefixed with a report name and a period only apply to that report, e.g. --loc.output=loc.svg", out);
 	out << std::endl;
 	print("--list-reports", "List report scrtips in search paths", out);
 	print("--list-backends", "List available backends", out);
@@ -183,6 +543,12 @@ void Options::reset()
 		m_options["cache_dir"] = str::printf("%s/.%s/cache", getenv("HOME"), PACKAGE_NAME, "cache");
 	}
 	PDEBUG << "Default cache dir set to " << m_options["cache_dir"] << endl;
+	if (char *cacheid = getenv("PEPPER_CACHEID")) {
+		m_options["cache_id"] = std::string(cacheid);
+	}
+	if (char *remote = getenv("PEPPER_REMOTE_CACHE")) {
+		m_options["remote_cache"] = std::string(remote);
+	}
 }
 
 // The actual parsing
@@ -196,6 +562,12 @@ void Options::parse(const std::vector<std::string> &args)
 		{"--help", "help", "true"},
 		{"--version", "version", "true"},
 		{"--no-cache", "cache", "false"},
+		{"--stats", "stats", "true"},
+		{"--profile-lua", "profile_lua", "true"},
+		{"--memstats", "memstats", "true"},
+		{"--warm-cache", "warm_cache", "true"},
+		{"--memoize", "memoize", "true"},
+		{"--watch", "watch", "true"},
 		{"--list-backends", "list_backends", "true"},
 		{"--list-reports", "list_reports", "true"}
 	};
@@ -229,8 +601,34 @@ void Options::parse(const std::vector<std::string> &args)
 			} else if (parseOpt(args[i], &key, &value)) {
 				if (key == "b") {
 					key = "backend";
+				} else if (key == "j") {
+					key = "jobs";
+				} else if (key == "profile-lua") {
+					key = "profile_lua";
+				} else if (key == "prefetch-window") {
+					key = "prefetch_window";
+				} else if (key == "cache-id") {
+					key = "cache_id";
+				} else if (key == "remote-cache") {
+					key = "remote_cache";
+				} else if (key == "cache-codec") {
+					key = "cache_codec";
+				} else if (key == "cache-memory") {
+					key = "cache_memory";
+				} else if (key == "revision-memory") {
+					key = "revision_memory";
+				} else if (key == "export-cache") {
+					key = "export_cache";
+				} else if (key == "import-cache") {
+					key = "import_cache";
 				}
 				m_options[key] = value;
+
+				// Report options follow the list of reports
+				if (key == "reports") {
+					++i;
+					break;
+				}
 			} else {
 				m_options["report"] = args[i];
 				++i;
@@ -261,12 +659,21 @@ void Options::parse(const std::vector<std::string> &args)
 		++i;
 	}
 
-	// Repository URL
+	// Repository URL. Cache bundles may be transferred without running a
+	// report, in which case the only positional argument is the repository.
+	std::string url;
 	if (i < args.size()) {
+		url = args[i];
+	} else if ((m_options.find("export_cache") != m_options.end() || m_options.find("import_cache") != m_options.end() || m_options.find("warm_cache") != m_options.end())
+			&& m_options.find("reports") == m_options.end() && m_options.find("report") != m_options.end()) {
+		url = m_options["report"];
+		m_options.erase("report");
+	}
+	if (!url.empty()) {
 		try {
-			m_options["repository"] = sys::fs::makeAbsolute(args[i]);
+			m_options["repository"] = sys::fs::makeAbsolute(url);
 		} catch (...) {
-			m_options["repository"] = args[i];
+			m_options["repository"] = url;
 		}
 	}
 
@@ -35,8 +35,37 @@ class Options
 		bool backendListRequested() const;
 		bool reportListRequested() const;
 
+		int jobs() const;
+		int prefetchWindow() const;
+		uint64_t maxMemory() const;
+		std::string traceFile() const;
+		std::string stats() const;
+		std::string luaProfile() const;
+		int memStats() const;
+		std::string plotter() const;
+		std::string daemonSocket() const;
+		std::string connectSocket() const;
+		std::string batchFile() const;
+		bool linesOnly() const;
+		bool approximateDiffstats() const;
+		int diffLimit() const;
+		std::vector<std::string> excludes() const;
+
 		bool useCache() const;
 		std::string cacheDir() const;
+		std::string cacheId() const;
+		std::string remoteCache() const;
+		std::string cacheCodec() const;
+		int cacheMemory() const;
+		int revisionMemory() const;
+		std::string exportCache() const;
+		std::string importCache() const;
+		std::vector<std::string> importCaches() const;
+		bool shard(int *k, int *n) const;
+		bool warmCache() const;
+		bool memoize() const;
+		std::string branch() const;
+		int watch() const;
 
 		std::string forcedBackend() const;
 		std::string repository() const;
@@ -44,7 +73,9 @@ class Options
 		std::map<std::string, std::string> options() const;
 
 		std::string report() const;
+		std::vector<std::string> reports() const;
 		std::map<std::string, std::string> reportOptions() const;
+		std::map<std::string, std::string> reportOptions(const std::string &report) const;
 
 		static void print(const std::string &option, const std::string &text, std::ostream &out = std::cout);
 		static void printHelp(std::ostream &out = std::cout);
@@ -7,7 +7,7 @@
  * terms and conditions, or see http://www.gnu.org/licenses/.
  *
  * file: plot.cpp
- * Lua plotting interface using gnuplot
+ * Lua plotting interface using gnuplot or the native renderer
  */
 
 
@@ -17,12 +17,19 @@
 #include <cstring>
 #include <fstream>
 
-#include "gnuplot.h"
+#include "backend.h"
+#include "chart.h"
+#ifdef USE_GNUPLOT
+ #include "gnuplot.h"
+#endif
 #include "logger.h"
 #include "luahelpers.h"
 #include "options.h"
 #include "report.h"
+#include "repository.h"
 #include "strlib.h"
+#include "tracer.h"
+#include "utils.h"
 
 #include "syslib/io.h"
 #include "syslib/fs.h"
@@ -67,6 +74,20 @@ Plot::Plot(lua_State *L)
 {
 	m_standardTerminal = "svg";
 	m_args = gp_args;
+	m_width = 640;
+	m_timeData = false;
+	g = NULL;
+	m_chart = NULL;
+
+	try {
+		if (Report::current()->repository()->backend()->options().plotter() == "native") {
+			m_chart = new Chart(Report::current()->out());
+			return;
+		}
+	} catch (const PepperException &ex) {
+		LuaHelpers::pushError(L, ex.what(), ex.where());
+		return;
+	}
 
 #if ( defined(unix) || defined(__unix) || defined(__unix__) ) && !defined(__APPLE__)
 	if (getenv("DISPLAY") && sys::io::isterm(stdout) && !Report::current()->outputRedirected()) {
@@ -82,18 +103,22 @@ Plot::Plot(lua_State *L)
 		m_args = gp_args_persist;
 	}
 
+#ifdef USE_GNUPLOT
 	try {
 		g = new Gnuplot(m_args, Report::current()->out());
 	} catch (const PepperException &ex) {
 		LuaHelpers::pushError(L, ex.what(), ex.where());
 	}
+#endif
 }
 
 // Destructor
 Plot::~Plot()
 {
-	delete g;
-	removeTempfiles();
+#ifdef USE_GNUPLOT
+	Gnuplot::finish(g);
+#endif
+	delete m_chart;
 }
 
 // Writes a Gnuplot command
@@ -140,11 +165,13 @@ int Plot::set_output(lua_State *L)
 	}
 
 	if (!file.empty()) {
+		Report::current()->addOutputFile(file);
 		gcmd(str::printf("set output \"%s\"", file.c_str()));
 	} else {
 		gcmd(str::printf("set output"));
 	}
 	gcmd(str::printf("set terminal %s size %d,%d", terminal.c_str(), width, height));
+	m_width = width;
 	return 0;
 }
 
@@ -244,41 +271,20 @@ int Plot::plot_series(lua_State *L)
 		titles = LuaHelpers::topvs(L, index);
 	}
 
-	std::ostringstream cmd;
-	cmd << "plot ";
-	if (options.find("command") == options.end()) {
-		for (size_t i = 0; i < nseries; i++) {
-			cmd << (i == 0 ? "'-'" : "''") << " using 1:2";
-			if (titles.size() > i) {
-				cmd << " title \"" << titles[i] << "\"";
-			} else {
-				cmd << " notitle";
-			}
-			if (options.find("style") != options.end()) {
-				cmd << " with " << options["style"];
-			}
-			if (i < nseries-1) {
-				cmd << ", ";
-			}
-		}
-	} else {
-		cmd << "'-' " << options["command"];
-	}
-	PDEBUG << "Running plot with command: " << cmd.str() << endl;
-	gcmd(cmd.str());
-
-	// Write data to pipe, separately for each series
+	// Read data, separately for each series
 	--index;
-	std::ostringstream ss;
+	std::vector<Series> series(nseries);
 	for (size_t i = 0; i < nseries; i++) {
-		ss.clear(); // Reset stringstream, but keep buffer
-		ss.seekp(0);
+		Series &s = series[i];
+		s.values.reserve(2 * keys.size());
+		s.offsets.reserve(keys.size());
 
 		lua_pushvalue(L, index);
 		lua_pushnil(L);
 		int j = 0;
 		while (lua_next(L, -2) != 0) {
-			ss << keys[j++] << " ";
+			s.row();
+			s.values.push_back(keys[j++]);
 			if (lua_type(L, -1) == LUA_TTABLE) {
 				if (nseries != LuaHelpers::tablesize(L, -1)) {
 					return LuaHelpers::pushError(L, "Inconsistent number of series");
@@ -289,22 +295,52 @@ int Plot::plot_series(lua_State *L)
 				if (lua_type(L, -1) == LUA_TTABLE) {
 					lua_pushnil(L);
 					while (lua_next(L, -2) != 0) {
-						ss << LuaHelpers::popd(L) << " ";
+						s.values.push_back(LuaHelpers::popd(L));
 					}
 					lua_pop(L, 1);
 				} else {
-					ss << LuaHelpers::popd(L);
+					s.values.push_back(LuaHelpers::popd(L));
 				}
 				lua_pop(L, 1);
 			} else {
-				ss << LuaHelpers::popd(L);
+				s.values.push_back(LuaHelpers::popd(L));
 			}
-			ss << "\n";
 		}
 		lua_pop(L, 1);
+		downsample(&s, options);
+	}
 
-		ss << "e\n"; // Marks end of data
-		g->cmd(ss.str().c_str(), ss.tellp());
+	if (m_chart) {
+		return chart(L, series, titles, options);
+	}
+
+	std::string data;
+	std::ostringstream cmd;
+	cmd << "plot ";
+	if (options.find("command") == options.end()) {
+		for (size_t i = 0; i < nseries; i++) {
+			cmd << source(series[i], options, &data) << " using 1:2";
+			if (titles.size() > i) {
+				cmd << " title \"" << titles[i] << "\"";
+			} else {
+				cmd << " notitle";
+			}
+			if (options.find("style") != options.end()) {
+				cmd << " with " << options["style"];
+			}
+			if (i < nseries-1) {
+				cmd << ", ";
+			}
+		}
+	} else if (nseries > 0) {
+		cmd << source(series[0], options, &data) << " " << options["command"];
+	}
+	PDEBUG << "Running plot with command: " << cmd.str() << endl;
+	gcmd(cmd.str());
+
+	// Write inline data to pipe
+	if (!data.empty()) {
+		gdata(data);
 	}
 	return 0;
 }
@@ -339,9 +375,9 @@ int Plot::plot_multi_series(lua_State *L)
 	++index;
 	size_t nseries = LuaHelpers::tablesize(L, index);
 
-	std::ostringstream *outs = new std::ostringstream[nseries];
+	std::vector<Series> series(nseries);
 	for (size_t i = 0; i < nseries; i++) {
-		std::ostringstream &out = outs[i];
+		Series &s = series[i];
 
 		// Read keys
 		lua_rawgeti(L, index, i+1);
@@ -359,10 +395,15 @@ int Plot::plot_multi_series(lua_State *L)
 		lua_pushvalue(L, -1);
 		lua_pushnil(L);
 		size_t j = 0;
+		s.values.reserve(2 * keys.size());
+		s.offsets.reserve(keys.size());
 		while (lua_next(L, -2) != 0) {
-			out << keys[j++] << " " << LuaHelpers::popd(L) << std::endl;
+			s.row();
+			s.values.push_back(keys[j++]);
+			s.values.push_back(LuaHelpers::popd(L));
 		}
 		lua_pop(L, 2);
+		downsample(&s, options);
 
 		// Reset index back to keys
 		--index;
@@ -375,10 +416,15 @@ int Plot::plot_multi_series(lua_State *L)
 		titles = LuaHelpers::topvs(L, index);
 	}
 
+	if (m_chart) {
+		return chart(L, series, titles, options);
+	}
+
+	std::string data;
 	std::ostringstream cmd;
 	cmd << "plot ";
 	for (size_t i = 0; i < nseries; i++) {
-		cmd << "'-' using 1:2";
+		cmd << source(series[i], options, &data) << " using 1:2";
 		if (titles.size() > i) {
 			cmd << " title \"" << titles[i] << "\"";
 		} else {
@@ -394,13 +440,10 @@ int Plot::plot_multi_series(lua_State *L)
 	PDEBUG << "Running plot with command: " << cmd.str() << endl;
 	gcmd(cmd.str());
 
-	// Write data
-	for (size_t i = 0; i < nseries; i++) {
-		g->cmd(outs[i].str());
-		g->cmd("e"); // Marks end of data
+	// Write inline data to pipe
+	if (!data.empty()) {
+		gdata(data);
 	}
-
-	delete[] outs;
 	return 0;
 }
 
@@ -461,34 +504,38 @@ int Plot::plot_histogram(lua_State *L)
 
 	gcmd("set style data histogram");
 	std::ostringstream cmd;
-	cmd << "plot ";
-	for (size_t i = 0; i < nseries; i++) {
-		cmd << (i == 0 ? "'-'" : "''") << " using  2:xtic(1)";
-		if (titles.size() > i) {
-			cmd << " title \"" << titles[i] << "\"";
-		} else {
-			cmd << " notitle";
-		}
-		if (options.find("style") != options.end()) {
-			cmd << " with " << options["style"];
-		}
-		if (i < nseries-1) {
-			cmd << ", ";
+	if (!m_chart) {
+		cmd << "plot ";
+		for (size_t i = 0; i < nseries; i++) {
+			cmd << (i == 0 ? "'-'" : "''") << " using  2:xtic(1)";
+			if (titles.size() > i) {
+				cmd << " title \"" << titles[i] << "\"";
+			} else {
+				cmd << " notitle";
+			}
+			if (options.find("style") != options.end()) {
+				cmd << " with " << options["style"];
+			}
+			if (i < nseries-1) {
+				cmd << ", ";
+			}
 		}
+		PDEBUG << "Running plot with command: " << cmd.str() << endl;
+		gcmd(cmd.str());
 	}
-	PDEBUG << "Running plot with command: " << cmd.str() << endl;
-	gcmd(cmd.str());
 
-	// Write data to pipe, separately for each series
+	// Write data to pipe, separately for each series. The native renderer
+	// only uses the first value of each row, as Gnuplot does.
 	--index;
 	std::ostringstream ss;
+	std::vector<std::vector<double> > bars(nseries);
 	for (size_t i = 0; i < nseries; i++) {
 		ss.clear(); // Reset stringstream, but keep buffer
 		ss.seekp(0);
 
 		lua_pushvalue(L, index);
 		lua_pushnil(L);
-		int j = 0;
+		size_t j = 0;
 		while (lua_next(L, -2) != 0) {
 			ss << '"' << keys[j++] << "\" ";
 			if (lua_type(L, -1) == LUA_TTABLE) {
@@ -501,22 +548,41 @@ int Plot::plot_histogram(lua_State *L)
 				if (lua_type(L, -1) == LUA_TTABLE) {
 					lua_pushnil(L);
 					while (lua_next(L, -2) != 0) {
-						ss << LuaHelpers::popd(L) << " ";
+						double v = LuaHelpers::popd(L);
+						ss << v << " ";
+						if (bars[i].size() < j) {
+							bars[i].push_back(v);
+						}
 					}
 					lua_pop(L, 1);
 				} else {
-					ss << LuaHelpers::popd(L);
+					double v = LuaHelpers::popd(L);
+					ss << v;
+					bars[i].push_back(v);
 				}
 				lua_pop(L, 1);
 			} else {
-				ss << LuaHelpers::popd(L);
+				double v = LuaHelpers::popd(L);
+				ss << v;
+				bars[i].push_back(v);
 			}
 			ss << "\n";
+			bars[i].resize(j);
 		}
 		lua_pop(L, 1);
 
-		ss << "e\n"; // Marks end of data
-		g->cmd(ss.str().c_str(), ss.tellp());
+		if (!m_chart) {
+			ss << "e\n"; // Marks end of data
+			gdata(ss.str().substr(0, ss.tellp()));
+		}
+	}
+
+	if (m_chart) {
+		try {
+			m_chart->plotHistogram(keys, bars, titles);
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
 	}
 	return 0;
 }
@@ -541,6 +607,15 @@ int Plot::plot_pie(lua_State *L)
 		return LuaHelpers::pushError(L, str::printf("Argument dimensions don't match (%d != %d)", keys.size(), values.size()));
 	}
 
+	if (m_chart) {
+		try {
+			m_chart->plotPie(keys, values);
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+		return 0;
+	}
+
 	// Prepare data, i.e. accumulate values to get [from,to] intervals
 	size_t n = keys.size();
 	for (size_t i = 1; i < n; i++) {
@@ -587,50 +662,222 @@ int Plot::plot_pie(lua_State *L)
 	return 0;
 }
 
-// Closes and reopens the Gnuplot connection. This will force
-// plotting to finish and temporary files to be closed
+// Closes and reopens the Gnuplot connection. Plotting will finish in the
+// background, and temporary files will be removed afterwards.
 int Plot::flush(lua_State *L)
 {
+	PTRACE_SCOPE("gnuplot.flush");
+	if (m_chart) {
+		// Charts are complete after each plot, so just reset the settings
+		delete m_chart;
+		m_chart = new Chart(Report::current()->out());
+		return 0;
+	}
+
+#ifdef USE_GNUPLOT
 	try {
-		delete g;
+		Gnuplot::finish(g);
+		g = NULL;
 		g = new Gnuplot(m_args, Report::current()->out());
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	}
+#else
+	(void)L;
+#endif
 	return 0;
 }
 
+// Waits until all plots writing to the given stream (or all plots if no
+// stream is given) have been rendered
+void Plot::wait(std::ostream *out)
+{
+#ifdef USE_GNUPLOT
+	Gnuplot::wait(out);
+#else
+	(void)out;
+#endif
+}
+
 // Sends a command to GNUPlot (and logs it)
 void Plot::gcmd(const std::string &c)
 {
+	PTRACE_SCOPE("gnuplot.cmd");
 	PTRACE << c << endl;
-	g->cmd(c);
+	if (m_chart) {
+		m_chart->command(c);
+	} else {
+#ifdef USE_GNUPLOT
+		g->cmd(c);
+#endif
+	}
+
+	// Time values can't be sent in binary format to old Gnuplot versions
+	size_t pos = c.rfind("set xdata");
+	if (pos != std::string::npos) {
+		m_timeData = (c.compare(pos, 14, "set xdata time") == 0);
+	}
+}
+
+// Writes inline data to Gnuplot
+void Plot::gdata(const std::string &data)
+{
+#ifdef USE_GNUPLOT
+	g->cmd(data.c_str(), data.length());
+#else
+	(void)data;
+#endif
+}
+
+// Plots XY series using the native renderer. The first column of each row
+// is the key and the second one the value. A third column contains the
+// circle radius for the "circles" style.
+int Plot::chart(lua_State *L, const std::vector<Series> &series, const std::vector<std::string> &titles, const std::map<std::string, std::string> &options)
+{
+	std::map<std::string, std::string>::const_iterator it = options.find("command");
+	if (it == options.end()) {
+		it = options.find("style");
+	}
+	Chart::Style style = (it != options.end() ? Chart::parseStyle(it->second) : Chart::Lines);
+
+	std::vector<Chart::Series> cs(series.size());
+	for (size_t i = 0; i < series.size(); i++) {
+		const Series &s = series[i];
+		Chart::Series &c = cs[i];
+		if (titles.size() > i) {
+			c.title = titles[i];
+		}
+		c.style = style;
+		c.keys.reserve(s.rows());
+		c.values.reserve(s.rows());
+		for (size_t j = 0; j < s.rows(); j++) {
+			size_t n = s.end(j) - s.offsets[j];
+			if (n < 2) {
+				continue;
+			}
+			c.keys.push_back(s.values[s.offsets[j]]);
+			c.values.push_back(s.values[s.offsets[j] + 1]);
+			if (n > 2) {
+				c.sizes.push_back(s.values[s.offsets[j] + 2]);
+			}
+		}
+	}
+
+	try {
+		m_chart->plot(cs);
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return 0;
+}
+
+// Returns the number of values per row of the series, or 0 if it differs
+size_t Plot::Series::columns() const
+{
+	size_t n = (offsets.empty() ? 0 : end(0) - offsets[0]);
+	for (size_t i = 1; i < offsets.size(); i++) {
+		if (end(i) - offsets[i] != n) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+// Reduces the number of points if requested by the "downsample" option,
+// which is either the number of key intervals or "auto" for one interval
+// per pixel of the output width. Only series with a single value per row
+// are downsampled.
+void Plot::downsample(Series *series, const std::map<std::string, std::string> &options) const
+{
+	std::map<std::string, std::string>::const_iterator it = options.find("downsample");
+	if (it == options.end() || series->columns() != 2) {
+		return;
+	}
+	int buckets = 0;
+	if (it->second == "auto" || it->second == "true") {
+		buckets = m_width;
+	} else if (!str::stoi(it->second, &buckets) || buckets <= 0) {
+		return;
+	}
+
+	size_t n = series->rows();
+	std::vector<double> keys(n), values(n);
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = series->values[2*i];
+		values[i] = series->values[2*i + 1];
+	}
+	std::vector<size_t> indices = utils::downsample(keys, values, buckets);
+	if (indices.size() == n) {
+		return;
+	}
+
+	PDEBUG << "Downsampled series from " << n << " to " << indices.size() << " points" << endl;
+	Series s;
+	s.values.reserve(2 * indices.size());
+	s.offsets.reserve(indices.size());
+	for (size_t i = 0; i < indices.size(); i++) {
+		s.row();
+		s.values.push_back(keys[indices[i]]);
+		s.values.push_back(values[indices[i]]);
+	}
+	std::swap(*series, s);
+}
+
+// Returns the data source for the given series in a plot command. The data
+// is written in binary format to a temporary file if possible, or appended
+// to the inline text data otherwise.
+std::string Plot::source(const Series &series, const std::map<std::string, std::string> &options, std::string *text)
+{
+	size_t columns = series.columns();
+	std::map<std::string, std::string>::const_iterator it = options.find("binary");
+	bool binary = (it == options.end() || it->second != "false");
+	if (binary && columns > 0 && version() >= (m_timeData ? 500 : 402)) {
+		std::ofstream out;
+		std::string path = tempfile(out);
+		out.write((const char *)&series.values[0], series.values.size() * sizeof(double));
+		out.close();
+		if (!out.fail()) {
+			std::string format;
+			for (size_t i = 0; i < columns; i++) {
+				format += "%float64";
+			}
+			return str::printf("'%s' binary record=%d format=\"%s\"", path.c_str(), int(series.rows()), format.c_str());
+		}
+	}
+
+	char buffer[32];
+	for (size_t i = 0; i < series.rows(); i++) {
+		size_t end = series.end(i);
+		for (size_t j = series.offsets[i]; j < end; j++) {
+			int n = snprintf(buffer, sizeof(buffer), "%.12g", series.values[j]);
+			text->append(buffer, n);
+			text->push_back(j + 1 < end ? ' ' : '\n');
+		}
+	}
+	text->append("e\n"); // Marks end of data
+	return "'-'";
 }
 
 // Creates a temporary file
 std::string Plot::tempfile(std::ofstream &out)
 {
 	std::string path;
-	sys::fs::mkstemp(&path);
+	FILE *f = sys::fs::mkstemp(&path);
+	if (f != NULL) {
+		fclose(f);
+	}
 
-	out.open(path.c_str());
+	out.open(path.c_str(), std::ios::out | std::ios::binary);
 	if (out.bad()) {
 		throw PEX(str::printf("Unable to open temporary file '%s'", path.c_str()));
 	}
 
-	m_tempfiles.push_back(path);
+#ifdef USE_GNUPLOT
+	g->removeOnExit(path);
+#endif
 	return path;
 }
 
-// Removes all temporary files
-void Plot::removeTempfiles()
-{
-	for (size_t i = 0; i < m_tempfiles.size(); i++) {
-		sys::fs::unlink(m_tempfiles[i]);
-	}
-	m_tempfiles.clear();
-}
-
 // Detects Gnuplot terminals, and checks wheter the X11 terminal is available
 void Plot::detectTerminals()
 {
@@ -668,3 +915,26 @@ void Plot::detectTerminals()
 	s_hasX11Term = (terms.find("x11") != std::string::npos);
 	s_detectTerminals = false;
 }
+
+// Returns the Gnuplot version as major * 100 + minor, or 0 if unknown
+int Plot::version()
+{
+	static int v = -1;
+	if (v >= 0) { // Run only once
+		return v;
+	}
+
+	v = 0;
+	try {
+		int ret, major, minor;
+		std::string path = sys::fs::which("gnuplot");
+		std::string out = sys::io::exec(&ret, path.c_str(), "--version");
+		if (ret == 0 && sscanf(out.c_str(), "gnuplot %d.%d", &major, &minor) == 2) {
+			v = major * 100 + minor;
+		}
+	} catch (const std::exception &ex) {
+		PDEBUG << "Can't query Gnuplot version (" << ex.what() << ")" << endl;
+	}
+	PDEBUG << "Gnuplot version is " << v << endl;
+	return v;
+}
@@ -7,7 +7,7 @@
  * terms and conditions, or see http://www.gnu.org/licenses/.
  *
  * file: plot.h
- * Lua plotting interface using gnuplot (interface)
+ * Lua plotting interface using gnuplot or the native renderer (interface)
  */
 
 
@@ -15,11 +15,13 @@
 #define PLOT_H_
 
 
+#include <map>
 #include <vector>
 #include <iostream>
 
 #include "lunar/lunar.h"
 
+class Chart;
 class Gnuplot;
 
 
@@ -42,21 +44,41 @@ class Plot
 
 		int flush(lua_State *L);
 
+		static void wait(std::ostream *out = NULL);
+
 	public:
 		static const char className[];
 		static Lunar<Plot>::RegType methods[];
 
 	private:
+		// Rows of a data series
+		struct Series
+		{
+			std::vector<double> values;
+			std::vector<size_t> offsets; // Start of each row
+
+			inline void row() { offsets.push_back(values.size()); }
+			inline size_t rows() const { return offsets.size(); }
+			inline size_t end(size_t row) const { return (row + 1 < offsets.size() ? offsets[row + 1] : values.size()); }
+			size_t columns() const;
+		};
+
 		void gcmd(const std::string &c);
+		void gdata(const std::string &data);
+		int chart(lua_State *L, const std::vector<Series> &series, const std::vector<std::string> &titles, const std::map<std::string, std::string> &options);
+		void downsample(Series *series, const std::map<std::string, std::string> &options) const;
+		std::string source(const Series &series, const std::map<std::string, std::string> &options, std::string *text);
 		std::string tempfile(std::ofstream &out);
-		void removeTempfiles();
 		static void detectTerminals();
+		static int version();
 
 	private:
 		Gnuplot *g;
-		std::vector<std::string> m_tempfiles;
+		Chart *m_chart;
 		std::string m_standardTerminal;
 		const char **m_args;
+		int m_width;
+		bool m_timeData;
 		static bool s_hasX11Term;
 		static bool s_detectTerminals;
 };
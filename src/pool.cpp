@@ -0,0 +1,209 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: pool.cpp
+ * Pooled allocation of small objects
+ */
+
+
+#include "main.h"
+
+#include <atomic>
+
+#include "stats.h"
+
+#include "syslib/parallel.h"
+
+#include "pool.h"
+
+
+namespace
+{
+
+// Blocks are moved between the thread and central lists in batches
+const size_t BatchSize = 32;
+const size_t ChunkSize = 64 * 1024;
+
+struct Block
+{
+	Block *next;
+};
+
+// Central free list of a size class
+struct Central
+{
+	sys::parallel::Mutex mutex;
+	Block *head;
+
+	Central() : head(NULL) { }
+};
+
+// Free lists of the current thread, which are returned on thread exit
+struct Local
+{
+	Block *head[Pool::NumClasses];
+	size_t count[Pool::NumClasses];
+
+	Local();
+	~Local();
+
+	void flush();
+};
+
+thread_local Local local;
+thread_local bool localGone = false;
+
+std::atomic<size_t> reservedBytes(0);
+
+// The central lists are never destroyed, as blocks may still be released
+// during the destruction of static objects
+Central *central()
+{
+	static Central *lists = new Central[Pool::NumClasses];
+	return lists;
+}
+
+// Removes up to n blocks from the central list, carving a new chunk if
+// the list is empty. The number of returned blocks is stored in count.
+Block *take(int c, size_t n, size_t *count)
+{
+	Central &list = central()[c];
+	sys::parallel::MutexLocker locker(&list.mutex);
+	if (list.head == NULL) {
+		size_t size = (c + 1) * Pool::Granularity;
+		char *chunk = static_cast<char *>(::operator new(ChunkSize));
+		for (size_t i = 0; i + size <= ChunkSize; i += size) {
+			Block *b = reinterpret_cast<Block *>(chunk + i);
+			b->next = list.head;
+			list.head = b;
+		}
+		reservedBytes += ChunkSize;
+		Stats::add(Stats::PoolBytes, ChunkSize);
+	}
+
+	Block *head = list.head, *tail = head;
+	*count = 1;
+	while (*count < n && tail->next != NULL) {
+		tail = tail->next;
+		++*count;
+	}
+	list.head = tail->next;
+	tail->next = NULL;
+	return head;
+}
+
+// Prepends the given list of blocks to the central list
+void give(int c, Block *head, Block *tail)
+{
+	Central &list = central()[c];
+	sys::parallel::MutexLocker locker(&list.mutex);
+	tail->next = list.head;
+	list.head = head;
+}
+
+// Constructor
+Local::Local()
+{
+	for (int i = 0; i < Pool::NumClasses; i++) {
+		head[i] = NULL;
+		count[i] = 0;
+	}
+}
+
+// Destructor
+Local::~Local()
+{
+	localGone = true;
+	flush();
+}
+
+// Returns all blocks to the central lists
+void Local::flush()
+{
+	for (int i = 0; i < Pool::NumClasses; i++) {
+		if (head[i] != NULL) {
+			Block *tail = head[i];
+			while (tail->next != NULL) {
+				tail = tail->next;
+			}
+			give(i, head[i], tail);
+			head[i] = NULL;
+			count[i] = 0;
+		}
+	}
+}
+
+} // anonymous namespace
+
+
+// Allocates a block of the given size
+void *Pool::allocate(size_t size)
+{
+	if (size > MaxSize) {
+		return ::operator new(size);
+	}
+	int c = (size > 0 ? (size - 1) / Granularity : 0);
+
+	size_t n;
+	if (localGone) {
+		return take(c, 1, &n);
+	}
+	if (local.head[c] == NULL) {
+		local.head[c] = take(c, BatchSize, &n);
+		local.count[c] = n;
+	}
+	Block *b = local.head[c];
+	local.head[c] = b->next;
+	--local.count[c];
+	return b;
+}
+
+// Releases a block that has been allocated with the given size
+void Pool::release(void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return;
+	} else if (size > MaxSize) {
+		::operator delete(ptr);
+		return;
+	}
+	int c = (size > 0 ? (size - 1) / Granularity : 0);
+
+	Block *b = static_cast<Block *>(ptr);
+	if (localGone) {
+		give(c, b, b);
+		return;
+	}
+	b->next = local.head[c];
+	local.head[c] = b;
+	if (++local.count[c] >= 2 * BatchSize) {
+		// Hand a batch back so other threads can reuse it
+		Block *tail = b;
+		for (size_t i = 1; i < BatchSize; i++) {
+			tail = tail->next;
+		}
+		local.head[c] = tail->next;
+		local.count[c] -= BatchSize;
+		give(c, b, tail);
+	}
+}
+
+// Returns the free lists of the current thread to the central lists, so
+// other threads can reuse the blocks right away
+void Pool::flush()
+{
+	if (!localGone) {
+		local.flush();
+	}
+}
+
+// Returns the number of bytes that have been reserved for pooled objects
+size_t Pool::reserved()
+{
+	return reservedBytes;
+}
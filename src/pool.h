@@ -0,0 +1,86 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: pool.h
+ * Pooled allocation of small objects (interface)
+ */
+
+
+#ifndef POOL_H_
+#define POOL_H_
+
+
+#include <cstddef>
+#include <new>
+
+
+/*
+ * Allocator for the small, short-lived objects of the iteration pipeline,
+ * e.g. revisions, diffstats and their shared pointer control blocks.
+ * These are created by the prefetch threads and released by the main
+ * thread shortly after, so the general-purpose allocator spends much time
+ * on contention and leaves fragmented memory behind.
+ *
+ * Requests are rounded up to size classes of 16 bytes. Every thread keeps
+ * a free list per class and only exchanges batches of blocks with the
+ * central lists, which are backed by chunks that are never given back.
+ * Blocks freed by the consumer thus flow back to the producers, and the
+ * pool stays at the size of the prefetch window. Larger requests are
+ * passed to the global operator new. Threads started via sys::parallel
+ * return their free lists before they are reported as finished.
+ */
+class Pool
+{
+	public:
+		enum {
+			Granularity = 16,
+			MaxSize = 512,
+			NumClasses = MaxSize / Granularity
+		};
+
+	public:
+		static void *allocate(size_t size);
+		static void release(void *ptr, size_t size);
+		static void flush();
+
+		static size_t reserved();
+};
+
+
+/*
+ * Standard allocator using the pool, e.g. for std::allocate_shared()
+ */
+template <typename T>
+class PoolAllocator
+{
+	public:
+		typedef T value_type;
+
+		template <typename U>
+		struct rebind { typedef PoolAllocator<U> other; };
+
+	public:
+		PoolAllocator() { }
+		template <typename U>
+		PoolAllocator(const PoolAllocator<U> &) { }
+
+		inline T *allocate(size_t n) {
+			return static_cast<T *>(Pool::allocate(n * sizeof(T)));
+		}
+		inline void deallocate(T *ptr, size_t n) {
+			Pool::release(ptr, n * sizeof(T));
+		}
+};
+
+template <typename T, typename U>
+inline bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+
+#endif // POOL_H_
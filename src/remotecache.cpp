@@ -0,0 +1,493 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: remotecache.cpp
+ * Revision cache on an HTTP server
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "bstream.h"
+#include "logger.h"
+#include "options.h"
+#include "revision.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "remotecache.h"
+
+
+#define REMOTE_MAGIC "pepper-revision"
+#define REMOTE_VERSION (uint32_t)1
+#define TIMEOUT 30 // Seconds
+#define MAX_PIPELINED 32 // Requests per round trip
+#define MAX_FETCHED 4096 // Revisions kept between lookup and retrieval
+
+
+// Constructor
+RemoteCache::RemoteCache(Backend *backend, const Options &options)
+	: AbstractCache(backend, options), m_port(80), m_enabled(true), m_writable(true), m_offset(0)
+{
+	if (!parseUrl(options.remoteCache(), &m_host, &m_port, &m_path)) {
+		throw PEX(str::printf("Invalid remote cache URL: %s", options.remoteCache().c_str()));
+	}
+}
+
+// Destructor
+RemoteCache::~RemoteCache()
+{
+	flush();
+	for (std::unordered_map<std::string, Revision *>::iterator it = m_fetched.begin(); it != m_fetched.end(); ++it) {
+		delete it->second;
+	}
+}
+
+// Waits until all revisions have been uploaded
+void RemoteCache::flush()
+{
+	PTRACE << "Flushing remote cache..." << endl;
+	sync();
+}
+
+// Remote caches are maintained by the server
+void RemoteCache::check(bool)
+{
+	Logger::info() << "RemoteCache: Nothing to check for " << m_host << ":" << m_port << m_path << endl;
+}
+
+// Splits an URL of the form http://host[:port][/path]
+bool RemoteCache::parseUrl(const std::string &url, std::string *host, int *port, std::string *path)
+{
+	const std::string scheme = "http://";
+	if (url.compare(0, scheme.length(), scheme) != 0) {
+		return false;
+	}
+
+	std::string rest = url.substr(scheme.length());
+	size_t slash = rest.find('/');
+	std::string authority = rest.substr(0, slash);
+	*path = (slash == std::string::npos ? std::string() : rest.substr(slash));
+	while (!path->empty() && (*path)[path->length()-1] == '/') {
+		path->resize(path->length()-1);
+	}
+
+	size_t colon = authority.rfind(':');
+	*port = 80;
+	if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+		if (!str::stoi(authority.substr(colon+1), port) || *port <= 0 || *port > 65535) {
+			return false;
+		}
+		authority = authority.substr(0, colon);
+	}
+	if (authority.length() > 2 && authority[0] == '[' && authority[authority.length()-1] == ']') {
+		authority = authority.substr(1, authority.length()-2);
+	}
+	*host = authority;
+	return !host->empty();
+}
+
+// Checks if the given revision is available on the server
+bool RemoteCache::lookup(const std::string &id)
+{
+	return lookupMany(std::vector<std::string>(1, id)).front();
+}
+
+// Uploads a revision
+void RemoteCache::put(const std::string &id, const Revision &rev)
+{
+	if (!m_enabled || !m_writable) {
+		return;
+	}
+
+	std::vector<Request> requests(1);
+	requests[0].method = "PUT";
+	requests[0].path = resource(id);
+	requests[0].body = encode(id, rev);
+
+	std::vector<Response> responses;
+	try {
+		responses = send(requests);
+	} catch (const std::exception &ex) {
+		disable(ex.what());
+		return;
+	}
+
+	int status = responses[0].status;
+	if (status != 200 && status != 201 && status != 204) {
+		Logger::warn() << "Warning: Remote cache refused upload (HTTP status " << status << "), disabling uploads" << endl;
+		m_writable = false;
+	}
+}
+
+// Returns the given parts of a revision that has been found by a lookup
+Revision *RemoteCache::get(const std::string &id, int parts)
+{
+	return getMany(std::vector<std::string>(1, id), parts).front();
+}
+
+// Downloads the given revisions in a single batch, keeping them until they
+// are retrieved via getMany()
+std::vector<bool> RemoteCache::lookupMany(const std::vector<std::string> &ids)
+{
+	std::vector<bool> found(ids.size(), false);
+	if (!m_enabled) {
+		return found;
+	}
+
+	std::vector<Request> requests;
+	std::vector<size_t> index;
+	for (size_t i = 0; i < ids.size(); i++) {
+		if (m_fetched.find(ids[i]) != m_fetched.end()) {
+			found[i] = true;
+			continue;
+		}
+		Request r;
+		r.method = "GET";
+		r.path = resource(ids[i]);
+		requests.push_back(r);
+		index.push_back(i);
+	}
+	if (requests.empty()) {
+		return found;
+	}
+
+	std::vector<Response> responses;
+	try {
+		responses = send(requests);
+	} catch (const std::exception &ex) {
+		disable(ex.what());
+		return found;
+	}
+
+	for (size_t i = 0; i < responses.size(); i++) {
+		const std::string &id = ids[index[i]];
+		if (responses[i].status != 200) {
+			if (responses[i].status != 404) {
+				PDEBUG << "Unexpected HTTP status " << responses[i].status << " for revision " << id << endl;
+			}
+			continue;
+		}
+
+		Revision *rev = new Revision(id);
+		if (!decode(responses[i].body, rev)) {
+			PDEBUG << "Ignoring invalid data for revision " << id << endl;
+			delete rev;
+			continue;
+		}
+
+		m_fetched[id] = rev;
+		m_order.push_back(id);
+		found[index[i]] = true;
+	}
+
+	// Don't keep too many revisions that will possibly never be retrieved
+	while (m_order.size() > MAX_FETCHED) {
+		std::unordered_map<std::string, Revision *>::iterator it = m_fetched.find(m_order.front());
+		if (it != m_fetched.end()) {
+			delete it->second;
+			m_fetched.erase(it);
+		}
+		m_order.pop_front();
+	}
+	return found;
+}
+
+// Uploads the given revisions in a single batch
+void RemoteCache::putMany(const std::vector<Revision *> &revs)
+{
+	if (!m_enabled || !m_writable || revs.empty()) {
+		return;
+	}
+
+	std::vector<Request> requests(revs.size());
+	for (size_t i = 0; i < revs.size(); i++) {
+		requests[i].method = "PUT";
+		requests[i].path = resource(revs[i]->id());
+		requests[i].body = encode(revs[i]->id(), *revs[i]);
+	}
+
+	std::vector<Response> responses;
+	try {
+		responses = send(requests);
+	} catch (const std::exception &ex) {
+		disable(ex.what());
+		return;
+	}
+
+	for (size_t i = 0; i < responses.size(); i++) {
+		int status = responses[i].status;
+		if (status != 200 && status != 201 && status != 204) {
+			Logger::warn() << "Warning: Remote cache refused upload (HTTP status " << status << "), disabling uploads" << endl;
+			m_writable = false;
+			break;
+		}
+	}
+}
+
+// Returns the given parts of revisions that have been found by a lookup.
+// Revisions that have been dropped in the meantime are downloaded again.
+std::vector<Revision *> RemoteCache::getMany(const std::vector<std::string> &ids, int parts)
+{
+	std::vector<bool> found = lookupMany(ids);
+	std::vector<Revision *> revs(ids.size(), (Revision *)NULL);
+	for (size_t i = 0; i < ids.size(); i++) {
+		std::unordered_map<std::string, Revision *>::iterator it = m_fetched.find(ids[i]);
+		if (!found[i] || it == m_fetched.end()) {
+			for (size_t j = 0; j < i; j++) {
+				delete revs[j];
+			}
+			throw PEX(str::printf("Error reading from remote cache: Revision %s not found", ids[i].c_str()));
+		}
+
+		revs[i] = it->second;
+		m_fetched.erase(it);
+		if (!(parts & Revision::DiffstatPart)) {
+			revs[i]->m_diffstat.reset();
+		}
+	}
+	return revs;
+}
+
+// Sends the given requests and returns the responses. Requests are
+// pipelined, and the connection will be re-opened if the server closes it.
+std::vector<RemoteCache::Response> RemoteCache::send(const std::vector<Request> &requests)
+{
+	std::vector<Response> responses;
+	responses.reserve(requests.size());
+	bool retried = false;
+	while (responses.size() < requests.size()) {
+		if (!m_socket.isOpen()) {
+			m_socket.connect(m_host, m_port, TIMEOUT);
+			m_buffer.clear();
+			m_offset = 0;
+		}
+
+		size_t first = responses.size();
+		size_t end = std::min(requests.size(), first + MAX_PIPELINED);
+		std::string data;
+		for (size_t i = first; i < end; i++) {
+			data += requests[i].method + " " + requests[i].path + " HTTP/1.1\r\n";
+			data += "Host: " + m_host + ":" + str::itos(m_port) + "\r\n";
+			data += "User-Agent: " PACKAGE_NAME "/" PACKAGE_VERSION "\r\n";
+			if (requests[i].method == "PUT") {
+				data += "Content-Type: application/octet-stream\r\n";
+				data += "Content-Length: " + str::itos(requests[i].body.length()) + "\r\n";
+			}
+			data += "\r\n";
+			data += requests[i].body;
+		}
+
+		bool open = true;
+		try {
+			m_socket.write(data.data(), data.length());
+			for (size_t i = first; i < end && open; i++) {
+				Response r;
+				if (!receive(&r)) {
+					open = false;
+					break;
+				}
+				responses.push_back(r);
+				open = m_socket.isOpen();
+			}
+		} catch (const std::exception &ex) {
+			// An idle keep-alive connection may have been closed by the server
+			PDEBUG << "Error during request: " << ex.what() << endl;
+			open = false;
+		}
+
+		if (!open) {
+			m_socket.close();
+			if (responses.size() == first) {
+				if (retried) {
+					throw PEX(str::printf("Connection to %s:%d has been closed", m_host.c_str(), m_port));
+				}
+				retried = true;
+			} else {
+				retried = false;
+			}
+		}
+	}
+	return responses;
+}
+
+// Reads a single response. Returns false if the connection has been
+// closed before the response could be read completely.
+bool RemoteCache::receive(Response *response)
+{
+	std::string line;
+	do {
+		if (!readLine(&line)) {
+			return false;
+		}
+		if (line.compare(0, 5, "HTTP/") != 0 || line.find(' ') == std::string::npos) {
+			throw PEX(str::printf("Invalid HTTP response from %s:%d", m_host.c_str(), m_port));
+		}
+		response->status = atoi(line.c_str() + line.find(' ') + 1);
+		bool close = (line.compare(0, 8, "HTTP/1.0") == 0);
+
+		long length = -1;
+		bool chunked = false;
+		while (true) {
+			if (!readLine(&line)) {
+				return false;
+			}
+			if (line.empty()) {
+				break;
+			}
+
+			size_t colon = line.find(':');
+			if (colon == std::string::npos) {
+				continue;
+			}
+			std::string name = str::trim(line.substr(0, colon));
+			std::string value = str::trim(line.substr(colon + 1));
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+			std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+			if (name == "content-length") {
+				length = atol(value.c_str());
+			} else if (name == "transfer-encoding") {
+				chunked = (value.find("chunked") != std::string::npos);
+			} else if (name == "connection") {
+				close = (value == "close");
+			}
+		}
+
+		// Read the body
+		response->body.clear();
+		if (response->status / 100 == 1 || response->status == 204 || response->status == 304) {
+			// No body
+		} else if (chunked) {
+			while (true) {
+				if (!readLine(&line)) {
+					return false;
+				}
+				size_t size = strtoul(line.c_str(), NULL, 16);
+				if (size == 0) {
+					// Skip trailers
+					while (readLine(&line) && !line.empty());
+					break;
+				}
+				std::string data;
+				if (!readData(size, &data) || !readLine(&line)) {
+					return false;
+				}
+				response->body += data;
+			}
+		} else if (length >= 0) {
+			if (!readData(length, &response->body)) {
+				return false;
+			}
+		} else {
+			// The body ends with the connection
+			char buffer[4096];
+			response->body = m_buffer.substr(m_offset);
+			m_buffer.clear();
+			m_offset = 0;
+			ssize_t n;
+			while ((n = m_socket.read(buffer, sizeof(buffer))) > 0) {
+				response->body.append(buffer, n);
+			}
+			close = true;
+		}
+
+		if (close) {
+			m_socket.close();
+		}
+	} while (response->status / 100 == 1); // Informational responses
+	return true;
+}
+
+// Reads a single line from the connection, without the line break
+bool RemoteCache::readLine(std::string *line)
+{
+	size_t pos;
+	while ((pos = m_buffer.find("\r\n", m_offset)) == std::string::npos) {
+		char buffer[4096];
+		ssize_t n = m_socket.read(buffer, sizeof(buffer));
+		if (n <= 0) {
+			return false;
+		}
+		m_buffer.append(buffer, n);
+	}
+
+	line->assign(m_buffer, m_offset, pos - m_offset);
+	m_offset = pos + 2;
+	if (m_offset == m_buffer.length()) {
+		m_buffer.clear();
+		m_offset = 0;
+	}
+	return true;
+}
+
+// Reads the given number of bytes from the connection
+bool RemoteCache::readData(size_t length, std::string *data)
+{
+	while (m_buffer.length() - m_offset < length) {
+		char buffer[16384];
+		ssize_t n = m_socket.read(buffer, sizeof(buffer));
+		if (n <= 0) {
+			return false;
+		}
+		m_buffer.append(buffer, n);
+	}
+
+	data->assign(m_buffer, m_offset, length);
+	m_offset += length;
+	if (m_offset == m_buffer.length()) {
+		m_buffer.clear();
+		m_offset = 0;
+	}
+	return true;
+}
+
+// Returns the path of the resource for the given revision
+std::string RemoteCache::resource(const std::string &id)
+{
+	unsigned char digest[20];
+	utils::sha1(id.data(), id.length(), digest);
+	std::string path = m_path + "/" + cacheId(this) + "/";
+	for (size_t i = 0; i < sizeof(digest); i++) {
+		path += str::printf("%02x", digest[i]);
+	}
+	return path;
+}
+
+// Stops using the server for the rest of the session
+void RemoteCache::disable(const std::string &reason)
+{
+	Logger::warn() << "Warning: Remote cache at " << m_host << ":" << m_port << " disabled: " << reason << endl;
+	m_enabled = false;
+	m_socket.close();
+}
+
+// Serializes a revision
+std::string RemoteCache::encode(const std::string &id, const Revision &rev)
+{
+	MOStream out;
+	out << std::string(REMOTE_MAGIC) << REMOTE_VERSION << id;
+	rev.write(out);
+	const std::vector<char> &data = out.buffer();
+	return std::string(data.begin(), data.end());
+}
+
+// Deserializes a revision, checking that it matches the requested one
+bool RemoteCache::decode(const std::string &data, Revision *rev)
+{
+	MIStream in(data.data(), data.length(), false);
+	std::string magic, id;
+	uint32_t version = 0;
+	in >> magic >> version >> id;
+	if (!in.ok() || magic != REMOTE_MAGIC || version != REMOTE_VERSION || id != rev->m_id) {
+		return false;
+	}
+	return (rev->load(in) && in.ok());
+}
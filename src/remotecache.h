@@ -0,0 +1,95 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: remotecache.h
+ * Revision cache on an HTTP server (interface)
+ */
+
+
+#ifndef REMOTECACHE_H_
+#define REMOTECACHE_H_
+
+
+#include <deque>
+#include <unordered_map>
+
+#include "abstractcache.h"
+
+#include "syslib/net.h"
+
+
+/*
+ * Stores revisions on a plain HTTP server that supports GET and PUT
+ * requests, e.g. a WebDAV-enabled web server or a generic build cache
+ * service. Each revision is a single resource named after the SHA-1 of its
+ * ID. Batches of requests are pipelined over a single connection.
+ *
+ * The remote cache is meant to be the second tier behind a local cache,
+ * so revisions are retrieved from the local cache, the remote cache and
+ * the repository, in this order. Network errors disable the remote cache
+ * for the rest of the session instead of aborting the program.
+ */
+class RemoteCache : public AbstractCache
+{
+	public:
+		RemoteCache(Backend *backend, const Options &options);
+		~RemoteCache();
+
+		void flush();
+		void check(bool force = false);
+
+		static bool parseUrl(const std::string &url, std::string *host, int *port, std::string *path);
+
+	protected:
+		bool lookup(const std::string &id);
+		void put(const std::string &id, const Revision &rev);
+		Revision *get(const std::string &id, int parts);
+
+		std::vector<bool> lookupMany(const std::vector<std::string> &ids);
+		void putMany(const std::vector<Revision *> &revs);
+		std::vector<Revision *> getMany(const std::vector<std::string> &ids, int parts);
+
+	private:
+		struct Request {
+			std::string method;
+			std::string path;
+			std::string body;
+		};
+
+		struct Response {
+			int status;
+			std::string body;
+		};
+
+		std::vector<Response> send(const std::vector<Request> &requests);
+		bool receive(Response *response);
+		bool readLine(std::string *line);
+		bool readData(size_t length, std::string *data);
+		std::string resource(const std::string &id);
+		void disable(const std::string &reason);
+
+		static std::string encode(const std::string &id, const Revision &rev);
+		static bool decode(const std::string &data, Revision *rev);
+
+	PEPPER_PVARS:
+		std::string m_host;
+		int m_port;
+		std::string m_path;
+		bool m_enabled, m_writable;
+
+		sys::net::Socket m_socket;
+		std::string m_buffer; // Received data that hasn't been parsed yet
+		size_t m_offset;
+
+		// Revisions that have been fetched by lookups, in order of arrival
+		std::unordered_map<std::string, Revision *> m_fetched;
+		std::deque<std::string> m_order;
+};
+
+
+#endif // REMOTECACHE_H_
@@ -18,22 +18,29 @@
 #include <sstream>
 #include <stack>
 
+#include "aggregator.h"
 #include "backend.h"
+#include "checkpoint.h"
+#include "columns.h"
 #include "diffstat.h"
 #include "logger.h"
 #include "luahelpers.h"
 #include "luamodules.h"
+#include "luaprofiler.h"
+#include "memstats.h"
 #include "options.h"
+#include "plot.h"
+#include "reportcache.h"
+#include "reportresult.h"
 #include "repository.h"
 #include "revision.h"
 #include "revisioniterator.h"
 #include "strlib.h"
 #include "tag.h"
-#ifdef USE_GNUPLOT
- #include "plot.h"
-#endif
 
 #include "syslib/fs.h"
+#include "syslib/io.h"
+#include "syslib/parallel.h"
 
 #include "report.h"
 
@@ -46,6 +53,9 @@
 
 namespace {
 
+// Serializes output from Lua states in other threads
+sys::parallel::Mutex printMutex;
+
 // Report entry function names
 const char *funcs[] = {"run", "main", NULL};
 
@@ -72,6 +82,20 @@ int atpanic(lua_State *L)
 	return 0;
 }
 
+// Registers rarely used binding classes on first access, i.e. when looking
+// up a missing field of the "pepper" table
+int lazyIndex(lua_State *L)
+{
+	const char *key = lua_tostring(L, 2);
+	if (key == NULL || strcmp(key, Plot::className) != 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	Lunar<Plot>::Register(L, "pepper");
+	lua_rawget(L, 1);
+	return 1;
+}
+
 // Returns all paths that may contains reports
 std::vector<std::string> reportDirs()
 {
@@ -124,7 +148,11 @@ std::string findScript(const std::string &script)
 lua_State *setupLua()
 {
 	// Setup lua context
-	lua_State *L = lua_open();
+#ifdef HAVE_LUAJIT
+	lua_State *L = luaL_newstate(); // Required by LuaJIT on 64-bit platforms
+#else
+	lua_State *L = (MemStats::enabled() ? lua_newstate(&MemStats::luaAlloc, NULL) : luaL_newstate());
+#endif
 	luaL_openlibs(L);
 
 	lua_atpanic(L, atpanic);
@@ -138,10 +166,31 @@ lua_State *setupLua()
 	Lunar<Revision>::Register(L, "pepper");
 	Lunar<RevisionIterator>::Register(L, "pepper");
 	Lunar<Diffstat>::Register(L, "pepper");
+	lua_getglobal(L, "pepper");
+	lua_getfield(L, -1, Diffstat::className);
+	lua_pushcfunction(L, &Diffstat::each);
+	lua_setfield(L, -2, "each");
+	lua_pushcfunction(L, &Diffstat::share);
+	lua_setfield(L, -2, "new");
+	lua_getmetatable(L, -1);
+	lua_pushcfunction(L, &Diffstat::share);
+	lua_setfield(L, -2, "__call");
+	lua_pop(L, 1);
+	lua_pop(L, 1);
+	lua_pushstring(L, Revision::viewDeclaration);
+	lua_setfield(L, -2, "revision_view");
+	lua_pop(L, 1);
 	Lunar<Tag>::Register(L, "pepper");
-#ifdef USE_GNUPLOT
-	Lunar<Plot>::Register(L, "pepper");
-#endif
+	Lunar<Aggregator>::Register(L, "pepper");
+	Lunar<Columns>::Register(L, "pepper");
+
+	// Plotting is only used by some reports
+	lua_getglobal(L, "pepper");
+	lua_newtable(L);
+	lua_pushcfunction(L, lazyIndex);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
 
 	// Setup package path to include built-in modules
 	lua_getglobal(L, "package");
@@ -161,16 +210,37 @@ lua_State *setupLua()
 	luaL_newmetatable(L, "meta");
 	lua_setglobal(L, "meta");
 
+	if (LuaProfiler::enabled()) {
+		LuaProfiler::attach(L);
+	}
 	return L;
 }
 
-// Opens a lua script and returns its entry point
-std::string loadReport(lua_State *L, const std::string &path)
+// Compiles a lua script, using its cached byte code if it is up to date
+void compileReport(lua_State *L, const std::string &path)
 {
+	ReportCache::Entry entry;
+	if (ReportCache::lookup(path, &entry) && !entry.bytecode.empty()) {
+		std::string name = "@" + path;
+		if (luaL_loadbuffer(L, entry.bytecode.data(), entry.bytecode.length(), name.c_str()) == 0) {
+			return;
+		}
+		PDEBUG << "Ignoring cached byte code: " << lua_tostring(L, -1) << endl;
+		lua_pop(L, 1);
+	}
+
 	// Check script syntax by loading the file
 	if (luaL_loadfile(L, path.c_str()) != 0) {
 		throw PEX(lua_tostring(L, -1));
 	}
+	entry.bytecode = LuaHelpers::dump(L);
+	ReportCache::store(path, entry);
+}
+
+// Opens a lua script and returns its entry point
+std::string loadReport(lua_State *L, const std::string &path)
+{
+	compileReport(L, path);
 
 	// Execute the main chunk
 	if (lua_pcall(L, 0, LUA_MULTRET, 0) != 0) {
@@ -187,28 +257,41 @@ std::string loadReport(lua_State *L, const std::string &path)
 // Wrapper for print(), mostly from VIM - Vi IMproved by Bram Moolenaar
 int printWrapper(lua_State *L)
 {
-	std::string str;
+	Report *c = Report::current();
+	std::ostream &out = (c == NULL ? std::cout : c->out());
+	std::string line;
 	int n = lua_gettop(L);
-	lua_getglobal(L, "tostring");
 	for (int i = 1; i <= n; i++) {
-		lua_pushvalue(L, -1); /* tostring */
+		if (i > 1) {
+			line += '\t';
+		}
+
+		// Strings and numbers don't need a call to tostring()
+		size_t l;
+		int type = lua_type(L, i);
+		if (type == LUA_TSTRING || type == LUA_TNUMBER) {
+			const char *s = lua_tolstring(L, i, &l);
+			line.append(s, l);
+			continue;
+		}
+
+		lua_getglobal(L, "tostring");
 		lua_pushvalue(L, i); /* arg */
 		lua_call(L, 1, 1);
-		size_t l;
 		const char *s = lua_tolstring(L, -1, &l);
 		if (s == NULL) {
 			return luaL_error(L, "cannot convert to string");
 		}
-
-		if (i > 1) {
-			str += '\t';
-		}
-		str += std::string(s, l);
+		line.append(s, l);
 		lua_pop(L, 1);
 	}
+	line += '\n';
 
-	Report *c = Report::current();
-	(c == NULL ? std::cout : c->out()) << str << std::endl;
+	// Don't flush the stream, which is buffered by the main program. The
+	// line is written at once, as Lua errors would skip the unlocking.
+	printMutex.lock();
+	out.write(line.data(), line.length());
+	printMutex.unlock();
 	return 0;
 }
 
@@ -224,7 +307,7 @@ std::stack<Report *> Report::s_stack;
 
 // Constructor
 Report::Report(const std::string &script, Backend *backend)
-	: m_repo(NULL), m_script(script), m_out(&std::cout),  m_metaDataRead(false)
+	: m_repo(NULL), m_script(script), m_out(&std::cout), m_redirected(false), m_metaDataRead(false)
 {
 	if (backend) {
 		m_repo = new Repository(backend);
@@ -234,7 +317,7 @@ Report::Report(const std::string &script, Backend *backend)
 
 // Constructor
 Report::Report(const std::string &script, const std::map<std::string, std::string> &options, Backend *backend)
-	: m_repo(NULL), m_script(script), m_options(options), m_out(&std::cout), m_metaDataRead(false)
+	: m_repo(NULL), m_script(script), m_options(options), m_out(&std::cout), m_redirected(false), m_metaDataRead(false)
 {
 	if (backend) {
 		m_repo = new Repository(backend);
@@ -265,11 +348,37 @@ int Report::run(std::ostream &out, std::ostream &err)
 	PDEBUG << "Stack size is " << s_stack.size() << endl;
 
 	std::ostream *prevout = m_out;
+	bool prevredirected = m_redirected;
 	m_out = &out;
+	m_redirected = (&out != &std::cout);
+	m_path = path;
+	m_outputFiles.clear();
 
 	// Ensure the backend is ready
 	m_repo->backend()->open();
 
+	// Serve unchanged requests from a previous run if possible, or capture
+	// the output for storing it afterwards
+	ReportResult *result = (s_stack.size() == 1 ? this->result() : NULL);
+	std::ostringstream capture;
+	if (result != NULL) {
+		bool replayed = false;
+		try {
+			replayed = result->replay(out);
+		} catch (const std::exception &ex) {
+			Logger::warn() << "Warning: Unable to replay report result: " << ex.what() << endl;
+		}
+		if (replayed) {
+			delete result;
+			m_repo->backend()->close();
+			s_stack.pop();
+			m_out = prevout;
+			m_redirected = prevredirected;
+			return EXIT_SUCCESS;
+		}
+		m_out = &capture;
+	}
+
 	lua_State *L = setupLua();
 
 	// Wrap print() function to use custom output stream
@@ -301,12 +410,25 @@ cleanup:
 	lua_gc(L, LUA_GCCOLLECT, 0);
 	lua_close(L);
 
+	if (result != NULL) {
+		out << capture.str() << std::flush;
+		if (ret == EXIT_SUCCESS) {
+			try {
+				result->save(capture.str(), m_outputFiles);
+			} catch (const std::exception &ex) {
+				PDEBUG << "Error saving report result: " << ex.what() << endl;
+			}
+		}
+		delete result;
+	}
+
 	// Inform backend that the report is done
 	m_repo->backend()->close();
 
 	PTRACE << "Popping report context for " << path <<  endl;
 	s_stack.pop();
 	m_out = prevout;
+	m_redirected = prevredirected;
 	return ret;
 }
 
@@ -338,6 +460,11 @@ Report::MetaData Report::metaData()
 bool Report::valid()
 {
 	std::string path = findScript(m_script);
+	ReportCache::Entry entry;
+	if (ReportCache::lookup(path, &entry) && entry.checked) {
+		return entry.valid;
+	}
+
 	lua_State *L = setupLua();
 
 	bool valid = true;
@@ -351,6 +478,12 @@ bool Report::valid()
 	// Clean up
 	lua_gc(L, LUA_GCCOLLECT, 0);
 	lua_close(L);
+
+	// Loading the report has stored its byte code
+	ReportCache::lookup(path, &entry);
+	entry.checked = true;
+	entry.valid = valid;
+	ReportCache::store(path, entry);
 	return valid;
 }
 
@@ -363,7 +496,32 @@ std::ostream &Report::out() const
 // Returns whether the standard output is redirected
 bool Report::outputRedirected() const
 {
-	return (m_out != &std::cout);
+	return m_redirected;
+}
+
+// Records a file written by the report, e.g. a plot, so it can be
+// restored if the report's result is memoized
+void Report::addOutputFile(const std::string &file)
+{
+	if (std::find(m_outputFiles.begin(), m_outputFiles.end(), file) == m_outputFiles.end()) {
+		m_outputFiles.push_back(file);
+	}
+}
+
+// Returns a new Lua state with the report script loaded, e.g. for running
+// callbacks in other threads. The report function isn't called.
+lua_State *Report::workerState() const
+{
+	lua_State *L = setupLua();
+	lua_pushcfunction(L, printWrapper);
+	lua_setglobal(L, "print");
+	try {
+		loadReport(L, m_path);
+	} catch (...) {
+		lua_close(L);
+		throw;
+	}
+	return L;
 }
 
 // Lists all report scripts and their descriptions
@@ -392,6 +550,7 @@ std::vector<std::pair<std::string, std::string> > Report::listReports()
 		}
 	}
 
+	ReportCache::flush();
 	return reports;
 }
 
@@ -420,7 +579,7 @@ void Report::printReportListing(std::ostream &out)
 
 #ifndef USE_GNUPLOT
 	out << std::endl << "NOTE: Built without Gnuplot support. ";
-	out << "Graphical reports are not shown." << std::endl;
+	out << "Graphical reports are rendered natively." << std::endl;
 #endif
 }
 
@@ -442,13 +601,52 @@ Report *Report::current()
 	return (s_stack.empty() ? NULL : s_stack.top());
 }
 
+// Returns the memoized result of running the report on the current
+// branch head, or NULL if results shouldn't be memoized
+ReportResult *Report::result()
+{
+	Backend *backend = m_repo->backend();
+	if (!backend->options().memoize()) {
+		return NULL;
+	}
+
+	// Interactive plots can't be replayed
+	if (!m_redirected && getenv("DISPLAY") && sys::io::isterm(stdout)) {
+		PDEBUG << "Not memoizing interactive report" << endl;
+		return NULL;
+	}
+
+	std::string branch;
+	if (m_options.find("branch") != m_options.end()) {
+		branch = m_options["branch"];
+	} else if (m_options.find("b") != m_options.end()) {
+		branch = m_options["b"];
+	}
+	try {
+		return new ReportResult(backend, m_path, m_options, backend->head(branch));
+	} catch (const std::exception &ex) {
+		PDEBUG << "Not memoizing report: " << ex.what() << endl;
+		return NULL;
+	}
+}
+
 // Reads the report script's meta data
 void Report::readMetaData()
 {
+	std::string path = findScript(m_script);
+	ReportCache::Entry entry;
+	if (ReportCache::lookup(path, &entry) && entry.hasMetaData) {
+		m_metaData = entry.metaData;
+		if (m_metaData.name.empty()) {
+			m_metaData.name = sys::fs::basename(m_script);
+		}
+		m_metaDataRead = true;
+		return;
+	}
+
 	lua_State *L = setupLua();
 
 	// Open the script
-	std::string path = findScript(m_script);
 	try {
 		loadReport(L, path);
 	} catch (const std::exception &ex) {
@@ -475,7 +673,7 @@ void Report::readMetaData()
 	}
 
 	// Read the report name
-	m_metaData.name = sys::fs::basename(m_script);
+	m_metaData.name.clear();
 	lua_getfield(L, -1, "title");
 	if (lua_type(L, -1) == LUA_TSTRING) {
 		m_metaData.name = LuaHelpers::tops(L);
@@ -533,6 +731,15 @@ void Report::readMetaData()
 	// Clean up
 	lua_gc(L, LUA_GCCOLLECT, 0);
 	lua_close(L);
+
+	// The script name is only used if there's no title
+	ReportCache::lookup(path, &entry);
+	entry.hasMetaData = true;
+	entry.metaData = m_metaData;
+	ReportCache::store(path, entry);
+	if (m_metaData.name.empty()) {
+		m_metaData.name = sys::fs::basename(m_script);
+	}
 	m_metaDataRead = true;
 }
 
@@ -548,6 +755,8 @@ Lunar<Report>::RegType Report::methods[] = {
 	LUNAR_DECLARE_METHOD(Report, name),
 	LUNAR_DECLARE_METHOD(Report, description),
 	LUNAR_DECLARE_METHOD(Report, options),
+	LUNAR_DECLARE_METHOD(Report, checkpoint),
+	LUNAR_DECLARE_METHOD(Report, restore),
 	{0,0}
 };
 
@@ -609,7 +818,9 @@ int Report::run(lua_State *L)
 {
 	try {
 		std::stringstream out, err;
-		if (run(out, err) != 0) {
+		int ret = run(out, err);
+		Plot::wait(&out);
+		if (ret != 0) {
 			return LuaHelpers::pushError(L, str::trim(err.str()));
 		}
 		return LuaHelpers::push(L, out.str());
@@ -674,3 +885,54 @@ int Report::options(lua_State *L)
 	}
 	return LuaHelpers::pushNil(L);
 }
+
+int Report::checkpoint(lua_State *L)
+{
+	if (lua_gettop(L) != 2 && lua_gettop(L) != 3) {
+		return luaL_error(L, "Invalid number of arguments (2 or 3 expected)");
+	}
+
+	std::string key = (lua_gettop(L) == 3 ? LuaHelpers::pops(L) : std::string());
+	std::string id = LuaHelpers::pops(L);
+	Backend *backend = m_repo->backend();
+	if (!backend->options().useCache()) {
+		lua_pop(L, 1);
+		return LuaHelpers::push(L, false);
+	}
+
+	try {
+		Checkpoint(backend, m_script, m_options, key).save(L, -1, id);
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+	lua_pop(L, 1);
+	return LuaHelpers::push(L, true);
+}
+
+int Report::restore(lua_State *L)
+{
+	if (lua_gettop(L) > 1) {
+		return luaL_error(L, "Invalid number of arguments (0 or 1 expected)");
+	}
+
+	std::string key = (lua_gettop(L) == 1 ? LuaHelpers::pops(L) : std::string());
+	Backend *backend = m_repo->backend();
+	if (!backend->options().useCache()) {
+		return LuaHelpers::pushNil(L);
+	}
+
+	std::string id;
+	try {
+		if (!Checkpoint(backend, m_script, m_options, key).load(L, &id)) {
+			return LuaHelpers::pushNil(L);
+		}
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+	LuaHelpers::push(L, id);
+	return 2;
+}
@@ -19,11 +19,13 @@
 #include <map>
 #include <stack>
 #include <string>
+#include <vector>
 
 #include "lunar/lunar.h"
 
 class Backend;
 class Repository;
+class ReportResult;
 
 
 // Report context
@@ -56,6 +58,8 @@ class Report
 		bool valid();
 		std::ostream &out() const;
 		bool outputRedirected() const;
+		void addOutputFile(const std::string &file);
+		lua_State *workerState() const;
 
 		static Report *current();
 		Repository *repository() const;
@@ -66,12 +70,16 @@ class Report
 
 	private:
 		void readMetaData();
+		ReportResult *result();
 
 	private:
 		Repository *m_repo;
 		std::string m_script;
+		std::string m_path;
 		std::map<std::string, std::string> m_options;
 		std::ostream *m_out;
+		bool m_redirected;
+		std::vector<std::string> m_outputFiles;
 		MetaData m_metaData;
 		bool m_metaDataRead;
 
@@ -87,6 +95,8 @@ class Report
 		int name(lua_State *L);
 		int description(lua_State *L);
 		int options(lua_State *L);
+		int checkpoint(lua_State *L);
+		int restore(lua_State *L);
 
 		static const char className[];
 		static Lunar<Report>::RegType methods[];
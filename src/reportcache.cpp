@@ -0,0 +1,276 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportcache.cpp
+ * Cache for compiled report scripts and their meta data
+ */
+
+
+#include "main.h"
+
+#include <map>
+
+#include "bstream.h"
+#include "logger.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+#include "reportcache.h"
+
+
+// Cache file format
+#define REPORTCACHE_MAGIC "pepper-reports"
+#define REPORTCACHE_VERSION 1
+
+// Byte code can only be loaded by the interpreter that produced it
+#ifdef HAVE_LUAJIT
+ #define REPORTCACHE_TAG PACKAGE_VERSION " " LUA_RELEASE " LuaJIT"
+#else
+ #define REPORTCACHE_TAG PACKAGE_VERSION " " LUA_RELEASE
+#endif
+
+
+namespace
+{
+
+// Marks the end of an entry, so truncated files are detected
+const char EntryEnd = 'e';
+
+struct Record
+{
+	int64_t mtime;
+	uint64_t size;
+	ReportCache::Entry entry;
+};
+
+struct State
+{
+	sys::parallel::Mutex mutex;
+	std::string dir;
+	bool loaded, dirty;
+	std::map<std::string, Record> records;
+
+	State() : loaded(false), dirty(false) { }
+	~State();
+
+	std::string file() const { return dir + "/reportcache"; }
+	void load();
+	void save();
+};
+
+State &state()
+{
+	static State s;
+	return s;
+}
+
+// Destructor, writes back pending changes on program exit
+State::~State()
+{
+	try {
+		save();
+	} catch (...) {
+		// Never fatal, the cache will be rebuilt next time
+	}
+}
+
+// Reads the cache file, if present
+void State::load()
+{
+	loaded = true;
+	if (dir.empty() || !sys::fs::fileExists(file())) {
+		return;
+	}
+
+	BIStream in(file());
+	std::string magic, tag;
+	uint32_t version = 0, n = 0;
+	in >> magic >> version >> tag >> n;
+	if (!in.ok() || magic != REPORTCACHE_MAGIC || version != REPORTCACHE_VERSION || tag != REPORTCACHE_TAG) {
+		PDEBUG << "Ignoring outdated report cache " << file() << endl;
+		return;
+	}
+
+	std::map<std::string, Record> data;
+	for (uint32_t i = 0; i < n; i++) {
+		std::string path;
+		Record r;
+		in >> path >> r.mtime >> r.size;
+		if (!in.ok() || !ReportCache::read(in, &r.entry)) {
+			Logger::warn() << "Warning: Ignoring corrupted report cache " << file() << endl;
+			return;
+		}
+		data[path] = r;
+	}
+	records.swap(data);
+	PDEBUG << "Loaded " << records.size() << " entries from report cache " << file() << endl;
+}
+
+// Writes the cache file, skipping entries of scripts that have been removed
+void State::save()
+{
+	if (!dirty || dir.empty()) {
+		return;
+	}
+	dirty = false;
+
+	std::map<std::string, Record> data;
+	for (std::map<std::string, Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+		if (sys::fs::fileExists(it->first)) {
+			data.insert(*it);
+		}
+	}
+
+	if (!sys::fs::dirExists(dir)) {
+		sys::fs::mkpath(dir);
+	}
+	std::string tmp = file() + ".tmp";
+	{
+		BOStream out(tmp);
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to open report cache %s for writing", tmp.c_str()));
+		}
+		out << std::string(REPORTCACHE_MAGIC) << uint32_t(REPORTCACHE_VERSION) << std::string(REPORTCACHE_TAG) << uint32_t(data.size());
+		for (std::map<std::string, Record>::const_iterator it = data.begin(); it != data.end(); ++it) {
+			out << it->first << it->second.mtime << it->second.size;
+			ReportCache::write(out, it->second.entry);
+		}
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write report cache %s", tmp.c_str()));
+		}
+	}
+	sys::fs::rename(tmp, file());
+}
+
+} // anonymous namespace
+
+
+// Sets the directory of the cache file, discarding in-memory entries
+void ReportCache::setDir(const std::string &dir)
+{
+	State &s = state();
+	sys::parallel::MutexLocker locker(&s.mutex);
+	s.dir = dir;
+	s.records.clear();
+	s.loaded = s.dirty = false;
+}
+
+// Copies the entry for the given script if it is up to date. Returns
+// false otherwise, or if the script can't be accessed.
+bool ReportCache::lookup(const std::string &path, Entry *entry)
+{
+	std::string key;
+	int64_t mtime;
+	size_t size;
+	try {
+		key = sys::fs::makeAbsolute(path);
+		mtime = sys::fs::mtime(key);
+		size = sys::fs::filesize(key);
+	} catch (const PepperException &) {
+		return false;
+	}
+
+	State &s = state();
+	sys::parallel::MutexLocker locker(&s.mutex);
+	if (!s.loaded) {
+		s.load();
+	}
+	std::map<std::string, Record>::const_iterator it = s.records.find(key);
+	if (it == s.records.end() || it->second.mtime != mtime || it->second.size != size) {
+		return false;
+	}
+	*entry = it->second.entry;
+	return true;
+}
+
+// Stores the entry for the given script
+void ReportCache::store(const std::string &path, const Entry &entry)
+{
+	std::string key;
+	Record r;
+	try {
+		key = sys::fs::makeAbsolute(path);
+		r.mtime = sys::fs::mtime(key);
+		r.size = sys::fs::filesize(key);
+	} catch (const PepperException &) {
+		return;
+	}
+	r.entry = entry;
+
+	State &s = state();
+	sys::parallel::MutexLocker locker(&s.mutex);
+	if (!s.loaded) {
+		s.load();
+	}
+	s.records[key] = r;
+	s.dirty = true;
+}
+
+// Writes back pending changes
+void ReportCache::flush()
+{
+	State &s = state();
+	sys::parallel::MutexLocker locker(&s.mutex);
+	try {
+		s.save();
+	} catch (const PepperException &ex) {
+		PDEBUG << "Error writing report cache: " << ex.what() << endl;
+	}
+}
+
+// Removes all entries, including the cache file
+void ReportCache::clear()
+{
+	State &s = state();
+	sys::parallel::MutexLocker locker(&s.mutex);
+	s.records.clear();
+	s.loaded = true;
+	s.dirty = false;
+	if (!s.dir.empty() && sys::fs::fileExists(s.file())) {
+		sys::fs::unlink(s.file());
+	}
+}
+
+// Serializes a cache entry
+void ReportCache::write(BOStream &out, const Entry &entry)
+{
+	out << std::vector<char>(entry.bytecode.begin(), entry.bytecode.end());
+	out << char(entry.checked ? 1 : 0) << char(entry.valid ? 1 : 0) << char(entry.hasMetaData ? 1 : 0);
+	out << entry.metaData.name << entry.metaData.description;
+	out << uint32_t(entry.metaData.options.size());
+	for (size_t i = 0; i < entry.metaData.options.size(); i++) {
+		out << entry.metaData.options[i].synopsis << entry.metaData.options[i].description;
+	}
+	out << EntryEnd;
+}
+
+// Deserializes a cache entry. Returns false on errors.
+bool ReportCache::read(BIStream &in, Entry *entry)
+{
+	std::vector<char> bytecode;
+	char checked = 0, valid = 0, hasMetaData = 0;
+	uint32_t n = 0;
+	in >> bytecode >> checked >> valid >> hasMetaData;
+	entry->bytecode.assign(bytecode.begin(), bytecode.end());
+	in >> entry->metaData.name >> entry->metaData.description >> n;
+	entry->checked = (checked != 0);
+	entry->valid = (valid != 0);
+	entry->hasMetaData = (hasMetaData != 0);
+
+	entry->metaData.options.clear();
+	for (uint32_t i = 0; i < n && in.ok(); i++) {
+		std::string synopsis, description;
+		in >> synopsis >> description;
+		entry->metaData.options.push_back(Report::MetaData::Option(synopsis, description));
+	}
+	char end = 0;
+	in >> end;
+	return (in.ok() && end == EntryEnd);
+}
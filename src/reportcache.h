@@ -0,0 +1,63 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportcache.h
+ * Cache for compiled report scripts and their meta data (interface)
+ */
+
+
+#ifndef REPORTCACHE_H_
+#define REPORTCACHE_H_
+
+
+#include <string>
+
+#include "report.h"
+
+class BIStream;
+class BOStream;
+
+
+/*
+ * Keeps the byte code of report scripts and the meta data returned by
+ * their describe() functions, so listing the available reports doesn't
+ * require loading every script into a new Lua state. Entries are keyed by
+ * the absolute path of the script and are invalidated if its modification
+ * time or size changes.
+ *
+ * The cache is stored in the directory given to setDir() and written back
+ * by flush() or on program exit. Without a directory, entries are only
+ * kept in memory.
+ */
+class ReportCache
+{
+	public:
+		struct Entry
+		{
+			std::string bytecode;
+			bool checked, valid;
+			bool hasMetaData;
+			Report::MetaData metaData; // Empty name if the script has no title
+
+			Entry() : checked(false), valid(false), hasMetaData(false) { }
+		};
+
+	public:
+		static void setDir(const std::string &dir);
+
+		static bool lookup(const std::string &path, Entry *entry);
+		static void store(const std::string &path, const Entry &entry);
+		static void flush();
+		static void clear();
+
+		static void write(BOStream &out, const Entry &entry);
+		static bool read(BIStream &in, Entry *entry);
+};
+
+
+#endif // REPORTCACHE_H_
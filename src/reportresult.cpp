@@ -0,0 +1,187 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportresult.cpp
+ * Memoized report output
+ */
+
+
+#include "main.h"
+
+#include <cstdio>
+
+#include "abstractcache.h"
+#include "backend.h"
+#include "bstream.h"
+#include "logger.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+
+#include "reportresult.h"
+
+
+// Result file format
+#define RESULT_MAGIC "pepper-result"
+#define RESULT_VERSION 1
+
+
+namespace
+{
+
+// Marks the end of a result, so truncated files are detected
+const char ResultEnd = 'e';
+
+// Reads the whole file. Returns false if it can't be opened.
+bool readFile(const std::string &path, std::string *data)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == NULL) {
+		return false;
+	}
+	char buffer[4096];
+	size_t n;
+	data->clear();
+	while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data->append(buffer, n);
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+// Writes the whole file. Returns false on errors.
+bool writeFile(const std::string &path, const std::string &data)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == NULL) {
+		return false;
+	}
+	bool ok = (fwrite(data.data(), 1, data.length(), f) == data.length());
+	return (fclose(f) == 0 && ok);
+}
+
+} // anonymous namespace
+
+
+// Constructor
+ReportResult::ReportResult(Backend *backend, const std::string &script, const std::map<std::string, std::string> &options, const std::string &head)
+	: m_backend(backend), m_name("result_" + ReportResult::key(script, options, head))
+{
+}
+
+// Returns the path to the result file
+std::string ReportResult::path() const
+{
+	return AbstractCache::cacheFile(m_backend, m_name);
+}
+
+// Writes the stored output to the given stream and restores the output
+// files. Returns false if there's no valid result.
+bool ReportResult::replay(std::ostream &out) const
+{
+	std::string file = path();
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic;
+	std::vector<char> output;
+	uint32_t version = 0, n = 0;
+	in >> magic >> version >> output >> n;
+	if (!in.ok() || magic != RESULT_MAGIC || version != RESULT_VERSION) {
+		Logger::warn() << "Warning: Ignoring invalid report result " << file << endl;
+		return false;
+	}
+
+	// Contents may be binary, e.g. for PNG images
+	std::vector<std::pair<std::string, std::vector<char> > > files;
+	for (uint32_t i = 0; i < n && in.ok(); i++) {
+		std::string name;
+		std::vector<char> data;
+		in >> name >> data;
+		files.push_back(std::make_pair(name, data));
+	}
+	char end = 0;
+	in >> end;
+	if (!in.ok() || end != ResultEnd) {
+		Logger::warn() << "Warning: Ignoring corrupted report result " << file << endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!writeFile(files[i].first, std::string(files[i].second.begin(), files[i].second.end()))) {
+			throw PEX(str::printf("Unable to write output file %s", files[i].first.c_str()));
+		}
+	}
+	out.write(output.data(), output.size());
+	out.flush();
+	PDEBUG << "Replayed report result with " << files.size() << " output files from " << file << endl;
+	return true;
+}
+
+// Stores the output of a report run and the contents of the given files.
+// Nothing is stored if a file can't be read, e.g. because the report has
+// removed it.
+void ReportResult::save(const std::string &output, const std::vector<std::string> &files)
+{
+	std::vector<std::string> contents(files.size());
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!readFile(files[i], &contents[i])) {
+			PDEBUG << "Not storing report result, unable to read output file " << files[i] << endl;
+			return;
+		}
+	}
+
+	// Write to a temporary file first, so concurrent runs never see a
+	// truncated result
+	std::string file = path();
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to open report result %s for writing", tmp.c_str()));
+		}
+		out << std::string(RESULT_MAGIC) << uint32_t(RESULT_VERSION) << std::vector<char>(output.begin(), output.end()) << uint32_t(files.size());
+		for (size_t i = 0; i < files.size(); i++) {
+			out << files[i] << std::vector<char>(contents[i].begin(), contents[i].end());
+		}
+		out << ResultEnd;
+		if (!out.ok()) {
+			throw PEX(str::printf("Unable to write report result %s", tmp.c_str()));
+		}
+	}
+	sys::fs::rename(tmp, file);
+	PDEBUG << "Saved report result with " << files.size() << " output files to " << file << endl;
+}
+
+// Returns a unique key for the given script, options and branch head
+std::string ReportResult::key(const std::string &script, const std::map<std::string, std::string> &options, const std::string &head)
+{
+	std::string contents;
+	if (!readFile(script, &contents)) {
+		throw PEX(str::printf("Unable to read report script %s", script.c_str()));
+	}
+
+	// Options are sorted by name, so the key doesn't depend on the order
+	// in which they have been specified
+	std::string data = std::string(PACKAGE_VERSION) + '\0' + head + '\0' + contents + '\0';
+	for (std::map<std::string, std::string>::const_iterator it = options.begin(); it != options.end(); ++it) {
+		data += it->first + '\0' + it->second + '\0';
+	}
+
+	unsigned char digest[20];
+	utils::sha1(data.data(), data.length(), digest);
+	std::string hex;
+	for (size_t i = 0; i < sizeof(digest); i++) {
+		hex += str::printf("%02x", digest[i]);
+	}
+	return sys::fs::basename(script) + "_" + hex;
+}
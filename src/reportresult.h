@@ -0,0 +1,52 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: reportresult.h
+ * Memoized report output (interface)
+ */
+
+
+#ifndef REPORTRESULT_H_
+#define REPORTRESULT_H_
+
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+class Backend;
+
+
+/*
+ * Output of a successful report run, i.e. the text written to the standard
+ * output and the contents of the files written by plots. Results are kept
+ * in the repository's cache directory and are keyed by the contents of the
+ * report script, the report options, the head of the branch the report
+ * runs on and the program version, so a run with an unchanged key can be
+ * replayed without executing the script.
+ */
+class ReportResult
+{
+	public:
+		ReportResult(Backend *backend, const std::string &script, const std::map<std::string, std::string> &options, const std::string &head);
+
+		std::string path() const;
+
+		bool replay(std::ostream &out) const;
+		void save(const std::string &output, const std::vector<std::string> &files);
+
+		static std::string key(const std::string &script, const std::map<std::string, std::string> &options, const std::string &head);
+
+	private:
+		Backend *m_backend;
+		std::string m_name;
+};
+
+
+#endif // REPORTRESULT_H_
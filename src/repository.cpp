@@ -13,17 +13,52 @@
 
 #include "main.h"
 
+#include <algorithm>
+#include <deque>
+
 #include "backend.h"
 #include "logger.h"
 #include "luahelpers.h"
 #include "options.h"
 #include "revision.h"
 #include "revisioniterator.h"
+#include "strlib.h"
 #include "tag.h"
 
 #include "repository.h"
 
 
+namespace
+{
+
+// Parses a sampling interval, i.e. a number of seconds with an optional
+// unit suffix (s, m, h, d or w)
+bool parseInterval(const std::string &str, int64_t *seconds)
+{
+	if (str.empty()) {
+		return false;
+	}
+	int64_t unit = 1;
+	std::string num = str;
+	switch (str[str.length()-1]) {
+		case 's': unit = 1; break;
+		case 'm': unit = 60; break;
+		case 'h': unit = 3600; break;
+		case 'd': unit = 86400; break;
+		case 'w': unit = 7 * 86400; break;
+		default: num += ' '; break;
+	}
+	num.resize(num.length() - 1);
+	if (!str::str2int(num, seconds, 10) || *seconds <= 0) {
+		return false;
+	}
+	*seconds *= unit;
+	return true;
+}
+
+} // anonymous namespace
+
+
 // Constructor
 Repository::Repository(Backend *backend)
 	: m_backend(backend)
@@ -43,6 +78,56 @@ Backend *Repository::backend() const
 	return m_backend;
 }
 
+// Requests the given revisions from the backend, so later calls to claim()
+// don't have to wait for them
+void Repository::prefetch(const std::vector<std::string> &ids)
+{
+	std::vector<RevisionFuture> futures = request(ids);
+	for (size_t i = 0; i < futures.size(); i++) {
+		m_prefetched.insert(std::make_pair(futures[i].id(), futures[i]));
+	}
+}
+
+// Returns futures for the given revisions, in order. Revisions that have
+// been prefetched already are taken over, and all other ones are requested
+// from the backend at once.
+std::vector<RevisionFuture> Repository::request(const std::vector<std::string> &ids)
+{
+	std::vector<RevisionFuture> futures(ids.size());
+	std::vector<std::string> missing;
+	std::vector<size_t> indexes;
+	for (size_t i = 0; i < ids.size(); i++) {
+		std::map<std::string, RevisionFuture>::iterator it = m_prefetched.find(ids[i]);
+		if (it != m_prefetched.end()) {
+			futures[i] = it->second;
+			m_prefetched.erase(it);
+		} else {
+			missing.push_back(ids[i]);
+			indexes.push_back(i);
+		}
+	}
+
+	if (!missing.empty()) {
+		std::vector<RevisionFuture> f = m_backend->revisionsAsync(missing);
+		for (size_t i = 0; i < f.size(); i++) {
+			futures[indexes[i]] = f[i];
+		}
+	}
+	return futures;
+}
+
+// Returns the revision with the given ID, which may have been prefetched
+Revision *Repository::claim(const std::string &id)
+{
+	std::map<std::string, RevisionFuture>::iterator it = m_prefetched.find(id);
+	if (it == m_prefetched.end()) {
+		return m_backend->revision(id);
+	}
+	RevisionFuture future = it->second;
+	m_prefetched.erase(it);
+	return future.get();
+}
+
 /*
  * Lua binding
  */
@@ -57,8 +142,13 @@ Lunar<Repository>::RegType Repository::methods[] = {
 	LUNAR_DECLARE_METHOD(Repository, tags),
 	LUNAR_DECLARE_METHOD(Repository, tree),
 	LUNAR_DECLARE_METHOD(Repository, revision),
+	LUNAR_DECLARE_METHOD(Repository, revisions),
+	LUNAR_DECLARE_METHOD(Repository, prefetch),
 	LUNAR_DECLARE_METHOD(Repository, iterator),
 	LUNAR_DECLARE_METHOD(Repository, cat),
+	LUNAR_DECLARE_METHOD(Repository, cat_many),
+	LUNAR_DECLARE_METHOD(Repository, line_counts),
+	LUNAR_DECLARE_METHOD(Repository, rollups),
 
 	LUNAR_DECLARE_METHOD(Repository, main_branch),
 	{0,0}
@@ -164,8 +254,8 @@ int Repository::revision(lua_State *L)
 	std::string id = LuaHelpers::pops(L);
 	Revision *rev = NULL;
 	try {
-		rev = m_backend->revision(id);
-		m_backend->filterDiffstat(rev->m_diffstat);
+		rev = claim(id);
+		rev->m_diffstat = m_backend->filterDiffstat(rev->m_diffstat);
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
@@ -174,31 +264,153 @@ int Repository::revision(lua_State *L)
 	return LuaHelpers::push(L, rev, true);
 }
 
+int Repository::revisions(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+		return luaL_error(L, "Invalid number of arguments (1 or 2 expected)");
+	}
+	int callback = LUA_NOREF;
+	if (lua_gettop(L) == 2) {
+		luaL_checktype(L, -1, LUA_TFUNCTION);
+		callback = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	std::vector<std::string> ids = LuaHelpers::popvs(L);
+
+	// Revisions are requested in chunks of the prefetch window, so a
+	// callback keeps only a window of revisions in memory
+	size_t window = 0, next = 0;
+	std::deque<RevisionFuture> futures;
+	int table = 0;
+	if (callback == LUA_NOREF) {
+		lua_createtable(L, ids.size(), 0);
+		table = lua_gettop(L);
+	}
+	try {
+		window = m_backend->options().prefetchWindow();
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (next < ids.size() && (window == 0 || futures.size() <= window / 2)) {
+				size_t n = (window == 0 ? ids.size() - next : std::min(ids.size() - next, window - futures.size()));
+				std::vector<RevisionFuture> f = request(std::vector<std::string>(ids.begin() + next, ids.begin() + next + n));
+				futures.insert(futures.end(), f.begin(), f.end());
+				next += n;
+			}
+
+			RevisionFuture future = futures.front();
+			futures.pop_front();
+			Revision *rev = future.get();
+			rev->m_diffstat = m_backend->filterDiffstat(rev->m_diffstat);
+			if (callback == LUA_NOREF) {
+				LuaHelpers::push(L, rev, true);
+				lua_rawseti(L, table, i+1);
+			} else {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+				LuaHelpers::push(L, rev, true);
+				lua_call(L, 1, 0);
+			}
+		}
+	} catch (const PepperException &ex) {
+		luaL_unref(L, LUA_REGISTRYINDEX, callback);
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		luaL_unref(L, LUA_REGISTRYINDEX, callback);
+		return LuaHelpers::pushError(L, ex.what());
+	}
+
+	if (callback != LUA_NOREF) {
+		luaL_unref(L, LUA_REGISTRYINDEX, callback);
+		return 0;
+	}
+	return 1;
+}
+
+int Repository::prefetch(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 1) {
+		return luaL_error(L, "Invalid number of arguments (1 expected)");
+	}
+	std::vector<std::string> ids = LuaHelpers::popvs(L);
+	try {
+		prefetch(ids);
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+	return 0;
+}
+
 int Repository::iterator(lua_State *L)
 {
 	if (m_backend == NULL) return LuaHelpers::pushNil(L);
 
-	std::string branch;
+	std::vector<std::string> branches;
 	int64_t start = -1, end = -1;
-	RevisionIterator::Flags flags = RevisionIterator::PrefetchRevisions;
+	int flags = RevisionIterator::PrefetchRevisions | RevisionIterator::FetchDiffstats;
+	RevisionFilter filter;
+	std::string since;
+	int limit = 0;
+	bool reverse = false;
+	double sample = 1.0;
+	int64_t every = 0;
 
 	if (lua_gettop(L) == 2) {
 		start = LuaHelpers::tablevi(L, "start", -1);
 		end = LuaHelpers::tablevi(L, "stop", -1); // 'end' is a Lua keyword
 		if (!LuaHelpers::tablevb(L, "prefetch", true)) {
-			flags = RevisionIterator::Flags(int(flags) & ~RevisionIterator::PrefetchRevisions);
+			flags &= ~RevisionIterator::PrefetchRevisions;
+		}
+		if (!LuaHelpers::tablevb(L, "diffstats", true)) {
+			flags &= ~RevisionIterator::FetchDiffstats;
+		}
+		since = LuaHelpers::tablevb(L, "since", std::string());
+		limit = LuaHelpers::tablevi(L, "limit", 0);
+		if (limit < 0) {
+			return luaL_error(L, "Invalid iteration limit %d", limit);
+		}
+		reverse = LuaHelpers::tablevb(L, "reverse", false);
+		sample = LuaHelpers::tablevd(L, "sample", 1.0);
+		if (sample <= 0.0 || sample > 1.0) {
+			return luaL_error(L, "Invalid sampling fraction %f", sample);
+		}
+		std::string interval = LuaHelpers::tablevb(L, "every", std::string());
+		if (!interval.empty() && !parseInterval(interval, &every)) {
+			return luaL_error(L, "Invalid sampling interval '%s'", interval.c_str());
+		}
+		filter.setAuthors(LuaHelpers::tablevvs(L, "authors"));
+		filter.setPaths(LuaHelpers::tablevvs(L, "paths"));
+		try {
+			filter.setGrep(LuaHelpers::tablevb(L, "grep", std::string()));
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
 		}
 		lua_pop(L, 1);
 	}
 	if (lua_gettop(L) == 1) {
-		branch = LuaHelpers::pops(L);
+		if (lua_istable(L, -1)) {
+			branches = LuaHelpers::popvs(L);
+			if (branches.empty()) {
+				return luaL_error(L, "No branches given");
+			}
+		} else {
+			branches.push_back(LuaHelpers::pops(L));
+		}
 	} else {
 		return luaL_error(L, "Invalid number of arguments (1 or 2 expected)");
 	}
 
 	RevisionIterator *it = NULL;
 	try {
-		it = new RevisionIterator(m_backend, branch, start, end, flags);
+		if (branches.size() == 1) {
+			it = new RevisionIterator(m_backend, branches[0], start, end, RevisionIterator::Flags(flags), filter, since);
+		} else {
+			it = new RevisionIterator(m_backend, branches, start, end, RevisionIterator::Flags(flags), filter, since);
+		}
+		it->setLimit(limit, reverse);
+		it->setSampling(sample, every);
 	} catch (const PepperException &ex) {
 		return LuaHelpers::pushError(L, ex.what(), ex.where());
 	} catch (const std::exception &ex) {
@@ -231,6 +443,104 @@ int Repository::cat(lua_State *L)
 	}
 }
 
+int Repository::cat_many(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+		return luaL_error(L, "Invalid number of arguments (1 or 2 expected)");
+	}
+
+	std::string id;
+	if (lua_gettop(L) == 2) {
+		id = LuaHelpers::pops(L);
+	}
+	std::vector<std::string> paths = LuaHelpers::popvs(L);
+
+	try {
+		return LuaHelpers::push(L, m_backend->catMany(paths, id));
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+}
+
+int Repository::line_counts(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	std::string id;
+	if (lua_gettop(L) > 0) {
+		id = LuaHelpers::pops(L);
+	}
+	std::map<std::string, uint64_t> counts;
+	try {
+		counts = m_backend->lineCounts(id);
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+	return LuaHelpers::push(L, counts);
+}
+
+int Repository::rollups(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) < 1 || lua_gettop(L) > 3) {
+		return luaL_error(L, "Invalid number of arguments (1 to 3 expected)");
+	}
+
+	int64_t start = -1, end = -1;
+	if (lua_gettop(L) == 3) {
+		if (!lua_isnil(L, -1)) {
+			end = LuaHelpers::topi(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	if (lua_gettop(L) == 2) {
+		if (!lua_isnil(L, -1)) {
+			start = LuaHelpers::topi(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	std::string name = LuaHelpers::pops(L);
+	Rollups::Key key;
+	if (!Rollups::parseKey(name, &key)) {
+		return luaL_error(L, "Unknown rollup key '%s'", name.c_str());
+	}
+
+	std::vector<Rollups::Row> rows;
+	try {
+		if (!m_backend->rollups(key, start, end, &rows)) {
+			return LuaHelpers::pushNil(L);
+		}
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	} catch (const std::exception &ex) {
+		return LuaHelpers::pushError(L, ex.what());
+	}
+
+	lua_createtable(L, rows.size(), 0);
+	for (size_t i = 0; i < rows.size(); i++) {
+		lua_createtable(L, 0, 5);
+		LuaHelpers::push(L, rows[i].day);
+		lua_setfield(L, -2, "date");
+		LuaHelpers::push(L, rows[i].key);
+		lua_setfield(L, -2, "key");
+		LuaHelpers::push(L, rows[i].commits);
+		lua_setfield(L, -2, "commits");
+		LuaHelpers::push(L, rows[i].added);
+		lua_setfield(L, -2, "added");
+		LuaHelpers::push(L, rows[i].removed);
+		lua_setfield(L, -2, "removed");
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
 int Repository::main_branch(lua_State *L)
 {
 	return default_branch(L);
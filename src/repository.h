@@ -15,9 +15,16 @@
 #define REPOSITORY_H_
 
 
+#include <map>
+#include <string>
+#include <vector>
+
+#include "revisionfuture.h"
+
 #include "lunar/lunar.h"
 
 class Backend;
+class Revision;
 class RevisionIterator;
 
 
@@ -29,8 +36,13 @@ class Repository
 
 		Backend *backend() const;
 
+		void prefetch(const std::vector<std::string> &ids);
+		std::vector<RevisionFuture> request(const std::vector<std::string> &ids);
+		Revision *claim(const std::string &id);
+
 	private:
 		Backend *m_backend;
+		std::map<std::string, RevisionFuture> m_prefetched;
 
 	// Lua binding
 	public:
@@ -44,8 +56,13 @@ class Repository
 		int tags(lua_State *L);
 		int tree(lua_State *L);
 		int revision(lua_State *L);
+		int revisions(lua_State *L);
+		int prefetch(lua_State *L);
 		int iterator(lua_State *L);
 		int cat(lua_State *L);
+		int cat_many(lua_State *L);
+		int line_counts(lua_State *L);
+		int rollups(lua_State *L);
 
 		// Compability methods
 		int main_branch(lua_State *L);
@@ -13,24 +13,34 @@
 
 #include "main.h"
 
+#include "authortable.h"
+#include "backend.h"
 #include "bstream.h"
 #include "logger.h"
 #include "luahelpers.h"
 #include "strlib.h"
+#include "utils.h"
 
 #include "revision.h"
 
 
 // Constructor
 Revision::Revision(const std::string &id)
-	: m_id(id), m_date(0), m_diffstat(std::make_shared<Diffstat>())
+	: m_id(id), m_date(0), m_author(0), m_diffstat(Diffstat::create()), m_backend(NULL)
 {
 
 }
 
 // Constructor
 Revision::Revision(const std::string &id, int64_t date, const std::string &author, const std::string &message, DiffstatPtr diffstat)
-	: m_id(id), m_date(date), m_author(author), m_message(message), m_diffstat(diffstat)
+	: m_id(id), m_date(date), m_author(AuthorTable::intern(author)), m_message(message), m_diffstat(diffstat), m_backend(NULL)
+{
+
+}
+
+// Constructor, using an interned author name
+Revision::Revision(const std::string &id, int64_t date, uint32_t author, const std::string &message, DiffstatPtr diffstat)
+	: m_id(id), m_date(date), m_author(author), m_message(message), m_diffstat(diffstat), m_backend(NULL)
 {
 
 }
@@ -47,17 +57,36 @@ std::string Revision::id() const
 	return m_id;
 }
 
+// Returns the author name
+const std::string &Revision::author() const
+{
+	return AuthorTable::name(m_author);
+}
+
 // Returns the diffstat object
 DiffstatPtr Revision::diffstat() const
 {
 	return m_diffstat;
 }
 
+// Fetches the diffstat from the backend if it hasn't been retrieved yet
+void Revision::fetchDiffstat()
+{
+	// Revisions from meta-data only iterations don't include diffstats
+	if (!m_diffstat) {
+		if (m_backend == NULL) {
+			throw PEX(str::printf("No diffstat available for revision %s", m_id.c_str()));
+		}
+		m_diffstat = m_backend->diffstat(m_id);
+		m_diffstat = m_backend->filterDiffstat(m_diffstat);
+	}
+}
+
 // Writes the revision to a binary stream (not writing the ID)
 void Revision::write(BOStream &out) const
 {
-	out << 'R' << char(1); // Head and version
-	out << m_date << m_author << m_message;
+	out << 'R' << char(3); // Head and version
+	out << m_date << author() << m_message;
 	m_diffstat->write(out);
 	out << 'V'; // Tail
 }
@@ -71,12 +100,15 @@ bool Revision::load(BIStream &in)
 		return false;
 	}
 	in >> v;
-	if (v != 1) {
+	if (v != 1 && v != 3) {
 		PDEBUG << "Unknown version number " << int(v) << ", aborting" << endl;
 		return false;
 	}
 
-	in >> m_date >> m_author >> m_message;
+	std::string author;
+	in >> m_date >> author >> m_message;
+	m_author = AuthorTable::intern(author);
+	// The compact diffstat format is used since version 3
 	if (!m_diffstat->load(in)) {
 		return false;
 	}
@@ -88,17 +120,61 @@ bool Revision::load(BIStream &in)
 	return in.ok();
 }
 
+// Writes the date and author to a binary stream. If a dictionary is
+// given, the author is stored as an index into it (version 2).
+void Revision::writeMeta(BOStream &out, AuthorDictionary *authors) const
+{
+	if (authors) {
+		out << 'M' << char(2); // Head and version
+		out << m_date << authors->encode(m_author);
+	} else {
+		out << 'M' << char(1);
+		out << m_date << author();
+	}
+}
+
+// Loads the date and author from a binary stream
+bool Revision::loadMeta(BIStream &in, AuthorDictionary *authors)
+{
+	char c, v;
+	in >> c >> v;
+	if (c != 'M') { // Head
+		return false;
+	}
+	if (v < 1 || v > 2) {
+		PDEBUG << "Unknown version number " << int(v) << ", aborting" << endl;
+		return false;
+	}
+
+	if (v == 1) {
+		std::string author;
+		in >> m_date >> author;
+		m_author = AuthorTable::intern(author);
+		return in.ok();
+	}
+
+	uint32_t index = 0;
+	in >> m_date >> index;
+	if (!in.ok() || authors == NULL || !authors->decode(index, &m_author)) {
+		PDEBUG << "Unable to decode author " << index << endl;
+		return false;
+	}
+	return true;
+}
+
 // Writes the revision to a binary stream (not writing the ID)
 void Revision::write03(BOStream &out) const
 {
-	out << m_date << m_author << m_message;
-	m_diffstat->write(out);
+	out << m_date << author() << m_message;
+	m_diffstat->writeLegacy(out);
 }
 
 // Loads the revision from a binary stream (not changing the ID)
 bool Revision::load03(BIStream &in)
 {
-	in >> m_date >> m_author >> m_message;
+	std::string author;
+	in >> m_date >> author >> m_message;
+	m_author = AuthorTable::intern(author);
 	if (!m_diffstat->load(in)) {
 		return false;
 	}
@@ -109,28 +185,38 @@ bool Revision::load03(BIStream &in)
  * Lua binding
  */
 
+const char Revision::viewDeclaration[] =
+	"typedef struct {"
+	" double date; double files;"
+	" double lines_added, bytes_added;"
+	" double lines_removed, bytes_removed;"
+	" } pepper_revision_view;";
+
 const char Revision::className[] = "revision";
 Lunar<Revision>::RegType Revision::methods[] = {
 	LUNAR_DECLARE_METHOD(Revision, id),
 	LUNAR_DECLARE_METHOD(Revision, parent_id),
 	LUNAR_DECLARE_METHOD(Revision, date),
 	LUNAR_DECLARE_METHOD(Revision, author),
+	LUNAR_DECLARE_METHOD(Revision, author_id),
 	LUNAR_DECLARE_METHOD(Revision, message),
 	LUNAR_DECLARE_METHOD(Revision, diffstat),
+	LUNAR_DECLARE_METHOD(Revision, view),
 	{0,0}
 };
 
-Revision::Revision(lua_State *) {
+Revision::Revision(lua_State *)
+	: m_author(0), m_backend(NULL) {
 }
 
 int Revision::id(lua_State *L) {
-	return LuaHelpers::push(L, str::split(m_id, ":").back());
+	return LuaHelpers::push(L, utils::childId(m_id));
 }
 
 int Revision::parent_id(lua_State *L) {
-	std::vector<std::string> ids = str::split(m_id, ":");
-	if (ids.size() > 1) {
-		return LuaHelpers::push(L, ids.front());
+	size_t p = m_id.find_last_of(':');
+	if (p != std::string::npos) {
+		return LuaHelpers::push(L, m_id.substr(0, p));
 	}
 	return LuaHelpers::pushNil(L);
 }
@@ -140,7 +226,11 @@ int Revision::date(lua_State *L) {
 }
 
 int Revision::author(lua_State *L) {
-	return LuaHelpers::push(L, m_author);
+	return LuaHelpers::push(L, author());
+}
+
+int Revision::author_id(lua_State *L) {
+	return LuaHelpers::push(L, (int64_t)m_author);
 }
 
 int Revision::message(lua_State *L) {
@@ -148,5 +238,29 @@ int Revision::message(lua_State *L) {
 }
 
 int Revision::diffstat(lua_State *L) {
+	try {
+		fetchDiffstat();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
 	return LuaHelpers::push(L, m_diffstat);
 }
+
+// Returns a pointer to a RevisionView as a light userdata. The view stays
+// valid as long as the revision object is referenced.
+int Revision::view(lua_State *L) {
+	try {
+		fetchDiffstat();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	const Diffstat::Stat &total = m_diffstat->total();
+	m_view.date = m_date;
+	m_view.files = m_diffstat->size();
+	m_view.lines_added = total.ladd;
+	m_view.bytes_added = total.cadd;
+	m_view.lines_removed = total.ldel;
+	m_view.bytes_removed = total.cdel;
+	lua_pushlightuserdata(L, &m_view);
+	return 1;
+}
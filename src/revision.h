@@ -20,37 +20,85 @@
 #include "main.h"
 
 #include "diffstat.h"
+#include "pool.h"
 
 #include "lunar/lunar.h"
 
+class AuthorDictionary;
+class Backend;
 class BIStream;
 class BOStream;
 
 
+/*
+ * Plain copy of the numeric data of a revision, which reports running on
+ * LuaJIT can access via the FFI without calling into the C API. The Lua
+ * declaration of the struct is available as pepper.revision_view. Values
+ * are stored as doubles, so they are read as plain Lua numbers.
+ */
+struct RevisionView
+{
+	double date;
+	double files;
+	double lines_added, bytes_added;
+	double lines_removed, bytes_removed;
+};
+
+
 class Revision
 {
+	friend class AbstractCache;
+	friend class Aggregator;
+	friend class Cache;
+	friend class LdbCache;
+	friend class Columns;
+	friend class MemoryCache;
+	friend class RemoteCache;
 	friend class Repository;
+	friend class RevisionFilter;
 	friend class RevisionIterator;
 
+	public:
+		// Parts of a revision that may be stored and loaded separately
+		enum Part {
+			MetaPart = 0x01, // Date and author
+			MessagePart = 0x02,
+			DiffstatPart = 0x04,
+			AllParts = 0x07
+		};
+
 	public:
 		Revision(const std::string &id);
 		Revision(const std::string &id, int64_t date, const std::string &author, const std::string &message, DiffstatPtr diffstat);
+		Revision(const std::string &id, int64_t date, uint32_t author, const std::string &message, DiffstatPtr diffstat);
 		~Revision();
 
+		// Revisions are allocated from the object pool
+		static inline void *operator new(size_t size) { return Pool::allocate(size); }
+		static inline void operator delete(void *ptr, size_t size) { Pool::release(ptr, size); }
+
 		std::string id() const;
+		const std::string &author() const;
 		DiffstatPtr diffstat() const;
 
 		void write(BOStream &out) const;
 		bool load(BIStream &in);
+		void writeMeta(BOStream &out, AuthorDictionary *authors = NULL) const;
+		bool loadMeta(BIStream &in, AuthorDictionary *authors = NULL);
 		void write03(BOStream &out) const;  // for pepper <= 0.3
 		bool load03(BIStream &in);          // for pepper <= 0.3
 
+	private:
+		void fetchDiffstat();
+
 	PEPPER_PVARS:
 		std::string m_id;
 		int64_t m_date;
-		std::string m_author;
+		uint32_t m_author; // ID in the AuthorTable
 		std::string m_message;
 		DiffstatPtr m_diffstat;
+		Backend *m_backend; // For fetching missing diffstats on demand
+		RevisionView m_view;
 
 	// Lua binding
 	public:
@@ -60,9 +108,12 @@ class Revision
 		int parent_id(lua_State *L);
 		int date(lua_State *L);
 		int author(lua_State *L);
+		int author_id(lua_State *L);
 		int message(lua_State *L);
 		int diffstat(lua_State *L);
+		int view(lua_State *L);
 
+		static const char viewDeclaration[];
 		static const char className[];
 		static Lunar<Revision>::RegType methods[];
 };
@@ -0,0 +1,168 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionfilter.cpp
+ * Revision filter for iterations
+ */
+
+
+#include "main.h"
+
+#include <regex.h>
+
+#include "revision.h"
+#include "strlib.h"
+
+#include "revisionfilter.h"
+
+
+// Compiled message pattern
+struct RevisionFilterData
+{
+	std::string pattern;
+	regex_t regex;
+
+	RevisionFilterData(const std::string &pattern) : pattern(pattern)
+	{
+		int err = regcomp(&regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+		if (err != 0) {
+			char buffer[256];
+			regerror(err, &regex, buffer, sizeof(buffer));
+			throw PEX(str::printf("Invalid message pattern '%s': %s", pattern.c_str(), buffer));
+		}
+	}
+
+	~RevisionFilterData()
+	{
+		regfree(&regex);
+	}
+};
+
+
+// Constructor
+RevisionFilter::RevisionFilter()
+{
+
+}
+
+// Destructor
+RevisionFilter::~RevisionFilter()
+{
+
+}
+
+// Returns whether the filter matches all revisions
+bool RevisionFilter::empty() const
+{
+	return (m_authors.empty() && m_paths.empty() && !d);
+}
+
+// Returns the list of accepted authors
+const std::vector<std::string> &RevisionFilter::authors() const
+{
+	return m_authors;
+}
+
+// Returns the list of accepted paths, without trailing slashes
+const std::vector<std::string> &RevisionFilter::paths() const
+{
+	return m_paths;
+}
+
+// Returns the message pattern
+std::string RevisionFilter::grep() const
+{
+	return (d ? d->pattern : std::string());
+}
+
+// Sets the list of accepted authors
+void RevisionFilter::setAuthors(const std::vector<std::string> &authors)
+{
+	m_authors = authors;
+}
+
+// Sets the list of accepted files or directories
+void RevisionFilter::setPaths(const std::vector<std::string> &paths)
+{
+	m_paths.clear();
+	for (size_t i = 0; i < paths.size(); i++) {
+		std::string path = paths[i];
+		while (!path.empty() && path[path.length()-1] == '/') {
+			path.erase(path.length()-1);
+		}
+		m_paths.push_back(path);
+	}
+}
+
+// Sets the message pattern, which is a POSIX extended regular expression
+void RevisionFilter::setGrep(const std::string &pattern)
+{
+	if (pattern.empty()) {
+		d.reset();
+	} else {
+		d = std::make_shared<RevisionFilterData>(pattern);
+	}
+}
+
+// Checks whether the given author is accepted
+bool RevisionFilter::matchesAuthor(const std::string &author) const
+{
+	if (m_authors.empty()) {
+		return true;
+	}
+	for (size_t i = 0; i < m_authors.size(); i++) {
+		if (m_authors[i] == author) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Checks whether the given file is one of the accepted paths or inside one
+// of the accepted directories
+bool RevisionFilter::matchesPath(const std::string &path) const
+{
+	if (m_paths.empty()) {
+		return true;
+	}
+	for (size_t i = 0; i < m_paths.size(); i++) {
+		const std::string &p = m_paths[i];
+		if (p.empty() || (!path.compare(0, p.length(), p) && (path.length() == p.length() || path[p.length()] == '/'))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Checks whether the given commit message matches the pattern
+bool RevisionFilter::matchesMessage(const std::string &message) const
+{
+	return (!d || regexec(&d->regex, message.c_str(), 0, NULL, 0) == 0);
+}
+
+// Checks whether a revision matches all criteria. Path checks require the
+// revision's diffstat.
+bool RevisionFilter::matches(const Revision *revision) const
+{
+	if (!matchesAuthor(revision->author()) || !matchesMessage(revision->m_message)) {
+		return false;
+	}
+	if (m_paths.empty()) {
+		return true;
+	}
+	if (!revision->m_diffstat) {
+		return false;
+	}
+	const Diffstat::Entries &entries = revision->m_diffstat->entries();
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (matchesPath(Diffstat::path(entries[i].first))) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,64 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionfilter.h
+ * Revision filter for iterations (interface)
+ */
+
+
+#ifndef REVISIONFILTER_H_
+#define REVISIONFILTER_H_
+
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class Revision;
+struct RevisionFilterData;
+
+
+/*
+ * Restricts an iteration to revisions by one of the given authors, touching
+ * one of the given paths and having a commit message matching a POSIX
+ * extended regular expression (line by line, like "git log --grep"). Empty
+ * criteria match all revisions.
+ *
+ * Backends may apply the filter natively when listing revisions, as long as
+ * no matching revision is dropped. The RevisionIterator checks all fetched
+ * revisions with matches() anyway.
+ */
+class RevisionFilter
+{
+	public:
+		RevisionFilter();
+		~RevisionFilter();
+
+		bool empty() const;
+
+		const std::vector<std::string> &authors() const;
+		const std::vector<std::string> &paths() const;
+		std::string grep() const;
+
+		void setAuthors(const std::vector<std::string> &authors);
+		void setPaths(const std::vector<std::string> &paths);
+		void setGrep(const std::string &pattern);
+
+		bool matchesAuthor(const std::string &author) const;
+		bool matchesPath(const std::string &path) const;
+		bool matchesMessage(const std::string &message) const;
+		bool matches(const Revision *revision) const;
+
+	private:
+		std::vector<std::string> m_authors;
+		std::vector<std::string> m_paths;
+		std::shared_ptr<RevisionFilterData> d;
+};
+
+
+#endif // REVISIONFILTER_H_
@@ -0,0 +1,83 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionfuture.cpp
+ * Handles of revisions that are retrieved asynchronously
+ */
+
+
+#include "main.h"
+
+#include "revision.h"
+
+#include "revisionfuture.h"
+
+
+// Destructor, releases revisions that have never been claimed
+RevisionFuture::State::~State()
+{
+	delete result;
+}
+
+
+// Constructs an invalid future
+RevisionFuture::RevisionFuture()
+{
+}
+
+// Constructs a future whose revision is completed by the given function
+RevisionFuture::RevisionFuture(const std::string &id, const Completion &completion)
+	: m_state(std::make_shared<State>(id))
+{
+	m_state->completion = completion;
+}
+
+// Constructs a future for a revision that is already available
+RevisionFuture::RevisionFuture(Revision *revision)
+	: m_state(std::make_shared<State>(revision->id()))
+{
+	m_state->result = revision;
+	m_state->done = true;
+}
+
+// Returns the ID of the requested revision
+const std::string &RevisionFuture::id() const
+{
+	return m_state->id;
+}
+
+// Returns whether the revision can be claimed without further work
+bool RevisionFuture::ready() const
+{
+	sys::parallel::MutexLocker locker(&m_state->mutex);
+	return m_state->done;
+}
+
+// Returns the revision, running the completion function if necessary.
+// Ownership is passed to the caller, so only the first call returns the
+// revision. Errors during retrieval are rethrown on each call.
+Revision *RevisionFuture::get()
+{
+	sys::parallel::MutexLocker locker(&m_state->mutex);
+	if (!m_state->done) {
+		try {
+			m_state->result = m_state->completion();
+		} catch (...) {
+			m_state->error = std::current_exception();
+		}
+		m_state->completion = Completion();
+		m_state->done = true;
+	}
+	if (m_state->error) {
+		std::rethrow_exception(m_state->error);
+	}
+
+	Revision *r = m_state->result;
+	m_state->result = NULL;
+	return r;
+}
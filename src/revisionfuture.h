@@ -0,0 +1,72 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionfuture.h
+ * Handles of revisions that are retrieved asynchronously (interface)
+ */
+
+
+#ifndef REVISIONFUTURE_H_
+#define REVISIONFUTURE_H_
+
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "syslib/parallel.h"
+
+class Revision;
+
+
+/*
+ * Handle of a revision that has been requested with
+ * Backend::revisionsAsync(). Backends start retrieving the revision when
+ * handing out the future, e.g. by passing it to their prefetching threads,
+ * and the remaining work is done by the completion function on the first
+ * call to get(). Copies of a future share their state.
+ *
+ * Futures keep a reference to the backend that created them and must not
+ * outlive it.
+ */
+class RevisionFuture
+{
+	public:
+		typedef std::function<Revision *()> Completion;
+
+	public:
+		RevisionFuture();
+		RevisionFuture(const std::string &id, const Completion &completion);
+		RevisionFuture(Revision *revision);
+
+		inline bool valid() const { return (bool)m_state; }
+		const std::string &id() const;
+		bool ready() const;
+
+		Revision *get();
+
+	private:
+		struct State
+		{
+			std::string id;
+			Completion completion;
+			Revision *result;
+			std::exception_ptr error;
+			bool done;
+			sys::parallel::Mutex mutex;
+
+			State(const std::string &id) : id(id), result(NULL), done(false) { }
+			~State();
+		};
+
+		std::shared_ptr<State> m_state;
+};
+
+
+#endif // REVISIONFUTURE_H_
@@ -0,0 +1,227 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionid.cpp
+ * Compact revision identifiers
+ */
+
+
+#include "main.h"
+
+#include "revisionid.h"
+
+
+namespace
+{
+
+// Returns the value of a lowercase hexadecimal digit, or -1
+inline int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+} // anonymous namespace
+
+
+// Parses a single ID, returning false if it has no fixed-width form
+bool RevisionId::Part::parse(const char *str, size_t len)
+{
+	if (len == 40) {
+		for (size_t i = 0; i < 20; i++) {
+			int hi = hexValue(str[2*i]), lo = hexValue(str[2*i + 1]);
+			if (hi < 0 || lo < 0) {
+				return false;
+			}
+			data[i] = (unsigned char)(hi << 4 | lo);
+		}
+		kind = Hash;
+		return true;
+	}
+
+	// Revision numbers without leading zeros, so the string can be restored
+	if (len == 0 || len > 19 || (str[0] == '0' && len > 1)) {
+		return false;
+	}
+	uint64_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (str[i] < '0' || str[i] > '9') {
+			return false;
+		}
+		n = n * 10 + (str[i] - '0');
+	}
+	memcpy(data, &n, sizeof(n));
+	kind = Number;
+	return true;
+}
+
+// Returns the string representation of a single ID
+std::string RevisionId::Part::str() const
+{
+	static const char digits[] = "0123456789abcdef";
+	if (kind == Hash) {
+		char buffer[40];
+		for (size_t i = 0; i < 20; i++) {
+			buffer[2*i] = digits[data[i] >> 4];
+			buffer[2*i + 1] = digits[data[i] & 0x0F];
+		}
+		return std::string(buffer, sizeof(buffer));
+	} else if (kind == Number) {
+		char buffer[24];
+		return std::string(buffer, snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)number()));
+	}
+	return std::string();
+}
+
+// Returns the revision number or the first bytes of the hash
+uint64_t RevisionId::Part::number() const
+{
+	uint64_t n;
+	memcpy(&n, data, sizeof(n));
+	return n;
+}
+
+
+// Constructor
+RevisionId::RevisionId()
+{
+}
+
+// Constructor, parsing an ID string
+RevisionId::RevisionId(const std::string &id)
+{
+	size_t colon = id.find(':');
+	bool ok;
+	if (colon == std::string::npos) {
+		ok = m_parts[0].parse(id.data(), id.length());
+	} else {
+		ok = (id.find(':', colon + 1) == std::string::npos
+			&& m_parts[0].parse(id.data() + colon + 1, id.length() - colon - 1)
+			&& m_parts[1].parse(id.data(), colon));
+	}
+	if (!ok) {
+		m_parts[0] = Part();
+		m_parts[1] = Part();
+		m_string = id;
+	}
+}
+
+// Checks whether the ID is empty
+bool RevisionId::empty() const
+{
+	return (m_parts[0].kind == None && m_string.empty());
+}
+
+// Checks whether the ID contains a parent ID
+bool RevisionId::hasParent() const
+{
+	if (!m_string.empty()) {
+		return (m_string.find(':') != std::string::npos);
+	}
+	return (m_parts[1].kind != None);
+}
+
+// Returns the parent part of the ID
+RevisionId RevisionId::parent() const
+{
+	if (!m_string.empty()) {
+		return RevisionId(parentStr());
+	}
+	RevisionId id;
+	id.m_parts[0] = m_parts[1];
+	return id;
+}
+
+// Returns the child part of the ID
+RevisionId RevisionId::child() const
+{
+	if (!m_string.empty()) {
+		return RevisionId(childStr());
+	}
+	RevisionId id;
+	id.m_parts[0] = m_parts[0];
+	return id;
+}
+
+// Returns the full ID string
+std::string RevisionId::str() const
+{
+	if (!m_string.empty() || m_parts[0].kind == None) {
+		return m_string;
+	} else if (m_parts[1].kind == None) {
+		return m_parts[0].str();
+	}
+	return m_parts[1].str() + ":" + m_parts[0].str();
+}
+
+// Returns the parent ID string, which is empty if there is no parent
+std::string RevisionId::parentStr() const
+{
+	if (!m_string.empty()) {
+		size_t p = m_string.find_last_of(':');
+		return (p != std::string::npos ? m_string.substr(0, p) : std::string());
+	}
+	return m_parts[1].str();
+}
+
+// Returns the child ID string, which is the same as utils::childId(str())
+std::string RevisionId::childStr() const
+{
+	if (!m_string.empty()) {
+		size_t p = m_string.find_last_of(':');
+		return (p != std::string::npos ? m_string.substr(p+1) : m_string);
+	}
+	return m_parts[0].str();
+}
+
+// Returns a hash value for the ID
+size_t RevisionId::hash() const
+{
+	if (!m_string.empty()) {
+		return std::hash<std::string>()(m_string);
+	}
+
+	// Hashes are random already, and numbers are unique
+	uint64_t h = m_parts[0].number() * 0x9E3779B97F4A7C15ULL;
+	h ^= m_parts[1].number() + (h << 6) + (h >> 2);
+	return size_t(h ^ (h >> 32));
+}
+
+// Equality operator
+bool RevisionId::operator==(const RevisionId &other) const
+{
+	return (m_parts[0].kind == other.m_parts[0].kind && m_parts[1].kind == other.m_parts[1].kind
+		&& !memcmp(m_parts[0].data, other.m_parts[0].data, sizeof(m_parts[0].data))
+		&& !memcmp(m_parts[1].data, other.m_parts[1].data, sizeof(m_parts[1].data))
+		&& m_string == other.m_string);
+}
+
+// Less-than operator, giving an arbitrary but strict order
+bool RevisionId::operator<(const RevisionId &other) const
+{
+	for (int i = 0; i < 2; i++) {
+		if (m_parts[i].kind != other.m_parts[i].kind) {
+			return (m_parts[i].kind < other.m_parts[i].kind);
+		}
+		int c = memcmp(m_parts[i].data, other.m_parts[i].data, sizeof(m_parts[i].data));
+		if (c != 0) {
+			return (c < 0);
+		}
+	}
+	return (m_string < other.m_string);
+}
+
+// Writes the ID string to a stream
+std::ostream &operator<<(std::ostream &out, const RevisionId &id)
+{
+	return (out << id.str());
+}
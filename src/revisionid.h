@@ -0,0 +1,99 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: revisionid.h
+ * Compact revision identifiers (interface)
+ */
+
+
+#ifndef REVISIONID_H_
+#define REVISIONID_H_
+
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "main.h"
+
+
+/*
+ * Revision IDs are given as strings by the backends, either as a single
+ * ID or as "parent:child" for revisions that are diffed against a
+ * specific parent. This class parses such a string once and stores both
+ * parts in fixed-width form: SHA-1 hashes as 20 bytes and revision numbers
+ * as integers. IDs that can't be represented this way, e.g. hashes with
+ * uppercase letters, are kept as strings. Comparison and hashing don't
+ * need to allocate memory.
+ */
+class RevisionId
+{
+	public:
+		RevisionId();
+		explicit RevisionId(const std::string &id);
+
+		bool empty() const;
+		bool hasParent() const;
+		RevisionId parent() const;
+		RevisionId child() const;
+
+		std::string str() const;
+		std::string parentStr() const;
+		std::string childStr() const;
+
+		size_t hash() const;
+
+		bool operator==(const RevisionId &other) const;
+		inline bool operator!=(const RevisionId &other) const {
+			return !(*this == other);
+		}
+		bool operator<(const RevisionId &other) const;
+
+	PEPPER_PVARS:
+		enum Kind {
+			None,
+			Hash,
+			Number
+		};
+
+		// A single ID in fixed-width form
+		struct Part
+		{
+			unsigned char kind;
+			unsigned char data[20]; // Hash, or number in host byte order
+
+			Part() : kind(None) { memset(data, 0, sizeof(data)); }
+
+			bool parse(const char *str, size_t len);
+			std::string str() const;
+			uint64_t number() const;
+		};
+
+		Part m_parts[2]; // Child and parent
+		std::string m_string; // Fallback for IDs that can't be parsed
+};
+
+std::ostream &operator<<(std::ostream &out, const RevisionId &id);
+
+
+namespace std
+{
+
+template <>
+struct hash<RevisionId>
+{
+	size_t operator()(const RevisionId &id) const {
+		return id.hash();
+	}
+};
+
+} // namespace std
+
+
+#endif // REVISIONID_H_
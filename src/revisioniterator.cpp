@@ -22,24 +22,190 @@
  * are known, the backend can pre-fetch them if it needs to. Note that the
  * RevisionIterator calls the corresponding backend methods for pre-fetching.
  * This design isn't exceptionally beautiful but functional. 
+ *
+ * Revisions are handed to the backend for pre-fetching in a sliding window
+ * ahead of the consumer rather than all at once, so the bookkeeping of the
+ * backend's job queues stays bounded for histories with millions of
+ * revisions.
  */
 
 
 #include "main.h"
 
+#include <algorithm>
+#include <deque>
+#include <list>
+
+#include "aggregator.h"
+#include "columns.h"
 #include "logger.h"
 #include "luahelpers.h"
+#include "options.h"
+#include "pool.h"
+#include "report.h"
 #include "revision.h"
+#include "stats.h"
+#include "tracer.h"
+
+#include "syslib/parallel.h"
 
 #include "revisioniterator.h"
 
 
+namespace
+{
+
+typedef std::vector<std::shared_ptr<Revision> > RevisionBatch;
+
+// Bounded queue of revision batches for the workers of mapreduce()
+class MapQueue
+{
+	public:
+		MapQueue(size_t max) : m_max(max), m_closed(false), m_aborted(false) { }
+
+		// Blocks while the queue is full. Returns false if the queue has been aborted.
+		bool put(const RevisionBatch &batch) {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			while (!m_aborted && m_batches.size() >= m_max) {
+				m_cond.wait(&m_mutex);
+			}
+			if (m_aborted) {
+				return false;
+			}
+			m_batches.push_back(batch);
+			m_cond.wakeAll();
+			return true;
+		}
+
+		// Blocks until a batch is available. Returns false if the queue has
+		// been closed and is empty, or has been aborted.
+		bool take(RevisionBatch *batch) {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			while (!m_aborted && !m_closed && m_batches.empty()) {
+				m_cond.wait(&m_mutex);
+			}
+			if (m_aborted || m_batches.empty()) {
+				return false;
+			}
+			batch->swap(m_batches.front());
+			m_batches.pop_front();
+			m_cond.wakeAll();
+			return true;
+		}
+
+		void close() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			m_closed = true;
+			m_cond.wakeAll();
+		}
+
+		void abort() {
+			sys::parallel::MutexLocker locker(&m_mutex);
+			m_aborted = true;
+			m_batches.clear();
+			m_cond.wakeAll();
+		}
+
+	private:
+		sys::parallel::Mutex m_mutex;
+		sys::parallel::WaitCondition m_cond;
+		std::deque<RevisionBatch> m_batches;
+		size_t m_max;
+		bool m_closed, m_aborted;
+};
+
+// Runs the map function of mapreduce() in its own Lua state
+class MapWorker : public sys::parallel::Thread
+{
+	public:
+		MapWorker(lua_State *L, MapQueue *queue) : L(L), function(LUA_NOREF), result(LUA_NOREF), m_queue(queue) { }
+		~MapWorker() { lua_close(L); }
+
+		lua_State *L;
+		int function, result; // Registry references
+		std::string error;
+
+	protected:
+		void run() {
+			RevisionBatch batch;
+			while (m_queue->take(&batch)) {
+				for (size_t i = 0; i < batch.size(); i++) {
+					PTRACE_SCOPE("lua.mapreduce");
+					Stats::Clock clock(Stats::LuaCallback);
+					lua_rawgeti(L, LUA_REGISTRYINDEX, function);
+					LuaHelpers::push(L, batch[i]);
+					lua_rawgeti(L, LUA_REGISTRYINDEX, result);
+					if (lua_pcall(L, 2, 0, 0) != 0) {
+						error = LuaHelpers::pops(L);
+						m_queue->abort();
+						return;
+					}
+				}
+				batch.clear();
+			}
+		}
+
+	private:
+		MapQueue *m_queue;
+};
+
+// Copies the Lua function at the top of the stack to another state,
+// including the values of its upvalues
+void copyFunction(lua_State *from, lua_State *to)
+{
+	if (lua_iscfunction(from, -1)) {
+		throw PEX("Native functions can't be copied to other Lua states");
+	}
+	std::string code = LuaHelpers::dump(from);
+	if (luaL_loadbuffer(to, code.data(), code.length(), "=mapreduce") != 0) {
+		throw PEX(LuaHelpers::pops(to));
+	}
+
+	const char *name;
+	for (int i = 1; (name = lua_getupvalue(from, -1, i)) != NULL; i++) {
+		bool ok = LuaHelpers::copy(from, -1, to);
+		lua_pop(from, 1);
+		if (!ok) {
+			lua_pop(to, 1);
+			throw PEX(str::printf("Upvalue '%s' can't be copied to other Lua states", name));
+		}
+		lua_setupvalue(to, -2, i);
+	}
+}
+
+} // anonymous namespace
+
+
 // Constructor
-RevisionIterator::RevisionIterator(Backend *backend, const std::string &branch, int64_t start, int64_t end, Flags flags)
-	: m_backend(backend), m_total(0), m_consumed(0), m_atEnd(false), m_flags(flags)
+RevisionIterator::RevisionIterator(Backend *backend, const std::string &branch, int64_t start, int64_t end, Flags flags, const RevisionFilter &filter, const std::string &since)
+	: m_backend(backend), m_total(0), m_consumed(0), m_prefetched(0), m_window(backend->options().prefetchWindow()), m_atEnd(false), m_flags(flags), m_filter(filter), m_since(since), m_resumed(false), m_limit(0), m_reverse(false), m_selected(false), m_fraction(1.0), m_scale(1.0), m_interval(0), m_progress(0)
 {
-	m_logIterator = backend->iterator(branch, start, end);
+	// Path filters need diffstats
+	if (!m_filter.paths().empty()) {
+		m_flags = Flags(m_flags | FetchDiffstats);
+	}
+
+	m_logIterator = backend->iterator(branch, start, end, m_filter);
+	m_logIterator->start();
+	m_branches.push_back(branch);
+}
+
+// Constructor for iterating over several branches. The logs are merged,
+// so revisions shared by the branches are processed only once.
+RevisionIterator::RevisionIterator(Backend *backend, const std::vector<std::string> &branches, int64_t start, int64_t end, Flags flags, const RevisionFilter &filter, const std::string &since)
+	: m_backend(backend), m_total(0), m_consumed(0), m_prefetched(0), m_window(backend->options().prefetchWindow()), m_atEnd(false), m_branches(branches), m_flags(flags), m_filter(filter), m_since(since), m_resumed(false), m_limit(0), m_reverse(false), m_selected(false), m_fraction(1.0), m_scale(1.0), m_interval(0), m_progress(0)
+{
+	if (!m_filter.paths().empty()) {
+		m_flags = Flags(m_flags | FetchDiffstats);
+	}
+
+	std::vector<std::vector<std::string> > logs;
+	for (size_t i = 0; i < branches.size(); i++) {
+		logs.push_back(readLog(backend, branches[i], start, end, m_filter));
+	}
+	m_logIterator = new Backend::LogIterator(unionLog(logs, &m_members));
 	m_logIterator->start();
+	PDEBUG << "Merged logs of " << branches.size() << " branches into " << m_members.size() << " revisions" << endl;
 }
 
 // Destructor
@@ -78,6 +244,7 @@ std::string RevisionIterator::next()
 	++m_consumed;
 	std::string id = m_queue.front();
 	m_queue.pop();
+	prefetchAhead();
 	return id;
 }
 
@@ -90,24 +257,416 @@ int RevisionIterator::progress() const
 	return int((100.0f * m_consumed) / m_total);
 }
 
+// Returns whether the iteration has been resumed after the revision given
+// by the "since" option. If this revision could not be found in the log,
+// the iteration covers all revisions.
+bool RevisionIterator::resumed()
+{
+	atEnd();
+	return m_resumed;
+}
+
+// Returns the names of the branches containing the given revision
+std::vector<std::string> RevisionIterator::branches(const std::string &id) const
+{
+	if (m_members.empty()) {
+		return m_branches;
+	}
+
+	std::vector<std::string> names;
+	std::unordered_map<std::string, std::vector<bool> >::const_iterator it = m_members.find(id);
+	if (it != m_members.end()) {
+		for (size_t i = 0; i < m_branches.size(); i++) {
+			if (it->second[i]) {
+				names.push_back(m_branches[i]);
+			}
+		}
+	}
+	return names;
+}
+
+// Restricts the iteration to the last revisions of the log, and optionally
+// reverses the order of the iteration. A limit of 0 includes all revisions.
+// This must be called before the iteration starts.
+void RevisionIterator::setLimit(size_t limit, bool reverse)
+{
+	m_limit = limit;
+	m_reverse = reverse;
+}
+
+// Restricts the iteration to a deterministic subset of the log, for
+// approximate reports. Either every n-th revision is included so that
+// the given fraction of revisions remains, or the first revision of each
+// interval of the given length in seconds. Sampling is applied before the
+// limit and the filter. This must be called before the iteration starts.
+void RevisionIterator::setSampling(double fraction, int64_t interval)
+{
+	m_fraction = std::min(1.0, fraction);
+	m_interval = interval;
+}
+
+// Returns the number of revisions of the log that are represented by each
+// revision of a sampled iteration, i.e. the factor for scaling results
+double RevisionIterator::scale()
+{
+	atEnd();
+	return m_scale;
+}
+
+// Merges the given logs, keeping the order of each of them. Revisions
+// that are contained in several logs are included once, and the logs
+// containing each revision are recorded in members.
+std::vector<std::string> RevisionIterator::unionLog(const std::vector<std::vector<std::string> > &logs, std::unordered_map<std::string, std::vector<bool> > *members)
+{
+	std::list<std::string> merged;
+	std::unordered_map<std::string, std::list<std::string>::iterator> positions;
+	for (size_t i = 0; i < logs.size(); i++) {
+		// New revisions are inserted after the previous revision of the
+		// same log, or in front of all others if there's none
+		std::list<std::string>::iterator prev = merged.end();
+		for (size_t j = 0; j < logs[i].size(); j++) {
+			const std::string &id = logs[i][j];
+			std::unordered_map<std::string, std::list<std::string>::iterator>::iterator it = positions.find(id);
+			if (it != positions.end()) {
+				prev = it->second;
+			} else {
+				std::list<std::string>::iterator pos = (prev == merged.end() ? merged.begin() : std::next(prev));
+				prev = merged.insert(pos, id);
+				positions[id] = prev;
+				(*members)[id].resize(logs.size(), false);
+			}
+			(*members)[id][i] = true;
+		}
+	}
+	return std::vector<std::string>(merged.begin(), merged.end());
+}
+
+// Reads the complete log of a branch
+std::vector<std::string> RevisionIterator::readLog(Backend *backend, const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter)
+{
+	PTRACE_SCOPE("iterator.log");
+	std::vector<std::string> ids;
+	Backend::LogIterator *it = backend->iterator(branch, start, end, filter);
+	try {
+		it->start();
+		std::queue<std::string> tq;
+		while (it->nextIds(&tq)) {
+			while (!tq.empty()) {
+				ids.push_back(tq.front());
+				tq.pop();
+			}
+		}
+	} catch (...) {
+		it->wait();
+		delete it;
+		throw;
+	}
+	it->wait();
+	delete it;
+	return ids;
+}
+
 // Fetches new logs
 void RevisionIterator::fetchLogs()
 {
 	// We need to ask the backend to prefetch the next revision, so
 	// a temporary queue is used for fetching the next IDs
 	std::queue<std::string> tq;
-	m_logIterator->nextIds(&tq);
+	if ((m_limit > 0 || m_reverse || m_fraction < 1.0 || m_interval > 0) && !m_selected) {
+		selectLogs(&tq);
+		m_selected = true;
+	} else if (!m_since.empty()) {
+		skipLogs(&tq);
+		m_since.clear();
+	} else {
+		m_logIterator->nextIds(&tq);
+	}
 
 	m_total += tq.size();
-	std::vector<std::string> ids;
 	while (!tq.empty()) {
-		ids.push_back(tq.front());
+		if (m_flags & PrefetchRevisions) {
+			m_unfetched.push_back(tq.front());
+		}
 		m_queue.push(tq.front());
 		tq.pop();
 	}
+	prefetchAhead();
+}
+
+// Lets the backend prefetch the next revisions of the window. The window
+// is refilled once half of it has been consumed, so the backend receives
+// the IDs in reasonably large chunks.
+void RevisionIterator::prefetchAhead()
+{
+	if (m_unfetched.empty()) {
+		return;
+	}
+	size_t ahead = m_prefetched - m_consumed;
+	size_t n = m_unfetched.size();
+	if (m_window > 0) {
+		if (ahead > m_window / 2) {
+			return;
+		}
+		n = std::min(n, m_window - ahead);
+	}
+
+	std::vector<std::string> ids(m_unfetched.begin(), m_unfetched.begin() + n);
+	m_unfetched.erase(m_unfetched.begin(), m_unfetched.begin() + n);
+	m_prefetched += n;
+	std::vector<RevisionFuture> futures = m_backend->revisionsAsync(ids, (m_flags & FetchDiffstats) != 0);
+	m_futures.insert(m_futures.end(), futures.begin(), futures.end());
+}
+
+// Returns the revision with the given ID, which has usually been requested
+// by prefetchAhead() already
+Revision *RevisionIterator::claim(const std::string &id)
+{
+	if (!m_futures.empty() && m_futures.front().id() == id) {
+		RevisionFuture future = m_futures.front();
+		m_futures.pop_front();
+		return future.get();
+	}
+	return ((m_flags & FetchDiffstats) ? m_backend->revision(id) : m_backend->metaRevision(id));
+}
+
+// Reads logs up to the revision given by the "since" option and stores
+// the IDs of all following revisions in the given queue. If the log doesn't
+// contain this revision, all IDs are stored.
+void RevisionIterator::skipLogs(std::queue<std::string> *queue)
+{
+	std::vector<std::string> ids;
+	std::queue<std::string> tq;
+	while (!m_resumed && m_logIterator->nextIds(&tq)) {
+		while (!tq.empty()) {
+			if (tq.front() == m_since) {
+				PDEBUG << "Resuming iteration after " << m_since << ", skipped " << ids.size() + 1 << " revisions" << endl;
+				ids.clear();
+				m_resumed = true;
+			} else if (m_resumed) {
+				queue->push(tq.front());
+			} else {
+				ids.push_back(tq.front());
+			}
+			tq.pop();
+		}
+	}
+
+	if (!m_resumed) {
+		PDEBUG << "Revision " << m_since << " not found, iterating over all revisions" << endl;
+		for (size_t i = 0; i < ids.size(); i++) {
+			queue->push(ids[i]);
+		}
+	}
+
+	// Don't let the iteration end prematurely if the checkpoint has been
+	// the last revision of a chunk
+	while (queue->empty() && m_logIterator->nextIds(queue)) ;
+}
+
+// Reads the complete log and stores the IDs of the revisions included by
+// the sampling and the limit in the given queue, in reverse order if
+// requested. If there's a filter, the log is scanned backwards until
+// enough matching revisions have been found, so the history before them
+// is never fetched.
+void RevisionIterator::selectLogs(std::queue<std::string> *queue)
+{
+	PTRACE_SCOPE("iterator.select");
+	std::vector<std::string> ids;
+	std::queue<std::string> tq;
+	if (!m_since.empty()) {
+		skipLogs(&tq);
+		m_since.clear();
+	}
+	do {
+		while (!tq.empty()) {
+			ids.push_back(tq.front());
+			tq.pop();
+		}
+	} while (m_logIterator->nextIds(&tq));
+
+	if (m_fraction < 1.0 || m_interval > 0) {
+		sampleLogs(&ids);
+	}
+
+	if (m_limit > 0 && ids.size() > m_limit) {
+		if (m_filter.empty()) {
+			ids.erase(ids.begin(), ids.end() - m_limit);
+		} else {
+			std::vector<std::string> matched;
+			size_t end = ids.size();
+			while (end > 0 && matched.size() < m_limit) {
+				size_t begin = (end > size_t(MapBatchSize) ? end - MapBatchSize : 0);
+				std::vector<std::string> batch(ids.begin() + begin, ids.begin() + end);
+				std::vector<Revision *> revs;
+				if (m_flags & FetchDiffstats) {
+					revs = m_backend->revisions(batch);
+				} else {
+					revs = m_backend->metaRevisions(batch);
+				}
+				for (size_t i = revs.size(); i > 0; i--) {
+					prepare(revs[i-1]);
+					if (matched.size() < m_limit && m_filter.matches(revs[i-1])) {
+						matched.push_back(revs[i-1]->id());
+					}
+					delete revs[i-1];
+				}
+				end = begin;
+			}
+			ids.assign(matched.rbegin(), matched.rend());
+		}
+		PDEBUG << "Limited iteration to the last " << ids.size() << " revisions" << endl;
+	}
+
+	if (m_reverse) {
+		std::reverse(ids.begin(), ids.end());
+	}
+	for (size_t i = 0; i < ids.size(); i++) {
+		queue->push(ids[i]);
+	}
+}
+
+// Reduces the given IDs to the sampled revisions and determines the
+// scaling factor
+void RevisionIterator::sampleLogs(std::vector<std::string> *ids)
+{
+	size_t total = ids->size();
+	std::vector<std::string> sampled;
+	if (m_interval > 0) {
+		// Dates are needed for this, but meta-data is cheap compared to
+		// diffstats and usually cached
+		bool first = true;
+		int64_t last = 0;
+		for (size_t i = 0; i < ids->size(); i += MapBatchSize) {
+			std::vector<std::string> batch(ids->begin() + i, ids->begin() + std::min(ids->size(), i + MapBatchSize));
+			std::vector<Revision *> revs = m_backend->metaRevisions(batch);
+			for (size_t j = 0; j < revs.size(); j++) {
+				int64_t date = revs[j]->m_date;
+				int64_t bucket = (date - (((date % m_interval) + m_interval) % m_interval)) / m_interval;
+				if (first || bucket != last) {
+					sampled.push_back(revs[j]->id());
+					last = bucket;
+					first = false;
+				}
+				delete revs[j];
+			}
+		}
+	} else if (m_fraction > 0.0) {
+		// Include the last revision of every stride, so the result doesn't
+		// depend on anything but the log
+		for (size_t i = 0; i < ids->size(); i++) {
+			if (size_t((i + 1) * m_fraction) > size_t(i * m_fraction)) {
+				sampled.push_back((*ids)[i]);
+			}
+		}
+	}
+
+	ids->swap(sampled);
+	m_scale = (ids->empty() ? 1.0 : double(total) / ids->size());
+	PDEBUG << "Sampled " << ids->size() << " of " << total << " revisions, scale is " << m_scale << endl;
+}
+
+// Filters the diffstat of a revision, or lets the revision fetch it on
+// demand if it's missing
+void RevisionIterator::prepare(Revision *revision)
+{
+	if (revision->m_diffstat) {
+		revision->m_diffstat = m_backend->filterDiffstat(revision->m_diffstat);
+	} else {
+		revision->m_backend = m_backend;
+	}
+}
+
+// Fetches the next revisions, requesting at most n at once. Revisions
+// rejected by the filter are dropped, so less than n revisions may be
+// returned even if the iteration is not finished yet.
+std::vector<Revision *> RevisionIterator::fetchRevisions(size_t n)
+{
+	PTRACE_SCOPE("iterator.fetch");
+	std::vector<std::string> ids;
+	while (ids.size() < n && !atEnd()) {
+		std::string id = next();
+		if (id.empty()) {
+			break;
+		}
+		ids.push_back(id);
+	}
+	if (ids.empty()) {
+		return std::vector<Revision *>();
+	}
+
+	// Revisions that haven't been requested in advance are fetched at once
+	std::vector<Revision *> revs(ids.size(), NULL);
+	std::vector<std::string> rest;
+	try {
+		for (size_t i = 0; i < ids.size(); i++) {
+			if (!m_futures.empty() && m_futures.front().id() == ids[i]) {
+				revs[i] = claim(ids[i]);
+			} else {
+				rest.push_back(ids[i]);
+			}
+		}
+		if (!rest.empty()) {
+			std::vector<Revision *> fetched;
+			if (m_flags & FetchDiffstats) {
+				fetched = m_backend->revisions(rest);
+			} else {
+				fetched = m_backend->metaRevisions(rest);
+			}
+			for (size_t i = 0, j = 0; i < revs.size(); i++) {
+				if (revs[i] == NULL) {
+					revs[i] = fetched[j++];
+				}
+			}
+		}
+	} catch (...) {
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		throw;
+	}
+
+	std::vector<Revision *>::iterator out = revs.begin();
+	for (size_t i = 0; i < revs.size(); i++) {
+		prepare(revs[i]);
+		if (m_filter.empty() || m_filter.matches(revs[i])) {
+			*out++ = revs[i];
+		} else {
+			PTRACE << "Skipping revision " << revs[i]->id() << endl;
+			delete revs[i];
+		}
+	}
+	revs.erase(out, revs.end());
+	return revs;
+}
 
-	if (m_flags & PrefetchRevisions) {
-		m_backend->prefetch(ids);
+// Fetches the diffstat of a revision from a meta-data only iteration
+void RevisionIterator::fetchDiffstat(Revision *revision)
+{
+	if (!revision->m_diffstat && revision->m_backend) {
+		revision->m_diffstat = m_backend->diffstat(revision->m_id);
+		revision->m_diffstat = m_backend->filterDiffstat(revision->m_diffstat);
+	}
+}
+
+// Prints the iteration status. Updates are rate-limited unless forced.
+void RevisionIterator::status(const Revision *revision, bool force)
+{
+	if (!force && m_statusWatch.elapsedMSecs() < StatusInterval) {
+		return;
+	}
+	m_statusWatch.start();
+
+	if (revision == NULL) {
+		if (Logger::level() < Logger::Info) {
+			Logger::status() << "Fetching revisions... " << flush;
+		}
+	} else if (Logger::level() > Logger::Info) {
+		Logger::info() << "\r\033[0K";
+		Logger::info() << "Fetching revisions... " << revision->m_id << flush;
+	} else if (m_progress != progress()) {
+		m_progress = progress();
+		Logger::status() << "\r\033[0K";
+		Logger::status() << "Fetching revisions... " << m_progress << "%" << flush;
 	}
 }
 
@@ -120,6 +679,14 @@ Lunar<RevisionIterator>::RegType RevisionIterator::methods[] = {
 	LUNAR_DECLARE_METHOD(RevisionIterator, next),
 	LUNAR_DECLARE_METHOD(RevisionIterator, revisions),
 	LUNAR_DECLARE_METHOD(RevisionIterator, map),
+	LUNAR_DECLARE_METHOD(RevisionIterator, map_batch),
+	LUNAR_DECLARE_METHOD(RevisionIterator, mapreduce),
+	LUNAR_DECLARE_METHOD(RevisionIterator, aggregate),
+	LUNAR_DECLARE_METHOD(RevisionIterator, columns),
+	LUNAR_DECLARE_METHOD(RevisionIterator, resumed),
+	LUNAR_DECLARE_METHOD(RevisionIterator, scale),
+	LUNAR_DECLARE_METHOD(RevisionIterator, branches),
+	LUNAR_DECLARE_METHOD(RevisionIterator, map_branches),
 	{0,0}
 };
 
@@ -127,20 +694,29 @@ RevisionIterator::RevisionIterator(lua_State *)
 {
 	m_backend = NULL;
 	m_logIterator = NULL;
+	m_prefetched = m_window = 0;
 }
 
 int RevisionIterator::next(lua_State *L)
 {
-	if (atEnd()) {
-		return LuaHelpers::pushNil(L);
-	}	
-
 	Revision *revision = NULL;
-	try {
-		revision = m_backend->revision(next());
-		m_backend->filterDiffstat(revision->m_diffstat);
-	} catch (const PepperException &ex) {
-		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	while (revision == NULL) {
+		if (atEnd()) {
+			return LuaHelpers::pushNil(L);
+		}
+
+		try {
+			revision = claim(next());
+			prepare(revision);
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+
+		if (!m_filter.empty() && !m_filter.matches(revision)) {
+			PTRACE << "Skipping revision " << revision->id() << endl;
+			delete revision;
+			revision = NULL;
+		}
 	}
 
 	PTRACE << "Fetched revision " << revision->id() << endl;
@@ -175,35 +751,417 @@ int RevisionIterator::map(lua_State *L)
 	int callback = luaL_ref(L, LUA_REGISTRYINDEX);
 	lua_pop(L, 1);
 
-	int progress = 0;
-	if (Logger::level() < Logger::Info) {
-		Logger::status() << "Fetching revisions... " << flush;
+	m_progress = 0;
+	status(NULL, true);
+	while (!atEnd()) {
+		std::vector<std::shared_ptr<Revision> > revisions;
+		try {
+			// Request the revisions in batches, so caches can look them up at once
+			std::vector<Revision *> revs = fetchRevisions(MapBatchSize);
+			for (size_t i = 0; i < revs.size(); i++) {
+				revisions.push_back(std::shared_ptr<Revision>(revs[i], std::default_delete<Revision>(), PoolAllocator<Revision>()));
+			}
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+
+		for (size_t i = 0; i < revisions.size(); i++) {
+			std::shared_ptr<Revision> revision = revisions[i];
+			PTRACE << "Fetched revision " << revision->id() << endl;
+
+			{
+				PTRACE_SCOPE("lua.map");
+				Stats::Clock clock(Stats::LuaCallback);
+				lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+				LuaHelpers::push(L, revision);
+				lua_call(L, 1, 1);
+				lua_pop(L, 1);
+			}
+
+			status(revision.get());
+		}
+	}
+
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+
+	try {
+		m_backend->finalize();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return 0;
+}
+
+int RevisionIterator::map_batch(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 2) {
+		return luaL_error(L, "Invalid number of arguments (2 expected)");
 	}
+
+	luaL_checktype(L, -1, LUA_TFUNCTION);
+	int callback = luaL_ref(L, LUA_REGISTRYINDEX);
+	int n = std::max(1, LuaHelpers::popi(L));
+
+	// The table passing the revisions to the callback is allocated once and
+	// recycled for every batch. The revisions may be kept by the callback,
+	// so every batch gets new objects.
+	lua_createtable(L, n, 0);
+	int batch = lua_gettop(L);
+	int filled = 0;
+
+	m_progress = 0;
+	status(NULL, true);
 	while (!atEnd()) {
-		std::shared_ptr<Revision> revision;
+		std::vector<Revision *> revs;
 		try {
-			revision = std::move(std::shared_ptr<Revision>(m_backend->revision(next())));
-			m_backend->filterDiffstat(revision->m_diffstat);
+			revs = fetchRevisions(n);
 		} catch (const PepperException &ex) {
+			lua_pop(L, 1);
 			return LuaHelpers::pushError(L, ex.what(), ex.where());
 		}
+		if (revs.empty()) {
+			// All revisions have been rejected by the filter
+			continue;
+		}
 
-		PTRACE << "Fetched revision " << revision->id() << endl;
+		for (size_t i = 0; i < revs.size(); i++) {
+			LuaHelpers::push(L, std::shared_ptr<Revision>(revs[i], std::default_delete<Revision>(), PoolAllocator<Revision>()));
+			lua_rawseti(L, batch, i+1);
+		}
+		// Batches may be short if revisions have been filtered
+		for (int i = revs.size(); i < filled; i++) {
+			lua_pushnil(L);
+			lua_rawseti(L, batch, i+1);
+		}
+		filled = revs.size();
 
-		lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
-		LuaHelpers::push(L, revision);
-		lua_call(L, 1, 1);
-		lua_pop(L, 1);
+		{
+			PTRACE_SCOPE("lua.map_batch");
+			Stats::Clock clock(Stats::LuaCallback);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
+			lua_pushvalue(L, batch);
+			lua_call(L, 1, 0);
+		}
 
-		if (Logger::level() > Logger::Info) {
-			Logger::info() << "\r\033[0K";
-			Logger::info() << "Fetching revisions... " << revision->id() << flush;
-		} else {
-			if (progress != this->progress()) {
-				progress = this->progress();
-				Logger::status() << "\r\033[0K";
-				Logger::status() << "Fetching revisions... " << progress << "%" << flush;
+		// The last revision is still referenced by the table
+		status(revs.back());
+	}
+	lua_pop(L, 1);
+
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+
+	try {
+		m_backend->finalize();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return 0;
+}
+
+// Calls the map function for all remaining revisions in worker threads,
+// each running its own Lua state with the report script loaded. Every
+// worker passes its own result table to the map function, and the tables
+// are merged with the reduce function afterwards.
+int RevisionIterator::mapreduce(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 2) {
+		return luaL_error(L, "Invalid number of arguments (2 expected)");
+	}
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	Report *report = Report::current();
+	if (report == NULL) {
+		return luaL_error(L, "No report is running");
+	}
+
+	size_t n = std::max(1, sys::parallel::ThreadPool::globalSize());
+	MapQueue queue(2 * n);
+	std::vector<MapWorker *> workers;
+	std::string error;
+	try {
+		for (size_t i = 0; i < n; i++) {
+			lua_State *W = report->workerState();
+			workers.push_back(new MapWorker(W, &queue));
+			lua_pushvalue(L, 1);
+			copyFunction(L, W);
+			lua_pop(L, 1);
+			workers.back()->function = luaL_ref(W, LUA_REGISTRYINDEX);
+			lua_newtable(W);
+			workers.back()->result = luaL_ref(W, LUA_REGISTRYINDEX);
+		}
+	} catch (const PepperException &ex) {
+		lua_settop(L, 2);
+		for (size_t i = 0; i < workers.size(); i++) {
+			delete workers[i];
+		}
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	for (size_t i = 0; i < n; i++) {
+		workers[i]->start();
+	}
+
+	m_progress = 0;
+	status(NULL, true);
+	try {
+		while (!atEnd()) {
+			std::vector<Revision *> revs = fetchRevisions(MapBatchSize);
+			RevisionBatch revisions;
+			for (size_t i = 0; i < revs.size(); i++) {
+				// The backend can't be used from the worker threads
+				revs[i]->m_backend = NULL;
+				revisions.push_back(std::shared_ptr<Revision>(revs[i], std::default_delete<Revision>(), PoolAllocator<Revision>()));
+			}
+
+			bool aborted = false;
+			for (size_t i = 0; i < revisions.size() && !aborted; i += MapReduceBatchSize) {
+				RevisionBatch batch(revisions.begin() + i, revisions.begin() + std::min(revisions.size(), i + MapReduceBatchSize));
+				status(batch.back().get());
+				aborted = !queue.put(batch);
 			}
+			if (aborted) {
+				// A worker has failed
+				break;
+			}
+		}
+	} catch (const PepperException &ex) {
+		error = std::string(ex.where()) + ": " + ex.what();
+		queue.abort();
+	}
+	queue.close();
+	for (size_t i = 0; i < n; i++) {
+		workers[i]->wait();
+		if (error.empty() && !workers[i]->error.empty()) {
+			error = workers[i]->error;
+		}
+	}
+
+	// Merge the results in the main Lua state
+	for (size_t i = 0; i < n && error.empty(); i++) {
+		lua_State *W = workers[i]->L;
+		lua_rawgeti(W, LUA_REGISTRYINDEX, workers[i]->result);
+		if (i > 0) {
+			lua_pushvalue(L, 2);
+			lua_insert(L, -2);
+		}
+		if (!LuaHelpers::copy(W, -1, L)) {
+			error = "The results of the map function may only contain booleans, numbers, strings and tables";
+		} else if (i > 0 && lua_pcall(L, 2, 1, 0) != 0) {
+			error = LuaHelpers::pops(L);
+		}
+		lua_pop(W, 1);
+	}
+	for (size_t i = 0; i < n; i++) {
+		delete workers[i];
+	}
+	if (!error.empty()) {
+		lua_settop(L, 2);
+		return LuaHelpers::pushError(L, error);
+	}
+
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+
+	try {
+		m_backend->finalize();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return 1;
+}
+
+int RevisionIterator::aggregate(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) < 1) {
+		return luaL_error(L, "Invalid number of arguments (at least 1 expected)");
+	}
+
+	std::vector<Aggregator *> aggregators(lua_gettop(L));
+	bool diffstats = false;
+	for (size_t i = 0; i < aggregators.size(); i++) {
+		aggregators[i] = LuaHelpers::topl<Aggregator>(L, i+1);
+		diffstats |= aggregators[i]->needsDiffstats();
+	}
+
+	// No Lua code is involved in this loop
+	m_progress = 0;
+	status(NULL, true);
+	while (!atEnd()) {
+		std::vector<Revision *> revs;
+		try {
+			revs = fetchRevisions(MapBatchSize);
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+
+		for (size_t i = 0; i < revs.size(); i++) {
+			if (diffstats) {
+				try {
+					fetchDiffstat(revs[i]);
+				} catch (const PepperException &ex) {
+					for (size_t j = i; j < revs.size(); j++) {
+						delete revs[j];
+					}
+					return LuaHelpers::pushError(L, ex.what(), ex.where());
+				}
+			}
+			for (size_t j = 0; j < aggregators.size(); j++) {
+				aggregators[j]->add(revs[i], m_scale);
+			}
+			status(revs[i]);
+			delete revs[i];
+		}
+	}
+
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+
+	try {
+		m_backend->finalize();
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return 0;
+}
+
+int RevisionIterator::columns(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 1) {
+		return luaL_error(L, "Invalid number of arguments (1 expected)");
+	}
+
+	Columns *columns = new Columns();
+	try {
+		columns->setFields(LuaHelpers::popvs(L));
+	} catch (const PepperException &ex) {
+		delete columns;
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	bool diffstats = columns->needsDiffstats();
+
+	m_progress = 0;
+	status(NULL, true);
+	while (!atEnd()) {
+		std::vector<Revision *> revs;
+		try {
+			revs = fetchRevisions(MapBatchSize);
+			for (size_t i = 0; i < revs.size() && diffstats; i++) {
+				fetchDiffstat(revs[i]);
+			}
+		} catch (const PepperException &ex) {
+			for (size_t i = 0; i < revs.size(); i++) {
+				delete revs[i];
+			}
+			delete columns;
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+
+		for (size_t i = 0; i < revs.size(); i++) {
+			columns->add(revs[i]);
+			status(revs[i]);
+			delete revs[i];
+		}
+	}
+
+	Logger::status() << "\r\033[0K";
+	Logger::status() << "Fetching revisions... done" << endl;
+
+	try {
+		m_backend->finalize();
+	} catch (const PepperException &ex) {
+		delete columns;
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+	return LuaHelpers::push(L, columns, true);
+}
+
+int RevisionIterator::resumed(lua_State *L)
+{
+	return LuaHelpers::push(L, resumed());
+}
+
+int RevisionIterator::scale(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	try {
+		return LuaHelpers::push(L, scale());
+	} catch (const PepperException &ex) {
+		return LuaHelpers::pushError(L, ex.what(), ex.where());
+	}
+}
+
+int RevisionIterator::branches(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 1) {
+		return luaL_error(L, "Invalid number of arguments (1 expected)");
+	}
+
+	std::string id;
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		id = LuaHelpers::pops(L);
+	} else {
+		id = LuaHelpers::popl<Revision>(L)->id();
+	}
+	return LuaHelpers::push(L, branches(id));
+}
+
+int RevisionIterator::map_branches(lua_State *L)
+{
+	if (m_backend == NULL) return LuaHelpers::pushNil(L);
+
+	if (lua_gettop(L) != 1) {
+		return luaL_error(L, "Invalid number of arguments (1 expected)");
+	}
+
+	luaL_checktype(L, -1, LUA_TTABLE);
+	int callbacks = lua_gettop(L);
+
+	m_progress = 0;
+	status(NULL, true);
+	while (!atEnd()) {
+		std::vector<std::shared_ptr<Revision> > revisions;
+		try {
+			std::vector<Revision *> revs = fetchRevisions(MapBatchSize);
+			for (size_t i = 0; i < revs.size(); i++) {
+				revisions.push_back(std::shared_ptr<Revision>(revs[i], std::default_delete<Revision>(), PoolAllocator<Revision>()));
+			}
+		} catch (const PepperException &ex) {
+			return LuaHelpers::pushError(L, ex.what(), ex.where());
+		}
+
+		for (size_t i = 0; i < revisions.size(); i++) {
+			std::shared_ptr<Revision> revision = revisions[i];
+			PTRACE << "Fetched revision " << revision->id() << endl;
+
+			// The same revision object is passed to the callbacks of all
+			// branches containing it
+			std::vector<std::string> names = branches(revision->id());
+			for (size_t j = 0; j < names.size(); j++) {
+				lua_getfield(L, callbacks, names[j].c_str());
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					continue;
+				}
+				PTRACE_SCOPE("lua.map_branches");
+				Stats::Clock clock(Stats::LuaCallback);
+				LuaHelpers::push(L, revision);
+				lua_call(L, 1, 0);
+			}
+
+			status(revision.get());
 		}
 	}
 
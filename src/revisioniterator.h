@@ -15,40 +15,90 @@
 #define REVISIONITERATOR_H_
 
 
+#include <deque>
 #include <string>
 #include <queue>
+#include <unordered_map>
 
 #include "backend.h"
+#include "revisionfilter.h"
+
+#include "syslib/datetime.h"
 
 #include "lunar/lunar.h"
 
+class Revision;
+
 
 class RevisionIterator
 {
 	public:
 		enum Flags {
-			PrefetchRevisions = 0x01
+			PrefetchRevisions = 0x01,
+			FetchDiffstats = 0x02
 		};
 
+		// Maximum number of revisions requested at once by map()
+		enum { MapBatchSize = 256 };
+
+		// Number of revisions handed to a worker at once by mapreduce()
+		enum { MapReduceBatchSize = 32 };
+
+		// Minimum time between two progress updates during map()
+		enum { StatusInterval = 100 };
+
 	public:
-		RevisionIterator(Backend *backend, const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, Flags flags = PrefetchRevisions);
+		RevisionIterator(Backend *backend, const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1, Flags flags = Flags(PrefetchRevisions | FetchDiffstats), const RevisionFilter &filter = RevisionFilter(), const std::string &since = std::string());
+		RevisionIterator(Backend *backend, const std::vector<std::string> &branches, int64_t start = -1, int64_t end = -1, Flags flags = Flags(PrefetchRevisions | FetchDiffstats), const RevisionFilter &filter = RevisionFilter(), const std::string &since = std::string());
 		~RevisionIterator();
 
 		bool atEnd();
 		std::string next();
 
 		int progress() const;
+		bool resumed();
+		std::vector<std::string> branches(const std::string &id) const;
+
+		void setLimit(size_t limit, bool reverse = false);
+		void setSampling(double fraction, int64_t interval = 0);
+		double scale();
+
+		static std::vector<std::string> unionLog(const std::vector<std::vector<std::string> > &logs, std::unordered_map<std::string, std::vector<bool> > *members);
 
 	private:
+		static std::vector<std::string> readLog(Backend *backend, const std::string &branch, int64_t start, int64_t end, const RevisionFilter &filter);
 		void fetchLogs();
+		void skipLogs(std::queue<std::string> *queue);
+		void selectLogs(std::queue<std::string> *queue);
+		void sampleLogs(std::vector<std::string> *ids);
+		void prefetchAhead();
+		Revision *claim(const std::string &id);
+		void prepare(Revision *revision);
+		std::vector<Revision *> fetchRevisions(size_t n);
+		void status(const Revision *revision, bool force = false);
+		void fetchDiffstat(Revision *revision);
 
 	protected:
 		Backend *m_backend;
 		Backend::LogIterator *m_logIterator;
 		std::queue<std::string> m_queue;
 		std::queue<std::string>::size_type m_total, m_consumed;
+		std::deque<std::string> m_unfetched;
+		std::deque<RevisionFuture> m_futures; // Requested, at most m_window ahead
+		size_t m_prefetched, m_window;
 		bool m_atEnd;
+		std::vector<std::string> m_branches;
+		std::unordered_map<std::string, std::vector<bool> > m_members; // Branches containing each revision
 		Flags m_flags;
+		RevisionFilter m_filter;
+		std::string m_since;
+		bool m_resumed;
+		size_t m_limit;
+		bool m_reverse, m_selected;
+		double m_fraction, m_scale;
+		int64_t m_interval;
+		sys::datetime::Watch m_statusWatch;
+		int m_progress;
 
 	// Lua binding
 	public:
@@ -57,6 +107,14 @@ class RevisionIterator
 		int next(lua_State *L);
 		int revisions(lua_State *L);
 		int map(lua_State *L);
+		int map_batch(lua_State *L);
+		int mapreduce(lua_State *L);
+		int aggregate(lua_State *L);
+		int columns(lua_State *L);
+		int resumed(lua_State *L);
+		int scale(lua_State *L);
+		int branches(lua_State *L);
+		int map_branches(lua_State *L);
 
 		static const char className[];
 		static Lunar<RevisionIterator>::RegType methods[];
@@ -0,0 +1,224 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: rollups.cpp
+ * Per-day sums of revision statistics
+ */
+
+
+#include "main.h"
+
+#include "authortable.h"
+#include "bstream.h"
+#include "diffstat.h"
+#include "revision.h"
+
+#include "syslib/fs.h"
+
+#include "rollups.h"
+
+
+#define ROLLUPS_MAGIC "pepper-rollups"
+#define ROLLUPS_VERSION (uint32_t)1
+
+
+// Constructor
+Rollups::Rollups()
+{
+
+}
+
+// Adds the statistics of a revision. Revisions without an author are only
+// counted for their directories.
+void Rollups::add(const Revision *revision)
+{
+	int64_t day = revision->m_date - (((revision->m_date % 86400) + 86400) % 86400);
+
+	Diffstat::Stat total;
+	std::map<std::string, Diffstat::Stat> dirs;
+	if (revision->m_diffstat) {
+		const Diffstat::Entries &entries = revision->m_diffstat->entries();
+		for (size_t i = 0; i < entries.size(); i++) {
+			const Diffstat::Stat &stat = entries[i].second;
+			Diffstat::Stat &dir = dirs[directory(Diffstat::path(entries[i].first))];
+			dir.ladd += stat.ladd;
+			dir.ldel += stat.ldel;
+			total.ladd += stat.ladd;
+			total.ldel += stat.ldel;
+		}
+	}
+
+	if (revision->m_author != 0) {
+		Sums &sums = m_tables[Author][std::make_pair(day, AuthorTable::name(revision->m_author))];
+		sums.commits += 1;
+		sums.added += total.ladd;
+		sums.removed += total.ldel;
+	}
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+		Sums &sums = m_tables[Directory][std::make_pair(day, it->first)];
+		sums.commits += 1;
+		sums.added += it->second.ladd;
+		sums.removed += it->second.ldel;
+	}
+}
+
+// Adds the rows of another instance
+void Rollups::merge(const Rollups &other)
+{
+	for (int k = 0; k < NumKeys; k++) {
+		for (Table::const_iterator it = other.m_tables[k].begin(); it != other.m_tables[k].end(); ++it) {
+			Sums &sums = m_tables[k][it->first];
+			sums.commits += it->second.commits;
+			sums.added += it->second.added;
+			sums.removed += it->second.removed;
+		}
+	}
+}
+
+// Removes all rows
+void Rollups::clear()
+{
+	for (int k = 0; k < NumKeys; k++) {
+		m_tables[k].clear();
+	}
+}
+
+// Checks whether there are no rows
+bool Rollups::empty() const
+{
+	return (size() == 0);
+}
+
+// Returns the number of rows in all tables
+size_t Rollups::size() const
+{
+	size_t n = 0;
+	for (int k = 0; k < NumKeys; k++) {
+		n += m_tables[k].size();
+	}
+	return n;
+}
+
+// Returns the rows of all days overlapping the given time range, ordered
+// by day and key. Negative bounds are ignored.
+std::vector<Rollups::Row> Rollups::rows(Key key, int64_t start, int64_t end) const
+{
+	const Table &table = m_tables[key];
+	Table::const_iterator it = table.begin();
+	if (start >= 0) {
+		it = table.lower_bound(std::make_pair(start - (start % 86400), std::string()));
+	}
+
+	std::vector<Row> rows;
+	for (; it != table.end() && (end < 0 || it->first.first <= end); ++it) {
+		Row row;
+		row.day = it->first.first;
+		row.key = it->first.second;
+		row.commits = it->second.commits;
+		row.added = it->second.added;
+		row.removed = it->second.removed;
+		rows.push_back(row);
+	}
+	return rows;
+}
+
+// Adds the rows stored in the given file. Rows are appended to the file,
+// so a truncated row at the end is ignored. Returns false if the file
+// does not exist or is invalid.
+bool Rollups::read(const std::string &file)
+{
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+
+	BIStream in(file);
+	std::string magic, name;
+	uint32_t version = 0;
+	in >> magic >> version;
+	if (!in.ok() || magic != ROLLUPS_MAGIC || version != ROLLUPS_VERSION) {
+		return false;
+	}
+
+	char key;
+	int64_t day;
+	Sums delta;
+	while (!in.eof()) {
+		in >> key >> day >> name >> delta.commits >> delta.added >> delta.removed;
+		if (!in.ok() || key < 0 || key >= NumKeys) {
+			break;
+		}
+		Sums &sums = m_tables[int(key)][std::make_pair(day, name)];
+		sums.commits += delta.commits;
+		sums.added += delta.added;
+		sums.removed += delta.removed;
+	}
+	return true;
+}
+
+// Appends all rows to an existing file
+bool Rollups::append(const std::string &file) const
+{
+	if (!sys::fs::fileExists(file)) {
+		return false;
+	}
+	BOStream out(file, true);
+	writeRows(out);
+	return out.ok();
+}
+
+// Replaces the given file with all rows
+bool Rollups::write(const std::string &file) const
+{
+	// Write to a temporary file first, so concurrent readers never see
+	// partial tables
+	std::string tmp = file + ".tmp";
+	{
+		BOStream out(tmp);
+		out << std::string(ROLLUPS_MAGIC) << ROLLUPS_VERSION;
+		writeRows(out);
+		if (!out.ok()) {
+			return false;
+		}
+	}
+	sys::fs::rename(tmp, file);
+	return true;
+}
+
+// Parses a key name
+bool Rollups::parseKey(const std::string &name, Key *key)
+{
+	if (name == "author") {
+		*key = Author;
+	} else if (name == "directory") {
+		*key = Directory;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Returns the top-level directory of the given file. Files in the root
+// directory are grouped as "/".
+std::string Rollups::directory(const std::string &path)
+{
+	size_t slash = path.find('/');
+	if (slash == std::string::npos || slash == 0) {
+		return std::string("/");
+	}
+	return path.substr(0, slash);
+}
+
+// Writes the rows of all tables
+void Rollups::writeRows(BOStream &out) const
+{
+	for (int k = 0; k < NumKeys; k++) {
+		for (Table::const_iterator it = m_tables[k].begin(); it != m_tables[k].end(); ++it) {
+			out << char(k) << it->first.first << it->first.second << it->second.commits << it->second.added << it->second.removed;
+		}
+	}
+}
@@ -0,0 +1,91 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: rollups.h
+ * Per-day sums of revision statistics (interface)
+ */
+
+
+#ifndef ROLLUPS_H_
+#define ROLLUPS_H_
+
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class BOStream;
+class Revision;
+
+
+/*
+ * Number of commits and added and removed lines per day and author and
+ * per day and top-level directory. Persistent caches maintain these
+ * tables as revisions are added, so charts of daily or weekly aggregates
+ * over long periods only read a few rows per day instead of decoding all
+ * revisions. Days start at midnight UTC.
+ */
+class Rollups
+{
+	public:
+		enum Key {
+			Author = 0,
+			Directory,
+			NumKeys
+		};
+
+		struct Row
+		{
+			int64_t day; // Start of the day
+			std::string key;
+			int64_t commits;
+			int64_t added;
+			int64_t removed;
+
+			Row() : day(0), commits(0), added(0), removed(0) { }
+		};
+
+	public:
+		Rollups();
+
+		void add(const Revision *revision);
+		void merge(const Rollups &other);
+		void clear();
+		bool empty() const;
+		size_t size() const;
+
+		std::vector<Row> rows(Key key, int64_t start = -1, int64_t end = -1) const;
+
+		bool read(const std::string &file);
+		bool append(const std::string &file) const;
+		bool write(const std::string &file) const;
+
+		static bool parseKey(const std::string &name, Key *key);
+		static std::string directory(const std::string &path);
+
+	private:
+		struct Sums
+		{
+			int64_t commits;
+			int64_t added;
+			int64_t removed;
+
+			Sums() : commits(0), added(0), removed(0) { }
+		};
+
+		typedef std::map<std::pair<int64_t, std::string>, Sums> Table;
+
+		void writeRows(BOStream &out) const;
+
+	private:
+		Table m_tables[NumKeys];
+};
+
+
+#endif // ROLLUPS_H_
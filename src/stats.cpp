@@ -0,0 +1,230 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: stats.cpp
+ * Runtime statistics
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/resource.h>
+
+#include "strlib.h"
+
+#include "stats.h"
+
+
+namespace
+{
+
+const char *counterNames[] = {
+	"cache_hits",
+	"cache_misses",
+	"cache_bytes_read",
+	"cache_bytes_decoded",
+	"process_spawns",
+	"queue_peak",
+	"pool_bytes",
+	"buffered_peak",
+	"memory_hits",
+	"memory_misses"
+};
+
+const char *timerNames[] = {
+	"diffstat_fetch",
+	"meta_fetch",
+	"consumer_wait",
+	"worker_idle",
+	"lua_callback"
+};
+
+// Returns a monotonic timestamp in microseconds
+inline int64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the histogram bucket for the given duration
+inline int bucket(int64_t usecs)
+{
+	int b = 0;
+	while (usecs > 0 && b < Stats::NumBuckets - 1) {
+		usecs >>= 1;
+		++b;
+	}
+	return b;
+}
+
+// Formats a duration in microseconds
+std::string duration(int64_t usecs)
+{
+	if (usecs < 10000) {
+		return str::itos(usecs) + " us";
+	} else if (usecs < 10000000) {
+		return str::itos(usecs / 1000) + " ms";
+	}
+	return str::printf("%.1f s", usecs / 1000000.0);
+}
+
+// Returns the peak resident set size of the process in kilobytes
+int64_t peakRss()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+} // anonymous namespace
+
+
+// Static variables
+std::atomic<int64_t> Stats::s_counters[Stats::NumCounters];
+Stats::Histogram Stats::s_timers[Stats::NumTimers];
+
+
+// Constructor
+Stats::Clock::Clock(Timer timer, bool enabled)
+	: m_timer(timer), m_start(enabled ? now() : -1)
+{
+}
+
+// Destructor
+Stats::Clock::~Clock()
+{
+	if (m_start >= 0) {
+		record(m_timer, now() - m_start);
+	}
+}
+
+// Raises a counter to the given value if it's lower
+void Stats::peak(Counter counter, int64_t value)
+{
+	int64_t current = s_counters[counter].load(std::memory_order_relaxed);
+	while (current < value && !s_counters[counter].compare_exchange_weak(current, value, std::memory_order_relaxed)) ;
+}
+
+// Adds a duration to a histogram
+void Stats::record(Timer timer, int64_t usecs)
+{
+	Histogram &h = s_timers[timer];
+	h.count.fetch_add(1, std::memory_order_relaxed);
+	h.total.fetch_add(usecs, std::memory_order_relaxed);
+	h.buckets[bucket(usecs)].fetch_add(1, std::memory_order_relaxed);
+	int64_t max = h.max.load(std::memory_order_relaxed);
+	while (max < usecs && !h.max.compare_exchange_weak(max, usecs, std::memory_order_relaxed)) ;
+}
+
+// Returns the value of a counter
+int64_t Stats::value(Counter counter)
+{
+	return s_counters[counter].load();
+}
+
+// Returns the number of durations recorded by a timer
+int64_t Stats::count(Timer timer)
+{
+	return s_timers[timer].count.load();
+}
+
+// Returns the sum of all durations recorded by a timer
+int64_t Stats::total(Timer timer)
+{
+	return s_timers[timer].total.load();
+}
+
+// Returns an estimate of the given percentile (0 to 1) of a timer, which
+// is the upper bound of the bucket containing it
+int64_t Stats::percentile(Timer timer, double p)
+{
+	const Histogram &h = s_timers[timer];
+	int64_t count = h.count.load(), seen = 0;
+	if (count == 0) {
+		return 0;
+	}
+	for (int i = 0; i < NumBuckets; i++) {
+		seen += h.buckets[i].load();
+		if (seen >= p * count) {
+			return std::min(h.max.load(), (int64_t(1) << i) - 1);
+		}
+	}
+	return h.max.load();
+}
+
+// Resets all counters and timers
+void Stats::reset()
+{
+	for (int i = 0; i < NumCounters; i++) {
+		s_counters[i] = 0;
+	}
+	for (int i = 0; i < NumTimers; i++) {
+		Histogram &h = s_timers[i];
+		h.count = h.total = h.max = 0;
+		for (int j = 0; j < NumBuckets; j++) {
+			h.buckets[j] = 0;
+		}
+	}
+}
+
+// Prints a human-readable summary
+void Stats::print(std::ostream &out)
+{
+	int64_t hits = value(CacheHits), misses = value(CacheMisses);
+	out << "Runtime statistics:" << std::endl;
+	out << str::printf("  %-20s %lld", "Cache hits:", (long long)hits);
+	if (hits + misses > 0) {
+		out << str::printf(" (%.1f%%)", 100.0 * hits / (hits + misses));
+	}
+	out << std::endl;
+	out << str::printf("  %-20s %lld", "Cache misses:", (long long)misses) << std::endl;
+	out << str::printf("  %-20s %lld", "Memory hits:", (long long)value(MemoryHits)) << std::endl;
+	out << str::printf("  %-20s %lld", "Memory misses:", (long long)value(MemoryMisses)) << std::endl;
+	out << str::printf("  %-20s %lld", "Cache bytes read:", (long long)value(CacheBytesRead)) << std::endl;
+	out << str::printf("  %-20s %lld", "Cache bytes decoded:", (long long)value(CacheBytesDecoded)) << std::endl;
+	out << str::printf("  %-20s %lld", "Process spawns:", (long long)value(ProcessSpawns)) << std::endl;
+	out << str::printf("  %-20s %lld", "Peak queue window:", (long long)value(QueuePeak)) << std::endl;
+	out << str::printf("  %-20s %lld kB", "Pooled memory:", (long long)value(PoolBytes) / 1024) << std::endl;
+	out << str::printf("  %-20s %lld kB", "Peak prefetched data:", (long long)value(BufferedPeak) / 1024) << std::endl;
+	out << str::printf("  %-20s %lld kB", "Peak memory usage:", (long long)peakRss()) << std::endl;
+
+	out << str::printf("  %-20s %10s %10s %10s %10s %10s %10s", "", "count", "total", "mean", "p50", "p99", "max") << std::endl;
+	for (int i = 0; i < NumTimers; i++) {
+		Timer t = Timer(i);
+		int64_t n = count(t);
+		out << str::printf("  %-20s %10lld %10s %10s %10s %10s %10s", (std::string(timerNames[i]) + ":").c_str(), (long long)n,
+			duration(total(t)).c_str(), duration(n > 0 ? total(t) / n : 0).c_str(), duration(percentile(t, 0.5)).c_str(),
+			duration(percentile(t, 0.99)).c_str(), duration(s_timers[i].max.load()).c_str()) << std::endl;
+	}
+}
+
+// Writes all counters and timers as a JSON object
+void Stats::writeJson(std::ostream &out)
+{
+	out << "{\"counters\":{";
+	for (int i = 0; i < NumCounters; i++) {
+		out << (i > 0 ? "," : "") << "\"" << counterNames[i] << "\":" << value(Counter(i));
+	}
+	out << ",\"peak_rss_kb\":" << peakRss();
+	out << "},\"timers\":{";
+	for (int i = 0; i < NumTimers; i++) {
+		Timer t = Timer(i);
+		out << (i > 0 ? "," : "") << "\"" << timerNames[i] << "\":{\"count\":" << count(t) << ",\"total_us\":" << total(t)
+			<< ",\"p50_us\":" << percentile(t, 0.5) << ",\"p90_us\":" << percentile(t, 0.9) << ",\"p99_us\":" << percentile(t, 0.99)
+			<< ",\"max_us\":" << s_timers[i].max.load() << "}";
+	}
+	out << "}}" << std::endl;
+}
@@ -0,0 +1,100 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: stats.h
+ * Runtime statistics (interface)
+ */
+
+
+#ifndef STATS_H_
+#define STATS_H_
+
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+
+/*
+ * Counters and latency histograms that are collected throughout the run
+ * and may be printed as a summary at exit. All updates are relaxed atomic
+ * operations, so they may be used from any thread. Histograms use
+ * power-of-two buckets of microseconds, so percentiles are estimates.
+ */
+class Stats
+{
+	public:
+		enum Counter {
+			CacheHits,         // Revisions or diffstats served by a cache
+			CacheMisses,       // Revisions or diffstats fetched from the repository
+			CacheBytesRead,    // Bytes of cache records that have been parsed
+			CacheBytesDecoded, // Bytes of decompressed cache records
+			ProcessSpawns,
+			QueuePeak,         // Maximum number of jobs in a queue window
+			PoolBytes,         // Memory reserved for pooled objects
+			BufferedPeak,      // Maximum number of bytes in prefetched results
+			MemoryHits,        // Revisions served from memory by a cache
+			MemoryMisses,      // Revisions that had to be read from a cache
+			NumCounters
+		};
+
+		enum Timer {
+			DiffstatFetch,     // Fetching revisions with diffstats from the repository
+			MetaFetch,         // Fetching revision meta-data from the repository
+			ConsumerWait,      // Waiting for results of prefetch jobs
+			WorkerIdle,        // Prefetch workers waiting for jobs
+			LuaCallback,       // Report callbacks during iteration
+			NumTimers
+		};
+
+		// Measures the lifetime of the object, if enabled
+		class Clock
+		{
+			public:
+				Clock(Timer timer, bool enabled = true);
+				~Clock();
+
+			private:
+				Clock(const Clock &);
+				Clock &operator=(const Clock &);
+
+				Timer m_timer;
+				int64_t m_start;
+		};
+
+		enum { NumBuckets = 40 };
+
+	public:
+		static inline void add(Counter counter, int64_t n = 1) {
+			s_counters[counter].fetch_add(n, std::memory_order_relaxed);
+		}
+		static void peak(Counter counter, int64_t value);
+		static void record(Timer timer, int64_t usecs);
+
+		static int64_t value(Counter counter);
+		static int64_t count(Timer timer);
+		static int64_t total(Timer timer);
+		static int64_t percentile(Timer timer, double p);
+		static void reset();
+
+		static void print(std::ostream &out);
+		static void writeJson(std::ostream &out);
+
+	private:
+		struct Histogram
+		{
+			std::atomic<int64_t> count, total, max;
+			std::atomic<int64_t> buckets[NumBuckets];
+		};
+
+		static std::atomic<int64_t> s_counters[NumCounters];
+		static Histogram s_timers[NumTimers];
+};
+
+
+#endif // STATS_H_
@@ -11,6 +11,8 @@
  */
 
 
+#include <algorithm>
+#include <cctype>
 #include <cstdarg>
 #include <cstdio>
 
@@ -20,6 +22,84 @@
 namespace str
 {
 
+// Returns the position of the first occurrence of token at or after pos
+size_t View::find(const View &token, size_t pos) const
+{
+	if (token.m_size == 0) {
+		return (pos <= m_size ? pos : std::string::npos);
+	}
+	while (pos + token.m_size <= m_size) {
+		const char *p = (const char *)memchr(m_data + pos, token.m_data[0], m_size - token.m_size - pos + 1);
+		if (p == NULL) {
+			break;
+		}
+		pos = p - m_data;
+		if (!memcmp(p, token.m_data, token.m_size)) {
+			return pos;
+		}
+		++pos;
+	}
+	return std::string::npos;
+}
+
+// Returns a part of the view
+View View::substr(size_t pos, size_t n) const
+{
+	if (pos > m_size) {
+		pos = m_size;
+	}
+	return View(m_data + pos, std::min(n, m_size - pos));
+}
+
+// Removes white-space characters at the beginning and end of the view
+View &View::trim()
+{
+	while (m_size > 0 && isspace((unsigned char)m_data[0])) {
+		++m_data;
+		--m_size;
+	}
+	while (m_size > 0 && isspace((unsigned char)m_data[m_size - 1])) {
+		--m_size;
+	}
+	return *this;
+}
+
+
+// Constructor
+Tokenizer::Tokenizer(const View &str, const View &token, bool trim)
+	: m_str(str), m_token(token), m_pos(0), m_trim(trim), m_done(false)
+{
+}
+
+// Returns the next field, or false if there are no more fields
+bool Tokenizer::next(View *field)
+{
+	if (m_done) {
+		return false;
+	}
+
+	if (m_token.empty()) {
+		// Single characters, or a single empty field
+		*field = m_str.substr(m_pos, 1);
+		m_done = (++m_pos >= m_str.size());
+	} else {
+		size_t pos = m_str.find(m_token, m_pos);
+		if (pos == std::string::npos) {
+			*field = m_str.substr(m_pos);
+			m_done = true;
+		} else {
+			*field = m_str.substr(m_pos, pos - m_pos);
+			m_pos = pos + m_token.size();
+		}
+	}
+
+	if (m_trim) {
+		field->trim();
+	}
+	return true;
+}
+
+
 // Removes white-space characters at the beginning and end of a string
 void trim(std::string *str)
 {
@@ -51,33 +131,24 @@ std::string trim(const std::string &str)
 std::vector<std::string> split(const std::string &str, const std::string &token, bool trim)
 {
 	std::vector<std::string> parts;
-	size_t index = 0;
-
-	if (str.length() == 0) {
-		parts.push_back(str);
-		return parts;
-	}
-
-	if (token.length() == 0) {
-		for (size_t i = 0; i < str.length(); i++) {
-			parts.push_back(trim ? str::trim(str.substr(i, 1)) : str.substr(i, 1));
-		}
-		return parts;
+	Tokenizer tok(str, token, trim);
+	View field;
+	while (tok.next(&field)) {
+		parts.push_back(field.str());
 	}
+	return parts;
+}
 
-	while (index < str.length()) {
-		size_t pos = str.find(token, index);
-		parts.push_back(trim ? str::trim(str.substr(index, pos - index)) : str.substr(index, pos - index));
-		if (pos == std::string::npos) {
-			break;
-		}
-		index = pos + token.length();
-		if (index == str.length()) {
-			parts.push_back("");
-		}
+// Split a string into at most max fields without copying them, returning
+// the number of fields
+size_t split(const View &str, const View &token, View *fields, size_t max, bool trim)
+{
+	Tokenizer tok(str, token, trim);
+	size_t n = 0;
+	while (n < max && tok.next(&fields[n])) {
+		++n;
 	}
-
-	return parts;
+	return n;
 }
 
 // Joins several strings
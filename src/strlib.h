@@ -17,6 +17,7 @@
 
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <sstream>
 #include <streambuf>
@@ -64,9 +65,81 @@ inline std::string int2str(T i) {
 }
 
 
+// Non-owning reference to a range of characters, which must outlive it
+class View
+{
+	public:
+		View() : m_data(""), m_size(0) { }
+		View(const char *data, size_t size) : m_data(data), m_size(size) { }
+		View(const char *str) : m_data(str), m_size(strlen(str)) { }
+		View(const std::string &str) : m_data(str.data()), m_size(str.length()) { }
+
+		inline const char *data() const { return m_data; }
+		inline size_t size() const { return m_size; }
+		inline bool empty() const { return m_size == 0; }
+		inline char operator[](size_t i) const { return m_data[i]; }
+		inline std::string str() const { return std::string(m_data, m_size); }
+
+		size_t find(const View &token, size_t pos = 0) const;
+		View substr(size_t pos, size_t n = std::string::npos) const;
+		View &trim();
+
+		inline bool operator==(const View &other) const {
+			return (m_size == other.m_size && !memcmp(m_data, other.m_data, m_size));
+		}
+		inline bool operator!=(const View &other) const {
+			return !(*this == other);
+		}
+
+	private:
+		const char *m_data;
+		size_t m_size;
+};
+
+// Iterates over the fields of a string that are separated by the given
+// token, without copying them. The fields are the same as the ones
+// returned by split().
+class Tokenizer
+{
+	public:
+		Tokenizer(const View &str, const View &token, bool trim = false);
+
+		bool next(View *field);
+
+	private:
+		View m_str, m_token;
+		size_t m_pos;
+		bool m_trim, m_done;
+};
+
+// Wrapper for strtol() on views
+template <typename T>
+bool stoi(const View &str, T *i, int base = 0)
+{
+	char buffer[32];
+	if (str.size() >= sizeof(buffer)) {
+		return stoi(str.str(), i, base);
+	}
+	memcpy(buffer, str.data(), str.size());
+	buffer[str.size()] = '\0';
+
+	char *end;
+	errno = 0;
+	T val = strtoll(buffer, &end, base);
+	if (errno == ERANGE || buffer == end
+	    || val > std::numeric_limits<T>::max()
+	    || val < std::numeric_limits<T>::min()) {
+		return false;
+	}
+
+	*i = (T)val;
+	return true;
+}
+
 void trim(std::string *str);
 std::string trim(const std::string &str);
 std::vector<std::string> split(const std::string &str, const std::string &token, bool trim = false);
+size_t split(const View &str, const View &token, View *fields, size_t max, bool trim = false);
 std::string join(const std::vector<std::string> &v, const std::string &c = std::string());
 std::string join(std::vector<std::string>::const_iterator start, std::vector<std::string>::const_iterator end, const std::string &c = std::string());
 std::string quote(const std::string &str);
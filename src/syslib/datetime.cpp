@@ -16,6 +16,7 @@
 #include <cstring>
 
 #include <sys/time.h>
+#include <time.h>
 
 #include "datetime.h"
 
@@ -77,6 +78,24 @@ int64_t ptime(const std::string &str, const std::string &format)
 	return mktime(&time);
 }
 
+// Returns the current time in microseconds, for measuring short durations
+int64_t usecs()
+{
+	timeval c;
+	gettimeofday(&c, NULL);
+	return int64_t(c.tv_sec) * 1000000 + c.tv_usec;
+}
+
+// Returns the CPU time used by the calling thread in microseconds
+int64_t cpuUsecs()
+{
+	timespec c;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c) != 0) {
+		return 0;
+	}
+	return int64_t(c.tv_sec) * 1000000 + c.tv_nsec / 1000;
+}
+
 } // namespace datetime
 
 } // namespace sys
@@ -41,6 +41,8 @@ class Watch
 
 
 int64_t ptime(const std::string &str, const std::string &format);
+int64_t usecs();
+int64_t cpuUsecs();
 
 } // namespace time
 
@@ -18,12 +18,21 @@
 #include <climits>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#ifdef POS_LINUX
+ #include <poll.h>
+ #include <sys/inotify.h>
+#endif
+
 #include "strlib.h"
 
+#include "parallel.h"
+
 #include "fs.h"
 
 
@@ -265,6 +274,20 @@ size_t filesize(const std::string &path)
 	return statbuf.st_size;
 }
 
+// Returns the modification time of the given file in nanoseconds
+int64_t mtime(const std::string &path)
+{
+	struct stat statbuf;
+	if (stat(path.c_str(), &statbuf) == -1) {
+		throw PEX_ERRNO();
+	}
+#ifdef POS_DARWIN
+	return int64_t(statbuf.st_mtimespec.tv_sec) * 1000000000 + statbuf.st_mtimespec.tv_nsec;
+#else
+	return int64_t(statbuf.st_mtim.tv_sec) * 1000000000 + statbuf.st_mtim.tv_nsec;
+#endif
+}
+
 // Searches the current PATH for the given program
 std::string which(const std::string &program)
 {
@@ -317,6 +340,138 @@ std::vector<std::string> ls(const std::string &path)
 	return entries;
 }
 
+
+// Constructor
+MappedFile::MappedFile()
+	: m_fd(-1), m_data(NULL), m_size(0)
+{
+}
+
+// Constructor, mapping the given file
+MappedFile::MappedFile(const std::string &path)
+	: m_fd(-1), m_data(NULL), m_size(0)
+{
+	open(path);
+}
+
+// Destructor
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+// Maps the whole file into memory
+void MappedFile::open(const std::string &path)
+{
+	close();
+
+	if ((m_fd = ::open(path.c_str(), O_RDONLY)) < 0) {
+		throw PEX_ERRNO();
+	}
+	struct stat statbuf;
+	if (fstat(m_fd, &statbuf) == -1) {
+		int err = errno;
+		close();
+		throw PEX_ERR(err);
+	}
+	m_size = statbuf.st_size;
+
+	// Empty files can't be mapped
+	if (m_size == 0) {
+		return;
+	}
+	void *data = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		int err = errno;
+		close();
+		throw PEX_ERR(err);
+	}
+	m_data = (const char *)data;
+}
+
+// Unmaps the file
+void MappedFile::close()
+{
+	if (m_data != NULL) {
+		munmap((void *)m_data, m_size);
+		m_data = NULL;
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_size = 0;
+}
+
+
+// Constructor
+Watch::Watch()
+	: m_fd(-1)
+{
+#ifdef POS_LINUX
+	if ((m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		throw PEX_ERRNO();
+	}
+#endif
+}
+
+// Destructor
+Watch::~Watch()
+{
+	if (m_fd >= 0) {
+		::close(m_fd);
+	}
+}
+
+// Returns whether changes are noticed before the timeout
+bool Watch::supported()
+{
+#ifdef POS_LINUX
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Watches the given directory for files being created, modified, deleted
+// or renamed. Adding a directory twice has no effect.
+void Watch::add(const std::string &path)
+{
+#ifdef POS_LINUX
+	if (inotify_add_watch(m_fd, path.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+		throw PEX_ERRNO();
+	}
+#else
+	(void)path;
+#endif
+}
+
+// Blocks until a watched directory changes or the timeout expires. Returns
+// false on timeout.
+bool Watch::wait(int msecs)
+{
+#ifdef POS_LINUX
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLIN;
+	int ret;
+	while ((ret = poll(&pfd, 1, msecs)) < 0 && errno == EINTR) ;
+	if (ret < 0) {
+		throw PEX_ERRNO();
+	} else if (ret == 0) {
+		return false;
+	}
+
+	// Only the fact that something changed is of interest
+	char buffer[4096];
+	while (read(m_fd, buffer, sizeof(buffer)) > 0) ;
+	return true;
+#else
+	sys::parallel::Thread::msleep(msecs);
+	return false;
+#endif
+}
+
 } // namespace fs
 
 } // namespace sys
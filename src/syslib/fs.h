@@ -15,6 +15,7 @@
 #define SYS_FS_H_
 
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -45,10 +46,57 @@ bool fileExists(const std::string &path);
 bool fileExecutable(const std::string &path);
 bool dirExists(const std::string &path);
 size_t filesize(const std::string &path);
+int64_t mtime(const std::string &path);
 std::string which(const std::string &program);
 
 std::vector<std::string> ls(const std::string &path);
 
+// Read-only memory mapping of a file
+class MappedFile
+{
+	public:
+		MappedFile();
+		MappedFile(const std::string &path);
+		~MappedFile();
+
+		void open(const std::string &path);
+		void close();
+
+		inline bool isOpen() const { return m_fd >= 0; }
+		inline const char *data() const { return m_data; }
+		inline size_t size() const { return m_size; }
+
+	private:
+		MappedFile(const MappedFile &);
+		MappedFile &operator=(const MappedFile &);
+
+	private:
+		int m_fd;
+		const char *m_data;
+		size_t m_size;
+};
+
+// Waits for changes to the entries of directories. Without file system
+// notifications (currently only on Linux), waiting always times out.
+class Watch
+{
+	public:
+		Watch();
+		~Watch();
+
+		static bool supported();
+
+		void add(const std::string &path);
+		bool wait(int msecs);
+
+	private:
+		Watch(const Watch &);
+		Watch &operator=(const Watch &);
+
+	private:
+		int m_fd;
+};
+
 } // namespace fs
 
 } // namespace sys
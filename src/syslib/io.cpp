@@ -19,16 +19,27 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
+#ifdef HAVE_POSIX_SPAWN
+ #include <spawn.h>
+#endif
 
 #include <sys/wait.h>
 
 #include "logger.h"
+#include "stats.h"
+#include "tracer.h"
 
 #include "io.h"
 
 #define MAX_ARGS 512
 
+#ifdef HAVE_POSIX_SPAWN
+extern char **environ;
+#endif
+
 
 namespace sys
 {
@@ -43,12 +54,117 @@ struct Filedes {
 	Filedes(int r = -1, int w = -1) : r(r), w(w) { }
 };
 
+#if !defined(HAVE_POSIX_SPAWN) || !defined(HAVE_PIPE2)
 static sys::parallel::Mutex forkMutex;
+#endif
+
+#ifdef HAVE_POSIX_SPAWN
+
+// Creates a pipe that won't be inherited by child processes
+static void cloexecPipe(int fds[2])
+{
+#ifdef HAVE_PIPE2
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		throw PEX_ERRNO();
+	}
+#else
+	if (pipe(fds) == -1) {
+		throw PEX_ERRNO();
+	}
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+		int err = errno;
+		close(fds[0]);
+		close(fds[1]);
+		throw PEX_ERR(err);
+	}
+#endif
+}
+
+// Spawns a process running the given command and returns file descriptors
+// for reading and writing. posix_spawn() doesn't copy the address space
+// of the application like fork() does. The pipe descriptors are created
+// with FD_CLOEXEC and only their duplicates on stdin and stdout are
+// inherited, so concurrently spawned processes won't keep other pipes
+// open. The global lock is only needed if pipes can't be created
+// atomically. If the command could not be started, the process ID is set
+// to 0.
+static Filedes forkrw(const char *cmd, const char * const *argv, int *pid = NULL, std::ios::open_mode mode = std::ios::in)
+{
+	PTRACE_SCOPE("process.spawn");
+	Stats::add(Stats::ProcessSpawns);
+#ifndef HAVE_PIPE2
+	sys::parallel::MutexLocker locker(&forkMutex);
+#endif
+
+	int rfds[2] = {-1, -1}, wfds[2] = {-1, -1};
+	if (mode & std::ios::in) {
+		cloexecPipe(rfds);
+	}
+	if (mode & std::ios::out) {
+		try {
+			cloexecPipe(wfds);
+		} catch (...) {
+			if (mode & std::ios::in) {
+				close(rfds[0]);
+				close(rfds[1]);
+			}
+			throw;
+		}
+	}
+
+	posix_spawn_file_actions_t actions;
+	int err = posix_spawn_file_actions_init(&actions);
+	if (err == 0 && (mode & std::ios::in)) {
+		err = posix_spawn_file_actions_adddup2(&actions, rfds[1], STDOUT_FILENO);
+	}
+	if (err == 0 && (mode & std::ios::out)) {
+		err = posix_spawn_file_actions_adddup2(&actions, wfds[0], STDIN_FILENO);
+	}
+
+	pid_t cpid = 0;
+	if (err == 0) {
+		err = posix_spawn(&cpid, cmd, &actions, NULL, (char * const *)argv, environ);
+		if (err != 0) {
+			// Report the error like a child process that failed to execute,
+			// so callers see the same exit code as with fork()
+			fprintf(stderr, "Error running program: %s\n", strerror(err));
+			cpid = 0;
+			err = 0;
+		}
+	}
+	posix_spawn_file_actions_destroy(&actions);
+
+	// Close unused pipe ends
+	if (mode & std::ios::in) {
+		close(rfds[1]);
+	}
+	if (mode & std::ios::out) {
+		close(wfds[0]);
+	}
+	if (err != 0) {
+		if (mode & std::ios::in) {
+			close(rfds[0]);
+		}
+		if (mode & std::ios::out) {
+			close(wfds[1]);
+		}
+		throw PEX_ERR(err);
+	}
+
+	if (pid != NULL) {
+		*pid = cpid;
+	}
+	return Filedes(rfds[0], wfds[1]);
+}
+
+#else // HAVE_POSIX_SPAWN
 
 // Forks the process, running the given command and returning file
 // descriptors for reading and writing
 static Filedes forkrw(const char *cmd, const char * const *argv, int *pid = NULL, std::ios::open_mode mode = std::ios::in)
 {
+	PTRACE_SCOPE("process.spawn");
+	Stats::add(Stats::ProcessSpawns);
 	sys::parallel::MutexLocker locker(&forkMutex);
 
 	int rfds[2] = {-1, -1}, wfds[2] = {-1, -1};
@@ -88,8 +204,8 @@ static Filedes forkrw(const char *cmd, const char * const *argv, int *pid = NULL
 		::execv(cmd, (char * const *)argv);
 		perror("Error running program");
 
-		// NOTE: Needs to be changed to _exit() if vfork() is being used above
-		exit(127);
+		// Don't run any destructors of the parent's static objects
+		_exit(127);
 	}
 
 	// Parent process: close unused pipe ends
@@ -106,6 +222,23 @@ static Filedes forkrw(const char *cmd, const char * const *argv, int *pid = NULL
 	return Filedes(rfds[0], wfds[1]);
 }
 
+#endif // HAVE_POSIX_SPAWN
+
+// Waits for a child process started by forkrw() and returns its status
+static int waitchild(int pid)
+{
+	if (pid == 0) {
+		// The program could not be started
+		return (127 << 8);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1) {
+		throw PEX_ERRNO();
+	}
+	return status;
+}
+
 
 // Checks whether the given file is a terminal
 bool isterm(FILE *f)
@@ -135,8 +268,9 @@ std::string execv(int *ret, const char *cmd, const char * const *argv)
 	}
 
 	// Wait for child process
-	if (waitpid(pid, ret, 0) == -1) {
-		throw PEX_ERRNO();
+	int status = waitchild(pid);
+	if (ret != NULL) {
+		*ret = status;
 	}
 	return result;
 }
@@ -248,15 +382,23 @@ int PopenStreambuf::close()
 
 	int status = -1;
 	if (d->pid >= 0) {
-		if (waitpid(d->pid, &status, 0) == -1) {
-			throw PEX_ERRNO();
-		}
+		status = waitchild(d->pid);
 	}
 	d->pid = -1;
 
 	return status;
 }
 
+// Terminates the process, e.g. for cancelling a long-running command.
+// Subsequent reads hit the end of the stream, and close() still has to
+// be called for collecting the process.
+void PopenStreambuf::kill()
+{
+	if (d->pid > 0) {
+		::kill(d->pid, SIGTERM);
+	}
+}
+
 // Closes the write channel, if any
 void PopenStreambuf::closeWrite()
 {
@@ -42,6 +42,7 @@ class PopenStreambuf : public std::streambuf
 
 		int close();
 		void closeWrite();
+		void kill();
 
 	private:
 		int_type underflow();
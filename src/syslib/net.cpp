@@ -0,0 +1,280 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: syslib/net.cpp
+ * Network classes
+ */
+
+
+#include "main.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "strlib.h"
+
+#include "net.h"
+
+
+namespace sys
+{
+
+namespace net
+{
+
+// Fills in the address of a UNIX domain socket
+static void unixAddress(const std::string &path, struct sockaddr_un *addr)
+{
+	memset(addr, 0x00, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (path.empty() || path.length() >= sizeof(addr->sun_path)) {
+		throw PEX(str::printf("Invalid socket path: %s", path.c_str()));
+	}
+	memcpy(addr->sun_path, path.c_str(), path.length());
+}
+
+
+// Constructor
+Socket::Socket()
+	: m_fd(-1)
+{
+
+}
+
+// Destructor
+Socket::~Socket()
+{
+	close();
+}
+
+// Connects to the given host. If timeout is positive, reads and writes
+// will fail after waiting for the given number of seconds.
+void Socket::connect(const std::string &host, int port, int timeout)
+{
+	close();
+
+	struct addrinfo hints, *addrs = NULL;
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	std::string service = str::itos(port);
+	int ret = getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs);
+	if (ret != 0) {
+		throw PEX(str::printf("Unable to resolve host %s: %s", host.c_str(), gai_strerror(ret)));
+	}
+
+	int error = 0;
+	for (struct addrinfo *addr = addrs; addr != NULL && m_fd < 0; addr = addr->ai_next) {
+		m_fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (m_fd < 0) {
+			error = errno;
+			continue;
+		}
+		if (timeout > 0) {
+			struct timeval tv;
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+			setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		}
+		if (::connect(m_fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+			error = errno;
+			::close(m_fd);
+			m_fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (m_fd < 0) {
+		throw PEX(str::printf("Unable to connect to %s:%d: %s", host.c_str(), port, PepperException::strerror(error).c_str()));
+	}
+
+	// Requests are usually small and written at once
+	int flag = 1;
+	setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+#ifdef SO_NOSIGPIPE
+	setsockopt(m_fd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif
+}
+
+// Connects to the UNIX domain socket at the given path
+void Socket::connect(const std::string &path)
+{
+	close();
+
+	struct sockaddr_un addr;
+	unixAddress(path, &addr);
+	m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_fd < 0) {
+		throw PEX_ERRNO();
+	}
+	if (::connect(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		int error = errno;
+		close();
+		throw PEX(str::printf("Unable to connect to %s: %s", path.c_str(), PepperException::strerror(error).c_str()));
+	}
+#ifdef SO_NOSIGPIPE
+	int flag = 1;
+	setsockopt(m_fd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif
+}
+
+// Closes the connection
+void Socket::close()
+{
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+// Checks whether the socket is connected
+bool Socket::isOpen() const
+{
+	return (m_fd >= 0);
+}
+
+// Writes all of the given data
+void Socket::write(const char *data, size_t length)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+	while (length > 0) {
+		ssize_t n = ::send(m_fd, data, length, flags);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			throw PEX_ERRNO();
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+// Reads up to length bytes and returns the number of bytes actually read,
+// which is 0 if the connection has been closed
+ssize_t Socket::read(char *buffer, size_t length)
+{
+	ssize_t n;
+	do {
+		n = ::recv(m_fd, buffer, length, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		throw PEX_ERRNO();
+	}
+	return n;
+}
+
+
+
+// Constructor
+Server::Server()
+	: m_fd(-1)
+{
+
+}
+
+// Destructor
+Server::~Server()
+{
+	close();
+}
+
+// Listens on the UNIX domain socket at the given path. A stale socket file
+// is removed, but the call fails if another server is listening on it.
+void Server::listen(const std::string &path)
+{
+	close();
+
+	struct sockaddr_un addr;
+	unixAddress(path, &addr);
+
+	Socket probe;
+	try {
+		probe.connect(path);
+	} catch (const PepperException &) {
+		unlink(path.c_str());
+	}
+	if (probe.isOpen()) {
+		throw PEX(str::printf("Another server is listening on %s", path.c_str()));
+	}
+
+	m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_fd < 0) {
+		throw PEX_ERRNO();
+	}
+	if (::bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(m_fd, 16) != 0) {
+		int error = errno;
+		::close(m_fd);
+		m_fd = -1;
+		throw PEX(str::printf("Unable to listen on %s: %s", path.c_str(), PepperException::strerror(error).c_str()));
+	}
+	m_path = path;
+}
+
+// Stops listening and removes the socket file
+void Server::close()
+{
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+		unlink(m_path.c_str());
+		m_path.clear();
+	}
+}
+
+// Checks whether the server is listening
+bool Server::isOpen() const
+{
+	return (m_fd >= 0);
+}
+
+// Waits for the next connection for at most timeout milliseconds, or
+// forever if timeout is negative. Returns NULL on timeouts and interrupts.
+Socket *Server::accept(int timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int ret = poll(&pfd, 1, timeout);
+	if (ret < 0 && errno != EINTR) {
+		throw PEX_ERRNO();
+	} else if (ret <= 0) {
+		return NULL;
+	}
+
+	int fd = ::accept(m_fd, NULL, NULL);
+	if (fd < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) {
+			return NULL;
+		}
+		throw PEX_ERRNO();
+	}
+	Socket *socket = new Socket();
+	socket->m_fd = fd;
+	return socket;
+}
+
+} // namespace net
+
+} // namespace sys
@@ -0,0 +1,85 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: syslib/net.h
+ * Network classes (interface)
+ */
+
+
+#ifndef SYS_NET_H_
+#define SYS_NET_H_
+
+
+#include <string>
+
+#include <sys/types.h>
+
+
+namespace sys
+{
+
+namespace net
+{
+
+class Server;
+
+// Blocking TCP or UNIX domain socket connection
+class Socket
+{
+	friend class Server;
+
+	public:
+		Socket();
+		~Socket();
+
+		void connect(const std::string &host, int port, int timeout = 0);
+		void connect(const std::string &path);
+		void close();
+		bool isOpen() const;
+
+		void write(const char *data, size_t length);
+		ssize_t read(char *buffer, size_t length);
+
+	private:
+		int m_fd;
+
+	private:
+		// Not allowed
+		Socket(const Socket &);
+		Socket &operator=(const Socket &);
+};
+
+// Listening UNIX domain socket
+class Server
+{
+	public:
+		Server();
+		~Server();
+
+		void listen(const std::string &path);
+		void close();
+		bool isOpen() const;
+
+		Socket *accept(int timeout = -1);
+
+	private:
+		int m_fd;
+		std::string m_path;
+
+	private:
+		// Not allowed
+		Server(const Server &);
+		Server &operator=(const Server &);
+};
+
+} // namespace net
+
+} // namespace sys
+
+
+#endif // SYS_NET_H_
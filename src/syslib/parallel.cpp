@@ -11,7 +11,14 @@
  */
 
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
 
 #include <unistd.h>
 
@@ -21,9 +28,12 @@
 
 #if defined(POS_BSD)
  #include <sys/sysctl.h>
+#elif defined(POS_LINUX)
+ #include <sched.h>
 #endif
 
 #include "logger.h"
+#include "pool.h"
 
 #include "parallel.h"
 
@@ -34,9 +44,116 @@ namespace sys
 namespace parallel
 {
 
+#ifdef POS_LINUX
+
+namespace
+{
+
+// Reads the first line of a file
+bool readLine(const std::string &path, std::string *line)
+{
+	std::ifstream in(path.c_str());
+	return (bool)std::getline(in, *line);
+}
+
+// Converts a CPU quota to a number of cores, rounding up
+int quotaCores(double quota, double period)
+{
+	if (quota <= 0 || period <= 0) {
+		return -1;
+	}
+	return std::max(1, (int)std::ceil(quota / period));
+}
+
+// Returns the number of cores granted by the CPU quota of the given
+// cgroup (v2) or one of its parents, or -1 if there's no quota
+int cgroup2Cores(std::string path)
+{
+	int cores = -1;
+	while (true) {
+		std::string line;
+		if (readLine("/sys/fs/cgroup" + path + "/cpu.max", &line) && line.compare(0, 3, "max") != 0) {
+			double quota = 0, period = 0;
+			if (sscanf(line.c_str(), "%lf %lf", &quota, &period) == 2) {
+				int n = quotaCores(quota, period);
+				if (n > 0 && (cores < 0 || n < cores)) {
+					cores = n;
+				}
+			}
+		}
+		if (path.empty() || path == "/") {
+			break;
+		}
+		path = path.substr(0, path.rfind('/'));
+	}
+	return cores;
+}
+
+// Returns the number of cores granted by the CFS quota of the given
+// cgroup (v1) in the given hierarchy, or -1 if there's no quota
+int cgroup1Cores(const std::string &hierarchy, const std::string &path)
+{
+	// The cgroup path is relative to the mount point, which is the
+	// cgroup itself in most containers
+	const char *dirs[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpuacct,cpu" };
+	std::string candidates[8];
+	size_t n = 0;
+	candidates[n++] = "/sys/fs/cgroup/" + hierarchy + path;
+	candidates[n++] = "/sys/fs/cgroup/" + hierarchy;
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		candidates[n++] = dirs[i] + path;
+		candidates[n++] = dirs[i];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		std::string quota, period;
+		if (readLine(candidates[i] + "/cpu.cfs_quota_us", &quota) && readLine(candidates[i] + "/cpu.cfs_period_us", &period)) {
+			return quotaCores(atof(quota.c_str()), atof(period.c_str()));
+		}
+	}
+	return -1;
+}
+
+// Returns the number of cores granted by the CPU quota of the cgroup
+// of this process, or -1 if there's no quota
+int cgroupCores()
+{
+	std::ifstream in("/proc/self/cgroup");
+	std::string line;
+	int cores = -1;
+	while (std::getline(in, line)) {
+		// Lines are "<id>:<controllers>:<path>"
+		size_t a = line.find(':'), b = (a == std::string::npos ? a : line.find(':', a + 1));
+		if (b == std::string::npos) {
+			continue;
+		}
+		std::string controllers = line.substr(a + 1, b - a - 1), path = line.substr(b + 1);
+		if (path == "/") {
+			path.clear();
+		}
+
+		int n = -1;
+		if (controllers.empty()) {
+			n = cgroup2Cores(path);
+		} else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+			n = cgroup1Cores(controllers, path);
+		}
+		if (n > 0 && (cores < 0 || n < cores)) {
+			cores = n;
+		}
+	}
+	return cores;
+}
+
+} // anonymous namespace
+
+#endif // POS_LINUX
+
+
 // Returns the ideal number of threads, based on the system's CPU resources
 // This function is mainly from Qt, version 4.8, but the more exotic systems
-// will fall back to '1'
+// will fall back to '1'. On Linux, the CPU affinity mask and cgroup CPU
+// quotas (e.g. of containers) are respected.
 int idealThreadCount()
 {
 	int cores = 1;
@@ -51,6 +168,17 @@ int idealThreadCount()
 	}
 #elif defined(POS_LINUX)
 	cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+ #ifdef CPU_COUNT
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+		cores = std::min(cores > 0 ? cores : CPU_COUNT(&set), CPU_COUNT(&set));
+	}
+ #endif
+	int quota = cgroupCores();
+	if (quota > 0 && (cores <= 0 || quota < cores)) {
+		cores = quota;
+	}
 #elif defined(POS_WIN)
 	SYSTEM_INFO sysinfo;
 	GetSystemInfo(&sysinfo);
@@ -259,6 +387,10 @@ void Thread::cleanup(void *obj)
 {
 	Thread *thr = reinterpret_cast<Thread *>(obj);
 
+	// Hand back the pool's free lists now, as thread-local destructors only
+	// run after waiting threads have been woken up
+	Pool::flush();
+
 	thr->m_mutex.lock();
 	thr->m_running = 0;
 	thr->m_mutex.unlock();
@@ -308,6 +440,27 @@ void WaitCondition::wait(Mutex *mutex)
 	}
 }
 
+// Blocks the current thread and waits for a signal for at most the given
+// number of milliseconds. Returns false on timeouts.
+bool WaitCondition::wait(Mutex *mutex, int msecs)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msecs / 1000;
+	ts.tv_nsec += (msecs % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	int ret = pthread_cond_timedwait(&m_pcond, &mutex->m_pmx, &ts);
+	switch (ret) {
+		case 0: return true;
+		case ETIMEDOUT: return false;
+		default: throw PEX_ERR(ret);
+	}
+}
+
 // Wakes a single waiting thread
 void WaitCondition::wake()
 {
@@ -381,6 +534,244 @@ void Semaphore::release(int n)
 	m_mutex.unlock();
 }
 
+
+namespace
+{
+
+// The pool and worker index of the current thread, if any
+thread_local ThreadPool *currentPool = NULL;
+thread_local int currentWorker = -1;
+
+Mutex globalMutex;
+ThreadPool *globalPool = NULL;
+int globalPoolSize = 0;
+
+} // anonymous namespace
+
+
+// Worker thread of a thread pool
+class ThreadPool::Worker : public Thread
+{
+	public:
+		Worker(ThreadPool *pool, int index) : m_pool(pool), m_index(index) { }
+
+		Mutex mutex;
+		std::deque<Task *> tasks;
+
+	protected:
+		void run() {
+			currentPool = m_pool;
+			currentWorker = m_index;
+			while (m_pool->reserve(true)) {
+				m_pool->take(m_index)->execute();
+			}
+		}
+
+	private:
+		ThreadPool *m_pool;
+		int m_index;
+};
+
+
+// Constructor
+Task::Task()
+	: m_pool(NULL), m_done(false)
+{
+
+}
+
+// Destructor
+Task::~Task()
+{
+
+}
+
+// Blocks until the task has been executed, rethrowing any exception that
+// has been thrown by it. Pool workers execute other tasks while waiting.
+void Task::wait()
+{
+	int worker = (m_pool != NULL ? ThreadPool::current(m_pool) : -1);
+	while (worker >= 0 && !done() && m_pool->reserve(false)) {
+		m_pool->take(worker)->execute();
+	}
+
+	m_mutex.lock();
+	while (!m_done) {
+		m_cond.wait(&m_mutex);
+	}
+	m_mutex.unlock();
+
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+}
+
+// Returns whether the task has been executed
+bool Task::done()
+{
+	m_mutex.lock();
+	bool d = m_done;
+	m_mutex.unlock();
+	return d;
+}
+
+// Runs the task and wakes up waiting threads. The task may be deleted by
+// another thread as soon as it's done, so it isn't accessed afterwards.
+void Task::execute()
+{
+	try {
+		run();
+	} catch (...) {
+		m_error = std::current_exception();
+	}
+
+	std::shared_ptr<Task> self = detach();
+	m_mutex.lock();
+	m_done = true;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+}
+
+
+// Constructor
+ThreadPool::ThreadPool(int size)
+	: m_pending(0), m_next(0), m_stop(false)
+{
+	size = std::max(1, size);
+	for (int i = 0; i < size; i++) {
+		m_workers.push_back(new Worker(this, i));
+	}
+	for (int i = 0; i < size; i++) {
+		m_workers[i]->start();
+	}
+}
+
+// Destructor, waits until all submitted tasks have been executed
+ThreadPool::~ThreadPool()
+{
+	m_mutex.lock();
+	m_stop = true;
+	m_cond.wakeAll();
+	m_mutex.unlock();
+
+	for (size_t i = 0; i < m_workers.size(); i++) {
+		m_workers[i]->wait();
+		delete m_workers[i];
+	}
+}
+
+// Returns the number of worker threads
+int ThreadPool::size() const
+{
+	return (int)m_workers.size();
+}
+
+// Queues a task for execution. The task must stay valid until it's done.
+void ThreadPool::submit(Task *task)
+{
+	task->m_pool = this;
+	task->m_done = false;
+	task->m_error = std::exception_ptr();
+
+	int worker = current(this);
+	if (worker < 0) {
+		m_mutex.lock();
+		worker = (int)(m_next++ % m_workers.size());
+		m_mutex.unlock();
+	}
+
+	Worker *w = m_workers[worker];
+	w->mutex.lock();
+	w->tasks.push_back(task);
+	w->mutex.unlock();
+
+	m_mutex.lock();
+	++m_pending;
+	m_cond.wake();
+	m_mutex.unlock();
+}
+
+// Returns the global thread pool, creating it if necessary
+ThreadPool *ThreadPool::global()
+{
+	MutexLocker locker(&globalMutex);
+	if (globalPool == NULL) {
+		int size = (globalPoolSize > 0 ? globalPoolSize : std::max(1, idealThreadCount()));
+		PDEBUG << "Starting global thread pool with " << size << " workers" << endl;
+		globalPool = new ThreadPool(size);
+	}
+	return globalPool;
+}
+
+// Sets the number of workers of the global thread pool. This has no effect
+// once the pool has been started.
+void ThreadPool::setGlobalSize(int size)
+{
+	MutexLocker locker(&globalMutex);
+	if (globalPool != NULL) {
+		PDEBUG << "Global thread pool is already running, ignoring new size " << size << endl;
+		return;
+	}
+	globalPoolSize = size;
+}
+
+// Returns the number of workers of the global thread pool
+int ThreadPool::globalSize()
+{
+	MutexLocker locker(&globalMutex);
+	if (globalPool != NULL) {
+		return globalPool->size();
+	}
+	return (globalPoolSize > 0 ? globalPoolSize : std::max(1, idealThreadCount()));
+}
+
+// Removes a reserved task from the queues, preferring the newest task of
+// the given worker and the oldest tasks of the others otherwise
+Task *ThreadPool::take(int worker)
+{
+	size_t n = m_workers.size();
+	while (true) {
+		for (size_t i = 0; i < n; i++) {
+			Worker *w = m_workers[(worker + i) % n];
+			MutexLocker locker(&w->mutex);
+			if (!w->tasks.empty()) {
+				Task *task;
+				if (i == 0) {
+					task = w->tasks.back();
+					w->tasks.pop_back();
+				} else {
+					task = w->tasks.front();
+					w->tasks.pop_front();
+				}
+				return task;
+			}
+		}
+	}
+}
+
+// Reserves a queued task for the calling worker, optionally blocking until
+// there is one. Returns false if there is no task or if the pool is being
+// destroyed and all tasks have been executed.
+bool ThreadPool::reserve(bool block)
+{
+	MutexLocker locker(&m_mutex);
+	while (block && m_pending == 0 && !m_stop) {
+		m_cond.wait(&m_mutex);
+	}
+	if (m_pending == 0) {
+		return false;
+	}
+	--m_pending;
+	return true;
+}
+
+// Returns the index of the calling thread in the given pool, or -1 if it
+// isn't one of its workers
+int ThreadPool::current(ThreadPool *pool)
+{
+	return (currentPool == pool ? currentWorker : -1);
+}
+
 } // namespace parallel
 
 } // namespace sys
@@ -15,7 +15,12 @@
 #define SYS_PARALLEL_H_
 
 
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -67,6 +72,7 @@ class WaitCondition
 		~WaitCondition();
 
 		void wait(Mutex *mutex);
+		bool wait(Mutex *mutex, int msecs);
 		void wake();
 		void wakeAll();
 
@@ -121,6 +127,129 @@ class Thread
 };
 
 
+class ThreadPool;
+
+// Unit of work that is executed by a thread pool
+class Task
+{
+	friend class ThreadPool;
+
+	public:
+		Task();
+		virtual ~Task();
+
+		void wait();
+		bool done();
+
+	protected:
+		virtual void run() = 0;
+		virtual std::shared_ptr<Task> detach() { return std::shared_ptr<Task>(); }
+
+	private:
+		void execute();
+
+	private:
+		ThreadPool *m_pool;
+		bool m_done;
+		std::exception_ptr m_error;
+		Mutex m_mutex;
+		WaitCondition m_cond;
+};
+
+
+// Result of a function that is executed by a thread pool
+template <typename T>
+class Future
+{
+	friend class ThreadPool;
+
+	private:
+		class State : public Task
+		{
+			public:
+				State(const std::function<T()> &func) : func(func) { }
+
+				std::function<T()> func;
+				T result;
+				std::shared_ptr<State> self; // Released after execution
+
+			protected:
+				void run() { result = func(); }
+				std::shared_ptr<Task> detach() { std::shared_ptr<Task> s = self; self.reset(); return s; }
+		};
+
+	public:
+		Future() { }
+
+		bool valid() const { return (bool)m_state; }
+		void wait() { m_state->wait(); }
+		T get() { m_state->wait(); return m_state->result; }
+
+	private:
+		std::shared_ptr<State> m_state;
+};
+
+
+/*
+ * Work-stealing thread pool. Every worker has its own task queue: tasks
+ * submitted by a worker are put into its own queue and are executed in
+ * LIFO order, while idle workers steal the oldest tasks from the queues of
+ * others. Tasks submitted by other threads are distributed round-robin.
+ * Workers waiting for a task execute other tasks in the meantime, so tasks
+ * may wait for tasks they have submitted themselves.
+ *
+ * The global pool is shared by the whole program. Tasks shouldn't block
+ * on I/O for a long time, since that takes capacity from everyone else.
+ */
+class ThreadPool
+{
+	friend class Task;
+
+	public:
+		ThreadPool(int size);
+		~ThreadPool();
+
+		int size() const;
+
+		void submit(Task *task);
+		template <typename T>
+		Future<T> submit(const std::function<T()> &func);
+
+		static ThreadPool *global();
+		static void setGlobalSize(int size);
+		static int globalSize();
+
+	private:
+		class Worker;
+
+		ThreadPool(const ThreadPool &);
+		ThreadPool &operator=(const ThreadPool &);
+
+		Task *take(int worker);
+		bool reserve(bool block);
+		static int current(ThreadPool *pool);
+
+	private:
+		std::vector<Worker *> m_workers;
+		Mutex m_mutex;
+		WaitCondition m_cond;
+		size_t m_pending; // Queued tasks that haven't been reserved by a worker
+		size_t m_next; // For distributing tasks from other threads
+		bool m_stop;
+};
+
+// Submits a function to the pool and returns its future result
+template <typename T>
+Future<T> ThreadPool::submit(const std::function<T()> &func)
+{
+	Future<T> future;
+	future.m_state = std::make_shared<typename Future<T>::State>(func);
+	future.m_state->self = future.m_state;
+	submit(future.m_state.get());
+	return future;
+}
+
+
 
 } // namespace parallel
 
@@ -0,0 +1,145 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tracer.cpp
+ * Timeline tracing facility
+ */
+
+
+#include "main.h"
+
+#include <chrono>
+#include <fstream>
+
+#include "strlib.h"
+
+#include "tracer.h"
+
+
+// Event ring buffer of a single thread
+struct Tracer::Buffer
+{
+	struct Event
+	{
+		const char *name;
+		int64_t start, end;
+	};
+
+	int tid;
+	std::vector<Event> events;
+	std::atomic<size_t> count;
+
+	Buffer(int tid) : tid(tid), events(BufferSize), count(0) { }
+};
+
+
+// Static variables
+std::atomic<bool> Tracer::s_enabled(false);
+sys::parallel::Mutex Tracer::s_mutex;
+std::vector<Tracer::Buffer *> *Tracer::s_buffers = NULL;
+int64_t Tracer::s_epoch = 0;
+
+
+// Starts recording events
+void Tracer::start()
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	if (s_epoch == 0) {
+		s_epoch = now();
+	}
+	s_enabled = true;
+}
+
+// Stops recording events
+void Tracer::stop()
+{
+	s_enabled = false;
+}
+
+// Drops all recorded events
+void Tracer::clear()
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	for (size_t i = 0; s_buffers != NULL && i < s_buffers->size(); i++) {
+		(*s_buffers)[i]->count = 0;
+	}
+	s_epoch = now();
+}
+
+// Returns a monotonic timestamp in microseconds
+int64_t Tracer::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records an event for the calling thread
+void Tracer::record(const char *name, int64_t start, int64_t end)
+{
+	Buffer *b = buffer();
+	size_t n = b->count.load(std::memory_order_relaxed);
+	Buffer::Event &e = b->events[n % BufferSize];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	b->count.store(n + 1, std::memory_order_release);
+}
+
+// Writes all recorded events as a JSON trace
+void Tracer::write(std::ostream &out)
+{
+	sys::parallel::MutexLocker locker(&s_mutex);
+	out << "{\"traceEvents\":[";
+	bool first = true;
+	for (size_t i = 0; s_buffers != NULL && i < s_buffers->size(); i++) {
+		Buffer *b = (*s_buffers)[i];
+		size_t count = b->count.load(std::memory_order_acquire);
+		if (count == 0) {
+			continue;
+		}
+
+		out << (first ? "\n" : ",\n");
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":\"" << "thread " << b->tid << "\"}}";
+		first = false;
+
+		for (size_t j = (count > BufferSize ? count - BufferSize : 0); j < count; j++) {
+			const Buffer::Event &e = b->events[j % BufferSize];
+			out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+				<< ",\"ts\":" << (e.start - s_epoch) << ",\"dur\":" << (e.end - e.start) << "}";
+		}
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
+
+// Writes all recorded events to the given file
+void Tracer::save(const std::string &path)
+{
+	std::ofstream out(path.c_str());
+	if (!out.good()) {
+		throw PEX(str::printf("Unable to open trace file %s for writing", path.c_str()));
+	}
+	write(out);
+	out.close();
+	if (out.fail()) {
+		throw PEX(str::printf("Unable to write trace file %s", path.c_str()));
+	}
+}
+
+// Returns the buffer of the calling thread, allocating it if necessary
+Tracer::Buffer *Tracer::buffer()
+{
+	static thread_local Buffer *b = NULL;
+	if (b == NULL) {
+		sys::parallel::MutexLocker locker(&s_mutex);
+		if (s_buffers == NULL) {
+			s_buffers = new std::vector<Buffer *>();
+		}
+		b = new Buffer(s_buffers->size() + 1);
+		s_buffers->push_back(b);
+	}
+	return b;
+}
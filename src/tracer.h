@@ -0,0 +1,91 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tracer.h
+ * Timeline tracing facility (interface)
+ */
+
+
+#ifndef TRACER_H_
+#define TRACER_H_
+
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "syslib/parallel.h"
+
+// Easy tracing of the enclosing scope
+#define PTRACE_SCOPE_CAT2(a, b) a##b
+#define PTRACE_SCOPE_CAT(a, b) PTRACE_SCOPE_CAT2(a, b)
+#define PTRACE_SCOPE(name) Tracer::Scope PTRACE_SCOPE_CAT(_traceScope, __LINE__)(name)
+
+
+/*
+ * Records the time spent in scopes on the hot paths and writes a timeline
+ * in the Chrome trace event format, which can be viewed with
+ * chrome://tracing or Perfetto.
+ *
+ * Every thread records its events into a ring buffer of its own, so
+ * recording doesn't need any locking. If a buffer is full, the oldest
+ * events of the thread are overwritten. Scope names must be string
+ * literals. If tracing is disabled, a scope costs a single atomic load.
+ */
+class Tracer
+{
+	public:
+		class Scope
+		{
+			public:
+				inline Scope(const char *name)
+					: m_name(name), m_start(Tracer::enabled() ? Tracer::now() : -1) { }
+				inline ~Scope() {
+					if (m_start >= 0) {
+						Tracer::record(m_name, m_start, Tracer::now());
+					}
+				}
+
+			private:
+				Scope(const Scope &);
+				Scope &operator=(const Scope &);
+
+				const char *m_name;
+				int64_t m_start;
+		};
+
+		// Number of events per thread
+		enum { BufferSize = 32768 };
+
+	public:
+		static void start();
+		static void stop();
+		static void clear();
+		static inline bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+		static int64_t now();
+		static void record(const char *name, int64_t start, int64_t end);
+
+		static void write(std::ostream &out);
+		static void save(const std::string &path);
+
+	private:
+		struct Buffer;
+		static Buffer *buffer();
+
+	private:
+		static std::atomic<bool> s_enabled;
+		static sys::parallel::Mutex s_mutex;
+		static std::vector<Buffer *> *s_buffers; // Kept until exit, since threads may have finished
+		static int64_t s_epoch;
+};
+
+
+#endif // TRACER_H_
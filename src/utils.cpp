@@ -13,13 +13,19 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 
 #ifdef HAVE_LIBZ
  #include <zlib.h>
 #endif
+#if defined(__aarch64__) && defined(__linux__)
+ #include <asm/hwcap.h>
+ #include <sys/auxv.h>
+#endif
 
+#include "logger.h"
 #include "strlib.h"
 
 #include "utils.h"
@@ -92,62 +98,332 @@ std::vector<char> uncompress(const std::vector<char> &data)
 }
 
 
-// CRC32 checksum, implementation from http://c.snippets.org/snip_lister.php?fname=crc_32.c
-static uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+// CRC checksums, computed eight bytes at a time using the slicing-by-8
+// technique. CRC-32C is computed by the CPU if it has instructions for it.
+namespace
+{
+
+#define CRC32_POLY 0xEDB88320 // Reversed polynomials
+#define CRC32C_POLY 0x82F63B78
+
+typedef uint32_t (*CrcFunction)(uint32_t crc, const unsigned char *p, size_t len);
+
+// Lookup tables for the slicing-by-8 algorithm
+struct CrcTables
+{
+	uint32_t t[8][256];
+
+	CrcTables(uint32_t poly) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int j = 0; j < 8; j++) {
+				c = (c & 1) ? (poly ^ (c >> 1)) : (c >> 1);
+			}
+			t[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int j = 1; j < 8; j++) {
+				t[j][i] = (t[j-1][i] >> 8) ^ t[0][t[j-1][i] & 0xFF];
+			}
+		}
+	}
 };
 
-#define UPDC32(octet,crc) (crc_32_tab[((crc) ^ ((BYTE)octet)) & 0xff] ^ ((crc) >> 8))
+const CrcTables crc32Tables(CRC32_POLY);
+const CrcTables crc32cTables(CRC32C_POLY);
+
+// Reads a little-endian 32-bit integer
+inline uint32_t readle32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+#ifdef WORDS_BIGENDIAN
+	v = bswap(v);
+#endif
+	return v;
+}
+
+// Updates the CRC using the given tables
+inline uint32_t crcSlicing8(const CrcTables &tables, uint32_t crc, const unsigned char *p, size_t len)
+{
+	const uint32_t (*t)[256] = tables.t;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint32_t a = readle32(p) ^ crc, b = readle32(p + 4);
+		crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF] ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+			^ t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF] ^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+	}
+	for (; len > 0; p++, len--) {
+		crc = t[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Software implementation of CRC-32C
+uint32_t crc32cTable(uint32_t crc, const unsigned char *p, size_t len)
+{
+	return crcSlicing8(crc32cTables, crc, p, len);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+// CRC-32C using the SSE 4.2 instructions
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; p++, len--) {
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	}
+	uint64_t c = crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = (uint32_t)c;
+	for (; len > 0; p++, len--) {
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	}
+	return crc;
+}
+
+// Checks whether the CPU supports SSE 4.2
+bool hardwareCrc()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+
+// CRC-32C using the ARMv8 CRC32 instructions
+__attribute__((target("+crc")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; p++, len--) {
+		crc = __builtin_aarch64_crc32cb(crc, *p);
+	}
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __builtin_aarch64_crc32cx(crc, v);
+	}
+	for (; len > 0; p++, len--) {
+		crc = __builtin_aarch64_crc32cb(crc, *p);
+	}
+	return crc;
+}
+
+// Checks whether the CPU supports the CRC32 instructions
+bool hardwareCrc()
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#else
+
+#define crc32cHardware crc32cTable
+
+// No hardware support on this platform
+bool hardwareCrc()
+{
+	return false;
+}
+
+#endif
+
+// Returns the fastest CRC-32C implementation on this machine
+CrcFunction crc32cFunction()
+{
+	if (hardwareCrc()) {
+		PDEBUG << "Using hardware CRC-32C" << endl;
+		return &crc32cHardware;
+	}
+	return &crc32cTable;
+}
+
+} // anonymous namespace
 
+// Standard CRC-32 checksum (as used by zlib)
 uint32_t crc32(const char *data, size_t len)
 {
-	register uint32_t oldcrc32 = 0xFFFFFFFF;
+	return ~crcSlicing8(crc32Tables, 0xFFFFFFFF, (const unsigned char *)data, len);
+}
+
+// CRC-32C (Castagnoli) checksum
+uint32_t crc32c(const char *data, size_t len)
+{
+	static const CrcFunction f = crc32cFunction();
+	return ~f(0xFFFFFFFF, (const unsigned char *)data, len);
+}
+
+// CRC-32C checksum, computed without hardware support
+uint32_t crc32cSoftware(const char *data, size_t len)
+{
+	return ~crc32cTable(0xFFFFFFFF, (const unsigned char *)data, len);
+}
+
+// SHA-1 implementation following RFC 3174
+namespace
+{
+
+inline uint32_t rol(uint32_t value, int bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+void sha1Block(uint32_t *h, const unsigned char *block)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t(block[4*i]) << 24) | (uint32_t(block[4*i+1]) << 16) | (uint32_t(block[4*i+2]) << 8) | uint32_t(block[4*i+3]);
+	}
+	for (int i = 16; i < 80; i++) {
+		w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	}
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d); k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d; k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d; k = 0xCA62C1D6;
+		}
+		uint32_t t = rol(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = rol(b, 30); b = a; a = t;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+} // anonymous namespace
+
+void sha1(const char *data, size_t len, unsigned char *digest)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+	const unsigned char *p = (const unsigned char *)data;
+	size_t n = len;
+	while (n >= 64) {
+		sha1Block(h, p);
+		p += 64; n -= 64;
+	}
+
+	// Padding: a single 1 bit, zeros and the message length in bits
+	unsigned char tail[128];
+	memset(tail, 0x00, sizeof(tail));
+	memcpy(tail, p, n);
+	tail[n] = 0x80;
+	size_t tlen = (n < 56 ? 64 : 128);
+	uint64_t bits = uint64_t(len) * 8;
+	for (int i = 0; i < 8; i++) {
+		tail[tlen-1-i] = (unsigned char)(bits >> (8*i));
+	}
+	sha1Block(h, tail);
+	if (tlen == 128) {
+		sha1Block(h, tail + 64);
+	}
+
+	for (int i = 0; i < 5; i++) {
+		digest[4*i] = (unsigned char)(h[i] >> 24);
+		digest[4*i+1] = (unsigned char)(h[i] >> 16);
+		digest[4*i+2] = (unsigned char)(h[i] >> 8);
+		digest[4*i+3] = (unsigned char)h[i];
+	}
+}
+
+// Counts the newline characters in the given data. Each word is compared
+// against a word of newlines, and the bytes that became zero are counted.
+size_t countNewlines(const char *data, size_t len)
+{
+	const uint64_t newlines = 0x0A0A0A0A0A0A0A0AULL, low = 0x7F7F7F7F7F7F7F7FULL;
+	size_t count = 0;
+	while (len >= 8) {
+		uint64_t x;
+		memcpy(&x, data, 8);
+		x ^= newlines;
+		// The high bit of each byte is set iff the byte is zero, and the
+		// multiplication sums up these bits in the highest byte
+		uint64_t y = ~(((x & low) + low) | x | low);
+		count += ((y >> 7) * 0x0101010101010101ULL) >> 56;
+		data += 8; len -= 8;
+	}
 	for (size_t i = 0; i < len; i++) {
-		oldcrc32 = (crc_32_tab[((oldcrc32) ^ ((char)data[i])) & 0xFF] ^ ((oldcrc32) >> 8));
+		count += (data[i] == '\n');
+	}
+	return count;
+}
+
+// Adds the next chunk of the file contents
+void LineCounter::feed(const char *data, size_t len)
+{
+	if (len == 0 || m_binary) {
+		return;
+	}
+	if (m_length < 8000 && memchr(data, '\0', std::min(len, size_t(8000 - m_length))) != NULL) {
+		m_binary = true;
+		return;
+	}
+	m_newlines += countNewlines(data, len);
+	m_length += len;
+	m_last = data[len-1];
+}
+
+// Returns the number of lines of the file
+uint64_t LineCounter::lines() const
+{
+	if (m_binary) {
+		return 0;
+	}
+	return m_newlines + (m_last != '\n' ? 1 : 0);
+}
+
+// Selects the first, last, minimum and maximum value of each of the given
+// number of equally wide key intervals. A line through the selected points
+// looks the same as one through all points if there is an interval for
+// each pixel. All indices are returned if the keys are not sorted.
+std::vector<size_t> downsample(const std::vector<double> &keys, const std::vector<double> &values, size_t buckets)
+{
+	size_t n = std::min(keys.size(), values.size());
+	std::vector<size_t> indices;
+	if (buckets > 0 && n > 4 * buckets && keys[n-1] > keys[0]) {
+		double scale = buckets / (keys[n-1] - keys[0]);
+		size_t start = 0, min = 0, max = 0, bucket = 0;
+		bool sorted = true;
+		for (size_t i = 1; i <= n && sorted; i++) {
+			size_t b = buckets;
+			if (i < n) {
+				sorted = (keys[i] >= keys[i-1]);
+				b = std::min(size_t((keys[i] - keys[0]) * scale), buckets - 1);
+			}
+			if (b == bucket) {
+				if (values[i] < values[min]) min = i;
+				if (values[i] > values[max]) max = i;
+				continue;
+			}
+
+			size_t selected[4] = {start, std::min(min, max), std::max(min, max), i - 1};
+			for (int j = 0; j < 4; j++) {
+				if (indices.empty() || selected[j] > indices.back()) {
+					indices.push_back(selected[j]);
+				}
+			}
+			start = min = max = i;
+			bucket = b;
+		}
+		if (sorted) {
+			return indices;
+		}
+		indices.clear();
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		indices.push_back(i);
 	}
-	return ~oldcrc32;
+	return indices;
 }
 
 } // namespace utils
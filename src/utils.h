@@ -37,6 +37,40 @@ inline uint32_t crc32(const std::vector<char> &data) {
 	return crc32(&data[0], data.size());
 }
 
+// CRC-32C checksums use the CRC instructions of the CPU if available
+uint32_t crc32c(const char *data, size_t len);
+inline uint32_t crc32c(const std::vector<char> &data) {
+	return crc32c(&data[0], data.size());
+}
+uint32_t crc32cSoftware(const char *data, size_t len);
+
+// Writes the 20-byte SHA-1 digest of the given data to digest
+void sha1(const char *data, size_t len, unsigned char *digest);
+
+// Counts the newline characters in the given data, eight bytes at a time
+size_t countNewlines(const char *data, size_t len);
+
+// Counts the lines of a file whose contents are fed in chunks. A last
+// line without a newline is counted, too. Files with NUL bytes at the
+// beginning are considered to be binary and have no lines, like git's
+// heuristic does.
+class LineCounter
+{
+	public:
+		LineCounter() : m_newlines(0), m_length(0), m_last('\n'), m_binary(false) { }
+
+		void feed(const char *data, size_t len);
+		uint64_t lines() const;
+
+	private:
+		uint64_t m_newlines, m_length;
+		char m_last;
+		bool m_binary;
+};
+
+// Returns the indices of the points to keep for rendering a line chart
+std::vector<size_t> downsample(const std::vector<double> &keys, const std::vector<double> &values, size_t buckets);
+
 } // namespace utils
 
 
@@ -0,0 +1,104 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: watcher.cpp
+ * Waiting for new revisions
+ */
+
+
+#include "main.h"
+
+#include <vector>
+
+#include "backend.h"
+#include "logger.h"
+
+#include "syslib/parallel.h"
+
+#include "watcher.h"
+
+
+// Constructor. The current head is recorded, so changes made while the
+// first reports are running will be noticed.
+Watcher::Watcher(Backend *backend, const std::string &branch, int interval)
+	: m_backend(backend), m_branch(branch), m_interval(interval)
+{
+	if (sys::fs::Watch::supported() && !m_backend->watchPaths().empty()) {
+		try {
+			m_watch.reset(new sys::fs::Watch());
+			watch();
+		} catch (const PepperException &ex) {
+			Logger::warn() << "Warning: Unable to watch the repository (" << ex.what() << "), polling every " << m_interval << " seconds" << endl;
+			m_watch.reset();
+		}
+	}
+	m_head = fetchHead();
+}
+
+// Returns the last known head of the branch
+std::string Watcher::head() const
+{
+	return m_head;
+}
+
+// Blocks until the head of the branch changes and returns the new head
+std::string Watcher::wait()
+{
+	while (true) {
+		if (m_watch) {
+			if (m_watch->wait(m_interval * 1000)) {
+				// Updates usually touch several files, e.g. lock files,
+				// reflogs and the ref itself
+				while (m_watch->wait(Settle)) ;
+			}
+		} else {
+			sys::parallel::Thread::msleep(m_interval * 1000);
+		}
+
+		std::string head = fetchHead();
+		if (head != m_head) {
+			PDEBUG << "Head of branch '" << m_branch << "' moved from " << m_head << " to " << head << endl;
+			m_head = head;
+			return head;
+		}
+
+		if (m_watch) {
+			// New directories may have been created for refs
+			try {
+				watch();
+			} catch (const PepperException &ex) {
+				PDEBUG << "Unable to update watched directories: " << ex.what() << endl;
+			}
+		}
+	}
+}
+
+// Adds the backend's directories to the watch
+void Watcher::watch()
+{
+	std::vector<std::string> paths = m_backend->watchPaths();
+	for (size_t i = 0; i < paths.size(); i++) {
+		m_watch->add(paths[i]);
+	}
+}
+
+// Reads the current head of the branch. Backends may keep refs for the
+// duration of a run, so the lookup is wrapped like one.
+std::string Watcher::fetchHead()
+{
+	try {
+		m_backend->open();
+		std::string head = m_backend->head(m_branch);
+		m_backend->close();
+		return head;
+	} catch (const PepperException &ex) {
+		m_backend->close();
+		Logger::warn() << "Warning: Unable to retrieve head of branch '" << m_branch << "': " << ex.what() << endl;
+		return m_head;
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: watcher.h
+ * Waiting for new revisions (interface)
+ */
+
+
+#ifndef WATCHER_H_
+#define WATCHER_H_
+
+
+#include <memory>
+#include <string>
+
+#include "syslib/fs.h"
+
+class Backend;
+
+
+/*
+ * Waits until the head of a branch changes. If the backend names local
+ * directories that change along with the refs, they are watched for file
+ * system notifications and the head is only checked after a change, or
+ * after the poll interval as a fallback. Otherwise, the head is checked
+ * periodically.
+ */
+class Watcher
+{
+	public:
+		enum {
+			Settle = 250 // Time in milliseconds without further changes before checking the head
+		};
+
+	public:
+		Watcher(Backend *backend, const std::string &branch, int interval);
+
+		std::string head() const;
+		std::string wait();
+
+	private:
+		void watch();
+		std::string fetchHead();
+
+	private:
+		Backend *m_backend;
+		std::string m_branch;
+		int m_interval; // Seconds
+		std::string m_head;
+		std::unique_ptr<sys::fs::Watch> m_watch;
+};
+
+
+#endif // WATCHER_H_
@@ -179,26 +179,27 @@ TEST_CASE("subversion/revisions", "Revision retrieval")
 
 	Revision *rev = backend.revision("1");
 	REQUIRE(rev->m_id == "1");
-	REQUIRE(rev->m_author == "jonas");
+	REQUIRE(rev->author() == "jonas");
 	REQUIRE(rev->m_message == "Initial repository layout");
 	REQUIRE(rev->m_date == 1299014963);
 	delete rev;
 
 	rev = backend.revision("7");
 	REQUIRE(rev->m_id == "7");
-	REQUIRE(rev->m_author == "jonas");
+	REQUIRE(rev->author() == "jonas");
 	REQUIRE(rev->m_message == "Use real names");
 	REQUIRE(rev->m_date == 1299447342);
 	DiffstatPtr d = rev->m_diffstat;
-	REQUIRE(d->m_stats.size() == 2);
-	REQUIRE(d->m_stats["trunk/dude"].ladd == 0);
-	REQUIRE(d->m_stats["trunk/dude"].ldel == 4);
-	REQUIRE(d->m_stats["trunk/dude"].cadd == 0);
-	REQUIRE(d->m_stats["trunk/dude"].cdel == 240);
-	REQUIRE(d->m_stats["trunk/jeffrey"].ladd == 4);
-	REQUIRE(d->m_stats["trunk/jeffrey"].ldel == 0);
-	REQUIRE(d->m_stats["trunk/jeffrey"].cadd == 240);
-	REQUIRE(d->m_stats["trunk/jeffrey"].cdel == 0);
+	std::map<std::string, Diffstat::Stat> stats = d->stats();
+	REQUIRE(stats.size() == 2);
+	REQUIRE(stats["trunk/dude"].ladd == 0);
+	REQUIRE(stats["trunk/dude"].ldel == 4);
+	REQUIRE(stats["trunk/dude"].cadd == 0);
+	REQUIRE(stats["trunk/dude"].cdel == 240);
+	REQUIRE(stats["trunk/jeffrey"].ladd == 4);
+	REQUIRE(stats["trunk/jeffrey"].ldel == 0);
+	REQUIRE(stats["trunk/jeffrey"].cadd == 240);
+	REQUIRE(stats["trunk/jeffrey"].cdel == 0);
 	delete rev;
 }
 
@@ -0,0 +1,564 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/bench/main.cpp
+ * Micro benchmarks for hot code paths
+ *
+ * Every benchmark runs a number of iterations that is calibrated to take
+ * at least the minimum time, and is repeated several times. The median
+ * time per iteration is printed as a tab-separated line, together with the
+ * throughput for benchmarks that process data. Output of previous runs may
+ * be passed as a baseline for comparison.
+ */
+
+
+#include "main.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "bstream.h"
+#include "cache.h"
+#include "diffstat.h"
+#include "jobqueue.h"
+#include "options.h"
+#include "revision.h"
+#include "strlib.h"
+#include "utils.h"
+#ifdef USE_LDBCACHE
+ #include "ldbcache.h"
+#endif
+
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+
+namespace
+{
+
+// Settings from the command line
+std::string dataDir = "tests/diffstat/data";
+int minTime = 200; // Milliseconds per repetition
+int repetitions = 5;
+
+
+// Returns a monotonic timestamp in nanoseconds
+inline int64_t nsecs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Keeps the compiler from optimizing away unused results
+volatile size_t sink;
+
+
+// Returns a revision with a moderately sized diffstat
+Revision *makeRevision(const std::string &id)
+{
+	DiffstatPtr stat(new Diffstat());
+	for (int i = 0; i < 10; i++) {
+		Diffstat::Stat s;
+		s.cadd = 100 + i; s.ladd = 10 + i;
+		s.cdel = 40; s.ldel = 4;
+		stat->add(str::printf("src/dir%d/file%s.cpp", i, id.c_str()), s);
+	}
+	return new Revision(id, 1300000000 + id.length(), "Author Name <author@example.org>", "Commit message for revision " + id, stat);
+}
+
+
+// Backend generating revisions for the cache benchmarks
+class NullBackend : public Backend
+{
+public:
+	NullBackend(const Options &options) : Backend(options) { }
+
+	std::string name() const { return "bench"; }
+	std::string uuid() { return "bench"; }
+	std::string head(const std::string &) { return std::string(); }
+	std::string mainBranch() { return std::string(); }
+	std::vector<std::string> branches() { return std::vector<std::string>(); }
+	std::vector<Tag> tags() { return std::vector<Tag>(); }
+	DiffstatPtr diffstat(const std::string &id) { Revision *rev = makeRevision(id); DiffstatPtr stat = rev->m_diffstat; delete rev; return stat; }
+	std::vector<std::string> tree(const std::string &) { return std::vector<std::string>(); }
+	std::string cat(const std::string &, const std::string &) { return std::string(); }
+	LogIterator *iterator(const std::string &, int64_t, int64_t, const RevisionFilter &) { return NULL; }
+	Revision *revision(const std::string &id) { return makeRevision(id); }
+};
+
+// Temporary cache directory with a backend
+struct CacheFixture
+{
+	Options opts;
+	NullBackend *backend;
+	std::string dir;
+
+	CacheFixture() {
+		FILE *f = sys::fs::mkstemp(&dir);
+		fclose(f);
+		sys::fs::unlink(dir);
+		sys::fs::mkdir(dir);
+		opts.m_options["cache_dir"] = dir;
+		backend = new NullBackend(opts);
+	}
+	~CacheFixture() {
+		delete backend;
+		sys::fs::unlinkr(dir);
+	}
+};
+
+
+/*
+ * Inputs
+ */
+
+// Returns all sample diffs
+const std::string &sampleDiffs()
+{
+	static std::string data;
+	if (data.empty()) {
+		std::vector<std::string> files = sys::fs::ls(dataDir);
+		std::sort(files.begin(), files.end());
+		for (size_t i = 0; i < files.size(); i++) {
+			if (files[i].length() > 4 && files[i].compare(files[i].length() - 4, 4, ".pat") == 0) {
+				std::ifstream in((dataDir + "/" + files[i]).c_str());
+				std::stringstream ss;
+				ss << in.rdbuf();
+				data += ss.str();
+			}
+		}
+		if (data.empty()) {
+			std::cerr << "Error: No sample diffs found in " << dataDir << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	return data;
+}
+
+// Returns a synthetic diff of many files with several hunks each
+const std::string &syntheticDiff()
+{
+	static std::string data;
+	if (data.empty()) {
+		std::ostringstream out;
+		for (int i = 0; i < 200; i++) {
+			std::string path = str::printf("src/module%d/file%d.cpp", i % 17, i);
+			out << "diff --git a/" << path << " b/" << path << "\n";
+			out << "index 0123456..89abcde 100644\n";
+			out << "--- a/" << path << "\n+++ b/" << path << "\n";
+			for (int j = 0; j < 20; j++) {
+				out << "@@ -" << (j * 40 + 1) << ",3 +" << (j * 40 + 1) << ",4 @@ void function" << j << "()\n";
+				out << "-\tint value = compute(" << j << ");\n";
+				out << "+\tint value = compute(" << j << ", options);\n";
+				out << "+\tvalue += adjust(value);\n";
+				out << " \treturn value;\n";
+			}
+		}
+		data = out.str();
+	}
+	return data;
+}
+
+// Returns a block of compressible text
+const std::vector<char> &textBlock()
+{
+	static std::vector<char> data;
+	if (data.empty()) {
+		const std::string &diff = syntheticDiff();
+		data.assign(diff.begin(), diff.begin() + std::min(diff.size(), size_t(65536)));
+	}
+	return data;
+}
+
+/*
+ * Benchmarks. Each function runs the given number of iterations and
+ * returns the number of bytes processed, if applicable.
+ */
+
+size_t benchDiffSamples(size_t n)
+{
+	const std::string &data = sampleDiffs();
+	for (size_t i = 0; i < n; i++) {
+		std::istringstream in(data);
+		sink = DiffParser::parse(in)->stats().size();
+	}
+	return n * data.size();
+}
+
+size_t benchDiffSynthetic(size_t n)
+{
+	const std::string &data = syntheticDiff();
+	for (size_t i = 0; i < n; i++) {
+		std::istringstream in(data);
+		sink = DiffParser::parse(in)->stats().size();
+	}
+	return n * data.size();
+}
+
+size_t benchStreamEncode(size_t n)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < n; i++) {
+		MOStream out;
+		for (uint32_t j = 0; j < 1000; j++) {
+			out << j << uint64_t(j) * 4096 << "src/file.cpp";
+		}
+		bytes += out.data().size();
+	}
+	return bytes;
+}
+
+size_t benchStreamDecode(size_t n)
+{
+	static std::vector<char> data;
+	if (data.empty()) {
+		MOStream out;
+		for (uint32_t j = 0; j < 1000; j++) {
+			out << j << uint64_t(j) * 4096 << "src/file.cpp";
+		}
+		data = out.data();
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		MIStream in(&data[0], data.size(), false);
+		uint32_t a;
+		uint64_t b;
+		std::string s;
+		for (uint32_t j = 0; j < 1000; j++) {
+			in >> a >> b >> s;
+		}
+		sink = a + b + s.length();
+	}
+	return n * data.size();
+}
+
+size_t benchDiffstatRoundtrip(size_t n)
+{
+	Revision *rev = makeRevision("1234567890abcdef");
+	size_t bytes = 0;
+	for (size_t i = 0; i < n; i++) {
+		MOStream out;
+		rev->m_diffstat->write(out);
+		MIStream in(out.data());
+		Diffstat stat;
+		sink = stat.load(in);
+		bytes += out.data().size();
+	}
+	delete rev;
+	return bytes;
+}
+
+size_t benchCompress(size_t n)
+{
+	const std::vector<char> &data = textBlock();
+	for (size_t i = 0; i < n; i++) {
+		sink = utils::compress(data).size();
+	}
+	return n * data.size();
+}
+
+size_t benchUncompress(size_t n)
+{
+	const std::vector<char> &data = textBlock();
+	static std::vector<char> compressed = utils::compress(data);
+	for (size_t i = 0; i < n; i++) {
+		sink = utils::uncompress(compressed).size();
+	}
+	return n * data.size();
+}
+
+size_t benchCrc32(size_t n)
+{
+	const std::vector<char> &data = textBlock();
+	for (size_t i = 0; i < n; i++) {
+		sink = utils::crc32(data);
+	}
+	return n * data.size();
+}
+
+size_t benchCrc32c(size_t n)
+{
+	const std::vector<char> &data = textBlock();
+	for (size_t i = 0; i < n; i++) {
+		sink = utils::crc32c(data);
+	}
+	return n * data.size();
+}
+
+size_t benchSplit(size_t n)
+{
+	std::string line;
+	for (int i = 0; i < 100; i++) {
+		line += str::printf("0123456789abcdef%02d:", i);
+	}
+	for (size_t i = 0; i < n; i++) {
+		sink = str::split(line, ":").size();
+	}
+	return n * line.length();
+}
+
+// Fetches revisions through a cache. Revisions are written to an empty
+// cache, or read back from a cache that has been filled before.
+template <typename CacheType>
+size_t benchCache(size_t n, bool read)
+{
+	CacheFixture fix;
+	CacheType cache(fix.backend, fix.opts);
+	size_t count = (read ? std::min(n, size_t(1000)) : n);
+	if (read) {
+		for (size_t i = 0; i < count; i++) {
+			delete cache.revision(str::printf("%040zx", i));
+		}
+		cache.flush();
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		Revision *rev = cache.revision(str::printf("%040zx", i % count));
+		sink = rev->m_diffstat->stats().size();
+		delete rev;
+	}
+	cache.flush();
+	return 0;
+}
+
+size_t benchCachePut(size_t n) { return benchCache<Cache>(n, false); }
+size_t benchCacheGet(size_t n) { return benchCache<Cache>(n, true); }
+#ifdef USE_LDBCACHE
+size_t benchLdbCachePut(size_t n) { return benchCache<LdbCache>(n, false); }
+size_t benchLdbCacheGet(size_t n) { return benchCache<LdbCache>(n, true); }
+#endif
+
+// Worker thread for the job queue benchmark
+class EchoThread : public sys::parallel::Thread
+{
+public:
+	EchoThread(JobQueue<std::string, size_t> *queue) : m_queue(queue) { }
+
+protected:
+	void run() {
+		std::string arg;
+		while (m_queue->getArg(&arg)) {
+			m_queue->done(arg, arg.length());
+		}
+	}
+
+private:
+	JobQueue<std::string, size_t> *m_queue;
+};
+
+size_t benchJobQueue(size_t n)
+{
+	JobQueue<std::string, size_t> queue(256);
+	std::vector<std::string> args;
+	for (size_t i = 0; i < n; i++) {
+		args.push_back(str::itos(i));
+	}
+	std::vector<EchoThread *> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(new EchoThread(&queue));
+		threads.back()->start();
+	}
+
+	queue.put(args);
+	for (size_t i = 0; i < n; i++) {
+		size_t result = 0;
+		queue.getResult(args[i], &result);
+		sink = result;
+	}
+
+	queue.stop();
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+	return 0;
+}
+
+
+struct Benchmark
+{
+	const char *name;
+	size_t (*run)(size_t n);
+};
+
+const Benchmark benchmarks[] = {
+	{"diffparser/samples", benchDiffSamples},
+	{"diffparser/synthetic", benchDiffSynthetic},
+	{"bstream/encode", benchStreamEncode},
+	{"bstream/decode", benchStreamDecode},
+	{"diffstat/roundtrip", benchDiffstatRoundtrip},
+	{"utils/compress", benchCompress},
+	{"utils/uncompress", benchUncompress},
+	{"utils/crc32", benchCrc32},
+	{"utils/crc32c", benchCrc32c},
+	{"strlib/split", benchSplit},
+	{"cache/put", benchCachePut},
+	{"cache/get", benchCacheGet},
+#ifdef USE_LDBCACHE
+	{"ldbcache/put", benchLdbCachePut},
+	{"ldbcache/get", benchLdbCacheGet},
+#endif
+	{"jobqueue/handoff", benchJobQueue}
+};
+
+
+// Result of a benchmark
+struct Result
+{
+	size_t iterations;
+	double nsPerOp;
+	double mbPerSec; // 0 if not applicable
+};
+
+// Runs a benchmark, calibrating the number of iterations first
+Result measure(const Benchmark &bench)
+{
+	// Warm up and find an iteration count that takes long enough
+	size_t n = 1;
+	int64_t elapsed = 0;
+	while (true) {
+		int64_t start = nsecs();
+		bench.run(n);
+		elapsed = nsecs() - start;
+		if (elapsed >= int64_t(minTime) * 1000000 / 4 || n >= (size_t(1) << 30)) {
+			break;
+		}
+		n *= (elapsed < 1000000 ? 10 : 2);
+	}
+	n = std::max(size_t(1), size_t(double(n) * minTime * 1000000 / std::max(elapsed, int64_t(1))));
+
+	std::vector<std::pair<double, size_t> > runs;
+	for (int i = 0; i < repetitions; i++) {
+		int64_t start = nsecs();
+		size_t bytes = bench.run(n);
+		runs.push_back(std::make_pair(double(nsecs() - start) / n, bytes));
+	}
+	std::sort(runs.begin(), runs.end());
+
+	Result r;
+	r.iterations = n;
+	r.nsPerOp = runs[runs.size() / 2].first;
+	r.mbPerSec = (runs[runs.size() / 2].second > 0 ? (runs[runs.size() / 2].second / double(n)) / r.nsPerOp * 1000.0 : 0.0);
+	return r;
+}
+
+// Reads the time per iteration of all benchmarks from previous results
+std::map<std::string, double> readBaseline(const std::string &path)
+{
+	std::map<std::string, double> baseline;
+	std::ifstream in(path.c_str());
+	if (!in.good()) {
+		std::cerr << "Error: Unable to read baseline " << path << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::vector<std::string> fields = str::split(line, "\t");
+		double ns;
+		if (fields.size() >= 3 && sscanf(fields[2].c_str(), "%lf", &ns) == 1) {
+			baseline[fields[0]] = ns;
+		}
+	}
+	return baseline;
+}
+
+// Prints usage information
+void printHelp()
+{
+	std::cout << "USAGE: pbench [options] [filter...]" << std::endl << std::endl;
+	std::cout << "Runs all benchmarks whose names contain one of the filters." << std::endl << std::endl;
+	std::cout << "  --data=DIR            Directory containing sample diffs (*.pat)" << std::endl;
+	std::cout << "  --time=MS             Minimum time per repetition (default: 200)" << std::endl;
+	std::cout << "  --repetitions=N       Number of repetitions (default: 5)" << std::endl;
+	std::cout << "  --baseline=FILE       Compare with the output of a previous run" << std::endl;
+	std::cout << "  --max-regression=PCT  Fail if a benchmark is slower than the baseline by PCT percent" << std::endl;
+	std::cout << "  --list                List all benchmarks" << std::endl;
+}
+
+} // anonymous namespace
+
+
+// Program entry point
+int main(int argc, char **argv)
+{
+	std::string baselineFile;
+	double maxRegression = -1;
+	std::vector<std::string> filters;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-h" || arg == "--help") {
+			printHelp();
+			return EXIT_SUCCESS;
+		} else if (arg == "--list") {
+			for (size_t j = 0; j < sizeof(benchmarks) / sizeof(Benchmark); j++) {
+				std::cout << benchmarks[j].name << std::endl;
+			}
+			return EXIT_SUCCESS;
+		} else if (arg.compare(0, 7, "--data=") == 0) {
+			dataDir = arg.substr(7);
+		} else if (arg.compare(0, 7, "--time=") == 0) {
+			minTime = std::max(1, atoi(arg.c_str() + 7));
+		} else if (arg.compare(0, 14, "--repetitions=") == 0) {
+			repetitions = std::max(1, atoi(arg.c_str() + 14));
+		} else if (arg.compare(0, 11, "--baseline=") == 0) {
+			baselineFile = arg.substr(11);
+		} else if (arg.compare(0, 17, "--max-regression=") == 0) {
+			maxRegression = atof(arg.c_str() + 17);
+		} else if (arg.compare(0, 1, "-") == 0) {
+			std::cerr << "Error: Unknown option " << arg << std::endl;
+			return EXIT_FAILURE;
+		} else {
+			filters.push_back(arg);
+		}
+	}
+
+	std::map<std::string, double> baseline;
+	if (!baselineFile.empty()) {
+		baseline = readBaseline(baselineFile);
+	}
+
+	std::cout << "# name\titerations\tns_per_op\tmb_per_s" << (baseline.empty() ? "" : "\tchange") << std::endl;
+	int ret = EXIT_SUCCESS;
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(Benchmark); i++) {
+		const Benchmark &bench = benchmarks[i];
+		bool selected = filters.empty();
+		for (size_t j = 0; j < filters.size() && !selected; j++) {
+			selected = (strstr(bench.name, filters[j].c_str()) != NULL);
+		}
+		if (!selected) {
+			continue;
+		}
+
+		Result r = measure(bench);
+		std::cout << bench.name << "\t" << r.iterations << "\t" << str::printf("%.1f", r.nsPerOp) << "\t" << str::printf("%.2f", r.mbPerSec);
+		if (!baseline.empty()) {
+			std::map<std::string, double>::const_iterator it = baseline.find(bench.name);
+			if (it != baseline.end() && it->second > 0) {
+				// Positive changes are regressions
+				double change = 100.0 * (r.nsPerOp - it->second) / it->second;
+				std::cout << "\t" << str::printf("%+.1f%%", change);
+				if (maxRegression >= 0 && change > maxRegression) {
+					ret = EXIT_FAILURE;
+				}
+			} else {
+				std::cout << "\tnew";
+			}
+		}
+		std::cout << std::endl;
+	}
+	return ret;
+}
@@ -44,12 +44,37 @@ void push_back(std::vector<std::string> *v, const char *s1 = 0, const char *s2 =
 
 
 // Unit tests
+#include "test_aggregator.h"
+#include "test_authortable.h"
 #include "test_bstream.h"
+#include "test_cache.h"
+#include "test_chart.h"
+#include "test_checkpoint.h"
+#include "test_codec.h"
+#include "test_columns.h"
+#include "test_daemon.h"
+#include "test_diffstat.h"
+#include "test_jobqueue.h"
+#include "test_logger.h"
+#include "test_luaprofiler.h"
+#include "test_memstats.h"
 #include "test_options.h"
+#include "test_pool.h"
+#include "test_remotecache.h"
+#include "test_reportcache.h"
+#include "test_reportresult.h"
+#include "test_repository.h"
+#include "test_revisionfilter.h"
+#include "test_revisionid.h"
+#include "test_revisioniterator.h"
+#include "test_rollups.h"
+#include "test_stats.h"
 #include "test_strlib.h"
 #include "test_sys_fs.h"
 #include "test_sys_io.h"
+#include "test_tracer.h"
 #include "test_utils.h"
+#include "test_watcher.h"
 #include "test_parallel.h"
 
 
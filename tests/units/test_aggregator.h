@@ -0,0 +1,136 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_aggregator.h
+ * Unit tests for native aggregation
+ */
+
+
+#ifndef TEST_AGGREGATOR_H
+#define TEST_AGGREGATOR_H
+
+
+#include "aggregator.h"
+#include "diffstat.h"
+#include "revision.h"
+#include "strlib.h"
+
+
+namespace test_aggregator
+{
+
+// Creates a revision changing the given files by the given number of lines
+Revision *revision(int64_t date, const std::string &author, const std::string &files, uint64_t ladd, uint64_t ldel = 0)
+{
+	DiffstatPtr stat = std::make_shared<Diffstat>();
+	std::vector<std::string> paths = str::split(files, ",");
+	for (size_t i = 0; i < paths.size(); i++) {
+		Diffstat::Stat s;
+		s.ladd = ladd;
+		s.ldel = ldel;
+		stat->add(paths[i], s);
+	}
+	return new Revision(str::itos(date), date, author, "", stat);
+}
+
+// Adds a few revisions to an aggregator
+void fill(Aggregator *a)
+{
+	std::vector<Revision *> revs;
+	revs.push_back(revision(300, "b", "src/x.c,README", 5));
+	revs.push_back(revision(100, "a", "src/a/y.C,src/z.h", 10, 2));
+	revs.push_back(revision(200, "", "doc/index.txt", 1));
+	revs.push_back(revision(400, "a", "src/x.c", 1, 4));
+	for (size_t i = 0; i < revs.size(); i++) {
+		a->add(revs[i]);
+		delete revs[i];
+	}
+}
+
+TEST_CASE("aggregator/authors", "Grouping by author")
+{
+	Aggregator a(Aggregator::Author, Aggregator::LinesAdded);
+	fill(&a);
+	REQUIRE(a.count() == 3);
+	REQUIRE(a.total("a") == 21);
+	REQUIRE(a.total("b") == 10);
+	REQUIRE(a.total("") == 0);
+
+	std::vector<std::pair<std::string, int64_t> > top = a.top(1);
+	REQUIRE(top.size() == 1);
+	REQUIRE(top[0].first == "a");
+
+	std::vector<std::string> keys;
+	keys.push_back("b");
+	keys.push_back("a");
+	std::vector<int64_t> dates;
+	std::vector<std::vector<int64_t> > values;
+	a.series(keys, 250, &dates, &values);
+	REQUIRE(dates.size() == 2);
+	REQUIRE(dates[0] == 300);
+	REQUIRE(values[0][0] == 10);
+	REQUIRE(values[0][1] == 20);
+	REQUIRE(values[1][1] == 21);
+}
+
+TEST_CASE("aggregator/scale", "Scaling values of sampled revisions")
+{
+	Aggregator a(Aggregator::Author, Aggregator::Commits);
+	Aggregator b(Aggregator::Directory, Aggregator::LinesAdded);
+	Revision *rev = revision(100, "a", "src/x.c,src/y.c", 4);
+	a.add(rev, 2.5);
+	b.add(rev, 2.5);
+	a.add(rev);
+	delete rev;
+	REQUIRE(a.total("a") == 4);
+	REQUIRE(b.total("src") == 20);
+}
+
+TEST_CASE("aggregator/files", "Grouping by directory and extension")
+{
+	SECTION("directory", "Directories") {
+		Aggregator a(Aggregator::Directory, Aggregator::Lines);
+		fill(&a);
+		REQUIRE(a.count() == 4);
+		REQUIRE(a.total("src") == 10);
+		REQUIRE(a.total("src/a") == 8);
+		REQUIRE(a.total("/") == 5);
+		REQUIRE(a.total("doc") == 1);
+	}
+
+	SECTION("depth", "Limited directory depth") {
+		Aggregator a(Aggregator::Directory, Aggregator::Commits, 1);
+		fill(&a);
+		REQUIRE(a.total("src") == 3);
+		REQUIRE(a.total("src/a") == 0);
+	}
+
+	SECTION("extension", "File extensions") {
+		Aggregator a(Aggregator::Extension, Aggregator::Commits);
+		fill(&a);
+		REQUIRE(a.total(".c") == 3);
+		REQUIRE(a.total(".h") == 1);
+		REQUIRE(a.keys().size() == 3);
+	}
+
+	SECTION("date", "Date buckets") {
+		Aggregator a(Aggregator::Date, Aggregator::Commits, 200);
+		fill(&a);
+		std::vector<std::pair<std::string, int64_t> > h = a.histogram();
+		REQUIRE(h.size() == 3);
+		REQUIRE(h[0].first == "0");
+		REQUIRE(h[0].second == 1);
+		REQUIRE(h[1].second == 2);
+		REQUIRE(h[2].first == "400");
+	}
+}
+
+} // namespace test_aggregator
+
+
+#endif // TEST_AGGREGATOR_H
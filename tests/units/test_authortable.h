@@ -0,0 +1,88 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_authortable.h
+ * Unit tests for interned author names
+ */
+
+
+#ifndef TEST_AUTHORTABLE_H
+#define TEST_AUTHORTABLE_H
+
+
+#include "authortable.h"
+#include "bstream.h"
+#include "revision.h"
+
+#include "test_cache.h"
+
+
+namespace test_authortable
+{
+
+TEST_CASE("authortable/intern", "Interning author names")
+{
+	REQUIRE(AuthorTable::intern("") == 0);
+	uint32_t a = AuthorTable::intern("test_authortable a");
+	uint32_t b = AuthorTable::intern("test_authortable b");
+	REQUIRE(a != b);
+	REQUIRE(AuthorTable::intern("test_authortable a") == a);
+	REQUIRE(AuthorTable::name(a) == "test_authortable a");
+	REQUIRE(AuthorTable::name(b) == "test_authortable b");
+	REQUIRE(AuthorTable::name(0xFFFFFFFF).empty());
+
+	uint32_t id = 0;
+	REQUIRE(AuthorTable::find("test_authortable b", &id));
+	REQUIRE(id == b);
+	REQUIRE(!AuthorTable::find("test_authortable c", &id));
+
+	Revision rev("1", 0, "test_authortable a", "", DiffstatPtr());
+	REQUIRE(rev.author() == "test_authortable a");
+}
+
+TEST_CASE("authortable/dictionary", "Author dictionaries shared by processes")
+{
+	test_cache::Fixture fix;
+	std::string path = fix.dir + "/authors";
+	uint32_t a = AuthorTable::intern("test_authortable x");
+	uint32_t b = AuthorTable::intern("test_authortable y");
+
+	AuthorDictionary d1, d2;
+	d1.open(path);
+	d2.open(path);
+	uint32_t ia = d1.encode(a);
+	REQUIRE(d1.encode(a) == ia);
+
+	// The second dictionary picks up the index assigned by the first one
+	uint32_t ib = d2.encode(b);
+	REQUIRE(ib != ia);
+	uint32_t id = 0;
+	REQUIRE(d2.decode(ia, &id));
+	REQUIRE(id == a);
+	REQUIRE(d1.decode(ib, &id));
+	REQUIRE(id == b);
+	REQUIRE(!d1.decode(ib + 1, &id));
+
+	// Meta-data records store the index
+	Revision rev("1", 42, "test_authortable y", "", DiffstatPtr());
+	MOStream out;
+	rev.writeMeta(out, &d1);
+	AuthorDictionary d3;
+	d3.open(path);
+	Revision loaded("1");
+	MIStream in(out.buffer());
+	bool ok = loaded.loadMeta(in, &d3);
+	REQUIRE(ok);
+	REQUIRE(loaded.author() == "test_authortable y");
+	REQUIRE(out.buffer().size() < 2 + 8 + rev.author().length());
+}
+
+} // namespace test_authortable
+
+
+#endif // TEST_AUTHORTABLE_H
@@ -17,6 +17,8 @@
 
 #include "bstream.h"
 
+#include "syslib/fs.h"
+
 
 namespace test_bstream
 {
@@ -94,6 +96,86 @@ TEST_CASE("bstream/checks", "Corner cases for memory streams")
 	REQUIRE(n == ssize_t(out.size()));
 }
 
+TEST_CASE("bstream/buffers", "Sharing the buffers of memory streams")
+{
+	MOStream out;
+	out << (uint32_t)42 << std::string("data");
+	const std::vector<char> &buffer = out.buffer();
+	REQUIRE(buffer.size() == 9);
+
+	SECTION("view", "Reading from external memory") {
+		MIStream in(buffer.data(), buffer.size(), false);
+		uint32_t i; std::string s;
+		in >> i >> s;
+		REQUIRE(i == 42);
+		REQUIRE(s == "data");
+	}
+
+	SECTION("release", "Moving the buffer between streams") {
+		std::vector<char> data = out.release();
+		const char *p = data.data();
+		REQUIRE(data.size() == 9);
+		REQUIRE(out.buffer().empty());
+		REQUIRE(out.tell() == 0);
+
+		MIStream in(std::move(data));
+		uint32_t i; std::string s;
+		in >> i >> s;
+		REQUIRE(i == 42);
+		REQUIRE(s == "data");
+		REQUIRE(p != NULL);
+
+		out << 'x';
+		REQUIRE(out.buffer().size() == 1);
+	}
+}
+
+TEST_CASE("bstream/buffered", "Buffered reading from files")
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	fclose(f);
+
+	std::string big(10000, 'x');
+	{
+		BOStream out(path);
+		for (uint32_t i = 0; i < 1000; i++) {
+			out << i << std::string("value") << (uint64_t)i * 3;
+		}
+		out << big << std::string("end");
+	}
+
+	BIStream in(path);
+	for (uint32_t i = 0; i < 1000; i++) {
+		uint32_t a; std::string s; uint64_t b;
+		in >> a >> s >> b;
+		if (a != i || s != "value" || b != i * 3) {
+			FAIL("Mismatch at record " << i);
+		}
+	}
+	size_t offset = in.tell();
+	REQUIRE(offset == 1000 * 18);
+
+	std::string s;
+	in >> s;
+	REQUIRE(s == big);
+	in >> s;
+	REQUIRE(s == "end");
+	in >> s;
+	REQUIRE(s.empty());
+	REQUIRE(in.eof());
+
+	REQUIRE(in.seek(offset + 5000));
+	std::vector<char> data(5001);
+	ssize_t n = in.read(&data[0], data.size());
+	REQUIRE(n == 5001);
+	REQUIRE(data[4999] == 'x');
+	REQUIRE(data[5000] == '\0');
+	REQUIRE(in.tell() == offset + 10001);
+
+	sys::fs::unlink(path);
+}
+
 TEST_CASE("bstream/operators", "Stream operators")
 {
 	SECTION("Characters", "char operators")
@@ -122,6 +204,24 @@ TEST_CASE("bstream/operators", "Stream operators")
 		}
 	}
 
+	SECTION("Varints", "LEB128 integers")
+	{
+		uint64_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, 4294967295ULL, 18446744073709551615ULL };
+		MOStream outv;
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+			outv.writeVarint(values[i]);
+		}
+		std::vector<char> data = outv.data();
+		REQUIRE(data.size() == 1 + 1 + 1 + 2 + 2 + 2 + 3 + 5 + 10);
+		REQUIRE((unsigned char)data[3] == 0x80);
+		REQUIRE((unsigned char)data[4] == 0x01);
+		MIStream inv(data);
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+			uint64_t v; inv.readVarint(v);
+			REQUIRE(v == values[i]);
+		}
+	}
+
 	SECTION("Integers (64bit)", "uint64_t operators")
 	{
 		MOStream out64;
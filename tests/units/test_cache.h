@@ -0,0 +1,1401 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_cache.h
+ * Unit tests for the revision cache
+ */
+
+
+#ifndef TEST_CACHE_H
+#define TEST_CACHE_H
+
+
+#include <cstdio>
+#include <queue>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bstream.h"
+#include "cache.h"
+#include "codec.h"
+#include "memorycache.h"
+#include "memstats.h"
+#include "options.h"
+#include "revision.h"
+#include "stats.h"
+#include "strlib.h"
+#include "utils.h"
+
+#include "syslib/fs.h"
+
+
+namespace test_cache
+{
+
+// Backend generating revisions on the fly
+class FakeBackend : public Backend
+{
+public:
+	FakeBackend(const Options &options) : Backend(options), calls(0), metaCalls(0), iterators(0) { }
+
+	std::string name() const { return "fake"; }
+	std::string uuid() { return "fake"; }
+	std::string head(const std::string &) { return headId; }
+	std::string mainBranch() { return std::string(); }
+	std::vector<std::string> branches() { return std::vector<std::string>(); }
+	std::vector<Tag> tags() { return std::vector<Tag>(); }
+	DiffstatPtr diffstat(const std::string &id) { return revision(id)->diffstat(); }
+	std::vector<std::string> tree(const std::string &) { return std::vector<std::string>(); }
+	std::string cat(const std::string &, const std::string &) { return std::string(); }
+	LogIterator *iterator(const std::string &, int64_t, int64_t, const RevisionFilter &) { ++iterators; return new LogIterator(log); }
+
+	Revision *revision(const std::string &id) {
+		++calls;
+		return make(id);
+	}
+
+	Revision *metaRevision(const std::string &id) {
+		++metaCalls;
+		Revision *rev = make(id);
+		rev->m_diffstat.reset();
+		return rev;
+	}
+
+	static Revision *make(const std::string &id) {
+		DiffstatPtr stat(new Diffstat());
+		Diffstat::Stat s;
+		s.cadd = id.length() * 10; s.ladd = id.length();
+		s.cdel = 4; s.ldel = 1;
+		stat->add("dir/" + id, s);
+		return new Revision(id, 1000 + id.length(), "author " + id, "message " + id, stat);
+	}
+
+	int calls, metaCalls, iterators;
+	std::vector<std::string> log;
+	std::string headId;
+};
+
+// Sets up a temporary cache directory
+struct Fixture
+{
+	Options opts;
+	std::string dir;
+
+	Fixture() {
+		FILE *f = sys::fs::mkstemp(&dir);
+		fclose(f);
+		sys::fs::unlink(dir);
+		sys::fs::mkdir(dir);
+		opts.m_options["cache_dir"] = dir;
+	}
+	~Fixture() {
+		sys::fs::unlinkr(dir);
+	}
+};
+
+// Checks whether a revision matches the generated one
+bool matches(Revision *rev)
+{
+	Revision *ref = FakeBackend::make(rev->m_id);
+	bool equal = (rev->m_date == ref->m_date && rev->m_author == ref->m_author && rev->m_message == ref->m_message);
+	std::map<std::string, Diffstat::Stat> sa = rev->m_diffstat->stats(), sb = ref->m_diffstat->stats();
+	Diffstat::Stat a = sa["dir/" + rev->m_id], b = sb["dir/" + rev->m_id];
+	equal = equal && sa.size() == 1 && a.cadd == b.cadd && a.ladd == b.ladd && a.cdel == b.cdel && a.ldel == b.ldel;
+	delete ref;
+	return equal;
+}
+
+// Requests a revision from the cache
+bool fetch(AbstractCache *cache, const std::string &id)
+{
+	Revision *rev = cache->revision(id);
+	bool ok = matches(rev);
+	delete rev;
+	return ok;
+}
+
+// Reads the whole file
+std::string readFile(const std::string &path)
+{
+	std::string data;
+	FILE *f = fopen(path.c_str(), "rb");
+	char buffer[4096];
+	size_t n;
+	while (f != NULL && (n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+		data.append(buffer, n);
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+	return data;
+}
+
+
+TEST_CASE("cache/roundtrip", "Cache roundtrip")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	SECTION("session", "Reading revisions written in the same session") {
+		Cache cache(&backend, fix.opts);
+		bool ok = fetch(&cache, "first");
+		REQUIRE(ok);
+		ok = fetch(&cache, "second");
+		REQUIRE(ok);
+		ok = fetch(&cache, "first");
+		REQUIRE(ok);
+		REQUIRE(backend.calls == 2);
+	}
+
+	SECTION("persistent", "Reading revisions written in previous sessions") {
+		for (int run = 0; run < 3; run++) {
+			Cache cache(&backend, fix.opts);
+			for (int i = 0; i < 100 * (run + 1); i++) {
+				bool ok = fetch(&cache, str::itos(i));
+				REQUIRE(ok);
+			}
+		}
+		REQUIRE(backend.calls == 300);
+	}
+}
+
+TEST_CASE("cache/codec", "Compressed cache records")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	fix.opts.m_options["cache_codec"] = "zlib";
+
+	for (int run = 0; run < 2; run++) {
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 100; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 100);
+
+	// Records can be read and converted regardless of the codec option
+	fix.opts.m_options["cache_codec"] = "none";
+	Cache cache(&backend, fix.opts);
+	cache.check();
+	cache.compact();
+	for (int i = 0; i < 100; i++) {
+		bool ok = fetch(&cache, str::itos(i));
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 100);
+}
+
+TEST_CASE("cache/codec/default", "Compressing new records by default")
+{
+	// Backend generating long commit messages
+	struct VerboseBackend : public FakeBackend {
+		VerboseBackend(const Options &options) : FakeBackend(options) { }
+		Revision *revision(const std::string &id) {
+			Revision *rev = FakeBackend::revision(id);
+			for (int i = 0; i < 50; i++) {
+				rev->m_message += "\nThis line is repeated in every commit message.";
+			}
+			return rev;
+		}
+	};
+
+	// Returns the size of the message store after adding some revisions
+	struct Run {
+		static int64_t size(Fixture *fix) {
+			VerboseBackend backend(fix->opts);
+			{
+				Cache cache(&backend, fix->opts);
+				for (int i = 0; i < 100; i++) {
+					delete cache.revision(str::itos(i));
+				}
+			}
+			return sys::fs::filesize(fix->dir + "/fake/messages.0");
+		}
+	};
+
+	Codec::Id id = Codec::parse(Options().cacheCodec());
+	if (Codec::available(Codec::Zlib)) {
+		REQUIRE(id == Codec::Zlib);
+	}
+	if (id == Codec::None) {
+		return;
+	}
+
+	Fixture encoded, raw;
+	raw.opts.m_options["cache_codec"] = "none";
+	int64_t esize = Run::size(&encoded), rsize = Run::size(&raw);
+	REQUIRE(esize > 0);
+	REQUIRE(esize < rsize / 4);
+}
+
+TEST_CASE("cache/batch", "Batched cache access")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 50; i++) {
+		ids.push_back(str::itos(i));
+	}
+
+	{
+		// Cache every other revision
+		Cache cache(&backend, fix.opts);
+		for (size_t i = 0; i < ids.size(); i += 2) {
+			bool ok = fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 25);
+
+	for (int run = 0; run < 2; run++) {
+		Cache cache(&backend, fix.opts);
+		std::vector<std::string> reversed(ids.rbegin(), ids.rend());
+		std::vector<Revision *> revs = cache.revisions(reversed);
+		REQUIRE(revs.size() == reversed.size());
+		for (size_t i = 0; i < revs.size(); i++) {
+			REQUIRE(revs[i]->m_id == reversed[i]);
+			bool ok = matches(revs[i]);
+			REQUIRE(ok);
+			delete revs[i];
+		}
+	}
+	REQUIRE(backend.calls == 50);
+}
+
+TEST_CASE("cache/batch/errors", "Releasing revisions if a batch fails")
+{
+	// Backend failing on a given revision
+	struct FailingBackend : public FakeBackend {
+		FailingBackend(const Options &options) : FakeBackend(options) { }
+		Revision *revision(const std::string &id) {
+			if (id == failure) {
+				throw PEX("Fetching " + id + " failed");
+			}
+			return FakeBackend::revision(id);
+		}
+		std::string failure;
+	};
+
+	Fixture fix;
+	FailingBackend backend(fix.opts);
+	MemStats::start();
+	int64_t base = MemStats::current(MemStats::Diffstats);
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 20; i++) {
+		ids.push_back(str::itos(i));
+	}
+	{
+		Cache cache(&backend, fix.opts);
+		for (size_t i = 0; i < ids.size(); i += 2) {
+			bool ok = fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+	}
+
+	{
+		// The cached revisions and the ones fetched before the failure are
+		// released with the cache
+		Cache cache(&backend, fix.opts);
+		backend.failure = "15";
+		bool thrown = false;
+		try {
+			std::vector<Revision *> revs = cache.revisions(ids);
+		} catch (const PepperException &) {
+			thrown = true;
+		}
+		REQUIRE(thrown);
+	}
+	REQUIRE(MemStats::current(MemStats::Diffstats) == base);
+}
+
+TEST_CASE("cache/async", "Asynchronous cache access")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 150; i++) {
+		ids.push_back(str::itos(i));
+	}
+
+	{
+		// Cache every other revision
+		Cache cache(&backend, fix.opts);
+		for (size_t i = 0; i < ids.size(); i += 2) {
+			bool ok = fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 75);
+
+	Cache cache(&backend, fix.opts);
+	std::vector<RevisionFuture> futures = cache.revisionsAsync(ids);
+	REQUIRE(futures.size() == ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		REQUIRE(futures[i].id() == ids[i]);
+		REQUIRE(cache.inFlight(ids[i]) == (i % 2 == 1));
+	}
+
+	SECTION("reverse", "Claiming revisions in reverse order") {
+		for (size_t i = futures.size(); i > 0; i--) {
+			Revision *rev = futures[i-1].get();
+			REQUIRE(rev->m_id == ids[i-1]);
+			bool ok = matches(rev);
+			REQUIRE(ok);
+			delete rev;
+			REQUIRE(!cache.inFlight(ids[i-1]));
+
+			// Ownership has been passed on
+			Revision *again = futures[i-1].get();
+			REQUIRE(again == NULL);
+		}
+		REQUIRE(backend.calls == 150);
+	}
+
+	SECTION("unclaimed", "Dropping futures without claiming them") {
+		Revision *rev = futures[1].get();
+		delete rev;
+		futures.clear();
+		REQUIRE(backend.calls == 76);
+		REQUIRE(cache.inFlight(ids[3]));
+
+		// Requested revisions aren't requested again
+		std::vector<RevisionFuture> more = cache.revisionsAsync(std::vector<std::string>(1, ids[3]), false);
+		rev = more[0].get();
+		REQUIRE(rev->m_id == ids[3]);
+		REQUIRE(rev->m_diffstat != NULL);
+		delete rev;
+		REQUIRE(backend.calls == 77);
+		REQUIRE(backend.metaCalls == 0);
+	}
+}
+
+TEST_CASE("cache/meta", "Meta-data only cache access")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 20; i++) {
+		ids.push_back(str::itos(i));
+	}
+
+	{
+		// Cache every other revision, then request meta-data for all
+		Cache cache(&backend, fix.opts);
+		for (size_t i = 0; i < ids.size(); i += 2) {
+			bool ok = fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+
+		// Cached revisions are returned without diffstats as well, since
+		// these are loaded from a separate store on demand
+		std::vector<Revision *> revs = cache.metaRevisions(ids);
+		REQUIRE(revs.size() == ids.size());
+		for (size_t i = 0; i < revs.size(); i++) {
+			REQUIRE(revs[i]->m_id == ids[i]);
+			REQUIRE(revs[i]->author() == "author " + ids[i]);
+			REQUIRE(revs[i]->m_message == "message " + ids[i]);
+			REQUIRE(!revs[i]->m_diffstat);
+			delete revs[i];
+		}
+		for (size_t i = 0; i < ids.size(); i += 2) {
+			DiffstatPtr stat = cache.diffstat(ids[i]);
+			size_t n = stat->stats().size();
+			REQUIRE(n == 1);
+		}
+		Revision *rev = cache.metaRevision("odd");
+		REQUIRE(!rev->m_diffstat);
+		delete rev;
+	}
+	REQUIRE(backend.calls == 10);
+	REQUIRE(backend.metaCalls == 11);
+
+	{
+		// Revisions without diffstats must not have been cached
+		Cache cache(&backend, fix.opts);
+		std::vector<Revision *> revs = cache.revisions(ids);
+		for (size_t i = 0; i < revs.size(); i++) {
+			bool ok = matches(revs[i]);
+			REQUIRE(ok);
+			delete revs[i];
+		}
+	}
+	REQUIRE(backend.calls == 20);
+}
+
+TEST_CASE("cache/memory", "In-memory cache for multiple reports")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 20; i++) {
+		ids.push_back(str::itos(i));
+	}
+
+	MemoryCache cache(&backend, fix.opts);
+	for (int run = 0; run < 3; run++) {
+		std::vector<Revision *> revs = cache.revisions(ids);
+		REQUIRE(revs.size() == ids.size());
+		for (size_t i = 0; i < revs.size(); i++) {
+			bool ok = matches(revs[i]);
+			REQUIRE(ok);
+
+			// Filtering must not affect the shared diffstat
+			revs[i]->m_diffstat = Diffstat::filter(revs[i]->m_diffstat, "none/");
+			delete revs[i];
+		}
+		cache.flush();
+	}
+	REQUIRE(backend.calls == 20);
+	REQUIRE(cache.size() == 20);
+
+	bool ok = fetch(&cache, "5");
+	REQUIRE(ok);
+	REQUIRE(backend.calls == 20);
+}
+
+TEST_CASE("cache/lru", "Keeping recently used revisions in memory")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+
+	SECTION("hits", "Revisions and diffstats are served from memory") {
+		Cache cache(&backend, fix.opts);
+		Stats::reset();
+		bool ok = fetch(&cache, "3");
+		REQUIRE(ok);
+		REQUIRE(Stats::value(Stats::MemoryMisses) == 1);
+		ok = fetch(&cache, "3");
+		REQUIRE(ok);
+		DiffstatPtr stat = cache.diffstat("3");
+		REQUIRE(stat->size() == 1);
+		REQUIRE(Stats::value(Stats::MemoryHits) == 2);
+		REQUIRE(Stats::value(Stats::MemoryMisses) == 1);
+
+		std::vector<Revision *> revs = cache.revisions(std::vector<std::string>(1, "3"));
+		ok = matches(revs[0]);
+		REQUIRE(ok);
+		delete revs[0];
+		REQUIRE(Stats::value(Stats::MemoryHits) == 3);
+	}
+
+	SECTION("parts", "Meta-data is completed by later requests") {
+		Cache cache(&backend, fix.opts);
+		Stats::reset();
+		Revision *rev = cache.metaRevision("4");
+		REQUIRE(rev->m_diffstat == NULL);
+		delete rev;
+		rev = cache.metaRevision("4");
+		REQUIRE(rev->author() == "author 4");
+		delete rev;
+		REQUIRE(Stats::value(Stats::MemoryHits) == 1);
+
+		// The diffstat is read from disk only once
+		bool ok = fetch(&cache, "4");
+		REQUIRE(ok);
+		ok = fetch(&cache, "4");
+		REQUIRE(ok);
+		REQUIRE(Stats::value(Stats::MemoryHits) == 2);
+		REQUIRE(Stats::value(Stats::MemoryMisses) == 2);
+	}
+
+	SECTION("disabled", "Keeping revisions in memory may be disabled") {
+		fix.opts.m_options["revision_memory"] = "0";
+		Cache cache(&backend, fix.opts);
+		Stats::reset();
+		for (int run = 0; run < 2; run++) {
+			bool ok = fetch(&cache, "5");
+			REQUIRE(ok);
+		}
+		REQUIRE(Stats::value(Stats::MemoryHits) == 0);
+		REQUIRE(Stats::value(Stats::MemoryMisses) == 0);
+	}
+	REQUIRE(backend.calls == 10);
+}
+
+TEST_CASE("cache/readahead", "Loading cached revisions in the background")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	std::vector<std::string> ids;
+	for (int i = 0; i < 200; i++) {
+		ids.push_back(str::itos(i));
+	}
+	{
+		Cache cache(&backend, fix.opts);
+		std::vector<Revision *> revs = cache.revisions(ids);
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+	}
+	REQUIRE(backend.calls == 200);
+
+	SECTION("async", "Batches are decoded before being claimed") {
+		Cache cache(&backend, fix.opts);
+		Stats::reset();
+		std::vector<RevisionFuture> futures = cache.revisionsAsync(ids);
+		cache.sync();
+		REQUIRE(Stats::value(Stats::CacheBytesRead) > 0);
+		for (size_t i = 0; i < futures.size(); i++) {
+			REQUIRE(futures[i].id() == ids[i]);
+			Revision *rev = futures[i].get();
+			bool ok = matches(rev);
+			REQUIRE(ok);
+			delete rev;
+		}
+	}
+
+	SECTION("prefetch", "Prefetched hits are kept in memory") {
+		Cache cache(&backend, fix.opts);
+		Stats::reset();
+		cache.prefetch(ids);
+		cache.sync();
+		for (size_t i = 0; i < ids.size(); i++) {
+			bool ok = fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+		REQUIRE(Stats::value(Stats::MemoryHits) == 200);
+		REQUIRE(Stats::value(Stats::MemoryMisses) == 0);
+	}
+	REQUIRE(backend.calls == 200);
+}
+
+TEST_CASE("cache/import", "Importing version 5 caches")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	std::string path = fix.dir + "/fake";
+	sys::fs::mkdir(path);
+
+	{
+		GZOStream index(path + "/index");
+		BOStream data(path + "/cache.0");
+		index << (uint32_t)5;
+		for (int i = 0; i < 10; i++) {
+			Revision *rev = FakeBackend::make(str::itos(i));
+			MOStream rout;
+			rev->write03(rout);
+			std::vector<char> compressed = utils::compress(rout.data());
+			index << rev->m_id << (uint32_t)0 << (uint32_t)data.tell() << utils::crc32(compressed);
+			data << compressed;
+			delete rev;
+		}
+	}
+
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 0);
+	REQUIRE(!sys::fs::exists(path + "/index"));
+	REQUIRE(!sys::fs::exists(path + "/cache.0"));
+}
+
+TEST_CASE("cache/check", "Cache consistency check")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+
+	SECTION("ok", "Consistent cache") {
+		Cache cache(&backend, fix.opts);
+		cache.check();
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 10);
+	}
+
+	SECTION("corrupted", "Corrupted revision data") {
+		// Overwrite the diffstat of the last revision
+		std::string path = fix.dir + "/fake/diffstats.0";
+		FILE *f = fopen(path.c_str(), "r+b");
+		REQUIRE(f != NULL);
+		fseek(f, -10, SEEK_END);
+		fputs("garbage", f);
+		fclose(f);
+
+		Cache cache(&backend, fix.opts);
+		cache.check();
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 11);
+	}
+
+	SECTION("index", "Missing index file") {
+		sys::fs::unlink(fix.dir + "/fake/cache.index");
+
+		Cache cache(&backend, fix.opts);
+		cache.check();
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 10);
+	}
+
+	SECTION("rebuild", "Rebuilding a missing index file on load") {
+		sys::fs::unlink(fix.dir + "/fake/cache.index");
+
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 10);
+	}
+}
+
+TEST_CASE("cache/check/parallel", "Checking many revisions in parallel")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 5000; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+
+	// Damage a record in the middle of the meta-data segment
+	std::string path = fix.dir + "/fake/meta.0";
+	std::string data;
+	{
+		sys::fs::MappedFile file(path);
+		data.assign(file.data(), file.size());
+	}
+	size_t pos = data.find(std::string("2500", 5));
+	REQUIRE(pos != std::string::npos);
+	FILE *f = fopen(path.c_str(), "r+b");
+	REQUIRE(f != NULL);
+	fseek(f, pos + 6, SEEK_SET);
+	fputc(~data[pos + 6], f);
+	fclose(f);
+
+	Cache cache(&backend, fix.opts);
+	cache.check();
+	for (int i = 0; i < 5000; i++) {
+		bool ok = fetch(&cache, str::itos(i));
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 5001);
+}
+
+TEST_CASE("cache/compact", "Removing unused records")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	std::string path = fix.dir + "/fake";
+
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+	}
+	size_t sizes[3] = { sys::fs::filesize(path + "/meta.0"), sys::fs::filesize(path + "/messages.0"), sys::fs::filesize(path + "/diffstats.0") };
+
+	SECTION("dead", "Dropping records of corrupted revisions") {
+		// Overwrite the diffstat of the last revision, which will be
+		// appended again after the check
+		FILE *f = fopen((path + "/diffstats.0").c_str(), "r+b");
+		REQUIRE(f != NULL);
+		fseek(f, -10, SEEK_END);
+		fputs("garbage", f);
+		fclose(f);
+		{
+			Cache cache(&backend, fix.opts);
+			cache.check();
+			for (int i = 0; i < 10; i++) {
+				bool ok = fetch(&cache, str::itos(i));
+				REQUIRE(ok);
+			}
+		}
+		REQUIRE(backend.calls == 11);
+		REQUIRE(sys::fs::filesize(path + "/meta.0") > sizes[0]);
+
+		Cache cache(&backend, fix.opts);
+		cache.compact();
+		REQUIRE(sys::fs::filesize(path + "/meta.0") == sizes[0]);
+		REQUIRE(sys::fs::filesize(path + "/messages.0") == sizes[1]);
+		REQUIRE(sys::fs::filesize(path + "/diffstats.0") == sizes[2]);
+		REQUIRE(!sys::fs::exists(path + ".compact"));
+		REQUIRE(!sys::fs::exists(path + ".old"));
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 11);
+	}
+
+	SECTION("interrupted", "Finishing an interrupted directory swap") {
+		sys::fs::rename(path, path + ".compact");
+		sys::fs::mkdir(path + ".old");
+
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 10);
+		REQUIRE(!sys::fs::exists(path + ".old"));
+	}
+}
+
+TEST_CASE("cache/shared", "Sharing diffstats with equal content-based keys")
+{
+	// Backend assigning the same key to all revisions starting with "a"
+	struct KeyedBackend : public FakeBackend {
+		KeyedBackend(const Options &options) : FakeBackend(options) { }
+		std::vector<std::string> diffstatKeys(const std::vector<std::string> &ids) {
+			std::vector<std::string> keys(ids.size());
+			for (size_t i = 0; i < ids.size(); i++) {
+				keys[i] = (ids[i][0] == 'a' ? "key" : "");
+			}
+			return keys;
+		}
+	};
+
+	Fixture fix;
+	KeyedBackend backend(fix.opts);
+
+	{
+		Cache cache(&backend, fix.opts);
+		cache.prefetch(std::vector<std::string>(1, "a1"));
+		bool ok = fetch(&cache, "a1");
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 1);
+
+	for (int run = 0; run < 2; run++) {
+		Cache cache(&backend, fix.opts);
+		if (run > 0) {
+			// Links must survive consistency checks
+			cache.check();
+		}
+		std::string id = "a" + str::itos(run + 2);
+		cache.prefetch(std::vector<std::string>(1, id));
+		Revision *rev = cache.revision(id);
+		REQUIRE(rev->m_message == "message " + id);
+		std::map<std::string, Diffstat::Stat> stats = rev->m_diffstat->stats();
+		REQUIRE(stats.find("dir/a1") != stats.end());
+		delete rev;
+	}
+	REQUIRE(backend.calls == 1);
+	REQUIRE(backend.metaCalls == 2);
+
+	{
+		// Revisions without keys don't share anything
+		Cache cache(&backend, fix.opts);
+		cache.prefetch(std::vector<std::string>(1, "b1"));
+		bool ok = fetch(&cache, "b1");
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 2);
+}
+
+TEST_CASE("cache/journal", "Appending new revisions to the index journal")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+	std::string index = fix.dir + "/fake/cache.index", journal = fix.dir + "/fake/cache.journal";
+
+	{
+		Cache cache(&backend, fix.opts);
+		for (int i = 0; i < 100; i++) {
+			fetch(&cache, str::itos(i));
+		}
+	}
+	REQUIRE(sys::fs::filesize(index) == 16 + 100 * 44);
+	REQUIRE(!sys::fs::fileExists(journal));
+
+	SECTION("append", "Appending without rewriting the index file") {
+		for (int run = 0; run < 2; run++) {
+			Cache cache(&backend, fix.opts);
+			for (int i = 0; i < 10; i++) {
+				fetch(&cache, "run" + str::itos(run) + "/" + str::itos(i));
+			}
+		}
+		REQUIRE(sys::fs::filesize(index) == 16 + 100 * 44);
+		REQUIRE(sys::fs::filesize(journal) == 8 + 20 * 44);
+
+		// A partial record of an interrupted flush is ignored and dropped
+		FILE *f = fopen(journal.c_str(), "ab");
+		fwrite("partial", 1, 7, f);
+		fclose(f);
+		{
+			Cache cache(&backend, fix.opts);
+			bool ok = fetch(&cache, "0") && fetch(&cache, "run0/0") && fetch(&cache, "run1/9");
+			REQUIRE(ok);
+			ok = fetch(&cache, "last");
+			REQUIRE(ok);
+		}
+		REQUIRE(backend.calls == 121);
+		REQUIRE(sys::fs::filesize(journal) == 8 + 21 * 44);
+
+		// Checking the cache merges the journal into the index file
+		{
+			Cache cache(&backend, fix.opts);
+			cache.check();
+		}
+		REQUIRE(!sys::fs::fileExists(journal));
+		REQUIRE(sys::fs::filesize(index) == 16 + 121 * 44);
+	}
+
+	SECTION("merge", "Merging the journal once it has grown large") {
+		{
+			Cache cache(&backend, fix.opts);
+			for (int i = 0; i < 4000; i++) {
+				fetch(&cache, "a" + str::itos(i));
+			}
+		}
+		REQUIRE(sys::fs::filesize(journal) == 8 + 4000 * 44);
+		{
+			Cache cache(&backend, fix.opts);
+			for (int i = 0; i < 200; i++) {
+				fetch(&cache, "b" + str::itos(i));
+			}
+		}
+		REQUIRE(!sys::fs::fileExists(journal));
+		REQUIRE(sys::fs::filesize(index) == 16 + 4300 * 44);
+
+		Cache cache(&backend, fix.opts);
+		bool ok = fetch(&cache, "99") && fetch(&cache, "a3999") && fetch(&cache, "b199");
+		REQUIRE(ok);
+		REQUIRE(backend.calls == 4300);
+	}
+}
+
+TEST_CASE("cache/processes", "Sharing a cache between processes")
+{
+	Fixture fix;
+	FakeBackend backend(fix.opts);
+
+	{
+		Cache cache(&backend, fix.opts);
+		bool ok = fetch(&cache, "parent1");
+		REQUIRE(ok);
+		cache.flush();
+
+		// Read and write from another process while the cache is in use
+		pid_t pid = fork();
+		REQUIRE(pid >= 0);
+		if (pid == 0) {
+			int status = 0;
+			try {
+				Cache other(&backend, fix.opts);
+				status = (fetch(&other, "parent1") && backend.calls == 1 ? 0 : 1);
+				for (int i = 0; i < 10 && status == 0; i++) {
+					status = (fetch(&other, "child" + str::itos(i)) ? 0 : 1);
+				}
+			} catch (...) {
+				status = 2;
+			}
+			_exit(status);
+		}
+		int status = -1;
+		waitpid(pid, &status, 0);
+		REQUIRE(WIFEXITED(status));
+		REQUIRE(WEXITSTATUS(status) == 0);
+
+		ok = fetch(&cache, "parent2");
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 2);
+
+	{
+		// The index contains the revisions of both processes
+		Cache cache(&backend, fix.opts);
+		bool ok = fetch(&cache, "parent1") && fetch(&cache, "parent2");
+		for (int i = 0; i < 10; i++) {
+			ok = ok && fetch(&cache, "child" + str::itos(i));
+		}
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 2);
+}
+
+TEST_CASE("cache/bundle", "Exporting and importing cache bundles")
+{
+	Fixture src, dest;
+	FakeBackend backend(src.opts);
+	std::string bundle = src.dir + "/bundle";
+	{
+		Cache cache(&backend, src.opts);
+		for (int i = 0; i < 300; i++) {
+			bool ok = fetch(&cache, str::itos(i));
+			REQUIRE(ok);
+		}
+		size_t n = cache.exportBundle(bundle);
+		REQUIRE(n == 300);
+	}
+	REQUIRE(backend.calls == 300);
+
+	SECTION("cache", "Importing into an empty cache") {
+		FakeBackend other(dest.opts);
+		for (int run = 0; run < 2; run++) {
+			Cache cache(&other, dest.opts);
+			size_t n = cache.importBundle(bundle);
+			REQUIRE(n == (run == 0 ? 300 : 0));
+			for (int i = 0; i < 300; i++) {
+				bool ok = fetch(&cache, str::itos(i));
+				REQUIRE(ok);
+			}
+		}
+		REQUIRE(other.calls == 0);
+	}
+
+	SECTION("memory", "Importing into an in-memory cache") {
+		FakeBackend other(dest.opts);
+		MemoryCache cache(&other, dest.opts);
+		size_t n = cache.importBundle(bundle);
+		REQUIRE(n == 300);
+		bool ok = fetch(&cache, "42");
+		REQUIRE(ok);
+		REQUIRE(other.calls == 0);
+	}
+
+	SECTION("foreign", "Rejecting bundles of other repositories") {
+		dest.opts.m_options["cache_id"] = "other";
+		FakeBackend other(dest.opts);
+		Cache cache(&other, dest.opts);
+		REQUIRE_THROWS(cache.importBundle(bundle));
+		REQUIRE_THROWS(cache.importBundle(dest.dir + "/missing"));
+	}
+}
+
+TEST_CASE("cache/shard", "Distributing the history over several bundles")
+{
+	Fixture dest;
+	std::vector<std::string> log;
+	for (int i = 0; i < 301; i++) {
+		log.push_back(str::itos(i));
+	}
+
+	// Every worker fetches its part of the history only
+	std::vector<std::string> bundles;
+	for (int k = 1; k <= 3; k++) {
+		Fixture worker;
+		FakeBackend backend(worker.opts);
+		backend.log = log;
+		std::string bundle = dest.dir + "/shard" + str::itos(k);
+		{
+			Cache cache(&backend, worker.opts);
+			size_t n = cache.exportShard(bundle, k, 3);
+			REQUIRE(n == size_t(k * 301 / 3 - (k-1) * 301 / 3));
+		}
+		REQUIRE(backend.calls == int(k * 301 / 3 - (k-1) * 301 / 3));
+		bundles.push_back(bundle);
+	}
+
+	FakeBackend backend(dest.opts);
+	Cache cache(&backend, dest.opts);
+	size_t total = 0;
+	for (size_t i = 0; i < bundles.size(); i++) {
+		total += cache.importBundle(bundles[i]);
+	}
+	REQUIRE(total == 301);
+	for (int i = 0; i < 301; i++) {
+		bool ok = fetch(&cache, str::itos(i));
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 0);
+}
+
+TEST_CASE("cache/warm", "Filling the cache without running a report")
+{
+	Fixture fixture;
+	FakeBackend backend(fixture.opts);
+	for (int i = 0; i < 2500; i++) {
+		backend.log.push_back(str::itos(i));
+	}
+
+	{
+		Cache cache(&backend, fixture.opts);
+		REQUIRE(fetch(&cache, "17"));
+		size_t n = cache.warm();
+		REQUIRE(n == 2499);
+	}
+	REQUIRE(backend.calls == 2500);
+
+	// Subsequent runs only add new revisions
+	backend.log.push_back("new");
+	Cache cache(&backend, fixture.opts);
+	size_t n = cache.warm();
+	REQUIRE(n == 1);
+	n = cache.warm();
+	REQUIRE(n == 0);
+	REQUIRE(backend.calls == 2501);
+	for (int i = 0; i < 2500; i += 100) {
+		bool ok = fetch(&cache, str::itos(i));
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 2501);
+}
+
+// Reads a complete log
+std::vector<std::string> readLog(Backend *backend, const std::string &branch = std::string(), int64_t start = -1, int64_t end = -1)
+{
+	std::vector<std::string> ids;
+	Backend::LogIterator *it = backend->iterator(branch, start, end);
+	it->start();
+	std::queue<std::string> queue;
+	while (it->nextIds(&queue)) {
+		while (!queue.empty()) {
+			ids.push_back(queue.front());
+			queue.pop();
+		}
+	}
+	it->wait();
+	delete it;
+	return ids;
+}
+
+TEST_CASE("cache/log", "Replaying logs while the head is unchanged")
+{
+	Fixture fixture;
+	FakeBackend backend(fixture.opts);
+	for (int i = 0; i < 100; i++) {
+		backend.log.push_back(str::itos(i));
+	}
+	backend.headId = "99";
+
+	for (int run = 0; run < 2; run++) {
+		Cache cache(&backend, fixture.opts);
+		std::vector<std::string> ids = readLog(&cache);
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 1);
+	}
+
+	// Other branches and heads need a new log
+	{
+		Cache cache(&backend, fixture.opts);
+		std::vector<std::string> ids = readLog(&cache, "other");
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 2);
+
+		backend.log.push_back("100");
+		backend.headId = "100";
+		ids = readLog(&cache);
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 3);
+		ids = readLog(&cache);
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 3);
+	}
+
+	// Incomplete logs are not recorded
+	{
+		backend.headId = "101";
+		Cache cache(&backend, fixture.opts);
+		Backend::LogIterator *it = cache.iterator();
+		it->start();
+		it->wait();
+		delete it;
+		std::vector<std::string> ids = readLog(&cache);
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 5);
+	}
+
+	// Logs are passed through without a head
+	{
+		backend.headId.clear();
+		MemoryCache cache(&backend, fixture.opts);
+		readLog(&cache);
+		readLog(&cache);
+		REQUIRE(backend.iterators == 7);
+	}
+}
+
+TEST_CASE("cache/dates", "Cutting date-bounded logs out of the complete log")
+{
+	struct DatedBackend : public FakeBackend {
+		DatedBackend(const Options &options) : FakeBackend(options) { }
+		bool orderedDates() const { return true; }
+	};
+
+	Fixture fixture;
+	DatedBackend backend(fixture.opts);
+	for (int i = 0; i < 100; i++) {
+		backend.log.push_back(str::itos(i));
+	}
+	backend.headId = "99";
+	std::vector<std::string> early(backend.log.begin(), backend.log.begin() + 10);
+	std::vector<std::string> late(backend.log.begin() + 10, backend.log.end());
+
+	{
+		Cache cache(&backend, fixture.opts);
+		readLog(&cache);
+		REQUIRE(backend.iterators == 1);
+
+		// The index requires all revisions to be cached
+		readLog(&cache, std::string(), 1001, -1);
+		REQUIRE(backend.iterators == 2);
+		std::vector<Revision *> revs = cache.revisions(backend.log);
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		cache.flush();
+
+		std::vector<std::string> ids = readLog(&cache, std::string(), 1001, -1);
+		REQUIRE(ids == late);
+		ids = readLog(&cache, std::string(), -1, 1001);
+		REQUIRE(ids == early);
+		ids = readLog(&cache, std::string(), 1002, 2000);
+		REQUIRE(ids.empty());
+		REQUIRE(backend.iterators == 2);
+	}
+
+	// The index is stored for the head
+	{
+		Cache cache(&backend, fixture.opts);
+		std::vector<std::string> ids = readLog(&cache, std::string(), 0, 1001);
+		REQUIRE(ids == early);
+		REQUIRE(backend.iterators == 2);
+
+		// The fake backend ignores date bounds
+		backend.log.push_back("100");
+		backend.headId = "100";
+		ids = readLog(&cache, std::string(), 0, 1001);
+		REQUIRE(ids == backend.log);
+		REQUIRE(backend.iterators == 3);
+	}
+}
+
+TEST_CASE("cache/lines", "Caching line counts of files by content")
+{
+	struct TreeBackend : public FakeBackend {
+		TreeBackend(const Options &options) : FakeBackend(options), cats(0) { }
+		std::vector<std::string> treeKeys(const std::string &, std::vector<std::string> *paths) {
+			paths->clear();
+			std::vector<std::string> keys;
+			for (std::map<std::string, std::string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+				paths->push_back(it->first);
+				keys.push_back(keyed ? "key:" + it->second : std::string());
+			}
+			return keys;
+		}
+		std::string cat(const std::string &path, const std::string &) { ++cats; return files[path]; }
+
+		std::map<std::string, std::string> files;
+		bool keyed;
+		int cats;
+	};
+
+	Fixture fixture;
+	TreeBackend backend(fixture.opts);
+	backend.files["a.c"] = "int a;\nint b;\n";
+	backend.files["b.c"] = "x";
+	backend.keyed = true;
+
+	{
+		Cache cache(&backend, fixture.opts);
+		std::map<std::string, uint64_t> counts = cache.lineCounts();
+		REQUIRE(counts.size() == 2);
+		REQUIRE(counts["a.c"] == 2);
+		REQUIRE(counts["b.c"] == 1);
+		REQUIRE(backend.cats == 2);
+	}
+
+	// Only changed files are read again
+	{
+		backend.files["b.c"] = "x\ny\nz\n";
+		Cache cache(&backend, fixture.opts);
+		std::map<std::string, uint64_t> counts = cache.lineCounts();
+		REQUIRE(counts["a.c"] == 2);
+		REQUIRE(counts["b.c"] == 3);
+		REQUIRE(backend.cats == 3);
+		counts = cache.lineCounts();
+		REQUIRE(backend.cats == 3);
+	}
+
+	// Files without keys are always read
+	{
+		backend.keyed = false;
+		Cache cache(&backend, fixture.opts);
+		std::map<std::string, uint64_t> counts = cache.lineCounts();
+		REQUIRE(counts["b.c"] == 3);
+		REQUIRE(backend.cats == 5);
+	}
+}
+
+TEST_CASE("cache/rollups", "Maintaining per-day rollups")
+{
+	Fixture fixture;
+	FakeBackend backend(fixture.opts);
+
+	// Rollups are built from the cached revisions once
+	{
+		Cache cache(&backend, fixture.opts);
+		REQUIRE(fetch(&cache, "a"));
+		REQUIRE(fetch(&cache, "bb"));
+		std::vector<Rollups::Row> rows;
+		bool ok = cache.rollups(Rollups::Author, -1, -1, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.size() == 2);
+		REQUIRE(rows[0].day == 0);
+		REQUIRE(rows[0].key == "author a");
+		REQUIRE(rows[0].commits == 1);
+		REQUIRE(rows[1].added == 2);
+	}
+	REQUIRE(sys::fs::fileExists(AbstractCache::cacheFile(&backend, "rollups")));
+
+	// New revisions are added as they are written
+	{
+		Cache cache(&backend, fixture.opts);
+		REQUIRE(fetch(&cache, "ccc"));
+		REQUIRE(fetch(&cache, "a"));
+		std::vector<Rollups::Row> rows;
+		bool ok = cache.rollups(Rollups::Directory, 0, 0, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.size() == 1);
+		REQUIRE(rows[0].key == "dir");
+		REQUIRE(rows[0].commits == 3);
+		REQUIRE(rows[0].added == 6);
+		REQUIRE(rows[0].removed == 3);
+		ok = cache.rollups(Rollups::Author, 86400, -1, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.empty());
+	}
+	REQUIRE(backend.calls == 3);
+
+	// Revisions written more than once are counted once
+	{
+		Cache cache(&backend, fixture.opts);
+		std::vector<Revision *> revs = cache.revisions(std::vector<std::string>(2, "dddd"));
+		for (size_t i = 0; i < revs.size(); i++) {
+			delete revs[i];
+		}
+		cache.flush();
+		REQUIRE(fetch(&cache, "dddd"));
+		std::vector<Rollups::Row> rows;
+		bool ok = cache.rollups(Rollups::Directory, -1, -1, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.size() == 1);
+		REQUIRE(rows[0].commits == 4);
+		REQUIRE(rows[0].added == 10);
+		REQUIRE(rows[0].removed == 4);
+	}
+
+	// Checking the cache drops the rollups
+	{
+		Cache cache(&backend, fixture.opts);
+		cache.check();
+		REQUIRE(!sys::fs::fileExists(AbstractCache::cacheFile(&backend, "rollups")));
+		std::vector<Rollups::Row> rows;
+		bool ok = cache.rollups(Rollups::Author, -1, -1, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.size() == 4);
+	}
+
+	// In-memory caches use the rollups of the wrapped cache, and there are
+	// none without a persistent cache
+	{
+		Cache cache(&backend, fixture.opts);
+		MemoryCache memory(&cache, fixture.opts);
+		std::vector<Rollups::Row> rows;
+		bool ok = memory.rollups(Rollups::Author, -1, -1, &rows);
+		REQUIRE(ok);
+		REQUIRE(rows.size() == 4);
+		MemoryCache direct(&backend, fixture.opts);
+		ok = direct.rollups(Rollups::Author, -1, -1, &rows);
+		REQUIRE(!ok);
+	}
+}
+
+TEST_CASE("cache/contents", "Caching tree listings and file contents")
+{
+	struct ContentBackend : public FakeBackend {
+		ContentBackend(const Options &options) : FakeBackend(options), trees(0), cats(0) { }
+		std::string treeKey(const std::string &id) { return (id.empty() ? std::string() : "tree:" + id); }
+		std::vector<std::string> tree(const std::string &id) {
+			++trees;
+			return std::vector<std::string>(1, "file@" + id);
+		}
+		std::string cat(const std::string &path, const std::string &id) { ++cats; return path + "@" + id; }
+
+		int trees, cats;
+	};
+
+	Fixture fixture;
+	ContentBackend backend(fixture.opts);
+
+	SECTION("tree", "Tree listings") {
+		for (int run = 0; run < 2; run++) {
+			Cache cache(&backend, fixture.opts);
+			std::vector<std::string> t = cache.tree("1");
+			REQUIRE(t.size() == 1);
+			REQUIRE(t[0] == "file@1");
+			REQUIRE(backend.trees == 1);
+		}
+
+		// Trees without keys are always listed
+		Cache cache(&backend, fixture.opts);
+		cache.tree();
+		cache.tree();
+		REQUIRE(backend.trees == 3);
+	}
+
+	SECTION("cat", "File contents") {
+		Cache cache(&backend, fixture.opts);
+		std::vector<std::string> paths;
+		paths.push_back("a");
+		paths.push_back("b");
+		std::vector<std::string> contents = cache.catMany(paths, "1");
+		REQUIRE(contents.size() == 2);
+		REQUIRE(contents[1] == "b@1");
+		REQUIRE(backend.cats == 2);
+
+		paths.push_back("c");
+		contents = cache.catMany(paths, "1");
+		REQUIRE(contents[2] == "c@1");
+		REQUIRE(backend.cats == 3);
+		std::string data = cache.cat("a", "1");
+		REQUIRE(data == "a@1");
+		REQUIRE(backend.cats == 3);
+
+		data = cache.cat("a", "2");
+		REQUIRE(data == "a@2");
+		cache.cat("a");
+		cache.cat("a");
+		REQUIRE(backend.cats == 6);
+	}
+}
+
+} // namespace test_cache
+
+
+#endif // TEST_CACHE_H
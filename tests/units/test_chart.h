@@ -0,0 +1,121 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_chart.h
+ * Unit tests for the native chart renderer
+ */
+
+
+#ifndef TEST_CHART_H
+#define TEST_CHART_H
+
+
+#include <sstream>
+
+#include "canvas.h"
+#include "chart.h"
+
+
+namespace test_chart
+{
+
+TEST_CASE("chart/commands", "Parsing of Gnuplot commands")
+{
+	std::ostringstream out;
+	Chart chart(out);
+	chart.command("set output \"a;b.png\"; set terminal png size 800,300\n"
+		"set title \"Lines of Code\"\n"
+		"set xrange [-1:24]; set yrange [*:10]\n"
+		"set xdata time\n"
+		"set nokey\n"
+		"plot '-' using 1:2");
+	REQUIRE(chart.m_output == "a;b.png");
+	REQUIRE(chart.m_terminal == "png");
+	REQUIRE(chart.m_width == 800);
+	REQUIRE(chart.m_height == 300);
+	REQUIRE(chart.m_title == "Lines of Code");
+	REQUIRE(chart.m_xrange.min == -1);
+	REQUIRE(chart.m_xrange.max == 24);
+	REQUIRE(!chart.m_xrange.autoMin);
+	REQUIRE(chart.m_yrange.autoMin);
+	REQUIRE(!chart.m_yrange.autoMax);
+	REQUIRE(chart.m_timeData);
+	REQUIRE(!chart.m_key);
+
+	chart.command("unset output; set xdata; set key");
+	REQUIRE(chart.m_output.empty());
+	REQUIRE(!chart.m_timeData);
+	REQUIRE(chart.m_key);
+
+	REQUIRE(Chart::parseStyle("with circles lc rgb \"black\"") == Chart::Circles);
+	REQUIRE(Chart::parseStyle("lines smooth bezier") == Chart::Lines);
+	REQUIRE(Chart::parseStyle("points") == Chart::Points);
+}
+
+TEST_CASE("chart/svg", "SVG output")
+{
+	std::ostringstream out;
+	Chart chart(out);
+	chart.command("set terminal svg size 320,200; set title \"A & B\"");
+
+	std::vector<Chart::Series> series(1);
+	series[0].title = "Series";
+	for (int i = 0; i < 10; i++) {
+		series[0].keys.push_back(i);
+		series[0].values.push_back(i * i);
+	}
+	chart.plot(series);
+
+	std::string svg = out.str();
+	REQUIRE(svg.compare(0, 5, "<?xml") == 0);
+	REQUIRE(svg.find("width=\"320\"") != std::string::npos);
+	REQUIRE(svg.find("<polyline") != std::string::npos);
+	REQUIRE(svg.find("A &amp; B") != std::string::npos);
+	REQUIRE(svg.find("Series") != std::string::npos);
+	REQUIRE(svg.find("</svg>") != std::string::npos);
+}
+
+TEST_CASE("chart/png", "PNG output")
+{
+	Canvas canvas(20, 10);
+	canvas.rect(2, 2, 4, 4, 0xFF0000);
+	REQUIRE(canvas.pixel(0, 0) == 0xFFFFFF);
+	REQUIRE(canvas.pixel(3, 3) == 0xFF0000);
+	canvas.line(0, 9, 19, 9, 0x00FF00);
+	REQUIRE(canvas.pixel(10, 9) == 0x00FF00);
+
+	std::ostringstream out;
+	Chart chart(out);
+	chart.command("set terminal png size 100,80");
+	std::vector<std::string> labels;
+	labels.push_back("a");
+	labels.push_back("b");
+	std::vector<double> values;
+	values.push_back(1);
+	values.push_back(3);
+	chart.plotPie(labels, values);
+
+	std::string png = out.str();
+	REQUIRE(png.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0);
+	REQUIRE(png.find("IHDR") == 12);
+	REQUIRE(png.compare(png.length() - 8, 4, "IEND") == 0);
+}
+
+TEST_CASE("chart/errors", "Unsupported terminals")
+{
+	std::ostringstream out;
+	Chart chart(out);
+	chart.command("set terminal postscript eps color enhanced");
+	std::vector<Chart::Series> series(1);
+	REQUIRE_THROWS(chart.plot(series));
+	REQUIRE(out.str().empty());
+}
+
+} // namespace test_chart
+
+#endif // TEST_CHART_H
@@ -0,0 +1,57 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_checkpoint.h
+ * Unit tests for report checkpoints
+ */
+
+
+#ifndef TEST_CHECKPOINT_H
+#define TEST_CHECKPOINT_H
+
+
+#include "checkpoint.h"
+
+
+namespace test_checkpoint
+{
+
+TEST_CASE("checkpoint/key", "Checkpoint keys")
+{
+	std::map<std::string, std::string> options;
+	options["branch"] = "master";
+	options["type"] = "svg";
+	std::string key = Checkpoint::key("reports/loc.lua", options, "master");
+	REQUIRE(key.compare(0, 8, "loc.lua_") == 0);
+	REQUIRE(key.length() == 8 + 40);
+	REQUIRE(key == Checkpoint::key("reports/loc.lua", options, "master"));
+
+	SECTION("report", "Different reports") {
+		REQUIRE(key != Checkpoint::key("reports/authors.lua", options, "master"));
+		REQUIRE(key != Checkpoint::key("other/loc.lua", options, "master"));
+	}
+
+	SECTION("options", "Different options") {
+		std::map<std::string, std::string> other = options;
+		other["type"] = "png";
+		REQUIRE(key != Checkpoint::key("reports/loc.lua", other, "master"));
+		other.erase("type");
+		REQUIRE(key != Checkpoint::key("reports/loc.lua", other, "master"));
+		other["typesvg"] = "";
+		REQUIRE(key != Checkpoint::key("reports/loc.lua", other, "master"));
+	}
+
+	SECTION("key", "Different user keys") {
+		REQUIRE(key != Checkpoint::key("reports/loc.lua", options, "trunk"));
+		REQUIRE(key != Checkpoint::key("reports/loc.lua", options, ""));
+	}
+}
+
+} // namespace test_checkpoint
+
+#endif // TEST_CHECKPOINT_H
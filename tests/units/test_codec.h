@@ -0,0 +1,95 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_codec.h
+ * Unit tests for the compression codecs
+ */
+
+
+#ifndef TEST_CODEC_H
+#define TEST_CODEC_H
+
+
+#include "codec.h"
+
+
+namespace test_codec
+{
+
+// Encodes and decodes the data, checking the result
+bool roundtrip(const Codec &codec, const std::vector<char> &in, size_t *encoded = NULL)
+{
+	std::vector<char> out, buffer;
+	codec.encode(in.empty() ? NULL : &in[0], in.size(), &out);
+	if (encoded) {
+		*encoded = out.size();
+	}
+	const char *data;
+	size_t length;
+	if (!codec.decode(out.empty() ? NULL : &out[0], out.size(), &buffer, &data, &length)) {
+		return false;
+	}
+	return (std::vector<char>(data, data + length) == in);
+}
+
+
+TEST_CASE("codec/roundtrip", "Encoding and decoding data")
+{
+	Codec::Id ids[] = { Codec::None, Codec::Zlib, Codec::LZ4, Codec::Zstd };
+	for (size_t i = 0; i < sizeof(ids) / sizeof(Codec::Id); i++) {
+		if (!Codec::available(ids[i])) {
+			continue;
+		}
+		Codec codec(ids[i]);
+
+		// Random data won't be compressed, but text will
+		for (int j = 0; j < 300; j++) {
+			std::vector<char> in(j);
+			for (size_t k = 0; k < in.size(); k++) in[k] = rand() & 0xFF;
+			bool ok = roundtrip(codec, in);
+			REQUIRE(ok);
+		}
+
+		std::string text;
+		for (int j = 0; j < 100; j++) {
+			text += "src/backends/git.cpp\n";
+		}
+		size_t encoded;
+		bool ok = roundtrip(codec, std::vector<char>(text.begin(), text.end()), &encoded);
+		REQUIRE(ok);
+		REQUIRE((ids[i] == Codec::None ? encoded == text.length() : encoded < text.length() / 4));
+	}
+}
+
+TEST_CASE("codec/raw", "Raw data in encoded format")
+{
+	Codec codec(Codec::None);
+	std::vector<char> in(1, 'M'), out, buffer;
+	codec.encode(&in[0], in.size(), &out);
+	REQUIRE(out == in);
+
+	// Data that starts with the marker byte is escaped
+	in.assign(10, '\xFF');
+	bool ok = roundtrip(codec, in);
+	REQUIRE(ok);
+
+	// Truncated headers and unknown codecs
+	const char *data;
+	size_t length;
+	REQUIRE(!codec.decode("\xFF\x01", 2, &buffer, &data, &length));
+	REQUIRE(!codec.decode("\xFF\x7F\x00\x00\x00\x01x", 7, &buffer, &data, &length));
+	REQUIRE(!Codec::supported("\xFF\x7F\x00\x00\x00\x01x", 7));
+	REQUIRE(Codec::supported("\x00\x00\x00\x01", 4));
+	REQUIRE_THROWS(Codec::parse("snappy"));
+	REQUIRE(Codec::parse("none") == Codec::None);
+}
+
+} // namespace test_codec
+
+
+#endif // TEST_CODEC_H
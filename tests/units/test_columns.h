@@ -0,0 +1,100 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_columns.h
+ * Unit tests for columnar revision data
+ */
+
+
+#ifndef TEST_COLUMNS_H
+#define TEST_COLUMNS_H
+
+
+#include <sstream>
+
+#include "bstream.h"
+#include "columns.h"
+#include "diffstat.h"
+#include "revision.h"
+#include "strlib.h"
+
+
+namespace test_columns
+{
+
+// Fills a column set with a few revisions
+void fill(Columns *c)
+{
+	const char *authors[] = {"a", "b", "a"};
+	for (int i = 0; i < 3; i++) {
+		DiffstatPtr stat = std::make_shared<Diffstat>();
+		Diffstat::Stat s;
+		s.ladd = 10 * (i+1);
+		s.ldel = i;
+		stat->add("file", s);
+		Revision rev(str::itos(i), 1000 + i, authors[i], (i == 1 ? "say \"hi\"" : "msg"), stat);
+		c->add(&rev);
+	}
+}
+
+TEST_CASE("columns/add", "Collecting columns")
+{
+	std::vector<std::string> names = str::split("date,author,ladd,delta,total,message", ",");
+	Columns c;
+	c.setFields(names);
+	fill(&c);
+
+	REQUIRE(c.size() == 3);
+	REQUIRE(c.width() == 6);
+	REQUIRE(c.find("total") == 4);
+	REQUIRE(c.find("none") == -1);
+	REQUIRE(c.columnAt(0).ints[2] == 1002);
+	REQUIRE(c.columnAt(1).dict.size() == 2);
+	REQUIRE(c.columnAt(1).str(2) == "a");
+	REQUIRE(c.columnAt(2).uints[1] == 20);
+	REQUIRE(c.columnAt(3).ints[2] == 28);
+	REQUIRE(c.columnAt(4).ints[2] == 57);
+	REQUIRE(c.columnAt(5).str(1) == "say \"hi\"");
+
+	SECTION("csv", "CSV output") {
+		std::ostringstream out;
+		c.writeCsv(out);
+		std::vector<std::string> lines = str::split(out.str(), "\n");
+		REQUIRE(lines[0] == "date,author,ladd,delta,total,message");
+		REQUIRE(lines[2] == "1001,\"b\",20,19,29,\"say \"\"hi\"\"\"");
+	}
+
+	SECTION("binary", "Serialization") {
+		MOStream out;
+		c.write(out);
+		std::vector<char> data = out.data();
+		MIStream in(data);
+		Columns d;
+		bool ok = d.load(in);
+		REQUIRE(ok);
+		REQUIRE(d.size() == 3);
+		REQUIRE(d.columnAt(1).str(1) == "b");
+		REQUIRE(d.columnAt(5).str(2) == "msg");
+		REQUIRE(d.columnAt(4).ints[1] == 29);
+	}
+
+	SECTION("invalid", "Unknown fields") {
+		bool thrown = false;
+		try {
+			c.setFields(str::split("date,foo", ","));
+		} catch (const PepperException &) {
+			thrown = true;
+		}
+		REQUIRE(thrown);
+	}
+}
+
+} // namespace test_columns
+
+
+#endif // TEST_COLUMNS_H
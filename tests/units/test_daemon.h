@@ -0,0 +1,99 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_daemon.h
+ * Unit tests for the daemon protocol
+ */
+
+
+#ifndef TEST_DAEMON_H
+#define TEST_DAEMON_H
+
+
+#include <unistd.h>
+
+#include "syslib/net.h"
+
+#include "daemon.h"
+
+
+namespace test_daemon
+{
+
+TEST_CASE("daemon/request", "Request encoding")
+{
+	std::vector<std::string> args;
+	args.push_back("--reports=loc,authors");
+	args.push_back("");
+	args.push_back("/path/to/repo");
+	std::string data = Daemon::encodeRequest("/home/user", args);
+
+	std::string cwd;
+	std::vector<std::string> decoded;
+	for (size_t i = 0; i < data.length(); i++) {
+		REQUIRE(Daemon::decodeRequest(data.substr(0, i), &cwd, &decoded) == false);
+	}
+	REQUIRE(Daemon::decodeRequest(data, &cwd, &decoded) == true);
+	REQUIRE(cwd == "/home/user");
+	REQUIRE(decoded == args);
+
+	REQUIRE(Daemon::decodeRequest(Daemon::encodeRequest("/", std::vector<std::string>()), &cwd, &decoded) == true);
+	REQUIRE(cwd == "/");
+	REQUIRE(decoded.empty());
+
+	REQUIRE_THROWS(Daemon::decodeRequest(std::string("x\0/\0", 4), &cwd, &decoded));
+}
+
+TEST_CASE("daemon/socket", "UNIX domain sockets")
+{
+	std::string path = str::printf("/tmp/pepper-test-%d.sock", (int)getpid());
+	char buffer[8];
+	ssize_t n;
+
+	sys::net::Server server;
+	server.listen(path);
+	REQUIRE(server.isOpen());
+	sys::net::Socket *conn = server.accept(0);
+	REQUIRE(conn == NULL);
+
+	// The second server probes the socket with a connection attempt
+	sys::net::Server second;
+	REQUIRE_THROWS(second.listen(path));
+	conn = server.accept(1000);
+	REQUIRE(conn != NULL);
+	n = conn->read(buffer, sizeof(buffer));
+	REQUIRE(n == 0);
+	delete conn;
+
+	sys::net::Socket client;
+	client.connect(path);
+	client.write("ping", 4);
+
+	conn = server.accept(1000);
+	REQUIRE(conn != NULL);
+	n = conn->read(buffer, sizeof(buffer));
+	REQUIRE(n == 4);
+	REQUIRE(std::string(buffer, 4) == "ping");
+	conn->write("pong", 4);
+	delete conn;
+
+	n = client.read(buffer, sizeof(buffer));
+	REQUIRE(n == 4);
+	REQUIRE(std::string(buffer, 4) == "pong");
+	n = client.read(buffer, sizeof(buffer));
+	REQUIRE(n == 0);
+
+	server.close();
+	REQUIRE(access(path.c_str(), F_OK) != 0);
+	REQUIRE_THROWS(client.connect(path));
+}
+
+} // namespace test_daemon
+
+
+#endif // TEST_DAEMON_H
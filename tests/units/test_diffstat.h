@@ -0,0 +1,345 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_diffstat.h
+ * Unit tests for diffstats and the diff parser
+ */
+
+
+#ifndef TEST_DIFFSTAT_H
+#define TEST_DIFFSTAT_H
+
+
+#include <sstream>
+
+#include "bstream.h"
+#include "diffstat.h"
+#include "strlib.h"
+
+
+namespace test_diffstat
+{
+
+const char diff[] =
+	"diff --git a/foo.c b/foo.c\n"
+	"--- a/foo.c\n"
+	"+++ b/foo.c\n"
+	"@@ -1,2 +1,3 @@\n"
+	"-int a;\n"
+	"-int b;\n"
+	"+int a = 0;\n"
+	"+int b = 1;\n"
+	"+--- c;\n"
+	"diff --git a/bar b/bar\n"
+	"new file mode 100644\n"
+	"--- /dev/null\n"
+	"+++ b/bar\n"
+	"@@ -0,0 +1 @@\n"
+	"+bar";
+
+// Returns whether two diffstats are equal
+bool equal(const DiffstatPtr &a, const DiffstatPtr &b)
+{
+	std::map<std::string, Diffstat::Stat> sa = a->stats(), sb = b->stats();
+	if (sa.size() != sb.size()) {
+		return false;
+	}
+	for (std::map<std::string, Diffstat::Stat>::const_iterator it = sa.begin(); it != sa.end(); ++it) {
+		const Diffstat::Stat &s = sb[it->first];
+		if (s.cadd != it->second.cadd || s.ladd != it->second.ladd || s.cdel != it->second.cdel || s.ldel != it->second.ldel) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+TEST_CASE("diffstat/parse", "Unified diff parsing")
+{
+	std::istringstream in(diff);
+	std::map<std::string, Diffstat::Stat> stats = DiffParser::parse(in)->stats();
+	REQUIRE(stats.size() == 2);
+	REQUIRE(stats["foo.c"].ladd == 3);
+	REQUIRE(stats["foo.c"].cadd == 29);
+	REQUIRE(stats["foo.c"].ldel == 2);
+	REQUIRE(stats["foo.c"].cdel == 14);
+	REQUIRE(stats["bar"].ladd == 1);
+	REQUIRE(stats["bar"].cadd == 4);
+	REQUIRE(stats["bar"].ldel == 0);
+}
+
+TEST_CASE("diffstat/totals", "Precomputed totals")
+{
+	std::istringstream in(diff);
+	DiffstatPtr stat = DiffParser::parse(in);
+	REQUIRE(stat->total().ladd == 4);
+	REQUIRE(stat->total().cadd == 33);
+	REQUIRE(stat->total().ldel == 2);
+	REQUIRE(stat->total().cdel == 14);
+
+	SECTION("filter", "Totals after filtering") {
+		DiffstatPtr filtered = Diffstat::filter(stat, "foo");
+		REQUIRE(filtered->total().ladd == 3);
+		REQUIRE(filtered->total().cadd == 29);
+		REQUIRE(stat->total().ladd == 4);
+		REQUIRE(Diffstat::filter(stat, std::string()) == stat);
+	}
+
+	SECTION("load", "Totals after loading") {
+		MOStream out;
+		stat->writeLegacy(out);
+		std::vector<char> data = out.data();
+		MIStream min(data);
+		Diffstat d;
+		bool ok = d.load(min);
+		REQUIRE(ok);
+		REQUIRE(d.total().ladd == 4);
+		REQUIRE(d.total().cdel == 14);
+	}
+}
+
+TEST_CASE("diffstat/feed", "Incremental diff parsing")
+{
+	std::istringstream in(diff);
+	DiffstatPtr ref = DiffParser::parse(in);
+
+	SECTION("chunks", "Arbitrary chunk sizes") {
+		DiffParser parser;
+		for (size_t size = 1; size < sizeof(diff); size++) {
+			for (size_t i = 0; i < sizeof(diff) - 1; i += size) {
+				parser.feed(diff + i, std::min(size, sizeof(diff) - 1 - i));
+			}
+			DiffstatPtr stat = parser.finish();
+			REQUIRE(equal(stat, ref));
+		}
+	}
+
+	SECTION("eof", "End of diff marker") {
+		DiffParser parser;
+		std::string data = std::string(diff) + "\n" + (char)EOF + "\n--- a/baz\n+++ b/baz\n@@ -1 +1 @@\n+baz\n";
+		parser.feed(data.data(), data.length());
+		REQUIRE(parser.done());
+		DiffstatPtr stat = parser.finish();
+		REQUIRE(equal(stat, ref));
+		REQUIRE(!parser.done());
+	}
+
+	SECTION("long", "Lines spanning many chunks") {
+		DiffParser parser;
+		std::string data = "--- a/min.js\n+++ b/min.js\n@@ -0,0 +1,2 @@\n+" + std::string(200000, 'x') + "\n+;\n";
+		for (size_t i = 0; i < data.length(); i += 1000) {
+			parser.feed(data.data() + i, std::min((size_t)1000, data.length() - i));
+		}
+		DiffstatPtr stat = parser.finish();
+		REQUIRE(stat->size() == 1);
+		REQUIRE(stat->total().ladd == 2);
+		REQUIRE(stat->total().cadd == 200003);
+	}
+
+	SECTION("binary", "Binary file markers") {
+		std::string data = std::string(diff) + "\n"
+			"diff --git a/image.png b/image.png\n"
+			"index 0123456..789abcd 100644\n"
+			"GIT binary patch\n"
+			"literal 3\n"
+			"-KUaN1\n"
+			"+KUaN1\n"
+			"\n"
+			"Index: logo.gif\n"
+			"===================================================================\n"
+			"Cannot display: file marked as a binary type.\n"
+			"+svn:mime-type = image/gif\n";
+		std::istringstream in(data);
+		DiffstatPtr stat = DiffParser::parse(in);
+		REQUIRE(equal(stat, ref));
+	}
+}
+
+TEST_CASE("diffstat/limit", "Skipping huge files")
+{
+	DiffParser::setLimit(3);
+	std::istringstream in(diff);
+	DiffstatPtr stat = DiffParser::parse(in);
+	std::istringstream nin("3\t2\tfoo.c\n1\t0\tbar\n");
+	DiffstatPtr numstat = DiffParser::parse(nin, DiffParser::Numstat);
+	DiffParser::setLimit(0);
+
+	REQUIRE(stat->size() == 1);
+	REQUIRE(stat->stat("bar") != NULL);
+	REQUIRE(stat->total().ladd == 1);
+	REQUIRE(numstat->size() == 1);
+	REQUIRE(numstat->stat("bar") != NULL);
+
+	std::istringstream fin(diff);
+	DiffstatPtr full = DiffParser::parse(fin);
+	full = Diffstat::limit(full, 3);
+	REQUIRE(equal(full, stat));
+	REQUIRE(full->total().ladd == 1);
+	REQUIRE(full->total().cadd == 4);
+}
+
+TEST_CASE("diffstat/numstat", "Line counts only")
+{
+	std::string data = std::string("0123456789abcdef\n") + "3\t2\tfoo.c\n" + "1\t0\tbar\n" + "-\t-\timage.png\n" + "2\t0\t\"a\\tb\"\n" + (char)EOF + "\n4\t4\tbaz\n";
+	std::istringstream in(data);
+	DiffstatPtr stat = DiffParser::parse(in, DiffParser::Numstat);
+	std::map<std::string, Diffstat::Stat> stats = stat->stats();
+	REQUIRE(stats.size() == 3);
+	REQUIRE(stats["foo.c"].ladd == 3);
+	REQUIRE(stats["foo.c"].ldel == 2);
+	REQUIRE(stats["foo.c"].cadd == 0);
+	REQUIRE(stats["bar"].ladd == 1);
+	REQUIRE(stats["a\\tb"].ladd == 2);
+	REQUIRE(stat->total().ladd == 6);
+	REQUIRE(!stat->hasBytes());
+
+	SECTION("write", "Serialization without byte counts") {
+		MOStream out, full;
+		stat->write(out);
+		std::istringstream fin(diff);
+		DiffParser::parse(fin)->write(full);
+		std::vector<char> ldata = out.data();
+		MIStream min(ldata);
+		Diffstat d;
+		bool ok = d.load(min);
+		REQUIRE(ok);
+		REQUIRE(!d.hasBytes());
+		REQUIRE(equal(stat, std::make_shared<Diffstat>(d)));
+		REQUIRE(d.total().ldel == 2);
+
+		std::vector<char> fdata = full.data();
+		MIStream fmin(fdata);
+		ok = d.load(fmin);
+		REQUIRE(ok);
+		REQUIRE(d.hasBytes());
+	}
+}
+
+TEST_CASE("diffstat/paths", "Interned paths")
+{
+	uint32_t id = Diffstat::intern("test_diffstat/paths/a");
+	REQUIRE(Diffstat::intern("test_diffstat/paths/a") == id);
+	REQUIRE(Diffstat::path(id) == "test_diffstat/paths/a");
+	uint32_t found = 0;
+	REQUIRE(Diffstat::lookup("test_diffstat/paths/a", &found));
+	REQUIRE(found == id);
+	REQUIRE(!Diffstat::lookup("test_diffstat/paths/none", &found));
+
+	// Interned paths stay valid while the table grows
+	const std::string &path = Diffstat::path(id);
+	for (int i = 0; i < 10000; i++) {
+		Diffstat::intern(str::printf("test_diffstat/paths/%d", i));
+	}
+	REQUIRE(path == "test_diffstat/paths/a");
+}
+
+TEST_CASE("diffstat/stats", "Adding, filtering and serialization")
+{
+	Diffstat d;
+	Diffstat::Stat s;
+	s.cadd = 10; s.ladd = 2;
+	d.add("src/b", s);
+	d.add("doc/a", s);
+	d.add("src/b", s);
+	REQUIRE(d.size() == 2);
+	REQUIRE(d.stat("src/b") != NULL);
+	REQUIRE(d.stat("src/b")->ladd == 4);
+	REQUIRE(d.stat("src/b")->cadd == 20);
+	REQUIRE(d.stat("doc/a")->ladd == 2);
+	REQUIRE(d.stat("none") == NULL);
+	REQUIRE(d.total().ladd == 6);
+
+	SECTION("write", "Serialization") {
+		MOStream out;
+		d.write(out);
+		std::vector<char> data = out.data();
+		MIStream in(data);
+		Diffstat e;
+		bool ok = e.load(in);
+		REQUIRE(ok);
+		REQUIRE(equal(std::make_shared<Diffstat>(d), std::make_shared<Diffstat>(e)));
+	}
+
+	SECTION("compact", "Compact and legacy serialization") {
+		for (int i = 0; i < 20; i++) {
+			d.add("src/module/file" + str::itos(i), s);
+		}
+		MOStream compact, legacy;
+		d.write(compact);
+		d.writeLegacy(legacy);
+		std::vector<char> cdata = compact.data(), ldata = legacy.data();
+		bool smaller = (cdata.size() * 4 < ldata.size());
+		REQUIRE(smaller);
+
+		Diffstat e, f;
+		MIStream cin(cdata), lin(ldata);
+		bool ok = e.load(cin) && f.load(lin);
+		REQUIRE(ok);
+		REQUIRE(equal(std::make_shared<Diffstat>(d), std::make_shared<Diffstat>(e)));
+		REQUIRE(equal(std::make_shared<Diffstat>(d), std::make_shared<Diffstat>(f)));
+		REQUIRE(e.total().ladd == d.total().ladd);
+
+		// Truncated data is rejected
+		cdata.resize(10);
+		MIStream tin(cdata);
+		Diffstat t;
+		ok = t.load(tin);
+		REQUIRE(!ok);
+	}
+
+	SECTION("exclude", "Excluding paths") {
+		std::vector<std::string> patterns;
+		patterns.push_back("doc");
+		d.add("vendor/lib/x.c", s);
+		d.add("Cargo.lock", s);
+		std::vector<std::string> globs;
+		globs.push_back("vendor");
+		globs.push_back("*.lock");
+		DiffstatPtr e = Diffstat::exclude(Diffstat::create(d), globs);
+		REQUIRE(e->size() == 2);
+		REQUIRE(e->stat("vendor/lib/x.c") == NULL);
+		REQUIRE(e->stat("Cargo.lock") == NULL);
+		REQUIRE(e->stat("src/b") != NULL);
+		REQUIRE(e->total().ladd == 6);
+		REQUIRE(d.size() == 4);
+
+		REQUIRE(Diffstat::excluded("doc/a", patterns));
+		REQUIRE(!Diffstat::excluded("docs/a", patterns));
+		REQUIRE(!Diffstat::excluded("src/doc", patterns));
+		patterns.push_back("*/generated/*.h");
+		REQUIRE(Diffstat::excluded("src/generated/x.h", patterns));
+		REQUIRE(Diffstat::excluded("src/a/generated/x.h", patterns));
+		REQUIRE(!Diffstat::excluded("src/generated/x.c", patterns));
+	}
+
+	SECTION("filter", "Prefix filtering") {
+		DiffstatPtr f = Diffstat::filter(Diffstat::create(d), "src/");
+		REQUIRE(f->size() == 1);
+		REQUIRE(f->stat("doc/a") == NULL);
+		REQUIRE(f->stat("src/b")->ladd == 4);
+	}
+
+	SECTION("merge", "Merging partial diffstats") {
+		Diffstat e;
+		e.add("src/a", s);
+		e.add("doc/a", s);
+		std::vector<DiffstatPtr> parts;
+		parts.push_back(Diffstat::create(d));
+		parts.push_back(Diffstat::create(e));
+		DiffstatPtr m = Diffstat::merge(parts);
+		REQUIRE(m->size() == 3);
+		REQUIRE(m->stat("src/a")->ladd == 2);
+		REQUIRE(m->stat("doc/a")->ladd == 4);
+		REQUIRE(m->total().ladd == 10);
+	}
+}
+
+} // namespace test_diffstat
+
+
+#endif // TEST_DIFFSTAT_H
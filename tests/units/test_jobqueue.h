@@ -0,0 +1,312 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_jobqueue.h
+ * Unit tests for the job queue
+ */
+
+
+#ifndef TEST_JOBQUEUE_H
+#define TEST_JOBQUEUE_H
+
+
+#include <memory>
+
+#include "jobqueue.h"
+#include "strlib.h"
+
+#include "syslib/parallel.h"
+
+
+namespace test_jobqueue
+{
+
+// Worker thread computing the length of the argument strings
+class LengthThread : public sys::parallel::Thread
+{
+public:
+	LengthThread(JobQueue<std::string, size_t> *queue, volatile int *delay = NULL, size_t bytes = 0) : sys::parallel::Thread(), m_queue(queue), m_delay(delay), m_bytes(bytes), m_jobs(0) { }
+
+	void run() {
+		std::string arg;
+		while (m_queue->getArg(&arg)) {
+			if (m_delay != NULL && *m_delay > 0) {
+				msleep(*m_delay);
+			}
+			if (arg == "fail") {
+				m_queue->failed(arg);
+			} else {
+				m_queue->done(arg, arg.length(), m_bytes);
+			}
+			++m_jobs;
+		}
+	}
+
+	JobQueue<std::string, size_t> *m_queue;
+	volatile int *m_delay;
+	size_t m_bytes;
+	std::atomic<size_t> m_jobs;
+};
+
+
+TEST_CASE("jobqueue/results", "JobQueue results")
+{
+	JobQueue<std::string, size_t> queue(16);
+	std::vector<std::string> args;
+	for (int i = 0; i < 1000; i++) {
+		args.push_back(str::itos(i));
+	}
+
+	std::vector<LengthThread *> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(new LengthThread(&queue));
+		threads.back()->start();
+	}
+
+	SECTION("inorder", "In-order consumption") {
+		queue.put(args);
+		for (size_t i = 0; i < args.size(); i++) {
+			REQUIRE(queue.hasArg(args[i]));
+			size_t len = 0;
+			bool ok = queue.getResult(args[i], &len);
+			REQUIRE(ok);
+			REQUIRE(len == args[i].length());
+			REQUIRE(!queue.hasArg(args[i]));
+		}
+	}
+
+	SECTION("outoforder", "Out-of-order consumption") {
+		queue.put(args);
+		for (size_t i = args.size(); i > 0; i--) {
+			size_t len = 0;
+			bool ok = queue.getResult(args[i-1], &len);
+			REQUIRE(ok);
+			REQUIRE(len == args[i-1].length());
+		}
+	}
+
+	SECTION("chunks", "Multiple chunks") {
+		std::vector<std::string> chunk;
+		for (size_t i = 0; i < args.size(); i++) {
+			chunk.push_back(args[i]);
+			if (chunk.size() == 100) {
+				queue.put(chunk);
+				chunk.clear();
+			}
+			if (i >= 150) {
+				size_t len = 0;
+				bool ok = queue.getResult(args[i-150], &len);
+				REQUIRE(ok);
+			}
+		}
+	}
+
+	SECTION("failed", "Failed jobs") {
+		args.insert(args.begin() + 10, "fail");
+		queue.put(args);
+		for (size_t i = 0; i < args.size(); i++) {
+			size_t len = 0;
+			bool ok = queue.getResult(args[i], &len);
+			REQUIRE(ok == (args[i] != "fail"));
+		}
+	}
+
+	SECTION("unknown", "Unknown arguments") {
+		size_t len = 0;
+		bool ok = queue.getResult("unknown", &len);
+		REQUIRE(!queue.hasArg("unknown"));
+		REQUIRE(!ok);
+	}
+
+	queue.stop();
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+TEST_CASE("jobqueue/adaptive", "Adapting the number of active workers")
+{
+	JobQueue<std::string, size_t> queue(16);
+	queue.setLimits(1, 4, 8, 256);
+	REQUIRE(queue.activeWorkers() == 4);
+
+	std::vector<std::string> args;
+	for (int i = 0; i < 800; i++) {
+		args.push_back(str::itos(i));
+	}
+	queue.put(args);
+
+	volatile int delay = 0;
+	std::vector<LengthThread *> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(new LengthThread(&queue, &delay));
+		threads.back()->start();
+	}
+
+	// A slow consumer needs a single worker only
+	for (size_t i = 0; i < 400; i++) {
+		size_t len = 0;
+		bool ok = queue.getResult(args[i], &len);
+		REQUIRE(ok);
+		sys::parallel::Thread::msleep(1);
+	}
+	REQUIRE(queue.activeWorkers() == 1);
+
+	// Slow workers are all needed
+	delay = 2;
+	for (size_t i = 400; i < args.size(); i++) {
+		size_t len = 0;
+		bool ok = queue.getResult(args[i], &len);
+		REQUIRE(ok);
+		REQUIRE(len == args[i].length());
+	}
+	REQUIRE(queue.activeWorkers() == 4);
+
+	queue.stop();
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+}
+
+TEST_CASE("jobqueue/budget", "Limiting the memory used by results")
+{
+	std::vector<std::string> args;
+	for (int i = 0; i < 200; i++) {
+		args.push_back(str::itos(i));
+	}
+
+	MemoryBudget::setLimit(1000);
+	{
+		JobQueue<std::string, size_t> queue(512);
+		queue.put(args);
+
+		std::vector<LengthThread *> threads;
+		for (int i = 0; i < 4; i++) {
+			threads.push_back(new LengthThread(&queue, NULL, 100));
+			threads.back()->start();
+		}
+
+		// Workers may only exceed the budget with the jobs they have started
+		for (size_t i = 0; i < 100; i++) {
+			size_t len = 0;
+			bool ok = queue.getResult(args[i], &len);
+			REQUIRE(ok);
+			REQUIRE(MemoryBudget::used() <= 1000 + 4 * 100);
+			sys::parallel::Thread::msleep(1);
+		}
+
+		// Requested results are fetched even if the budget is exhausted
+		size_t len = 0;
+		bool ok = queue.getResult(args.back(), &len);
+		REQUIRE(ok);
+		REQUIRE(len == args.back().length());
+
+		queue.stop();
+		for (size_t i = 0; i < threads.size(); i++) {
+			threads[i]->wait();
+			delete threads[i];
+		}
+	}
+	REQUIRE(MemoryBudget::used() == 0);
+	MemoryBudget::setLimit(0);
+}
+
+TEST_CASE("jobqueue/priority", "Scheduling jobs the consumer is waiting for")
+{
+	JobQueue<std::string, size_t> queue(1000);
+	std::vector<std::string> args;
+	for (int i = 0; i < 200; i++) {
+		args.push_back(str::itos(i));
+	}
+	queue.put(args);
+
+	SECTION("batches", "Small batches next to the consumer") {
+		std::vector<std::string> batch;
+		bool ok = queue.getArgs(&batch, 64);
+		REQUIRE(ok);
+		REQUIRE(batch.size() == 8);
+		REQUIRE(batch.front() == "0");
+		ok = queue.getArgs(&batch, 64);
+		REQUIRE(ok);
+		REQUIRE(batch.size() == 8);
+		ok = queue.getArgs(&batch, 64);
+		REQUIRE(ok);
+		REQUIRE(batch.size() == 16);
+		ok = queue.getArgs(&batch, 64);
+		REQUIRE(ok);
+		REQUIRE(batch.size() == 32);
+		REQUIRE(batch.front() == "32");
+		queue.stop();
+	}
+
+	SECTION("urgent", "Waiting for a queued job") {
+		volatile int delay = 5;
+		LengthThread thread(&queue, &delay);
+		thread.start();
+
+		// The last job is started next, so no more than a few jobs have
+		// been finished before it
+		size_t len = 0;
+		bool ok = queue.getResult(args.back(), &len);
+		REQUIRE(ok);
+		size_t jobs = thread.m_jobs;
+		REQUIRE(jobs <= 3);
+
+		delay = 0;
+		for (size_t i = 0; i + 1 < args.size(); i++) {
+			ok = queue.getResult(args[i], &len);
+			REQUIRE(ok);
+			REQUIRE(len == args[i].length());
+		}
+		queue.stop();
+		thread.wait();
+	}
+}
+
+TEST_CASE("jobqueue/release", "Releasing consumed results")
+{
+	JobQueue<std::string, std::shared_ptr<std::string> > queue(16);
+	std::vector<std::string> args;
+	for (int i = 0; i < 10; i++) {
+		args.push_back(str::itos(i));
+	}
+	queue.put(args);
+	for (size_t i = 0; i < args.size(); i++) {
+		std::string arg;
+		bool ok = queue.getArg(&arg);
+		REQUIRE(ok);
+		queue.done(arg, std::make_shared<std::string>(arg));
+	}
+
+	// The first slot keeps the others in the window, but their results
+	// are released once they have been consumed
+	std::vector<std::weak_ptr<std::string> > refs;
+	for (size_t i = 1; i < args.size(); i++) {
+		std::shared_ptr<std::string> res;
+		bool ok = queue.getResult(args[i], &res);
+		REQUIRE(ok);
+		REQUIRE(*res == args[i]);
+		refs.push_back(res);
+	}
+	for (size_t i = 0; i < refs.size(); i++) {
+		REQUIRE(refs[i].expired());
+	}
+
+	std::shared_ptr<std::string> res;
+	bool ok = queue.getResult(args[0], &res);
+	REQUIRE(ok);
+	REQUIRE(*res == args[0]);
+	queue.stop();
+}
+
+} // namespace test_jobqueue
+
+
+#endif // TEST_JOBQUEUE_H
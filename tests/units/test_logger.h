@@ -0,0 +1,136 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_logger.h
+ * Unit tests for the logging facility
+ */
+
+
+#ifndef TEST_LOGGER_H
+#define TEST_LOGGER_H
+
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+#include "logger.h"
+
+
+namespace test_logger
+{
+
+// Counts its calls
+int evaluated = 0;
+const char *message()
+{
+	++evaluated;
+	return "message";
+}
+
+TEST_CASE("logger/levels", "Evaluation of log statements")
+{
+	int level = Logger::level();
+	std::ostringstream out;
+	Logger::setOutput(out, Logger::Debug);
+
+	// Disabled levels don't evaluate their arguments
+	evaluated = 0;
+	Logger::setLevel(Logger::Info);
+	PDEBUG << message() << endl;
+	Logger::flush();
+	REQUIRE(evaluated == 0);
+	REQUIRE(out.str().empty());
+
+	// Statements may be used without braces
+	if (evaluated == 0)
+		PDEBUG << message() << endl;
+	else
+		evaluated = -1;
+	REQUIRE(evaluated == 0);
+
+	Logger::setLevel(Logger::Debug);
+	PDEBUG << message() << endl;
+	Logger::flush();
+	REQUIRE(evaluated == 1);
+	REQUIRE(out.str().find("]: message\n") != std::string::npos);
+
+	Logger::setOutput(std::cerr, Logger::Debug);
+	Logger::setLevel(level);
+}
+
+// Thread writing numbered lines
+class LineThread : public sys::parallel::Thread
+{
+public:
+	LineThread(int id) : id(id) { }
+
+	void run() {
+		for (int i = 0; i < 100; i++) {
+			Logger::info() << "thread " << id << " line " << i << endl;
+		}
+	}
+
+	int id;
+};
+
+TEST_CASE("logger/async", "Queued records")
+{
+	int level = Logger::level();
+	std::ostringstream out;
+	Logger::setOutput(out, Logger::Info);
+	Logger::setLevel(Logger::Info);
+
+	// Records of several threads are not interleaved
+	std::vector<LineThread *> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(new LineThread(i));
+		threads.back()->start();
+	}
+	for (int i = 0; i < 4; i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+	Logger::flush();
+
+	std::istringstream in(out.str());
+	std::string line;
+	int lines = 0, next[4] = {0, 0, 0, 0};
+	while (std::getline(in, line)) {
+		int id = -1, n = -1;
+		REQUIRE(sscanf(line.c_str(), "thread %d line %d", &id, &n) == 2);
+		REQUIRE(id >= 0);
+		REQUIRE(id < 4);
+		REQUIRE(n == next[id]);
+		++next[id];
+		++lines;
+	}
+	REQUIRE(lines == 400);
+
+	// Progress updates are coalesced
+	out.str(std::string());
+	for (int i = 0; i < 1000; i++) {
+		Logger::info() << "\r\033[0K";
+		Logger::info() << "progress " << i << flush;
+	}
+	Logger::info() << "\r\033[0K";
+	Logger::info() << "done" << endl;
+	Logger::flush();
+	std::string text = out.str();
+	REQUIRE(text.length() >= 5);
+	REQUIRE(text.compare(text.length() - 5, 5, "done\n") == 0);
+	REQUIRE(std::count(text.begin(), text.end(), '\r') < 1000);
+
+	Logger::setOutput(std::cerr, Logger::Info);
+	Logger::setLevel(level);
+}
+
+} // namespace test_logger
+
+
+#endif // TEST_LOGGER_H
@@ -0,0 +1,66 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_luaprofiler.h
+ * Unit tests for the Lua profiler
+ */
+
+
+#ifndef TEST_LUAPROFILER_H
+#define TEST_LUAPROFILER_H
+
+
+#include <sstream>
+
+#include "luaprofiler.h"
+
+
+namespace test_luaprofiler
+{
+
+TEST_CASE("luaprofiler/profile", "Flat profiles and collapsed stacks")
+{
+	LuaProfiler::clear();
+	LuaProfiler::add("main chunk (loc.lua);run (loc.lua:10);diffstat:files", 3000);
+	LuaProfiler::add("main chunk (loc.lua);run (loc.lua:10)", 1000);
+	LuaProfiler::add("main chunk (loc.lua);run (loc.lua:10);count (loc.lua:3);count (loc.lua:3)", 2000);
+	LuaProfiler::add("main chunk (loc.lua);run (loc.lua:10)", 1000);
+
+	SECTION("collapsed", "Collapsed stacks") {
+		std::ostringstream out;
+		LuaProfiler::writeCollapsed(out);
+		REQUIRE(out.str() ==
+			"main chunk (loc.lua);run (loc.lua:10) 2000\n"
+			"main chunk (loc.lua);run (loc.lua:10);count (loc.lua:3);count (loc.lua:3) 2000\n"
+			"main chunk (loc.lua);run (loc.lua:10);diffstat:files 3000\n");
+	}
+
+	SECTION("flat", "Flat profile") {
+		std::ostringstream out;
+		LuaProfiler::print(out);
+		std::vector<std::string> lines = str::split(out.str(), "\n");
+		REQUIRE(lines.size() >= 6);
+		REQUIRE(lines[0] == "Lua profile (7.0 ms CPU time):");
+
+		// Sorted by self time and total time, with recursive calls
+		// counted once
+		REQUIRE(lines[2].find("diffstat:files") != std::string::npos);
+		REQUIRE(lines[2].find("3.0 ms  42.9%     3.0 ms  42.9%") != std::string::npos);
+		REQUIRE(lines[3].find("run (loc.lua:10)") != std::string::npos);
+		REQUIRE(lines[3].find("2.0 ms  28.6%     7.0 ms 100.0%") != std::string::npos);
+		REQUIRE(lines[4].find("count (loc.lua:3)") != std::string::npos);
+		REQUIRE(lines[4].find("2.0 ms  28.6%     2.0 ms  28.6%") != std::string::npos);
+	}
+
+	LuaProfiler::clear();
+}
+
+} // namespace test_luaprofiler
+
+
+#endif // TEST_LUAPROFILER_H
@@ -0,0 +1,94 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_memstats.h
+ * Unit tests for the memory accounting
+ */
+
+
+#ifndef TEST_MEMSTATS_H
+#define TEST_MEMSTATS_H
+
+
+#include <sstream>
+
+#include "diffstat.h"
+#include "memstats.h"
+
+
+namespace test_memstats
+{
+
+TEST_CASE("memstats/gauge", "Gauges")
+{
+	MemStats::start();
+	MemStats::reset();
+	int64_t base = MemStats::current(MemStats::CacheIndex);
+
+	{
+		MemStats::Gauge a(MemStats::CacheIndex), b(MemStats::CacheIndex);
+		a.set(1000);
+		b.set(500);
+		REQUIRE(MemStats::current(MemStats::CacheIndex) == base + 1500);
+		a.set(200);
+		REQUIRE(MemStats::current(MemStats::CacheIndex) == base + 700);
+		REQUIRE(MemStats::peak(MemStats::CacheIndex) == base + 1500);
+	}
+
+	// Destroyed gauges release their memory
+	REQUIRE(MemStats::current(MemStats::CacheIndex) == base);
+	REQUIRE(MemStats::peak(MemStats::CacheIndex) == base + 1500);
+}
+
+TEST_CASE("memstats/allocators", "Counting allocators")
+{
+	MemStats::start();
+
+	SECTION("diffstats", "Diffstat entries") {
+		int64_t base = MemStats::current(MemStats::Diffstats);
+		{
+			DiffstatPtr d = Diffstat::create();
+			Diffstat::Stat s;
+			s.ladd = 1;
+			d->add("src/a.cpp", s);
+			d->add("src/b.cpp", s);
+			REQUIRE(MemStats::current(MemStats::Diffstats) >= base + int64_t(2 * sizeof(Diffstat::Entry)));
+		}
+		REQUIRE(MemStats::current(MemStats::Diffstats) == base);
+	}
+
+	SECTION("lua", "Lua allocator") {
+		int64_t base = MemStats::current(MemStats::Lua);
+		void *p = MemStats::luaAlloc(NULL, NULL, 0, 100);
+		REQUIRE(p != NULL);
+		REQUIRE(MemStats::current(MemStats::Lua) == base + 100);
+		p = MemStats::luaAlloc(NULL, p, 100, 400);
+		REQUIRE(p != NULL);
+		REQUIRE(MemStats::current(MemStats::Lua) == base + 400);
+		p = MemStats::luaAlloc(NULL, p, 400, 0);
+		REQUIRE(p == NULL);
+		REQUIRE(MemStats::current(MemStats::Lua) == base);
+	}
+}
+
+TEST_CASE("memstats/print", "Summary")
+{
+	MemStats::start();
+	std::ostringstream out;
+	MemStats::print(out);
+	std::vector<std::string> lines = str::split(out.str(), "\n");
+	REQUIRE(lines.size() >= 2 + MemStats::NumSubsystems);
+	REQUIRE(lines[0] == "Memory usage:");
+	REQUIRE(lines[2].find("Cache index:") != std::string::npos);
+	REQUIRE(lines[6].find("LevelDB:") != std::string::npos);
+}
+
+} // namespace test_memstats
+
+
+#endif // TEST_MEMSTATS_H
@@ -159,6 +159,146 @@ TEST_CASE("options/cmdlines", "Command line parsing")
 	rhelp2.options["help"] = "true";
 	tests.push_back(rhelp2);
 
+	data_t multi(defaults);
+	multi.setupArgs(5, "-v", "--reports=loc,authors", "-tpng", "--loc.output=loc.png", "http://svn.example.org");
+	multi.options["reports"] = "loc,authors";
+	multi.options["repository"] = "http://svn.example.org";
+	multi.reportOptions["t"] = "png";
+	multi.reportOptions["loc.output"] = "loc.png";
+	tests.push_back(multi);
+
+	data_t cacheid(defaults);
+	cacheid.setupArgs(3, "--cache-id=monorepo", "loc", "http://svn.example.org");
+	cacheid.options["cache_id"] = "monorepo";
+	cacheid.options["report"] = "loc";
+	cacheid.options["repository"] = "http://svn.example.org";
+	tests.push_back(cacheid);
+
+	data_t cachememory(defaults);
+	cachememory.setupArgs(3, "--cache-memory=128", "loc", "http://svn.example.org");
+	cachememory.options["cache_memory"] = "128";
+	cachememory.options["report"] = "loc";
+	cachememory.options["repository"] = "http://svn.example.org";
+	tests.push_back(cachememory);
+
+	data_t revisionmemory(defaults);
+	revisionmemory.setupArgs(3, "--revision-memory=64", "loc", "http://svn.example.org");
+	revisionmemory.options["revision_memory"] = "64";
+	revisionmemory.options["report"] = "loc";
+	revisionmemory.options["repository"] = "http://svn.example.org";
+	tests.push_back(revisionmemory);
+
+	data_t jobs(defaults);
+	jobs.setupArgs(3, "-j4", "loc", "http://svn.example.org");
+	jobs.options["jobs"] = "4";
+	jobs.options["report"] = "loc";
+	jobs.options["repository"] = "http://svn.example.org";
+	tests.push_back(jobs);
+
+	data_t window(defaults);
+	window.setupArgs(3, "--prefetch-window=256", "loc", "http://svn.example.org");
+	window.options["prefetch_window"] = "256";
+	window.options["report"] = "loc";
+	window.options["repository"] = "http://svn.example.org";
+	tests.push_back(window);
+
+	data_t trace(defaults);
+	trace.setupArgs(3, "--trace=trace.json", "loc", "http://svn.example.org");
+	trace.options["trace"] = "trace.json";
+	trace.options["report"] = "loc";
+	trace.options["repository"] = "http://svn.example.org";
+	tests.push_back(trace);
+
+	data_t stats1(defaults);
+	stats1.setupArgs(3, "--stats", "loc", "http://svn.example.org");
+	stats1.options["stats"] = "true";
+	stats1.options["report"] = "loc";
+	stats1.options["repository"] = "http://svn.example.org";
+	tests.push_back(stats1);
+
+	data_t stats2(defaults);
+	stats2.setupArgs(3, "--stats=stats.json", "loc", "http://svn.example.org");
+	stats2.options["stats"] = "stats.json";
+	stats2.options["report"] = "loc";
+	stats2.options["repository"] = "http://svn.example.org";
+	tests.push_back(stats2);
+
+	data_t profile(defaults);
+	profile.setupArgs(3, "--profile-lua=loc.folded", "loc", "http://svn.example.org");
+	profile.options["profile_lua"] = "loc.folded";
+	profile.options["report"] = "loc";
+	profile.options["repository"] = "http://svn.example.org";
+	tests.push_back(profile);
+
+	data_t approx(defaults);
+	approx.setupArgs(3, "--diffstat=approx", "loc", "http://svn.example.org");
+	approx.options["diffstat"] = "approx";
+	approx.options["report"] = "loc";
+	approx.options["repository"] = "http://svn.example.org";
+	tests.push_back(approx);
+
+	data_t memstats(defaults);
+	memstats.setupArgs(3, "--memstats=30", "loc", "http://svn.example.org");
+	memstats.options["memstats"] = "30";
+	memstats.options["report"] = "loc";
+	memstats.options["repository"] = "http://svn.example.org";
+	tests.push_back(memstats);
+
+	data_t watch(defaults);
+	watch.setupArgs(4, "--watch=30", "--branch=release", "loc", "/tmp/repo");
+	watch.options["watch"] = "30";
+	watch.options["branch"] = "release";
+	watch.options["report"] = "loc";
+	watch.options["repository"] = "/tmp/repo";
+	tests.push_back(watch);
+
+	data_t plotter(defaults);
+	plotter.setupArgs(3, "--plotter=native", "loc", "http://svn.example.org");
+	plotter.options["plotter"] = "native";
+	plotter.options["report"] = "loc";
+	plotter.options["repository"] = "http://svn.example.org";
+	tests.push_back(plotter);
+
+	data_t daemon(defaults);
+	daemon.setupArgs(1, "--daemon=/tmp/pepper.sock");
+	daemon.options["daemon"] = "/tmp/pepper.sock";
+	tests.push_back(daemon);
+
+	data_t connect(defaults);
+	connect.setupArgs(3, "--connect=/tmp/pepper.sock", "loc", "http://svn.example.org");
+	connect.options["connect"] = "/tmp/pepper.sock";
+	connect.options["report"] = "loc";
+	connect.options["repository"] = "http://svn.example.org";
+	tests.push_back(connect);
+
+	data_t batch(defaults);
+	batch.setupArgs(3, "--batch=repos.txt", "loc", "--output=loc.svg");
+	batch.options["batch"] = "repos.txt";
+	batch.options["report"] = "loc";
+	batch.reportOptions["output"] = "loc.svg";
+	tests.push_back(batch);
+
+	data_t shard(defaults);
+	shard.setupArgs(3, "--shard=2/8", "--export-cache=part2.bundle", "http://svn.example.org");
+	shard.options["shard"] = "2/8";
+	shard.options["export_cache"] = "part2.bundle";
+	shard.options["repository"] = "http://svn.example.org";
+	tests.push_back(shard);
+
+	data_t warm(defaults);
+	warm.setupArgs(3, "--warm-cache", "--branch=stable", "http://svn.example.org");
+	warm.options["warm_cache"] = "true";
+	warm.options["branch"] = "stable";
+	warm.options["repository"] = "http://svn.example.org";
+	tests.push_back(warm);
+
+	data_t memoize(defaults);
+	memoize.setupArgs(3, "--memoize", "loc", "http://svn.example.org");
+	memoize.options["memoize"] = "true";
+	memoize.options["report"] = "loc";
+	memoize.options["repository"] = "http://svn.example.org";
+	tests.push_back(memoize);
+
 	// Run tests
 	for (std::vector<data_t>::size_type i = 0;  i < tests.size(); i++) {
 		Options opts;
@@ -169,6 +309,54 @@ TEST_CASE("options/cmdlines", "Command line parsing")
 	}
 }
 
+TEST_CASE("options/shard", "Shards of the history")
+{
+	Options opts;
+	int k, n;
+	REQUIRE(opts.shard(&k, &n) == false);
+	opts.m_options["shard"] = "3/8";
+	REQUIRE(opts.shard(&k, &n) == true);
+	REQUIRE(k == 3);
+	REQUIRE(n == 8);
+
+	const char *invalid[] = {"0/8", "9/8", "1/0", "3", "a/b", "1/2/3"};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		opts.m_options["shard"] = invalid[i];
+		INFO(invalid[i]);
+		REQUIRE_THROWS(opts.shard(&k, &n));
+	}
+
+	opts.m_options["import_cache"] = "a.bundle,,b.bundle";
+	std::vector<std::string> files = opts.importCaches();
+	REQUIRE(files.size() == 2);
+	REQUIRE(files[0] == "a.bundle");
+	REQUIRE(files[1] == "b.bundle");
+}
+
+TEST_CASE("options/reports", "Options for multiple reports")
+{
+	Options opts;
+	opts.m_options["reports"] = "loc,,authors";
+	opts.m_reportOptions["t"] = "png";
+	opts.m_reportOptions["output"] = "out.png";
+	opts.m_reportOptions["loc.output"] = "loc.png";
+	opts.m_reportOptions["authors.n"] = "3";
+
+	std::vector<std::string> reports = opts.reports();
+	REQUIRE(reports.size() == 2);
+	REQUIRE(reports[1] == "authors");
+
+	stringmap loc = opts.reportOptions("loc");
+	REQUIRE(loc.size() == 2);
+	REQUIRE(loc["t"] == "png");
+	REQUIRE(loc["output"] == "loc.png");
+
+	stringmap authors = opts.reportOptions("/path/to/authors.lua");
+	REQUIRE(authors.size() == 3);
+	REQUIRE(authors["output"] == "out.png");
+	REQUIRE(authors["n"] == "3");
+}
+
 } // namespace test_options
 
 #endif // TEST_OPTIONS_H
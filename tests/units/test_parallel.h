@@ -17,6 +17,10 @@
 
 #include <sys/time.h> 
 
+#ifdef POS_LINUX
+ #include <sched.h>
+#endif
+
 #include "syslib/parallel.h"
 
 
@@ -95,6 +99,70 @@ TEST_CASE("parallel/thread", "parallel::Thread")
 	}
 }
 
+TEST_CASE("parallel/threadcount", "parallel::idealThreadCount()")
+{
+	int count = sys::parallel::idealThreadCount();
+	REQUIRE(count >= 1);
+#ifdef POS_LINUX
+	// The affinity mask is an upper bound
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	REQUIRE(sched_getaffinity(0, sizeof(set), &set) == 0);
+	REQUIRE(count <= CPU_COUNT(&set));
+#endif
+}
+
+// Computes Fibonacci numbers with nested tasks, which the workers execute
+// while waiting for their subtasks
+int fib(sys::parallel::ThreadPool *pool, int n)
+{
+	if (n < 2) {
+		return n;
+	}
+	sys::parallel::Future<int> a = pool->submit(std::function<int()>([=]() { return fib(pool, n - 1); }));
+	int b = fib(pool, n - 2);
+	return a.get() + b;
+}
+
+TEST_CASE("parallel/pool", "parallel::ThreadPool")
+{
+	sys::parallel::ThreadPool pool(2);
+	REQUIRE(pool.size() == 2);
+
+	SECTION("futures", "Results of many functions") {
+		std::vector<sys::parallel::Future<int> > results;
+		for (int i = 0; i < 1000; i++) {
+			results.push_back(pool.submit(std::function<int()>([=]() { return i * i; })));
+		}
+		for (int i = 0; i < 1000; i++) {
+			int result = results[i].get();
+			REQUIRE(result == i * i);
+		}
+	}
+
+	SECTION("nested", "Tasks waiting for their subtasks") {
+		int result = pool.submit(std::function<int()>([&]() { return fib(&pool, 15); })).get();
+		REQUIRE(result == 610);
+	}
+
+	SECTION("exception", "Exceptions are passed to the waiting thread") {
+		sys::parallel::Future<int> future = pool.submit(std::function<int()>([]() -> int { throw PEX("failed"); }));
+		bool thrown = false;
+		try {
+			future.get();
+		} catch (const PepperException &ex) {
+			thrown = (std::string(ex.what()) == "failed");
+		}
+		REQUIRE(thrown);
+	}
+
+	SECTION("dropped", "Futures may be dropped before execution") {
+		for (int i = 0; i < 100; i++) {
+			pool.submit(std::function<int()>([]() { sys::parallel::Thread::msleep(1); return 0; }));
+		}
+	}
+}
+
 } // namespace test_parallel
 
 
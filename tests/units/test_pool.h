@@ -0,0 +1,106 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_pool.h
+ * Unit tests for pooled object allocation
+ */
+
+
+#ifndef TEST_POOL_H
+#define TEST_POOL_H
+
+
+#include <cstring>
+#include <set>
+
+#include "pool.h"
+#include "revision.h"
+
+#include "syslib/parallel.h"
+
+
+namespace test_pool
+{
+
+TEST_CASE("pool/reuse", "Reusing released blocks")
+{
+	std::vector<void *> blocks;
+	for (int i = 0; i < 1000; i++) {
+		void *p = Pool::allocate(40);
+		REQUIRE((size_t(p) % Pool::Granularity) == 0);
+		memset(p, i, 40);
+		blocks.push_back(p);
+	}
+	REQUIRE(std::set<void *>(blocks.begin(), blocks.end()).size() == blocks.size());
+
+	size_t reserved = Pool::reserved();
+	for (int run = 0; run < 10; run++) {
+		for (size_t i = 0; i < blocks.size(); i++) {
+			Pool::release(blocks[i], 40);
+		}
+		for (size_t i = 0; i < blocks.size(); i++) {
+			blocks[i] = Pool::allocate(33);
+		}
+	}
+	REQUIRE(Pool::reserved() == reserved);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		Pool::release(blocks[i], 48);
+	}
+
+	// Large blocks are not pooled
+	void *p = Pool::allocate(Pool::MaxSize + 1);
+	memset(p, 0, Pool::MaxSize + 1);
+	Pool::release(p, Pool::MaxSize + 1);
+	REQUIRE(Pool::reserved() == reserved);
+}
+
+TEST_CASE("pool/threads", "Releasing objects in other threads")
+{
+	struct Producer : public sys::parallel::Thread {
+		std::vector<Revision *> revisions;
+		void run() {
+			for (int i = 0; i < 5000; i++) {
+				Revision *r = new Revision(str::itos(i));
+				r->diffstat()->add("file", Diffstat::Stat());
+				revisions.push_back(r);
+			}
+		}
+	};
+
+	size_t reserved = 0;
+	for (int run = 0; run < 5; run++) {
+		Producer producers[4];
+		for (int i = 0; i < 4; i++) {
+			producers[i].start();
+		}
+		for (int i = 0; i < 4; i++) {
+			producers[i].wait();
+		}
+		for (int i = 0; i < 4; i++) {
+			for (size_t j = 0; j < producers[i].revisions.size(); j++) {
+				REQUIRE(producers[i].revisions[j]->id() == str::itos(j));
+				delete producers[i].revisions[j];
+			}
+		}
+
+		// Finished threads have returned their free lists, so once the
+		// consumer has done the same, the blocks of the first run are
+		// reused by all following ones
+		Pool::flush();
+		if (run == 0) {
+			reserved = Pool::reserved();
+		} else {
+			REQUIRE(Pool::reserved() == reserved);
+		}
+	}
+}
+
+} // namespace test_pool
+
+
+#endif // TEST_POOL_H
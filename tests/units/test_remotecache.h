@@ -0,0 +1,202 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_remotecache.h
+ * Unit tests for the remote revision cache
+ */
+
+
+#ifndef TEST_REMOTECACHE_H
+#define TEST_REMOTECACHE_H
+
+
+#include <csignal>
+#include <map>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "remotecache.h"
+
+#include "test_cache.h"
+
+
+namespace test_remotecache
+{
+
+// Minimal HTTP server storing resources in memory. Requests are handled
+// in a child process, one connection after another.
+struct Server
+{
+	pid_t pid;
+	int port;
+
+	Server() : pid(-1), port(0) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0x00, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&addr, len) != 0 || listen(fd, 4) != 0 || getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+			return;
+		}
+		port = ntohs(addr.sin_port);
+
+		pid = fork();
+		if (pid == 0) {
+			serve(fd);
+			_exit(0);
+		}
+		close(fd);
+	}
+	~Server() {
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	static void serve(int fd) {
+		std::map<std::string, std::string> store;
+		int conn;
+		while ((conn = accept(fd, NULL, NULL)) >= 0) {
+			std::string in;
+			char buffer[4096];
+			ssize_t n;
+			while ((n = read(conn, buffer, sizeof(buffer))) > 0) {
+				in.append(buffer, n);
+
+				// Handle all complete requests
+				size_t end;
+				while ((end = in.find("\r\n\r\n")) != std::string::npos) {
+					std::string head = in.substr(0, end);
+					size_t length = 0, pos = head.find("Content-Length: ");
+					if (pos != std::string::npos) {
+						length = atol(head.c_str() + pos + 16);
+					}
+					if (in.length() < end + 4 + length) {
+						break;
+					}
+					std::string body = in.substr(end + 4, length);
+					in.erase(0, end + 4 + length);
+
+					std::string path = head.substr(head.find(' ') + 1);
+					path = path.substr(0, path.find(' '));
+					std::string out;
+					if (head.compare(0, 4, "PUT ") == 0) {
+						store[path] = body;
+						out = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+					} else if (store.find(path) != store.end()) {
+						out = "HTTP/1.1 200 OK\r\nContent-Length: " + str::itos(store[path].length()) + "\r\n\r\n" + store[path];
+					} else {
+						out = "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nNot found";
+					}
+					if (write(conn, out.data(), out.length()) < 0) {
+						break;
+					}
+				}
+			}
+			close(conn);
+		}
+	}
+};
+
+
+TEST_CASE("remotecache/url", "URL parsing")
+{
+	std::string host, path;
+	int port;
+
+	REQUIRE(RemoteCache::parseUrl("http://cache.example.org", &host, &port, &path));
+	REQUIRE(host == "cache.example.org");
+	REQUIRE(port == 80);
+	REQUIRE(path == "");
+
+	REQUIRE(RemoteCache::parseUrl("http://cache:8080/pepper/", &host, &port, &path));
+	REQUIRE(host == "cache");
+	REQUIRE(port == 8080);
+	REQUIRE(path == "/pepper");
+
+	REQUIRE(RemoteCache::parseUrl("http://[::1]:81/a/b", &host, &port, &path));
+	REQUIRE(host == "::1");
+	REQUIRE(port == 81);
+	REQUIRE(path == "/a/b");
+
+	REQUIRE(!RemoteCache::parseUrl("https://cache.example.org", &host, &port, &path));
+	REQUIRE(!RemoteCache::parseUrl("http://cache:http/", &host, &port, &path));
+	REQUIRE(!RemoteCache::parseUrl("http:///pepper", &host, &port, &path));
+}
+
+TEST_CASE("remotecache/roundtrip", "Sharing revisions via a server")
+{
+	test_cache::Fixture fix;
+	test_cache::FakeBackend backend(fix.opts);
+	Server server;
+	REQUIRE(server.pid > 0);
+	fix.opts.m_options["remote_cache"] = "http://127.0.0.1:" + str::itos(server.port) + "/pepper";
+
+	std::vector<std::string> ids;
+	for (int i = 0; i < 100; i++) {
+		ids.push_back(str::itos(i));
+	}
+
+	for (int run = 0; run < 2; run++) {
+		RemoteCache cache(&backend, fix.opts);
+		if (run > 0) {
+			cache.prefetch(ids);
+		}
+		std::vector<Revision *> revs = cache.revisions(ids);
+		REQUIRE(revs.size() == ids.size());
+		for (size_t i = 0; i < revs.size(); i++) {
+			bool ok = test_cache::matches(revs[i]);
+			REQUIRE(ok);
+			delete revs[i];
+		}
+	}
+	REQUIRE(backend.calls == 100);
+
+	{
+		// A local cache in front of the remote one is filled as well
+		RemoteCache remote(&backend, fix.opts);
+		Cache cache(&remote, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = test_cache::fetch(&cache, ids[i]);
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 100);
+	REQUIRE(sys::fs::exists(fix.dir + "/fake/cache.index"));
+}
+
+TEST_CASE("remotecache/unavailable", "Falling back to the backend")
+{
+	test_cache::Fixture fix;
+	test_cache::FakeBackend backend(fix.opts);
+	int port;
+	{
+		// Use a port that has just been free
+		Server server;
+		port = server.port;
+	}
+	fix.opts.m_options["remote_cache"] = "http://127.0.0.1:" + str::itos(port);
+
+	RemoteCache cache(&backend, fix.opts);
+	for (int i = 0; i < 10; i++) {
+		bool ok = test_cache::fetch(&cache, str::itos(i));
+		REQUIRE(ok);
+	}
+	REQUIRE(backend.calls == 10);
+}
+
+} // namespace test_remotecache
+
+
+#endif // TEST_REMOTECACHE_H
@@ -0,0 +1,137 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_reportcache.h
+ * Unit tests for the report script cache
+ */
+
+
+#ifndef TEST_REPORTCACHE_H
+#define TEST_REPORTCACHE_H
+
+
+#include <cstdio>
+
+#include "bstream.h"
+#include "reportcache.h"
+
+#include "syslib/fs.h"
+
+
+namespace test_reportcache
+{
+
+// Writes the given script to a file
+void writeScript(const std::string &path, const std::string &contents)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	fputs(contents.c_str(), f);
+	fclose(f);
+}
+
+// Sets up a temporary cache directory and a report script
+struct Fixture
+{
+	std::string dir, script;
+
+	Fixture() {
+		FILE *f = sys::fs::mkstemp(&dir);
+		fclose(f);
+		sys::fs::unlink(dir);
+		sys::fs::mkdir(dir);
+		script = dir + "/report.lua";
+		writeScript(script, "function run() end\n");
+		ReportCache::setDir(dir + "/cache");
+	}
+	~Fixture() {
+		ReportCache::setDir(std::string());
+		sys::fs::unlinkr(dir);
+	}
+};
+
+// Returns a cache entry with some meta data
+ReportCache::Entry entry()
+{
+	ReportCache::Entry e;
+	e.bytecode = std::string("\x1bLua\0code", 9);
+	e.checked = e.valid = true;
+	e.hasMetaData = true;
+	e.metaData.name = "Report";
+	e.metaData.description = "Test report";
+	e.metaData.options.push_back(Report::MetaData::Option("-b ARG, --branch=ARG", "Select branch"));
+	return e;
+}
+
+TEST_CASE("reportcache/io", "Serialization of cache entries")
+{
+	ReportCache::Entry e = entry();
+	MOStream out;
+	ReportCache::write(out, e);
+	std::vector<char> data = out.data();
+
+	ReportCache::Entry f;
+	MIStream in(data);
+	bool ok = ReportCache::read(in, &f);
+	REQUIRE(ok);
+	REQUIRE(f.bytecode == e.bytecode);
+	REQUIRE(f.checked);
+	REQUIRE(f.valid);
+	REQUIRE(f.hasMetaData);
+	REQUIRE(f.metaData.name == e.metaData.name);
+	REQUIRE(f.metaData.description == e.metaData.description);
+	REQUIRE(f.metaData.options.size() == 1);
+	REQUIRE(f.metaData.options[0].synopsis == e.metaData.options[0].synopsis);
+	REQUIRE(f.metaData.options[0].description == e.metaData.options[0].description);
+
+	SECTION("truncated", "Truncated entries") {
+		MIStream in(&data[0], data.size() - 1);
+		ok = ReportCache::read(in, &f);
+		REQUIRE(!ok);
+	}
+}
+
+TEST_CASE("reportcache/lookup", "Cache lookups")
+{
+	Fixture fixture;
+	ReportCache::Entry e;
+	REQUIRE(!ReportCache::lookup(fixture.script, &e));
+	ReportCache::store(fixture.script, entry());
+	REQUIRE(ReportCache::lookup(fixture.script, &e));
+	REQUIRE(e.metaData.description == "Test report");
+
+	SECTION("persistent", "Entries are kept across runs") {
+		ReportCache::flush();
+		REQUIRE(sys::fs::fileExists(fixture.dir + "/cache/reportcache"));
+		ReportCache::setDir(fixture.dir + "/cache");
+		ReportCache::Entry f;
+		REQUIRE(ReportCache::lookup(fixture.script, &f));
+		REQUIRE(f.bytecode == e.bytecode);
+		REQUIRE(f.metaData.options.size() == 1);
+	}
+
+	SECTION("modified", "Modified scripts invalidate their entry") {
+		writeScript(fixture.script, "function main() end\n");
+		REQUIRE(!ReportCache::lookup(fixture.script, &e));
+	}
+
+	SECTION("removed", "Removed scripts are dropped") {
+		sys::fs::unlink(fixture.script);
+		REQUIRE(!ReportCache::lookup(fixture.script, &e));
+	}
+
+	SECTION("clear", "Clearing the cache") {
+		ReportCache::flush();
+		ReportCache::clear();
+		REQUIRE(!sys::fs::fileExists(fixture.dir + "/cache/reportcache"));
+		REQUIRE(!ReportCache::lookup(fixture.script, &e));
+	}
+}
+
+} // namespace test_reportcache
+
+#endif // TEST_REPORTCACHE_H
@@ -0,0 +1,102 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_reportresult.h
+ * Unit tests for memoized report output
+ */
+
+
+#ifndef TEST_REPORTRESULT_H
+#define TEST_REPORTRESULT_H
+
+
+#include <cstdio>
+#include <sstream>
+
+#include "reportresult.h"
+
+
+namespace test_reportresult
+{
+
+// Writes the given data to a file
+void writeFile(const std::string &path, const std::string &data)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	fwrite(data.data(), 1, data.length(), f);
+	fclose(f);
+}
+
+TEST_CASE("reportresult/key", "Result keys")
+{
+	test_cache::Fixture fixture;
+	std::string script = fixture.dir + "/loc.lua";
+	writeFile(script, "function main() end\n");
+	std::map<std::string, std::string> options;
+	options["branch"] = "master";
+	std::string key = ReportResult::key(script, options, "abc");
+	REQUIRE(key.compare(0, 8, "loc.lua_") == 0);
+	REQUIRE(key.length() == 8 + 40);
+	REQUIRE(key == ReportResult::key(script, options, "abc"));
+
+	SECTION("head", "Moved branch heads") {
+		REQUIRE(key != ReportResult::key(script, options, "abd"));
+	}
+
+	SECTION("options", "Different options") {
+		options["type"] = "png";
+		REQUIRE(key != ReportResult::key(script, options, "abc"));
+	}
+
+	SECTION("script", "Modified scripts") {
+		writeFile(script, "function main() print(1) end\n");
+		REQUIRE(key != ReportResult::key(script, options, "abc"));
+		sys::fs::unlink(script);
+		REQUIRE_THROWS(ReportResult::key(script, options, "abc"));
+	}
+}
+
+TEST_CASE("reportresult/replay", "Storing and replaying results")
+{
+	test_cache::Fixture fixture;
+	test_cache::FakeBackend backend(fixture.opts);
+	std::string script = fixture.dir + "/loc.lua";
+	writeFile(script, "function main() end\n");
+	std::map<std::string, std::string> options;
+
+	ReportResult result(&backend, script, options, "abc");
+	std::ostringstream out;
+	REQUIRE(!result.replay(out));
+
+	std::string plot = fixture.dir + "/loc.png";
+	std::string image("\x89PNG\0\r\n", 7);
+	writeFile(plot, image);
+	result.save(std::string("text\0output", 11), std::vector<std::string>(1, plot));
+	sys::fs::unlink(plot);
+
+	ReportResult same(&backend, script, options, "abc");
+	bool ok = same.replay(out);
+	REQUIRE(ok);
+	REQUIRE(out.str() == std::string("text\0output", 11));
+	REQUIRE(test_cache::readFile(plot) == image);
+
+	SECTION("moved", "Results for other heads") {
+		ReportResult other(&backend, script, options, "abd");
+		REQUIRE(!other.replay(out));
+	}
+
+	SECTION("missing", "Results with missing output files aren't stored") {
+		ReportResult other(&backend, script, options, "abd");
+		other.save("text", std::vector<std::string>(1, fixture.dir + "/missing.png"));
+		REQUIRE(!other.replay(out));
+	}
+}
+
+} // namespace test_reportresult
+
+#endif // TEST_REPORTRESULT_H
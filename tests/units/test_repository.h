@@ -0,0 +1,82 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_repository.h
+ * Unit tests for the repository interface
+ */
+
+
+#ifndef TEST_REPOSITORY_H
+#define TEST_REPOSITORY_H
+
+
+#include "repository.h"
+
+#include "test_revisioniterator.h"
+
+
+namespace test_repository
+{
+
+TEST_CASE("repository/prefetch", "Prefetching random-access lookups")
+{
+	Options opts;
+	test_revisioniterator::LogBackend backend(opts, 0);
+	Repository repo(&backend);
+
+	std::vector<std::string> ids;
+	tutils::push_back(&ids, "a", "bb", "ccc");
+	repo.prefetch(ids);
+	REQUIRE(backend.order == ids);
+	REQUIRE(backend.requests == 1);
+
+	SECTION("claim", "Prefetched revisions are claimed once") {
+		Revision *rev = repo.claim("bb");
+		REQUIRE(rev->id() == "bb");
+		REQUIRE(rev->diffstat()->entries().size() == 1);
+		delete rev;
+		REQUIRE(backend.calls == 1);
+
+		// Unknown revisions are fetched right away
+		rev = repo.claim("dddd");
+		REQUIRE(rev->id() == "dddd");
+		delete rev;
+		REQUIRE(backend.calls == 2);
+		REQUIRE(backend.requests == 1);
+	}
+
+	SECTION("request", "Requests take over prefetched revisions") {
+		std::vector<std::string> more;
+		tutils::push_back(&more, "ccc", "dddd", "a", "eeeee");
+		std::vector<RevisionFuture> futures = repo.request(more);
+		REQUIRE(futures.size() == 4);
+		for (size_t i = 0; i < futures.size(); i++) {
+			Revision *rev = futures[i].get();
+			REQUIRE(rev->id() == more[i]);
+			delete rev;
+		}
+
+		// Only the missing revisions are requested again
+		REQUIRE(backend.requests == 2);
+		REQUIRE(backend.order.size() == 5);
+		REQUIRE(backend.order[3] == "dddd");
+		REQUIRE(backend.order[4] == "eeeee");
+
+		// The remaining prefetched revision is still available
+		size_t before = backend.order.size();
+		Revision *rev = repo.claim("bb");
+		REQUIRE(rev->id() == "bb");
+		delete rev;
+		REQUIRE(backend.order.size() == before);
+	}
+}
+
+} // namespace test_repository
+
+
+#endif // TEST_REPOSITORY_H
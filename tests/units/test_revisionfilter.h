@@ -0,0 +1,103 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_revisionfilter.h
+ * Unit tests for revision filters
+ */
+
+
+#ifndef TEST_REVISIONFILTER_H
+#define TEST_REVISIONFILTER_H
+
+
+#include "diffstat.h"
+#include "revision.h"
+#include "revisionfilter.h"
+
+
+namespace test_revisionfilter
+{
+
+TEST_CASE("revisionfilter/criteria", "Single criteria")
+{
+	RevisionFilter f;
+	REQUIRE(f.empty());
+	REQUIRE(f.matchesAuthor("anyone"));
+	REQUIRE(f.matchesPath("any/path"));
+	REQUIRE(f.matchesMessage("anything"));
+
+	SECTION("authors", "Exact author names") {
+		f.setAuthors(std::vector<std::string>(1, "jonas"));
+		REQUIRE(!f.empty());
+		REQUIRE(f.matchesAuthor("jonas"));
+		REQUIRE(!f.matchesAuthor("jonas2"));
+		REQUIRE(!f.matchesAuthor(""));
+	}
+
+	SECTION("paths", "Files and directory prefixes") {
+		std::vector<std::string> paths;
+		paths.push_back("src/");
+		paths.push_back("README");
+		f.setPaths(paths);
+		REQUIRE(f.paths()[0] == "src");
+		REQUIRE(f.matchesPath("src"));
+		REQUIRE(f.matchesPath("src/main.cpp"));
+		REQUIRE(f.matchesPath("README"));
+		REQUIRE(!f.matchesPath("srcfoo/main.cpp"));
+		REQUIRE(!f.matchesPath("README.md"));
+		REQUIRE(!f.matchesPath("doc/src/index"));
+	}
+
+	SECTION("grep", "Message patterns") {
+		f.setGrep("^(fix|bug)[: ]");
+		REQUIRE(f.grep() == "^(fix|bug)[: ]");
+		REQUIRE(f.matchesMessage("fix: crash"));
+		REQUIRE(f.matchesMessage("Summary\nbug 123"));
+		REQUIRE(!f.matchesMessage("prefix: no"));
+		f.setGrep("");
+		REQUIRE(f.empty());
+	}
+
+	SECTION("invalid", "Invalid patterns") {
+		bool thrown = false;
+		try {
+			f.setGrep("(unbalanced");
+		} catch (const PepperException &) {
+			thrown = true;
+		}
+		REQUIRE(thrown);
+		REQUIRE(f.empty());
+	}
+}
+
+TEST_CASE("revisionfilter/revisions", "Matching revisions")
+{
+	DiffstatPtr stat = std::make_shared<Diffstat>();
+	Diffstat::Stat s;
+	s.ladd = 1;
+	stat->add("doc/index.txt", s);
+	Revision rev("1", 0, "jonas", "Update docs", stat);
+
+	RevisionFilter f;
+	f.setAuthors(std::vector<std::string>(1, "jonas"));
+	f.setGrep("docs");
+	REQUIRE(f.matches(&rev));
+
+	f.setPaths(std::vector<std::string>(1, "src"));
+	REQUIRE(!f.matches(&rev));
+	f.setPaths(std::vector<std::string>(1, "doc"));
+	REQUIRE(f.matches(&rev));
+
+	f.setAuthors(std::vector<std::string>(1, "someone"));
+	REQUIRE(!f.matches(&rev));
+}
+
+} // namespace test_revisionfilter
+
+
+#endif // TEST_REVISIONFILTER_H
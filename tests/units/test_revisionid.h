@@ -0,0 +1,100 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_revisionid.h
+ * Unit tests for compact revision identifiers
+ */
+
+
+#ifndef TEST_REVISIONID_H
+#define TEST_REVISIONID_H
+
+
+#include <set>
+#include <sstream>
+#include <unordered_map>
+
+#include "revisionid.h"
+#include "utils.h"
+
+
+namespace test_revisionid
+{
+
+TEST_CASE("revisionid/parse", "Parsing and formatting of revision IDs")
+{
+	const char *ids[] = {
+		"0123456789abcdef0123456789abcdef01234567",
+		"fedcba9876543210fedcba9876543210fedcba98:0123456789abcdef0123456789abcdef01234567",
+		"1234",
+		"0",
+		"1233:1234",
+		"0123456789ABCDEF0123456789ABCDEF01234567", // Uppercase hash
+		"0123",
+		"main@{1}",
+		"41:abc:42",
+		":1234",
+		"18446744073709551616" // Too large
+	};
+	for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+		INFO(ids[i]);
+		RevisionId id(ids[i]);
+		REQUIRE(id.str() == ids[i]);
+		REQUIRE(id.childStr() == utils::childId(ids[i]));
+		REQUIRE(id.child().str() == utils::childId(ids[i]));
+		REQUIRE(id.hasParent() == (strchr(ids[i], ':') != NULL));
+		REQUIRE(id == RevisionId(ids[i]));
+		REQUIRE(id.hash() == RevisionId(ids[i]).hash());
+		REQUIRE(!id.empty());
+
+		std::ostringstream out;
+		out << id;
+		REQUIRE(out.str() == ids[i]);
+	}
+
+	// Fixed-width storage
+	REQUIRE(RevisionId(ids[1]).m_string.empty());
+	REQUIRE(RevisionId(ids[1]).parentStr() == "fedcba9876543210fedcba9876543210fedcba98");
+	REQUIRE(RevisionId(ids[4]).m_string.empty());
+	REQUIRE(RevisionId(ids[4]).parent() == RevisionId("1233"));
+	REQUIRE(!RevisionId(ids[5]).m_string.empty());
+	REQUIRE(!RevisionId(ids[10]).m_string.empty());
+
+	REQUIRE(RevisionId().empty());
+	REQUIRE(RevisionId().str().empty());
+	REQUIRE(RevisionId("1234").parentStr().empty());
+}
+
+TEST_CASE("revisionid/compare", "Comparison and hashing of revision IDs")
+{
+	RevisionId a("1233:1234"), b("1234"), c("1233"), d("0123");
+	REQUIRE(a != b);
+	REQUIRE(a.child() == b);
+	REQUIRE(a.parent() == c);
+	REQUIRE(b != c);
+	REQUIRE(d != RevisionId("123"));
+
+	std::set<RevisionId> set;
+	set.insert(a);
+	set.insert(b);
+	set.insert(c);
+	set.insert(d);
+	set.insert(RevisionId("1234"));
+	REQUIRE(set.size() == 4);
+
+	std::unordered_map<RevisionId, int> map;
+	for (int i = 0; i < 1000; i++) {
+		map[RevisionId(str::itos(i) + ":" + str::itos(i + 1))] = i;
+	}
+	REQUIRE(map.size() == 1000);
+	REQUIRE(map[RevisionId("41:42")] == 41);
+}
+
+} // namespace test_revisionid
+
+#endif // TEST_REVISIONID_H
@@ -0,0 +1,211 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_revisioniterator.h
+ * Unit tests for the revision iterator
+ */
+
+
+#ifndef TEST_REVISIONITERATOR_H
+#define TEST_REVISIONITERATOR_H
+
+
+#include "revisioniterator.h"
+
+#include "test_cache.h"
+
+
+namespace test_revisioniterator
+{
+
+// Backend with a fixed log that records prefetch requests
+class LogBackend : public test_cache::FakeBackend
+{
+public:
+	LogBackend(const Options &options, size_t n) : test_cache::FakeBackend(options), prefetched(0), requests(0) {
+		for (size_t i = 0; i < n; i++) {
+			ids.push_back(str::itos(i));
+		}
+	}
+
+	LogIterator *iterator(const std::string &, int64_t, int64_t, const RevisionFilter &) {
+		return new LogIterator(ids);
+	}
+
+	void prefetch(const std::vector<std::string> &ids) {
+		for (size_t i = 0; i < ids.size(); i++) {
+			order.push_back(ids[i]);
+		}
+		prefetched += ids.size();
+		++requests;
+	}
+
+	std::vector<std::string> ids, order;
+	size_t prefetched, requests;
+};
+
+
+TEST_CASE("revisioniterator/window", "Prefetching in a sliding window")
+{
+	Options opts;
+	opts.m_options["prefetch_window"] = "100";
+	LogBackend backend(opts, 1000);
+
+	RevisionIterator it(&backend);
+	size_t consumed = 0;
+	while (!it.atEnd()) {
+		std::string id = it.next();
+		REQUIRE(id == str::itos(consumed));
+		++consumed;
+
+		// The consumed revision has been prefetched, and the backend
+		// never gets far ahead
+		REQUIRE(backend.prefetched >= consumed);
+		REQUIRE(backend.prefetched <= consumed + 100);
+	}
+	REQUIRE(consumed == 1000);
+	REQUIRE(backend.order == backend.ids);
+	REQUIRE(backend.requests < 30);
+
+	// All revisions are prefetched at once without a window
+	opts.m_options["prefetch_window"] = "0";
+	LogBackend unbounded(opts, 1000);
+	RevisionIterator it2(&unbounded);
+	REQUIRE(!it2.atEnd());
+	REQUIRE(unbounded.prefetched == 1000);
+	REQUIRE(unbounded.requests == 1);
+}
+
+// Backend with a separate log for each branch
+class BranchBackend : public test_cache::FakeBackend
+{
+public:
+	BranchBackend(const Options &options) : test_cache::FakeBackend(options) { }
+
+	LogIterator *iterator(const std::string &branch, int64_t, int64_t, const RevisionFilter &) {
+		return new LogIterator(logs[branch]);
+	}
+
+	std::map<std::string, std::vector<std::string> > logs;
+};
+
+// Splits a space-separated list of IDs
+std::vector<std::string> ids(const std::string &str)
+{
+	return str::split(str, " ");
+}
+
+
+TEST_CASE("revisioniterator/limit", "Limiting and reversing the iteration")
+{
+	Options opts;
+	LogBackend backend(opts, 1000);
+
+	RevisionIterator it(&backend);
+	it.setLimit(3);
+	std::vector<std::string> visited;
+	while (!it.atEnd()) {
+		visited.push_back(it.next());
+	}
+	REQUIRE(visited == ids("997 998 999"));
+	REQUIRE(backend.prefetched == 3);
+
+	RevisionIterator rit(&backend);
+	rit.setLimit(0, true);
+	size_t n = 0;
+	while (!rit.atEnd()) {
+		std::string id = rit.next();
+		REQUIRE(id == str::itos(999 - n));
+		++n;
+	}
+	REQUIRE(n == 1000);
+
+	// The limit applies to the revisions accepted by the filter
+	RevisionFilter filter;
+	filter.setGrep("^message 9[0-9]5$");
+	RevisionIterator fit(&backend, std::string(), -1, -1, RevisionIterator::Flags(RevisionIterator::PrefetchRevisions | RevisionIterator::FetchDiffstats), filter);
+	fit.setLimit(3, true);
+	visited.clear();
+	while (!fit.atEnd()) {
+		visited.push_back(fit.next());
+	}
+	REQUIRE(visited == ids("995 985 975"));
+}
+
+TEST_CASE("revisioniterator/sample", "Sampling revisions")
+{
+	Options opts;
+	LogBackend backend(opts, 1000);
+
+	RevisionIterator it(&backend);
+	it.setSampling(0.1);
+	std::vector<std::string> visited;
+	while (!it.atEnd()) {
+		visited.push_back(it.next());
+	}
+	REQUIRE(visited.size() == 100);
+	REQUIRE(visited.front() == "9");
+	REQUIRE(visited.back() == "999");
+	REQUIRE(it.scale() == 10.0);
+	REQUIRE(backend.prefetched == 100);
+
+	// Fake revisions are dated by the length of their IDs
+	RevisionIterator dit(&backend);
+	dit.setSampling(1.0, 1);
+	visited.clear();
+	while (!dit.atEnd()) {
+		visited.push_back(dit.next());
+	}
+	REQUIRE(visited == ids("0 10 100"));
+
+	RevisionIterator full(&backend);
+	REQUIRE(full.scale() == 1.0);
+}
+
+TEST_CASE("revisioniterator/union", "Merging branch logs")
+{
+	std::vector<std::vector<std::string> > logs;
+	logs.push_back(ids("a b c d"));
+	logs.push_back(ids("a b x y"));
+	logs.push_back(ids("z a b c"));
+	std::unordered_map<std::string, std::vector<bool> > members;
+	std::vector<std::string> merged = RevisionIterator::unionLog(logs, &members);
+	REQUIRE(merged == ids("z a b x y c d"));
+	REQUIRE(members.size() == 7);
+	REQUIRE(members["a"] == std::vector<bool>(3, true));
+	std::vector<bool> d(3, false), z(3, false);
+	d[0] = true;
+	z[2] = true;
+	REQUIRE(members["d"] == d);
+	REQUIRE(members["z"] == z);
+}
+
+TEST_CASE("revisioniterator/branches", "Iterating over several branches")
+{
+	Options opts;
+	BranchBackend backend(opts);
+	backend.logs["master"] = ids("1 2 3 4");
+	backend.logs["topic"] = ids("1 2 5");
+	std::vector<std::string> branches = ids("master topic");
+
+	RevisionIterator it(&backend, branches);
+	std::vector<std::string> visited;
+	while (!it.atEnd()) {
+		visited.push_back(it.next());
+	}
+	REQUIRE(visited == ids("1 2 5 3 4"));
+	REQUIRE(it.branches("1") == branches);
+	REQUIRE(it.branches("4") == ids("master"));
+	REQUIRE(it.branches("5") == ids("topic"));
+	REQUIRE(it.branches("6").empty());
+}
+
+} // namespace test_revisioniterator
+
+
+#endif // TEST_REVISIONITERATOR_H
@@ -0,0 +1,173 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_rollups.h
+ * Unit tests for per-day rollups
+ */
+
+
+#ifndef TEST_ROLLUPS_H
+#define TEST_ROLLUPS_H
+
+
+#include <cstdio>
+#include <unistd.h>
+
+#include "diffstat.h"
+#include "revision.h"
+#include "rollups.h"
+#include "strlib.h"
+
+#include "syslib/fs.h"
+
+
+namespace test_rollups
+{
+
+// Creates a revision changing the given files by the given number of lines
+Revision *revision(int64_t date, const std::string &author, const std::string &files, uint64_t ladd, uint64_t ldel = 0)
+{
+	DiffstatPtr stat = std::make_shared<Diffstat>();
+	std::vector<std::string> paths = str::split(files, ",");
+	for (size_t i = 0; i < paths.size(); i++) {
+		Diffstat::Stat s;
+		s.ladd = ladd;
+		s.ldel = ldel;
+		stat->add(paths[i], s);
+	}
+	return new Revision(str::itos(date), date, author, "", stat);
+}
+
+// Adds a few revisions on three days
+void fill(Rollups *r)
+{
+	std::vector<Revision *> revs;
+	revs.push_back(revision(86400 + 10, "a", "src/x.c,README", 5));
+	revs.push_back(revision(86400 + 500, "a", "src/a/y.c,src/z.h", 10, 2));
+	revs.push_back(revision(2 * 86400 - 1, "b", "doc/index.txt", 1));
+	revs.push_back(revision(3 * 86400, "", "src/x.c", 1, 4));
+	revs.push_back(revision(5 * 86400 + 7, "b", "src/x.c", 3, 3));
+	for (size_t i = 0; i < revs.size(); i++) {
+		r->add(revs[i]);
+		delete revs[i];
+	}
+}
+
+TEST_CASE("rollups/authors", "Sums by day and author")
+{
+	Rollups r;
+	fill(&r);
+	std::vector<Rollups::Row> rows = r.rows(Rollups::Author);
+	REQUIRE(rows.size() == 3);
+	REQUIRE(rows[0].day == 86400);
+	REQUIRE(rows[0].key == "a");
+	REQUIRE(rows[0].commits == 2);
+	REQUIRE(rows[0].added == 30);
+	REQUIRE(rows[0].removed == 4);
+	REQUIRE(rows[1].day == 86400);
+	REQUIRE(rows[1].key == "b");
+	REQUIRE(rows[1].commits == 1);
+	REQUIRE(rows[2].day == 5 * 86400);
+	REQUIRE(rows[2].added == 3);
+}
+
+TEST_CASE("rollups/directories", "Sums by day and top-level directory")
+{
+	Rollups r;
+	fill(&r);
+	std::vector<Rollups::Row> rows = r.rows(Rollups::Directory);
+	REQUIRE(rows.size() == 5);
+	REQUIRE(rows[0].key == "/");
+	REQUIRE(rows[0].added == 5);
+	REQUIRE(rows[1].key == "doc");
+	REQUIRE(rows[2].key == "src");
+	REQUIRE(rows[2].commits == 2);
+	REQUIRE(rows[2].added == 25);
+	REQUIRE(rows[3].day == 3 * 86400);
+	REQUIRE(rows[3].removed == 4);
+
+	REQUIRE(Rollups::directory("README") == "/");
+	REQUIRE(Rollups::directory("/abs") == "/");
+	REQUIRE(Rollups::directory("a/b/c") == "a");
+}
+
+TEST_CASE("rollups/range", "Selecting days by time range")
+{
+	Rollups r;
+	fill(&r);
+
+	// Days overlapping the range are included
+	std::vector<Rollups::Row> rows = r.rows(Rollups::Directory, 86400 + 1000, 3 * 86400);
+	REQUIRE(rows.size() == 4);
+	REQUIRE(rows[0].day == 86400);
+	REQUIRE(rows[3].day == 3 * 86400);
+	rows = r.rows(Rollups::Author, 2 * 86400, -1);
+	REQUIRE(rows.size() == 1);
+	REQUIRE(rows[0].key == "b");
+	rows = r.rows(Rollups::Author, -1, 86399);
+	REQUIRE(rows.empty());
+}
+
+TEST_CASE("rollups/file", "Writing and appending rollups")
+{
+	std::string file;
+	FILE *f = sys::fs::mkstemp(&file);
+	fclose(f);
+	sys::fs::unlink(file);
+
+	Rollups r;
+	fill(&r);
+	bool ok = Rollups().read(file);
+	REQUIRE(!ok);
+	ok = r.append(file);
+	REQUIRE(!ok);
+	ok = r.write(file);
+	REQUIRE(ok);
+
+	{
+		Rollups loaded;
+		bool ok = loaded.read(file);
+		REQUIRE(ok);
+		REQUIRE(loaded.size() == r.size());
+	}
+
+	// Appended rows are summed
+	Rollups more;
+	Revision *rev = revision(86400 + 2, "a", "src/b.c", 2);
+	more.add(rev);
+	delete rev;
+	ok = more.append(file);
+	REQUIRE(ok);
+	{
+		Rollups loaded;
+		bool ok = loaded.read(file);
+		REQUIRE(ok);
+		REQUIRE(loaded.size() == r.size());
+		std::vector<Rollups::Row> rows = loaded.rows(Rollups::Author, 86400, 86400);
+		REQUIRE(rows[0].commits == 3);
+		REQUIRE(rows[0].added == 32);
+	}
+
+	// A truncated row at the end is ignored
+	size_t size = sys::fs::filesize(file);
+	REQUIRE(truncate(file.c_str(), size - 3) == 0);
+	{
+		Rollups loaded;
+		bool ok = loaded.read(file);
+		REQUIRE(ok);
+		REQUIRE(loaded.size() == r.size());
+		std::vector<Rollups::Row> rows = loaded.rows(Rollups::Author, 86400, 86400);
+		REQUIRE(rows[0].commits == 3);
+	}
+	sys::fs::unlink(file);
+}
+
+} // namespace test_rollups
+
+
+#endif // TEST_ROLLUPS_H
@@ -0,0 +1,84 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_stats.h
+ * Unit tests for runtime statistics
+ */
+
+
+#ifndef TEST_STATS_H
+#define TEST_STATS_H
+
+
+#include <sstream>
+
+#include "memorycache.h"
+#include "stats.h"
+
+#include "test_cache.h"
+
+
+namespace test_stats
+{
+
+TEST_CASE("stats/timers", "Counters and histograms")
+{
+	Stats::reset();
+	Stats::add(Stats::ProcessSpawns);
+	Stats::add(Stats::ProcessSpawns, 2);
+	Stats::peak(Stats::QueuePeak, 10);
+	Stats::peak(Stats::QueuePeak, 5);
+	REQUIRE(Stats::value(Stats::ProcessSpawns) == 3);
+	REQUIRE(Stats::value(Stats::QueuePeak) == 10);
+
+	for (int i = 1; i <= 100; i++) {
+		Stats::record(Stats::LuaCallback, i);
+	}
+	REQUIRE(Stats::count(Stats::LuaCallback) == 100);
+	REQUIRE(Stats::total(Stats::LuaCallback) == 5050);
+	int64_t p50 = Stats::percentile(Stats::LuaCallback, 0.5), p99 = Stats::percentile(Stats::LuaCallback, 0.99);
+	REQUIRE(p50 >= 50);
+	REQUIRE(p50 < 100);
+	REQUIRE(p99 == 100);
+
+	std::ostringstream out;
+	Stats::writeJson(out);
+	REQUIRE(out.str().find("\"process_spawns\":3") != std::string::npos);
+	REQUIRE(out.str().find("\"lua_callback\":{\"count\":100,\"total_us\":5050") != std::string::npos);
+	REQUIRE(out.str().find("\"peak_rss_kb\":") != std::string::npos);
+	Stats::reset();
+	REQUIRE(Stats::count(Stats::LuaCallback) == 0);
+}
+
+TEST_CASE("stats/cache", "Cache hits and misses")
+{
+	test_cache::Fixture fix;
+	test_cache::FakeBackend backend(fix.opts);
+	Stats::reset();
+
+	// Hits of the outer cache and misses of the inner one add up to the
+	// number of requests
+	{
+		MemoryCache inner(&backend, fix.opts);
+		MemoryCache outer(&inner, fix.opts);
+		for (int i = 0; i < 10; i++) {
+			bool ok = test_cache::fetch(&outer, str::itos(i % 5));
+			REQUIRE(ok);
+		}
+	}
+	REQUIRE(backend.calls == 5);
+	REQUIRE(Stats::value(Stats::CacheMisses) == 5);
+	REQUIRE(Stats::value(Stats::CacheHits) == 5);
+	REQUIRE(Stats::count(Stats::DiffstatFetch) == 5);
+	Stats::reset();
+}
+
+} // namespace test_stats
+
+
+#endif // TEST_STATS_H
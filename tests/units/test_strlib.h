@@ -75,6 +75,57 @@ TEST_CASE("str/split", "str::split()")
 	}
 }
 
+TEST_CASE("str/tokenizer", "str::Tokenizer and str::View")
+{
+	const char *inputs[][2] = {
+		{ "", "" },
+		{ "", "token" },
+		{ "1,2,3", "," },
+		{ "1,2,3", "token" },
+		{ "abc1abc2abc3abc", "abc" },
+		{ "1abc2abc3abc ", "abc" },
+		{ "defdef", "def" },
+		{ "defdef", "" },
+		{ "ab ab  ", "ab" },
+		{ "aaa", "aa" },
+		{ " 1 , 2 ,, 3", "," }
+	};
+
+	// Fields must be the same as with split()
+	for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		for (int trim = 0; trim < 2; trim++) {
+			INFO("input = \"" << inputs[i][0] << "\", token = \"" << inputs[i][1] << "\", trim = " << trim);
+			std::vector<std::string> expected = str::split(inputs[i][0], inputs[i][1], trim != 0);
+			std::vector<std::string> out;
+			str::Tokenizer tok(inputs[i][0], inputs[i][1], trim != 0);
+			str::View field;
+			while (tok.next(&field)) {
+				out.push_back(field.str());
+			}
+			REQUIRE(out == expected);
+			REQUIRE(!tok.next(&field));
+		}
+	}
+
+	std::string line("1300000000 abc def ghi");
+	str::View parts[3];
+	REQUIRE(str::split(line, " ", parts, 3) == 3);
+	REQUIRE(parts[0].data() == line.data());
+	REQUIRE(parts[1] == "abc");
+	REQUIRE(parts[2] != "ghi");
+	int64_t date;
+	REQUIRE(str::stoi(parts[0], &date));
+	REQUIRE(date == 1300000000);
+	REQUIRE(!str::stoi(parts[1], &date, 10));
+
+	str::View view("  trimmed \n");
+	REQUIRE(view.trim() == "trimmed");
+	REQUIRE(view.find("mm") == 3);
+	REQUIRE(view.find("x") == std::string::npos);
+	REQUIRE(view.substr(4) == "med");
+	REQUIRE(view.substr(10).empty());
+}
+
 TEST_CASE("str/join", "str::join()")
 {
 	struct inout_t {
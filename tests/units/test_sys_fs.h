@@ -75,6 +75,75 @@ TEST_CASE("sys_fs/dirname", "sys::fs::dirname()")
 	}
 }
 
+TEST_CASE("sys_fs/mappedfile", "sys::fs::MappedFile")
+{
+	std::string path;
+	FILE *f = sys::fs::mkstemp(&path);
+	REQUIRE(f != NULL);
+	fputs("pepper", f);
+	fclose(f);
+
+	SECTION("read", "Read contents") {
+		sys::fs::MappedFile file(path);
+		REQUIRE(file.isOpen());
+		REQUIRE(file.size() == 6);
+		REQUIRE(std::string(file.data(), file.size()) == "pepper");
+		file.close();
+		REQUIRE(!file.isOpen());
+		REQUIRE(file.data() == NULL);
+	}
+
+	SECTION("empty", "Empty file") {
+		f = fopen(path.c_str(), "w");
+		fclose(f);
+		sys::fs::MappedFile file(path);
+		REQUIRE(file.isOpen());
+		REQUIRE(file.size() == 0);
+	}
+
+	SECTION("missing", "Missing file") {
+		sys::fs::MappedFile file;
+		REQUIRE_THROWS(file.open(path + ".missing"));
+		REQUIRE(!file.isOpen());
+	}
+
+	sys::fs::unlink(path);
+}
+
+TEST_CASE("sys_fs/watch", "sys::fs::Watch")
+{
+	if (!sys::fs::Watch::supported()) {
+		return;
+	}
+
+	std::string dir;
+	FILE *f = sys::fs::mkstemp(&dir);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(dir);
+	sys::fs::mkdir(dir);
+
+	sys::fs::Watch watch;
+	watch.add(dir);
+	watch.add(dir);
+	REQUIRE_THROWS(watch.add(dir + "/missing"));
+	bool changed = watch.wait(0);
+	REQUIRE(!changed);
+
+	f = fopen((dir + "/file").c_str(), "w");
+	fclose(f);
+	changed = watch.wait(1000);
+	REQUIRE(changed);
+	changed = watch.wait(0);
+	REQUIRE(!changed);
+
+	sys::fs::rename(dir + "/file", dir + "/renamed");
+	changed = watch.wait(1000);
+	REQUIRE(changed);
+
+	sys::fs::unlinkr(dir);
+}
+
 } // namespace test_sys_fs
 
 #endif // TEST_SYS_FS_H
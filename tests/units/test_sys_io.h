@@ -15,6 +15,8 @@
 #define TEST_SYS_IO_H
 
 
+#include <sys/wait.h>
+
 #include "syslib/io.h"
 #include "syslib/parallel.h"
 
@@ -65,6 +67,30 @@ TEST_CASE("sys_io/popenstreambuf", "sys::io::PopenStreambuf")
 	}
 }
 
+TEST_CASE("sys_io/exec", "sys::io::exec()")
+{
+	int ret = -1;
+
+	SECTION("output", "Output and exit code") {
+		std::string out = sys::io::exec(&ret, "/bin/echo", "-n", "pepper");
+		REQUIRE(out == "pepper");
+		REQUIRE(WIFEXITED(ret));
+		REQUIRE(WEXITSTATUS(ret) == 0);
+	}
+
+	SECTION("status", "Non-zero exit code") {
+		std::string out = sys::io::exec(&ret, "/bin/sh", "-c", "echo fail; exit 3");
+		REQUIRE(out == "fail\n");
+		REQUIRE(WEXITSTATUS(ret) == 3);
+	}
+
+	SECTION("missing", "Missing executable") {
+		std::string out = sys::io::exec(&ret, "/nonexistent/pepper-test");
+		REQUIRE(out.empty());
+		REQUIRE(WEXITSTATUS(ret) == 127);
+	}
+}
+
 } // namespace test_sys_io
 
 #endif // TEST_SYS_IO_H
@@ -0,0 +1,93 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_tracer.h
+ * Unit tests for the timeline tracing facility
+ */
+
+
+#ifndef TEST_TRACER_H
+#define TEST_TRACER_H
+
+
+#include <sstream>
+
+#include "tracer.h"
+
+#include "syslib/parallel.h"
+
+
+namespace test_tracer
+{
+
+// Counts the occurrences of a string
+size_t count(const std::string &haystack, const std::string &needle)
+{
+	size_t n = 0, pos = 0;
+	while ((pos = haystack.find(needle, pos)) != std::string::npos) {
+		++n;
+		pos += needle.length();
+	}
+	return n;
+}
+
+// Thread recording a number of scopes
+class ScopeThread : public sys::parallel::Thread
+{
+public:
+	ScopeThread(int n) : n(n) { }
+
+	void run() {
+		for (int i = 0; i < n; i++) {
+			PTRACE_SCOPE("test.thread");
+		}
+	}
+
+	int n;
+};
+
+
+TEST_CASE("tracer/scopes", "Recording scopes")
+{
+	Tracer::clear();
+	{
+		PTRACE_SCOPE("test.disabled");
+	}
+
+	Tracer::start();
+	{
+		PTRACE_SCOPE("test.outer");
+		PTRACE_SCOPE("test.inner");
+	}
+	ScopeThread thread(Tracer::BufferSize + 10);
+	thread.start();
+	thread.wait();
+	Tracer::stop();
+	{
+		PTRACE_SCOPE("test.disabled");
+	}
+
+	std::ostringstream out;
+	Tracer::write(out);
+	std::string trace = out.str();
+	Tracer::clear();
+
+	REQUIRE(trace.compare(0, 16, "{\"traceEvents\":[") == 0);
+	REQUIRE(count(trace, "\"name\":\"test.disabled\"") == 0);
+	REQUIRE(count(trace, "\"name\":\"test.outer\",\"ph\":\"X\"") == 1);
+	REQUIRE(count(trace, "\"name\":\"test.inner\",\"ph\":\"X\"") == 1);
+
+	// Full ring buffers keep the latest events
+	REQUIRE(count(trace, "\"name\":\"test.thread\"") == size_t(Tracer::BufferSize));
+	REQUIRE(count(trace, "\"ph\":\"M\"") == 2);
+}
+
+} // namespace test_tracer
+
+
+#endif // TEST_TRACER_H
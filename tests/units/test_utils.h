@@ -15,6 +15,9 @@
 #define TEST_UTILS_H
 
 
+#include <algorithm>
+
+#include "strlib.h"
 #include "utils.h"
 
 
@@ -53,6 +56,112 @@ TEST_CASE("utils/crc32", "utils::crc32()")
 	}
 }
 
+TEST_CASE("utils/crc32c", "utils::crc32c()")
+{
+	std::string check = "123456789";
+	REQUIRE(utils::crc32(check.data(), check.length()) == 0xCBF43926);
+	REQUIRE(utils::crc32c(check.data(), check.length()) == 0xE3069283);
+	REQUIRE(utils::crc32c(std::vector<char>(32, 0x00)) == 0x8A9136AA);
+	REQUIRE(utils::crc32c(std::vector<char>(32, 0xFF)) == 0x62A8AB43);
+
+	// Compare against a bitwise computation at all alignments
+	std::vector<char> data(300);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = char(i * 7 + 3);
+	}
+	for (size_t start = 0; start < 16; start++) {
+		for (size_t len = 0; start + len <= data.size(); len += 13) {
+			uint32_t ref = 0xFFFFFFFF;
+			for (size_t i = start; i < start + len; i++) {
+				ref ^= (unsigned char)data[i];
+				for (int j = 0; j < 8; j++) {
+					ref = (ref & 1) ? (0x82F63B78 ^ (ref >> 1)) : (ref >> 1);
+				}
+			}
+			uint32_t hw = utils::crc32c(&data[start], len), sw = utils::crc32cSoftware(&data[start], len);
+			REQUIRE(hw == ~ref);
+			REQUIRE(sw == ~ref);
+		}
+	}
+}
+
+TEST_CASE("utils/sha1", "utils::sha1()")
+{
+	struct inout_t {
+		std::string in;
+		std::string out;
+	} inout[] = {
+		{ "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+		{ "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+		{ std::string(1000, 'a'), "291e9a6c66994949b57ba5e650361e98fc36b1ba" }
+	};
+
+	for (unsigned int i = 0; i < NUM_INOUTS; i++) {
+		unsigned char digest[20];
+		utils::sha1(inout[i].in.data(), inout[i].in.length(), digest);
+		std::string hex;
+		for (int j = 0; j < 20; j++) {
+			hex += str::printf("%02x", digest[j]);
+		}
+		REQUIRE(hex == inout[i].out);
+	}
+}
+
+TEST_CASE("utils/lines", "utils::countNewlines() and utils::LineCounter")
+{
+	// Newlines at all offsets, mixed with bytes close to '\n'
+	std::string data;
+	for (int i = 0; i < 1000; i++) {
+		data += char(i % 13 == 0 ? '\n' : 0x09 + (i % 3) * 0x80);
+	}
+	for (size_t offset = 0; offset < 16; offset++) {
+		size_t n = utils::countNewlines(data.data() + offset, data.length() - offset);
+		REQUIRE(n == (size_t)std::count(data.begin() + offset, data.end(), '\n'));
+	}
+
+	utils::LineCounter counter;
+	std::string text = "one\ntwo\nthree";
+	for (size_t i = 0; i < text.length(); i += 2) {
+		counter.feed(text.data() + i, std::min((size_t)2, text.length() - i));
+	}
+	REQUIRE(counter.lines() == 3);
+
+	utils::LineCounter binary;
+	binary.feed("a\nb\0c\n", 6);
+	REQUIRE(binary.lines() == 0);
+	utils::LineCounter empty;
+	REQUIRE(empty.lines() == 0);
+}
+
+TEST_CASE("utils/downsample", "utils::downsample()")
+{
+	std::vector<double> keys, values;
+	for (int i = 0; i < 10000; i++) {
+		keys.push_back(i);
+		values.push_back(i % 100 == 50 ? 1000 + i : (i % 7));
+	}
+
+	std::vector<size_t> indices = utils::downsample(keys, values, 100);
+	REQUIRE(indices.size() <= 400);
+	REQUIRE(indices.front() == 0);
+	REQUIRE(indices.back() == keys.size() - 1);
+	bool ordered = true, peaks = true;
+	for (size_t i = 1; i < indices.size(); i++) {
+		ordered = ordered && (indices[i] > indices[i-1]);
+	}
+	for (int i = 50; i < 10000; i += 100) {
+		peaks = peaks && std::find(indices.begin(), indices.end(), size_t(i)) != indices.end();
+	}
+	REQUIRE(ordered);
+	REQUIRE(peaks);
+
+	// Small or unsorted data is not reduced
+	REQUIRE(utils::downsample(keys, values, 5000).size() == keys.size());
+	std::swap(keys[10], keys[20]);
+	REQUIRE(utils::downsample(keys, values, 100).size() == keys.size());
+}
+
 } // namespace test_utils
 
 #endif // TEST_UTILS_H
@@ -0,0 +1,124 @@
+/*
+ * pepper - SCM statistics report generator
+ * Copyright (C) 2010-present Jonas Gehring
+ *
+ * Released under the GNU General Public License, version 3.
+ * Please see the COPYING file in the source distribution for license
+ * terms and conditions, or see http://www.gnu.org/licenses/.
+ *
+ * file: tests/units/test_watcher.h
+ * Unit tests for waiting for new revisions
+ */
+
+
+#ifndef TEST_WATCHER_H
+#define TEST_WATCHER_H
+
+
+#include <cstdio>
+
+#include "backend.h"
+#include "options.h"
+#include "watcher.h"
+
+#include "syslib/datetime.h"
+#include "syslib/fs.h"
+#include "syslib/parallel.h"
+
+
+namespace test_watcher
+{
+
+// Backend with a head that can be moved by another thread
+class HeadBackend : public Backend
+{
+public:
+	HeadBackend(const Options &options, const std::string &dir = std::string()) : Backend(options), dir(dir), headId("a") { }
+
+	std::string name() const { return "head"; }
+	std::string uuid() { return "head"; }
+	std::string head(const std::string &) { sys::parallel::MutexLocker locker(&mutex); return headId; }
+	std::string mainBranch() { return std::string(); }
+	std::vector<std::string> branches() { return std::vector<std::string>(); }
+	std::vector<Tag> tags() { return std::vector<Tag>(); }
+	DiffstatPtr diffstat(const std::string &) { return DiffstatPtr(); }
+	std::vector<std::string> tree(const std::string &) { return std::vector<std::string>(); }
+	std::string cat(const std::string &, const std::string &) { return std::string(); }
+	LogIterator *iterator(const std::string &, int64_t, int64_t, const RevisionFilter &) { return new LogIterator(); }
+	Revision *revision(const std::string &) { return NULL; }
+	std::vector<std::string> watchPaths() { return (dir.empty() ? std::vector<std::string>() : std::vector<std::string>(1, dir)); }
+
+	void move(const std::string &id) { sys::parallel::MutexLocker locker(&mutex); headId = id; }
+
+	std::string dir;
+	std::string headId;
+	sys::parallel::Mutex mutex;
+};
+
+// Moves the head and touches a file in the watched directory after a delay
+class Committer : public sys::parallel::Thread
+{
+public:
+	Committer(HeadBackend *backend, const std::string &id, int msecs) : backend(backend), id(id), msecs(msecs) { }
+
+	void run() {
+		msleep(msecs);
+		backend->move(id);
+		if (!backend->dir.empty()) {
+			FILE *f = fopen((backend->dir + "/" + id).c_str(), "w");
+			fclose(f);
+		}
+	}
+
+	HeadBackend *backend;
+	std::string id;
+	int msecs;
+};
+
+
+TEST_CASE("watcher/poll", "Polling the head")
+{
+	Options opts;
+	HeadBackend backend(opts);
+	Watcher watcher(&backend, std::string(), 1);
+	REQUIRE(watcher.head() == "a");
+
+	backend.move("b");
+	std::string head = watcher.wait();
+	REQUIRE(head == "b");
+	REQUIRE(watcher.head() == "b");
+}
+
+TEST_CASE("watcher/watch", "Watching a directory")
+{
+	if (!sys::fs::Watch::supported()) {
+		return;
+	}
+
+	std::string dir;
+	FILE *f = sys::fs::mkstemp(&dir);
+	REQUIRE(f != NULL);
+	fclose(f);
+	sys::fs::unlink(dir);
+	sys::fs::mkdir(dir);
+
+	// Changes are noticed long before the poll interval expires
+	Options opts;
+	HeadBackend backend(opts, dir);
+	Watcher watcher(&backend, std::string(), 60);
+	Committer committer(&backend, "b", 50);
+	sys::datetime::Watch watch;
+	committer.start();
+	std::string head = watcher.wait();
+	int elapsed = watch.elapsedMSecs();
+	REQUIRE(head == "b");
+	REQUIRE(elapsed < 10000);
+	committer.wait();
+
+	sys::fs::unlinkr(dir);
+}
+
+} // namespace test_watcher
+
+
+#endif // TEST_WATCHER_H